@@ -0,0 +1,577 @@
+#include "bench_client.h"
+#include "mount/mount_types.h"
+#include "rpc/rpc_types.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Largest reply record accepted (RFC 5531 §11 puts no limit on it)
+static constexpr size_t kMaxRecord = 16 * 1024 * 1024;
+
+RpcConnection::~RpcConnection() {
+    close();
+}
+
+bool RpcConnection::connect(const std::string& host, uint16_t port, std::string& err) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    int rc = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res);
+    if (rc != 0) {
+        err = host + ": " + gai_strerror(rc);
+        return false;
+    }
+    err = "no address";
+    for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fd_ = fd;
+            break;
+        }
+        err = std::strerror(errno);
+        ::close(fd);
+    }
+    freeaddrinfo(res);
+    return fd_ >= 0;
+}
+
+void RpcConnection::close() {
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+}
+
+void RpcConnection::set_auth_sys(const std::string& machine, uint32_t uid, uint32_t gid) {
+    // RFC 5531 §A.1 - authsys_parms: stamp, machinename, uid, gid, gids<16>
+    XdrEncoder body;
+    body.encode_uint32(0);
+    body.encode_string(machine);
+    body.encode_uint32(uid);
+    body.encode_uint32(gid);
+    body.encode_uint32(0);
+
+    XdrEncoder cred;
+    cred.encode_uint32(static_cast<uint32_t>(RpcAuthFlavor::AUTH_SYS));
+    cred.encode_opaque(body.data().data(), body.size());
+    cred.encode_uint32(static_cast<uint32_t>(RpcAuthFlavor::AUTH_NONE));  // verifier
+    cred.encode_uint32(0);
+    cred_.assign(cred.data().begin(), cred.data().end());
+}
+
+uint32_t RpcConnection::queue_call(uint32_t prog, uint32_t vers, uint32_t proc,
+                                   const XdrEncoder& args) {
+    // RFC 5531 §9 - call_body
+    uint32_t xid = next_xid_++;
+    XdrEncoder hdr;
+    hdr.encode_uint32(xid);
+    hdr.encode_uint32(static_cast<uint32_t>(RpcMsgType::CALL));
+    hdr.encode_uint32(2);  // rpcvers
+    hdr.encode_uint32(prog);
+    hdr.encode_uint32(vers);
+    hdr.encode_uint32(proc);
+
+    size_t len = hdr.size() + cred_.size() + args.size();
+    uint32_t mark = htonl(static_cast<uint32_t>(len) | 0x80000000u);
+    const uint8_t* m = reinterpret_cast<const uint8_t*>(&mark);
+    out_.insert(out_.end(), m, m + 4);
+    out_.insert(out_.end(), hdr.data().begin(), hdr.data().end());
+    out_.insert(out_.end(), cred_.begin(), cred_.end());
+    out_.insert(out_.end(), args.data().begin(), args.data().end());
+    return xid;
+}
+
+void RpcConnection::queue_record(const uint8_t* data, size_t len) {
+    uint32_t mark = htonl(static_cast<uint32_t>(len) | 0x80000000u);
+    const uint8_t* m = reinterpret_cast<const uint8_t*>(&mark);
+    out_.insert(out_.end(), m, m + 4);
+    out_.insert(out_.end(), data, data + len);
+}
+
+void RpcConnection::queue_reply(uint32_t xid, const XdrEncoder& result) {
+    // RFC 5531 §9 - accepted_reply with an AUTH_NONE verifier
+    XdrEncoder msg;
+    msg.encode_uint32(xid);
+    msg.encode_uint32(static_cast<uint32_t>(RpcMsgType::REPLY));
+    msg.encode_uint32(static_cast<uint32_t>(RpcReplyStatus::MSG_ACCEPTED));
+    msg.encode_uint32(static_cast<uint32_t>(RpcAuthFlavor::AUTH_NONE));
+    msg.encode_uint32(0);
+    msg.encode_uint32(static_cast<uint32_t>(RpcAcceptStatus::SUCCESS));
+    msg.encode_opaque_fixed(result.data().data(), result.size());
+    queue_record(msg.data().data(), msg.size());
+}
+
+bool RpcConnection::flush() {
+    while (out_off_ < out_.size()) {
+        ssize_t n = send(fd_, out_.data() + out_off_, out_.size() - out_off_, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        out_off_ += static_cast<size_t>(n);
+        bytes_sent_ += static_cast<uint64_t>(n);
+    }
+    if (out_off_ == out_.size()) {
+        out_.clear();
+        out_off_ = 0;
+    }
+    return true;
+}
+
+static bool parse_reply(const uint8_t* data, size_t len, RpcReply& r) {
+    // RFC 5531 §9 - reply_body; accepted replies carry a verifier first
+    try {
+        XdrDecoder dec(data, len);
+        r.xid = dec.decode_uint32();
+        if (dec.decode_uint32() != static_cast<uint32_t>(RpcMsgType::REPLY)) return false;
+        r.accepted = dec.decode_uint32() == static_cast<uint32_t>(RpcReplyStatus::MSG_ACCEPTED);
+        if (r.accepted) {
+            dec.decode_uint32();  // verifier flavor
+            dec.decode_opaque();
+            r.accept_stat = dec.decode_uint32();
+        }
+        r.body = dec.current();
+        r.body_len = dec.remaining();
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+static bool parse_call(const uint8_t* data, size_t len, RpcIncomingCall& c) {
+    // RFC 5531 §9 - call_body; the credential and verifier are not checked
+    try {
+        XdrDecoder dec(data, len);
+        c.xid = dec.decode_uint32();
+        dec.decode_uint32();  // CALL
+        if (dec.decode_uint32() != 2) return false;
+        c.prog = dec.decode_uint32();
+        c.vers = dec.decode_uint32();
+        c.proc = dec.decode_uint32();
+        dec.decode_uint32();
+        dec.decode_opaque();
+        dec.decode_uint32();
+        dec.decode_opaque();
+        c.body = dec.current();
+        c.body_len = dec.remaining();
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+bool RpcConnection::receive(const std::function<void(const RpcReply&)>& on_reply,
+                            const std::function<void(const RpcIncomingCall&)>& on_call) {
+    uint8_t buf[64 * 1024];
+    for (;;) {
+        ssize_t n = recv(fd_, buf, sizeof(buf), 0);
+        if (n == 0) return false;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        bytes_received_ += static_cast<uint64_t>(n);
+        in_.insert(in_.end(), buf, buf + n);
+        if (static_cast<size_t>(n) < sizeof(buf)) break;
+    }
+
+    // RFC 5531 §11 - record marking: reassemble fragments into records
+    size_t pos = 0;
+    while (in_.size() - pos >= 4) {
+        uint32_t mark = (static_cast<uint32_t>(in_[pos]) << 24) |
+                        (static_cast<uint32_t>(in_[pos + 1]) << 16) |
+                        (static_cast<uint32_t>(in_[pos + 2]) << 8) | in_[pos + 3];
+        size_t frag_len = mark & 0x7FFFFFFFu;
+        if (record_.size() + frag_len > kMaxRecord) return false;
+        if (in_.size() - pos - 4 < frag_len) break;
+        const uint8_t* frag = in_.data() + pos + 4;
+        pos += 4 + frag_len;
+
+        const uint8_t* rec = frag;
+        size_t rec_len = frag_len;
+        if (!(mark & 0x80000000u)) {
+            record_.insert(record_.end(), frag, frag + frag_len);
+            continue;
+        }
+        if (!record_.empty()) {
+            record_.insert(record_.end(), frag, frag + frag_len);
+            rec = record_.data();
+            rec_len = record_.size();
+        }
+        bool is_call = rec_len >= 8 && rec[4] == 0 && rec[5] == 0 && rec[6] == 0 &&
+                       rec[7] == static_cast<uint8_t>(RpcMsgType::CALL);
+        if (is_call) {
+            RpcIncomingCall call;
+            if (!on_call || !parse_call(rec, rec_len, call)) return false;
+            on_call(call);
+        } else {
+            RpcReply reply;
+            if (!parse_reply(rec, rec_len, reply)) return false;
+            on_reply(reply);
+        }
+        record_.clear();
+    }
+    in_.erase(in_.begin(), in_.begin() + static_cast<std::ptrdiff_t>(pos));
+    return true;
+}
+
+bool RpcConnection::call(uint32_t prog, uint32_t vers, uint32_t proc, const XdrEncoder& args,
+                         std::vector<uint8_t>& body, int timeout_ms) {
+    uint32_t xid = queue_call(prog, vers, proc, args);
+    bool done = false, ok = false;
+    auto on_reply = [&](const RpcReply& r) {
+        if (r.xid != xid) return;
+        done = true;
+        ok = r.accepted && r.accept_stat == static_cast<uint32_t>(RpcAcceptStatus::SUCCESS);
+        body.assign(r.body, r.body + r.body_len);
+    };
+    while (!done) {
+        if (!flush()) return false;
+        pollfd pfd{fd_, static_cast<short>(POLLIN | (want_write() ? POLLOUT : 0)), 0};
+        int rc = poll(&pfd, 1, timeout_ms);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) return false;
+        if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) && !receive(on_reply)) return done && ok;
+    }
+    return ok;
+}
+
+// --- NFSv3 / MOUNT3 ---
+
+void encode_fh3(XdrEncoder& enc, const FileHandle& fh) {
+    enc.encode_opaque(fh.data(), fh.size());
+}
+
+void encode_sattr3_mode(XdrEncoder& enc, uint32_t mode) {
+    // RFC 1813 §2.6 - sattr3: set_mode3 then five unset fields
+    enc.encode_bool(true);
+    enc.encode_uint32(mode);
+    enc.encode_bool(false);  // uid
+    enc.encode_bool(false);  // gid
+    enc.encode_bool(false);  // size
+    enc.encode_uint32(0);    // atime: DONT_CHANGE
+    enc.encode_uint32(0);    // mtime: DONT_CHANGE
+}
+
+void skip_fattr3(XdrDecoder& dec) {
+    // RFC 1813 §2.6 - fattr3 is fixed size: 21 XDR words
+    dec.skip(21 * 4);
+}
+
+void skip_post_op_attr(XdrDecoder& dec) {
+    if (dec.decode_bool()) skip_fattr3(dec);
+}
+
+void skip_wcc_data(XdrDecoder& dec) {
+    // pre_op_attr: wcc_attr is size, mtime, ctime
+    if (dec.decode_bool()) dec.skip(6 * 4);
+    skip_post_op_attr(dec);
+}
+
+static void decode_fh(XdrDecoder& dec, FileHandle& fh) {
+    auto bytes = dec.decode_opaque();
+    fh = FileHandle(bytes.data(), bytes.size());
+}
+
+bool decode_mnt_reply(const uint8_t* body, size_t len, FileHandle& fh) {
+    try {
+        XdrDecoder dec(body, len);
+        if (dec.decode_uint32() != static_cast<uint32_t>(MountStat3::MNT3_OK)) return false;
+        decode_fh(dec, fh);
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+NfsStat3 decode_status(const uint8_t* body, size_t len) {
+    if (len < 4) return NfsStat3::NFS3ERR_SERVERFAULT;
+    XdrDecoder dec(body, len);
+    return static_cast<NfsStat3>(dec.decode_uint32());
+}
+
+NfsStat3 decode_lookup_reply(const uint8_t* body, size_t len, FileHandle& fh,
+                             Ftype3* type) {
+    try {
+        XdrDecoder dec(body, len);
+        auto status = static_cast<NfsStat3>(dec.decode_uint32());
+        if (status != NfsStat3::NFS3_OK) return status;
+        decode_fh(dec, fh);
+        // obj_attributes: post_op_attr, fattr3 starting with ftype3
+        if (type && dec.decode_bool()) *type = static_cast<Ftype3>(dec.decode_uint32());
+        return status;
+    } catch (const std::exception&) {
+        return NfsStat3::NFS3ERR_SERVERFAULT;
+    }
+}
+
+NfsStat3 decode_create_reply(const uint8_t* body, size_t len, FileHandle& fh) {
+    try {
+        XdrDecoder dec(body, len);
+        auto status = static_cast<NfsStat3>(dec.decode_uint32());
+        // post_op_fh3: the server may leave the handle out
+        if (status == NfsStat3::NFS3_OK && dec.decode_bool()) decode_fh(dec, fh);
+        return status;
+    } catch (const std::exception&) {
+        return NfsStat3::NFS3ERR_SERVERFAULT;
+    }
+}
+
+NfsStat3 decode_read_reply(const uint8_t* body, size_t len, uint32_t& count, bool& eof) {
+    try {
+        XdrDecoder dec(body, len);
+        auto status = static_cast<NfsStat3>(dec.decode_uint32());
+        skip_post_op_attr(dec);
+        if (status == NfsStat3::NFS3_OK) {
+            count = dec.decode_uint32();
+            eof = dec.decode_bool();
+        }
+        return status;
+    } catch (const std::exception&) {
+        return NfsStat3::NFS3ERR_SERVERFAULT;
+    }
+}
+
+NfsStat3 decode_readdirplus_reply(const uint8_t* body, size_t len, ReaddirplusPage& page,
+                                  std::vector<std::string>* names) {
+    try {
+        // RFC 1813 §3.3.17 - READDIRPLUS3resok
+        XdrDecoder dec(body, len);
+        auto status = static_cast<NfsStat3>(dec.decode_uint32());
+        skip_post_op_attr(dec);
+        if (status != NfsStat3::NFS3_OK) return status;
+        page.cookieverf = dec.decode_uint64();
+        page.entries = 0;
+        while (dec.decode_bool()) {
+            dec.decode_uint64();  // fileid
+            uint32_t name_len = dec.decode_uint32();
+            if (names) names->emplace_back(reinterpret_cast<const char*>(dec.current()),
+                                           std::min<size_t>(name_len, dec.remaining()));
+            dec.skip((name_len + 3) & ~3u);
+            page.last_cookie = dec.decode_uint64();
+            skip_post_op_attr(dec);
+            if (dec.decode_bool()) dec.decode_opaque();  // post_op_fh3
+            page.entries++;
+        }
+        page.eof = dec.decode_bool();
+        return status;
+    } catch (const std::exception&) {
+        return NfsStat3::NFS3ERR_SERVERFAULT;
+    }
+}
+
+NfsStat3 decode_readdir_reply(const uint8_t* body, size_t len, ReaddirplusPage& page,
+                              std::vector<std::string>* names) {
+    try {
+        // RFC 1813 §3.3.16 - READDIR3resok
+        XdrDecoder dec(body, len);
+        auto status = static_cast<NfsStat3>(dec.decode_uint32());
+        skip_post_op_attr(dec);
+        if (status != NfsStat3::NFS3_OK) return status;
+        page.cookieverf = dec.decode_uint64();
+        page.entries = 0;
+        while (dec.decode_bool()) {
+            dec.decode_uint64();  // fileid
+            uint32_t name_len = dec.decode_uint32();
+            if (names) names->emplace_back(reinterpret_cast<const char*>(dec.current()),
+                                           std::min<size_t>(name_len, dec.remaining()));
+            dec.skip((name_len + 3) & ~3u);
+            page.last_cookie = dec.decode_uint64();
+            page.entries++;
+        }
+        page.eof = dec.decode_bool();
+        return status;
+    } catch (const std::exception&) {
+        return NfsStat3::NFS3ERR_SERVERFAULT;
+    }
+}
+
+// --- NFSv4.1 ---
+
+XdrEncoder& Compound4::op(Nfs4Op op) {
+    ops_.encode_uint32(static_cast<uint32_t>(op));
+    count_++;
+    return ops_;
+}
+
+void Compound4::encode(XdrEncoder& args) const {
+    // RFC 8881 §16.2.1 - COMPOUND4args: tag, minorversion, argarray
+    args.encode_string("");
+    args.encode_uint32(minorversion_);
+    args.encode_uint32(count_);
+    args.encode_opaque_fixed(ops_.data().data(), ops_.size());
+}
+
+Compound4Reply::Compound4Reply(const uint8_t* body, size_t len) : dec_(body, len) {
+    // COMPOUND4res: status, tag, resarray
+    status_ = static_cast<Nfs4Stat>(dec_.decode_uint32());
+    dec_.decode_opaque();
+    remaining_ = dec_.decode_uint32();
+}
+
+bool Compound4Reply::next(uint32_t& op, Nfs4Stat& status) {
+    if (remaining_ == 0) return false;
+    remaining_--;
+    op = dec_.decode_uint32();
+    status = static_cast<Nfs4Stat>(dec_.decode_uint32());
+    return true;
+}
+
+void encode_stateid4(XdrEncoder& enc, const Nfs4StateId& sid) {
+    enc.encode_uint32(sid.seqid);
+    enc.encode_opaque_fixed(sid.other, 12);
+}
+
+void decode_stateid4(XdrDecoder& dec, Nfs4StateId& sid) {
+    sid.seqid = dec.decode_uint32();
+    dec.decode_opaque_fixed(sid.other, 12);
+}
+
+void encode_fh4(XdrEncoder& enc, const FileHandle& fh) {
+    enc.encode_opaque(fh.data(), fh.size());
+}
+
+void decode_fh4(XdrDecoder& dec, FileHandle& fh) {
+    decode_fh(dec, fh);
+}
+
+void encode_bitmap4(XdrEncoder& enc, std::initializer_list<uint32_t> attrs) {
+    std::vector<uint32_t> words;
+    for (uint32_t a : attrs) {
+        if (words.size() <= a / 32) words.resize(a / 32 + 1);
+        words[a / 32] |= 1u << (a % 32);
+    }
+    enc.encode_uint32(static_cast<uint32_t>(words.size()));
+    for (uint32_t w : words) enc.encode_uint32(w);
+}
+
+void skip_fattr4(XdrDecoder& dec) {
+    uint32_t words = dec.decode_uint32();
+    dec.skip(static_cast<size_t>(words) * 4);
+    dec.decode_opaque();  // attr_vals
+}
+
+void encode_sequence4(XdrEncoder& enc, const SessionId41& sid, uint32_t seqid,
+                      uint32_t slotid, uint32_t highest_slotid) {
+    enc.encode_opaque_fixed(sid.data(), sid.size());
+    enc.encode_uint32(seqid);
+    enc.encode_uint32(slotid);
+    enc.encode_uint32(highest_slotid);
+    enc.encode_bool(false);
+}
+
+void skip_sequence4_result(XdrDecoder& dec) {
+    // sessionid, sequenceid, slotid, highest_slotid, target_highest_slotid,
+    // status_flags
+    dec.skip(16 + 5 * 4);
+}
+
+static void skip_nfsace4(XdrDecoder& dec) {
+    dec.skip(3 * 4);  // type, flag, access_mask
+    dec.decode_opaque();  // who
+}
+
+void decode_open4_result(XdrDecoder& dec, Open4Result& out) {
+    decode_stateid4(dec, out.stateid);
+    dec.skip(4 + 2 * 8);  // change_info4
+    dec.decode_uint32();  // rflags
+    uint32_t words = dec.decode_uint32();  // attrset
+    dec.skip(static_cast<size_t>(words) * 4);
+
+    // open_delegation4
+    out.deleg_type = dec.decode_uint32();
+    if (out.deleg_type == OPEN_DELEGATE_READ || out.deleg_type == OPEN_DELEGATE_WRITE) {
+        decode_stateid4(dec, out.deleg_stateid);
+        dec.decode_bool();  // recall
+        if (out.deleg_type == OPEN_DELEGATE_WRITE) {
+            // nfs_space_limit4: a size, or blocks and block size
+            if (dec.decode_uint32() == NFS_LIMIT_SIZE) dec.skip(8);
+            else dec.skip(2 * 4);
+        }
+        skip_nfsace4(dec);
+    }
+}
+
+void decode_readdir4_result(XdrDecoder& dec, Readdir4Page& page) {
+    page.cookieverf = dec.decode_uint64();
+    while (dec.decode_bool()) {
+        page.last_cookie = dec.decode_uint64();
+        dec.decode_opaque();  // name
+        skip_fattr4(dec);
+        page.entries++;
+    }
+    page.eof = dec.decode_bool();
+}
+
+// --- Shared by the load generators ---
+
+bool parse_size(const char* s, uint64_t& out) {
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long v = std::strtoull(s, &end, 10);
+    if (errno || end == s) return false;
+    switch (*end) {
+        case 'K': case 'k': v <<= 10; end++; break;
+        case 'M': case 'm': v <<= 20; end++; break;
+        case 'G': case 'g': v <<= 30; end++; break;
+        default: break;
+    }
+    out = v;
+    return *end == '\0';
+}
+
+void raise_fd_limit() {
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+bool make_fault_vfs(const char* prog, LocalFs& fs, const std::string& export_dir,
+                    const std::vector<std::string>& specs, std::unique_ptr<FaultVfs>& out) {
+    out.reset();
+    if (specs.empty()) return true;
+    out = std::make_unique<FaultVfs>(fs);
+    for (const auto& spec : specs) {
+        FaultRule rule;
+        std::string err;
+        if (!FaultRule::parse(spec, rule, err)) {
+            std::fprintf(stderr, "%s: bad --fault %s: %s\n", prog, spec.c_str(), err.c_str());
+            return false;
+        }
+        out->add_rule(rule);
+    }
+    out->set_path_resolver([&fs, export_dir](const FileHandle& fh) {
+        std::string path = fs.path_of(fh);
+        if (path.compare(0, export_dir.size(), export_dir) != 0) return std::string();
+        path.erase(0, export_dir.size());
+        return path.empty() ? std::string("/") : path;
+    });
+    return true;
+}
+
+void write_latency_json(FILE* out, const LatencySnapshot& s) {
+    auto us = [](uint64_t ns) { return ns / 1000.0; };
+    std::fprintf(out,
+                 "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, "
+                 "\"p999_us\": %.1f, \"max_us\": %.1f",
+                 s.mean_ns() / 1000.0, us(s.percentile(0.50)), us(s.percentile(0.90)),
+                 us(s.percentile(0.99)), us(s.percentile(0.999)), us(s.max_ns));
+}
+
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "nfs/nfs_types.h"
+#include "nfs4/nfs4_types.h"
+#include "stats/latency_stats.h"
+#include "vfs/fault_vfs.h"
+#include "vfs/local_fs.h"
+#include "vfs/vfs.h"
+#include "xdr/xdr_codec.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Client side of ONC RPC over TCP for the load generators: one connection,
+// any number of calls in flight. Calls are framed into an output buffer and
+// written when the socket has room; replies are matched by xid.
+
+// One reply as it comes off the wire (RFC 5531 §9). body points into the
+// connection's input buffer and is valid only inside the callback.
+struct RpcReply {
+    uint32_t xid = 0;
+    bool accepted = false;     // MSG_ACCEPTED (otherwise MSG_DENIED)
+    uint32_t accept_stat = 0;  // RpcAcceptStatus; SUCCESS = 0
+    const uint8_t* body = nullptr;
+    size_t body_len = 0;
+};
+
+// A call the server sent us on this connection: an NFSv4.1 backchannel
+// request (RFC 8881 §2.10.3.1). body is valid only inside the callback.
+struct RpcIncomingCall {
+    uint32_t xid = 0;
+    uint32_t prog = 0;
+    uint32_t vers = 0;
+    uint32_t proc = 0;
+    const uint8_t* body = nullptr;
+    size_t body_len = 0;
+};
+
+class RpcConnection {
+public:
+    RpcConnection() = default;
+    ~RpcConnection();
+
+    RpcConnection(const RpcConnection&) = delete;
+    RpcConnection& operator=(const RpcConnection&) = delete;
+
+    // Blocking connect (TCP_NODELAY), then non-blocking for the event loop.
+    // False with err set on failure.
+    bool connect(const std::string& host, uint16_t port, std::string& err);
+    void close();
+    int fd() const { return fd_; }
+
+    // AUTH_SYS credential (RFC 5531 §A.1) sent with every later call;
+    // the default is AUTH_NONE
+    void set_auth_sys(const std::string& machine, uint32_t uid, uint32_t gid);
+
+    // Frame a call into the output buffer; returns its xid
+    uint32_t queue_call(uint32_t prog, uint32_t vers, uint32_t proc, const XdrEncoder& args);
+    // Frame a prebuilt RPC message (header included) as one record
+    void queue_record(const uint8_t* data, size_t len);
+    // Frame an accepted, successful reply to an incoming call
+    void queue_reply(uint32_t xid, const XdrEncoder& result);
+
+    bool want_write() const { return out_off_ < out_.size(); }
+    size_t queued_bytes() const { return out_.size() - out_off_; }
+
+    // Write what the socket accepts; false on a socket error
+    bool flush();
+    // Read what is available and hand each complete reply to on_reply and
+    // each incoming call to on_call; false on EOF, a socket or framing
+    // error, or a call with no on_call
+    bool receive(const std::function<void(const RpcReply&)>& on_reply,
+                 const std::function<void(const RpcIncomingCall&)>& on_call = nullptr);
+
+    // Round trip for setup code: send one call and wait (blocking) for its
+    // reply. Fails on any RPC-level error; body gets the procedure result.
+    bool call(uint32_t prog, uint32_t vers, uint32_t proc, const XdrEncoder& args,
+              std::vector<uint8_t>& body, int timeout_ms = 10000);
+
+    uint64_t bytes_sent() const { return bytes_sent_; }
+    uint64_t bytes_received() const { return bytes_received_; }
+
+private:
+    int fd_ = -1;
+    uint32_t next_xid_ = 1;
+    std::vector<uint8_t> cred_ = {0, 0, 0, 0, 0, 0, 0, 0};  // AUTH_NONE
+
+    std::vector<uint8_t> out_;
+    size_t out_off_ = 0;
+    std::vector<uint8_t> in_;
+    std::vector<uint8_t> record_;  // fragments of the record being reassembled
+
+    uint64_t bytes_sent_ = 0;
+    uint64_t bytes_received_ = 0;
+};
+
+// --- NFSv3 / MOUNT3 (RFC 1813) ---
+
+// nfs_fh3 argument
+void encode_fh3(XdrEncoder& enc, const FileHandle& fh);
+// sattr3 with only the mode set
+void encode_sattr3_mode(XdrEncoder& enc, uint32_t mode);
+
+// Skip the optional attributes in a result
+void skip_fattr3(XdrDecoder& dec);
+void skip_post_op_attr(XdrDecoder& dec);
+void skip_wcc_data(XdrDecoder& dec);
+
+// MOUNTPROC3_MNT result: the export's root handle (false unless MNT3_OK)
+bool decode_mnt_reply(const uint8_t* body, size_t len, FileHandle& fh);
+
+// LOOKUP, CREATE and MKDIR results: status and, when OK, the object handle
+// (and for LOOKUP its type, if the attributes came back)
+NfsStat3 decode_lookup_reply(const uint8_t* body, size_t len, FileHandle& fh,
+                             Ftype3* type = nullptr);
+NfsStat3 decode_create_reply(const uint8_t* body, size_t len, FileHandle& fh);
+
+// Just the nfsstat3 at the start of any result
+NfsStat3 decode_status(const uint8_t* body, size_t len);
+
+// READ result: bytes returned and EOF
+NfsStat3 decode_read_reply(const uint8_t* body, size_t len, uint32_t& count, bool& eof);
+
+// READDIRPLUS result, entries counted and their names optionally collected
+struct ReaddirplusPage {
+    uint64_t cookieverf = 0;
+    uint64_t last_cookie = 0;
+    uint32_t entries = 0;
+    bool eof = false;
+};
+NfsStat3 decode_readdirplus_reply(const uint8_t* body, size_t len, ReaddirplusPage& page,
+                                  std::vector<std::string>* names = nullptr);
+// READDIR result, summarized the same way
+NfsStat3 decode_readdir_reply(const uint8_t* body, size_t len, ReaddirplusPage& page,
+                              std::vector<std::string>* names = nullptr);
+
+// --- NFSv4.1 (RFC 8881) ---
+
+// COMPOUND4args built one op at a time
+class Compound4 {
+public:
+    explicit Compound4(uint32_t minorversion = 1) : minorversion_(minorversion) {}
+
+    // Start an op; its arguments go into the returned encoder
+    XdrEncoder& op(Nfs4Op op);
+    uint32_t count() const { return count_; }
+    // tag, minorversion and the ops
+    void encode(XdrEncoder& args) const;
+
+private:
+    uint32_t minorversion_;
+    uint32_t count_ = 0;
+    XdrEncoder ops_;
+};
+
+// COMPOUND4res read one op result at a time. The decoder throws if the
+// reply is short.
+class Compound4Reply {
+public:
+    Compound4Reply(const uint8_t* body, size_t len);
+
+    Nfs4Stat status() const { return status_; }
+    // The next result's op and status; false after the last. An OK
+    // result's body is then read from dec().
+    bool next(uint32_t& op, Nfs4Stat& status);
+    XdrDecoder& dec() { return dec_; }
+
+private:
+    XdrDecoder dec_;
+    Nfs4Stat status_ = Nfs4Stat::NFS4_OK;
+    uint32_t remaining_ = 0;
+};
+
+void encode_stateid4(XdrEncoder& enc, const Nfs4StateId& sid);
+void decode_stateid4(XdrDecoder& dec, Nfs4StateId& sid);
+void encode_fh4(XdrEncoder& enc, const FileHandle& fh);
+void decode_fh4(XdrDecoder& dec, FileHandle& fh);
+// bitmap4 with the given attribute numbers set
+void encode_bitmap4(XdrEncoder& enc, std::initializer_list<uint32_t> attrs);
+// fattr4: bitmap and attribute values
+void skip_fattr4(XdrDecoder& dec);
+
+// SEQUENCE4args (§18.46); sa_cachethis is false
+void encode_sequence4(XdrEncoder& enc, const SessionId41& sid, uint32_t seqid,
+                      uint32_t slotid, uint32_t highest_slotid);
+void skip_sequence4_result(XdrDecoder& dec);
+
+// OPEN4resok (§18.16): the open stateid and the delegation granted, if any
+struct Open4Result {
+    Nfs4StateId stateid;
+    uint32_t deleg_type = OPEN_DELEGATE_NONE;
+    Nfs4StateId deleg_stateid;
+};
+void decode_open4_result(XdrDecoder& dec, Open4Result& out);
+
+// READDIR4resok (§18.23): entries counted, their attributes skipped
+struct Readdir4Page {
+    uint64_t cookieverf = 0;
+    uint64_t last_cookie = 0;
+    uint32_t entries = 0;
+    bool eof = false;
+};
+void decode_readdir4_result(XdrDecoder& dec, Readdir4Page& page);
+
+// --- Shared by the load generators ---
+
+// Byte count with an optional K, M or G suffix
+bool parse_size(const char* s, uint64_t& out);
+
+// Thousands of connections need more descriptors than the usual soft limit
+void raise_fd_limit();
+
+inline uint64_t xorshift(uint64_t& s) {
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return s;
+}
+
+// --fault rules (vfs/fault_vfs.h) for an in-process server: a FaultVfs
+// over fs with paths relative to export_dir, or null when specs is empty.
+// False, after printing why, if a rule does not parse.
+bool make_fault_vfs(const char* prog, LocalFs& fs, const std::string& export_dir,
+                    const std::vector<std::string>& specs, std::unique_ptr<FaultVfs>& out);
+
+// "mean_us": ..., "p50_us": ... "max_us": ... (no braces)
+void write_latency_json(FILE* out, const LatencySnapshot& s);
+
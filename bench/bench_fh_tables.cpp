@@ -0,0 +1,191 @@
+// Memory and lookup cost of the handle-keyed state tables.
+//
+//   sizes   — bytes of FileHandle and of the entries that embed one
+//   table   — ByteRangeLockTable with --files files, one lock each: heap
+//             bytes per held lock, then LOCKT-style test() on random files
+//   nfs4    — Nfs4StateManager with --opens files open by one client: heap
+//             bytes per open, then OPENs of already open files,
+//             which find the client's open state among all of them
+//
+// Lookups report ns/op and, where the kernel exposes hardware counters
+// (perf_event_open(2)), last-level cache misses per op.
+//
+// Usage: bench_fh_tables [--files N] [--opens N] [--lookups N]
+
+#include "locking/lock_table.h"
+#include "nfs4/nfs4_state.h"
+
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static FileHandle make_fh(uint32_t n) {
+    uint8_t data[16] = {0xfb, static_cast<uint8_t>(n), static_cast<uint8_t>(n >> 8),
+                        static_cast<uint8_t>(n >> 16), static_cast<uint8_t>(n >> 24)};
+    return FileHandle(data, sizeof(data));
+}
+
+static uint64_t xorshift(uint64_t& s) {
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return s;
+}
+
+// Heap bytes in use (glibc), large mmap()ed blocks included: unlike the
+// resident set, it also counts memory a freed table left for reuse
+static uint64_t heap_bytes() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+// Cache misses of this thread in user space; reads -1 where the kernel
+// has no hardware counters (most VMs and containers)
+class CacheMisses {
+public:
+    CacheMisses() {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+    ~CacheMisses() {
+        if (fd_ >= 0) close(fd_);
+    }
+    int64_t read_count() const {
+        uint64_t v = 0;
+        if (fd_ < 0 || read(fd_, &v, sizeof(v)) != sizeof(v)) return -1;
+        return static_cast<int64_t>(v);
+    }
+
+private:
+    int fd_ = -1;
+};
+
+struct Lookup {
+    double ns_per_op = 0;
+    double misses_per_op = -1;
+};
+
+template <typename F>
+static Lookup measure(long ops, F&& fn) {
+    CacheMisses misses;
+    int64_t m0 = misses.read_count();
+    auto start = Clock::now();
+    for (long i = 0; i < ops; i++) fn();
+    auto end = Clock::now();
+    int64_t m1 = misses.read_count();
+    Lookup r;
+    r.ns_per_op = std::chrono::duration<double, std::nano>(end - start).count() / ops;
+    if (m0 >= 0 && m1 >= 0) r.misses_per_op = static_cast<double>(m1 - m0) / ops;
+    return r;
+}
+
+static void report(const char* table, uint32_t entries, double bytes_per_entry,
+                   const char* lookup, const Lookup& r) {
+    char misses[32] = "n/a";
+    if (r.misses_per_op >= 0) std::snprintf(misses, sizeof(misses), "%.2f", r.misses_per_op);
+    std::printf("%-6s %9u %10.0f   %-14s %10.1f %12s\n", table, entries, bytes_per_entry,
+                lookup, r.ns_per_op, misses);
+    std::fflush(stdout);
+}
+
+static void run_table(uint32_t files, long lookups) {
+    std::vector<FileHandle> fhs;
+    fhs.reserve(files);
+    for (uint32_t i = 0; i < files; i++) fhs.push_back(make_fh(i));
+
+    uint64_t before = heap_bytes();
+    auto table = std::make_unique<ByteRangeLockTable>();
+    for (uint32_t i = 0; i < files; i++) {
+        LockConflict conflict;
+        table->acquire(fhs[i], "bench:" + std::to_string(i), true, 0, 4096, conflict);
+    }
+    double per_lock = static_cast<double>(heap_bytes() - before) / files;
+
+    // A range nobody holds: every test() finds the file and walks its locks
+    uint64_t rng = 0x9e3779b97f4a7c15ull;
+    LockConflict conflict;
+    Lookup r = measure(lookups, [&] {
+        const FileHandle& fh = fhs[xorshift(rng) % files];
+        table->test(fh, "reader", true, 8192, 4096, conflict);
+    });
+    report("table", files, per_lock, "test", r);
+}
+
+static void run_nfs4(uint32_t opens, long lookups) {
+    std::vector<FileHandle> fhs;
+    fhs.reserve(opens);
+    for (uint32_t i = 0; i < opens; i++) fhs.push_back(make_fh(i));
+
+    auto mgr = std::make_unique<Nfs4StateManager>();
+    mgr->end_grace_period();
+    uint8_t verifier[8] = {1};
+    auto [clientid, seq] = mgr->exchange_id41(verifier, "bench-fh");
+    SessionId41 sid;
+    mgr->create_session41(clientid, seq, sid);
+    const std::vector<uint8_t> owner = {'o', 'w', 'n', 'e', 'r'};
+
+    auto open = [&](const FileHandle& fh) {
+        Nfs4StateId open_sid, deleg_sid, recall_sid;
+        bool needs_confirm = false;
+        uint32_t deleg_type = OPEN_DELEGATE_NONE;
+        Nfs4CallbackInfo recall_cb;
+        FileHandle recall_fh;
+        mgr->open_file(clientid, owner, 0, fh, OPEN4_SHARE_ACCESS_READ, OPEN4_SHARE_DENY_NONE,
+                       open_sid, needs_confirm, deleg_type, deleg_sid, recall_cb, recall_sid,
+                       recall_fh, false);
+        return open_sid;
+    };
+
+    uint64_t before = heap_bytes();
+    for (uint32_t i = 0; i < opens; i++) mgr->auto_confirm_open(open(fhs[i]));
+    double per_open = static_cast<double>(heap_bytes() - before) / opens;
+
+    uint64_t rng = 0x2545f4914f6cdd1dull;
+    Lookup r = measure(lookups, [&] { open(fhs[xorshift(rng) % opens]); });
+    report("nfs4", opens, per_open, "reopen", r);
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t files = 200000;
+    uint32_t opens = 20000;
+    long lookups = 200000;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--files" && i + 1 < argc)
+            files = static_cast<uint32_t>(std::max(1, std::atoi(argv[++i])));
+        else if (arg == "--opens" && i + 1 < argc)
+            opens = static_cast<uint32_t>(std::max(1, std::atoi(argv[++i])));
+        else if (arg == "--lookups" && i + 1 < argc)
+            lookups = std::max(1L, std::atol(argv[++i]));
+        else {
+            std::fprintf(stderr, "unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    std::printf("sizeof: FileHandle %zu, LockEntry %zu, Nfs4OpenState %zu, "
+                "Nfs4LockState %zu, Nfs4DelegState %zu\n",
+                sizeof(FileHandle), sizeof(LockEntry), sizeof(Nfs4OpenState),
+                sizeof(Nfs4LockState), sizeof(Nfs4DelegState));
+    std::printf("%-6s %9s %10s   %-14s %10s %12s\n", "table", "entries", "bytes/entry",
+                "lookup", "ns/op", "misses/op");
+    run_table(files, lookups);
+    run_nfs4(opens, lookups / 10);
+    return 0;
+}
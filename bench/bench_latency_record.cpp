@@ -0,0 +1,113 @@
+// Cost of latency recording on the RPC hot path.
+//
+//   record_call  — one LatencyStats::record_call (4 phases, one key lookup)
+//   record       — one LatencyStats::record (single phase, NFSv4 op path)
+//   now_ns       — one LatencyStats::now_ns timestamp
+//
+// A call through RpcServer pays 4 timestamps (received, decoded, handled,
+// sent) plus one record_call; each NFSv4 COMPOUND op pays 1 timestamp plus
+// one record.
+//
+// Times are each thread's CPU time (CLOCK_THREAD_CPUTIME_ID), so threads
+// outnumbering cores are not charged for waiting to be scheduled.
+//
+// With --budget-ns N, exits 1 if record_call takes more than N ns on any
+// thread. Only checked in an optimized build: unoptimized timings say
+// nothing about the server's.
+//
+// Usage: bench_latency_record [--iterations N] [--threads N] [--budget-ns N]
+
+#include "stats/latency_stats.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <vector>
+
+static double thread_cpu_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+template <typename F>
+static double ns_per_iter(long iterations, F&& fn) {
+    double start = thread_cpu_ns();
+    for (long i = 0; i < iterations; i++) fn(i);
+    return (thread_cpu_ns() - start) / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = 10000000;
+    int threads = 1;
+    double budget_ns = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc)
+            iterations = std::atol(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = std::atoi(argv[++i]);
+        else if (arg == "--budget-ns" && i + 1 < argc)
+            budget_ns = std::atof(argv[++i]);
+    }
+
+    LatencyStats stats;
+    // A realistic key mix: NFSv3 procedures cycling through 16 keys
+    auto key_for = [](long i) {
+        return LatencyKey{100003, 3, static_cast<uint32_t>(i & 15)};
+    };
+
+    std::vector<double> call_ns(threads), op_ns(threads), clock_ns(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            // Warm up: allocate this thread's shard and histograms
+            ns_per_iter(1000, [&](long i) {
+                uint64_t phases[kLatencyPhases] = {1, 2, 3, 4};
+                stats.record_call(key_for(i), phases);
+            });
+            call_ns[t] = ns_per_iter(iterations, [&](long i) {
+                const uint64_t phases[kLatencyPhases] = {
+                    static_cast<uint64_t>(i & 1023), 200, static_cast<uint64_t>(i & 65535), 900};
+                stats.record_call(key_for(i), phases);
+            });
+            op_ns[t] = ns_per_iter(iterations, [&](long i) {
+                stats.record({100003, 4, 1, static_cast<uint32_t>(i & 31)},
+                             LatencyPhase::HANDLER, static_cast<uint64_t>(i & 65535));
+            });
+            volatile uint64_t sink = 0;
+            clock_ns[t] = ns_per_iter(iterations, [&](long) { sink = sink + LatencyStats::now_ns(); });
+        });
+    }
+    for (auto& w : workers) w.join();
+
+    auto avg = [](const std::vector<double>& v) {
+        double s = 0;
+        for (double x : v) s += x;
+        return v.empty() ? 0 : s / v.size();
+    };
+    const double worst_call = *std::max_element(call_ns.begin(), call_ns.end());
+    std::printf("latency recording cost, %ld iterations x %d threads, thread CPU time\n",
+                iterations, threads);
+    std::printf("record_call  %8.1f ns  (worst thread %.1f)\n", avg(call_ns), worst_call);
+    std::printf("record       %8.1f ns\n", avg(op_ns));
+    std::printf("now_ns       %8.1f ns\n", avg(clock_ns));
+    std::printf("per call     %8.1f ns  (4 timestamps + record_call)\n",
+                4 * avg(clock_ns) + avg(call_ns));
+    std::printf("per v4 op    %8.1f ns  (1 timestamp + record)\n", avg(clock_ns) + avg(op_ns));
+
+    if (budget_ns <= 0) return 0;
+#ifdef __OPTIMIZE__
+    if (worst_call > budget_ns) {
+        std::printf("FAIL: record_call %.1f ns over the %.0f ns budget\n", worst_call, budget_ns);
+        return 1;
+    }
+    std::printf("record_call within the %.0f ns budget\n", budget_ns);
+#else
+    std::printf("budget not checked: unoptimized build\n");
+#endif
+    return 0;
+}
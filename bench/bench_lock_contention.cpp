@@ -0,0 +1,203 @@
+// Mixed-protocol lock contention: NLM handler threads and NFSv4 state
+// manager threads lock/unlock byte ranges on a shared set of files for a
+// fixed duration. Each NLM thread uses its own svid and each NFSv4 thread
+// its own lock_owner, so conflicts are real cross-protocol conflicts on the
+// files both sides touch.
+//
+// Reports granted/denied operations per second for each protocol. With the
+// lock table striped by file handle, NLM traffic never waits on the NFSv4
+// state mutex and unrelated files never share a lock.
+//
+// Usage: bench_lock_contention [--seconds S] [--nlm-threads N]
+//                              [--v4-threads N] [--files N]
+
+#include "nfs4/nfs4_state.h"
+#include "nlm/nlm_server.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static FileHandle make_fh(uint32_t n) {
+    uint8_t data[16] = {0xbe, static_cast<uint8_t>(n), static_cast<uint8_t>(n >> 8)};
+    return FileHandle(data, sizeof(data));
+}
+
+static void encode_nlm4_lock(XdrEncoder& enc, uint32_t svid, const FileHandle& fh,
+                             uint64_t offset) {
+    enc.encode_string("127.0.0.1");
+    enc.encode_opaque(fh.data(), fh.size());
+    uint8_t oh[4] = {0, 0, static_cast<uint8_t>(svid >> 8), static_cast<uint8_t>(svid)};
+    enc.encode_opaque(oh, sizeof(oh));
+    enc.encode_uint32(svid);
+    enc.encode_uint64(offset);
+    enc.encode_uint64(1);
+}
+
+static NlmStat call_nlm(RpcProgramHandlers& h, uint32_t proc, const XdrEncoder& args) {
+    RpcCallHeader call;
+    call.program = NLM_PROGRAM;
+    call.version = NLM_V4;
+    call.procedure = proc;
+    XdrDecoder dec(args.data().data(), args.size());
+    XdrEncoder reply;
+    h.procedures.at(proc)(call, dec, reply);
+    XdrDecoder res(reply.data().data(), reply.size());
+    res.decode_opaque();
+    return static_cast<NlmStat>(res.decode_uint32());
+}
+
+struct Counts {
+    std::atomic<uint64_t> granted{0};
+    std::atomic<uint64_t> denied{0};
+};
+
+static void nlm_worker(RpcProgramHandlers h, uint32_t svid, int files,
+                       const std::atomic<bool>& stop, Counts& counts) {
+    uint64_t granted = 0, denied = 0;
+    uint32_t n = svid;
+    while (!stop.load(std::memory_order_relaxed)) {
+        n = n * 1103515245 + 12345;
+        FileHandle fh = make_fh((n >> 8) % files);
+        uint64_t offset = (n >> 4) % 8;
+
+        XdrEncoder lock;
+        lock.encode_opaque("c", 1);
+        lock.encode_bool(false);  // non-blocking
+        lock.encode_bool(true);   // exclusive
+        encode_nlm4_lock(lock, svid, fh, offset);
+        lock.encode_bool(false);
+        lock.encode_uint32(0);
+        if (call_nlm(h, NLMPROC4_LOCK, lock) != NlmStat::LCK_GRANTED) {
+            denied++;
+            continue;
+        }
+        granted++;
+
+        XdrEncoder unlock;
+        unlock.encode_opaque("c", 1);
+        encode_nlm4_lock(unlock, svid, fh, offset);
+        call_nlm(h, NLMPROC4_UNLOCK, unlock);
+    }
+    counts.granted += granted;
+    counts.denied += denied;
+}
+
+static void v4_worker(Nfs4StateManager& mgr, uint64_t clientid, uint32_t id, int files,
+                      const std::atomic<bool>& stop, Counts& counts) {
+    // One open and one lock stateid per file, established lazily
+    std::vector<Nfs4StateId> open_sids(files);
+    std::vector<Nfs4StateId> lock_sids(files);
+    std::vector<bool> opened(files, false), have_lock_state(files, false);
+    std::vector<uint8_t> open_owner = {static_cast<uint8_t>(id), 'o'};
+    Nfs4LockOwner lock_owner{clientid, {static_cast<uint8_t>(id), 'l'}};
+
+    uint64_t granted = 0, denied = 0;
+    uint32_t n = id * 7919;
+    while (!stop.load(std::memory_order_relaxed)) {
+        n = n * 1103515245 + 12345;
+        uint32_t f = (n >> 8) % files;
+        uint64_t offset = (n >> 4) % 8;
+        FileHandle fh = make_fh(f);
+
+        if (!opened[f]) {
+            bool needs_confirm = false;
+            uint32_t deleg_type = OPEN_DELEGATE_NONE;
+            Nfs4StateId deleg_sid, recall_sid;
+            Nfs4CallbackInfo recall_cb;
+            FileHandle recall_fh;
+            if (mgr.open_file(clientid, open_owner, 0, fh, OPEN4_SHARE_ACCESS_BOTH,
+                              OPEN4_SHARE_DENY_NONE, open_sids[f], needs_confirm,
+                              deleg_type, deleg_sid, recall_cb, recall_sid,
+                              recall_fh) != Nfs4Stat::NFS4_OK)
+                continue;
+            mgr.auto_confirm_open(open_sids[f]);
+            opened[f] = true;
+        }
+
+        Nfs4StateId out;
+        Nfs4LockDenied d;
+        Nfs4Stat st;
+        if (!have_lock_state[f]) {
+            st = mgr.lock_new(clientid, open_sids[f], 0, lock_owner, 0, fh, WRITE_LT,
+                              offset, 1, out, d);
+            if (st == Nfs4Stat::NFS4_OK) {
+                lock_sids[f] = out;
+                have_lock_state[f] = true;
+            }
+        } else {
+            st = mgr.lock_existing(lock_sids[f], 0, WRITE_LT, offset, 1, out, d);
+        }
+        if (st != Nfs4Stat::NFS4_OK) {
+            denied++;
+            continue;
+        }
+        granted++;
+        mgr.lock_unlock(lock_sids[f], 0, offset, 1, out);
+    }
+    counts.granted += granted;
+    counts.denied += denied;
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = 2.0;
+    int nlm_threads = 4;
+    int v4_threads = 4;
+    int files = 256;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--seconds" && i + 1 < argc)
+            seconds = std::atof(argv[++i]);
+        else if (arg == "--nlm-threads" && i + 1 < argc)
+            nlm_threads = std::atoi(argv[++i]);
+        else if (arg == "--v4-threads" && i + 1 < argc)
+            v4_threads = std::atoi(argv[++i]);
+        else if (arg == "--files" && i + 1 < argc)
+            files = std::atoi(argv[++i]);
+    }
+    if (files < 1) files = 1;
+
+    Nfs4StateManager mgr;
+    mgr.end_grace_period();
+    uint8_t verifier[8] = {7};
+    auto [clientid, seq] = mgr.exchange_id41(verifier, "bench_lock_contention");
+    SessionId41 sid;
+    mgr.create_session41(clientid, seq, sid);
+
+    NlmServer nlm(mgr.lock_table());
+    auto h = nlm.get_handlers();
+
+    std::atomic<bool> stop{false};
+    Counts nlm_counts, v4_counts;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nlm_threads; i++)
+        threads.emplace_back(nlm_worker, h, static_cast<uint32_t>(i + 1), files,
+                             std::cref(stop), std::ref(nlm_counts));
+    for (int i = 0; i < v4_threads; i++)
+        threads.emplace_back(v4_worker, std::ref(mgr), clientid, static_cast<uint32_t>(i + 1),
+                             files, std::cref(stop), std::ref(v4_counts));
+
+    auto start = Clock::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& t : threads) t.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    auto report = [elapsed](const char* name, int nthreads, const Counts& c) {
+        uint64_t total = c.granted + c.denied;
+        std::printf("%-5s threads=%-3d ops/s=%12.0f  granted=%llu  denied=%llu\n",
+                    name, nthreads, total / elapsed,
+                    static_cast<unsigned long long>(c.granted.load()),
+                    static_cast<unsigned long long>(c.denied.load()));
+    };
+    std::printf("mixed lock contention, %d files, %.1f s\n", files, elapsed);
+    report("nlm", nlm_threads, nlm_counts);
+    report("nfsv4", v4_threads, v4_counts);
+    return 0;
+}
@@ -0,0 +1,168 @@
+// Lock handoff latency: time from the holder's NLMPROC4_UNLOCK until the
+// waiting client owns the lock.
+//
+//   blocking  — waiter sent LOCK(block=true), got LCK_BLOCKED, and is told
+//               via NLMPROC4_GRANTED (callback to an in-process NLM service)
+//   polling   — waiter retries LOCK(block=false) every --poll-ms, which is
+//               what clients had to do before the server queued requests
+//
+// Usage: bench_lock_handoff [--iterations N] [--poll-ms MS]
+
+#include "nlm/nlm_server.h"
+#include "rpc/rpc_server.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static void encode_nlm4_lock(XdrEncoder& enc, uint32_t svid) {
+    enc.encode_string("127.0.0.1");
+    uint8_t fh[8] = {42};
+    enc.encode_opaque(fh, sizeof(fh));
+    uint8_t oh[4] = {0, 0, 0, static_cast<uint8_t>(svid)};
+    enc.encode_opaque(oh, sizeof(oh));
+    enc.encode_uint32(svid);
+    enc.encode_uint64(0);
+    enc.encode_uint64(0);  // to EOF
+}
+
+static NlmStat call_nlm(RpcProgramHandlers& h, uint32_t proc, const XdrEncoder& args) {
+    RpcCallHeader call;
+    call.program = NLM_PROGRAM;
+    call.version = NLM_V4;
+    call.procedure = proc;
+    XdrDecoder dec(args.data().data(), args.size());
+    XdrEncoder reply;
+    h.procedures.at(proc)(call, dec, reply);
+    XdrDecoder res(reply.data().data(), reply.size());
+    res.decode_opaque();
+    return static_cast<NlmStat>(res.decode_uint32());
+}
+
+static NlmStat nlm_lock(RpcProgramHandlers& h, uint32_t svid, bool block) {
+    XdrEncoder enc;
+    enc.encode_opaque("b", 1);
+    enc.encode_bool(block);
+    enc.encode_bool(true);
+    encode_nlm4_lock(enc, svid);
+    enc.encode_bool(false);
+    enc.encode_uint32(0);
+    return call_nlm(h, NLMPROC4_LOCK, enc);
+}
+
+static void nlm_unlock(RpcProgramHandlers& h, uint32_t svid) {
+    XdrEncoder enc;
+    enc.encode_opaque("b", 1);
+    encode_nlm4_lock(enc, svid);
+    call_nlm(h, NLMPROC4_UNLOCK, enc);
+}
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    size_t idx = static_cast<size_t>(p * (v.size() - 1));
+    return v[idx];
+}
+
+static void report(const char* name, const std::vector<double>& us) {
+    std::printf("%-10s n=%zu  p50=%10.1f us  p99=%10.1f us  max=%10.1f us\n",
+                name, us.size(), percentile(us, 0.50), percentile(us, 0.99),
+                percentile(us, 1.0));
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = 50;
+    int poll_ms = 100;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc)
+            iterations = std::atoi(argv[++i]);
+        else if (arg == "--poll-ms" && i + 1 < argc)
+            poll_ms = std::atoi(argv[++i]);
+    }
+
+    ByteRangeLockTable table;
+    NlmServer srv(table);
+    auto h = srv.get_handlers();
+
+    // Client-side NLM service receiving GRANTED callbacks
+    std::mutex mu;
+    std::condition_variable cv;
+    bool granted = false;
+    Clock::time_point granted_at;
+
+    RpcServer client_nlm;
+    RpcProgramHandlers cb;
+    cb.procedures[NLMPROC4_GRANTED] = [&](const RpcCallHeader&, XdrDecoder& args, XdrEncoder& reply) {
+        auto cookie = args.decode_opaque();
+        reply.encode_opaque(cookie.data(), cookie.size());
+        reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_GRANTED));
+        std::lock_guard<std::mutex> lk(mu);
+        granted = true;
+        granted_at = Clock::now();
+        cv.notify_all();
+    };
+    client_nlm.register_program(NLM_PROGRAM, NLM_V4, cb);
+    client_nlm.start(0);
+    uint16_t cb_port = client_nlm.port();
+    srv.set_port_resolver([cb_port](const std::string&) { return cb_port; });
+
+    std::vector<double> blocking_us, polling_us;
+
+    for (int i = 0; i < iterations; i++) {
+        nlm_lock(h, 1, false);
+        granted = false;
+        if (nlm_lock(h, 2, true) != NlmStat::LCK_BLOCKED) {
+            std::fprintf(stderr, "expected LCK_BLOCKED\n");
+            return 1;
+        }
+        auto start = Clock::now();
+        nlm_unlock(h, 1);
+        {
+            std::unique_lock<std::mutex> lk(mu);
+            if (!cv.wait_for(lk, std::chrono::seconds(5), [&] { return granted; })) {
+                std::fprintf(stderr, "GRANTED callback not received\n");
+                return 1;
+            }
+            blocking_us.push_back(
+                std::chrono::duration<double, std::micro>(granted_at - start).count());
+        }
+        nlm_unlock(h, 2);
+    }
+
+    for (int i = 0; i < iterations; i++) {
+        nlm_lock(h, 1, false);
+        // Holder releases at a random point in the waiter's poll interval
+        auto hold = std::chrono::microseconds(std::rand() % (poll_ms * 1000 + 1));
+        Clock::time_point released;
+        std::thread holder([&] {
+            std::this_thread::sleep_for(hold);
+            released = Clock::now();
+            nlm_unlock(h, 1);
+        });
+        while (nlm_lock(h, 2, false) != NlmStat::LCK_GRANTED)
+            std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms));
+        auto acquired = Clock::now();
+        holder.join();
+        polling_us.push_back(
+            std::chrono::duration<double, std::micro>(acquired - released).count());
+        nlm_unlock(h, 2);
+    }
+
+    client_nlm.stop();
+
+    std::printf("lock handoff latency (unlock -> waiter owns lock), poll interval %d ms\n",
+                poll_ms);
+    report("blocking", blocking_us);
+    report("polling", polling_us);
+    return 0;
+}
@@ -0,0 +1,450 @@
+// Lock-manager stress and scalability benchmark.
+//
+// Drives the lock managers in-process (no network) with one of several
+// workload models and a range of thread counts:
+//
+//   backends
+//     table   — ByteRangeLockTable::acquire/release
+//     nfs4    — Nfs4StateManager::lock_new/lock_existing/lock_unlock
+//     nlm     — NlmServer NLMPROC4_LOCK/UNLOCK handlers (XDR in and out)
+//
+//   workloads
+//     record      — exclusive 128-byte records at random offsets of --files files
+//     wholefile   — exclusive whole-file locks on 4 hot files
+//     readmostly  — 95% shared / 5% exclusive record locks
+//     manyowners  — every thread cycles through --owners owners on one file
+//
+// One operation is a lock request plus, if granted, the matching unlock.
+// Denied requests count as operations (that is the contended fast path).
+// Reports ops/s and p50/p99/p999 per-operation latency.
+//
+// Usage: bench_lock_stress [--seconds S] [--threads 1,2,4,8]
+//                          [--backend all|table|nfs4|nlm]
+//                          [--workload all|record|wholefile|readmostly|manyowners]
+//                          [--files N] [--owners N]
+
+#include "locking/lock_table.h"
+#include "nfs4/nfs4_state.h"
+#include "nlm/nlm_server.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+enum class Backend { TABLE, NFS4, NLM };
+enum class Workload { RECORD, WHOLEFILE, READMOSTLY, MANYOWNERS };
+
+static const char* backend_name(Backend b) {
+    switch (b) {
+        case Backend::TABLE: return "table";
+        case Backend::NFS4:  return "nfs4";
+        case Backend::NLM:   return "nlm";
+    }
+    return "?";
+}
+
+static const char* workload_name(Workload w) {
+    switch (w) {
+        case Workload::RECORD:     return "record";
+        case Workload::WHOLEFILE:  return "wholefile";
+        case Workload::READMOSTLY: return "readmostly";
+        case Workload::MANYOWNERS: return "manyowners";
+    }
+    return "?";
+}
+
+struct Params {
+    Workload workload = Workload::RECORD;
+    uint32_t files = 64;
+    uint32_t owners = 32;  // per thread, manyowners only
+};
+
+// One lock request
+struct Op {
+    uint32_t file = 0;
+    uint32_t owner = 0;     // index within the thread
+    uint64_t offset = 0;
+    uint64_t length = 0;    // UINT64_MAX = to EOF
+    bool exclusive = true;
+};
+
+static constexpr uint64_t kRecordSize = 128;
+static constexpr uint64_t kRecordsPerFile = 1024;
+static constexpr uint32_t kHotFiles = 4;
+
+static uint64_t xorshift(uint64_t& s) {
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return s;
+}
+
+static Op next_op(const Params& p, uint64_t& rng) {
+    Op op;
+    uint64_t r = xorshift(rng);
+    switch (p.workload) {
+        case Workload::RECORD:
+            op.file = r % p.files;
+            op.offset = ((r >> 16) % kRecordsPerFile) * kRecordSize;
+            op.length = kRecordSize;
+            break;
+        case Workload::WHOLEFILE:
+            op.file = r % kHotFiles;
+            op.offset = 0;
+            op.length = UINT64_MAX;
+            break;
+        case Workload::READMOSTLY:
+            op.file = r % p.files;
+            op.offset = ((r >> 16) % kRecordsPerFile) * kRecordSize;
+            op.length = kRecordSize;
+            op.exclusive = (r >> 40) % 100 < 5;
+            break;
+        case Workload::MANYOWNERS:
+            op.file = 0;
+            op.owner = r % p.owners;
+            op.offset = ((r >> 16) % kRecordsPerFile) * kRecordSize;
+            op.length = kRecordSize;
+            break;
+    }
+    return op;
+}
+
+static uint32_t owners_per_thread(const Params& p) {
+    return p.workload == Workload::MANYOWNERS ? p.owners : 1;
+}
+
+static FileHandle make_fh(uint32_t n) {
+    uint8_t data[16] = {0x5e, static_cast<uint8_t>(n), static_cast<uint8_t>(n >> 8)};
+    return FileHandle(data, sizeof(data));
+}
+
+// --- Backends: each thread gets a Worker with its own owners/state ---
+
+class Worker {
+public:
+    virtual ~Worker() = default;
+    // Returns true if the lock was granted (and has been released again)
+    virtual bool run(const Op& op) = 0;
+};
+
+class TableWorker : public Worker {
+public:
+    TableWorker(ByteRangeLockTable& table, const std::vector<FileHandle>& fhs,
+                uint32_t thread, uint32_t owners)
+        : table_(table), fhs_(fhs) {
+        for (uint32_t i = 0; i < owners; i++)
+            keys_.push_back("bench:" + std::to_string(thread) + ":" + std::to_string(i));
+    }
+
+    bool run(const Op& op) override {
+        const FileHandle& fh = fhs_[op.file];
+        const LockOwnerKey& key = keys_[op.owner];
+        LockConflict conflict;
+        if (!table_.acquire(fh, key, op.exclusive, op.offset, op.length, conflict))
+            return false;
+        table_.release(fh, key, op.offset, op.length);
+        return true;
+    }
+
+private:
+    ByteRangeLockTable& table_;
+    const std::vector<FileHandle>& fhs_;
+    std::vector<LockOwnerKey> keys_;
+};
+
+class Nfs4Worker : public Worker {
+public:
+    // Each thread is its own NFSv4.1 client with one open per file
+    // (seqid 0 everywhere, as a sessions client would send).
+    Nfs4Worker(Nfs4StateManager& mgr, const std::vector<FileHandle>& fhs,
+               uint32_t thread, uint32_t owners)
+        : mgr_(mgr), fhs_(fhs), owners_(owners) {
+        uint8_t verifier[8] = {static_cast<uint8_t>(thread)};
+        auto [cid, seq] = mgr_.exchange_id41(verifier, "bench-" + std::to_string(thread));
+        clientid_ = cid;
+        SessionId41 sid;
+        mgr_.create_session41(clientid_, seq, sid);
+
+        std::vector<uint8_t> open_owner = {'o', static_cast<uint8_t>(thread)};
+        open_sids_.resize(fhs_.size());
+        for (size_t f = 0; f < fhs_.size(); f++) {
+            bool needs_confirm = false;
+            uint32_t deleg_type = OPEN_DELEGATE_NONE;
+            Nfs4StateId deleg_sid, recall_sid;
+            Nfs4CallbackInfo recall_cb;
+            FileHandle recall_fh;
+            mgr_.open_file(clientid_, open_owner, 0, fhs_[f], OPEN4_SHARE_ACCESS_BOTH,
+                           OPEN4_SHARE_DENY_NONE, open_sids_[f], needs_confirm,
+                           deleg_type, deleg_sid, recall_cb, recall_sid, recall_fh);
+            mgr_.auto_confirm_open(open_sids_[f]);
+        }
+        for (uint32_t i = 0; i < owners; i++) {
+            Nfs4LockOwner lo;
+            lo.clientid = clientid_;
+            lo.owner = {'l', static_cast<uint8_t>(thread), static_cast<uint8_t>(i),
+                        static_cast<uint8_t>(i >> 8)};
+            lock_owners_.push_back(lo);
+        }
+        lock_sids_.resize(fhs_.size() * owners);
+        have_lock_sid_.resize(fhs_.size() * owners, false);
+    }
+
+    bool run(const Op& op) override {
+        size_t slot = op.file * owners_ + op.owner;
+        uint32_t locktype = op.exclusive ? WRITE_LT : READ_LT;
+        Nfs4StateId out;
+        Nfs4LockDenied denied;
+        Nfs4Stat st;
+        if (!have_lock_sid_[slot]) {
+            st = mgr_.lock_new(clientid_, open_sids_[op.file], 0, lock_owners_[op.owner], 0,
+                               fhs_[op.file], locktype, op.offset, op.length, out, denied);
+            if (st == Nfs4Stat::NFS4_OK) {
+                lock_sids_[slot] = out;
+                have_lock_sid_[slot] = true;
+            }
+        } else {
+            st = mgr_.lock_existing(lock_sids_[slot], 0, locktype, op.offset, op.length,
+                                    out, denied);
+        }
+        if (st != Nfs4Stat::NFS4_OK) return false;
+        mgr_.lock_unlock(lock_sids_[slot], 0, op.offset, op.length, out);
+        return true;
+    }
+
+private:
+    Nfs4StateManager& mgr_;
+    const std::vector<FileHandle>& fhs_;
+    uint32_t owners_;
+    uint64_t clientid_ = 0;
+    std::vector<Nfs4StateId> open_sids_;
+    std::vector<Nfs4LockOwner> lock_owners_;
+    std::vector<Nfs4StateId> lock_sids_;
+    std::vector<bool> have_lock_sid_;
+};
+
+class NlmWorker : public Worker {
+public:
+    NlmWorker(NlmServer& srv, const std::vector<FileHandle>& fhs, uint32_t thread)
+        : handlers_(srv.get_handlers()), fhs_(fhs), thread_(thread) {}
+
+    bool run(const Op& op) override {
+        XdrEncoder lock;
+        lock.encode_opaque("s", 1);
+        lock.encode_bool(false);  // non-blocking
+        lock.encode_bool(op.exclusive);
+        encode_nlm4_lock(lock, op);
+        lock.encode_bool(false);
+        lock.encode_uint32(0);
+        if (call(NLMPROC4_LOCK, lock) != NlmStat::LCK_GRANTED)
+            return false;
+
+        XdrEncoder unlock;
+        unlock.encode_opaque("s", 1);
+        encode_nlm4_lock(unlock, op);
+        call(NLMPROC4_UNLOCK, unlock);
+        return true;
+    }
+
+private:
+    void encode_nlm4_lock(XdrEncoder& enc, const Op& op) const {
+        uint32_t svid = (thread_ << 16) | op.owner;
+        enc.encode_string("127.0.0.1");
+        enc.encode_opaque(fhs_[op.file].data(), fhs_[op.file].size());
+        enc.encode_opaque(&svid, sizeof(svid));
+        enc.encode_uint32(svid);
+        enc.encode_uint64(op.offset);
+        // NLM length 0 means to EOF
+        enc.encode_uint64(op.length == UINT64_MAX ? 0 : op.length);
+    }
+
+    NlmStat call(uint32_t proc, const XdrEncoder& args) {
+        RpcCallHeader hdr;
+        hdr.program = NLM_PROGRAM;
+        hdr.version = NLM_V4;
+        hdr.procedure = proc;
+        XdrDecoder dec(args.data().data(), args.size());
+        XdrEncoder reply;
+        handlers_.procedures.at(proc)(hdr, dec, reply);
+        XdrDecoder res(reply.data().data(), reply.size());
+        res.decode_opaque();
+        return static_cast<NlmStat>(res.decode_uint32());
+    }
+
+    RpcProgramHandlers handlers_;
+    const std::vector<FileHandle>& fhs_;
+    uint32_t thread_;
+};
+
+// --- Runner ---
+
+struct RunResult {
+    double ops_per_sec = 0;
+    double granted_pct = 0;
+    double p50_us = 0, p99_us = 0, p999_us = 0;
+};
+
+static double percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t idx = static_cast<size_t>(p * (sorted.size() - 1));
+    return sorted[idx] / 1000.0;
+}
+
+static RunResult run_one(Backend backend, const Params& p, int nthreads, double seconds) {
+    std::vector<FileHandle> fhs;
+    uint32_t nfiles = p.workload == Workload::WHOLEFILE ? kHotFiles
+                    : p.workload == Workload::MANYOWNERS ? 1 : p.files;
+    for (uint32_t f = 0; f < nfiles; f++) fhs.push_back(make_fh(f));
+
+    // Fresh state per run so earlier runs don't leave lock state behind.
+    // Only the backend under test is built (the state manager's reaper
+    // thread takes up to a second to stop).
+    ByteRangeLockTable table;
+    std::unique_ptr<Nfs4StateManager> mgr;
+    std::unique_ptr<NlmServer> nlm;
+    if (backend == Backend::NFS4) {
+        mgr = std::make_unique<Nfs4StateManager>();
+        mgr->end_grace_period();
+    } else if (backend == Backend::NLM) {
+        nlm = std::make_unique<NlmServer>(table);
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int t = 0; t < nthreads; t++) {
+        uint32_t tid = static_cast<uint32_t>(t);
+        switch (backend) {
+            case Backend::TABLE:
+                workers.push_back(std::make_unique<TableWorker>(table, fhs, tid,
+                                                                owners_per_thread(p)));
+                break;
+            case Backend::NFS4:
+                workers.push_back(std::make_unique<Nfs4Worker>(*mgr, fhs, tid,
+                                                               owners_per_thread(p)));
+                break;
+            case Backend::NLM:
+                workers.push_back(std::make_unique<NlmWorker>(*nlm, fhs, tid));
+                break;
+        }
+    }
+
+    std::atomic<bool> go{false}, stop{false};
+    std::vector<std::vector<uint64_t>> lat(nthreads);
+    std::vector<uint64_t> granted(nthreads, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t] {
+            uint64_t rng = 0x9e3779b97f4a7c15ULL * (t + 1);
+            auto& mine = lat[t];
+            mine.reserve(1 << 20);
+            while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+            while (!stop.load(std::memory_order_relaxed)) {
+                Op op = next_op(p, rng);
+                auto start = Clock::now();
+                bool ok = workers[t]->run(op);
+                auto end = Clock::now();
+                mine.push_back(static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+                if (ok) granted[t]++;
+            }
+        });
+    }
+
+    auto start = Clock::now();
+    go = true;
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& th : threads) th.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<uint64_t> all;
+    uint64_t total_granted = 0;
+    for (int t = 0; t < nthreads; t++) {
+        all.insert(all.end(), lat[t].begin(), lat[t].end());
+        total_granted += granted[t];
+    }
+    std::sort(all.begin(), all.end());
+
+    RunResult r;
+    r.ops_per_sec = all.size() / elapsed;
+    r.granted_pct = all.empty() ? 0 : 100.0 * total_granted / all.size();
+    r.p50_us = percentile(all, 0.50);
+    r.p99_us = percentile(all, 0.99);
+    r.p999_us = percentile(all, 0.999);
+    return r;
+}
+
+static std::vector<int> parse_list(const std::string& s) {
+    std::vector<int> out;
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) comma = s.size();
+        int v = std::atoi(s.substr(pos, comma - pos).c_str());
+        if (v > 0) out.push_back(v);
+        pos = comma + 1;
+    }
+    return out;
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = 1.0;
+    std::vector<int> thread_counts = {1, 2, 4, 8};
+    std::string backend_arg = "all";
+    std::string workload_arg = "all";
+    Params params;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--seconds" && i + 1 < argc)
+            seconds = std::atof(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            thread_counts = parse_list(argv[++i]);
+        else if (arg == "--backend" && i + 1 < argc)
+            backend_arg = argv[++i];
+        else if (arg == "--workload" && i + 1 < argc)
+            workload_arg = argv[++i];
+        else if (arg == "--files" && i + 1 < argc)
+            params.files = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--owners" && i + 1 < argc)
+            params.owners = std::max(1, std::atoi(argv[++i]));
+        else {
+            std::fprintf(stderr, "unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<Backend> backends;
+    for (Backend b : {Backend::TABLE, Backend::NFS4, Backend::NLM})
+        if (backend_arg == "all" || backend_arg == backend_name(b)) backends.push_back(b);
+    std::vector<Workload> workloads;
+    for (Workload w : {Workload::RECORD, Workload::WHOLEFILE, Workload::READMOSTLY,
+                       Workload::MANYOWNERS})
+        if (workload_arg == "all" || workload_arg == workload_name(w)) workloads.push_back(w);
+    if (backends.empty() || workloads.empty() || thread_counts.empty()) {
+        std::fprintf(stderr, "nothing to run\n");
+        return 1;
+    }
+
+    std::printf("%-6s %-11s %7s %12s %8s %10s %10s %10s\n", "backend", "workload",
+                "threads", "ops/s", "granted", "p50(us)", "p99(us)", "p999(us)");
+    for (Backend b : backends) {
+        for (Workload w : workloads) {
+            params.workload = w;
+            for (int n : thread_counts) {
+                RunResult r = run_one(b, params, n, seconds);
+                std::printf("%-7s %-11s %7d %12.0f %7.1f%% %10.2f %10.2f %10.2f\n",
+                            backend_name(b), workload_name(w), n, r.ops_per_sec,
+                            r.granted_pct, r.p50_us, r.p99_us, r.p999_us);
+                std::fflush(stdout);
+            }
+        }
+    }
+    return 0;
+}
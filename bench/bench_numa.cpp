@@ -0,0 +1,370 @@
+// Cost of memory on the wrong NUMA node, and what the server's placement
+// (RpcServer::set_numa()) does about it.
+//
+//   buffers — for every pair of nodes: --mb MiB from one node's buffer pool,
+//             filled by a thread on that node, then read by a thread on the
+//             other: a dependent random walk over it (ns per cache line,
+//             latency-bound) and a sequential sum (GB/s)
+//   rpc     — an in-process RpcServer with NUMA placement, --connections
+//             clients sending --io-size byte calls for --seconds; reports
+//             calls/s, where the connections were placed and the backing
+//             of the pools their buffers came from
+//
+// Both report node loads and node-load misses, the loads served by another
+// node's memory (perf_event_open(2) PERF_COUNT_HW_CACHE_NODE), where the
+// kernel exposes hardware counters; n/a elsewhere (most VMs and
+// containers). On a single node the threads are not pinned, and buffers
+// mode has only the local case.
+//
+// Usage: bench_numa [--mode buffers|rpc|both] [--mb N] [--seconds S]
+//                   [--connections N] [--io-size BYTES]
+
+#include "rpc/rpc_numa.h"
+#include "rpc/rpc_server.h"
+
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr size_t kLine = 64;
+static constexpr uint32_t kProgram = 0x20000099;
+
+static uint64_t xorshift(uint64_t& s) {
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return s;
+}
+
+// Node loads (result ACCESS) or node-load misses (result MISS) in user
+// space, of this thread or, with inherit, of threads it starts afterwards
+// too; reads -1 where the kernel has no hardware counters
+class NodeCounter {
+public:
+    NodeCounter(uint64_t result, bool inherit) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_NODE | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (result << 16);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = inherit ? 1 : 0;
+        fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+    ~NodeCounter() {
+        if (fd_ >= 0) close(fd_);
+    }
+    int64_t read_count() const {
+        uint64_t v = 0;
+        if (fd_ < 0 || read(fd_, &v, sizeof(v)) != sizeof(v)) return -1;
+        return static_cast<int64_t>(v);
+    }
+
+private:
+    int fd_ = -1;
+};
+
+// Node loads and misses over a stretch of work
+struct NodeLoads {
+    int64_t loads = -1;
+    int64_t misses = -1;
+};
+
+class NodeLoadCounters {
+public:
+    explicit NodeLoadCounters(bool inherit = false)
+        : loads_(PERF_COUNT_HW_CACHE_RESULT_ACCESS, inherit),
+          misses_(PERF_COUNT_HW_CACHE_RESULT_MISS, inherit) {}
+    void start() {
+        l0_ = loads_.read_count();
+        m0_ = misses_.read_count();
+    }
+    NodeLoads stop() const {
+        NodeLoads r;
+        int64_t l1 = loads_.read_count(), m1 = misses_.read_count();
+        if (l0_ >= 0 && l1 >= 0) r.loads = l1 - l0_;
+        if (m0_ >= 0 && m1 >= 0) r.misses = m1 - m0_;
+        return r;
+    }
+
+private:
+    NodeCounter loads_, misses_;
+    int64_t l0_ = -1, m0_ = -1;
+};
+
+static std::string per_op(int64_t count, double ops) {
+    if (count < 0) return "n/a";
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.3f", count / ops);
+    return buf;
+}
+
+static std::string remote_pct(const NodeLoads& r) {
+    if (r.loads <= 0 || r.misses < 0) return "n/a";
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.1f%%", 100.0 * r.misses / r.loads);
+    return buf;
+}
+
+// Run fn on a thread restricted to node's CPUs (where there is a choice)
+template <typename F>
+static void on_node(NumaPlacement& numa, size_t node, F&& fn) {
+    std::thread([&] {
+        numa.pin(node);
+        fn();
+    }).join();
+}
+
+static void print_pools(const NumaPlacement& numa) {
+    for (size_t i = 0; i < numa.topology().nodes(); i++) {
+        const NodeBufferPool& pool = numa.pool(i);
+        std::printf("pool node %d: %llu MiB mapped (", numa.topology().node(i).id,
+                    static_cast<unsigned long long>(pool.mapped_bytes() >> 20));
+        for (int b = 0; b < NodeBufferPool::BACKINGS; b++) {
+            auto backing = static_cast<NodeBufferPool::Backing>(b);
+            std::printf("%s%s %llu", b ? ", " : "", NodeBufferPool::backing_name(backing),
+                        static_cast<unsigned long long>(pool.mapped_bytes(backing) >> 20));
+        }
+        std::printf(")%s\n", pool.bind_failures() ? ", mbind failed" : "");
+    }
+}
+
+static void run_buffers(NumaPlacement& numa, size_t mb) {
+    const size_t chunk = NodeBufferPool::kRegionBytes;
+    const size_t chunks = std::max<size_t>(1, (mb << 20) / chunk);
+    const size_t lines_per_chunk = chunk / kLine;
+    const size_t lines = chunks * lines_per_chunk;
+    const size_t nodes = numa.topology().nodes();
+
+    std::printf("%-6s %-6s %12s %10s %12s %12s %8s\n", "memory", "cpu", "walk ns/line",
+                "sum GB/s", "loads/line", "remote/line", "remote");
+    for (size_t mem = 0; mem < nodes; mem++) {
+        NodeBufferPool& pool = numa.pool(mem);
+        std::vector<uint8_t*> bufs(chunks);
+        // Touched first on its own node, in case mbind() is not allowed:
+        // each line points to the next of a random cycle through all of them
+        on_node(numa, mem, [&] {
+            for (auto& b : bufs) b = static_cast<uint8_t*>(pool.allocate(chunk));
+            std::vector<uint32_t> order(lines);
+            for (size_t i = 0; i < lines; i++) order[i] = static_cast<uint32_t>(i);
+            uint64_t rng = 0x9e3779b97f4a7c15ull;
+            for (size_t i = lines - 1; i > 0; i--) std::swap(order[i], order[xorshift(rng) % (i + 1)]);
+            auto line = [&](size_t n) {
+                return bufs[n / lines_per_chunk] + (n % lines_per_chunk) * kLine;
+            };
+            for (size_t i = 0; i < lines; i++) {
+                uint8_t* here = line(order[i]);
+                std::memset(here, static_cast<int>(i), kLine);
+                uint8_t* next = line(order[(i + 1) % lines]);
+                std::memcpy(here, &next, sizeof(next));
+            }
+        });
+
+        for (size_t cpu = 0; cpu < nodes; cpu++) {
+            if (numa.topology().node(cpu).cpus.empty()) continue;
+            double walk_ns = 0, gbps = 0;
+            NodeLoads walk_loads;
+            on_node(numa, cpu, [&] {
+                NodeLoadCounters counters;
+                uint8_t* p = bufs[0];
+                counters.start();
+                auto start = Clock::now();
+                for (size_t i = 0; i < lines; i++) std::memcpy(&p, p, sizeof(p));
+                auto end = Clock::now();
+                walk_loads = counters.stop();
+                walk_ns = std::chrono::duration<double, std::nano>(end - start).count() / lines;
+                if (p == nullptr) std::printf("\n");  // keep the walk
+
+                uint64_t sum = 0;
+                start = Clock::now();
+                for (uint8_t* b : bufs) {
+                    const uint64_t* w = reinterpret_cast<const uint64_t*>(b);
+                    for (size_t i = 0; i < chunk / sizeof(uint64_t); i++) sum += w[i];
+                }
+                end = Clock::now();
+                gbps = static_cast<double>(chunks * chunk) /
+                       std::chrono::duration<double, std::nano>(end - start).count();
+                if (sum == 42) std::printf("\n");
+            });
+            std::printf("%-6d %-6d %12.1f %10.2f %12s %12s %8s\n", numa.topology().node(mem).id,
+                        numa.topology().node(cpu).id, walk_ns, gbps,
+                        per_op(walk_loads.loads, lines).c_str(),
+                        per_op(walk_loads.misses, lines).c_str(), remote_pct(walk_loads).c_str());
+            std::fflush(stdout);
+        }
+        for (uint8_t* b : bufs) pool.deallocate(b, chunk);
+    }
+}
+
+static int connect_loopback(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int run_rpc(NumaPlacement& numa, double seconds, int connections, size_t io_size) {
+    // Inherited by the server's threads, which start after it
+    NodeLoadCounters counters(true);
+    counters.start();
+
+    RpcServer server;
+    RpcProgramHandlers handlers;
+    // Reads the payload the way a WRITE does, and answers with as much
+    handlers.procedures[1] = [](const RpcCallHeader&, XdrDecoder& args, XdrEncoder& reply) {
+        uint32_t len = args.decode_uint32();
+        const uint8_t* data = args.current();
+        uint64_t sum = 0;
+        for (uint32_t i = 0; i < len; i += sizeof(uint64_t)) {
+            uint64_t w;
+            std::memcpy(&w, data + i, sizeof(w));
+            sum += w;
+        }
+        args.skip(len);
+        reply.encode_uint64(sum);
+        reply.encode_opaque(data, len);
+    };
+    server.register_program(kProgram, 1, std::move(handlers));
+    server.set_numa(&numa);
+    server.start(0);
+
+    XdrEncoder call;
+    call.encode_uint32(0);  // xid
+    call.encode_uint32(static_cast<uint32_t>(RpcMsgType::CALL));
+    call.encode_uint32(2);
+    call.encode_uint32(kProgram);
+    call.encode_uint32(1);
+    call.encode_uint32(1);
+    call.encode_uint32(0);  // AUTH_NONE credential and verifier
+    call.encode_uint32(0);
+    call.encode_uint32(0);
+    call.encode_uint32(0);
+    std::vector<uint8_t> payload(io_size & ~size_t(7), 0x5a);
+    call.encode_opaque(payload.data(), payload.size());
+    std::vector<uint8_t> framed(4 + call.size());
+    const uint32_t marker = htonl(static_cast<uint32_t>(call.size()) | 0x80000000u);
+    std::memcpy(framed.data(), &marker, 4);
+    std::memcpy(framed.data() + 4, call.data().data(), call.size());
+
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> calls{0};
+    std::atomic<int> failed{0};
+    std::vector<std::thread> clients;
+    for (int c = 0; c < connections; c++) {
+        clients.emplace_back([&] {
+            int fd = connect_loopback(server.port());
+            if (fd < 0) {
+                failed++;
+                return;
+            }
+            std::vector<uint8_t> reply(8 + 4 + 8 + 4 + framed.size() + 64);
+            while (!stop.load(std::memory_order_relaxed)) {
+                uint32_t hdr;
+                if (send(fd, framed.data(), framed.size(), MSG_NOSIGNAL) !=
+                        static_cast<ssize_t>(framed.size()) ||
+                    recv(fd, &hdr, 4, MSG_WAITALL) != 4) {
+                    failed++;
+                    break;
+                }
+                const size_t len = ntohl(hdr) & 0x7FFFFFFF;
+                if (len > reply.size() ||
+                    recv(fd, reply.data(), len, MSG_WAITALL) != static_cast<ssize_t>(len)) {
+                    failed++;
+                    break;
+                }
+                calls.fetch_add(1, std::memory_order_relaxed);
+            }
+            close(fd);
+        });
+    }
+    auto start = Clock::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& t : clients) t.join();
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    server.stop();
+    NodeLoads loads = counters.stop();
+
+    const double n = static_cast<double>(std::max<uint64_t>(1, calls.load()));
+    std::printf("rpc: %d connections, %zu byte calls: %.0f calls/s, loads/call %s, "
+                "remote/call %s, remote %s\n",
+                connections, payload.size(), calls.load() / elapsed, per_op(loads.loads, n).c_str(),
+                per_op(loads.misses, n).c_str(), remote_pct(loads).c_str());
+    for (size_t i = 0; i < numa.topology().nodes(); i++)
+        std::printf("node %d: %llu connections by incoming CPU, %llu by load\n",
+                    numa.topology().node(i).id,
+                    static_cast<unsigned long long>(numa.placed_by_cpu(i)),
+                    static_cast<unsigned long long>(numa.placed_by_load(i)));
+    if (failed) {
+        std::fprintf(stderr, "%d connections failed\n", failed.load());
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::string mode = "both";
+    size_t mb = 256;
+    double seconds = 2;
+    int connections = 4;
+    size_t io_size = 32768;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--mode" && i + 1 < argc)
+            mode = argv[++i];
+        else if (arg == "--mb" && i + 1 < argc)
+            mb = static_cast<size_t>(std::max(2, std::atoi(argv[++i])));
+        else if (arg == "--seconds" && i + 1 < argc)
+            seconds = std::max(0.01, std::atof(argv[++i]));
+        else if (arg == "--connections" && i + 1 < argc)
+            connections = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--io-size" && i + 1 < argc)
+            io_size = static_cast<size_t>(std::max(8, std::atoi(argv[++i])));
+        else {
+            std::fprintf(stderr, "unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+    if (mode != "buffers" && mode != "rpc" && mode != "both") {
+        std::fprintf(stderr, "--mode takes buffers, rpc or both\n");
+        return 1;
+    }
+
+    NumaPlacement numa(NumaTopology::discover());
+    std::printf("nodes:");
+    for (size_t i = 0; i < numa.topology().nodes(); i++)
+        std::printf(" %d (%zu CPUs)", numa.topology().node(i).id,
+                    numa.topology().node(i).cpus.size());
+    std::printf("\n");
+
+    int rc = 0;
+    if (mode != "rpc") run_buffers(numa, mb);
+    if (mode != "buffers") rc = run_rpc(numa, seconds, connections, io_size);
+    print_pools(numa);
+    return rc;
+}
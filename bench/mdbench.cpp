@@ -0,0 +1,707 @@
+// Metadata-storm and huge-directory benchmark.
+//
+// Serves --export DIR (default: a temporary directory) from LocalFs through
+// MOUNT3 and NFSv3 on an RpcServer at an ephemeral port in this process,
+// builds a directory of --entries files and a tree on it, and times the
+// metadata paths that hurt most in production:
+//
+//   phases (--phases, default all, in this order)
+//     readdir     — one full listing of the big directory with READDIR
+//     readdirplus — the same with READDIRPLUS
+//     lookup      — --threads clients LOOKUP random names in the big
+//                   directory for --seconds; --lookup-miss percent of them
+//                   do not exist
+//     create      — --threads clients CREATE --creates files in one
+//                   directory
+//     rename      — those clients RENAME their files back and forth in that
+//                   directory for --seconds
+//     unlink      — and REMOVE them
+//     walk        — a find-style walk of a --tree-depth / --tree-fanout tree
+//                   with --tree-files files per directory: READDIRPLUS each
+//                   directory, LOOKUP each entry, descend into directories
+//
+// Listings stop at --seconds too, and are then reported incomplete: on a
+// huge directory that is itself the finding.
+//
+// The big directory and the tree are built with local system calls before
+// any phase and are not timed over NFS (their build rate is reported). For
+// every phase the report has ops/s, errors and mean/p50/p90/p99/p999/max
+// latency in microseconds, the system calls LocalFs made on the export
+// (LocalFs::Syscall) in total and per op, the growth of the handle-to-path
+// cache (entries and estimated bytes) and the growth of this process's
+// resident memory. It is one JSON document on stdout (or --json FILE). The
+// exit status is non-zero if setup fails or any call fails.
+//
+// Usage: mdbench [--export DIR] [--phases LIST] [--entries N] [--threads N]
+//                [--seconds S] [--lookup-miss PCT] [--creates N]
+//                [--tree-depth N] [--tree-fanout N] [--tree-files N]
+//                [--json FILE] [--keep]
+//
+// Counts accept K, M and G suffixes (powers of 1024).
+
+#include "bench_client.h"
+#include "mount/mount_server.h"
+#include "mount/mount_types.h"
+#include "nfs/nfs_server.h"
+#include "nfs/nfs_types.h"
+#include "rpc/rpc_server.h"
+#include "stats/latency_stats.h"
+#include "vfs/local_fs.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+enum class Phase : uint8_t { READDIR, READDIRPLUS, LOOKUP, CREATE, RENAME, UNLINK, WALK, COUNT };
+static constexpr size_t kPhases = static_cast<size_t>(Phase::COUNT);
+
+static const char* const kPhaseNames[kPhases] = {
+    "readdir", "readdirplus", "lookup", "create", "rename", "unlink", "walk"};
+
+struct Config {
+    std::string export_dir;
+    std::array<bool, kPhases> phases{};
+    uint64_t entries = 10000;
+    uint32_t threads = 4;
+    double seconds = 5;
+    uint32_t lookup_miss = 20;  // percent
+    uint64_t creates = 10000;
+    uint32_t tree_depth = 3;
+    uint32_t tree_fanout = 8;
+    uint32_t tree_files = 16;
+    std::string json_path;
+    bool keep = false;
+
+    bool uses(Phase p) const { return phases[static_cast<size_t>(p)]; }
+};
+
+// "readdir,lookup,walk"
+static bool parse_phases(const std::string& spec, std::array<bool, kPhases>& phases) {
+    phases.fill(false);
+    size_t pos = 0;
+    bool any = false;
+    while (pos < spec.size()) {
+        size_t comma = spec.find(',', pos);
+        if (comma == std::string::npos) comma = spec.size();
+        std::string name = spec.substr(pos, comma - pos);
+        pos = comma + 1;
+        size_t p = 0;
+        while (p < kPhases && name != kPhaseNames[p]) p++;
+        if (p == kPhases) return false;
+        phases[p] = any = true;
+    }
+    return any;
+}
+
+static std::string entry_name(uint64_t i) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "entry%09llu", static_cast<unsigned long long>(i));
+    return name;
+}
+
+// --- Local build ---
+
+// --entries empty files in big/, split across threads
+static bool build_big(const Config& cfg, const std::string& dir) {
+    std::atomic<bool> ok{true};
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < cfg.threads; t++) {
+        threads.emplace_back([&, t] {
+            for (uint64_t i = t; i < cfg.entries && ok; i += cfg.threads) {
+                std::string path = dir + "/" + entry_name(i);
+                int fd = ::open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+                if (fd < 0) {
+                    std::fprintf(stderr, "mdbench: %s: %s\n", path.c_str(), std::strerror(errno));
+                    ok = false;
+                    break;
+                }
+                ::close(fd);
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    return ok;
+}
+
+// d<i> directories --tree-depth deep, --tree-files files f<j> in each
+static bool build_tree(const Config& cfg, const std::string& dir, uint32_t depth,
+                       uint64_t& objects) {
+    for (uint32_t j = 0; j < cfg.tree_files; j++) {
+        std::string path = dir + "/f" + std::to_string(j);
+        int fd = ::open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+        if (fd < 0) return false;
+        ::close(fd);
+        objects++;
+    }
+    if (depth == 0) return true;
+    for (uint32_t i = 0; i < cfg.tree_fanout; i++) {
+        std::string sub = dir + "/d" + std::to_string(i);
+        if (::mkdir(sub.c_str(), 0755) != 0) return false;
+        objects++;
+        if (!build_tree(cfg, sub, depth - 1, objects)) return false;
+    }
+    return true;
+}
+
+// --- Measurement ---
+
+// Resident set size of this process (server included), in KiB
+static uint64_t rss_kb() {
+    FILE* f = std::fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    unsigned long long size = 0, resident = 0;
+    int n = std::fscanf(f, "%llu %llu", &size, &resident);
+    std::fclose(f);
+    return n == 2 ? resident * (static_cast<uint64_t>(sysconf(_SC_PAGESIZE)) / 1024) : 0;
+}
+
+// Server-side state sampled around a phase
+struct ServerSample {
+    std::array<uint64_t, LocalFs::kSyscalls> syscalls{};
+    LocalFs::CacheFootprint cache;
+    uint64_t rss_kb = 0;
+};
+
+static ServerSample sample(LocalFs& fs) {
+    ServerSample s;
+    for (size_t i = 0; i < LocalFs::kSyscalls; i++)
+        s.syscalls[i] = fs.syscalls(static_cast<LocalFs::Syscall>(i));
+    s.cache = fs.cache_footprint();
+    s.rss_kb = rss_kb();
+    return s;
+}
+
+// One thread's share of a phase
+struct Worker {
+    LatencyHistogram latency;
+    uint64_t ops = 0;
+    uint64_t errors = 0;
+    uint64_t hits = 0;     // lookup: found
+    uint64_t misses = 0;   // lookup: NFS3ERR_NOENT
+    uint64_t entries = 0;  // listings and walk: entries seen
+};
+
+struct PhaseResult {
+    bool ran = false;
+    bool complete = true;  // listings and walk: reached the end in time
+    double seconds = 0;
+    uint64_t ops = 0;
+    uint64_t errors = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t entries = 0;
+    LatencySnapshot latency;
+    ServerSample before;
+    ServerSample after;
+};
+
+// A timed NFSv3 call: false (and an error counted) if the RPC itself fails
+static bool timed_call(RpcConnection& conn, Worker& w, uint32_t proc, const XdrEncoder& args,
+                       std::vector<uint8_t>& body) {
+    uint64_t start = LatencyStats::now_ns();
+    bool ok = conn.call(NFS_PROGRAM, NFS_V3, proc, args, body);
+    w.latency.record(LatencyStats::now_ns() - start);
+    w.ops++;
+    if (!ok) w.errors++;
+    return ok;
+}
+
+// --- Phases ---
+
+struct Tree {
+    FileHandle root;
+    FileHandle work;
+    FileHandle big;
+    FileHandle churn;
+    FileHandle tree;
+    uint64_t tree_objects = 0;
+};
+
+// Files of one create/rename/unlink client: current names
+struct ChurnFiles {
+    std::vector<std::string> names;
+};
+
+static void list_dir(RpcConnection& conn, const FileHandle& dir, bool plus, uint64_t deadline,
+                     Worker& w, bool& complete) {
+    uint64_t cookie = 0;
+    uint64_t verf = 0;
+    std::vector<uint8_t> body;
+    for (;;) {
+        if (LatencyStats::now_ns() > deadline) {
+            complete = false;
+            return;
+        }
+        // RFC 1813 §3.3.16 / §3.3.17 - READDIR3args / READDIRPLUS3args
+        XdrEncoder args;
+        encode_fh3(args, dir);
+        args.encode_uint64(cookie);
+        args.encode_uint64(verf);
+        if (plus) args.encode_uint32(8192);  // dircount
+        args.encode_uint32(65536);           // count / maxcount
+        if (!timed_call(conn, w, plus ? NFSPROC3_READDIRPLUS : NFSPROC3_READDIR, args, body))
+            return;
+        ReaddirplusPage page;
+        NfsStat3 st = plus ? decode_readdirplus_reply(body.data(), body.size(), page)
+                           : decode_readdir_reply(body.data(), body.size(), page);
+        if (st != NfsStat3::NFS3_OK) {
+            w.errors++;
+            return;
+        }
+        w.entries += page.entries;
+        if (page.eof || !page.entries) return;
+        cookie = page.last_cookie;
+        verf = page.cookieverf;
+    }
+}
+
+static void lookup_storm(const Config& cfg, RpcConnection& conn, const Tree& tree,
+                         uint64_t deadline, uint32_t id, Worker& w) {
+    uint64_t rng = 0x9e3779b97f4a7c15ull * (id + 1);
+    std::vector<uint8_t> body;
+    while (LatencyStats::now_ns() < deadline) {
+        bool miss = xorshift(rng) % 100 < cfg.lookup_miss;
+        uint64_t i = xorshift(rng) % cfg.entries;
+        XdrEncoder args;
+        encode_fh3(args, tree.big);
+        args.encode_string(miss ? "missing" + std::to_string(i) : entry_name(i));
+        if (!timed_call(conn, w, NFSPROC3_LOOKUP, args, body)) return;
+        FileHandle fh;
+        NfsStat3 st = decode_lookup_reply(body.data(), body.size(), fh);
+        if (st == NfsStat3::NFS3_OK && !miss) w.hits++;
+        else if (st == NfsStat3::NFS3ERR_NOENT && miss) w.misses++;
+        else w.errors++;
+    }
+}
+
+static void create_files(const Config& cfg, RpcConnection& conn, const Tree& tree,
+                         uint64_t deadline, uint32_t id, ChurnFiles& files, Worker& w) {
+    std::vector<uint8_t> body;
+    for (uint64_t i = id; i < cfg.creates && LatencyStats::now_ns() < deadline;
+         i += cfg.threads) {
+        std::string name = "c" + std::to_string(id) + "." + std::to_string(i);
+        XdrEncoder args;
+        encode_fh3(args, tree.churn);
+        args.encode_string(name);
+        args.encode_uint32(UNCHECKED);
+        encode_sattr3_mode(args, 0644);
+        if (!timed_call(conn, w, NFSPROC3_CREATE, args, body)) return;
+        FileHandle fh;
+        if (decode_create_reply(body.data(), body.size(), fh) != NfsStat3::NFS3_OK) {
+            w.errors++;
+            continue;
+        }
+        files.names.push_back(name);
+    }
+}
+
+// name <-> name.r, one file after another
+static void rename_churn(RpcConnection& conn, const Tree& tree, uint64_t deadline,
+                         ChurnFiles& files, Worker& w) {
+    std::vector<uint8_t> body;
+    for (size_t i = 0; !files.names.empty() && LatencyStats::now_ns() < deadline;
+         i = (i + 1) % files.names.size()) {
+        std::string& name = files.names[i];
+        std::string to = name.size() > 2 && name.compare(name.size() - 2, 2, ".r") == 0
+                             ? name.substr(0, name.size() - 2)
+                             : name + ".r";
+        // RFC 1813 §3.3.14 - RENAME3args: from and to diropargs3
+        XdrEncoder args;
+        encode_fh3(args, tree.churn);
+        args.encode_string(name);
+        encode_fh3(args, tree.churn);
+        args.encode_string(to);
+        if (!timed_call(conn, w, NFSPROC3_RENAME, args, body)) return;
+        if (decode_status(body.data(), body.size()) != NfsStat3::NFS3_OK) w.errors++;
+        else name = to;
+    }
+}
+
+static void unlink_files(RpcConnection& conn, const Tree& tree, ChurnFiles& files, Worker& w) {
+    std::vector<uint8_t> body;
+    for (const auto& name : files.names) {
+        XdrEncoder args;
+        encode_fh3(args, tree.churn);
+        args.encode_string(name);
+        if (!timed_call(conn, w, NFSPROC3_REMOVE, args, body)) return;
+        if (decode_status(body.data(), body.size()) != NfsStat3::NFS3_OK) w.errors++;
+    }
+    files.names.clear();
+}
+
+// Breadth first, as find(1) sees a tree when it has to stat every entry
+static void walk_tree(RpcConnection& conn, const FileHandle& top, uint64_t deadline, Worker& w,
+                      bool& complete) {
+    std::deque<FileHandle> dirs{top};
+    std::vector<uint8_t> body;
+    std::vector<std::string> names;
+    while (!dirs.empty()) {
+        FileHandle dir = dirs.front();
+        dirs.pop_front();
+        uint64_t cookie = 0;
+        uint64_t verf = 0;
+        names.clear();
+        for (;;) {
+            if (LatencyStats::now_ns() > deadline) {
+                complete = false;
+                return;
+            }
+            XdrEncoder args;
+            encode_fh3(args, dir);
+            args.encode_uint64(cookie);
+            args.encode_uint64(verf);
+            args.encode_uint32(8192);
+            args.encode_uint32(65536);
+            if (!timed_call(conn, w, NFSPROC3_READDIRPLUS, args, body)) return;
+            ReaddirplusPage page;
+            if (decode_readdirplus_reply(body.data(), body.size(), page, &names) !=
+                NfsStat3::NFS3_OK) {
+                w.errors++;
+                break;
+            }
+            if (page.eof || !page.entries) break;
+            cookie = page.last_cookie;
+            verf = page.cookieverf;
+        }
+        for (const auto& name : names) {
+            if (name == "." || name == "..") continue;
+            XdrEncoder args;
+            encode_fh3(args, dir);
+            args.encode_string(name);
+            if (!timed_call(conn, w, NFSPROC3_LOOKUP, args, body)) return;
+            FileHandle fh;
+            Ftype3 type = Ftype3::NF3REG;
+            if (decode_lookup_reply(body.data(), body.size(), fh, &type) != NfsStat3::NFS3_OK) {
+                w.errors++;
+                continue;
+            }
+            w.entries++;
+            if (type == Ftype3::NF3DIR) dirs.push_back(fh);
+        }
+    }
+}
+
+// --- Report ---
+
+static void write_phase(FILE* out, const char* name, const PhaseResult& r, bool first) {
+    double secs = r.seconds > 0 ? r.seconds : 1e-9;
+    std::fprintf(out, "%s\n    \"%s\": {\"ops\": %llu, \"errors\": %llu, \"seconds\": %.3f, "
+                 "\"ops_per_sec\": %.1f, ",
+                 first ? "" : ",", name, static_cast<unsigned long long>(r.ops),
+                 static_cast<unsigned long long>(r.errors), r.seconds, r.ops / secs);
+    if (r.entries)
+        std::fprintf(out, "\"entries\": %llu, \"entries_per_sec\": %.1f, \"complete\": %s, ",
+                     static_cast<unsigned long long>(r.entries), r.entries / secs,
+                     r.complete ? "true" : "false");
+    if (r.hits || r.misses)
+        std::fprintf(out, "\"hits\": %llu, \"misses\": %llu, \"hit_rate\": %.4f, ",
+                     static_cast<unsigned long long>(r.hits),
+                     static_cast<unsigned long long>(r.misses),
+                     static_cast<double>(r.hits) / (r.hits + r.misses));
+    write_latency_json(out, r.latency);
+
+    uint64_t total = 0;
+    std::fprintf(out, ",\n      \"syscalls\": {");
+    bool first_call = true;
+    for (size_t i = 0; i < LocalFs::kSyscalls; i++) {
+        uint64_t n = r.after.syscalls[i] - r.before.syscalls[i];
+        if (!n) continue;
+        total += n;
+        std::fprintf(out, "%s\"%s\": %llu", first_call ? "" : ", ",
+                     LocalFs::syscall_name(static_cast<LocalFs::Syscall>(i)),
+                     static_cast<unsigned long long>(n));
+        first_call = false;
+    }
+    std::fprintf(out, "}, \"syscalls_per_op\": %.2f,\n", r.ops ? double(total) / r.ops : 0.0);
+    std::fprintf(out,
+                 "      \"fh_cache\": {\"entries_before\": %zu, \"entries_after\": %zu, "
+                 "\"bytes_before\": %zu, \"bytes_after\": %zu}, \"rss_kb_growth\": %lld}",
+                 r.before.cache.entries, r.after.cache.entries, r.before.cache.bytes,
+                 r.after.cache.bytes,
+                 static_cast<long long>(r.after.rss_kb) - static_cast<long long>(r.before.rss_kb));
+}
+
+static void write_report(FILE* out, const Config& cfg, double build_seconds,
+                         uint64_t tree_objects, const std::array<PhaseResult, kPhases>& results) {
+    std::fprintf(out, "{\n");
+    std::fprintf(out, "  \"export\": \"%s\",\n", cfg.export_dir.c_str());
+    std::fprintf(out,
+                 "  \"entries\": %llu, \"threads\": %u, \"seconds\": %.3f, \"lookup_miss_pct\": "
+                 "%u, \"creates\": %llu,\n",
+                 static_cast<unsigned long long>(cfg.entries), cfg.threads, cfg.seconds,
+                 cfg.lookup_miss, static_cast<unsigned long long>(cfg.creates));
+    std::fprintf(out,
+                 "  \"tree\": {\"depth\": %u, \"fanout\": %u, \"files\": %u, \"objects\": %llu},\n",
+                 cfg.tree_depth, cfg.tree_fanout, cfg.tree_files,
+                 static_cast<unsigned long long>(tree_objects));
+    std::fprintf(out, "  \"build\": {\"seconds\": %.3f, \"objects_per_sec\": %.1f},\n",
+                 build_seconds,
+                 build_seconds > 0 ? (cfg.entries + tree_objects) / build_seconds : 0.0);
+    std::fprintf(out, "  \"phases\": {");
+    bool first = true;
+    for (size_t p = 0; p < kPhases; p++) {
+        if (!results[p].ran) continue;
+        write_phase(out, kPhaseNames[p], results[p], first);
+        first = false;
+    }
+    std::fprintf(out, "\n  }\n}\n");
+}
+
+// --- Main ---
+
+static void usage() {
+    std::fprintf(stderr,
+                 "usage: mdbench [--export DIR] [--phases LIST] [--entries N] [--threads N]\n"
+                 "               [--seconds S] [--lookup-miss PCT] [--creates N]\n"
+                 "               [--tree-depth N] [--tree-fanout N] [--tree-files N]\n"
+                 "               [--json FILE] [--keep]\n"
+                 "phases:");
+    for (const char* name : kPhaseNames) std::fprintf(stderr, " %s", name);
+    std::fprintf(stderr, "\n");
+}
+
+static bool parse_args(int argc, char* argv[], Config& cfg) {
+    cfg.phases.fill(true);
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        uint64_t v = 0;
+        auto size_arg = [&](uint64_t& out) {
+            return has_value && parse_size(argv[++i], out);
+        };
+        if (arg == "--export" && has_value) cfg.export_dir = argv[++i];
+        else if (arg == "--phases" && has_value) {
+            if (!parse_phases(argv[++i], cfg.phases)) {
+                std::fprintf(stderr, "mdbench: bad --phases: %s\n", argv[i]);
+                return false;
+            }
+        }
+        else if (arg == "--entries" && size_arg(v)) cfg.entries = v;
+        else if (arg == "--threads" && size_arg(v)) cfg.threads = static_cast<uint32_t>(v);
+        else if (arg == "--seconds" && has_value) cfg.seconds = std::atof(argv[++i]);
+        else if (arg == "--lookup-miss" && size_arg(v)) cfg.lookup_miss = static_cast<uint32_t>(v);
+        else if (arg == "--creates" && size_arg(v)) cfg.creates = v;
+        else if (arg == "--tree-depth" && size_arg(v)) cfg.tree_depth = static_cast<uint32_t>(v);
+        else if (arg == "--tree-fanout" && size_arg(v)) cfg.tree_fanout = static_cast<uint32_t>(v);
+        else if (arg == "--tree-files" && size_arg(v)) cfg.tree_files = static_cast<uint32_t>(v);
+        else if (arg == "--json" && has_value) cfg.json_path = argv[++i];
+        else if (arg == "--keep") cfg.keep = true;
+        else {
+            std::fprintf(stderr, "mdbench: bad argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    if (!cfg.entries || !cfg.threads || cfg.lookup_miss > 100 || cfg.seconds <= 0) {
+        std::fprintf(stderr,
+                     "mdbench: --entries and --threads must be non-zero, --seconds positive "
+                     "and --lookup-miss at most 100\n");
+        return false;
+    }
+    return true;
+}
+
+// Run fn(thread, connection, worker) on every client thread and merge the
+// workers into the phase result
+template <typename Fn>
+static void run_parallel(std::vector<std::unique_ptr<RpcConnection>>& conns, PhaseResult& r,
+                         Fn fn) {
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < conns.size(); t++) {
+        workers.push_back(std::make_unique<Worker>());
+        threads.emplace_back([&, t] { fn(static_cast<uint32_t>(t), *conns[t], *workers[t]); });
+    }
+    for (auto& t : threads) t.join();
+    for (const auto& w : workers) {
+        w->latency.add_to(r.latency);
+        r.ops += w->ops;
+        r.errors += w->errors;
+        r.hits += w->hits;
+        r.misses += w->misses;
+        r.entries += w->entries;
+    }
+}
+
+static bool lookup_fh(RpcConnection& conn, const FileHandle& dir, const std::string& name,
+                      FileHandle& out) {
+    XdrEncoder args;
+    encode_fh3(args, dir);
+    args.encode_string(name);
+    std::vector<uint8_t> body;
+    return conn.call(NFS_PROGRAM, NFS_V3, NFSPROC3_LOOKUP, args, body) &&
+           decode_lookup_reply(body.data(), body.size(), out) == NfsStat3::NFS3_OK;
+}
+
+static int run(Config& cfg) {
+    raise_fd_limit();
+
+    std::string temp_dir;
+    if (cfg.export_dir.empty()) {
+        char tmpl[] = "/tmp/mdbench_XXXXXX";
+        if (!mkdtemp(tmpl)) {
+            std::fprintf(stderr, "mdbench: mkdtemp: %s\n", std::strerror(errno));
+            return 1;
+        }
+        temp_dir = cfg.export_dir = tmpl;
+    }
+    LocalFs fs(cfg.export_dir);
+    MountServer mount_srv(fs, std::vector<std::string>{cfg.export_dir});
+    NfsServer nfs_srv(fs);
+    RpcServer rpc;
+    rpc.register_program(MOUNT_PROGRAM, MOUNT_V3, mount_srv.get_handlers());
+    rpc.register_program(NFS_PROGRAM, NFS_V3, nfs_srv.get_handlers());
+    rpc.start(0);
+
+    // Build the work directory locally
+    const std::string work_name = "mdbench." + std::to_string(getpid());
+    const std::string work = cfg.export_dir + "/" + work_name;
+    bool want_big = cfg.uses(Phase::READDIR) || cfg.uses(Phase::READDIRPLUS) ||
+                    cfg.uses(Phase::LOOKUP);
+    Tree tree;
+    int rc = 1;
+    uint64_t build_start = LatencyStats::now_ns();
+    bool built = ::mkdir(work.c_str(), 0755) == 0 && ::mkdir((work + "/big").c_str(), 0755) == 0 &&
+                 ::mkdir((work + "/churn").c_str(), 0755) == 0 &&
+                 ::mkdir((work + "/tree").c_str(), 0755) == 0;
+    if (built && want_big) built = build_big(cfg, work + "/big");
+    if (built && cfg.uses(Phase::WALK))
+        built = build_tree(cfg, work + "/tree", cfg.tree_depth, tree.tree_objects);
+    double build_seconds = (LatencyStats::now_ns() - build_start) / 1e9;
+
+    std::vector<std::unique_ptr<RpcConnection>> conns;
+    std::string err;
+    for (uint32_t t = 0; built && t < cfg.threads; t++) {
+        conns.push_back(std::make_unique<RpcConnection>());
+        if (!conns.back()->connect("127.0.0.1", rpc.port(), err)) {
+            std::fprintf(stderr, "mdbench: connect: %s\n", err.c_str());
+            built = false;
+        }
+        conns.back()->set_auth_sys("mdbench", 0, 0);
+    }
+
+    if (!built) {
+        std::fprintf(stderr, "mdbench: setup failed\n");
+    } else {
+        // RFC 1813 §A.5.2 - MNT, then the work directories by name
+        RpcConnection& conn = *conns[0];
+        XdrEncoder mnt;
+        mnt.encode_string("/");
+        std::vector<uint8_t> body;
+        bool mounted = conn.call(MOUNT_PROGRAM, MOUNT_V3, MOUNTPROC3_MNT, mnt, body) &&
+                       decode_mnt_reply(body.data(), body.size(), tree.root) &&
+                       lookup_fh(conn, tree.root, work_name, tree.work) &&
+                       lookup_fh(conn, tree.work, "big", tree.big) &&
+                       lookup_fh(conn, tree.work, "churn", tree.churn) &&
+                       lookup_fh(conn, tree.work, "tree", tree.tree);
+        if (!mounted) {
+            std::fprintf(stderr, "mdbench: setup: MNT or LOOKUP of the work directory failed\n");
+        } else {
+            std::array<PhaseResult, kPhases> results{};
+            std::vector<ChurnFiles> churn(cfg.threads);
+            uint64_t total_errors = 0;
+            for (size_t p = 0; p < kPhases; p++) {
+                if (!cfg.phases[p]) continue;
+                Phase phase = static_cast<Phase>(p);
+                PhaseResult& r = results[p];
+                r.ran = true;
+                r.before = sample(fs);
+                uint64_t start = LatencyStats::now_ns();
+                uint64_t deadline = start + static_cast<uint64_t>(cfg.seconds * 1e9);
+                switch (phase) {
+                    case Phase::READDIR:
+                    case Phase::READDIRPLUS: {
+                        Worker w;
+                        list_dir(conn, tree.big, phase == Phase::READDIRPLUS, deadline, w,
+                                 r.complete);
+                        w.latency.add_to(r.latency);
+                        r.ops = w.ops;
+                        r.errors = w.errors;
+                        r.entries = w.entries;
+                        break;
+                    }
+                    case Phase::LOOKUP:
+                        run_parallel(conns, r, [&](uint32_t t, RpcConnection& c, Worker& w) {
+                            lookup_storm(cfg, c, tree, deadline, t, w);
+                        });
+                        break;
+                    case Phase::CREATE:
+                        run_parallel(conns, r, [&](uint32_t t, RpcConnection& c, Worker& w) {
+                            create_files(cfg, c, tree, UINT64_MAX, t, churn[t], w);
+                        });
+                        break;
+                    case Phase::RENAME:
+                        run_parallel(conns, r, [&](uint32_t t, RpcConnection& c, Worker& w) {
+                            rename_churn(c, tree, deadline, churn[t], w);
+                        });
+                        break;
+                    case Phase::UNLINK:
+                        run_parallel(conns, r, [&](uint32_t t, RpcConnection& c, Worker& w) {
+                            unlink_files(c, tree, churn[t], w);
+                        });
+                        break;
+                    case Phase::WALK: {
+                        Worker w;
+                        walk_tree(conn, tree.tree, deadline, w, r.complete);
+                        w.latency.add_to(r.latency);
+                        r.ops = w.ops;
+                        r.errors = w.errors;
+                        r.entries = w.entries;
+                        break;
+                    }
+                    case Phase::COUNT:
+                        break;
+                }
+                r.seconds = (LatencyStats::now_ns() - start) / 1e9;
+                r.after = sample(fs);
+                total_errors += r.errors;
+            }
+
+            FILE* out = stdout;
+            if (!cfg.json_path.empty()) out = std::fopen(cfg.json_path.c_str(), "w");
+            if (!out) {
+                std::fprintf(stderr, "mdbench: %s: %s\n", cfg.json_path.c_str(),
+                             std::strerror(errno));
+            } else {
+                write_report(out, cfg, build_seconds, tree.tree_objects, results);
+                if (out != stdout) std::fclose(out);
+                rc = total_errors == 0 ? 0 : 1;
+            }
+        }
+    }
+    conns.clear();
+    rpc.stop();
+
+    if (!cfg.keep) {
+        std::string cmd = "rm -rf " + (temp_dir.empty() ? work : temp_dir);
+        if (std::system(cmd.c_str()) != 0)
+            std::fprintf(stderr, "mdbench: could not remove %s\n", work.c_str());
+    }
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    Config cfg;
+    if (!parse_args(argc, argv, cfg)) {
+        usage();
+        return 2;
+    }
+    try {
+        return run(cfg);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "mdbench: %s\n", e.what());
+        return 1;
+    }
+}
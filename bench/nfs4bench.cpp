@@ -0,0 +1,1289 @@
+// NFSv4.1 load generator.
+//
+// Simulates --clients NFSv4.1 clients, each with its own TCP connection
+// and session: EXCHANGE_ID, CREATE_SESSION asking for --slots fore channel
+// slots with the backchannel on the same connection (CONN_BACK_CHAN), then
+// RECLAIM_COMPLETE. Every granted slot drives a chain of COMPOUNDs, each
+// led by SEQUENCE, so a client has at most as many calls in flight as the
+// server granted it slots. --threads event-loop threads share the clients.
+//
+//   scenarios (--scenario)
+//     open-read-close — OPEN of a data file (with GETFH), READ of --io-size
+//                       bytes, CLOSE
+//     lock            — OPEN for read/write asking for no delegation, LOCK
+//                       of a random --io-size range, LOCKU, CLOSE
+//     getattr         — GETATTR revalidation of a data file (type, change,
+//                       size, fileid, mode, numlinks, time_modify)
+//     readdir         — READDIR walks of a --dir-entries directory asking
+//                       for type, size, fileid and time_modify per entry
+//     recall          — OPEN for read of the client's own file, which the
+//                       server answers with a read delegation, CLOSE; then
+//                       OPEN for write of the next client's file, which
+//                       recalls that client's delegation; CLOSE
+//     mixed           — open_read_close=40,getattr=30,lock=10,readdir=10,
+//                       recall=10
+//
+//   --mix scenario=weight,... picks chains at random by weight instead;
+//   scenarios are open_read_close lock getattr readdir recall.
+//
+// Delegations: a client answers CB_RECALL on its backchannel at once and
+// returns the delegation with DELEGRETURN on its next free slot. An OPEN
+// answered NFS4ERR_DELAY (a recall in progress) is retried after 1 ms.
+// "recall" is the time from the first delayed OPEN to the one that
+// succeeds; "cb_recall" the time from CB_RECALL arriving to DELEGRETURN
+// being answered.
+//
+// Target: a running nfsd (--host/--port, default 127.0.0.1:2049), or
+// --inprocess, which serves --export DIR (default: a temporary directory)
+// from LocalFs through NFSv4 on an RpcServer at an ephemeral port in this
+// process; there, --fault RULE (repeatable; see vfs/fault_vfs.h) degrades
+// the export's VFS calls.
+//
+// Setup is not timed: a work directory with --files data files of
+// --file-size bytes, one file per client for recall, and for readdir a
+// directory of --dir-entries files, all made over NFSv4.1 by a separate
+// setup client. The work directory is removed afterwards unless --keep.
+//
+// The report is one JSON document on stdout (or --json FILE): COMPOUNDs/s,
+// read MB/s, slots granted, delegation and recall counts, and per op the
+// count, errors and mean/p50/p90/p99/p999/max latency in microseconds. The
+// exit status is non-zero if setup fails, nothing completes, or any call
+// fails.
+//
+// Usage: nfs4bench [--host H] [--port P] [--inprocess] [--export DIR]
+//                  [--scenario NAME | --mix scenario=w,...] [--seconds S]
+//                  [--clients N] [--threads N] [--slots N]
+//                  [--io-size B] [--file-size B] [--files N] [--dir-entries N]
+//                  [--json FILE] [--keep] [--fault RULE]...
+//
+// Sizes accept K, M and G suffixes.
+
+#include "bench_client.h"
+#include "nfs4/nfs4_server.h"
+#include "nfs4/nfs4_types.h"
+#include "rpc/rpc_server.h"
+#include "rpc/rpc_types.h"
+#include "stats/latency_stats.h"
+#include "vfs/fault_vfs.h"
+#include "vfs/local_fs.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <poll.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+enum class Scenario : uint8_t { OPEN_READ_CLOSE, LOCK, GETATTR, READDIR, RECALL, COUNT };
+static constexpr size_t kScenarios = static_cast<size_t>(Scenario::COUNT);
+
+static const char* const kScenarioNames[kScenarios] = {
+    "open_read_close", "lock", "getattr", "readdir", "recall"};
+
+// Timed per COMPOUND, named for its main op; RECALL and CB_RECALL are
+// derived intervals, not COMPOUNDs
+enum class Step : uint8_t {
+    OPEN, READ, CLOSE, LOCK, LOCKU, GETATTR, READDIR, DELEGRETURN, RECALL, CB_RECALL, COUNT
+};
+static constexpr size_t kSteps = static_cast<size_t>(Step::COUNT);
+
+static const char* const kStepNames[kSteps] = {
+    "open", "read", "close", "lock", "locku", "getattr", "readdir", "delegreturn", "recall",
+    "cb_recall"};
+
+// The COMPOUNDs of each scenario, in order (COUNT ends a short chain)
+static constexpr size_t kMaxChain = 4;
+static const Step kChains[kScenarios][kMaxChain] = {
+    {Step::OPEN, Step::READ, Step::CLOSE, Step::COUNT},
+    {Step::OPEN, Step::LOCK, Step::LOCKU, Step::CLOSE},
+    {Step::GETATTR, Step::COUNT, Step::COUNT, Step::COUNT},
+    {Step::READDIR, Step::COUNT, Step::COUNT, Step::COUNT},
+    {Step::OPEN, Step::CLOSE, Step::OPEN, Step::CLOSE},
+};
+
+struct Workload {
+    const char* name;
+    const char* mix;
+};
+
+static const Workload kWorkloads[] = {
+    {"open-read-close", "open_read_close=1"},
+    {"lock", "lock=1"},
+    {"getattr", "getattr=1"},
+    {"readdir", "readdir=1"},
+    {"recall", "recall=1"},
+    {"mixed", "open_read_close=40,getattr=30,lock=10,readdir=10,recall=10"},
+};
+
+struct Config {
+    std::string host = "127.0.0.1";
+    uint16_t port = 2049;
+    bool inprocess = false;
+    std::string export_dir;
+    std::string scenario = "mixed";
+    std::string mix;
+    double seconds = 10;
+    uint32_t clients = 64;
+    uint32_t threads = 4;
+    uint32_t slots = 8;
+    uint32_t io_size = 4096;
+    uint64_t file_size = 1024 * 1024;
+    uint32_t files = 16;
+    uint32_t dir_entries = 1000;
+    std::string json_path;
+    std::vector<std::string> faults;
+    bool keep = false;
+
+    std::array<uint32_t, kScenarios> weights{};
+};
+
+// "open_read_close=40,lock=10": weight per scenario
+static bool parse_mix(const std::string& spec, std::array<uint32_t, kScenarios>& weights) {
+    weights.fill(0);
+    size_t pos = 0;
+    while (pos < spec.size()) {
+        size_t comma = spec.find(',', pos);
+        if (comma == std::string::npos) comma = spec.size();
+        std::string item = spec.substr(pos, comma - pos);
+        pos = comma + 1;
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) return false;
+        std::string name = item.substr(0, eq);
+        size_t sc = 0;
+        while (sc < kScenarios && name != kScenarioNames[sc]) sc++;
+        if (sc == kScenarios) return false;
+        weights[sc] = static_cast<uint32_t>(std::atoi(item.c_str() + eq + 1));
+    }
+    uint64_t total = 0;
+    for (uint32_t w : weights) total += w;
+    return total > 0;
+}
+
+static bool uses(const Config& cfg, Scenario sc) {
+    return cfg.weights[static_cast<size_t>(sc)] != 0;
+}
+
+// Attributes a client revalidates its cache with
+static void encode_getattr_bitmap(XdrEncoder& enc) {
+    encode_bitmap4(enc, {FATTR4_TYPE, FATTR4_CHANGE, FATTR4_SIZE, FATTR4_FILEID, FATTR4_MODE,
+                         FATTR4_NUMLINKS, FATTR4_TIME_MODIFY});
+}
+
+// RFC 8881 §18.16 - OPEN4args with CLAIM_NULL; create is UNCHECKED4 with
+// no attributes
+static void encode_open4(XdrEncoder& enc, uint64_t clientid, const std::vector<uint8_t>& owner,
+                         uint32_t access, bool create, const std::string& name) {
+    enc.encode_uint32(0);  // seqid (unused in v4.1)
+    enc.encode_uint32(access);
+    enc.encode_uint32(OPEN4_SHARE_DENY_NONE);
+    enc.encode_uint64(clientid);
+    enc.encode_opaque(owner.data(), owner.size());
+    enc.encode_uint32(create ? OPEN4_CREATE : OPEN4_NOCREATE);
+    if (create) {
+        enc.encode_uint32(UNCHECKED4);
+        enc.encode_uint32(0);  // createattrs: empty bitmap
+        enc.encode_uint32(0);  // and no values
+    }
+    enc.encode_uint32(CLAIM_NULL);
+    enc.encode_string(name);
+}
+
+// Walk a COMPOUND reply, decoding the results the benchmark uses. Returns
+// the COMPOUND status; sequence_ok tells whether SEQUENCE itself passed
+// (so the slot's sequenceid advanced).
+struct Compound4Results {
+    bool sequence_ok = false;
+    Open4Result open;
+    FileHandle fh;
+    Nfs4StateId stateid;  // CLOSE, LOCK, LOCKU
+    uint32_t read_bytes = 0;
+    Readdir4Page page;
+};
+
+static Nfs4Stat decode_results(const uint8_t* body, size_t len, Compound4Results& out) {
+    try {
+        Compound4Reply rep(body, len);
+        uint32_t op = 0;
+        Nfs4Stat st = Nfs4Stat::NFS4_OK;
+        while (rep.next(op, st)) {
+            if (op == static_cast<uint32_t>(Nfs4Op::OP_SEQUENCE))
+                out.sequence_ok = st == Nfs4Stat::NFS4_OK;
+            if (st != Nfs4Stat::NFS4_OK) break;
+            XdrDecoder& dec = rep.dec();
+            switch (static_cast<Nfs4Op>(op)) {
+                case Nfs4Op::OP_SEQUENCE: skip_sequence4_result(dec); break;
+                case Nfs4Op::OP_OPEN: decode_open4_result(dec, out.open); break;
+                case Nfs4Op::OP_GETFH: decode_fh4(dec, out.fh); break;
+                case Nfs4Op::OP_CLOSE:
+                case Nfs4Op::OP_LOCK:
+                case Nfs4Op::OP_LOCKU: decode_stateid4(dec, out.stateid); break;
+                case Nfs4Op::OP_READ:
+                    dec.decode_bool();  // eof
+                    out.read_bytes = dec.decode_uint32();
+                    dec.skip((out.read_bytes + 3) & ~3u);
+                    break;
+                case Nfs4Op::OP_READDIR: decode_readdir4_result(dec, out.page); break;
+                case Nfs4Op::OP_GETATTR: skip_fattr4(dec); break;
+                case Nfs4Op::OP_CREATE:
+                    dec.skip(4 + 2 * 8);  // change_info4
+                    dec.skip(static_cast<size_t>(dec.decode_uint32()) * 4);  // attrset
+                    break;
+                default: break;  // PUTFH, PUTROOTFH, DELEGRETURN...: no body used
+            }
+        }
+        return rep.status();
+    } catch (const std::exception&) {
+        return Nfs4Stat::NFS4ERR_SERVERFAULT;
+    }
+}
+
+// --- Sessions ---
+
+// RFC 8881 §18.35 / §18.36 / §18.51 - EXCHANGE_ID, CREATE_SESSION, then
+// RECLAIM_COMPLETE on slot 0 (sequenceid 1)
+struct Session {
+    uint64_t clientid = 0;
+    SessionId41 sid{};
+    uint32_t slots = 0;  // granted
+};
+
+static bool call_compound(RpcConnection& rpc, const Compound4& comp, std::vector<uint8_t>& body) {
+    XdrEncoder args;
+    comp.encode(args);
+    return rpc.call(NFS_PROGRAM, NFS_V4, NFSPROC4_COMPOUND, args, body);
+}
+
+static bool establish(RpcConnection& rpc, const std::string& owner, uint32_t slots,
+                      bool back_channel, Session& out, std::string& err) {
+    std::vector<uint8_t> body;
+    {
+        Compound4 comp;
+        XdrEncoder& a = comp.op(Nfs4Op::OP_EXCHANGE_ID);
+        uint64_t verifier = static_cast<uint64_t>(getpid());
+        a.encode_opaque_fixed(&verifier, 8);
+        a.encode_opaque(owner.data(), owner.size());
+        a.encode_uint32(0);  // eia_flags
+        a.encode_uint32(0);  // SP4_NONE
+        a.encode_uint32(0);  // no implementation id
+        if (!call_compound(rpc, comp, body)) {
+            err = "EXCHANGE_ID: no reply";
+            return false;
+        }
+    }
+    uint32_t exchange_seq = 0;
+    try {
+        Compound4Reply rep(body.data(), body.size());
+        uint32_t op = 0;
+        Nfs4Stat st = rep.status();
+        if (st != Nfs4Stat::NFS4_OK || !rep.next(op, st) || st != Nfs4Stat::NFS4_OK) {
+            err = "EXCHANGE_ID failed (nfsstat4 " + std::to_string(static_cast<uint32_t>(st)) + ")";
+            return false;
+        }
+        out.clientid = rep.dec().decode_uint64();
+        exchange_seq = rep.dec().decode_uint32();
+    } catch (const std::exception&) {
+        err = "EXCHANGE_ID: bad reply";
+        return false;
+    }
+
+    {
+        Compound4 comp;
+        XdrEncoder& a = comp.op(Nfs4Op::OP_CREATE_SESSION);
+        a.encode_uint64(out.clientid);
+        a.encode_uint32(exchange_seq);
+        a.encode_uint32(back_channel ? CREATE_SESSION4_FLAG_CONN_BACK_CHAN : 0);
+        // channel_attrs4: headerpadsize, maxrequestsize, maxresponsesize,
+        // maxresponsesize_cached, maxoperations, maxrequests, rdma_ird<>
+        const uint32_t fore[6] = {0, 2 << 20, 2 << 20, 4096, 16, slots};
+        const uint32_t back[6] = {0, 64 << 10, 64 << 10, 0, 4, 1};
+        for (uint32_t v : fore) a.encode_uint32(v);
+        a.encode_uint32(0);
+        for (uint32_t v : back) a.encode_uint32(v);
+        a.encode_uint32(0);
+        a.encode_uint32(NFS4_CALLBACK);
+        a.encode_uint32(1);  // csa_sec_parms: AUTH_NONE
+        a.encode_uint32(static_cast<uint32_t>(RpcAuthFlavor::AUTH_NONE));
+        if (!call_compound(rpc, comp, body)) {
+            err = "CREATE_SESSION: no reply";
+            return false;
+        }
+    }
+    try {
+        Compound4Reply rep(body.data(), body.size());
+        uint32_t op = 0;
+        Nfs4Stat st = rep.status();
+        if (st != Nfs4Stat::NFS4_OK || !rep.next(op, st) || st != Nfs4Stat::NFS4_OK) {
+            err = "CREATE_SESSION failed (nfsstat4 " +
+                  std::to_string(static_cast<uint32_t>(st)) + ")";
+            return false;
+        }
+        XdrDecoder& dec = rep.dec();
+        dec.decode_opaque_fixed(out.sid.data(), out.sid.size());
+        dec.decode_uint32();  // csr_sequence
+        dec.decode_uint32();  // csr_flags
+        uint32_t fore[6];
+        for (auto& v : fore) v = dec.decode_uint32();
+        out.slots = std::max<uint32_t>(1, fore[5]);
+    } catch (const std::exception&) {
+        err = "CREATE_SESSION: bad reply";
+        return false;
+    }
+
+    Compound4 comp;
+    encode_sequence4(comp.op(Nfs4Op::OP_SEQUENCE), out.sid, 1, 0, out.slots - 1);
+    comp.op(Nfs4Op::OP_RECLAIM_COMPLETE).encode_bool(false);
+    Compound4Results res;
+    if (!call_compound(rpc, comp, body) ||
+        decode_results(body.data(), body.size(), res) != Nfs4Stat::NFS4_OK) {
+        err = "RECLAIM_COMPLETE failed";
+        return false;
+    }
+    return true;
+}
+
+// RFC 8881 §18.37 - DESTROY_SESSION (needs no SEQUENCE)
+static void destroy_session(RpcConnection& rpc, const Session& s) {
+    Compound4 comp;
+    comp.op(Nfs4Op::OP_DESTROY_SESSION).encode_opaque_fixed(s.sid.data(), s.sid.size());
+    std::vector<uint8_t> body;
+    call_compound(rpc, comp, body);
+}
+
+// --- Setup ---
+
+// The setup client: one slot, one COMPOUND at a time
+struct Control {
+    RpcConnection rpc;
+    Session session;
+    uint32_t seqid = 1;  // RECLAIM_COMPLETE used 1
+    const std::vector<uint8_t> owner = {'s', 'e', 't', 'u', 'p'};
+
+    Compound4 begin() {
+        Compound4 comp;
+        encode_sequence4(comp.op(Nfs4Op::OP_SEQUENCE), session.sid, ++seqid, 0, 0);
+        return comp;
+    }
+    Nfs4Stat run(const Compound4& comp, Compound4Results& res) {
+        std::vector<uint8_t> body;
+        if (!call_compound(rpc, comp, body)) return Nfs4Stat::NFS4ERR_SERVERFAULT;
+        Nfs4Stat st = decode_results(body.data(), body.size(), res);
+        if (!res.sequence_ok) seqid--;
+        return st;
+    }
+};
+
+struct Tree {
+    FileHandle root;
+    FileHandle work;
+    std::string work_name;
+    std::vector<FileHandle> files;
+    std::vector<std::string> file_names;
+    std::vector<std::string> client_files;  // recall: one per client
+    FileHandle bigdir;
+    uint32_t dir_entries = 0;
+};
+
+static Nfs4Stat make_dir(Control& ctl, const FileHandle* parent, const std::string& name,
+                         FileHandle& out) {
+    Compound4 comp = ctl.begin();
+    if (parent) encode_fh4(comp.op(Nfs4Op::OP_PUTFH), *parent);
+    else comp.op(Nfs4Op::OP_PUTROOTFH);
+    XdrEncoder& a = comp.op(Nfs4Op::OP_CREATE);
+    a.encode_uint32(static_cast<uint32_t>(Nfs4Type::NF4DIR));
+    a.encode_string(name);
+    a.encode_uint32(0);  // createattrs: empty bitmap
+    a.encode_uint32(0);
+    comp.op(Nfs4Op::OP_GETFH);
+    Compound4Results res;
+    Nfs4Stat st = ctl.run(comp, res);
+    out = res.fh;
+    return st;
+}
+
+// OPEN with create, --file-size bytes of UNSTABLE4 WRITEs if data is given,
+// CLOSE
+static Nfs4Stat make_file(Control& ctl, const FileHandle& dir, const std::string& name,
+                          const std::vector<uint8_t>* data, uint64_t size, FileHandle& out) {
+    Compound4 comp = ctl.begin();
+    encode_fh4(comp.op(Nfs4Op::OP_PUTFH), dir);
+    encode_open4(comp.op(Nfs4Op::OP_OPEN), ctl.session.clientid, ctl.owner,
+                 OPEN4_SHARE_ACCESS_BOTH | OPEN4_SHARE_ACCESS_WANT_NO_DELEG, true, name);
+    comp.op(Nfs4Op::OP_GETFH);
+    Compound4Results res;
+    Nfs4Stat st = ctl.run(comp, res);
+    if (st != Nfs4Stat::NFS4_OK) return st;
+    out = res.fh;
+    const Nfs4StateId open_sid = res.open.stateid;
+
+    for (uint64_t off = 0; data && off < size; off += data->size()) {
+        Compound4 w = ctl.begin();
+        encode_fh4(w.op(Nfs4Op::OP_PUTFH), out);
+        XdrEncoder& a = w.op(Nfs4Op::OP_WRITE);
+        encode_stateid4(a, open_sid);
+        a.encode_uint64(off);
+        a.encode_uint32(UNSTABLE4);
+        a.encode_opaque(data->data(), data->size());
+        Compound4Results wres;
+        st = ctl.run(w, wres);
+        if (st != Nfs4Stat::NFS4_OK) return st;
+    }
+
+    Compound4 c = ctl.begin();
+    encode_fh4(c.op(Nfs4Op::OP_PUTFH), out);
+    XdrEncoder& a = c.op(Nfs4Op::OP_CLOSE);
+    a.encode_uint32(0);
+    encode_stateid4(a, open_sid);
+    Compound4Results cres;
+    return ctl.run(c, cres);
+}
+
+static Nfs4Stat remove_name(Control& ctl, const FileHandle& dir, const std::string& name) {
+    Compound4 comp = ctl.begin();
+    encode_fh4(comp.op(Nfs4Op::OP_PUTFH), dir);
+    comp.op(Nfs4Op::OP_REMOVE).encode_string(name);
+    Compound4Results res;
+    return ctl.run(comp, res);
+}
+
+static bool fail(const char* what, Nfs4Stat status) {
+    std::fprintf(stderr, "nfs4bench: setup: %s failed (nfsstat4 %u)\n", what,
+                 static_cast<unsigned>(status));
+    return false;
+}
+
+static bool setup(const Config& cfg, Control& ctl, const std::vector<uint8_t>& data, Tree& tree) {
+    tree.work_name = "nfs4bench." + std::to_string(getpid());
+    Nfs4Stat st = make_dir(ctl, nullptr, tree.work_name, tree.work);
+    if (st != Nfs4Stat::NFS4_OK) return fail("CREATE of the work directory", st);
+
+    bool need_files = uses(cfg, Scenario::OPEN_READ_CLOSE) || uses(cfg, Scenario::LOCK) ||
+                      uses(cfg, Scenario::GETATTR);
+    bool need_data = uses(cfg, Scenario::OPEN_READ_CLOSE);
+    for (uint32_t i = 0; need_files && i < cfg.files; i++) {
+        std::string name = "f" + std::to_string(i);
+        FileHandle fh;
+        st = make_file(ctl, tree.work, name, need_data ? &data : nullptr, cfg.file_size, fh);
+        if (st != Nfs4Stat::NFS4_OK) return fail("OPEN/WRITE of a data file", st);
+        tree.files.push_back(fh);
+        tree.file_names.push_back(name);
+    }
+
+    for (uint32_t i = 0; uses(cfg, Scenario::RECALL) && i < cfg.clients; i++) {
+        std::string name = "d" + std::to_string(i);
+        FileHandle fh;
+        st = make_file(ctl, tree.work, name, nullptr, 0, fh);
+        if (st != Nfs4Stat::NFS4_OK) return fail("OPEN of a client's file", st);
+        tree.client_files.push_back(name);
+    }
+
+    if (uses(cfg, Scenario::READDIR)) {
+        st = make_dir(ctl, &tree.work, "dir", tree.bigdir);
+        if (st != Nfs4Stat::NFS4_OK) return fail("CREATE of the listing directory", st);
+        char name[32];
+        for (uint32_t i = 0; i < cfg.dir_entries; i++) {
+            std::snprintf(name, sizeof(name), "entry%07u", i);
+            FileHandle fh;
+            st = make_file(ctl, tree.bigdir, name, nullptr, 0, fh);
+            if (st != Nfs4Stat::NFS4_OK) return fail("OPEN of a directory entry", st);
+            tree.dir_entries++;
+        }
+    }
+    return true;
+}
+
+static void cleanup(Control& ctl, const Tree& tree) {
+    char name[32];
+    for (uint32_t i = 0; i < tree.dir_entries; i++) {
+        std::snprintf(name, sizeof(name), "entry%07u", i);
+        remove_name(ctl, tree.bigdir, name);
+    }
+    if (!tree.bigdir.empty()) remove_name(ctl, tree.work, "dir");
+    for (const auto& n : tree.file_names) remove_name(ctl, tree.work, n);
+    for (const auto& n : tree.client_files) remove_name(ctl, tree.work, n);
+    if (!tree.work.empty()) {
+        Compound4 comp = ctl.begin();
+        comp.op(Nfs4Op::OP_PUTROOTFH);
+        comp.op(Nfs4Op::OP_REMOVE).encode_string(tree.work_name);
+        Compound4Results res;
+        ctl.run(comp, res);
+    }
+}
+
+// --- Load ---
+
+struct OpStats {
+    LatencyHistogram latency;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+};
+
+struct ThreadStats {
+    std::array<OpStats, kSteps> ops;
+    uint64_t delays = 0;       // OPENs answered NFS4ERR_DELAY
+    uint64_t lock_denied = 0;  // LOCKs answered NFS4ERR_DENIED (not errors)
+    uint64_t read_delegations = 0;
+    uint64_t write_delegations = 0;
+    uint64_t recalls = 0;      // CB_RECALLs answered
+    uint64_t connection_errors = 0;
+};
+
+// One slot's chain of COMPOUNDs
+struct Chain {
+    Scenario scenario = Scenario::GETATTR;
+    uint8_t step = 0;
+    bool active = false;
+    bool busy = false;
+    uint64_t ready_ns = 0;       // after NFS4ERR_DELAY: not before this
+    uint64_t delayed_since = 0;  // when the first delayed OPEN was sent
+    size_t file = 0;
+    FileHandle fh;
+    Nfs4StateId open_sid;
+    Nfs4StateId lock_sid;
+    uint64_t lock_offset = 0;
+    uint64_t cookie = 0;  // READDIR cursor
+    uint64_t verf = 0;
+    std::vector<uint8_t> owner;  // open-owner and lock-owner
+};
+
+// A recalled delegation to return
+struct Recall {
+    Nfs4StateId stateid;
+    FileHandle fh;
+    uint64_t received_ns = 0;
+};
+
+struct Slot {
+    uint32_t seqid = 1;  // last used; RECLAIM_COMPLETE took 1 on slot 0
+    bool busy = false;
+    uint32_t xid = 0;
+    int32_t chain = -1;  // -1: DELEGRETURN
+    Step step = Step::OPEN;
+    uint64_t start_ns = 0;
+    Recall recall;
+};
+
+struct Client {
+    RpcConnection rpc;
+    uint32_t id = 0;
+    Session session;
+    std::vector<Slot> slots;
+    std::vector<Chain> chains;
+    std::deque<Recall> returns;
+    uint32_t inflight = 0;
+    uint64_t rng = 0;
+    bool dead = false;
+};
+
+class LoadThread {
+public:
+    LoadThread(const Config& cfg, const Tree& tree, ThreadStats& stats)
+        : cfg_(cfg), tree_(tree), stats_(stats) {
+        for (size_t i = 0; i < kScenarios; i++) {
+            total_weight_ += cfg.weights[i];
+            cumulative_[i] = total_weight_;
+        }
+    }
+
+    void add(std::unique_ptr<Client> c) { clients_.push_back(std::move(c)); }
+    std::vector<std::unique_ptr<Client>>& clients() { return clients_; }
+
+    void run(uint64_t deadline_ns) {
+        // Chains still running at the deadline get this long to finish
+        const uint64_t drain_ns = 5000000000ull;
+        std::vector<pollfd> pfds;
+        for (;;) {
+            uint64_t now = LatencyStats::now_ns();
+            bool issuing = now < deadline_ns;
+            bool busy = false;
+            bool waiting = false;  // a chain is backing off after NFS4ERR_DELAY
+            pfds.clear();
+            for (auto& c : clients_) {
+                if (c->dead) continue;
+                issue(*c, now, issuing, waiting);
+                if (c->rpc.want_write() && !c->rpc.flush()) {
+                    lost(*c);
+                    continue;
+                }
+                busy = busy || c->inflight || !c->returns.empty() ||
+                       std::any_of(c->chains.begin(), c->chains.end(),
+                                   [](const Chain& ch) { return ch.active; });
+                short events = POLLIN;
+                if (c->rpc.want_write()) events |= POLLOUT;
+                pfds.push_back({c->rpc.fd(), events, 0});
+            }
+            if (!issuing && (!busy || now > deadline_ns + drain_ns)) break;
+            if (pfds.empty()) break;
+
+            int rc = poll(pfds.data(), pfds.size(), waiting ? 1 : 100);
+            if (rc < 0 && errno != EINTR) break;
+            if (rc <= 0) continue;
+
+            size_t p = 0;
+            for (auto& c : clients_) {
+                if (c->dead) continue;
+                const pollfd& pfd = pfds[p++];
+                if (pfd.revents & POLLOUT && !c->rpc.flush()) {
+                    lost(*c);
+                    continue;
+                }
+                if (pfd.revents & (POLLIN | POLLHUP | POLLERR) &&
+                    !c->rpc.receive([&](const RpcReply& r) { complete(*c, r); },
+                                    [&](const RpcIncomingCall& call) { callback(*c, call); }))
+                    lost(*c);
+            }
+        }
+    }
+
+private:
+    Scenario pick(Client& c) {
+        uint64_t r = xorshift(c.rng) % total_weight_;
+        size_t i = 0;
+        while (r >= cumulative_[i]) i++;
+        return static_cast<Scenario>(i);
+    }
+
+    Slot* free_slot(Client& c) {
+        for (auto& s : c.slots)
+            if (!s.busy) return &s;
+        return nullptr;
+    }
+
+    // Start SEQUENCE on a free slot
+    Compound4 begin(Client& c, Slot& slot) {
+        Compound4 comp;
+        uint32_t index = static_cast<uint32_t>(&slot - c.slots.data());
+        encode_sequence4(comp.op(Nfs4Op::OP_SEQUENCE), c.session.sid, ++slot.seqid, index,
+                         static_cast<uint32_t>(c.slots.size() - 1));
+        return comp;
+    }
+
+    void send(Client& c, Slot& slot, const Compound4& comp, int32_t chain, Step step) {
+        XdrEncoder args;
+        comp.encode(args);
+        slot.busy = true;
+        slot.chain = chain;
+        slot.step = step;
+        slot.start_ns = LatencyStats::now_ns();
+        slot.xid = c.rpc.queue_call(NFS_PROGRAM, NFS_V4, NFSPROC4_COMPOUND, args);
+        c.inflight++;
+    }
+
+    void issue(Client& c, uint64_t now, bool issuing, bool& waiting) {
+        // Recalled delegations go back first
+        while (!c.returns.empty()) {
+            Slot* slot = free_slot(c);
+            if (!slot) return;
+            slot->recall = c.returns.front();
+            c.returns.pop_front();
+            Compound4 comp = begin(c, *slot);
+            encode_fh4(comp.op(Nfs4Op::OP_PUTFH), slot->recall.fh);
+            encode_stateid4(comp.op(Nfs4Op::OP_DELEGRETURN), slot->recall.stateid);
+            send(c, *slot, comp, -1, Step::DELEGRETURN);
+        }
+
+        for (size_t i = 0; i < c.chains.size(); i++) {
+            Chain& ch = c.chains[i];
+            if (ch.busy) continue;
+            if (ch.active && ch.ready_ns > now) {
+                waiting = true;
+                continue;
+            }
+            // Past the deadline only chains already under way go on
+            if (!ch.active && !issuing) continue;
+            Slot* slot = free_slot(c);
+            if (!slot) return;
+            if (!ch.active) start(c, ch);
+            Compound4 comp = begin(c, *slot);
+            Step step = encode_step(c, ch, comp);
+            ch.busy = true;
+            send(c, *slot, comp, static_cast<int32_t>(i), step);
+        }
+    }
+
+    void start(Client& c, Chain& ch) {
+        ch.scenario = pick(c);
+        ch.step = 0;
+        ch.active = true;
+        ch.delayed_since = 0;
+        ch.ready_ns = 0;
+        if (!tree_.files.empty()) ch.file = xorshift(c.rng) % tree_.files.size();
+    }
+
+    Step encode_step(Client& c, Chain& ch, Compound4& comp) {
+        Step step = kChains[static_cast<size_t>(ch.scenario)][ch.step];
+        switch (step) {
+            case Step::OPEN: {
+                // recall: own file for read (delegation wanted), then the
+                // next client's for write
+                std::string name;
+                uint32_t access = OPEN4_SHARE_ACCESS_READ;
+                if (ch.scenario == Scenario::RECALL) {
+                    uint32_t n = static_cast<uint32_t>(tree_.client_files.size());
+                    name = tree_.client_files[ch.step == 0 ? c.id : (c.id + 1) % n];
+                    if (ch.step != 0)
+                        access = OPEN4_SHARE_ACCESS_BOTH | OPEN4_SHARE_ACCESS_WANT_NO_DELEG;
+                } else {
+                    name = tree_.file_names[ch.file];
+                    if (ch.scenario == Scenario::LOCK)
+                        access = OPEN4_SHARE_ACCESS_BOTH | OPEN4_SHARE_ACCESS_WANT_NO_DELEG;
+                }
+                encode_fh4(comp.op(Nfs4Op::OP_PUTFH), tree_.work);
+                encode_open4(comp.op(Nfs4Op::OP_OPEN), c.session.clientid, ch.owner, access,
+                             false, name);
+                comp.op(Nfs4Op::OP_GETFH);
+                break;
+            }
+            case Step::READ: {
+                encode_fh4(comp.op(Nfs4Op::OP_PUTFH), ch.fh);
+                XdrEncoder& a = comp.op(Nfs4Op::OP_READ);
+                encode_stateid4(a, ch.open_sid);
+                a.encode_uint64(random_offset(c));
+                a.encode_uint32(cfg_.io_size);
+                break;
+            }
+            case Step::CLOSE: {
+                encode_fh4(comp.op(Nfs4Op::OP_PUTFH), ch.fh);
+                XdrEncoder& a = comp.op(Nfs4Op::OP_CLOSE);
+                a.encode_uint32(0);
+                encode_stateid4(a, ch.open_sid);
+                break;
+            }
+            case Step::LOCK: {
+                // RFC 8881 §18.10 - LOCK4args with a new lock-owner
+                ch.lock_offset = random_offset(c);
+                encode_fh4(comp.op(Nfs4Op::OP_PUTFH), ch.fh);
+                XdrEncoder& a = comp.op(Nfs4Op::OP_LOCK);
+                a.encode_uint32(WRITE_LT);
+                a.encode_bool(false);  // reclaim
+                a.encode_uint64(ch.lock_offset);
+                a.encode_uint64(cfg_.io_size);
+                a.encode_bool(true);   // new_lock_owner
+                a.encode_uint32(0);    // open_seqid
+                encode_stateid4(a, ch.open_sid);
+                a.encode_uint32(0);    // lock_seqid
+                a.encode_uint64(c.session.clientid);
+                a.encode_opaque(ch.owner.data(), ch.owner.size());
+                break;
+            }
+            case Step::LOCKU: {
+                encode_fh4(comp.op(Nfs4Op::OP_PUTFH), ch.fh);
+                XdrEncoder& a = comp.op(Nfs4Op::OP_LOCKU);
+                a.encode_uint32(WRITE_LT);
+                a.encode_uint32(0);
+                encode_stateid4(a, ch.lock_sid);
+                a.encode_uint64(ch.lock_offset);
+                a.encode_uint64(cfg_.io_size);
+                break;
+            }
+            case Step::GETATTR:
+                encode_fh4(comp.op(Nfs4Op::OP_PUTFH), tree_.files[ch.file]);
+                encode_getattr_bitmap(comp.op(Nfs4Op::OP_GETATTR));
+                break;
+            case Step::READDIR: {
+                encode_fh4(comp.op(Nfs4Op::OP_PUTFH), tree_.bigdir);
+                XdrEncoder& a = comp.op(Nfs4Op::OP_READDIR);
+                a.encode_uint64(ch.cookie);
+                a.encode_uint64(ch.verf);
+                a.encode_uint32(8192);   // dircount
+                a.encode_uint32(65536);  // maxcount
+                encode_bitmap4(a, {FATTR4_TYPE, FATTR4_SIZE, FATTR4_FILEID, FATTR4_TIME_MODIFY});
+                break;
+            }
+            default:
+                break;
+        }
+        return step;
+    }
+
+    uint64_t random_offset(Client& c) {
+        uint64_t blocks = std::max<uint64_t>(1, cfg_.file_size / cfg_.io_size);
+        return (xorshift(c.rng) % blocks) * cfg_.io_size;
+    }
+
+    // Move past the current step: to the next one, to the CLOSE of an open
+    // file if the chain failed, or to the end
+    void advance(Chain& ch, bool failed) {
+        const Step* steps = kChains[static_cast<size_t>(ch.scenario)];
+        if (failed && steps[ch.step] != Step::OPEN) {
+            while (ch.step + 1 < kMaxChain && steps[ch.step + 1] != Step::CLOSE) ch.step++;
+        } else if (failed) {
+            ch.active = false;
+            return;
+        }
+        ch.step++;
+        if (ch.step >= kMaxChain || steps[ch.step] == Step::COUNT) ch.active = false;
+    }
+
+    void complete(Client& c, const RpcReply& r) {
+        Slot* slot = nullptr;
+        for (auto& s : c.slots) {
+            if (s.busy && s.xid == r.xid) {
+                slot = &s;
+                break;
+            }
+        }
+        if (!slot) return;
+        slot->busy = false;
+        c.inflight--;
+
+        uint64_t now = LatencyStats::now_ns();
+        OpStats& st = stats_.ops[static_cast<size_t>(slot->step)];
+        st.latency.record(now - slot->start_ns);
+
+        Compound4Results res;
+        Nfs4Stat status = Nfs4Stat::NFS4ERR_SERVERFAULT;
+        if (r.accepted && r.accept_stat == static_cast<uint32_t>(RpcAcceptStatus::SUCCESS))
+            status = decode_results(r.body, r.body_len, res);
+        // A SEQUENCE the server did not accept leaves the slot where it was
+        if (!res.sequence_ok) slot->seqid--;
+
+        if (slot->chain < 0) {
+            if (status != Nfs4Stat::NFS4_OK) st.errors++;
+            else stats_.ops[static_cast<size_t>(Step::CB_RECALL)].latency.record(
+                     now - slot->recall.received_ns);
+            return;
+        }
+
+        Chain& ch = c.chains[static_cast<size_t>(slot->chain)];
+        ch.busy = false;
+        switch (slot->step) {
+            case Step::OPEN:
+                if (status == Nfs4Stat::NFS4ERR_DELAY) {
+                    // A delegation is being recalled: retry shortly
+                    stats_.delays++;
+                    if (!ch.delayed_since) ch.delayed_since = slot->start_ns;
+                    ch.ready_ns = now + 1000000;
+                    return;
+                }
+                if (status != Nfs4Stat::NFS4_OK) break;
+                if (ch.delayed_since) {
+                    stats_.ops[static_cast<size_t>(Step::RECALL)].latency.record(
+                        now - ch.delayed_since);
+                    ch.delayed_since = 0;
+                }
+                if (res.open.deleg_type == OPEN_DELEGATE_READ) stats_.read_delegations++;
+                if (res.open.deleg_type == OPEN_DELEGATE_WRITE) stats_.write_delegations++;
+                ch.open_sid = res.open.stateid;
+                ch.fh = res.fh;
+                break;
+            case Step::READ:
+                if (status == Nfs4Stat::NFS4_OK) st.bytes += res.read_bytes;
+                break;
+            case Step::LOCK:
+                if (status == Nfs4Stat::NFS4ERR_DENIED) {
+                    // Contention, not a failure: skip the LOCKU
+                    stats_.lock_denied++;
+                    advance(ch, true);
+                    return;
+                }
+                if (status == Nfs4Stat::NFS4_OK) ch.lock_sid = res.stateid;
+                break;
+            case Step::READDIR:
+                if (status == Nfs4Stat::NFS4_OK && !res.page.eof && res.page.entries) {
+                    ch.cookie = res.page.last_cookie;
+                    ch.verf = res.page.cookieverf;
+                } else {
+                    ch.cookie = 0;
+                    ch.verf = 0;
+                }
+                break;
+            default:
+                break;
+        }
+        bool failed = status != Nfs4Stat::NFS4_OK;
+        if (failed) st.errors++;
+        advance(ch, failed);
+    }
+
+    // RFC 8881 §20 - the backchannel: CB_SEQUENCE then CB_RECALL (or any
+    // other callback, which is just acknowledged)
+    void callback(Client& c, const RpcIncomingCall& call) {
+        XdrEncoder res;
+        if (call.proc == CB_COMPOUND) {
+            try {
+                XdrDecoder dec(call.body, call.body_len);
+                dec.decode_opaque();  // tag
+                dec.decode_uint32();  // minorversion
+                dec.decode_uint32();  // callback_ident
+                uint32_t n = dec.decode_uint32();
+                XdrEncoder results;
+                for (uint32_t i = 0; i < n; i++) {
+                    uint32_t op = dec.decode_uint32();
+                    results.encode_uint32(op);
+                    results.encode_uint32(static_cast<uint32_t>(Nfs4Stat::NFS4_OK));
+                    if (op == OP_CB_SEQUENCE) {
+                        SessionId41 sid{};
+                        dec.decode_opaque_fixed(sid.data(), sid.size());
+                        uint32_t seq = dec.decode_uint32();
+                        uint32_t slot = dec.decode_uint32();
+                        uint32_t highest = dec.decode_uint32();
+                        dec.decode_bool();
+                        uint32_t lists = dec.decode_uint32();
+                        if (lists) throw std::runtime_error("referring call lists");
+                        results.encode_opaque_fixed(sid.data(), sid.size());
+                        results.encode_uint32(seq);
+                        results.encode_uint32(slot);
+                        results.encode_uint32(highest);
+                        results.encode_uint32(highest);
+                    } else if (op == OP_CB_RECALL) {
+                        Recall rc;
+                        decode_stateid4(dec, rc.stateid);
+                        dec.decode_bool();  // truncate
+                        decode_fh4(dec, rc.fh);
+                        rc.received_ns = LatencyStats::now_ns();
+                        c.returns.push_back(rc);
+                        stats_.recalls++;
+                    } else {
+                        break;  // CB_NOTIFY_LOCK etc.: not asked for, the rest is ignored
+                    }
+                }
+                res.encode_uint32(static_cast<uint32_t>(Nfs4Stat::NFS4_OK));
+                res.encode_string("");
+                res.encode_uint32(n);
+                res.encode_opaque_fixed(results.data().data(), results.size());
+            } catch (const std::exception&) {
+                return;  // malformed: no answer; the server frees the slot after a timeout
+            }
+        }
+        c.rpc.queue_reply(call.xid, res);
+    }
+
+    // The connection failed: its calls in flight count as errors
+    void lost(Client& c) {
+        c.dead = true;
+        stats_.connection_errors++;
+        for (auto& s : c.slots)
+            if (s.busy) stats_.ops[static_cast<size_t>(s.step)].errors++;
+        for (auto& ch : c.chains) ch.active = false;
+        c.inflight = 0;
+        c.rpc.close();
+    }
+
+    const Config& cfg_;
+    const Tree& tree_;
+    ThreadStats& stats_;
+    std::vector<std::unique_ptr<Client>> clients_;
+    uint64_t total_weight_ = 0;
+    std::array<uint64_t, kScenarios> cumulative_{};
+};
+
+// --- Report ---
+
+static bool derived(size_t step) {
+    return step == static_cast<size_t>(Step::RECALL) ||
+           step == static_cast<size_t>(Step::CB_RECALL);
+}
+
+struct Summary {
+    std::array<LatencySnapshot, kSteps> latency{};
+    std::array<uint64_t, kSteps> errors{};
+    LatencySnapshot all;  // COMPOUNDs only
+    uint64_t compounds = 0;
+    uint64_t total_errors = 0;
+    uint64_t connection_errors = 0;
+    uint64_t read_bytes = 0;
+    uint64_t delays = 0;
+    uint64_t lock_denied = 0;
+    uint64_t read_delegations = 0;
+    uint64_t write_delegations = 0;
+    uint64_t recalls = 0;
+};
+
+static Summary summarize(const std::vector<std::unique_ptr<ThreadStats>>& stats) {
+    Summary sum;
+    for (const auto& t : stats) {
+        for (size_t i = 0; i < kSteps; i++) {
+            t->ops[i].latency.add_to(sum.latency[i]);
+            sum.errors[i] += t->ops[i].errors;
+        }
+        sum.read_bytes += t->ops[static_cast<size_t>(Step::READ)].bytes;
+        sum.delays += t->delays;
+        sum.lock_denied += t->lock_denied;
+        sum.read_delegations += t->read_delegations;
+        sum.write_delegations += t->write_delegations;
+        sum.recalls += t->recalls;
+        sum.connection_errors += t->connection_errors;
+    }
+    for (size_t i = 0; i < kSteps; i++) {
+        sum.total_errors += sum.errors[i];
+        if (derived(i)) continue;
+        sum.all.merge(sum.latency[i]);
+        sum.compounds += sum.latency[i].count;
+    }
+    sum.total_errors += sum.connection_errors;
+    return sum;
+}
+
+static void write_report(FILE* out, const Config& cfg, const std::string& target,
+                         uint32_t slots_granted, const Summary& sum, double elapsed) {
+    std::fprintf(out, "{\n");
+    std::fprintf(out, "  \"target\": \"%s\",\n", target.c_str());
+    std::fprintf(out, "  \"scenario\": \"%s\",\n",
+                 cfg.mix.empty() ? cfg.scenario.c_str() : "custom");
+    std::fprintf(out, "  \"mix\": {");
+    bool first = true;
+    for (size_t i = 0; i < kScenarios; i++) {
+        if (!cfg.weights[i]) continue;
+        std::fprintf(out, "%s\"%s\": %u", first ? "" : ", ", kScenarioNames[i], cfg.weights[i]);
+        first = false;
+    }
+    std::fprintf(out, "},\n");
+    std::fprintf(out,
+                 "  \"clients\": %u, \"threads\": %u, \"slots\": %u, \"slots_granted\": %u, "
+                 "\"io_size\": %u, \"file_size\": %llu, \"files\": %u, \"dir_entries\": %u,\n",
+                 cfg.clients, cfg.threads, cfg.slots, slots_granted, cfg.io_size,
+                 static_cast<unsigned long long>(cfg.file_size), cfg.files, cfg.dir_entries);
+    std::fprintf(out, "  \"seconds\": %.3f,\n", elapsed);
+    std::fprintf(out, "  \"compounds\": %llu, \"errors\": %llu, \"connection_errors\": %llu,\n",
+                 static_cast<unsigned long long>(sum.compounds),
+                 static_cast<unsigned long long>(sum.total_errors - sum.connection_errors),
+                 static_cast<unsigned long long>(sum.connection_errors));
+    std::fprintf(out, "  \"compounds_per_sec\": %.1f, \"read_mb_per_sec\": %.2f,\n",
+                 sum.compounds / elapsed, sum.read_bytes / elapsed / 1048576.0);
+    std::fprintf(out,
+                 "  \"delegations\": {\"read\": %llu, \"write\": %llu, \"recalled\": %llu, "
+                 "\"open_delays\": %llu},\n",
+                 static_cast<unsigned long long>(sum.read_delegations),
+                 static_cast<unsigned long long>(sum.write_delegations),
+                 static_cast<unsigned long long>(sum.recalls),
+                 static_cast<unsigned long long>(sum.delays));
+    std::fprintf(out, "  \"lock_denied\": %llu,\n",
+                 static_cast<unsigned long long>(sum.lock_denied));
+    std::fprintf(out, "  \"latency\": {");
+    write_latency_json(out, sum.all);
+    std::fprintf(out, "},\n");
+    std::fprintf(out, "  \"by_op\": {");
+    first = true;
+    for (size_t i = 0; i < kSteps; i++) {
+        const LatencySnapshot& s = sum.latency[i];
+        if (!s.count && !sum.errors[i]) continue;
+        std::fprintf(out, "%s\n    \"%s\": {\"count\": %llu, \"errors\": %llu, \"per_sec\": %.1f, ",
+                     first ? "" : ",", kStepNames[i], static_cast<unsigned long long>(s.count),
+                     static_cast<unsigned long long>(sum.errors[i]), s.count / elapsed);
+        write_latency_json(out, s);
+        std::fprintf(out, "}");
+        first = false;
+    }
+    std::fprintf(out, "\n  }\n}\n");
+}
+
+// --- Main ---
+
+static void usage() {
+    std::fprintf(stderr,
+                 "usage: nfs4bench [--host H] [--port P] [--inprocess] [--export DIR]\n"
+                 "                 [--scenario NAME | --mix scenario=w,...] [--seconds S]\n"
+                 "                 [--clients N] [--threads N] [--slots N]\n"
+                 "                 [--io-size B] [--file-size B] [--files N] [--dir-entries N]\n"
+                 "                 [--json FILE] [--keep] [--fault RULE]...\n"
+                 "scenarios:");
+    for (const auto& w : kWorkloads) std::fprintf(stderr, " %s", w.name);
+    std::fprintf(stderr, "\nmix names:");
+    for (size_t i = 0; i < kScenarios; i++) std::fprintf(stderr, " %s", kScenarioNames[i]);
+    std::fprintf(stderr, "\n");
+}
+
+static bool parse_args(int argc, char* argv[], Config& cfg) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        uint64_t v = 0;
+        auto size_arg = [&](uint64_t& out) {
+            return has_value && parse_size(argv[++i], out);
+        };
+        if (arg == "--host" && has_value) cfg.host = argv[++i];
+        else if (arg == "--port" && has_value) cfg.port = static_cast<uint16_t>(std::atoi(argv[++i]));
+        else if (arg == "--inprocess") cfg.inprocess = true;
+        else if (arg == "--export" && has_value) cfg.export_dir = argv[++i];
+        else if (arg == "--scenario" && has_value) cfg.scenario = argv[++i];
+        else if (arg == "--mix" && has_value) cfg.mix = argv[++i];
+        else if (arg == "--seconds" && has_value) cfg.seconds = std::atof(argv[++i]);
+        else if (arg == "--clients" && size_arg(v)) cfg.clients = static_cast<uint32_t>(v);
+        else if (arg == "--threads" && size_arg(v)) cfg.threads = static_cast<uint32_t>(v);
+        else if (arg == "--slots" && size_arg(v)) cfg.slots = static_cast<uint32_t>(v);
+        else if (arg == "--io-size" && size_arg(v)) cfg.io_size = static_cast<uint32_t>(v);
+        else if (arg == "--file-size" && size_arg(v)) cfg.file_size = v;
+        else if (arg == "--files" && size_arg(v)) cfg.files = static_cast<uint32_t>(v);
+        else if (arg == "--dir-entries" && size_arg(v)) cfg.dir_entries = static_cast<uint32_t>(v);
+        else if (arg == "--json" && has_value) cfg.json_path = argv[++i];
+        else if (arg == "--fault" && has_value) cfg.faults.push_back(argv[++i]);
+        else if (arg == "--keep") cfg.keep = true;
+        else {
+            std::fprintf(stderr, "nfs4bench: bad argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+
+    std::string mix = cfg.mix;
+    if (mix.empty()) {
+        for (const auto& w : kWorkloads)
+            if (cfg.scenario == w.name) mix = w.mix;
+        if (mix.empty()) {
+            std::fprintf(stderr, "nfs4bench: unknown scenario: %s\n", cfg.scenario.c_str());
+            return false;
+        }
+    }
+    if (!parse_mix(mix, cfg.weights)) {
+        std::fprintf(stderr, "nfs4bench: bad --mix: %s\n", mix.c_str());
+        return false;
+    }
+    if (!cfg.clients || !cfg.threads || !cfg.slots || !cfg.io_size || !cfg.files ||
+        cfg.io_size > 1024 * 1024) {
+        std::fprintf(stderr, "nfs4bench: counts must be non-zero and --io-size at most 1M\n");
+        return false;
+    }
+    if (uses(cfg, Scenario::RECALL) && cfg.clients < 2) {
+        std::fprintf(stderr, "nfs4bench: the recall scenario needs at least 2 clients\n");
+        return false;
+    }
+    if (!cfg.faults.empty() && !cfg.inprocess) {
+        std::fprintf(stderr, "nfs4bench: --fault needs --inprocess\n");
+        return false;
+    }
+    cfg.threads = std::min(cfg.threads, cfg.clients);
+    cfg.file_size = std::max<uint64_t>(cfg.file_size, cfg.io_size);
+    return true;
+}
+
+static int run(Config& cfg) {
+    raise_fd_limit();
+
+    // --inprocess: NFSv4 over LocalFs at an ephemeral port
+    std::string temp_dir;
+    std::unique_ptr<LocalFs> fs;
+    std::unique_ptr<FaultVfs> faults;
+    std::unique_ptr<Nfs4Server> nfs4_srv;
+    std::unique_ptr<RpcServer> rpc;
+    if (cfg.inprocess) {
+        if (cfg.export_dir.empty()) {
+            char tmpl[] = "/tmp/nfs4bench_XXXXXX";
+            if (!mkdtemp(tmpl)) {
+                std::fprintf(stderr, "nfs4bench: mkdtemp: %s\n", std::strerror(errno));
+                return 1;
+            }
+            temp_dir = cfg.export_dir = tmpl;
+        }
+        fs = std::make_unique<LocalFs>(cfg.export_dir);
+        if (!make_fault_vfs("nfs4bench", *fs, cfg.export_dir, cfg.faults, faults)) return 1;
+        Vfs& vfs = faults ? static_cast<Vfs&>(*faults) : *fs;
+        nfs4_srv = std::make_unique<Nfs4Server>(vfs, cfg.export_dir);
+        rpc = std::make_unique<RpcServer>();
+        rpc->register_program(NFS_PROGRAM, NFS_V4, nfs4_srv->get_handlers());
+        rpc->start(0);
+        cfg.host = "127.0.0.1";
+        cfg.port = rpc->port();
+    }
+    const std::string target = cfg.host + ":" + std::to_string(cfg.port);
+    const std::string owner_prefix = "nfs4bench." + std::to_string(getpid()) + ".";
+
+    std::vector<uint8_t> data(cfg.io_size);
+    for (size_t i = 0; i < data.size(); i++) data[i] = static_cast<uint8_t>(i * 31 + 7);
+
+    int rc = 1;
+    Tree tree;
+    Control ctl;
+    std::string err;
+    if (!ctl.rpc.connect(cfg.host, cfg.port, err)) {
+        std::fprintf(stderr, "nfs4bench: connect %s: %s\n", target.c_str(), err.c_str());
+    } else if (ctl.rpc.set_auth_sys("nfs4bench", 0, 0),
+               !establish(ctl.rpc, owner_prefix + "setup", 1, false, ctl.session, err)) {
+        std::fprintf(stderr, "nfs4bench: setup: %s\n", err.c_str());
+    } else {
+        if (setup(cfg, ctl, data, tree)) {
+            std::vector<std::unique_ptr<ThreadStats>> stats;
+            std::vector<std::unique_ptr<LoadThread>> loaders;
+            for (uint32_t t = 0; t < cfg.threads; t++) {
+                stats.push_back(std::make_unique<ThreadStats>());
+                loaders.push_back(std::make_unique<LoadThread>(cfg, tree, *stats.back()));
+            }
+            uint32_t connected = 0;
+            uint32_t slots_granted = cfg.slots;
+            for (uint32_t i = 0; i < cfg.clients; i++) {
+                auto c = std::make_unique<Client>();
+                if (!c->rpc.connect(cfg.host, cfg.port, err)) {
+                    std::fprintf(stderr, "nfs4bench: connect %s: %s\n", target.c_str(),
+                                 err.c_str());
+                    break;
+                }
+                c->rpc.set_auth_sys("nfs4bench", 0, 0);
+                if (!establish(c->rpc, owner_prefix + std::to_string(i), cfg.slots, true,
+                               c->session, err)) {
+                    std::fprintf(stderr, "nfs4bench: client %u: %s\n", i, err.c_str());
+                    break;
+                }
+                slots_granted = std::min(slots_granted, c->session.slots);
+                c->id = i;
+                c->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+                c->slots.resize(c->session.slots);
+                c->slots[0].seqid = 1;  // RECLAIM_COMPLETE
+                for (size_t s = 1; s < c->slots.size(); s++) c->slots[s].seqid = 0;
+                c->chains.resize(c->session.slots);
+                for (size_t s = 0; s < c->chains.size(); s++) {
+                    std::string owner = "o" + std::to_string(i) + "." + std::to_string(s);
+                    c->chains[s].owner.assign(owner.begin(), owner.end());
+                }
+                loaders[i % cfg.threads]->add(std::move(c));
+                connected++;
+            }
+
+            if (connected == cfg.clients) {
+                uint64_t start = LatencyStats::now_ns();
+                uint64_t deadline = start + static_cast<uint64_t>(cfg.seconds * 1e9);
+                std::vector<std::thread> threads;
+                for (auto& l : loaders)
+                    threads.emplace_back([&l, deadline] { l->run(deadline); });
+                for (auto& t : threads) t.join();
+                double elapsed = (LatencyStats::now_ns() - start) / 1e9;
+
+                FILE* out = stdout;
+                if (!cfg.json_path.empty()) out = std::fopen(cfg.json_path.c_str(), "w");
+                if (!out) {
+                    std::fprintf(stderr, "nfs4bench: %s: %s\n", cfg.json_path.c_str(),
+                                 std::strerror(errno));
+                } else {
+                    Summary sum = summarize(stats);
+                    write_report(out, cfg, target, slots_granted, sum, elapsed);
+                    if (out != stdout) std::fclose(out);
+                    rc = sum.compounds > 0 && sum.total_errors == 0 ? 0 : 1;
+                }
+            }
+            for (auto& l : loaders)
+                for (auto& c : l->clients())
+                    if (!c->dead) destroy_session(c->rpc, c->session);
+            loaders.clear();  // closes the connections
+        }
+        if (!cfg.keep && temp_dir.empty()) cleanup(ctl, tree);
+        destroy_session(ctl.rpc, ctl.session);
+    }
+    ctl.rpc.close();
+
+    if (rpc) rpc->stop();
+    if (!temp_dir.empty() && !cfg.keep) {
+        std::string cmd = "rm -rf " + temp_dir;
+        if (std::system(cmd.c_str()) != 0)
+            std::fprintf(stderr, "nfs4bench: could not remove %s\n", temp_dir.c_str());
+    }
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    Config cfg;
+    if (!parse_args(argc, argv, cfg)) {
+        usage();
+        return 2;
+    }
+    try {
+        return run(cfg);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "nfs4bench: %s\n", e.what());
+        return 1;
+    }
+}
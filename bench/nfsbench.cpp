@@ -0,0 +1,873 @@
+// NFSv3 load generator.
+//
+// Speaks MOUNT3 and NFSv3 over TCP with the server's own XDR codec and
+// record marking, so load tests need no kernel client. --threads event-loop
+// threads drive --connections connections, each keeping up to --depth
+// calls in flight.
+//
+//   workloads (--workload)
+//     getattr     — GETATTR storm over the data files
+//     lookup-miss — LOOKUP of names that do not exist (NFS3ERR_NOENT expected)
+//     seqread     — --io-size READs walking a file per connection
+//     randread    — --io-size READs at random aligned offsets
+//     seqwrite    — UNSTABLE WRITEs walking a file per connection
+//     randwrite   — UNSTABLE WRITEs at random aligned offsets
+//     churn       — CREATE of a fresh name, then its REMOVE
+//     readdirplus — READDIRPLUS walks of a --dir-entries directory, one
+//                   cookie cursor per in-flight slot
+//     mixed       — getattr=40,lookup=15,lookup_miss=5,read_rand=15,
+//                   write_rand=10,create=10,readdirplus=5
+//
+//   --mix op=weight,... picks ops at random by weight instead; ops are
+//   getattr lookup lookup_miss read_seq read_rand write_seq write_rand
+//   create readdirplus (a create is always followed by its remove).
+//
+// Target: a running nfsd (--host/--port, default 127.0.0.1:2049), or
+// --inprocess, which serves --export DIR (default: a temporary directory)
+// from LocalFs through MOUNT3 and NFSv3 on an RpcServer at an ephemeral
+// port in this process. With --inprocess, --capture FILE also records the
+// run's calls and replies for bench/nfsreplay, and --fault RULE (repeatable;
+// see vfs/fault_vfs.h) slows or fails the export's VFS calls to show tail
+// latency over degraded storage.
+//
+// Setup is not timed: MNT, a work directory holding --files files of
+// --file-size bytes and, for readdirplus, a directory of --dir-entries
+// files. The work directory is removed afterwards unless --keep.
+//
+// The report is one JSON document on stdout (or --json FILE): ops/s and
+// MB/s overall, and per op the count, errors and mean/p50/p90/p99/p999/max
+// latency in microseconds, timed from queueing the call to parsing its
+// reply. The exit status is non-zero if setup fails, nothing completes, or
+// any call fails.
+//
+// Usage: nfsbench [--host H] [--port P] [--inprocess] [--export DIR]
+//                 [--workload NAME | --mix op=w,...] [--seconds S]
+//                 [--connections N] [--threads N] [--depth N]
+//                 [--io-size B] [--file-size B] [--files N] [--dir-entries N]
+//                 [--json FILE] [--keep] [--capture FILE] [--fault RULE]...
+//
+// Sizes accept K, M and G suffixes.
+
+#include "bench_client.h"
+#include "mount/mount_server.h"
+#include "mount/mount_types.h"
+#include "nfs/nfs_server.h"
+#include "rpc/rpc_capture.h"
+#include "rpc/rpc_server.h"
+#include "rpc/rpc_types.h"
+#include "stats/latency_stats.h"
+#include "vfs/fault_vfs.h"
+#include "vfs/local_fs.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <poll.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+enum class Op : uint8_t {
+    GETATTR, LOOKUP, LOOKUP_MISS, READ_SEQ, READ_RAND, WRITE_SEQ, WRITE_RAND,
+    CREATE, REMOVE, READDIRPLUS, COUNT
+};
+static constexpr size_t kOps = static_cast<size_t>(Op::COUNT);
+
+static const char* const kOpNames[kOps] = {
+    "getattr", "lookup", "lookup_miss", "read_seq", "read_rand", "write_seq",
+    "write_rand", "create", "remove", "readdirplus"};
+
+struct Workload {
+    const char* name;
+    const char* mix;
+};
+
+static const Workload kWorkloads[] = {
+    {"getattr", "getattr=1"},
+    {"lookup-miss", "lookup_miss=1"},
+    {"seqread", "read_seq=1"},
+    {"randread", "read_rand=1"},
+    {"seqwrite", "write_seq=1"},
+    {"randwrite", "write_rand=1"},
+    {"churn", "create=1"},
+    {"readdirplus", "readdirplus=1"},
+    {"mixed", "getattr=40,lookup=15,lookup_miss=5,read_rand=15,write_rand=10,create=10,"
+              "readdirplus=5"},
+};
+
+struct Config {
+    std::string host = "127.0.0.1";
+    uint16_t port = 2049;
+    bool inprocess = false;
+    std::string export_dir;
+    std::string workload = "mixed";
+    std::string mix;
+    double seconds = 10;
+    uint32_t connections = 16;
+    uint32_t threads = 4;
+    uint32_t depth = 8;
+    uint32_t io_size = 64 * 1024;
+    uint64_t file_size = 1024 * 1024;
+    uint32_t files = 16;
+    uint32_t dir_entries = 1000;
+    std::string json_path;
+    std::vector<std::string> faults;
+    bool keep = false;
+    std::string capture_path;
+
+    std::array<uint32_t, kOps> weights{};
+};
+
+// "getattr=40,read_rand=20": weight per op
+static bool parse_mix(const std::string& spec, std::array<uint32_t, kOps>& weights) {
+    weights.fill(0);
+    size_t pos = 0;
+    while (pos < spec.size()) {
+        size_t comma = spec.find(',', pos);
+        if (comma == std::string::npos) comma = spec.size();
+        std::string item = spec.substr(pos, comma - pos);
+        pos = comma + 1;
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) return false;
+        std::string name = item.substr(0, eq);
+        size_t op = 0;
+        while (op < kOps && name != kOpNames[op]) op++;
+        if (op == kOps || op == static_cast<size_t>(Op::REMOVE)) return false;
+        weights[op] = static_cast<uint32_t>(std::atoi(item.c_str() + eq + 1));
+    }
+    uint64_t total = 0;
+    for (uint32_t w : weights) total += w;
+    return total > 0;
+}
+
+static bool uses(const Config& cfg, Op op) {
+    return cfg.weights[static_cast<size_t>(op)] != 0;
+}
+
+// --- Setup ---
+
+struct Tree {
+    FileHandle root;
+    FileHandle work;
+    std::string work_name;
+    std::vector<FileHandle> files;
+    std::vector<std::string> file_names;
+    FileHandle bigdir;
+    uint32_t dir_entries = 0;
+};
+
+static bool nfs_call(RpcConnection& conn, uint32_t proc, const XdrEncoder& args,
+                     std::vector<uint8_t>& body) {
+    return conn.call(NFS_PROGRAM, NFS_V3, proc, args, body);
+}
+
+static NfsStat3 make_dir(RpcConnection& conn, const FileHandle& parent, const std::string& name,
+                         FileHandle& out) {
+    XdrEncoder args;
+    encode_fh3(args, parent);
+    args.encode_string(name);
+    encode_sattr3_mode(args, 0755);
+    std::vector<uint8_t> body;
+    if (!nfs_call(conn, NFSPROC3_MKDIR, args, body)) return NfsStat3::NFS3ERR_SERVERFAULT;
+    return decode_create_reply(body.data(), body.size(), out);
+}
+
+static NfsStat3 make_file(RpcConnection& conn, const FileHandle& dir, const std::string& name,
+                          FileHandle& out) {
+    XdrEncoder args;
+    encode_fh3(args, dir);
+    args.encode_string(name);
+    args.encode_uint32(UNCHECKED);
+    encode_sattr3_mode(args, 0644);
+    std::vector<uint8_t> body;
+    if (!nfs_call(conn, NFSPROC3_CREATE, args, body)) return NfsStat3::NFS3ERR_SERVERFAULT;
+    return decode_create_reply(body.data(), body.size(), out);
+}
+
+static void encode_write(XdrEncoder& args, const FileHandle& fh, uint64_t offset,
+                         const std::vector<uint8_t>& data, uint32_t stable) {
+    encode_fh3(args, fh);
+    args.encode_uint64(offset);
+    args.encode_uint32(static_cast<uint32_t>(data.size()));
+    args.encode_uint32(stable);
+    args.encode_opaque(data.data(), data.size());
+}
+
+static NfsStat3 remove_name(RpcConnection& conn, uint32_t proc, const FileHandle& dir,
+                            const std::string& name) {
+    XdrEncoder args;
+    encode_fh3(args, dir);
+    args.encode_string(name);
+    std::vector<uint8_t> body;
+    if (!nfs_call(conn, proc, args, body)) return NfsStat3::NFS3ERR_SERVERFAULT;
+    return decode_status(body.data(), body.size());
+}
+
+static bool fail(const char* what, NfsStat3 status) {
+    std::fprintf(stderr, "nfsbench: setup: %s failed (nfsstat3 %u)\n", what,
+                 static_cast<unsigned>(status));
+    return false;
+}
+
+static bool setup(const Config& cfg, RpcConnection& conn, const std::vector<uint8_t>& data,
+                  Tree& tree) {
+    // RFC 1813 §A.5.2 - MNT; "/" names the server's export
+    XdrEncoder mnt;
+    mnt.encode_string("/");
+    std::vector<uint8_t> body;
+    if (!conn.call(MOUNT_PROGRAM, MOUNT_V3, MOUNTPROC3_MNT, mnt, body) ||
+        !decode_mnt_reply(body.data(), body.size(), tree.root)) {
+        std::fprintf(stderr, "nfsbench: setup: MNT failed\n");
+        return false;
+    }
+
+    tree.work_name = "nfsbench." + std::to_string(getpid());
+    NfsStat3 st = make_dir(conn, tree.root, tree.work_name, tree.work);
+    if (st != NfsStat3::NFS3_OK) return fail("MKDIR of the work directory", st);
+
+    bool need_files = uses(cfg, Op::GETATTR) || uses(cfg, Op::LOOKUP) ||
+                      uses(cfg, Op::READ_SEQ) || uses(cfg, Op::READ_RAND) ||
+                      uses(cfg, Op::WRITE_SEQ) || uses(cfg, Op::WRITE_RAND);
+    bool need_data = uses(cfg, Op::READ_SEQ) || uses(cfg, Op::READ_RAND);
+    for (uint32_t i = 0; need_files && i < cfg.files; i++) {
+        std::string name = "f" + std::to_string(i);
+        FileHandle fh;
+        st = make_file(conn, tree.work, name, fh);
+        if (st != NfsStat3::NFS3_OK) return fail("CREATE of a data file", st);
+        for (uint64_t off = 0; need_data && off < cfg.file_size; off += data.size()) {
+            XdrEncoder args;
+            encode_write(args, fh, off, data, UNSTABLE);
+            if (!nfs_call(conn, NFSPROC3_WRITE, args, body))
+                return fail("WRITE of a data file", NfsStat3::NFS3ERR_SERVERFAULT);
+            st = decode_status(body.data(), body.size());
+            if (st != NfsStat3::NFS3_OK) return fail("WRITE of a data file", st);
+        }
+        tree.files.push_back(fh);
+        tree.file_names.push_back(name);
+    }
+
+    if (uses(cfg, Op::READDIRPLUS)) {
+        st = make_dir(conn, tree.work, "dir", tree.bigdir);
+        if (st != NfsStat3::NFS3_OK) return fail("MKDIR of the listing directory", st);
+        char name[32];
+        for (uint32_t i = 0; i < cfg.dir_entries; i++) {
+            std::snprintf(name, sizeof(name), "entry%07u", i);
+            FileHandle fh;
+            st = make_file(conn, tree.bigdir, name, fh);
+            if (st != NfsStat3::NFS3_OK) return fail("CREATE of a directory entry", st);
+            tree.dir_entries++;
+        }
+    }
+    return true;
+}
+
+static void cleanup(RpcConnection& conn, const Tree& tree) {
+    char name[32];
+    for (uint32_t i = 0; i < tree.dir_entries; i++) {
+        std::snprintf(name, sizeof(name), "entry%07u", i);
+        remove_name(conn, NFSPROC3_REMOVE, tree.bigdir, name);
+    }
+    if (!tree.bigdir.empty()) remove_name(conn, NFSPROC3_RMDIR, tree.work, "dir");
+    for (const auto& name : tree.file_names) remove_name(conn, NFSPROC3_REMOVE, tree.work, name);
+    if (!tree.work.empty()) remove_name(conn, NFSPROC3_RMDIR, tree.root, tree.work_name);
+}
+
+// --- Load ---
+
+struct OpStats {
+    LatencyHistogram latency;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+};
+
+struct ThreadStats {
+    std::array<OpStats, kOps> ops;
+    uint64_t connection_errors = 0;
+};
+
+struct Pending {
+    uint32_t xid = 0;
+    Op op = Op::GETATTR;
+    uint32_t cursor = 0;  // READDIRPLUS: index into Conn::cursors
+    uint64_t start_ns = 0;
+    bool busy = false;
+};
+
+// One READDIRPLUS walk of the listing directory
+struct Cursor {
+    uint64_t cookie = 0;
+    uint64_t verf = 0;
+    bool busy = false;
+};
+
+struct Conn {
+    RpcConnection rpc;
+    uint32_t id = 0;
+    std::vector<Pending> slots;
+    std::vector<Cursor> cursors;
+    uint32_t inflight = 0;
+    uint64_t rng = 0;
+    uint64_t seq_offset = 0;
+    uint64_t created = 0;
+    std::deque<std::string> to_remove;  // created, REMOVE not yet sent
+    bool dead = false;
+};
+
+class LoadThread {
+public:
+    LoadThread(const Config& cfg, const Tree& tree, const std::vector<uint8_t>& data,
+               ThreadStats& stats)
+        : cfg_(cfg), tree_(tree), data_(data), stats_(stats) {
+        for (size_t i = 0; i < kOps; i++) {
+            total_weight_ += cfg.weights[i];
+            cumulative_[i] = total_weight_;
+        }
+    }
+
+    void add(std::unique_ptr<Conn> conn) { conns_.push_back(std::move(conn)); }
+
+    void run(uint64_t deadline_ns) {
+        // Calls still in flight at the deadline get this long to finish
+        const uint64_t drain_ns = 5000000000ull;
+        std::vector<pollfd> pfds;
+        for (;;) {
+            uint64_t now = LatencyStats::now_ns();
+            bool issuing = now < deadline_ns;
+            uint32_t inflight = 0;
+            pfds.clear();
+            for (auto& c : conns_) {
+                if (c->dead) continue;
+                // Past the deadline only the REMOVEs of created names go out
+                while (c->inflight < cfg_.depth && (issuing || !c->to_remove.empty()))
+                    issue(*c);
+                if (c->rpc.want_write() && !c->rpc.flush()) {
+                    lost(*c);
+                    continue;
+                }
+                inflight += c->inflight;
+                short events = POLLIN;
+                if (c->rpc.want_write()) events |= POLLOUT;
+                pfds.push_back({c->rpc.fd(), events, 0});
+            }
+            if (!issuing && (inflight == 0 || now > deadline_ns + drain_ns)) break;
+            if (pfds.empty()) break;
+
+            int rc = poll(pfds.data(), pfds.size(), 100);
+            if (rc < 0 && errno != EINTR) break;
+            if (rc <= 0) continue;
+
+            size_t p = 0;
+            for (auto& c : conns_) {
+                if (c->dead) continue;
+                const pollfd& pfd = pfds[p++];
+                if (pfd.revents & POLLOUT && !c->rpc.flush()) {
+                    lost(*c);
+                    continue;
+                }
+                if (pfd.revents & (POLLIN | POLLHUP | POLLERR) &&
+                    !c->rpc.receive([&](const RpcReply& r) { complete(*c, r); }))
+                    lost(*c);
+            }
+        }
+    }
+
+private:
+    Op pick(Conn& c) {
+        uint64_t r = xorshift(c.rng) % total_weight_;
+        size_t i = 0;
+        while (r >= cumulative_[i]) i++;
+        return static_cast<Op>(i);
+    }
+
+    const FileHandle& random_file(Conn& c, size_t& index) {
+        index = xorshift(c.rng) % tree_.files.size();
+        return tree_.files[index];
+    }
+
+    uint64_t random_offset(Conn& c) {
+        uint64_t blocks = std::max<uint64_t>(1, cfg_.file_size / cfg_.io_size);
+        return (xorshift(c.rng) % blocks) * cfg_.io_size;
+    }
+
+    uint64_t next_seq_offset(Conn& c) {
+        uint64_t off = c.seq_offset;
+        c.seq_offset += cfg_.io_size;
+        if (c.seq_offset + cfg_.io_size > cfg_.file_size) c.seq_offset = 0;
+        return off;
+    }
+
+    void issue(Conn& c) {
+        // A created name is removed by the next call on the connection;
+        // the server runs one connection's calls in order
+        Op op = c.to_remove.empty() ? pick(c) : Op::REMOVE;
+        XdrEncoder args;
+        uint32_t proc = 0;
+        uint32_t cursor = 0;
+        size_t file = 0;
+        switch (op) {
+            case Op::GETATTR:
+                proc = NFSPROC3_GETATTR;
+                encode_fh3(args, random_file(c, file));
+                break;
+            case Op::LOOKUP:
+                proc = NFSPROC3_LOOKUP;
+                random_file(c, file);
+                encode_fh3(args, tree_.work);
+                args.encode_string(tree_.file_names[file]);
+                break;
+            case Op::LOOKUP_MISS:
+                proc = NFSPROC3_LOOKUP;
+                encode_fh3(args, tree_.work);
+                args.encode_string("missing" + std::to_string(xorshift(c.rng) & 0xffffff));
+                break;
+            case Op::READ_SEQ:
+            case Op::READ_RAND:
+                proc = NFSPROC3_READ;
+                if (op == Op::READ_SEQ) {
+                    encode_fh3(args, tree_.files[c.id % tree_.files.size()]);
+                    args.encode_uint64(next_seq_offset(c));
+                } else {
+                    encode_fh3(args, random_file(c, file));
+                    args.encode_uint64(random_offset(c));
+                }
+                args.encode_uint32(cfg_.io_size);
+                break;
+            case Op::WRITE_SEQ:
+                proc = NFSPROC3_WRITE;
+                encode_write(args, tree_.files[c.id % tree_.files.size()], next_seq_offset(c),
+                             data_, UNSTABLE);
+                break;
+            case Op::WRITE_RAND: {
+                proc = NFSPROC3_WRITE;
+                const FileHandle& fh = random_file(c, file);
+                encode_write(args, fh, random_offset(c), data_, UNSTABLE);
+                break;
+            }
+            case Op::CREATE: {
+                proc = NFSPROC3_CREATE;
+                std::string name = "c" + std::to_string(c.id) + "." + std::to_string(c.created++);
+                encode_fh3(args, tree_.work);
+                args.encode_string(name);
+                args.encode_uint32(UNCHECKED);
+                encode_sattr3_mode(args, 0644);
+                c.to_remove.push_back(std::move(name));
+                break;
+            }
+            case Op::REMOVE:
+                proc = NFSPROC3_REMOVE;
+                encode_fh3(args, tree_.work);
+                args.encode_string(c.to_remove.front());
+                c.to_remove.pop_front();
+                break;
+            case Op::READDIRPLUS: {
+                proc = NFSPROC3_READDIRPLUS;
+                // At most depth walks are in flight, so one is always idle
+                while (c.cursors[cursor].busy) cursor++;
+                Cursor& cur = c.cursors[cursor];
+                cur.busy = true;
+                encode_fh3(args, tree_.bigdir);
+                args.encode_uint64(cur.cookie);
+                args.encode_uint64(cur.verf);
+                args.encode_uint32(8192);   // dircount
+                args.encode_uint32(65536);  // maxcount
+                break;
+            }
+            case Op::COUNT:
+                return;
+        }
+
+        Pending* slot = nullptr;
+        for (auto& s : c.slots) {
+            if (!s.busy) {
+                slot = &s;
+                break;
+            }
+        }
+        slot->busy = true;
+        slot->op = op;
+        slot->cursor = cursor;
+        slot->start_ns = LatencyStats::now_ns();
+        slot->xid = c.rpc.queue_call(NFS_PROGRAM, NFS_V3, proc, args);
+        c.inflight++;
+    }
+
+    void complete(Conn& c, const RpcReply& r) {
+        Pending* slot = nullptr;
+        for (auto& s : c.slots) {
+            if (s.busy && s.xid == r.xid) {
+                slot = &s;
+                break;
+            }
+        }
+        if (!slot) return;
+        slot->busy = false;
+        c.inflight--;
+
+        OpStats& st = stats_.ops[static_cast<size_t>(slot->op)];
+        st.latency.record(LatencyStats::now_ns() - slot->start_ns);
+        bool ok = r.accepted && r.accept_stat == static_cast<uint32_t>(RpcAcceptStatus::SUCCESS);
+        if (!ok) {
+            st.errors++;
+            if (slot->op == Op::READDIRPLUS) c.cursors[slot->cursor] = Cursor{};
+            return;
+        }
+
+        NfsStat3 status = NfsStat3::NFS3_OK;
+        switch (slot->op) {
+            case Op::LOOKUP_MISS:
+                status = decode_status(r.body, r.body_len);
+                ok = status == NfsStat3::NFS3ERR_NOENT;
+                break;
+            case Op::READ_SEQ:
+            case Op::READ_RAND: {
+                uint32_t count = 0;
+                bool eof = false;
+                status = decode_read_reply(r.body, r.body_len, count, eof);
+                ok = status == NfsStat3::NFS3_OK;
+                if (ok) st.bytes += count;
+                break;
+            }
+            case Op::WRITE_SEQ:
+            case Op::WRITE_RAND:
+                status = decode_status(r.body, r.body_len);
+                ok = status == NfsStat3::NFS3_OK;
+                if (ok) st.bytes += data_.size();
+                break;
+            case Op::READDIRPLUS: {
+                Cursor& cur = c.cursors[slot->cursor];
+                ReaddirplusPage page;
+                status = decode_readdirplus_reply(r.body, r.body_len, page);
+                ok = status == NfsStat3::NFS3_OK;
+                if (ok && !page.eof && page.entries) {
+                    cur.cookie = page.last_cookie;
+                    cur.verf = page.cookieverf;
+                } else {
+                    cur.cookie = 0;
+                    cur.verf = 0;
+                }
+                cur.busy = false;
+                break;
+            }
+            default:
+                status = decode_status(r.body, r.body_len);
+                ok = status == NfsStat3::NFS3_OK;
+                break;
+        }
+        if (!ok) st.errors++;
+    }
+
+    // The connection failed: its calls in flight count as errors
+    void lost(Conn& c) {
+        c.dead = true;
+        stats_.connection_errors++;
+        for (auto& s : c.slots) {
+            if (s.busy) stats_.ops[static_cast<size_t>(s.op)].errors++;
+        }
+        c.inflight = 0;
+        c.rpc.close();
+    }
+
+    const Config& cfg_;
+    const Tree& tree_;
+    const std::vector<uint8_t>& data_;
+    ThreadStats& stats_;
+    std::vector<std::unique_ptr<Conn>> conns_;
+    uint64_t total_weight_ = 0;
+    std::array<uint64_t, kOps> cumulative_{};
+};
+
+// --- Report ---
+
+struct Summary {
+    std::array<LatencySnapshot, kOps> latency{};
+    std::array<uint64_t, kOps> errors{};
+    LatencySnapshot all;
+    uint64_t ops = 0;
+    uint64_t total_errors = 0;  // failed calls and lost connections
+    uint64_t connection_errors = 0;
+    uint64_t read_bytes = 0;
+    uint64_t write_bytes = 0;
+};
+
+static Summary summarize(const std::vector<std::unique_ptr<ThreadStats>>& stats) {
+    Summary sum;
+    for (const auto& t : stats) {
+        for (size_t i = 0; i < kOps; i++) {
+            const OpStats& o = t->ops[i];
+            o.latency.add_to(sum.latency[i]);
+            sum.errors[i] += o.errors;
+            Op op = static_cast<Op>(i);
+            if (op == Op::READ_SEQ || op == Op::READ_RAND) sum.read_bytes += o.bytes;
+            if (op == Op::WRITE_SEQ || op == Op::WRITE_RAND) sum.write_bytes += o.bytes;
+        }
+        sum.connection_errors += t->connection_errors;
+    }
+    for (size_t i = 0; i < kOps; i++) {
+        sum.all.merge(sum.latency[i]);
+        sum.ops += sum.latency[i].count;
+        sum.total_errors += sum.errors[i];
+    }
+    sum.total_errors += sum.connection_errors;
+    return sum;
+}
+
+static void write_report(FILE* out, const Config& cfg, const std::string& target,
+                         const Summary& sum, double elapsed) {
+    std::fprintf(out, "{\n");
+    std::fprintf(out, "  \"target\": \"%s\",\n", target.c_str());
+    std::fprintf(out, "  \"workload\": \"%s\",\n",
+                 cfg.mix.empty() ? cfg.workload.c_str() : "custom");
+    std::fprintf(out, "  \"mix\": {");
+    bool first = true;
+    for (size_t i = 0; i < kOps; i++) {
+        if (!cfg.weights[i]) continue;
+        std::fprintf(out, "%s\"%s\": %u", first ? "" : ", ", kOpNames[i], cfg.weights[i]);
+        first = false;
+    }
+    std::fprintf(out, "},\n");
+    std::fprintf(out,
+                 "  \"connections\": %u, \"threads\": %u, \"depth\": %u, \"io_size\": %u, "
+                 "\"file_size\": %llu, \"files\": %u, \"dir_entries\": %u,\n",
+                 cfg.connections, cfg.threads, cfg.depth, cfg.io_size,
+                 static_cast<unsigned long long>(cfg.file_size), cfg.files, cfg.dir_entries);
+    std::fprintf(out, "  \"seconds\": %.3f,\n", elapsed);
+    std::fprintf(out, "  \"ops\": %llu, \"errors\": %llu, \"connection_errors\": %llu,\n",
+                 static_cast<unsigned long long>(sum.ops),
+                 static_cast<unsigned long long>(sum.total_errors - sum.connection_errors),
+                 static_cast<unsigned long long>(sum.connection_errors));
+    std::fprintf(out, "  \"ops_per_sec\": %.1f, \"read_mb_per_sec\": %.2f, "
+                      "\"write_mb_per_sec\": %.2f,\n",
+                 sum.ops / elapsed, sum.read_bytes / elapsed / 1048576.0,
+                 sum.write_bytes / elapsed / 1048576.0);
+    std::fprintf(out, "  \"latency\": {");
+    write_latency_json(out, sum.all);
+    std::fprintf(out, "},\n");
+    std::fprintf(out, "  \"by_op\": {");
+    first = true;
+    for (size_t i = 0; i < kOps; i++) {
+        const LatencySnapshot& s = sum.latency[i];
+        if (!s.count && !sum.errors[i]) continue;
+        std::fprintf(out, "%s\n    \"%s\": {\"ops\": %llu, \"errors\": %llu, \"ops_per_sec\": %.1f, ",
+                     first ? "" : ",", kOpNames[i], static_cast<unsigned long long>(s.count),
+                     static_cast<unsigned long long>(sum.errors[i]), s.count / elapsed);
+        write_latency_json(out, s);
+        std::fprintf(out, "}");
+        first = false;
+    }
+    std::fprintf(out, "\n  }\n}\n");
+}
+
+// --- Main ---
+
+static void usage() {
+    std::fprintf(stderr,
+                 "usage: nfsbench [--host H] [--port P] [--inprocess] [--export DIR]\n"
+                 "                [--workload NAME | --mix op=w,...] [--seconds S]\n"
+                 "                [--connections N] [--threads N] [--depth N]\n"
+                 "                [--io-size B] [--file-size B] [--files N] [--dir-entries N]\n"
+                 "                [--json FILE] [--keep] [--capture FILE] [--fault RULE]...\n"
+                 "workloads:");
+    for (const auto& w : kWorkloads) std::fprintf(stderr, " %s", w.name);
+    std::fprintf(stderr, "\nops:");
+    for (size_t i = 0; i < kOps; i++)
+        if (i != static_cast<size_t>(Op::REMOVE)) std::fprintf(stderr, " %s", kOpNames[i]);
+    std::fprintf(stderr, "\n");
+}
+
+static bool parse_args(int argc, char* argv[], Config& cfg) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        uint64_t v = 0;
+        auto size_arg = [&](uint64_t& out) {
+            return has_value && parse_size(argv[++i], out);
+        };
+        if (arg == "--host" && has_value) cfg.host = argv[++i];
+        else if (arg == "--port" && has_value) cfg.port = static_cast<uint16_t>(std::atoi(argv[++i]));
+        else if (arg == "--inprocess") cfg.inprocess = true;
+        else if (arg == "--export" && has_value) cfg.export_dir = argv[++i];
+        else if (arg == "--workload" && has_value) cfg.workload = argv[++i];
+        else if (arg == "--mix" && has_value) cfg.mix = argv[++i];
+        else if (arg == "--seconds" && has_value) cfg.seconds = std::atof(argv[++i]);
+        else if (arg == "--connections" && size_arg(v)) cfg.connections = static_cast<uint32_t>(v);
+        else if (arg == "--threads" && size_arg(v)) cfg.threads = static_cast<uint32_t>(v);
+        else if (arg == "--depth" && size_arg(v)) cfg.depth = static_cast<uint32_t>(v);
+        else if (arg == "--io-size" && size_arg(v)) cfg.io_size = static_cast<uint32_t>(v);
+        else if (arg == "--file-size" && size_arg(v)) cfg.file_size = v;
+        else if (arg == "--files" && size_arg(v)) cfg.files = static_cast<uint32_t>(v);
+        else if (arg == "--dir-entries" && size_arg(v)) cfg.dir_entries = static_cast<uint32_t>(v);
+        else if (arg == "--json" && has_value) cfg.json_path = argv[++i];
+        else if (arg == "--fault" && has_value) cfg.faults.push_back(argv[++i]);
+        else if (arg == "--keep") cfg.keep = true;
+        else if (arg == "--capture" && has_value) cfg.capture_path = argv[++i];
+        else {
+            std::fprintf(stderr, "nfsbench: bad argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+
+    std::string mix = cfg.mix;
+    if (mix.empty()) {
+        for (const auto& w : kWorkloads)
+            if (cfg.workload == w.name) mix = w.mix;
+        if (mix.empty()) {
+            std::fprintf(stderr, "nfsbench: unknown workload: %s\n", cfg.workload.c_str());
+            return false;
+        }
+    }
+    if (!parse_mix(mix, cfg.weights)) {
+        std::fprintf(stderr, "nfsbench: bad --mix: %s\n", mix.c_str());
+        return false;
+    }
+    if (!cfg.connections || !cfg.threads || !cfg.depth || !cfg.io_size || !cfg.files ||
+        cfg.io_size > 1024 * 1024) {
+        std::fprintf(stderr, "nfsbench: counts must be non-zero and --io-size at most 1M\n");
+        return false;
+    }
+    if ((!cfg.capture_path.empty() || !cfg.faults.empty()) && !cfg.inprocess) {
+        std::fprintf(stderr, "nfsbench: --capture and --fault need --inprocess\n");
+        return false;
+    }
+    cfg.threads = std::min(cfg.threads, cfg.connections);
+    cfg.file_size = std::max<uint64_t>(cfg.file_size, cfg.io_size);
+    return true;
+}
+
+static int run(Config& cfg) {
+    raise_fd_limit();
+
+    // --inprocess: MOUNT3 and NFSv3 over LocalFs at an ephemeral port
+    std::string temp_dir;
+    std::unique_ptr<LocalFs> fs;
+    std::unique_ptr<FaultVfs> faults;
+    std::unique_ptr<MountServer> mount_srv;
+    std::unique_ptr<NfsServer> nfs_srv;
+    std::unique_ptr<RpcCapture> capture;
+    std::unique_ptr<RpcServer> rpc;
+    if (cfg.inprocess) {
+        if (cfg.export_dir.empty()) {
+            char tmpl[] = "/tmp/nfsbench_XXXXXX";
+            if (!mkdtemp(tmpl)) {
+                std::fprintf(stderr, "nfsbench: mkdtemp: %s\n", std::strerror(errno));
+                return 1;
+            }
+            temp_dir = cfg.export_dir = tmpl;
+        }
+        fs = std::make_unique<LocalFs>(cfg.export_dir);
+        if (!make_fault_vfs("nfsbench", *fs, cfg.export_dir, cfg.faults, faults)) return 1;
+        Vfs& vfs = faults ? static_cast<Vfs&>(*faults) : *fs;
+        mount_srv = std::make_unique<MountServer>(vfs, std::vector<std::string>{cfg.export_dir});
+        nfs_srv = std::make_unique<NfsServer>(vfs);
+        rpc = std::make_unique<RpcServer>();
+        rpc->register_program(MOUNT_PROGRAM, MOUNT_V3, mount_srv->get_handlers());
+        rpc->register_program(NFS_PROGRAM, NFS_V3, nfs_srv->get_handlers());
+        if (!cfg.capture_path.empty()) {
+            capture = std::make_unique<RpcCapture>(cfg.capture_path, true);
+            if (!capture->open()) {
+                std::fprintf(stderr, "nfsbench: %s: %s\n", cfg.capture_path.c_str(),
+                             std::strerror(errno));
+                return 1;
+            }
+            rpc->set_capture(capture.get());
+        }
+        rpc->start(0);
+        cfg.host = "127.0.0.1";
+        cfg.port = rpc->port();
+    }
+    const std::string target = cfg.host + ":" + std::to_string(cfg.port);
+
+    std::vector<uint8_t> data(cfg.io_size);
+    for (size_t i = 0; i < data.size(); i++) data[i] = static_cast<uint8_t>(i * 31 + 7);
+
+    int rc = 1;
+    Tree tree;
+    RpcConnection control;
+    std::string err;
+    if (!control.connect(cfg.host, cfg.port, err)) {
+        std::fprintf(stderr, "nfsbench: connect %s: %s\n", target.c_str(), err.c_str());
+    } else {
+        control.set_auth_sys("nfsbench", 0, 0);
+        if (setup(cfg, control, data, tree)) {
+            std::vector<std::unique_ptr<ThreadStats>> stats;
+            std::vector<std::unique_ptr<LoadThread>> loaders;
+            for (uint32_t t = 0; t < cfg.threads; t++) {
+                stats.push_back(std::make_unique<ThreadStats>());
+                loaders.push_back(std::make_unique<LoadThread>(cfg, tree, data, *stats.back()));
+            }
+            uint32_t connected = 0;
+            for (uint32_t i = 0; i < cfg.connections; i++) {
+                auto c = std::make_unique<Conn>();
+                if (!c->rpc.connect(cfg.host, cfg.port, err)) {
+                    std::fprintf(stderr, "nfsbench: connect %s: %s\n", target.c_str(),
+                                 err.c_str());
+                    break;
+                }
+                c->rpc.set_auth_sys("nfsbench", 0, 0);
+                c->id = i;
+                c->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+                c->slots.resize(cfg.depth);
+                c->cursors.resize(cfg.depth);
+                loaders[i % cfg.threads]->add(std::move(c));
+                connected++;
+            }
+
+            if (connected == cfg.connections) {
+                uint64_t start = LatencyStats::now_ns();
+                uint64_t deadline = start + static_cast<uint64_t>(cfg.seconds * 1e9);
+                std::vector<std::thread> threads;
+                for (auto& l : loaders)
+                    threads.emplace_back([&l, deadline] { l->run(deadline); });
+                for (auto& t : threads) t.join();
+                double elapsed = (LatencyStats::now_ns() - start) / 1e9;
+                loaders.clear();  // closes the connections
+
+                FILE* out = stdout;
+                if (!cfg.json_path.empty()) out = std::fopen(cfg.json_path.c_str(), "w");
+                if (!out) {
+                    std::fprintf(stderr, "nfsbench: %s: %s\n", cfg.json_path.c_str(),
+                                 std::strerror(errno));
+                } else {
+                    Summary sum = summarize(stats);
+                    write_report(out, cfg, target, sum, elapsed);
+                    if (out != stdout) std::fclose(out);
+                    rc = sum.ops > 0 && sum.total_errors == 0 ? 0 : 1;
+                }
+            }
+        }
+        if (!cfg.keep && temp_dir.empty()) cleanup(control, tree);
+    }
+    control.close();
+
+    if (rpc) rpc->stop();
+    if (capture && capture->dropped()) {
+        std::fprintf(stderr, "nfsbench: capture dropped %llu records\n",
+                     static_cast<unsigned long long>(capture->dropped()));
+    }
+    if (!temp_dir.empty() && !cfg.keep) {
+        std::string cmd = "rm -rf " + temp_dir;
+        if (std::system(cmd.c_str()) != 0)
+            std::fprintf(stderr, "nfsbench: could not remove %s\n", temp_dir.c_str());
+    }
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    Config cfg;
+    if (!parse_args(argc, argv, cfg)) {
+        usage();
+        return 2;
+    }
+    try {
+        return run(cfg);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "nfsbench: %s\n", e.what());
+        return 1;
+    }
+}
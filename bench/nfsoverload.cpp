@@ -0,0 +1,377 @@
+// Goodput under overload, with and without overload control.
+//
+// Serves a temporary directory in-process through MOUNT3 and NFSv3, with a
+// FaultVfs bandwidth cap on READ (--bw) as the bottleneck, so the server
+// completes about bw / io-size READs per second whatever the offered load.
+// An open-loop client then offers --load times that rate of --io-size READs
+// at random offsets, Poisson arrivals spread round-robin over --connections
+// connections, for --seconds, twice: against a plain server and against one
+// with overload control (rpc/rpc_overload.h; --target-ms, --interval-ms).
+//
+// Open loop means arrivals do not wait for replies, as with many clients
+// each doing their own thing. Each connection holds at most --max-inflight
+// calls (a client's RPC slot table); an arrival that finds it full is lost,
+// as the client would have timed it out. NFS3ERR_JUKEBOX answers are
+// counted, not retried: a client backs off for seconds before it retries.
+//
+// Goodput is READs answered NFS3_OK within --deadline-ms of being sent,
+// per second: what clients with that timeout get done. Without control the
+// queue in the server's sockets grows until nearly every reply is late;
+// with it the excess is refused at once and the rest are served in time.
+//
+// The report is one JSON document on stdout (or --json FILE) with, per
+// run, the offered rate, goodput, late, JUKEBOX and lost counts and the
+// latency of the in-time replies. The exit status is non-zero if setup
+// fails or a run completes nothing.
+//
+// Usage: nfsoverload [--seconds S] [--load X] [--bw B] [--io-size B]
+//                    [--file-size B] [--connections N] [--max-inflight N]
+//                    [--deadline-ms MS] [--target-ms MS] [--interval-ms MS]
+//                    [--json FILE]
+//
+// Sizes accept K, M and G suffixes.
+
+#include "bench_client.h"
+#include "mount/mount_server.h"
+#include "mount/mount_types.h"
+#include "nfs/nfs_server.h"
+#include "rpc/rpc_overload.h"
+#include "rpc/rpc_server.h"
+#include "rpc/rpc_types.h"
+#include "stats/latency_stats.h"
+#include "vfs/fault_vfs.h"
+#include "vfs/local_fs.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <poll.h>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+struct Config {
+    double seconds = 3;
+    double load = 2;
+    uint64_t bw = 16 * 1024 * 1024;
+    uint32_t io_size = 16 * 1024;
+    uint64_t file_size = 16 * 1024 * 1024;
+    uint32_t connections = 8;
+    uint32_t max_inflight = 64;
+    double deadline_ms = 100;
+    double target_ms = 10;
+    double interval_ms = 100;
+    std::string json_path;
+};
+
+struct RunStats {
+    const char* name = "";
+    double elapsed = 0;
+    uint64_t offered = 0;   // arrivals
+    uint64_t good = 0;      // NFS3_OK within the deadline
+    uint64_t late = 0;      // NFS3_OK after it
+    uint64_t jukebox = 0;   // NFS3ERR_JUKEBOX
+    uint64_t errors = 0;    // anything else, unanswered calls and lost connections
+    uint64_t lost = 0;      // arrivals that found the slot table full
+    uint64_t shed = 0;      // the server's count
+    uint64_t episodes = 0;
+    LatencyHistogram latency;  // of the good replies
+};
+
+struct Conn {
+    RpcConnection rpc;
+    std::unordered_map<uint32_t, uint64_t> sent;  // xid -> send time
+    bool dead = false;
+};
+
+// MNT, then the data file's handle
+static bool setup(RpcConnection& conn, FileHandle& file) {
+    XdrEncoder mnt;
+    mnt.encode_string("/");
+    std::vector<uint8_t> body;
+    FileHandle root;
+    if (!conn.call(MOUNT_PROGRAM, MOUNT_V3, MOUNTPROC3_MNT, mnt, body) ||
+        !decode_mnt_reply(body.data(), body.size(), root)) {
+        std::fprintf(stderr, "nfsoverload: setup: MNT failed\n");
+        return false;
+    }
+    XdrEncoder lookup;
+    encode_fh3(lookup, root);
+    lookup.encode_string("data");
+    if (!conn.call(NFS_PROGRAM, NFS_V3, NFSPROC3_LOOKUP, lookup, body) ||
+        decode_lookup_reply(body.data(), body.size(), file) != NfsStat3::NFS3_OK) {
+        std::fprintf(stderr, "nfsoverload: setup: LOOKUP of the data file failed\n");
+        return false;
+    }
+    return true;
+}
+
+// One run of the open-loop load against a fresh server over dir
+static bool run_once(const Config& cfg, const std::string& dir, bool controlled,
+                     RunStats& st) {
+    LocalFs fs(dir);
+    std::unique_ptr<FaultVfs> faults;
+    const std::vector<std::string> rules = {"op=read,bw=" + std::to_string(cfg.bw)};
+    if (!make_fault_vfs("nfsoverload", fs, dir, rules, faults)) return false;
+    MountServer mount_srv(*faults, std::vector<std::string>{dir});
+    NfsServer nfs_srv(*faults);
+    OverloadControl control(static_cast<uint64_t>(cfg.target_ms * 1e6),
+                            static_cast<uint64_t>(cfg.interval_ms * 1e6));
+    RpcServer rpc;
+    rpc.register_program(MOUNT_PROGRAM, MOUNT_V3, mount_srv.get_handlers());
+    rpc.register_program(NFS_PROGRAM, NFS_V3, nfs_srv.get_handlers());
+    if (controlled) rpc.set_overload_control(&control);
+    rpc.start(0);
+
+    bool ok = false;
+    std::string err;
+    RpcConnection setup_conn;
+    FileHandle file;
+    std::vector<std::unique_ptr<Conn>> conns;
+    if (!setup_conn.connect("127.0.0.1", rpc.port(), err)) {
+        std::fprintf(stderr, "nfsoverload: connect: %s\n", err.c_str());
+    } else {
+        setup_conn.set_auth_sys("nfsoverload", 0, 0);
+        ok = setup(setup_conn, file);
+        for (uint32_t i = 0; ok && i < cfg.connections; i++) {
+            conns.push_back(std::make_unique<Conn>());
+            if (!conns.back()->rpc.connect("127.0.0.1", rpc.port(), err)) {
+                std::fprintf(stderr, "nfsoverload: connect: %s\n", err.c_str());
+                ok = false;
+            }
+            conns.back()->rpc.set_auth_sys("nfsoverload", 0, 0);
+        }
+    }
+    setup_conn.close();
+
+    if (ok) {
+        const double capacity = static_cast<double>(cfg.bw) / cfg.io_size;
+        const double mean_gap_ns = 1e9 / (capacity * cfg.load);
+        const uint64_t deadline_ns = static_cast<uint64_t>(cfg.deadline_ms * 1e6);
+        const uint64_t blocks = std::max<uint64_t>(1, cfg.file_size / cfg.io_size);
+        uint64_t rng = 0x9e3779b97f4a7c15ull;
+        // Exponential gaps: Poisson arrivals at capacity * load
+        auto gap = [&] {
+            double u = ((xorshift(rng) >> 11) + 1) * (1.0 / 9007199254740993.0);
+            return static_cast<uint64_t>(-std::log(u) * mean_gap_ns);
+        };
+
+        const uint64_t start = LatencyStats::now_ns();
+        const uint64_t end = start + static_cast<uint64_t>(cfg.seconds * 1e9);
+        // Calls still out at the end get this long to be answered
+        const uint64_t drain_end = end + 10000000000ull;
+        uint64_t next = start + gap();
+        size_t rr = 0;
+        std::vector<pollfd> pfds;
+        for (;;) {
+            uint64_t now = LatencyStats::now_ns();
+            for (; next <= now && next < end; next += gap()) {
+                st.offered++;
+                Conn& c = *conns[rr++ % conns.size()];
+                if (c.dead || c.sent.size() >= cfg.max_inflight) {
+                    st.lost++;
+                    continue;
+                }
+                XdrEncoder args;
+                encode_fh3(args, file);
+                args.encode_uint64((xorshift(rng) % blocks) * cfg.io_size);
+                args.encode_uint32(cfg.io_size);
+                c.sent[c.rpc.queue_call(NFS_PROGRAM, NFS_V3, NFSPROC3_READ, args)] = now;
+            }
+            size_t outstanding = 0;
+            pfds.clear();
+            for (auto& c : conns) {
+                if (!c->dead && c->rpc.want_write() && !c->rpc.flush()) c->dead = true;
+                if (c->dead) continue;
+                outstanding += c->sent.size();
+                short events = POLLIN;
+                if (c->rpc.want_write()) events |= POLLOUT;
+                pfds.push_back({c->rpc.fd(), events, 0});
+            }
+            if (now >= end && (outstanding == 0 || now >= drain_end)) break;
+            if (pfds.empty()) break;
+
+            // Wake for the next arrival, or every 10ms while draining
+            uint64_t wait_ns = next < end ? (next > now ? next - now : 0) : 10000000;
+            timespec ts{static_cast<time_t>(wait_ns / 1000000000),
+                        static_cast<long>(wait_ns % 1000000000)};
+            int rc = ppoll(pfds.data(), pfds.size(), &ts, nullptr);
+            if (rc < 0 && errno != EINTR) break;
+            if (rc <= 0) continue;
+
+            size_t p = 0;
+            for (auto& c : conns) {
+                if (c->dead) continue;
+                const pollfd& pfd = pfds[p++];
+                if (pfd.revents & POLLOUT && !c->rpc.flush()) {
+                    c->dead = true;
+                    continue;
+                }
+                if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+                bool alive = c->rpc.receive([&](const RpcReply& r) {
+                    auto it = c->sent.find(r.xid);
+                    if (it == c->sent.end()) return;
+                    const uint64_t ns = LatencyStats::now_ns() - it->second;
+                    c->sent.erase(it);
+                    NfsStat3 s = r.accepted && r.accept_stat == 0
+                                     ? decode_status(r.body, r.body_len)
+                                     : NfsStat3::NFS3ERR_SERVERFAULT;
+                    if (s == NfsStat3::NFS3_OK && ns <= deadline_ns) {
+                        st.good++;
+                        st.latency.record(ns);
+                    } else if (s == NfsStat3::NFS3_OK) {
+                        st.late++;
+                    } else if (s == NfsStat3::NFS3ERR_JUKEBOX) {
+                        st.jukebox++;
+                    } else {
+                        st.errors++;
+                    }
+                });
+                if (!alive) c->dead = true;
+            }
+        }
+        st.elapsed = (std::min(LatencyStats::now_ns(), end) - start) / 1e9;
+        for (auto& c : conns) st.errors += c->sent.size();
+    }
+    conns.clear();  // closes the connections before the server stops
+    rpc.stop();
+    st.shed = control.shed_count(3);
+    st.episodes = control.episodes();
+    return ok;
+}
+
+static void write_run(FILE* out, const RunStats& st, bool last) {
+    LatencySnapshot lat;
+    st.latency.add_to(lat);
+    std::fprintf(out, "    \"%s\": {\"offered_per_sec\": %.1f, \"goodput_per_sec\": %.1f, ",
+                 st.name, st.offered / st.elapsed, st.good / st.elapsed);
+    std::fprintf(out,
+                 "\"offered\": %llu, \"good\": %llu, \"late\": %llu, \"jukebox\": %llu, "
+                 "\"lost\": %llu, \"errors\": %llu, \"shed\": %llu, \"episodes\": %llu,\n"
+                 "      \"latency\": {",
+                 static_cast<unsigned long long>(st.offered),
+                 static_cast<unsigned long long>(st.good),
+                 static_cast<unsigned long long>(st.late),
+                 static_cast<unsigned long long>(st.jukebox),
+                 static_cast<unsigned long long>(st.lost),
+                 static_cast<unsigned long long>(st.errors),
+                 static_cast<unsigned long long>(st.shed),
+                 static_cast<unsigned long long>(st.episodes));
+    write_latency_json(out, lat);
+    std::fprintf(out, "}}%s\n", last ? "" : ",");
+}
+
+static void usage() {
+    std::fprintf(stderr,
+                 "usage: nfsoverload [--seconds S] [--load X] [--bw B] [--io-size B]\n"
+                 "                   [--file-size B] [--connections N] [--max-inflight N]\n"
+                 "                   [--deadline-ms MS] [--target-ms MS] [--interval-ms MS]\n"
+                 "                   [--json FILE]\n");
+}
+
+static bool parse_args(int argc, char* argv[], Config& cfg) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        uint64_t v = 0;
+        auto size_arg = [&](uint64_t& out) {
+            return has_value && parse_size(argv[++i], out);
+        };
+        if (arg == "--seconds" && has_value) cfg.seconds = std::atof(argv[++i]);
+        else if (arg == "--load" && has_value) cfg.load = std::atof(argv[++i]);
+        else if (arg == "--bw" && size_arg(v)) cfg.bw = v;
+        else if (arg == "--io-size" && size_arg(v)) cfg.io_size = static_cast<uint32_t>(v);
+        else if (arg == "--file-size" && size_arg(v)) cfg.file_size = v;
+        else if (arg == "--connections" && size_arg(v)) cfg.connections = static_cast<uint32_t>(v);
+        else if (arg == "--max-inflight" && size_arg(v)) cfg.max_inflight = static_cast<uint32_t>(v);
+        else if (arg == "--deadline-ms" && has_value) cfg.deadline_ms = std::atof(argv[++i]);
+        else if (arg == "--target-ms" && has_value) cfg.target_ms = std::atof(argv[++i]);
+        else if (arg == "--interval-ms" && has_value) cfg.interval_ms = std::atof(argv[++i]);
+        else if (arg == "--json" && has_value) cfg.json_path = argv[++i];
+        else {
+            std::fprintf(stderr, "nfsoverload: bad argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    if (cfg.seconds <= 0 || cfg.load <= 0 || !cfg.bw || !cfg.io_size || !cfg.connections ||
+        !cfg.max_inflight || cfg.deadline_ms <= 0 || cfg.target_ms <= 0 ||
+        cfg.interval_ms <= 0 || cfg.io_size > 1024 * 1024) {
+        std::fprintf(stderr, "nfsoverload: values must be positive and --io-size at most 1M\n");
+        return false;
+    }
+    cfg.file_size = std::max<uint64_t>(cfg.file_size, cfg.io_size);
+    return true;
+}
+
+static int run(const Config& cfg) {
+    raise_fd_limit();
+    char tmpl[] = "/tmp/nfsoverload_XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        std::fprintf(stderr, "nfsoverload: mkdtemp: %s\n", std::strerror(errno));
+        return 1;
+    }
+    const std::string dir = tmpl;
+    {
+        std::ofstream data(dir + "/data", std::ios::binary);
+        std::vector<char> block(cfg.io_size, 'x');
+        for (uint64_t off = 0; off < cfg.file_size; off += block.size())
+            data.write(block.data(), static_cast<std::streamsize>(block.size()));
+    }
+
+    int rc = 1;
+    RunStats plain, controlled;
+    plain.name = "uncontrolled";
+    controlled.name = "controlled";
+    if (run_once(cfg, dir, false, plain) && run_once(cfg, dir, true, controlled)) {
+        FILE* out = stdout;
+        if (!cfg.json_path.empty()) out = std::fopen(cfg.json_path.c_str(), "w");
+        if (!out) {
+            std::fprintf(stderr, "nfsoverload: %s: %s\n", cfg.json_path.c_str(),
+                         std::strerror(errno));
+        } else {
+            const double capacity = static_cast<double>(cfg.bw) / cfg.io_size;
+            std::fprintf(out, "{\n");
+            std::fprintf(out,
+                         "  \"capacity_per_sec\": %.1f, \"load\": %.2f, \"seconds\": %.3f, "
+                         "\"io_size\": %u, \"connections\": %u, \"max_inflight\": %u,\n",
+                         capacity, cfg.load, cfg.seconds, cfg.io_size, cfg.connections,
+                         cfg.max_inflight);
+            std::fprintf(out,
+                         "  \"deadline_ms\": %.1f, \"target_ms\": %.1f, \"interval_ms\": %.1f,\n",
+                         cfg.deadline_ms, cfg.target_ms, cfg.interval_ms);
+            std::fprintf(out, "  \"runs\": {\n");
+            write_run(out, plain, false);
+            write_run(out, controlled, true);
+            std::fprintf(out, "  }\n}\n");
+            if (out != stdout) std::fclose(out);
+            const uint64_t answered_plain = plain.good + plain.late;
+            const uint64_t answered_controlled = controlled.good + controlled.late;
+            rc = answered_plain && answered_controlled ? 0 : 1;
+        }
+    }
+
+    std::string cmd = "rm -rf " + dir;
+    if (std::system(cmd.c_str()) != 0)
+        std::fprintf(stderr, "nfsoverload: could not remove %s\n", dir.c_str());
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    Config cfg;
+    if (!parse_args(argc, argv, cfg)) {
+        usage();
+        return 2;
+    }
+    try {
+        return run(cfg);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "nfsoverload: %s\n", e.what());
+        return 1;
+    }
+}
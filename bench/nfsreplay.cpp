@@ -0,0 +1,1097 @@
+// Replays an RPC capture (nfsd --capture, rpc/rpc_capture.h) against a
+// server.
+//
+// Every captured call is sent again, in capture order per connection, over
+// --connections connections (default: one per captured connection; captured
+// connection i goes out on connection i mod N) driven by --threads
+// event-loop threads. --speed scales the captured timing: 1 keeps the
+// original gaps between calls, 2 halves them, and 0 (or "max") sends each
+// call as soon as --depth allows. A call whose file handle came from an
+// earlier call's reply waits for that reply, whatever the speed.
+//
+// File handles are opaque and differ between servers, so NFSv3 handles are
+// remapped. The capture's replies (nfsd --capture-replies) say which handle
+// names which object: MNT gives the export root, LOOKUP and READDIRPLUS name
+// a handle under its directory, CREATE, MKDIR, SYMLINK and MKNOD make one.
+// The setup phase then
+//
+//   - MNTs each captured export path (or --mount PATH) on the target,
+//   - LOOKUPs every object the trace found already there, parent first,
+//     and creates those that are missing (directories, and regular files
+//     truncated to their captured size),
+//   - removes, recursively, whatever the target has under a name the trace
+//     itself creates, so the creations succeed again.
+//
+// During replay each reply is paired with its captured reply, and the
+// handles in both are mapped onto each other. Outgoing NFSv3 calls carry
+// the target's handle wherever one is known; an unknown handle goes out
+// unchanged and is counted. MOUNT3, NFSv4 and NLM calls are replayed
+// verbatim (apart from the xid, and the MNT path with --mount): NFSv4
+// client, session and state ids are not remapped. The replay modifies the
+// target, so point it at a scratch export.
+//
+// Target: a running nfsd (--host/--port, default 127.0.0.1:2049), or
+// --inprocess, which serves --export DIR (default: a temporary directory)
+// from LocalFs through MOUNT3, NFSv3 and NFSv4 on an RpcServer at an
+// ephemeral port in this process.
+//
+// The report is one JSON document on stdout (or --json FILE): calls, RPC
+// errors, replies whose status differs from the captured one, unmapped
+// handles, calls/s, how late calls went out against the schedule, and per
+// procedure the count and latency percentiles. The exit status is non-zero
+// if the trace cannot be read, setup fails, a connection is lost or a call
+// gets an RPC-level error.
+//
+// Usage: nfsreplay --trace FILE [--host H] [--port P] [--inprocess]
+//                  [--export DIR] [--mount PATH] [--speed X|max]
+//                  [--connections N] [--threads N] [--depth N] [--no-setup]
+//                  [--json FILE]
+
+#include "bench_client.h"
+#include "mount/mount_server.h"
+#include "mount/mount_types.h"
+#include "nfs/nfs_server.h"
+#include "nfs4/nfs4_server.h"
+#include "nfs4/nfs4_types.h"
+#include "nlm/nlm_types.h"
+#include "rpc/rpc_capture.h"
+#include "rpc/rpc_server.h"
+#include "rpc/rpc_types.h"
+#include "stats/latency_stats.h"
+#include "vfs/local_fs.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+struct Config {
+    std::string trace_path;
+    std::string host = "127.0.0.1";
+    uint16_t port = 2049;
+    bool inprocess = false;
+    std::string export_dir;
+    std::string mount_path;
+    double speed = 1;
+    uint32_t connections = 0;  // 0: one per captured connection
+    uint32_t threads = 4;
+    uint32_t depth = 64;
+    bool setup = true;
+    std::string json_path;
+};
+
+// --- Trace ---
+
+// A handle a reply returned, with what it said about the object
+struct NamedHandle {
+    std::string name;  // READDIRPLUS: the entry; otherwise named by the call
+    FileHandle fh;
+    bool has_attr = false;
+    Ftype3 type = Ftype3::NF3REG;
+    uint64_t size = 0;
+};
+
+struct TraceCall {
+    uint32_t conn = 0;
+    uint64_t ts_ns = 0;
+    uint32_t xid = 0;
+    uint32_t prog = 0;
+    uint32_t vers = 0;
+    uint32_t proc = 0;
+    uint32_t name = 0;  // index into Trace::names
+    std::vector<uint8_t> msg;
+    size_t args_off = 0;
+    std::vector<size_t> fh_offs;  // NFSv3 handles in msg: their length words
+    std::vector<uint32_t> deps;   // earlier calls whose replies gave those handles
+
+    bool replied = false;    // the capture holds the reply
+    bool reply_ok = false;   // MSG_ACCEPTED / SUCCESS
+    std::vector<uint8_t> reply;  // the procedure result
+};
+
+// An object the trace named: where it lives and whether the trace made it
+struct Node {
+    FileHandle parent;
+    std::string name;
+    bool has_attr = false;
+    Ftype3 type = Ftype3::NF3REG;
+    uint64_t size = 0;
+    bool created = false;
+};
+
+struct Trace {
+    std::vector<TraceCall> calls;  // in capture order
+    std::vector<std::string> names;
+    std::vector<uint32_t> conns;  // captured connection ids, ascending
+    std::vector<std::pair<std::string, FileHandle>> mounts;  // MNT path and root
+    std::map<FileHandle, Node> nodes;
+    bool replies = false;
+    uint64_t records = 0;
+};
+
+static bool is_nfs3(const TraceCall& c) {
+    return c.prog == NFS_PROGRAM && c.vers == NFS_V3;
+}
+
+static bool is_mnt(const TraceCall& c) {
+    return c.prog == MOUNT_PROGRAM && c.vers == MOUNT_V3 && c.proc == MOUNTPROC3_MNT;
+}
+
+static bool creates(uint32_t proc) {
+    return proc == NFSPROC3_CREATE || proc == NFSPROC3_MKDIR || proc == NFSPROC3_SYMLINK ||
+           proc == NFSPROC3_MKNOD;
+}
+
+static const char* const kNfs3Procs[] = {
+    "null", "getattr", "setattr", "lookup", "access", "readlink", "read", "write",
+    "create", "mkdir", "symlink", "mknod", "remove", "rmdir", "rename", "link",
+    "readdir", "readdirplus", "fsstat", "fsinfo", "pathconf", "commit"};
+
+static const char* const kMount3Procs[] = {"null", "mnt", "dump", "umnt", "umntall", "export"};
+
+// "nfs3.lookup", "nfs4.compound", "mount3.mnt"; "<prog>.<vers>.<proc>" otherwise
+static std::string proc_name(const TraceCall& c) {
+    if (is_nfs3(c) && c.proc < sizeof(kNfs3Procs) / sizeof(kNfs3Procs[0]))
+        return std::string("nfs3.") + kNfs3Procs[c.proc];
+    if (c.prog == NFS_PROGRAM && c.vers == NFS_V4)
+        return c.proc == NFSPROC4_COMPOUND ? "nfs4.compound" : "nfs4.null";
+    if (c.prog == MOUNT_PROGRAM && c.vers == MOUNT_V3 &&
+        c.proc < sizeof(kMount3Procs) / sizeof(kMount3Procs[0]))
+        return std::string("mount3.") + kMount3Procs[c.proc];
+    if (c.prog == NLM_PROGRAM) return "nlm" + std::to_string(c.vers) + "." + std::to_string(c.proc);
+    return std::to_string(c.prog) + "." + std::to_string(c.vers) + "." + std::to_string(c.proc);
+}
+
+// RFC 5531 §9 - call header up to the arguments; false for anything else
+static bool parse_call(TraceCall& c) {
+    try {
+        XdrDecoder dec(c.msg.data(), c.msg.size());
+        c.xid = dec.decode_uint32();
+        if (dec.decode_uint32() != static_cast<uint32_t>(RpcMsgType::CALL)) return false;
+        dec.decode_uint32();  // rpcvers
+        c.prog = dec.decode_uint32();
+        c.vers = dec.decode_uint32();
+        c.proc = dec.decode_uint32();
+        dec.decode_uint32();  // cred
+        dec.decode_opaque();
+        dec.decode_uint32();  // verf
+        dec.decode_opaque();
+        c.args_off = c.msg.size() - dec.remaining();
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// RFC 1813 - every NFSv3 procedure but NULL starts with an nfs_fh3;
+// RENAME's second diropargs3 and LINK's target directory add another
+static void find_handles(TraceCall& c) {
+    if (!is_nfs3(c) || c.proc == NFSPROC3_NULL || c.proc > NFSPROC3_COMMIT) return;
+    try {
+        XdrDecoder dec(c.msg.data() + c.args_off, c.msg.size() - c.args_off);
+        auto here = [&] { return c.msg.size() - dec.remaining(); };
+        c.fh_offs.push_back(here());
+        dec.decode_opaque();
+        if (c.proc == NFSPROC3_RENAME) dec.decode_string();
+        if (c.proc == NFSPROC3_RENAME || c.proc == NFSPROC3_LINK) c.fh_offs.push_back(here());
+    } catch (const std::exception&) {
+        c.fh_offs.clear();
+    }
+}
+
+static FileHandle handle_at(const std::vector<uint8_t>& msg, size_t off) {
+    XdrDecoder dec(msg.data() + off, msg.size() - off);
+    auto bytes = dec.decode_opaque();
+    return FileHandle(bytes.data(), bytes.size());
+}
+
+// diropargs3 name after the first handle (LOOKUP and the create family)
+static std::string dirop_name(const TraceCall& c) {
+    try {
+        XdrDecoder dec(c.msg.data() + c.fh_offs[0], c.msg.size() - c.fh_offs[0]);
+        dec.decode_opaque();
+        return dec.decode_string();
+    } catch (const std::exception&) {
+        return std::string();
+    }
+}
+
+static void decode_fh(XdrDecoder& dec, FileHandle& fh) {
+    auto bytes = dec.decode_opaque();
+    fh = FileHandle(bytes.data(), bytes.size());
+}
+
+// RFC 1813 §2.6 - post_op_attr: ftype3 and size of the fattr3 kept
+static void decode_attr(XdrDecoder& dec, NamedHandle& h) {
+    if (!dec.decode_bool()) return;
+    h.has_attr = true;
+    h.type = static_cast<Ftype3>(dec.decode_uint32());
+    dec.skip(4 * 4);  // mode, nlink, uid, gid
+    h.size = dec.decode_uint64();
+    dec.skip(14 * 4);  // used, rdev, fsid, fileid, atime, mtime, ctime
+}
+
+// The handles in a successful result of c: the export root for MNT, the
+// object for LOOKUP and the create family, each entry for READDIRPLUS
+static void reply_handles(const TraceCall& c, const uint8_t* body, size_t len,
+                          std::vector<NamedHandle>& out) {
+    out.clear();
+    try {
+        XdrDecoder dec(body, len);
+        if (is_mnt(c)) {
+            if (dec.decode_uint32() != static_cast<uint32_t>(MountStat3::MNT3_OK)) return;
+            NamedHandle h;
+            decode_fh(dec, h.fh);
+            h.type = Ftype3::NF3DIR;
+            out.push_back(h);
+            return;
+        }
+        if (!is_nfs3(c) || c.fh_offs.empty()) return;
+        if (c.proc == NFSPROC3_LOOKUP || creates(c.proc)) {
+            if (dec.decode_uint32() != static_cast<uint32_t>(NfsStat3::NFS3_OK)) return;
+            NamedHandle h;
+            h.name = dirop_name(c);
+            // LOOKUP3resok has the handle; the create family a post_op_fh3
+            if (c.proc != NFSPROC3_LOOKUP && !dec.decode_bool()) return;
+            decode_fh(dec, h.fh);
+            decode_attr(dec, h);
+            out.push_back(h);
+        } else if (c.proc == NFSPROC3_READDIRPLUS) {
+            // RFC 1813 §3.3.17 - READDIRPLUS3resok
+            if (dec.decode_uint32() != static_cast<uint32_t>(NfsStat3::NFS3_OK)) return;
+            skip_post_op_attr(dec);
+            dec.decode_uint64();  // cookieverf
+            while (dec.decode_bool()) {
+                NamedHandle h;
+                dec.decode_uint64();  // fileid
+                h.name = dec.decode_string();
+                dec.decode_uint64();  // cookie
+                decode_attr(dec, h);
+                if (dec.decode_bool()) {
+                    decode_fh(dec, h.fh);
+                    if (h.name != "." && h.name != "..") out.push_back(h);
+                }
+            }
+        }
+    } catch (const std::exception&) {
+        // A short result: keep what was decoded
+    }
+}
+
+// RFC 5531 §9 - a reply's xid, whether it was accepted and successful, and
+// where the result starts; false if it is not a reply
+static bool parse_reply(const std::vector<uint8_t>& msg, uint32_t& xid, bool& ok,
+                        size_t& result_off) {
+    try {
+        XdrDecoder dec(msg.data(), msg.size());
+        xid = dec.decode_uint32();
+        if (dec.decode_uint32() != static_cast<uint32_t>(RpcMsgType::REPLY)) return false;
+        ok = false;
+        result_off = msg.size();
+        if (dec.decode_uint32() != 0) return true;  // MSG_DENIED
+        dec.decode_uint32();  // verf
+        dec.decode_opaque();
+        ok = dec.decode_uint32() == 0;
+        result_off = msg.size() - dec.remaining();
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+static bool load_trace(const std::string& path, Trace& trace) {
+    RpcCaptureReader reader(path);
+    if (!reader.open()) {
+        std::fprintf(stderr, "nfsreplay: %s: not a capture file\n", path.c_str());
+        return false;
+    }
+    trace.replies = reader.replies();
+
+    std::unordered_map<std::string, uint32_t> names;
+    std::unordered_map<uint64_t, size_t> waiting;  // conn << 32 | xid -> call
+    CaptureRecord rec;
+    while (reader.next(rec)) {
+        trace.records++;
+        uint64_t key = static_cast<uint64_t>(rec.conn) << 32;
+        if (rec.kind == CaptureKind::RECEIVED) {
+            TraceCall c;
+            c.conn = rec.conn;
+            c.ts_ns = rec.ts_ns;
+            c.msg = std::move(rec.data);
+            if (!parse_call(c)) continue;  // a backchannel reply
+            find_handles(c);
+            auto it = names.emplace(proc_name(c), static_cast<uint32_t>(names.size())).first;
+            c.name = it->second;
+            waiting[key | c.xid] = trace.calls.size();
+            trace.calls.push_back(std::move(c));
+        } else if (rec.kind == CaptureKind::SENT) {
+            uint32_t xid = 0;
+            bool ok = false;
+            size_t off = 0;
+            if (!parse_reply(rec.data, xid, ok, off)) continue;  // a backchannel call
+            auto it = waiting.find(key | xid);
+            if (it == waiting.end()) continue;
+            TraceCall& c = trace.calls[it->second];
+            waiting.erase(it);
+            c.replied = true;
+            c.reply_ok = ok;
+            c.reply.assign(rec.data.begin() + off, rec.data.end());
+        }
+    }
+    trace.names.resize(names.size());
+    for (const auto& n : names) trace.names[n.second] = n.first;
+
+    // Which call produced each handle, and what the trace says it names
+    std::map<FileHandle, uint32_t> producer;
+    std::vector<NamedHandle> handles;
+    for (uint32_t i = 0; i < trace.calls.size(); i++) {
+        TraceCall& c = trace.calls[i];
+        if (std::find(trace.conns.begin(), trace.conns.end(), c.conn) == trace.conns.end())
+            trace.conns.push_back(c.conn);
+        for (size_t off : c.fh_offs) {
+            auto it = producer.find(handle_at(c.msg, off));
+            if (it != producer.end() && std::find(c.deps.begin(), c.deps.end(), it->second) ==
+                                            c.deps.end())
+                c.deps.push_back(it->second);
+        }
+        if (!c.replied || !c.reply_ok) continue;
+        reply_handles(c, c.reply.data(), c.reply.size(), handles);
+        for (const auto& h : handles) {
+            producer[h.fh] = i;
+            if (is_mnt(c)) {
+                std::string path;
+                try {
+                    XdrDecoder dec(c.msg.data() + c.args_off, c.msg.size() - c.args_off);
+                    path = dec.decode_string();
+                } catch (const std::exception&) {
+                    continue;
+                }
+                bool known = false;
+                for (const auto& m : trace.mounts) known |= m.second == h.fh;
+                if (!known) trace.mounts.emplace_back(path, h.fh);
+                continue;
+            }
+            if (trace.nodes.count(h.fh)) continue;
+            Node& n = trace.nodes[h.fh];
+            n.parent = handle_at(c.msg, c.fh_offs[0]);
+            n.name = h.name;
+            n.has_attr = h.has_attr;
+            n.type = h.type;
+            n.size = h.size;
+            n.created = creates(c.proc);
+        }
+    }
+    std::sort(trace.conns.begin(), trace.conns.end());
+    return true;
+}
+
+// --- Handle map ---
+
+class HandleMap {
+public:
+    void set(const FileHandle& captured, const FileHandle& live) {
+        std::lock_guard<std::mutex> lk(mu_);
+        map_[captured] = live;
+    }
+
+    bool get(const FileHandle& captured, FileHandle& live) const {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = map_.find(captured);
+        if (it == map_.end()) return false;
+        live = it->second;
+        return true;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return map_.size();
+    }
+
+private:
+    mutable std::mutex mu_;
+    std::map<FileHandle, FileHandle> map_;
+};
+
+// Map the handles of a captured result onto those of the live one, by
+// position and entry name
+static void learn(const TraceCall& c, const uint8_t* body, size_t len, HandleMap& map) {
+    if (!c.replied || !c.reply_ok) return;
+    std::vector<NamedHandle> captured, live;
+    reply_handles(c, c.reply.data(), c.reply.size(), captured);
+    if (captured.empty()) return;
+    reply_handles(c, body, len, live);
+    for (const auto& h : captured) {
+        for (const auto& l : live) {
+            if (l.name != h.name) continue;
+            map.set(h.fh, l.fh);
+            break;
+        }
+    }
+}
+
+// --- Setup ---
+
+struct SetupStats {
+    uint64_t found = 0;
+    uint64_t created = 0;
+    uint64_t removed = 0;
+    uint64_t unresolved = 0;
+};
+
+static bool nfs_call(RpcConnection& conn, uint32_t proc, const XdrEncoder& args,
+                     std::vector<uint8_t>& body) {
+    return conn.call(NFS_PROGRAM, NFS_V3, proc, args, body);
+}
+
+static NfsStat3 lookup(RpcConnection& conn, const FileHandle& dir, const std::string& name,
+                       FileHandle& out, Ftype3* type = nullptr) {
+    XdrEncoder args;
+    encode_fh3(args, dir);
+    args.encode_string(name);
+    std::vector<uint8_t> body;
+    if (!nfs_call(conn, NFSPROC3_LOOKUP, args, body)) return NfsStat3::NFS3ERR_SERVERFAULT;
+    return decode_lookup_reply(body.data(), body.size(), out, type);
+}
+
+// MKDIR, or CREATE (UNCHECKED) and a SETATTR to the captured size
+static NfsStat3 make(RpcConnection& conn, const FileHandle& dir, const Node& n,
+                     FileHandle& out) {
+    XdrEncoder args;
+    encode_fh3(args, dir);
+    args.encode_string(n.name);
+    if (n.type != Ftype3::NF3DIR) args.encode_uint32(UNCHECKED);
+    encode_sattr3_mode(args, n.type == Ftype3::NF3DIR ? 0755 : 0644);
+    std::vector<uint8_t> body;
+    if (!nfs_call(conn, n.type == Ftype3::NF3DIR ? NFSPROC3_MKDIR : NFSPROC3_CREATE, args,
+                  body))
+        return NfsStat3::NFS3ERR_SERVERFAULT;
+    NfsStat3 st = decode_create_reply(body.data(), body.size(), out);
+    if (st == NfsStat3::NFS3_OK && out.empty()) st = lookup(conn, dir, n.name, out);
+    if (st != NfsStat3::NFS3_OK || n.type == Ftype3::NF3DIR || !n.size) return st;
+
+    // RFC 1813 §3.3.2 - SETATTR3args: sattr3 with only the size, no guard
+    XdrEncoder set;
+    encode_fh3(set, out);
+    set.encode_bool(false);  // mode
+    set.encode_bool(false);  // uid
+    set.encode_bool(false);  // gid
+    set.encode_bool(true);
+    set.encode_uint64(n.size);
+    set.encode_uint32(0);  // atime: DONT_CHANGE
+    set.encode_uint32(0);  // mtime: DONT_CHANGE
+    set.encode_bool(false);
+    if (!nfs_call(conn, NFSPROC3_SETATTR, set, body)) return NfsStat3::NFS3ERR_SERVERFAULT;
+    return decode_status(body.data(), body.size());
+}
+
+// Remove dir/name and, for a directory, everything under it
+static bool remove_tree(RpcConnection& conn, const FileHandle& dir, const std::string& name,
+                        uint64_t& removed) {
+    FileHandle fh;
+    Ftype3 type = Ftype3::NF3REG;
+    if (lookup(conn, dir, name, fh, &type) != NfsStat3::NFS3_OK) return false;
+    std::vector<uint8_t> body;
+    if (type == Ftype3::NF3DIR) {
+        // RFC 1813 §3.3.16 - READDIR3args; entries are removed after the
+        // listing, which the cookies would not survive
+        std::vector<std::string> names;
+        uint64_t cookie = 0;
+        uint64_t verf = 0;
+        for (;;) {
+            XdrEncoder args;
+            encode_fh3(args, fh);
+            args.encode_uint64(cookie);
+            args.encode_uint64(verf);
+            args.encode_uint32(65536);
+            ReaddirplusPage page;
+            if (!nfs_call(conn, NFSPROC3_READDIR, args, body) ||
+                decode_readdir_reply(body.data(), body.size(), page, &names) !=
+                    NfsStat3::NFS3_OK)
+                return false;
+            if (page.eof || !page.entries) break;
+            cookie = page.last_cookie;
+            verf = page.cookieverf;
+        }
+        for (const auto& n : names)
+            if (n != "." && n != "..") remove_tree(conn, fh, n, removed);
+    }
+    XdrEncoder args;
+    encode_fh3(args, dir);
+    args.encode_string(name);
+    uint32_t proc = type == Ftype3::NF3DIR ? NFSPROC3_RMDIR : NFSPROC3_REMOVE;
+    if (!nfs_call(conn, proc, args, body) ||
+        decode_status(body.data(), body.size()) != NfsStat3::NFS3_OK)
+        return false;
+    removed++;
+    return true;
+}
+
+static bool setup(const Config& cfg, const Trace& trace, RpcConnection& conn, HandleMap& map,
+                  SetupStats& stats) {
+    // RFC 1813 §A.5.2 - MNT each export the trace mounted
+    for (const auto& m : trace.mounts) {
+        XdrEncoder mnt;
+        mnt.encode_string(cfg.mount_path.empty() ? m.first : cfg.mount_path);
+        std::vector<uint8_t> body;
+        FileHandle root;
+        if (!conn.call(MOUNT_PROGRAM, MOUNT_V3, MOUNTPROC3_MNT, mnt, body) ||
+            !decode_mnt_reply(body.data(), body.size(), root)) {
+            std::fprintf(stderr, "nfsreplay: setup: MNT of %s failed\n",
+                         cfg.mount_path.empty() ? m.first.c_str() : cfg.mount_path.c_str());
+            return false;
+        }
+        map.set(m.second, root);
+    }
+    if (!cfg.setup) return true;
+
+    // Objects by depth below a mount, so parents are resolved first
+    std::vector<std::pair<uint32_t, const std::pair<const FileHandle, Node>*>> order;
+    for (const auto& n : trace.nodes) {
+        uint32_t depth = 1;
+        bool rooted = false;
+        bool under_created = false;
+        FileHandle parent = n.second.parent;
+        for (size_t guard = 0; guard < trace.nodes.size() + 1; guard++) {
+            FileHandle live;
+            if (map.get(parent, live)) {
+                rooted = true;
+                break;
+            }
+            auto it = trace.nodes.find(parent);
+            if (it == trace.nodes.end()) break;
+            under_created |= it->second.created;
+            parent = it->second.parent;
+            depth++;
+        }
+        if (!rooted) {
+            stats.unresolved++;
+        } else if (!under_created) {
+            order.emplace_back(depth, &n);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    for (const auto& o : order) {
+        const FileHandle& captured = o.second->first;
+        const Node& n = o.second->second;
+        FileHandle dir, live;
+        if (!map.get(n.parent, dir)) {
+            stats.unresolved++;
+            continue;
+        }
+        if (n.created) {
+            // The trace makes this name: clear what an earlier run left
+            uint64_t removed = 0;
+            remove_tree(conn, dir, n.name, removed);
+            stats.removed += removed;
+            continue;
+        }
+        NfsStat3 st = lookup(conn, dir, n.name, live);
+        if (st == NfsStat3::NFS3_OK) {
+            map.set(captured, live);
+            stats.found++;
+        } else if (st == NfsStat3::NFS3ERR_NOENT && n.has_attr &&
+                   (n.type == Ftype3::NF3DIR || n.type == Ftype3::NF3REG) &&
+                   make(conn, dir, n, live) == NfsStat3::NFS3_OK) {
+            map.set(captured, live);
+            stats.created++;
+        } else {
+            stats.unresolved++;
+        }
+    }
+    return true;
+}
+
+// --- Replay ---
+
+struct ProcStats {
+    LatencyHistogram latency;
+    uint64_t calls = 0;
+    uint64_t rpc_errors = 0;
+    uint64_t mismatches = 0;
+};
+
+struct ThreadStats {
+    std::vector<std::unique_ptr<ProcStats>> procs;
+    LatencyHistogram lateness;
+    uint64_t unmapped = 0;
+    uint64_t callbacks = 0;
+    uint64_t connection_errors = 0;
+};
+
+struct Conn {
+    RpcConnection rpc;
+    std::vector<uint32_t> queue;  // call indexes in capture order
+    size_t next = 0;
+    std::unordered_map<uint32_t, uint64_t> inflight;  // call index -> start
+    uint64_t last_reply_ns = 0;
+    bool dead = false;
+};
+
+class ReplayThread {
+public:
+    ReplayThread(const Config& cfg, const Trace& trace, HandleMap& map,
+                 std::atomic<bool>* done, ThreadStats& stats)
+        : cfg_(cfg), trace_(trace), map_(map), done_(done), stats_(stats) {
+        for (size_t i = 0; i < trace.names.size(); i++)
+            stats_.procs.push_back(std::make_unique<ProcStats>());
+    }
+
+    void add(std::unique_ptr<Conn> conn) { conns_.push_back(std::move(conn)); }
+
+    void run(uint64_t start_ns) {
+        // A connection with calls in flight and no reply for this long is lost
+        const uint64_t stall_ns = 30000000000ull;
+        const uint64_t ts0 = trace_.calls.empty() ? 0 : trace_.calls[0].ts_ns;
+        std::vector<pollfd> pfds;
+        for (;;) {
+            uint64_t now = LatencyStats::now_ns();
+            int timeout_ms = 100;
+            bool active = false;
+            pfds.clear();
+            for (auto& c : conns_) {
+                if (c->dead) continue;
+                while (c->next < c->queue.size() && c->inflight.size() < cfg_.depth) {
+                    uint32_t idx = c->queue[c->next];
+                    const TraceCall& call = trace_.calls[idx];
+                    uint64_t due = start_ns;
+                    if (cfg_.speed > 0)
+                        due += static_cast<uint64_t>((call.ts_ns - ts0) / cfg_.speed);
+                    if (due > now) {
+                        timeout_ms = std::min<int>(timeout_ms,
+                                                   static_cast<int>((due - now) / 1000000) + 1);
+                        break;
+                    }
+                    if (!ready(call)) {
+                        timeout_ms = 1;
+                        break;
+                    }
+                    if (cfg_.speed > 0) stats_.lateness.record(now - due);
+                    send(*c, idx, now);
+                }
+                if (c->rpc.want_write() && !c->rpc.flush()) {
+                    lost(*c);
+                    continue;
+                }
+                if (!c->inflight.empty() && now - c->last_reply_ns > stall_ns) {
+                    lost(*c);
+                    continue;
+                }
+                if (c->next == c->queue.size() && c->inflight.empty()) continue;
+                active = true;
+                short events = POLLIN;
+                if (c->rpc.want_write()) events |= POLLOUT;
+                pfds.push_back({c->rpc.fd(), events, 0});
+            }
+            if (!active) break;
+
+            int rc = poll(pfds.data(), pfds.size(), timeout_ms);
+            if (rc < 0 && errno != EINTR) break;
+            if (rc <= 0) continue;
+
+            size_t p = 0;
+            for (auto& c : conns_) {
+                if (c->dead || (c->next == c->queue.size() && c->inflight.empty())) continue;
+                const pollfd& pfd = pfds[p++];
+                if (pfd.revents & POLLOUT && !c->rpc.flush()) {
+                    lost(*c);
+                    continue;
+                }
+                if (pfd.revents & (POLLIN | POLLHUP | POLLERR) &&
+                    !c->rpc.receive([&](const RpcReply& r) { complete(*c, r); },
+                                    [&](const RpcIncomingCall&) { stats_.callbacks++; }))
+                    lost(*c);
+            }
+        }
+    }
+
+private:
+    // Every call whose reply gave this one its handles has completed
+    bool ready(const TraceCall& call) const {
+        for (uint32_t d : call.deps)
+            if (!done_[d].load(std::memory_order_acquire)) return false;
+        return true;
+    }
+
+    void send(Conn& c, uint32_t idx, uint64_t now) {
+        const TraceCall& call = trace_.calls[idx];
+        std::vector<uint8_t> msg;
+        msg.reserve(call.msg.size() + 64);
+        size_t prev = 0;
+        if (is_mnt(call) && !cfg_.mount_path.empty()) {
+            XdrEncoder path;
+            path.encode_string(cfg_.mount_path);
+            msg.assign(call.msg.begin(), call.msg.begin() + call.args_off);
+            msg.insert(msg.end(), path.data().begin(), path.data().end());
+            prev = call.msg.size();
+        }
+        for (size_t off : call.fh_offs) {
+            FileHandle captured = handle_at(call.msg, off);
+            FileHandle live;
+            msg.insert(msg.end(), call.msg.begin() + prev, call.msg.begin() + off);
+            // The wire length: a handle too long to keep is still skipped whole
+            const uint8_t* len = call.msg.data() + off;
+            size_t wire_len = (size_t(len[0]) << 24) | (size_t(len[1]) << 16) |
+                              (size_t(len[2]) << 8) | len[3];
+            prev = off + 4 + ((wire_len + 3) & ~size_t(3));
+            if (!map_.get(captured, live)) {
+                stats_.unmapped++;
+                live = captured;
+            }
+            XdrEncoder fh;
+            fh.encode_opaque(live.data(), live.size());
+            msg.insert(msg.end(), fh.data().begin(), fh.data().end());
+        }
+        msg.insert(msg.end(), call.msg.begin() + prev, call.msg.end());
+
+        // Our xid names the call: its index plus one
+        uint32_t xid = idx + 1;
+        msg[0] = static_cast<uint8_t>(xid >> 24);
+        msg[1] = static_cast<uint8_t>(xid >> 16);
+        msg[2] = static_cast<uint8_t>(xid >> 8);
+        msg[3] = static_cast<uint8_t>(xid);
+        c.rpc.queue_record(msg.data(), msg.size());
+        if (c.inflight.empty()) c.last_reply_ns = now;
+        c.inflight[idx] = now;
+        c.next++;
+    }
+
+    void complete(Conn& c, const RpcReply& r) {
+        uint32_t idx = r.xid - 1;
+        auto it = c.inflight.find(idx);
+        if (it == c.inflight.end()) return;
+        uint64_t now = LatencyStats::now_ns();
+        const TraceCall& call = trace_.calls[idx];
+        ProcStats& ps = *stats_.procs[call.name];
+        ps.calls++;
+        ps.latency.record(now - it->second);
+        c.inflight.erase(it);
+        c.last_reply_ns = now;
+
+        bool ok = r.accepted && r.accept_stat == 0;
+        if (!ok) ps.rpc_errors++;
+        if (call.replied) {
+            // The first word of every result here is its status
+            if (ok != call.reply_ok ||
+                (ok && r.body_len >= 4 && call.reply.size() >= 4 &&
+                 std::memcmp(r.body, call.reply.data(), 4) != 0))
+                ps.mismatches++;
+        }
+        if (ok) learn(call, r.body, r.body_len, map_);
+        done_[idx].store(true, std::memory_order_release);
+    }
+
+    // The connection's remaining calls count as done so others do not wait
+    void lost(Conn& c) {
+        c.dead = true;
+        stats_.connection_errors++;
+        for (const auto& f : c.inflight) done_[f.first].store(true, std::memory_order_release);
+        for (size_t i = c.next; i < c.queue.size(); i++)
+            done_[c.queue[i]].store(true, std::memory_order_release);
+        c.rpc.close();
+    }
+
+    const Config& cfg_;
+    const Trace& trace_;
+    HandleMap& map_;
+    std::atomic<bool>* done_;
+    ThreadStats& stats_;
+    std::vector<std::unique_ptr<Conn>> conns_;
+};
+
+// --- Report ---
+
+struct Summary {
+    std::vector<LatencySnapshot> latency;
+    std::vector<uint64_t> calls, rpc_errors, mismatches;
+    LatencySnapshot all;
+    LatencySnapshot lateness;
+    uint64_t total_calls = 0;
+    uint64_t total_rpc_errors = 0;
+    uint64_t total_mismatches = 0;
+    uint64_t unmapped = 0;
+    uint64_t callbacks = 0;
+    uint64_t connection_errors = 0;
+};
+
+static Summary summarize(const Trace& trace,
+                         const std::vector<std::unique_ptr<ThreadStats>>& stats) {
+    Summary sum;
+    size_t n = trace.names.size();
+    sum.latency.resize(n);
+    sum.calls.resize(n);
+    sum.rpc_errors.resize(n);
+    sum.mismatches.resize(n);
+    for (const auto& t : stats) {
+        for (size_t i = 0; i < n; i++) {
+            const ProcStats& p = *t->procs[i];
+            p.latency.add_to(sum.latency[i]);
+            sum.calls[i] += p.calls;
+            sum.rpc_errors[i] += p.rpc_errors;
+            sum.mismatches[i] += p.mismatches;
+        }
+        t->lateness.add_to(sum.lateness);
+        sum.unmapped += t->unmapped;
+        sum.callbacks += t->callbacks;
+        sum.connection_errors += t->connection_errors;
+    }
+    for (size_t i = 0; i < n; i++) {
+        sum.all.merge(sum.latency[i]);
+        sum.total_calls += sum.calls[i];
+        sum.total_rpc_errors += sum.rpc_errors[i];
+        sum.total_mismatches += sum.mismatches[i];
+    }
+    return sum;
+}
+
+static void write_report(FILE* out, const Config& cfg, const std::string& target,
+                         const Trace& trace, const SetupStats& setup, size_t mapped,
+                         const Summary& sum, double elapsed) {
+    double trace_seconds =
+        trace.calls.empty() ? 0 : (trace.calls.back().ts_ns - trace.calls[0].ts_ns) / 1e9;
+    std::fprintf(out, "{\n");
+    std::fprintf(out, "  \"target\": \"%s\",\n", target.c_str());
+    std::fprintf(out, "  \"trace\": \"%s\",\n", cfg.trace_path.c_str());
+    std::fprintf(out,
+                 "  \"trace_calls\": %zu, \"trace_connections\": %zu, \"trace_seconds\": %.3f, "
+                 "\"trace_replies\": %s,\n",
+                 trace.calls.size(), trace.conns.size(), trace_seconds,
+                 trace.replies ? "true" : "false");
+    std::fprintf(out, "  \"speed\": %.3f, \"connections\": %u, \"threads\": %u, \"depth\": %u,\n",
+                 cfg.speed, cfg.connections, cfg.threads, cfg.depth);
+    std::fprintf(out,
+                 "  \"setup\": {\"found\": %llu, \"created\": %llu, \"removed\": %llu, "
+                 "\"unresolved\": %llu, \"handles_mapped\": %zu},\n",
+                 static_cast<unsigned long long>(setup.found),
+                 static_cast<unsigned long long>(setup.created),
+                 static_cast<unsigned long long>(setup.removed),
+                 static_cast<unsigned long long>(setup.unresolved), mapped);
+    std::fprintf(out, "  \"seconds\": %.3f,\n", elapsed);
+    std::fprintf(out,
+                 "  \"calls\": %llu, \"rpc_errors\": %llu, \"status_mismatches\": %llu, "
+                 "\"unmapped_handles\": %llu, \"callbacks\": %llu, \"connection_errors\": %llu,\n",
+                 static_cast<unsigned long long>(sum.total_calls),
+                 static_cast<unsigned long long>(sum.total_rpc_errors),
+                 static_cast<unsigned long long>(sum.total_mismatches),
+                 static_cast<unsigned long long>(sum.unmapped),
+                 static_cast<unsigned long long>(sum.callbacks),
+                 static_cast<unsigned long long>(sum.connection_errors));
+    std::fprintf(out, "  \"calls_per_sec\": %.1f,\n", sum.total_calls / elapsed);
+    std::fprintf(out, "  \"latency\": {");
+    write_latency_json(out, sum.all);
+    std::fprintf(out, "},\n");
+    std::fprintf(out, "  \"lateness\": {");
+    write_latency_json(out, sum.lateness);
+    std::fprintf(out, "},\n");
+    std::fprintf(out, "  \"by_proc\": {");
+    bool first = true;
+    for (size_t i = 0; i < trace.names.size(); i++) {
+        if (!sum.calls[i]) continue;
+        std::fprintf(out,
+                     "%s\n    \"%s\": {\"calls\": %llu, \"rpc_errors\": %llu, "
+                     "\"status_mismatches\": %llu, ",
+                     first ? "" : ",", trace.names[i].c_str(),
+                     static_cast<unsigned long long>(sum.calls[i]),
+                     static_cast<unsigned long long>(sum.rpc_errors[i]),
+                     static_cast<unsigned long long>(sum.mismatches[i]));
+        write_latency_json(out, sum.latency[i]);
+        std::fprintf(out, "}");
+        first = false;
+    }
+    std::fprintf(out, "\n  }\n}\n");
+}
+
+// --- Main ---
+
+static void usage() {
+    std::fprintf(stderr,
+                 "usage: nfsreplay --trace FILE [--host H] [--port P] [--inprocess]\n"
+                 "                 [--export DIR] [--mount PATH] [--speed X|max]\n"
+                 "                 [--connections N] [--threads N] [--depth N] [--no-setup]\n"
+                 "                 [--json FILE]\n");
+}
+
+static bool parse_args(int argc, char* argv[], Config& cfg) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        uint64_t v = 0;
+        auto size_arg = [&](uint64_t& out) {
+            return has_value && parse_size(argv[++i], out);
+        };
+        if (arg == "--trace" && has_value) cfg.trace_path = argv[++i];
+        else if (arg == "--host" && has_value) cfg.host = argv[++i];
+        else if (arg == "--port" && has_value) cfg.port = static_cast<uint16_t>(std::atoi(argv[++i]));
+        else if (arg == "--inprocess") cfg.inprocess = true;
+        else if (arg == "--export" && has_value) cfg.export_dir = argv[++i];
+        else if (arg == "--mount" && has_value) cfg.mount_path = argv[++i];
+        else if (arg == "--speed" && has_value) {
+            std::string s = argv[++i];
+            cfg.speed = s == "max" ? 0 : std::atof(s.c_str());
+        }
+        else if (arg == "--connections" && size_arg(v)) cfg.connections = static_cast<uint32_t>(v);
+        else if (arg == "--threads" && size_arg(v)) cfg.threads = static_cast<uint32_t>(v);
+        else if (arg == "--depth" && size_arg(v)) cfg.depth = static_cast<uint32_t>(v);
+        else if (arg == "--no-setup") cfg.setup = false;
+        else if (arg == "--json" && has_value) cfg.json_path = argv[++i];
+        else {
+            std::fprintf(stderr, "nfsreplay: bad argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    if (cfg.trace_path.empty()) {
+        std::fprintf(stderr, "nfsreplay: --trace is required\n");
+        return false;
+    }
+    if (!cfg.threads || !cfg.depth || cfg.speed < 0) {
+        std::fprintf(stderr, "nfsreplay: --threads and --depth must be non-zero, --speed "
+                             "not negative\n");
+        return false;
+    }
+    return true;
+}
+
+static int run(Config& cfg) {
+    raise_fd_limit();
+
+    Trace trace;
+    if (!load_trace(cfg.trace_path, trace)) return 1;
+    if (trace.calls.empty()) {
+        std::fprintf(stderr, "nfsreplay: %s: no calls\n", cfg.trace_path.c_str());
+        return 1;
+    }
+    if (!trace.replies)
+        std::fprintf(stderr, "nfsreplay: the capture has no replies: NFSv3 handles cannot be "
+                             "remapped\n");
+    if (!cfg.connections) cfg.connections = static_cast<uint32_t>(trace.conns.size());
+    cfg.threads = std::min(cfg.threads, cfg.connections);
+
+    // --inprocess: MOUNT3, NFSv3 and NFSv4 over LocalFs at an ephemeral port
+    std::string temp_dir;
+    std::unique_ptr<LocalFs> fs;
+    std::unique_ptr<MountServer> mount_srv;
+    std::unique_ptr<NfsServer> nfs_srv;
+    std::unique_ptr<Nfs4Server> nfs4_srv;
+    std::unique_ptr<RpcServer> rpc;
+    if (cfg.inprocess) {
+        if (cfg.export_dir.empty()) {
+            char tmpl[] = "/tmp/nfsreplay_XXXXXX";
+            if (!mkdtemp(tmpl)) {
+                std::fprintf(stderr, "nfsreplay: mkdtemp: %s\n", std::strerror(errno));
+                return 1;
+            }
+            temp_dir = cfg.export_dir = tmpl;
+        }
+        fs = std::make_unique<LocalFs>(cfg.export_dir);
+        mount_srv = std::make_unique<MountServer>(*fs, std::vector<std::string>{cfg.export_dir});
+        nfs_srv = std::make_unique<NfsServer>(*fs);
+        nfs4_srv = std::make_unique<Nfs4Server>(*fs, cfg.export_dir);
+        rpc = std::make_unique<RpcServer>();
+        rpc->register_program(MOUNT_PROGRAM, MOUNT_V3, mount_srv->get_handlers());
+        rpc->register_program(NFS_PROGRAM, NFS_V3, nfs_srv->get_handlers());
+        rpc->register_program(NFS_PROGRAM, NFS_V4, nfs4_srv->get_handlers());
+        rpc->start(0);
+        cfg.host = "127.0.0.1";
+        cfg.port = rpc->port();
+    }
+    const std::string target = cfg.host + ":" + std::to_string(cfg.port);
+
+    int rc = 1;
+    HandleMap map;
+    SetupStats setup_stats;
+    RpcConnection control;
+    std::string err;
+    if (!control.connect(cfg.host, cfg.port, err)) {
+        std::fprintf(stderr, "nfsreplay: connect %s: %s\n", target.c_str(), err.c_str());
+    } else if (control.set_auth_sys("nfsreplay", 0, 0),
+               setup(cfg, trace, control, map, setup_stats)) {
+        control.close();
+        std::unique_ptr<std::atomic<bool>[]> done(new std::atomic<bool>[trace.calls.size()]);
+        for (size_t i = 0; i < trace.calls.size(); i++) done[i] = false;
+
+        std::vector<std::unique_ptr<ThreadStats>> stats;
+        std::vector<std::unique_ptr<ReplayThread>> players;
+        for (uint32_t t = 0; t < cfg.threads; t++) {
+            stats.push_back(std::make_unique<ThreadStats>());
+            players.push_back(
+                std::make_unique<ReplayThread>(cfg, trace, map, done.get(), *stats.back()));
+        }
+        std::vector<std::unique_ptr<Conn>> conns;
+        for (uint32_t i = 0; i < cfg.connections; i++) {
+            auto c = std::make_unique<Conn>();
+            if (!c->rpc.connect(cfg.host, cfg.port, err)) {
+                std::fprintf(stderr, "nfsreplay: connect %s: %s\n", target.c_str(),
+                             err.c_str());
+                break;
+            }
+            conns.push_back(std::move(c));
+        }
+        if (conns.size() == cfg.connections) {
+            std::unordered_map<uint32_t, uint32_t> conn_index;
+            for (uint32_t i = 0; i < trace.conns.size(); i++)
+                conn_index[trace.conns[i]] = i % cfg.connections;
+            for (uint32_t i = 0; i < trace.calls.size(); i++)
+                conns[conn_index[trace.calls[i].conn]]->queue.push_back(i);
+            for (uint32_t i = 0; i < conns.size(); i++)
+                players[i % cfg.threads]->add(std::move(conns[i]));
+
+            uint64_t start = LatencyStats::now_ns();
+            std::vector<std::thread> threads;
+            for (auto& p : players) threads.emplace_back([&p, start] { p->run(start); });
+            for (auto& t : threads) t.join();
+            double elapsed = (LatencyStats::now_ns() - start) / 1e9;
+            players.clear();  // closes the connections
+
+            FILE* out = stdout;
+            if (!cfg.json_path.empty()) out = std::fopen(cfg.json_path.c_str(), "w");
+            if (!out) {
+                std::fprintf(stderr, "nfsreplay: %s: %s\n", cfg.json_path.c_str(),
+                             std::strerror(errno));
+            } else {
+                Summary sum = summarize(trace, stats);
+                write_report(out, cfg, target, trace, setup_stats, map.size(), sum, elapsed);
+                if (out != stdout) std::fclose(out);
+                rc = sum.total_calls > 0 && sum.total_rpc_errors == 0 &&
+                             sum.connection_errors == 0
+                         ? 0
+                         : 1;
+            }
+        }
+    }
+    control.close();
+
+    if (rpc) rpc->stop();
+    if (!temp_dir.empty()) {
+        std::string cmd = "rm -rf " + temp_dir;
+        if (std::system(cmd.c_str()) != 0)
+            std::fprintf(stderr, "nfsreplay: could not remove %s\n", temp_dir.c_str());
+    }
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    Config cfg;
+    if (!parse_args(argc, argv, cfg)) {
+        usage();
+        return 2;
+    }
+    try {
+        return run(cfg);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "nfsreplay: %s\n", e.what());
+        return 1;
+    }
+}
@@ -1,5 +1,7 @@
 #include "locking/lock_table.h"
+#include "stats/probes.h"
 #include <algorithm>
+#include <set>
 
 bool ByteRangeLockTable::ranges_overlap(uint64_t o1, uint64_t l1,
                                          uint64_t o2, uint64_t l2) {
@@ -8,14 +10,25 @@ bool ByteRangeLockTable::ranges_overlap(uint64_t o1, uint64_t l1,
     return o1 < end2 && o2 < end1;
 }
 
-LockEntry* ByteRangeLockTable::find_entry(const FileHandle& fh,
-                                           const LockOwnerKey& owner) {
-    for (auto& e : entries_)
-        if (e.fh == fh && e.owner == owner) return &e;
+// The handle's own hash; its high half picks the stripe, so the stripe's
+// file map still sees well spread low bits
+ByteRangeLockTable::Stripe& ByteRangeLockTable::stripe_for(const FileHandle& fh) {
+    return stripes_[(fh.hash() >> 32) % kStripes];
+}
+
+const ByteRangeLockTable::Stripe& ByteRangeLockTable::stripe_for(const FileHandle& fh) const {
+    return stripes_[(fh.hash() >> 32) % kStripes];
+}
+
+ByteRangeLockTable::Holder* ByteRangeLockTable::find_entry(Stripe& st, const FileHandle& fh,
+                                                           const LockOwnerKey& owner) {
+    auto range = st.files.equal_range(fh);
+    for (auto it = range.first; it != range.second; ++it)
+        if (it->second.owner == owner) return &it->second;
     return nullptr;
 }
 
-void ByteRangeLockTable::remove_range(LockEntry& entry,
+void ByteRangeLockTable::remove_range(Holder& entry,
                                        uint64_t offset, uint64_t length) {
     uint64_t rem_end = (length == UINT64_MAX) ? UINT64_MAX : offset + length;
     std::vector<LockRange> new_ranges;
@@ -47,18 +60,32 @@ void ByteRangeLockTable::remove_range(LockEntry& entry,
     entry.ranges = std::move(new_ranges);
 }
 
-void ByteRangeLockTable::cleanup_empty() {
-    entries_.erase(
-        std::remove_if(entries_.begin(), entries_.end(),
-                       [](const LockEntry& e) { return e.ranges.empty(); }),
-        entries_.end());
+void ByteRangeLockTable::cleanup_empty(Stripe& st, const FileHandle& fh) {
+    auto range = st.files.equal_range(fh);
+    for (auto it = range.first; it != range.second;)
+        it = it->second.ranges.empty() ? st.files.erase(it) : std::next(it);
 }
 
-bool ByteRangeLockTable::test(const FileHandle& fh, const LockOwnerKey& requester,
-                               bool exclusive, uint64_t offset, uint64_t length,
-                               LockConflict& conflict) {
-    for (const auto& e : entries_) {
-        if (!(e.fh == fh)) continue;
+// Drop the holders matching pred, noting the files they were on
+template <typename Files, typename Pred>
+static void erase_owners(Files& files, Pred pred, std::vector<FileHandle>& touched) {
+    for (auto it = files.begin(); it != files.end();) {
+        if (pred(it->second.owner)) {
+            touched.push_back(it->first);
+            it = files.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool ByteRangeLockTable::test_locked(const Stripe& st, const FileHandle& fh,
+                                      const LockOwnerKey& requester,
+                                      bool exclusive, uint64_t offset, uint64_t length,
+                                      LockConflict& conflict) {
+    auto range = st.files.equal_range(fh);
+    for (auto it = range.first; it != range.second; ++it) {
+        const Holder& e = it->second;
         if (e.owner == requester) continue;
         for (const auto& r : e.ranges) {
             if (!exclusive && !r.exclusive) continue;  // read-read OK
@@ -74,57 +101,356 @@ bool ByteRangeLockTable::test(const FileHandle& fh, const LockOwnerKey& requeste
     return false;
 }
 
+// FIFO admission: a new request does not overtake a queued one it conflicts
+// with, or a stream of readers could starve a waiting writer. The
+// requester's own waiter marks its place in the queue.
+bool ByteRangeLockTable::queued_ahead_locked(const Stripe& st, const FileHandle& fh,
+                                             const LockOwnerKey& requester, bool exclusive,
+                                             uint64_t offset, uint64_t length,
+                                             LockConflict& conflict) {
+    for (const auto& w : st.waiters) {
+        if (!(w.fh == fh)) continue;
+        if (w.owner == requester) return false;
+        if ((w.exclusive || exclusive) && ranges_overlap(offset, length, w.offset, w.length)) {
+            conflict.offset = w.offset;
+            conflict.length = w.length;
+            conflict.exclusive = w.exclusive;
+            conflict.owner = w.owner;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ByteRangeLockTable::acquire_locked(Stripe& st, const FileHandle& fh,
+                                         const LockOwnerKey& owner, bool exclusive,
+                                         uint64_t offset, uint64_t length) {
+    auto* entry = find_entry(st, fh, owner);
+    if (!entry) entry = &st.files.emplace(fh, Holder{owner, {}})->second;
+    entry->ranges.push_back({offset, length, exclusive});
+}
+
+bool ByteRangeLockTable::test(const FileHandle& fh, const LockOwnerKey& requester,
+                               bool exclusive, uint64_t offset, uint64_t length,
+                               LockConflict& conflict) {
+    auto& st = stripe_for(fh);
+    std::lock_guard<std::mutex> lk(st.mu);
+    return test_locked(st, fh, requester, exclusive, offset, length, conflict);
+}
+
 bool ByteRangeLockTable::acquire(const FileHandle& fh, const LockOwnerKey& owner,
                                   bool exclusive, uint64_t offset, uint64_t length,
                                   LockConflict& conflict) {
-    if (test(fh, owner, exclusive, offset, length, conflict))
+    auto& st = stripe_for(fh);
+    std::lock_guard<std::mutex> lk(st.mu);
+    if (test_locked(st, fh, owner, exclusive, offset, length, conflict) ||
+        queued_ahead_locked(st, fh, owner, exclusive, offset, length, conflict)) {
+        NFSD_PROBE6(lock__deny, t_probe_xid, fh.data(), fh.size(), offset, length, exclusive);
         return false;
-
-    auto* entry = find_entry(fh, owner);
-    if (!entry) {
-        entries_.push_back({owner, fh, {}});
-        entry = &entries_.back();
     }
-    entry->ranges.push_back({offset, length, exclusive});
+    acquire_locked(st, fh, owner, exclusive, offset, length);
+    // Granted directly (a client retrying its queued request): the waiter
+    // has nothing left to wait for
+    st.waiters.erase(std::remove_if(st.waiters.begin(), st.waiters.end(),
+                                    [&](const LockWaiter& w) {
+                                        return w.fh == fh && w.owner == owner &&
+                                               w.exclusive == exclusive &&
+                                               w.offset == offset && w.length == length;
+                                    }),
+                     st.waiters.end());
+    NFSD_PROBE6(lock__acquire, t_probe_xid, fh.data(), fh.size(), offset, length, exclusive);
     return true;
 }
 
 void ByteRangeLockTable::release(const FileHandle& fh, const LockOwnerKey& owner,
                                   uint64_t offset, uint64_t length) {
-    auto* entry = find_entry(fh, owner);
+    auto& st = stripe_for(fh);
+    std::lock_guard<std::mutex> lk(st.mu);
+    auto* entry = find_entry(st, fh, owner);
     if (!entry) return;
     remove_range(*entry, offset, length);
-    cleanup_empty();
+    cleanup_empty(st, fh);
+    wake_waiters(st, fh);
 }
 
 void ByteRangeLockTable::release_all(const LockOwnerKey& owner) {
-    entries_.erase(
-        std::remove_if(entries_.begin(), entries_.end(),
-                       [&](const LockEntry& e) { return e.owner == owner; }),
-        entries_.end());
+    for (auto& st : stripes_) {
+        std::lock_guard<std::mutex> lk(st.mu);
+        std::vector<FileHandle> touched;
+        erase_owners(st.files, [&](const LockOwnerKey& o) { return o == owner; }, touched);
+        for (const auto& w : st.waiters)
+            if (w.owner == owner) touched.push_back(w.fh);
+        if (touched.empty()) continue;
+
+        st.waiters.erase(
+            std::remove_if(st.waiters.begin(), st.waiters.end(),
+                           [&](const LockWaiter& w) { return w.owner == owner; }),
+            st.waiters.end());
+
+        for (const auto& fh : touched)
+            wake_waiters(st, fh);
+    }
 }
 
 void ByteRangeLockTable::release_all_matching(const std::string& prefix) {
-    entries_.erase(
-        std::remove_if(entries_.begin(), entries_.end(),
-                       [&](const LockEntry& e) {
-                           return e.owner.compare(0, prefix.size(), prefix) == 0;
-                       }),
-        entries_.end());
+    auto matches = [&](const LockOwnerKey& owner) {
+        return owner.compare(0, prefix.size(), prefix) == 0;
+    };
+    for (auto& st : stripes_) {
+        std::lock_guard<std::mutex> lk(st.mu);
+        std::vector<FileHandle> touched;
+        erase_owners(st.files, matches, touched);
+        for (const auto& w : st.waiters)
+            if (matches(w.owner)) touched.push_back(w.fh);
+        if (touched.empty()) continue;
+
+        st.waiters.erase(
+            std::remove_if(st.waiters.begin(), st.waiters.end(),
+                           [&](const LockWaiter& w) { return matches(w.owner); }),
+            st.waiters.end());
+
+        for (const auto& fh : touched)
+            wake_waiters(st, fh);
+    }
 }
 
 bool ByteRangeLockTable::has_locks(const FileHandle& fh,
                                     const LockOwnerKey& owner) {
-    auto* entry = find_entry(fh, owner);
+    auto& st = stripe_for(fh);
+    std::lock_guard<std::mutex> lk(st.mu);
+    auto* entry = find_entry(st, fh, owner);
     return entry != nullptr && !entry->ranges.empty();
 }
 
+std::vector<LockEntry> ByteRangeLockTable::entries() const {
+    std::vector<LockEntry> out;
+    for (const auto& st : stripes_) {
+        std::lock_guard<std::mutex> lk(st.mu);
+        for (const auto& [fh, h] : st.files) out.push_back({h.owner, fh, h.ranges});
+    }
+    return out;
+}
+
+void ByteRangeLockTable::restore(const std::vector<LockEntry>& entries) {
+    for (const auto& e : entries) {
+        auto& st = stripe_for(e.fh);
+        std::lock_guard<std::mutex> lk(st.mu);
+        for (const auto& r : e.ranges)
+            acquire_locked(st, e.fh, e.owner, r.exclusive, r.offset, r.length);
+    }
+}
+
 void ByteRangeLockTable::release_all_for_file(const FileHandle& fh,
                                                const LockOwnerKey& owner) {
-    entries_.erase(
-        std::remove_if(entries_.begin(), entries_.end(),
-                       [&](const LockEntry& e) {
-                           return e.fh == fh && e.owner == owner;
+    auto& st = stripe_for(fh);
+    std::lock_guard<std::mutex> lk(st.mu);
+    auto range = st.files.equal_range(fh);
+    for (auto it = range.first; it != range.second;)
+        it = it->second.owner == owner ? st.files.erase(it) : std::next(it);
+    st.waiters.erase(
+        std::remove_if(st.waiters.begin(), st.waiters.end(),
+                       [&](const LockWaiter& w) {
+                           return w.fh == fh && w.owner == owner;
                        }),
-        entries_.end());
+        st.waiters.end());
+    wake_waiters(st, fh);
+}
+
+// --- Blocked lock requests ---
+
+uint64_t ByteRangeLockTable::enqueue_waiter(LockWaiter waiter, bool refuse_deadlock) {
+    auto& st = stripe_for(waiter.fh);
+    if (!refuse_deadlock) {
+        std::lock_guard<std::mutex> lk(st.mu);
+        return enqueue_locked(st, std::move(waiter), false);
+    }
+    // The check and the enqueue are one step: two owners blocking on each
+    // other must not both pass the check before either is queued
+    auto locks = lock_all();
+    return enqueue_locked(st, std::move(waiter), true);
+}
+
+uint64_t ByteRangeLockTable::enqueue_locked(Stripe& st, LockWaiter waiter,
+                                            bool refuse_deadlock) {
+    for (const auto& w : st.waiters) {
+        if (w.fh == waiter.fh && w.owner == waiter.owner &&
+            w.exclusive == waiter.exclusive &&
+            w.offset == waiter.offset && w.length == waiter.length)
+            return w.id;
+    }
+    if (refuse_deadlock && deadlock_locked(waiter.fh, waiter.owner, waiter.exclusive,
+                                           waiter.offset, waiter.length))
+        return 0;
+    waiter.id = next_waiter_id_++;
+    uint64_t id = waiter.id;
+    FileHandle fh = waiter.fh;
+    st.waiters.push_back(std::move(waiter));
+    // The conflicting lock may have gone away since the caller's attempt
+    wake_waiters(st, fh);
+    return id;
+}
+
+bool ByteRangeLockTable::cancel_waiter(const FileHandle& fh,
+                                        const LockOwnerKey& owner,
+                                        bool exclusive, uint64_t offset,
+                                        uint64_t length) {
+    auto& st = stripe_for(fh);
+    std::lock_guard<std::mutex> lk(st.mu);
+    auto it = std::find_if(st.waiters.begin(), st.waiters.end(),
+                           [&](const LockWaiter& w) {
+                               return w.fh == fh && w.owner == owner &&
+                                      w.exclusive == exclusive &&
+                                      w.offset == offset && w.length == length;
+                           });
+    if (it == st.waiters.end()) return false;
+    st.waiters.erase(it);
+    // Later waiters may have been queued behind the cancelled one
+    wake_waiters(st, fh);
+    return true;
+}
+
+void ByteRangeLockTable::cancel_waiters_matching(const std::string& prefix) {
+    auto matches = [&](const LockWaiter& w) {
+        return w.owner.compare(0, prefix.size(), prefix) == 0;
+    };
+    for (auto& st : stripes_) {
+        std::lock_guard<std::mutex> lk(st.mu);
+        std::vector<FileHandle> touched;
+        for (const auto& w : st.waiters)
+            if (matches(w)) touched.push_back(w.fh);
+        if (touched.empty()) continue;
+        st.waiters.erase(std::remove_if(st.waiters.begin(), st.waiters.end(), matches),
+                         st.waiters.end());
+        for (const auto& fh : touched)
+            wake_waiters(st, fh);
+    }
+}
+
+size_t ByteRangeLockTable::waiter_count(const FileHandle& fh) const {
+    const auto& st = stripe_for(fh);
+    std::lock_guard<std::mutex> lk(st.mu);
+    return std::count_if(st.waiters.begin(), st.waiters.end(),
+                         [&](const LockWaiter& w) { return w.fh == fh; });
+}
+
+std::vector<LockOwnerKey> ByteRangeLockTable::blockers(
+        const Stripe& st, const FileHandle& fh, const LockOwnerKey& requester,
+        bool exclusive, uint64_t offset, uint64_t length) {
+    std::vector<LockOwnerKey> out;
+    auto range = st.files.equal_range(fh);
+    for (auto it = range.first; it != range.second; ++it) {
+        const Holder& e = it->second;
+        if (e.owner == requester) continue;
+        for (const auto& r : e.ranges) {
+            if (!exclusive && !r.exclusive) continue;
+            if (ranges_overlap(offset, length, r.offset, r.length)) {
+                out.push_back(e.owner);
+                break;
+            }
+        }
+    }
+    return out;
+}
+
+std::vector<LockOwnerKey> ByteRangeLockTable::waits_for(
+        const Stripe& st, const FileHandle& fh, const LockOwnerKey& requester,
+        bool exclusive, uint64_t offset, uint64_t length, const LockWaiter* self) {
+    std::vector<LockOwnerKey> out = blockers(st, fh, requester, exclusive, offset, length);
+    // FIFO admission (wake_waiters()) holds the request behind these too.
+    // A waiter that only wants to be told (acquire false) is not a blocked
+    // owner: its client polls. The request waits for what that waiter
+    // waits for instead.
+    for (const auto& w : st.waiters) {
+        if (&w == self) break;
+        if (!(w.fh == fh) || w.owner == requester) continue;
+        if (!(w.exclusive || exclusive) || !ranges_overlap(offset, length, w.offset, w.length))
+            continue;
+        if (w.acquire) {
+            out.push_back(w.owner);
+        } else {
+            for (auto& o : waits_for(st, fh, w.owner, w.exclusive, w.offset, w.length, &w))
+                out.push_back(std::move(o));
+        }
+    }
+    return out;
+}
+
+// The wait-for graph spans files, so take every stripe (in index order)
+std::array<std::unique_lock<std::mutex>, ByteRangeLockTable::kStripes>
+ByteRangeLockTable::lock_all() const {
+    std::array<std::unique_lock<std::mutex>, kStripes> locks;
+    for (size_t i = 0; i < kStripes; i++)
+        locks[i] = std::unique_lock<std::mutex>(stripes_[i].mu);
+    return locks;
+}
+
+bool ByteRangeLockTable::would_deadlock(const FileHandle& fh,
+                                         const LockOwnerKey& owner,
+                                         bool exclusive, uint64_t offset,
+                                         uint64_t length) const {
+    auto locks = lock_all();
+    return deadlock_locked(fh, owner, exclusive, offset, length);
+}
+
+bool ByteRangeLockTable::deadlock_locked(const FileHandle& fh, const LockOwnerKey& owner,
+                                         bool exclusive, uint64_t offset,
+                                         uint64_t length) const {
+    // Walk the wait-for graph from the owners this request would wait for,
+    // queued at the back. Only acquiring waiters are blocked owners.
+    std::vector<LockOwnerKey> stack =
+        waits_for(stripe_for(fh), fh, owner, exclusive, offset, length, nullptr);
+    std::set<LockOwnerKey> seen;
+    while (!stack.empty()) {
+        LockOwnerKey cur = std::move(stack.back());
+        stack.pop_back();
+        if (cur == owner) return true;
+        if (!seen.insert(cur).second) continue;
+        for (const auto& st : stripes_) {
+            for (const auto& w : st.waiters) {
+                if (w.owner != cur || !w.acquire) continue;
+                for (auto& b : waits_for(st, w.fh, w.owner, w.exclusive, w.offset, w.length, &w))
+                    stack.push_back(std::move(b));
+            }
+        }
+    }
+    return false;
+}
+
+void ByteRangeLockTable::wake_waiters(Stripe& st, const FileHandle& fh) {
+    std::vector<LockWaiter> keep;
+    std::vector<LockWaiter> ready;
+    std::vector<size_t> blocked;  // indices into keep of still-blocked waiters on fh
+
+    for (auto& w : st.waiters) {
+        if (!(w.fh == fh)) {
+            keep.push_back(std::move(w));
+            continue;
+        }
+
+        // FIFO: stay behind an earlier waiter whose request we conflict with
+        bool behind = false;
+        for (size_t i : blocked) {
+            const auto& b = keep[i];
+            if (b.owner != w.owner && (b.exclusive || w.exclusive) &&
+                ranges_overlap(b.offset, b.length, w.offset, w.length)) {
+                behind = true;
+                break;
+            }
+        }
+
+        LockConflict conflict;
+        if (behind || test_locked(st, fh, w.owner, w.exclusive, w.offset, w.length, conflict)) {
+            blocked.push_back(keep.size());
+            keep.push_back(std::move(w));
+            continue;
+        }
+
+        if (w.acquire)
+            acquire_locked(st, fh, w.owner, w.exclusive, w.offset, w.length);
+        ready.push_back(std::move(w));
+    }
+    st.waiters = std::move(keep);
+
+    for (const auto& w : ready)
+        if (w.on_ready) w.on_ready(w);
 }
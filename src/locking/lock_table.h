@@ -1,13 +1,22 @@
 #pragma once
 
 #include "vfs/vfs.h"
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 // Protocol-agnostic byte-range lock table.
 // Used by both NFSv4 state manager and NLM (NFSv3 locking).
-// No internal mutex — caller provides synchronization.
+// Internally synchronized: state is striped by file handle hash, so every
+// per-file operation (test/acquire/release, waiters) is atomic under one
+// stripe lock and unrelated files never contend. NFSv4 and NLM see the
+// same stripe for the same file, which keeps cross-protocol conflict
+// detection atomic without a shared outer mutex.
 
 using LockOwnerKey = std::string;
 
@@ -30,6 +39,24 @@ struct LockEntry {
     std::vector<LockRange> ranges;
 };
 
+// A blocked lock request queued until the conflicting range is released.
+// Waiters on a file are served in FIFO order: a later waiter is never granted
+// ahead of an earlier one whose request it conflicts with.
+struct LockWaiter {
+    uint64_t id = 0;                 // assigned by enqueue_waiter()
+    LockOwnerKey owner;
+    FileHandle fh;
+    bool exclusive = false;
+    uint64_t offset = 0;
+    uint64_t length = 0;             // UINT64_MAX = to EOF
+    // true: the table acquires the lock on the waiter's behalf before
+    // calling on_ready (NLM). false: the waiter is only told that the
+    // range is now free and must retry itself (NFSv4.1 CB_NOTIFY_LOCK).
+    bool acquire = true;
+    // Called with the file's stripe lock held — must not re-enter the table.
+    std::function<void(const LockWaiter&)> on_ready;
+};
+
 class ByteRangeLockTable {
 public:
     // Test for conflict (does not modify state)
@@ -37,7 +64,9 @@ public:
               bool exclusive, uint64_t offset, uint64_t length,
               LockConflict& conflict);
 
-    // Acquire lock (returns false on conflict)
+    // Acquire lock (returns false on conflict, filling conflict). Test and
+    // insert are one atomic step. A queued request of another owner that
+    // conflicts counts as a conflict too: waiters are not overtaken.
     bool acquire(const FileHandle& fh, const LockOwnerKey& owner,
                  bool exclusive, uint64_t offset, uint64_t length,
                  LockConflict& conflict);
@@ -58,12 +87,96 @@ public:
     // Check if an owner holds any locks on a file
     bool has_locks(const FileHandle& fh, const LockOwnerKey& owner);
 
+    // Queue a blocked request. A retransmitted request (same owner, file,
+    // range and mode) returns the id of the existing waiter. If the range
+    // became free since the caller's failed attempt, the waiter is served
+    // (on_ready called) before this returns. With refuse_deadlock, a request
+    // that would_deadlock() is not queued and 0 is returned; the check and
+    // the enqueue are then one step under every stripe lock.
+    uint64_t enqueue_waiter(LockWaiter waiter, bool refuse_deadlock = false);
+
+    // Remove a queued request. Returns false if no such waiter exists.
+    bool cancel_waiter(const FileHandle& fh, const LockOwnerKey& owner,
+                       bool exclusive, uint64_t offset, uint64_t length);
+
+    // Drop all queued requests whose owner starts with prefix
+    void cancel_waiters_matching(const std::string& prefix);
+
+    // Number of queued requests on a file
+    size_t waiter_count(const FileHandle& fh) const;
+
+    // Deadlock detection: true if blocking this request would close a cycle
+    // in the wait-for graph (owner waits on a holder that, transitively,
+    // waits on owner). Locks every stripe; only for the blocking slow path.
+    bool would_deadlock(const FileHandle& fh, const LockOwnerKey& owner,
+                        bool exclusive, uint64_t offset, uint64_t length) const;
+
+    // Every held lock, for handing the table to another process; queued
+    // requests are not included
+    std::vector<LockEntry> entries() const;
+    // Add entries as held, without conflict checks (an entries() image)
+    void restore(const std::vector<LockEntry>& entries);
+
     static bool ranges_overlap(uint64_t o1, uint64_t l1, uint64_t o2, uint64_t l2);
 
-private:
-    std::vector<LockEntry> entries_;
+    static constexpr size_t kStripes = 64;
 
-    LockEntry* find_entry(const FileHandle& fh, const LockOwnerKey& owner);
-    void remove_range(LockEntry& entry, uint64_t offset, uint64_t length);
-    void cleanup_empty();
+private:
+    // A LockEntry without the handle its map key already holds
+    struct Holder {
+        LockOwnerKey owner;
+        std::vector<LockRange> ranges;
+    };
+
+    struct Stripe {
+        mutable std::mutex mu;
+        // Held locks by file, one holder per owner and file
+        std::unordered_multimap<FileHandle, Holder> files;
+        std::vector<LockWaiter> waiters;  // arrival order
+    };
+
+    std::array<Stripe, kStripes> stripes_;
+    std::atomic<uint64_t> next_waiter_id_{1};
+
+    Stripe& stripe_for(const FileHandle& fh);
+    const Stripe& stripe_for(const FileHandle& fh) const;
+
+    // Helpers below require the stripe's mu to be held
+    static Holder* find_entry(Stripe& st, const FileHandle& fh, const LockOwnerKey& owner);
+    static void remove_range(Holder& entry, uint64_t offset, uint64_t length);
+    // Drop fh's entries left without ranges
+    static void cleanup_empty(Stripe& st, const FileHandle& fh);
+    static bool test_locked(const Stripe& st, const FileHandle& fh,
+                            const LockOwnerKey& requester, bool exclusive,
+                            uint64_t offset, uint64_t length, LockConflict& conflict);
+    // A waiter queued on fh before requester's own (if any) that conflicts
+    static bool queued_ahead_locked(const Stripe& st, const FileHandle& fh,
+                                    const LockOwnerKey& requester, bool exclusive,
+                                    uint64_t offset, uint64_t length, LockConflict& conflict);
+    static void acquire_locked(Stripe& st, const FileHandle& fh, const LockOwnerKey& owner,
+                               bool exclusive, uint64_t offset, uint64_t length);
+
+    // Owners holding ranges that conflict with the given request
+    static std::vector<LockOwnerKey> blockers(const Stripe& st, const FileHandle& fh,
+                                              const LockOwnerKey& requester,
+                                              bool exclusive, uint64_t offset,
+                                              uint64_t length);
+    // Owners the request waits for: blockers(), and those of the waiters
+    // queued on fh ahead of it that it conflicts with — ahead of self, or
+    // of the whole queue for a request not queued yet (self null)
+    static std::vector<LockOwnerKey> waits_for(const Stripe& st, const FileHandle& fh,
+                                               const LockOwnerKey& requester,
+                                               bool exclusive, uint64_t offset,
+                                               uint64_t length, const LockWaiter* self);
+
+    // Every stripe's mu, in index order
+    std::array<std::unique_lock<std::mutex>, kStripes> lock_all() const;
+    // would_deadlock() with every stripe's mu held
+    bool deadlock_locked(const FileHandle& fh, const LockOwnerKey& owner, bool exclusive,
+                         uint64_t offset, uint64_t length) const;
+    // enqueue_waiter() with st's mu (or, refuse_deadlock, every stripe's) held
+    uint64_t enqueue_locked(Stripe& st, LockWaiter waiter, bool refuse_deadlock);
+
+    // Re-check queued requests on fh after a release
+    static void wake_waiters(Stripe& st, const FileHandle& fh);
 };
@@ -0,0 +1,284 @@
+#include "log/logger.h"
+#include "stats/metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <thread>
+
+static const char* const kLevelNames[] = {"debug", "info", "warn", "error", "off"};
+static const char* const kSysNames[kLogSubsystems] = {
+    "rpc", "tls", "portmap", "mount", "nfs3", "nfs4", "nlm", "nsm", "vfs"};
+
+const char* log_level_name(LogLevel level) {
+    return kLevelNames[static_cast<size_t>(level)];
+}
+
+const char* log_sys_name(LogSys sys) {
+    return kSysNames[static_cast<size_t>(sys)];
+}
+
+static uint64_t wall_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+// --- Rate limiting ---
+
+bool LogSite::admit() {
+    uint32_t limit = Logger::instance().rate_limit();
+    if (limit == 0) return true;
+
+    uint64_t second = wall_ns() / 1000000000ull;
+    uint64_t window = window_.load(std::memory_order_relaxed);
+    if (window != second && window_.compare_exchange_strong(window, second,
+                                                            std::memory_order_relaxed))
+        count_.store(0, std::memory_order_relaxed);
+    if (count_.fetch_add(1, std::memory_order_relaxed) < limit) return true;
+
+    suppressed_.fetch_add(1, std::memory_order_relaxed);
+    Logger::instance().count_suppressed();
+    return false;
+}
+
+// --- Per-thread rings ---
+
+namespace {
+struct LogRecord {
+    uint64_t wall_ns = 0;
+    const char* msg = nullptr;
+    uint64_t suppressed = 0;
+    LogLevel level = LogLevel::INFO;
+    LogSys sys = LogSys::RPC;
+    uint16_t len = 0;
+    char fields[216];  // " key=value" pairs, already quoted
+};
+}  // namespace
+
+// Single-producer (the owning thread) / single-consumer (the writer)
+struct Logger::Ring {
+    static constexpr size_t kCapacity = 256;  // power of two
+
+    std::unique_ptr<LogRecord[]> records{new LogRecord[kCapacity]};
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    std::atomic<bool> released{false};  // owning thread exited
+};
+
+namespace {
+struct ThreadLogRing {
+    std::shared_ptr<Logger::Ring> ring;
+    ~ThreadLogRing() {
+        if (ring) ring->released.store(true, std::memory_order_release);
+    }
+};
+}  // namespace
+
+static thread_local ThreadLogRing t_log_ring;
+
+// --- Logger ---
+
+Logger& Logger::instance() {
+    static Logger* logger = new Logger();
+    return *logger;
+}
+
+Logger::Logger() {
+    for (auto& l : levels_) l.store(static_cast<uint8_t>(LogLevel::INFO));
+    sink_ = [](const std::string& lines) {
+        std::fwrite(lines.data(), 1, lines.size(), stderr);
+        std::fflush(stderr);
+    };
+    std::thread(&Logger::writer_loop, this).detach();
+}
+
+void Logger::set_level(LogSys sys, LogLevel level) {
+    levels_[static_cast<size_t>(sys)].store(static_cast<uint8_t>(level),
+                                            std::memory_order_relaxed);
+}
+
+void Logger::set_level(LogLevel level) {
+    for (size_t i = 0; i < kLogSubsystems; i++) set_level(static_cast<LogSys>(i), level);
+}
+
+static bool parse_level(const std::string& name, LogLevel& out) {
+    for (size_t i = 0; i < sizeof(kLevelNames) / sizeof(kLevelNames[0]); i++) {
+        if (name == kLevelNames[i]) {
+            out = static_cast<LogLevel>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Logger::configure(const std::string& spec) {
+    // Parse everything first so a bad spec changes nothing
+    std::vector<std::pair<int, LogLevel>> settings;  // subsystem (-1: all), level
+    size_t pos = 0;
+    while (pos <= spec.size()) {
+        size_t comma = spec.find(',', pos);
+        if (comma == std::string::npos) comma = spec.size();
+        std::string item = spec.substr(pos, comma - pos);
+        pos = comma + 1;
+        if (item.empty()) continue;
+
+        size_t eq = item.find('=');
+        LogLevel level;
+        if (!parse_level(eq == std::string::npos ? item : item.substr(eq + 1), level))
+            return false;
+        int sys = -1;
+        if (eq != std::string::npos) {
+            std::string name = item.substr(0, eq);
+            for (size_t i = 0; i < kLogSubsystems; i++)
+                if (name == kSysNames[i]) sys = static_cast<int>(i);
+            if (sys < 0) return false;
+        }
+        settings.emplace_back(sys, level);
+    }
+    for (const auto& [sys, level] : settings) {
+        if (sys < 0) set_level(level);
+        else set_level(static_cast<LogSys>(sys), level);
+    }
+    return true;
+}
+
+void Logger::set_sink(std::function<void(const std::string&)> sink) {
+    std::lock_guard<std::mutex> lk(write_mu_);
+    sink_ = std::move(sink);
+}
+
+Logger::Ring* Logger::thread_ring() {
+    if (t_log_ring.ring) return t_log_ring.ring.get();
+
+    std::lock_guard<std::mutex> lk(rings_mu_);
+    for (auto& r : rings_) {
+        // A ring whose thread exited, possibly with records still queued
+        if (r->released.load(std::memory_order_acquire)) {
+            r->released.store(false, std::memory_order_relaxed);
+            t_log_ring.ring = r;
+            return r.get();
+        }
+    }
+    rings_.push_back(std::make_shared<Ring>());
+    t_log_ring.ring = rings_.back();
+    return t_log_ring.ring.get();
+}
+
+// Append " key=value" to the record, quoting and escaping string values
+// as logfmt requires; what does not fit is cut off
+static void append_field(LogRecord& rec, const LogField& f) {
+    char* out = rec.fields + rec.len;
+    const size_t room = sizeof(rec.fields) - rec.len;
+    if (f.type != LogField::STR) {
+        int n = std::snprintf(out, room, " %s=%s%llu", f.key,
+                              f.type == LogField::NEG ? "-" : "",
+                              static_cast<unsigned long long>(f.u));
+        if (n > 0) rec.len = static_cast<uint16_t>(rec.len + std::min<size_t>(n, room - 1));
+        return;
+    }
+
+    bool quote = f.len == 0;
+    for (size_t i = 0; i < f.len && !quote; i++) {
+        char c = f.s[i];
+        quote = c == ' ' || c == '"' || c == '=' || c == '\\' ||
+                static_cast<unsigned char>(c) < 0x20;
+    }
+    int n = std::snprintf(out, room, " %s=%s", f.key, quote ? "\"" : "");
+    if (n < 0 || static_cast<size_t>(n) >= room) return;
+    size_t len = rec.len + n;
+    const size_t end = sizeof(rec.fields) - 2;  // room for the closing quote
+    for (size_t i = 0; i < f.len && len < end; i++) {
+        char c = f.s[i];
+        if (c == '"' || c == '\\' || c == '\n') {
+            if (len + 2 > end) break;
+            rec.fields[len++] = '\\';
+            c = c == '\n' ? 'n' : c;
+        }
+        rec.fields[len++] = c;
+    }
+    if (quote) rec.fields[len++] = '"';
+    rec.len = static_cast<uint16_t>(len);
+}
+
+void Logger::log(LogSite& site, const char* msg, std::initializer_list<LogField> fields) {
+    Ring* ring = thread_ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= Ring::kCapacity) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    LogRecord& rec = ring->records[head & (Ring::kCapacity - 1)];
+    rec.wall_ns = wall_ns();
+    rec.msg = msg;
+    rec.level = site.level();
+    rec.sys = site.sys();
+    rec.suppressed = site.take_suppressed();
+    rec.len = 0;
+    for (const auto& f : fields) append_field(rec, f);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+static void format_record(std::string& out, const LogRecord& rec) {
+    time_t secs = static_cast<time_t>(rec.wall_ns / 1000000000ull);
+    struct tm tm {};
+    gmtime_r(&secs, &tm);
+    char stamp[64];
+    std::snprintf(stamp, sizeof(stamp), "%04d-%02d-%02dT%02d:%02d:%02d.%06uZ",
+                  tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min,
+                  tm.tm_sec, static_cast<unsigned>(rec.wall_ns % 1000000000ull / 1000));
+    out += "ts=";
+    out += stamp;
+    out += " level=";
+    out += log_level_name(rec.level);
+    out += " sys=";
+    out += log_sys_name(rec.sys);
+    out += " msg=\"";
+    out += rec.msg;
+    out += '"';
+    out.append(rec.fields, rec.len);
+    if (rec.suppressed) {
+        // Messages from this site dropped by the rate limit since the last one
+        out += " suppressed=";
+        out += std::to_string(rec.suppressed);
+    }
+    out += '\n';
+}
+
+void Logger::drain_locked() {
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        std::lock_guard<std::mutex> lk(rings_mu_);
+        rings = rings_;
+    }
+    std::string out;
+    for (const auto& ring : rings) {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        for (uint64_t i = tail; i != head; i++)
+            format_record(out, ring->records[i & (Ring::kCapacity - 1)]);
+        ring->tail.store(head, std::memory_order_release);
+    }
+    if (!out.empty() && sink_) sink_(out);
+}
+
+void Logger::flush() {
+    std::lock_guard<std::mutex> lk(write_mu_);
+    drain_locked();
+}
+
+void Logger::writer_loop() {
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        flush();
+    }
+}
+
+void Logger::register_metrics(MetricsRegistry& metrics) {
+    metrics.counter("nfsd_log_messages_dropped_total",
+                    "Log messages dropped because the thread's log buffer was full", {},
+                    [this] { return dropped(); });
+    metrics.counter("nfsd_log_messages_suppressed_total",
+                    "Log messages dropped by per-site rate limiting", {},
+                    [this] { return suppressed(); });
+}
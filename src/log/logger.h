@@ -0,0 +1,155 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+class MetricsRegistry;
+
+// Asynchronous structured logging.
+//
+//   NFSD_LOG_WARN(LogSys::RPC, "program not registered",
+//                 {{"prog", call.program}, {"vers", call.version}});
+//
+// The calling thread checks the subsystem's level and the call site's rate
+// limit, then copies the message and fields into a record in its own
+// lock-free ring. It takes no lock and makes no system call; a background
+// thread formats and writes logfmt lines:
+//
+//   ts=2026-10-18T09:12:03.551207Z level=warn sys=rpc msg="program not registered" prog=100099 vers=1
+//
+// A full ring drops the record (counted), so logging never blocks a request.
+// Messages are string literals; anything variable goes in fields.
+
+enum class LogLevel : uint8_t { DEBUG = 0, INFO = 1, WARN = 2, ERROR = 3, OFF = 4 };
+
+enum class LogSys : uint8_t { RPC, TLS, PORTMAP, MOUNT, NFS3, NFS4, NLM, NSM, VFS, COUNT };
+constexpr size_t kLogSubsystems = static_cast<size_t>(LogSys::COUNT);
+
+const char* log_level_name(LogLevel level);
+const char* log_sys_name(LogSys sys);
+
+// One key/value pair; values are copied when the record is built
+struct LogField {
+    template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+    LogField(const char* k, T v) : key(k) {
+        if (std::is_signed<T>::value && v < 0) {
+            type = NEG;
+            u = 0 - static_cast<uint64_t>(v);
+        } else {
+            type = UINT;
+            u = static_cast<uint64_t>(v);
+        }
+    }
+    LogField(const char* k, const char* v) : key(k), type(STR), s(v ? v : ""), len(0) {
+        while (s[len]) len++;
+    }
+    LogField(const char* k, const std::string& v)
+        : key(k), type(STR), s(v.data()), len(v.size()) {}
+
+    enum Type : uint8_t { UINT, NEG, STR };
+    const char* key;
+    Type type = UINT;
+    uint64_t u = 0;
+    const char* s = nullptr;
+    size_t len = 0;
+};
+
+// Per call site: level, subsystem and rate-limit window. Declared static by
+// the NFSD_LOG macros, so each site is limited on its own.
+class LogSite {
+public:
+    constexpr LogSite(LogSys sys, LogLevel level) : sys_(sys), level_(level) {}
+
+    LogSys sys() const { return sys_; }
+    LogLevel level() const { return level_; }
+
+    // Within this second's budget? Otherwise counts the message as suppressed.
+    bool admit();
+    // Suppressed since the last admitted message (resets)
+    uint64_t take_suppressed() { return suppressed_.exchange(0, std::memory_order_relaxed); }
+
+private:
+    const LogSys sys_;
+    const LogLevel level_;
+    std::atomic<uint64_t> window_{0};  // second the count belongs to
+    std::atomic<uint32_t> count_{0};
+    std::atomic<uint64_t> suppressed_{0};
+};
+
+class Logger {
+public:
+    // Process-wide logger; never destroyed, so it can be used from any
+    // thread up to exit. Call flush() before exiting.
+    static Logger& instance();
+
+    bool enabled(LogSys sys, LogLevel level) const {
+        return static_cast<uint8_t>(level) >=
+               levels_[static_cast<size_t>(sys)].load(std::memory_order_relaxed);
+    }
+    void set_level(LogSys sys, LogLevel level);
+    void set_level(LogLevel level);  // every subsystem
+    // "warn", or "info,rpc=debug,tls=warn": a bare level sets every
+    // subsystem, sys=level one of them. False on an unknown name.
+    bool configure(const std::string& spec);
+
+    // Messages admitted per call site per second (0: unlimited; default 10)
+    void set_rate_limit(uint32_t per_second) {
+        rate_limit_.store(per_second, std::memory_order_relaxed);
+    }
+    uint32_t rate_limit() const { return rate_limit_.load(std::memory_order_relaxed); }
+
+    // Where formatted lines go (default: stderr); called on the writer thread
+    void set_sink(std::function<void(const std::string&)> sink);
+
+    void log(LogSite& site, const char* msg, std::initializer_list<LogField> fields = {});
+
+    // Write everything queued so far
+    void flush();
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+    uint64_t suppressed() const { return suppressed_.load(std::memory_order_relaxed); }
+    void count_suppressed() { suppressed_.fetch_add(1, std::memory_order_relaxed); }
+
+    // nfsd_log_messages_dropped_total / nfsd_log_messages_suppressed_total
+    void register_metrics(MetricsRegistry& metrics);
+
+    struct Ring;
+
+private:
+    Logger();
+    void writer_loop();
+    void drain_locked();
+    Ring* thread_ring();
+
+    std::atomic<uint8_t> levels_[kLogSubsystems];
+    std::atomic<uint32_t> rate_limit_{10};
+
+    std::mutex rings_mu_;  // guards rings_
+    std::vector<std::shared_ptr<Ring>> rings_;
+
+    std::mutex write_mu_;  // guards sink_ and the drain
+    std::function<void(const std::string&)> sink_;
+
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<uint64_t> suppressed_{0};
+};
+
+#define NFSD_LOG(level, sys, ...)                                            \
+    do {                                                                     \
+        static LogSite nfsd_log_site_((sys), (level));                       \
+        if (Logger::instance().enabled((sys), (level)) &&                    \
+            nfsd_log_site_.admit())                                          \
+            Logger::instance().log(nfsd_log_site_, __VA_ARGS__);             \
+    } while (0)
+
+#define NFSD_LOG_DEBUG(sys, ...) NFSD_LOG(LogLevel::DEBUG, sys, __VA_ARGS__)
+#define NFSD_LOG_INFO(sys, ...) NFSD_LOG(LogLevel::INFO, sys, __VA_ARGS__)
+#define NFSD_LOG_WARN(sys, ...) NFSD_LOG(LogLevel::WARN, sys, __VA_ARGS__)
+#define NFSD_LOG_ERROR(sys, ...) NFSD_LOG(LogLevel::ERROR, sys, __VA_ARGS__)
@@ -2,6 +2,11 @@
 // MOUNT v3, NFS v3, and NFS v4 share a single RPC server on one TCP port.
 // Optionally registers with portmapper/rpcbind on port 111.
 
+#include "log/logger.h"
+#include "rpc/rpc_handoff.h"
+#include "rpc/rpc_numa.h"
+#include "rpc/rpc_overload.h"
+#include "rpc/rpc_qos.h"
 #include "rpc/rpc_server.h"
 #include "rpc/rpc_types.h"
 #include "rpc/portmapper.h"
@@ -10,32 +15,192 @@
 #include "nfs4/nfs4_server.h"
 #include "nlm/nlm_server.h"
 #include "nlm/nlm_types.h"
+#include "stats/client_stats.h"
+#include "stats/latency_stats.h"
+#include "stats/memory_governor.h"
+#include "stats/metrics.h"
+#include "stats/metrics_server.h"
+#include "stats/profiled_mutex.h"
+#include "stats/request_tracer.h"
+#include "stats/slow_op_log.h"
 #include "vfs/local_fs.h"
+#include "vfs/fault_vfs.h"
+#include "vfs/traced_vfs.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <csignal>
+#include <cstdint>
 #include <ctime>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <vector>
 
 static volatile sig_atomic_t g_shutdown = 0;
 
+static volatile sig_atomic_t g_dump_top = 0;
+
 static void signal_handler(int) {
     g_shutdown = 1;
 }
 
+static void dump_top_handler(int) {
+    g_dump_top = 1;
+}
+
+static volatile sig_atomic_t g_reload_qos = 0;
+
+static void reload_qos_handler(int) {
+    g_reload_qos = 1;
+}
+
+static volatile sig_atomic_t g_upgrade = 0;
+
+static void upgrade_handler(int) {
+    g_upgrade = 1;
+}
+
+// "512M", "2G", "65536"
+static bool parse_bytes(const std::string& s, uint64_t& out) {
+    char* end = nullptr;
+    double v = std::strtod(s.c_str(), &end);
+    if (end == s.c_str() || v < 0) return false;
+    if (*end == 'K') v *= 1024.0, end++;
+    else if (*end == 'M') v *= 1024.0 * 1024, end++;
+    else if (*end == 'G') v *= 1024.0 * 1024 * 1024, end++;
+    out = static_cast<uint64_t>(v);
+    return *end == '\0';
+}
+
+static bool write_all(int fd, const uint8_t* p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// One QosPolicy spec per line; blank lines and lines starting with '#'
+// are skipped
+static bool load_qos_file(const std::string& path, std::vector<QosPolicy>& out,
+                          std::string& err) {
+    std::ifstream in(path);
+    if (!in) {
+        err = "cannot open " + path;
+        return false;
+    }
+    std::string line;
+    for (int n = 1; std::getline(in, line); n++) {
+        size_t b = line.find_first_not_of(" \t");
+        if (b == std::string::npos || line[b] == '#') continue;
+        size_t e = line.find_last_not_of(" \t\r");
+        QosPolicy policy;
+        if (!QosPolicy::parse(line.substr(b, e - b + 1), policy, err)) {
+            err = path + ":" + std::to_string(n) + ": " + err;
+            return false;
+        }
+        out.push_back(std::move(policy));
+    }
+    return true;
+}
+
+// Rows per ranking in the top-talker report and /metrics
+static const size_t kTopTalkers = 10;
+
+static const char* const kDefaultMetricsSocket = "/run/nfsd-metrics.sock";
+
+// Warm restart: handle-cache entries kept across a restart, and the threads
+// checking them at startup (lstat-bound, so more than the cores)
+static const size_t kWarmEntries = 1 << 18;
+static const unsigned kWarmThreads = 8;
+
 static void print_usage(const char* prog) {
     std::cerr << "Usage: " << prog << " --export <path> [--port <port>] [--tls-cert <pem> --tls-key <pem>]\n"
+              << "       " << prog << " --stats [--metrics-socket <path>]\n"
               << "  --export <path>     Directory to export via NFS (required)\n"
               << "  --port <port>       TCP port to listen on (default: 2049)\n"
               << "  --tls-cert <path>   TLS certificate file (PEM)\n"
-              << "  --tls-key <path>    TLS private key file (PEM, unencrypted)\n";
+              << "  --tls-key <path>    TLS private key file (PEM, unencrypted)\n"
+              << "  --metrics-socket <path>  Metrics endpoint Unix socket (default: "
+              << kDefaultMetricsSocket << ")\n"
+              << "  --metrics-port <port>    Also serve metrics on 127.0.0.1:<port>\n"
+              << "  --slow-op-ms <ms>   Log calls taking at least <ms> milliseconds\n"
+              << "  --slow-op-log <path> Slow-op log file (default: stderr)\n"
+              << "  --trace-out <path>  Write sampled request timelines (Chrome trace JSON)\n"
+              << "  --trace-sample <n>  Trace 1 in <n> calls (default: 1000; 0: none)\n"
+              << "  --trace-client <s>  Also trace every call from clients matching <s>\n"
+              << "  --capture <path>    Copy every RPC record received to a trace file\n"
+              << "                      for bench/nfsreplay\n"
+              << "  --capture-replies   Capture replies too (needed to remap file handles)\n"
+              << "  --capture-max-mb <n> Stop capturing when the file reaches <n> MiB\n"
+              << "  --fault <rule>      Inject latency, stalls, errors or a bandwidth cap\n"
+              << "                      into VFS calls (repeatable; see vfs/fault_vfs.h),\n"
+              << "                      e.g. op=read+write,prefix=/db,latency=exp:2ms\n"
+              << "  --qos <policy>      Limit ops/s and bytes/s per client, uid or export;\n"
+              << "                      calls over the limit wait (repeatable; see\n"
+              << "                      rpc/rpc_qos.h), e.g. scope=client,iops=500,bw=50M\n"
+              << "  --qos-file <path>   More policies, one per line; re-read on SIGHUP\n"
+              << "  --overload-target-ms <ms> Answer expensive calls JUKEBOX/DELAY while\n"
+              << "                      calls keep queueing longer than <ms> (default: off)\n"
+              << "  --overload-interval-ms <ms> How long the queue must stay above the\n"
+              << "                      target (default: 100)\n"
+              << "  --numa <mode>       Keep each connection's thread and buffers on one\n"
+              << "                      NUMA node: auto (on machines with several nodes),\n"
+              << "                      on, or off (default: auto)\n"
+              << "  --warm-state <path> Keep the hottest file handles across restarts: save\n"
+              << "                      them to <path> at shutdown, reload them at startup\n"
+              << "  --upgrade-fd <fd>   Take over from a running server (which starts its\n"
+              << "                      successor this way on SIGUSR2)\n"
+              << "  --mem-budget <size> Memory budget of the server's caches, e.g. 512M;\n"
+              << "                      they give memory back when over it\n"
+              << "  --mem-weight <name>=<n> Share weight of a cache (default 1; see\n"
+              << "                      nfsd_memory_bytes for the names)\n"
+              << "  --mem-psi <pct>     Shrink caches while memory PSI some avg10 is at\n"
+              << "                      least <pct> (default: 10 with --mem-budget, else\n"
+              << "                      off; 0: ignore pressure)\n"
+              << "  --log-level <spec>  Log level, e.g. info or warn,rpc=debug (default: info)\n"
+              << "  --log-rate <n>      Messages per second per log site (default: 10; 0: no limit)\n"
+              << "  --lock-stats        Record wait and hold times of the server's\n"
+              << "                      global locks (nfsd_lock_* metrics)\n"
+              << "  --stats             Print a running server's statistics in\n"
+              << "                      /proc/net/rpc/nfsd format and exit\n";
 }
 
 int main(int argc, char* argv[]) {
     std::string export_path;
     std::string tls_cert, tls_key;
     uint16_t port = 2049;
+    std::string metrics_socket = kDefaultMetricsSocket;
+    int metrics_port = 0;
+    bool print_stats = false;
+    double slow_op_ms = 0;
+    std::string slow_op_path;
+    bool lock_stats = false;
+    std::string trace_path, trace_client;
+    long trace_sample = 1000;
+    std::string capture_path;
+    bool capture_replies = false;
+    long capture_max_mb = 0;
+    std::vector<FaultRule> fault_rules;
+    std::vector<QosPolicy> qos_policies;
+    std::string qos_file;
+    double overload_target_ms = 0;
+    double overload_interval_ms = 100;
+    std::string numa_mode = "auto";
+    std::string warm_state;
+    int upgrade_fd = -1;
+    const std::vector<std::string> args(argv, argv + argc);
+    uint64_t mem_budget = 0;
+    std::map<std::string, uint32_t> mem_weights;
+    double mem_psi = -1;  // unset: 10 with a budget, else off
 
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
@@ -52,6 +217,118 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
             port = static_cast<uint16_t>(p);
+        } else if (arg == "--metrics-socket" && i + 1 < argc) {
+            metrics_socket = argv[++i];
+        } else if (arg == "--metrics-port" && i + 1 < argc) {
+            metrics_port = std::stoi(argv[++i]);
+            if (metrics_port < 1 || metrics_port > 65535) {
+                std::cerr << "Error: metrics port must be 1-65535\n";
+                return 1;
+            }
+        } else if (arg == "--slow-op-ms" && i + 1 < argc) {
+            slow_op_ms = std::stod(argv[++i]);
+            if (slow_op_ms <= 0) {
+                std::cerr << "Error: slow-op threshold must be positive\n";
+                return 1;
+            }
+        } else if (arg == "--slow-op-log" && i + 1 < argc) {
+            slow_op_path = argv[++i];
+        } else if (arg == "--trace-out" && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (arg == "--trace-sample" && i + 1 < argc) {
+            trace_sample = std::stol(argv[++i]);
+            if (trace_sample < 0 || trace_sample > UINT32_MAX) {
+                std::cerr << "Error: trace sample rate must be 0-" << UINT32_MAX << "\n";
+                return 1;
+            }
+        } else if (arg == "--trace-client" && i + 1 < argc) {
+            trace_client = argv[++i];
+        } else if (arg == "--capture" && i + 1 < argc) {
+            capture_path = argv[++i];
+        } else if (arg == "--capture-replies") {
+            capture_replies = true;
+        } else if (arg == "--capture-max-mb" && i + 1 < argc) {
+            capture_max_mb = std::stol(argv[++i]);
+            if (capture_max_mb < 0) {
+                std::cerr << "Error: capture size limit must not be negative\n";
+                return 1;
+            }
+        } else if (arg == "--fault" && i + 1 < argc) {
+            FaultRule rule;
+            std::string err;
+            if (!FaultRule::parse(argv[++i], rule, err)) {
+                std::cerr << "Error: bad fault rule " << argv[i] << ": " << err << "\n";
+                return 1;
+            }
+            fault_rules.push_back(rule);
+        } else if (arg == "--qos" && i + 1 < argc) {
+            QosPolicy policy;
+            std::string err;
+            if (!QosPolicy::parse(argv[++i], policy, err)) {
+                std::cerr << "Error: bad QoS policy " << argv[i] << ": " << err << "\n";
+                return 1;
+            }
+            qos_policies.push_back(policy);
+        } else if (arg == "--qos-file" && i + 1 < argc) {
+            qos_file = argv[++i];
+        } else if (arg == "--overload-target-ms" && i + 1 < argc) {
+            overload_target_ms = std::stod(argv[++i]);
+            if (overload_target_ms < 0) {
+                std::cerr << "Error: overload target must not be negative\n";
+                return 1;
+            }
+        } else if (arg == "--overload-interval-ms" && i + 1 < argc) {
+            overload_interval_ms = std::stod(argv[++i]);
+            if (overload_interval_ms <= 0) {
+                std::cerr << "Error: overload interval must be positive\n";
+                return 1;
+            }
+        } else if (arg == "--numa" && i + 1 < argc) {
+            numa_mode = argv[++i];
+            if (numa_mode != "auto" && numa_mode != "on" && numa_mode != "off") {
+                std::cerr << "Error: --numa takes auto, on or off\n";
+                return 1;
+            }
+        } else if (arg == "--warm-state" && i + 1 < argc) {
+            warm_state = argv[++i];
+        } else if (arg == "--upgrade-fd" && i + 1 < argc) {
+            upgrade_fd = std::stoi(argv[++i]);
+        } else if (arg == "--mem-budget" && i + 1 < argc) {
+            if (!parse_bytes(argv[++i], mem_budget)) {
+                std::cerr << "Error: bad memory budget " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--mem-weight" && i + 1 < argc) {
+            std::string spec = argv[++i];
+            size_t eq = spec.find('=');
+            long w = eq == std::string::npos ? 0 : std::atol(spec.c_str() + eq + 1);
+            if (eq == 0 || w < 1 || w > 1000000) {
+                std::cerr << "Error: bad memory weight " << spec << " (want <name>=<1-1000000>)\n";
+                return 1;
+            }
+            mem_weights[spec.substr(0, eq)] = static_cast<uint32_t>(w);
+        } else if (arg == "--mem-psi" && i + 1 < argc) {
+            mem_psi = std::stod(argv[++i]);
+            if (mem_psi < 0 || mem_psi > 100) {
+                std::cerr << "Error: PSI threshold must be 0-100\n";
+                return 1;
+            }
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            if (!Logger::instance().configure(argv[++i])) {
+                std::cerr << "Error: bad log level spec " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--log-rate" && i + 1 < argc) {
+            long rate = std::stol(argv[++i]);
+            if (rate < 0 || rate > UINT32_MAX) {
+                std::cerr << "Error: log rate must be 0-" << UINT32_MAX << "\n";
+                return 1;
+            }
+            Logger::instance().set_rate_limit(static_cast<uint32_t>(rate));
+        } else if (arg == "--lock-stats") {
+            lock_stats = true;
+        } else if (arg == "--stats") {
+            print_stats = true;
         } else if (arg == "--help" || arg == "-h") {
             print_usage(argv[0]);
             return 0;
@@ -62,6 +339,16 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (print_stats) {
+        std::string body;
+        if (!metrics_fetch_unix(metrics_socket, "/nfsd", body)) {
+            std::cerr << "Error: no server answering on " << metrics_socket << "\n";
+            return 1;
+        }
+        std::cout << body;
+        return 0;
+    }
+
     if (export_path.empty()) {
         std::cerr << "Error: --export is required\n";
         print_usage(argv[0]);
@@ -70,17 +357,199 @@ int main(int argc, char* argv[]) {
 
     std::signal(SIGINT, signal_handler);
     std::signal(SIGTERM, signal_handler);
+    std::signal(SIGUSR1, dump_top_handler);
+    std::signal(SIGHUP, reload_qos_handler);
+    std::signal(SIGUSR2, upgrade_handler);
+
+    // Before any server thread takes a profiled lock
+    ProfiledMutex::set_enabled(lock_stats);
 
     try {
-        LocalFs vfs(export_path);
+        // Declared first: components register read callbacks into it
+        MetricsRegistry metrics;
+
+        LocalFs local_fs(export_path);
+        // Checked in the background while the server starts serving; a
+        // handle asked for first is checked on the spot
+        if (!warm_state.empty() && upgrade_fd < 0) {
+            std::string err;
+            if (!std::ifstream(warm_state).good())
+                std::cout << "  Warm state: none yet, saving to " << warm_state << "\n";
+            else if (local_fs.load_snapshot(warm_state, kWarmThreads, err))
+                std::cout << "  Warm state: " << local_fs.warm_entries()
+                          << " file handles from " << warm_state << "\n";
+            else
+                std::cerr << "  Warning: cannot load warm state " << err << "\n";
+        }
+        // Degraded-storage simulation, only in the stack when asked for
+        FaultVfs fault_vfs(local_fs);
+        for (const auto& rule : fault_rules) fault_vfs.add_rule(rule);
+        fault_vfs.set_path_resolver([&local_fs, &export_path](const FileHandle& fh) {
+            std::string path = local_fs.path_of(fh);
+            if (path.compare(0, export_path.size(), export_path) != 0) return std::string();
+            path.erase(0, export_path.size());
+            return path.empty() ? std::string("/") : path;
+        });
+        // Charges VFS time to the slow-op trace of the current call
+        TracedVfs vfs(fault_vfs.empty() ? static_cast<Vfs&>(local_fs) : fault_vfs);
         std::vector<std::string> exports = {export_path};
 
         MountServer mount_srv(vfs, exports);
         NfsServer nfs_srv(vfs);
         Nfs4Server nfs4_srv(vfs, export_path);
-        NlmServer nlm_srv(nfs4_srv.lock_table(), nfs4_srv.lock_mutex());
+        NlmServer nlm_srv(nfs4_srv.lock_table());
+
+        // Always on: per-thread recording is cheap enough for production
+        LatencyStats latency_stats;
+        nfs4_srv.set_latency_stats(&latency_stats);
+
+        // Fixed memory however many clients connect
+        ClientStats client_stats;
+
+        // Declared before the server: its connections hold the pools' buffers
+        std::unique_ptr<NumaPlacement> numa;
+        if (numa_mode != "off") {
+            NumaTopology topology = NumaTopology::discover();
+            if (numa_mode == "on" || topology.nodes() > 1)
+                numa = std::make_unique<NumaPlacement>(std::move(topology));
+        }
 
         RpcServer rpc;
+        rpc.set_latency_stats(&latency_stats);
+        rpc.set_client_stats(&client_stats, export_path);
+
+        std::unique_ptr<SlowOpLog> slow_op_log;
+        if (slow_op_ms > 0) {
+            slow_op_log = std::make_unique<SlowOpLog>(
+                static_cast<uint64_t>(slow_op_ms * 1e6), slow_op_path);
+            if (!slow_op_log->open()) {
+                std::cerr << "Error: cannot open slow-op log " << slow_op_path << "\n";
+                return 1;
+            }
+            slow_op_log->set_path_resolver(
+                [&local_fs](const FileHandle& fh) { return local_fs.path_of(fh); });
+            rpc.set_slow_op_log(slow_op_log.get());
+            std::cout << "  Slow-op log: >= " << slow_op_ms << " ms to "
+                      << (slow_op_path.empty() ? "stderr" : slow_op_path) << "\n";
+        }
+
+        std::unique_ptr<RequestTracer> tracer;
+        if (!trace_path.empty()) {
+            tracer = std::make_unique<RequestTracer>(
+                trace_path, static_cast<uint32_t>(trace_sample), trace_client);
+            if (!tracer->open()) {
+                std::cerr << "Error: cannot open trace file " << trace_path << "\n";
+                return 1;
+            }
+            rpc.set_request_tracer(tracer.get());
+            std::cout << "  Tracing: "
+                      << (trace_sample ? "1 in " + std::to_string(trace_sample) + " calls"
+                                       : std::string("no sampling"))
+                      << (trace_client.empty() ? "" : ", all from " + trace_client)
+                      << " to " << trace_path << "\n";
+        }
+
+        std::unique_ptr<RpcCapture> capture;
+        if (!capture_path.empty()) {
+            capture = std::make_unique<RpcCapture>(
+                capture_path, capture_replies, 64 << 20,
+                static_cast<uint64_t>(capture_max_mb) << 20);
+            if (!capture->open()) {
+                std::cerr << "Error: cannot open capture file " << capture_path << "\n";
+                return 1;
+            }
+            rpc.set_capture(capture.get());
+            capture->register_metrics(metrics);
+            std::cout << "  Capture: " << (capture_replies ? "calls and replies" : "calls")
+                      << " to " << capture_path << "\n";
+        }
+
+        // Policies from the command line stay; the file's are replaced on SIGHUP
+        RpcQos qos;
+        auto load_qos = [&]() {
+            std::vector<QosPolicy> policies = qos_policies;
+            std::string err;
+            if (!qos_file.empty() && !load_qos_file(qos_file, policies, err)) {
+                std::cerr << "Error: " << err << "\n";
+                return false;
+            }
+            qos.set_policies(std::move(policies));
+            return true;
+        };
+        if (!load_qos()) return 1;
+        rpc.set_qos(&qos);
+        qos.register_metrics(metrics);
+        if (qos.active() || !qos_file.empty())
+            std::cout << "  QoS: " << qos.policy_count() << " polic"
+                      << (qos.policy_count() == 1 ? "y" : "ies")
+                      << (qos_file.empty() ? "" : ", reloaded from " + qos_file + " on SIGHUP")
+                      << "\n";
+
+        std::unique_ptr<OverloadControl> overload;
+        if (overload_target_ms > 0) {
+            overload = std::make_unique<OverloadControl>(
+                static_cast<uint64_t>(overload_target_ms * 1e6),
+                static_cast<uint64_t>(overload_interval_ms * 1e6));
+            rpc.set_overload_control(overload.get());
+            overload->register_metrics(metrics);
+            std::cout << "  Overload control: shedding while calls queue over "
+                      << overload_target_ms << " ms for " << overload_interval_ms << " ms\n";
+        }
+
+        if (numa) {
+            rpc.set_numa(numa.get());
+            numa->register_metrics(metrics);
+            std::cout << "  NUMA: connections placed on " << numa->topology().nodes() << " node"
+                      << (numa->topology().nodes() == 1 ? "" : "s")
+                      << ", buffers from hugepage pools\n";
+        }
+
+        if (!fault_vfs.empty()) {
+            fault_vfs.register_metrics(metrics);
+            std::cout << "  Faults: " << fault_rules.size() << " rule"
+                      << (fault_rules.size() == 1 ? "" : "s") << " on VFS calls\n";
+        }
+
+        // Caches register what they hold; the reclaimable ones split the
+        // budget by weight. The connections' request arenas, which trim
+        // themselves, and the NUMA pools' free chunks, kept for the next
+        // connection, are counted but never reclaimed.
+        MemoryGovernor governor(mem_budget);
+        auto weight = [&mem_weights](const char* name) {
+            auto it = mem_weights.find(name);
+            if (it == mem_weights.end()) return 1u;
+            uint32_t w = it->second;
+            mem_weights.erase(it);
+            return w;
+        };
+        governor.add("fh_cache", weight("fh_cache"),
+                     [&local_fs] { return local_fs.cache_bytes(); },
+                     [&local_fs](uint64_t bytes) { return local_fs.trim_cache(bytes); });
+        governor.add("rpc_arena", weight("rpc_arena"), [&rpc] { return rpc.arena_bytes(); });
+        if (numa)
+            governor.add("numa_pool", weight("numa_pool"), [&numa] { return numa->idle_bytes(); });
+        governor.add("qos", weight("qos"), [&qos] { return qos.memory_bytes(); },
+                     [&qos](uint64_t bytes) { return qos.reclaim(bytes, LatencyStats::now_ns()); });
+        if (capture)
+            governor.add("capture", weight("capture"),
+                         [&capture] { return capture->memory_bytes(); },
+                         [&capture](uint64_t) { return capture->trim(); });
+        for (const auto& [name, w] : mem_weights)
+            std::cerr << "  Warning: --mem-weight " << name << ": no such cache\n";
+        if (mem_psi < 0) mem_psi = mem_budget ? 10 : 0;
+        std::string psi_path = mem_psi > 0 ? MemoryGovernor::default_psi_path() : std::string();
+        governor.set_pressure(psi_path, mem_psi);
+        governor.register_metrics(metrics);
+        if (mem_budget || !psi_path.empty()) {
+            std::cout << "  Memory: ";
+            if (mem_budget)
+                std::cout << (mem_budget >> 20) << " MiB budget";
+            else
+                std::cout << "no budget";
+            if (!psi_path.empty())
+                std::cout << ", shrinking at " << mem_psi << "% pressure (" << psi_path << ")";
+            std::cout << "\n";
+        }
 
         // RFC 9289 — Optional TLS support
         if (!tls_cert.empty() && !tls_key.empty()) {
@@ -89,6 +558,7 @@ int main(int argc, char* argv[]) {
                 rpc.set_tls_context(std::move(tls_ctx));
                 std::cout << "  TLS:    enabled (cert=" << tls_cert << ")\n";
             } else {
+                Logger::instance().flush();  // the reason, logged by RpcTlsContext
                 std::cerr << "  Warning: TLS context invalid, continuing without TLS\n";
             }
         }
@@ -97,27 +567,141 @@ int main(int argc, char* argv[]) {
         rpc.register_program(NFS_PROGRAM, NFS_V3, nfs_srv.get_handlers());
         rpc.register_program(NFS_PROGRAM, NFS_V4, nfs4_srv.get_handlers());
         rpc.register_program(NLM_PROGRAM, NLM_V4, nlm_srv.get_handlers());
+        rpc.set_backchannel_reply_handler([&nfs4_srv](const uint8_t* data, size_t len) {
+            nfs4_srv.backchannel_reply(data, len);
+        });
+
+        rpc.register_metrics(metrics);
+        nfs_srv.register_metrics(metrics);
+        nfs4_srv.register_metrics(metrics);
+        nlm_srv.register_metrics(metrics);
+        local_fs.register_metrics(metrics);
+        Logger::instance().register_metrics(metrics);
+        metrics.add_client_stats(&client_stats, kTopTalkers);
+        client_stats.register_metrics(metrics);
+
+        // State carried over by a binary upgrade (SIGUSR2); the write
+        // verifiers go with it, so clients keep their unstable writes
+        RpcHandoff handoff;
+        handoff.add_state(
+            "nfs3", [&nfs_srv](XdrEncoder& enc) { nfs_srv.save_state(enc); },
+            [&nfs_srv](XdrDecoder& dec) { return nfs_srv.restore_state(dec); });
+        handoff.add_state(
+            "nfs4", [&nfs4_srv](XdrEncoder& enc) { nfs4_srv.save_state(enc); },
+            [&nfs4_srv](XdrDecoder& dec) { return nfs4_srv.restore_state(dec); });
+        handoff.add_state(
+            "nlm", [&nlm_srv](XdrEncoder& enc) { nlm_srv.save_state(enc); },
+            [&nlm_srv](XdrDecoder& dec) { return nlm_srv.restore_state(dec); });
+        handoff.add_state(
+            "fh_cache",
+            [&local_fs](XdrEncoder& enc) {
+                std::string snap = local_fs.encode_snapshot(kWarmEntries);
+                enc.encode_opaque(snap.data(), snap.size());
+            },
+            [&local_fs](XdrDecoder& dec) {
+                std::vector<uint8_t> snap = dec.decode_opaque();
+                int fd = memfd_create("nfsd-fh-cache", MFD_CLOEXEC);
+                std::string err;
+                bool ok = fd >= 0 && write_all(fd, snap.data(), snap.size()) &&
+                          local_fs.load_snapshot_fd(fd, kWarmThreads, err);
+                if (fd >= 0) close(fd);
+                return ok;
+            });
+        if (upgrade_fd >= 0) {
+            std::string err;
+            if (!handoff.receive(upgrade_fd, err)) {
+                std::cerr << "Error: upgrade: " << err << "\n";
+                return 1;
+            }
+            std::cout << "  Upgrade: took over " << handoff.connections()
+                      << " connections and the state of the running server\n";
+        }
+
+        // Declared after every registered component so it stops first
+        MetricsServer metrics_srv(metrics);
+        auto listen_metrics = [&]() {
+            if (!metrics_socket.empty()) {
+                if (metrics_srv.listen_unix(metrics_socket))
+                    std::cout << "  Metrics: unix:" << metrics_socket << "\n";
+                else
+                    std::cerr << "  Warning: cannot listen on " << metrics_socket << "\n";
+            }
+            if (metrics_port > 0) {
+                if (metrics_srv.listen_tcp(static_cast<uint16_t>(metrics_port)))
+                    std::cout << "  Metrics: http://127.0.0.1:" << metrics_port << "/metrics\n";
+                else
+                    std::cerr << "  Warning: cannot listen on metrics port " << metrics_port
+                              << "\n";
+            }
+            metrics_srv.start();
+        };
+        listen_metrics();
 
         std::cout << "NFS server starting...\n"
                   << "  Export: " << export_path << "\n"
                   << "  Port:   " << port << "\n";
 
-        rpc.start(port);
+        if (upgrade_fd >= 0)
+            handoff.serve(rpc);
+        else
+            rpc.start(port);
+        governor.start();
         pmap_register_all(port);
 
         // Wait for shutdown signal (async-signal-safe polling)
-        while (!g_shutdown) {
+        bool upgraded = false;
+        while (!g_shutdown && !upgraded) {
             struct timespec ts = {0, 100000000}; // 100ms
             nanosleep(&ts, nullptr);
+            if (g_dump_top) {
+                g_dump_top = 0;
+                std::cerr << client_stats.report(kTopTalkers);
+                if (qos.active()) std::cerr << qos.report(kTopTalkers);
+            }
+            if (g_reload_qos) {
+                g_reload_qos = 0;
+                if (load_qos())
+                    NFSD_LOG_INFO(LogSys::RPC, "QoS policies reloaded",
+                                  {{"policies", qos.policy_count()}});
+                else
+                    NFSD_LOG_WARN(LogSys::RPC, "QoS reload failed, keeping the old policies",
+                                  {{"file", qos_file}});
+            }
+            if (g_upgrade) {
+                g_upgrade = 0;
+                // The metrics endpoint is the new process's from the hand-off
+                std::string err;
+                upgraded = handoff.upgrade(
+                    rpc, args, [&metrics_srv] { metrics_srv.stop(); }, listen_metrics, err);
+                if (!upgraded)
+                    NFSD_LOG_WARN(LogSys::RPC, "Upgrade failed, still serving",
+                                  {{"error", err}});
+            }
         }
 
-        pmap_unregister_all();
+        // After an upgrade the new process serves: the portmapper entries
+        // and the warm state are its
+        if (!upgraded) pmap_unregister_all();
+        metrics_srv.stop();
         rpc.stop();
+        governor.stop();
+
+        if (!warm_state.empty() && !upgraded) {
+            std::string err;
+            if (local_fs.save_snapshot(warm_state, kWarmEntries, err))
+                NFSD_LOG_INFO(LogSys::VFS, "Warm state saved",
+                              {{"file", warm_state},
+                               {"handles", std::min(local_fs.cache_footprint().entries, kWarmEntries)}});
+            else
+                NFSD_LOG_WARN(LogSys::VFS, "Cannot save warm state", {{"error", err}});
+        }
 
     } catch (const std::exception& e) {
+        Logger::instance().flush();
         std::cerr << "Fatal: " << e.what() << "\n";
         return 1;
     }
 
+    Logger::instance().flush();
     return 0;
 }
@@ -44,7 +44,7 @@ void MountServer::proc_mnt(const RpcCallHeader&, XdrDecoder& args, XdrEncoder& r
 
     reply.encode_uint32(static_cast<uint32_t>(MountStat3::MNT3_OK));
     // File handle as variable-length opaque
-    reply.encode_opaque(fh.data, fh.len);
+    reply.encode_opaque(fh.data(), fh.size());
     // Auth flavors: just AUTH_SYS
     reply.encode_uint32(1); // count
     reply.encode_uint32(static_cast<uint32_t>(RpcAuthFlavor::AUTH_SYS));
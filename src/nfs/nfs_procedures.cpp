@@ -12,7 +12,7 @@ static bool decode_auth_sys(const RpcOpaqueAuth& cred,
     try {
         XdrDecoder dec(cred.body.data(), cred.body.size());
         dec.decode_uint32();   // stamp
-        dec.decode_string();   // machinename
+        dec.skip(dec.decode_uint32());  // machinename
         uid = dec.decode_uint32();
         gid = dec.decode_uint32();
         return true;
@@ -115,7 +115,7 @@ void NfsServer::proc_lookup(const RpcCallHeader&, XdrDecoder& args, XdrEncoder&
     NfsStat3 status = vfs_.lookup(dir_fh, name, out_fh, out_attr);
     reply.encode_uint32(static_cast<uint32_t>(status));
     if (status == NfsStat3::NFS3_OK) {
-        reply.encode_opaque(out_fh.data, out_fh.len);
+        reply.encode_opaque(out_fh.data(), out_fh.size());
         // post_op_attr for object
         reply.encode_bool(true);
         encode_fattr3(reply, out_attr);
@@ -176,6 +176,7 @@ void NfsServer::proc_read(const RpcCallHeader& call, XdrDecoder& args, XdrEncode
     reply.encode_uint32(static_cast<uint32_t>(status));
     encode_post_op_attr(reply, fh);
     if (status == NfsStat3::NFS3_OK) {
+        bytes_read_.fetch_add(data.size(), std::memory_order_relaxed);
         reply.encode_uint32(static_cast<uint32_t>(data.size())); // count
         reply.encode_bool(eof);
         reply.encode_opaque(data.data(), data.size());
@@ -205,6 +206,7 @@ void NfsServer::proc_write(const RpcCallHeader&, XdrDecoder& args, XdrEncoder& r
     reply.encode_uint32(static_cast<uint32_t>(status));
     encode_wcc_data(reply, fh, have_pre ? &pre : nullptr);
     if (status == NfsStat3::NFS3_OK) {
+        bytes_written_.fetch_add(written, std::memory_order_relaxed);
         reply.encode_uint32(written);
         reply.encode_uint32(stable); // echo back requested stability
         reply.encode_uint64(write_verifier_);
@@ -245,13 +247,13 @@ void NfsServer::proc_create(const RpcCallHeader&, XdrDecoder& args, XdrEncoder&
         FileHandle existing_fh;
         Fattr3 existing_attr;
         if (vfs_.lookup(dir_fh, name, existing_fh, existing_attr) == NfsStat3::NFS3_OK) {
-            std::lock_guard<std::mutex> lock(excl_mu_);
+            std::lock_guard<ProfiledMutex> lock(excl_mu_);
             auto it = excl_verifiers_.find(existing_fh);
             if (it != excl_verifiers_.end() && it->second == excl_verf) {
                 // Same verifier: idempotent re-creation, return existing handle
                 reply.encode_uint32(0u);
                 reply.encode_bool(true);
-                reply.encode_opaque(existing_fh.data, existing_fh.len);
+                reply.encode_opaque(existing_fh.data(), existing_fh.size());
                 reply.encode_bool(true);
                 encode_fattr3(reply, existing_attr);
                 encode_wcc_data(reply, dir_fh, have_pre ? &dir_pre : nullptr);
@@ -269,13 +271,13 @@ void NfsServer::proc_create(const RpcCallHeader&, XdrDecoder& args, XdrEncoder&
     Fattr3 out_attr;
     NfsStat3 status = vfs_.create(dir_fh, name, mode, out_fh, out_attr);
     if (status == NfsStat3::NFS3_OK && createmode == EXCLUSIVE) {
-        std::lock_guard<std::mutex> lock(excl_mu_);
+        std::lock_guard<ProfiledMutex> lock(excl_mu_);
         excl_verifiers_[out_fh] = excl_verf;
     }
     reply.encode_uint32(static_cast<uint32_t>(status));
     if (status == NfsStat3::NFS3_OK) {
         reply.encode_bool(true);
-        reply.encode_opaque(out_fh.data, out_fh.len);
+        reply.encode_opaque(out_fh.data(), out_fh.size());
         reply.encode_bool(true);
         encode_fattr3(reply, out_attr);
     }
@@ -299,7 +301,7 @@ void NfsServer::proc_mkdir(const RpcCallHeader&, XdrDecoder& args, XdrEncoder& r
     reply.encode_uint32(static_cast<uint32_t>(status));
     if (status == NfsStat3::NFS3_OK) {
         reply.encode_bool(true);
-        reply.encode_opaque(out_fh.data, out_fh.len);
+        reply.encode_opaque(out_fh.data(), out_fh.size());
         reply.encode_bool(true);
         encode_fattr3(reply, out_attr);
     }
@@ -322,7 +324,7 @@ void NfsServer::proc_symlink(const RpcCallHeader&, XdrDecoder& args, XdrEncoder&
     reply.encode_uint32(static_cast<uint32_t>(status));
     if (status == NfsStat3::NFS3_OK) {
         reply.encode_bool(true);
-        reply.encode_opaque(out_fh.data, out_fh.len);
+        reply.encode_opaque(out_fh.data(), out_fh.size());
         reply.encode_bool(true);
         encode_fattr3(reply, out_attr);
     }
@@ -367,7 +369,7 @@ void NfsServer::proc_mknod(const RpcCallHeader&, XdrDecoder& args, XdrEncoder& r
     if (status == NfsStat3::NFS3_OK) {
         // post_op_fh3
         reply.encode_bool(true);
-        reply.encode_opaque(out_fh.data, out_fh.len);
+        reply.encode_opaque(out_fh.data(), out_fh.size());
         // post_op_attr
         reply.encode_bool(true);
         encode_fattr3(reply, out_attr);
@@ -515,7 +517,7 @@ void NfsServer::proc_readdirplus(const RpcCallHeader&, XdrDecoder& args, XdrEnco
                 reply.encode_bool(true);
                 encode_fattr3(reply, entry_attr);
                 reply.encode_bool(true);
-                reply.encode_opaque(entry_fh.data, entry_fh.len);
+                reply.encode_opaque(entry_fh.data(), entry_fh.size());
             } else {
                 reply.encode_bool(false);
                 reply.encode_bool(false);
@@ -1,5 +1,6 @@
 #include "nfs/nfs_server.h"
 #include "nfs/nfs_types.h"
+#include "rpc/rpc_overload.h"
 #include <chrono>
 
 NfsServer::NfsServer(Vfs& vfs) : vfs_(vfs) {
@@ -15,39 +16,88 @@ RpcProgramHandlers NfsServer::get_handlers() {
         };
     };
 
+    // Under overload (RpcCallHeader::overload) the expensive procedures
+    // answer NFS3ERR_JUKEBOX (RFC 1813 §2.6) without touching the VFS.
+    // fail_words: their resfail body, every optional attribute absent.
+    auto sheddable = [](RpcProcedureHandler fn, uint32_t fail_words) {
+        return [fn, fail_words](const RpcCallHeader& c, XdrDecoder& a, XdrEncoder& r) {
+            if (!c.overload) return fn(c, a, r);
+            r.encode_uint32(static_cast<uint32_t>(NfsStat3::NFS3ERR_JUKEBOX));
+            for (uint32_t i = 0; i < fail_words; i++) r.encode_bool(false);
+            c.overload->shed(NFS_V3);
+        };
+    };
+
     h.procedures[NFSPROC3_NULL]        = bind(&NfsServer::proc_null);
     h.procedures[NFSPROC3_GETATTR]     = bind(&NfsServer::proc_getattr);
-    h.procedures[NFSPROC3_SETATTR]     = bind(&NfsServer::proc_setattr);
+    h.procedures[NFSPROC3_SETATTR]     = sheddable(bind(&NfsServer::proc_setattr), 2);
     h.procedures[NFSPROC3_LOOKUP]      = bind(&NfsServer::proc_lookup);
     h.procedures[NFSPROC3_ACCESS]      = bind(&NfsServer::proc_access);
     h.procedures[NFSPROC3_READLINK]    = bind(&NfsServer::proc_readlink);
-    h.procedures[NFSPROC3_READ]        = bind(&NfsServer::proc_read);
-    h.procedures[NFSPROC3_WRITE]       = bind(&NfsServer::proc_write);
-    h.procedures[NFSPROC3_CREATE]      = bind(&NfsServer::proc_create);
-    h.procedures[NFSPROC3_MKDIR]       = bind(&NfsServer::proc_mkdir);
-    h.procedures[NFSPROC3_SYMLINK]     = bind(&NfsServer::proc_symlink);
-    h.procedures[NFSPROC3_MKNOD]       = bind(&NfsServer::proc_mknod);
-    h.procedures[NFSPROC3_REMOVE]      = bind(&NfsServer::proc_remove);
-    h.procedures[NFSPROC3_RMDIR]       = bind(&NfsServer::proc_rmdir);
-    h.procedures[NFSPROC3_RENAME]      = bind(&NfsServer::proc_rename);
-    h.procedures[NFSPROC3_LINK]        = bind(&NfsServer::proc_link);
-    h.procedures[NFSPROC3_READDIR]     = bind(&NfsServer::proc_readdir);
-    h.procedures[NFSPROC3_READDIRPLUS] = bind(&NfsServer::proc_readdirplus);
+    h.procedures[NFSPROC3_READ]        = sheddable(bind(&NfsServer::proc_read), 1);
+    h.procedures[NFSPROC3_WRITE]       = sheddable(bind(&NfsServer::proc_write), 2);
+    h.procedures[NFSPROC3_CREATE]      = sheddable(bind(&NfsServer::proc_create), 2);
+    h.procedures[NFSPROC3_MKDIR]       = sheddable(bind(&NfsServer::proc_mkdir), 2);
+    h.procedures[NFSPROC3_SYMLINK]     = sheddable(bind(&NfsServer::proc_symlink), 2);
+    h.procedures[NFSPROC3_MKNOD]       = sheddable(bind(&NfsServer::proc_mknod), 2);
+    h.procedures[NFSPROC3_REMOVE]      = sheddable(bind(&NfsServer::proc_remove), 2);
+    h.procedures[NFSPROC3_RMDIR]       = sheddable(bind(&NfsServer::proc_rmdir), 2);
+    h.procedures[NFSPROC3_RENAME]      = sheddable(bind(&NfsServer::proc_rename), 4);
+    h.procedures[NFSPROC3_LINK]        = sheddable(bind(&NfsServer::proc_link), 3);
+    h.procedures[NFSPROC3_READDIR]     = sheddable(bind(&NfsServer::proc_readdir), 1);
+    h.procedures[NFSPROC3_READDIRPLUS] = sheddable(bind(&NfsServer::proc_readdirplus), 1);
     h.procedures[NFSPROC3_FSSTAT]      = bind(&NfsServer::proc_fsstat);
     h.procedures[NFSPROC3_FSINFO]      = bind(&NfsServer::proc_fsinfo);
     h.procedures[NFSPROC3_PATHCONF]    = bind(&NfsServer::proc_pathconf);
-    h.procedures[NFSPROC3_COMMIT]      = bind(&NfsServer::proc_commit);
+    h.procedures[NFSPROC3_COMMIT]      = sheddable(bind(&NfsServer::proc_commit), 2);
 
     return h;
 }
 
+void NfsServer::register_metrics(MetricsRegistry& metrics) {
+    metrics.counter("nfsd_io_bytes_total", "File data bytes read and written",
+                    {{"direction", "read"}, {"version", "3"}},
+                    [this] { return bytes_read_.load(std::memory_order_relaxed); });
+    metrics.counter("nfsd_io_bytes_total", "File data bytes read and written",
+                    {{"direction", "write"}, {"version", "3"}},
+                    [this] { return bytes_written_.load(std::memory_order_relaxed); });
+    excl_mu_.register_metrics(metrics);
+}
+
+void NfsServer::save_state(XdrEncoder& enc) {
+    enc.encode_uint64(write_verifier_);
+    std::lock_guard<ProfiledMutex> lock(excl_mu_);
+    enc.encode_uint32(static_cast<uint32_t>(excl_verifiers_.size()));
+    for (const auto& [fh, verf] : excl_verifiers_) {
+        enc.encode_opaque(fh.data(), fh.size());
+        enc.encode_uint64(verf);
+    }
+}
+
+bool NfsServer::restore_state(XdrDecoder& dec) {
+    try {
+        uint64_t write_verifier = dec.decode_uint64();
+        std::unordered_map<FileHandle, uint64_t> excl;
+        for (uint32_t n = dec.decode_uint32(); n > 0; n--) {
+            FileHandle fh = decode_fh(dec);
+            excl[fh] = dec.decode_uint64();
+        }
+        write_verifier_ = write_verifier;
+        std::lock_guard<ProfiledMutex> lock(excl_mu_);
+        excl_verifiers_ = std::move(excl);
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
 // RFC 1813 §2.3.3 - Decode nfs_fh3 (variable-length opaque file handle)
+// straight from the call's bytes
 FileHandle NfsServer::decode_fh(XdrDecoder& dec) {
-    auto opaque = dec.decode_opaque();
-    FileHandle fh;
-    fh.len = std::min(opaque.size(), sizeof(fh.data));
-    std::memcpy(fh.data, opaque.data(), fh.len);
-    return fh;
+    uint32_t len = dec.decode_uint32();
+    const uint8_t* data = dec.current();
+    dec.skip(len);
+    return FileHandle(data, len);
 }
 
 // RFC 1813 §2.5 - Encode fattr3 (file attributes)
@@ -2,6 +2,10 @@
 
 #include "rpc/rpc_server.h"
 #include "vfs/vfs.h"
+#include "stats/metrics.h"
+#include "stats/profiled_mutex.h"
+#include <atomic>
+#include <unordered_map>
 
 class NfsServer {
 public:
@@ -9,6 +13,16 @@ public:
 
     RpcProgramHandlers get_handlers();
 
+    // Export READ/WRITE byte counters
+    void register_metrics(MetricsRegistry& metrics);
+
+    // Binary upgrade: the write verifier and the EXCLUSIVE CREATE
+    // verifiers. Keeping the write verifier spares clients resending their
+    // unstable writes, which are in the page cache, not in this process.
+    void save_state(XdrEncoder& enc);
+    // Adopt a save_state() image; false if malformed. Call before serving.
+    bool restore_state(XdrDecoder& dec);
+
 private:
     FileHandle decode_fh(XdrDecoder& dec);                          // RFC 1813 §2.3.3 - nfs_fh3
     void encode_fattr3(XdrEncoder& enc, const Fattr3& attr);        // RFC 1813 §2.5 - fattr3
@@ -59,6 +73,9 @@ private:
 
     // EXCLUSIVE CREATE verifier map: FH → createverf3 supplied by client.
     // Used to detect idempotent re-creation vs. conflicting duplicate (RFC 1813 §3.3.8).
-    std::mutex excl_mu_;
-    std::map<FileHandle, uint64_t> excl_verifiers_;
+    ProfiledMutex excl_mu_{"nfs3_exclusive_create"};
+    std::unordered_map<FileHandle, uint64_t> excl_verifiers_;
+
+    std::atomic<uint64_t> bytes_read_{0};
+    std::atomic<uint64_t> bytes_written_{0};
 };
@@ -1,23 +1,33 @@
 #include "nfs4/nfs4_attrs.h"
 #include <pwd.h>
 #include <grp.h>
+#include <cstring>
 #include <string>
 
 // RFC 7530 §5.8.2.2 - owner/owner_group as "user@domain" strings
 static const std::string nfs4_domain = "localdomain";
 
-static std::string uid_to_owner(uint32_t uid) {
+// name@domain, or the bare number without a name, allocated from mr
+static std::pmr::string owner_string(const char* name, uint32_t id,
+                                     std::pmr::memory_resource* mr) {
+    std::pmr::string s(mr);
+    if (name) {
+        s.reserve(std::strlen(name) + 1 + nfs4_domain.size());
+        s.append(name).append(1, '@').append(nfs4_domain);
+    } else {
+        s.assign(std::to_string(id));
+    }
+    return s;
+}
+
+static std::pmr::string uid_to_owner(uint32_t uid, std::pmr::memory_resource* mr) {
     struct passwd* pw = getpwuid(uid);
-    if (pw)
-        return std::string(pw->pw_name) + "@" + nfs4_domain;
-    return std::to_string(uid);
+    return owner_string(pw ? pw->pw_name : nullptr, uid, mr);
 }
 
-static std::string gid_to_group(uint32_t gid) {
+static std::pmr::string gid_to_group(uint32_t gid, std::pmr::memory_resource* mr) {
     struct group* gr = getgrgid(gid);
-    if (gr)
-        return std::string(gr->gr_name) + "@" + nfs4_domain;
-    return std::to_string(gid);
+    return owner_string(gr ? gr->gr_name : nullptr, gid, mr);
 }
 
 static uint32_t owner_to_uid(const std::string& owner_str) {
@@ -51,15 +61,17 @@ static uint32_t group_to_gid(const std::string& group_str) {
 
 // RFC 7530 §5.8 - NFSv4 bitmap-based attribute encoding
 
-std::vector<uint32_t> decode_bitmap(XdrDecoder& dec) {
+Bitmap4 decode_bitmap(XdrDecoder& dec, std::pmr::memory_resource* mr) {
     uint32_t count = dec.decode_uint32();
-    std::vector<uint32_t> bm(count);
+    if (count > dec.remaining() / 4)
+        throw std::runtime_error("XDR decode: buffer underflow");
+    Bitmap4 bm(count, mr);
     for (uint32_t i = 0; i < count; i++)
         bm[i] = dec.decode_uint32();
     return bm;
 }
 
-void encode_bitmap(XdrEncoder& enc, const std::vector<uint32_t>& bm) {
+void encode_bitmap(XdrEncoder& enc, const Bitmap4& bm) {
     // Trim trailing zero words
     size_t len = bm.size();
     while (len > 0 && bm[len - 1] == 0) len--;
@@ -68,8 +80,8 @@ void encode_bitmap(XdrEncoder& enc, const std::vector<uint32_t>& bm) {
         enc.encode_uint32(bm[i]);
 }
 
-std::vector<uint32_t> get_supported_bitmap() {
-    std::vector<uint32_t> bm(2, 0);
+static Bitmap4 make_supported_bitmap() {
+    Bitmap4 bm(2, 0);
 
     // Word 0 attributes (bits 0-31)
     bitmap_set(bm, FATTR4_SUPPORTED_ATTRS);  // 0
@@ -122,6 +134,11 @@ std::vector<uint32_t> get_supported_bitmap() {
     return bm;
 }
 
+const Bitmap4& get_supported_bitmap() {
+    static const Bitmap4 bm = make_supported_bitmap();
+    return bm;
+}
+
 // Helper: encode nfstime4 (int64 seconds + uint32 nseconds)
 static void encode_nfstime4(XdrEncoder& enc, const NfsTime3& t) {
     enc.encode_int64(static_cast<int64_t>(t.seconds));
@@ -194,12 +211,12 @@ uint32_t decode_acl4_to_mode(XdrDecoder& dec) {
 }
 
 void encode_fattr4(XdrEncoder& enc,
-                   const std::vector<uint32_t>& requested,
+                   const Bitmap4& requested,
                    const Fattr3& attr,
                    const FileHandle& fh) {
     // Compute result bitmap = requested AND supported
-    auto supported = get_supported_bitmap();
-    std::vector<uint32_t> result(std::max(requested.size(), supported.size()), 0);
+    const Bitmap4& supported = get_supported_bitmap();
+    Bitmap4 result(std::max(requested.size(), supported.size()), 0, enc.resource());
     for (size_t i = 0; i < result.size(); i++) {
         uint32_t r = (i < requested.size()) ? requested[i] : 0;
         uint32_t s = (i < supported.size()) ? supported[i] : 0;
@@ -211,7 +228,7 @@ void encode_fattr4(XdrEncoder& enc,
 
     // Encode attribute values into a temporary buffer, then write as opaque.
     // MUST be encoded in strict bit order (RFC 7530 §5.1).
-    XdrEncoder attr_data;
+    XdrEncoder attr_data(enc.resource());
 
     // Word 0 attributes (bits 0-31)
     if (bitmap_isset(result, FATTR4_SUPPORTED_ATTRS)) {  // 0
@@ -275,7 +292,7 @@ void encode_fattr4(XdrEncoder& enc,
         attr_data.encode_bool(true);
     }
     if (bitmap_isset(result, FATTR4_FILEHANDLE)) {        // 19
-        attr_data.encode_opaque(fh.data, fh.len);
+        attr_data.encode_opaque(fh.data(), fh.size());
     }
     if (bitmap_isset(result, FATTR4_FILEID)) {            // 20
         attr_data.encode_uint64(attr.fileid);
@@ -322,10 +339,10 @@ void encode_fattr4(XdrEncoder& enc,
         attr_data.encode_uint32(attr.nlink);
     }
     if (bitmap_isset(result, FATTR4_OWNER)) {             // 36
-        attr_data.encode_string(uid_to_owner(attr.uid));
+        attr_data.encode_string(uid_to_owner(attr.uid, enc.resource()));
     }
     if (bitmap_isset(result, FATTR4_OWNER_GROUP)) {       // 37
-        attr_data.encode_string(gid_to_group(attr.gid));
+        attr_data.encode_string(gid_to_group(attr.gid, enc.resource()));
     }
     // 38 QUOTA_AVAIL_HARD - not supported
     // 39 QUOTA_AVAIL_SOFT - not supported
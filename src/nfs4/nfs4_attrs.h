@@ -3,37 +3,43 @@
 #include "xdr/xdr_codec.h"
 #include "vfs/vfs.h"
 #include "nfs4/nfs4_types.h"
+#include <memory_resource>
 #include <vector>
 
 // RFC 7530 §5.8 - NFSv4 bitmap-based attribute encoding/decoding
 
+// RFC 7530 §3.3.7 - bitmap4; in the request path from the call's arena
+using Bitmap4 = std::pmr::vector<uint32_t>;
+
 // Decode a bitmap (array of uint32_t) from XDR
-std::vector<uint32_t> decode_bitmap(XdrDecoder& dec);
+Bitmap4 decode_bitmap(XdrDecoder& dec,
+                      std::pmr::memory_resource* mr = std::pmr::get_default_resource());
 
 // Encode a bitmap (array of uint32_t) to XDR
-void encode_bitmap(XdrEncoder& enc, const std::vector<uint32_t>& bm);
+void encode_bitmap(XdrEncoder& enc, const Bitmap4& bm);
 
 // Return the bitmap of attributes this server supports
-std::vector<uint32_t> get_supported_bitmap();
+const Bitmap4& get_supported_bitmap();
 
 // Check if a specific attribute bit is set in a bitmap
-inline bool bitmap_isset(const std::vector<uint32_t>& bm, uint32_t bit) {
+inline bool bitmap_isset(const Bitmap4& bm, uint32_t bit) {
     uint32_t word = bit / 32;
     uint32_t mask = 1u << (bit % 32);
     return word < bm.size() && (bm[word] & mask) != 0;
 }
 
 // Set a specific attribute bit in a bitmap
-inline void bitmap_set(std::vector<uint32_t>& bm, uint32_t bit) {
+inline void bitmap_set(Bitmap4& bm, uint32_t bit) {
     uint32_t word = bit / 32;
     if (bm.size() <= word) bm.resize(word + 1, 0);
     bm[word] |= (1u << (bit % 32));
 }
 
 // Encode fattr4 for a given file: bitmap of what's returned + attribute data
-// Only encodes attributes that are both requested and supported.
+// Only encodes attributes that are both requested and supported; its
+// temporaries come from enc's memory resource.
 void encode_fattr4(XdrEncoder& enc,
-                   const std::vector<uint32_t>& requested,
+                   const Bitmap4& requested,
                    const Fattr3& attr,
                    const FileHandle& fh);
 
@@ -187,7 +187,7 @@ bool cb_recall(const Nfs4CallbackInfo& cb,
     // truncate
     enc.encode_bool(truncate);
     // fh (nfs_fh4 = opaque<NFS4_FHSIZE>)
-    enc.encode_opaque(fh.data, fh.len);
+    enc.encode_opaque(fh.data(), fh.size());
 
     bool ok = send_record(fd, enc.data().data(), enc.size());
     if (!ok) { close(fd); return false; }
@@ -216,3 +216,66 @@ bool cb_recall(const Nfs4CallbackInfo& cb,
     uint32_t status = dec.decode_uint32();
     return status == 0;  // NFS4_OK
 }
+
+// v4.1 CB_COMPOUND header with CB_SEQUENCE as its first op; num_ops
+// counts the CB_SEQUENCE
+static void encode_cb_compound41(XdrEncoder& enc, const Nfs4BackChannel& bc,
+                                 uint32_t xid, uint32_t cb_seqid, uint32_t num_ops) {
+    encode_rpc_call(enc, xid, bc.cb_program, NFS4_CB_VERSION, CB_COMPOUND);
+
+    // CB_COMPOUND4args: tag, minorversion, callback_ident, num_ops
+    enc.encode_string("");
+    enc.encode_uint32(1);              // minorversion
+    enc.encode_uint32(0);              // callback_ident (unused in v4.1)
+    enc.encode_uint32(num_ops);
+
+    // RFC 8881 §20.9 - CB_SEQUENCE4args
+    enc.encode_uint32(OP_CB_SEQUENCE);
+    enc.encode_opaque_fixed(bc.sessionid.data(), 16);
+    enc.encode_uint32(cb_seqid);
+    enc.encode_uint32(0);              // csa_slotid
+    enc.encode_uint32(0);              // csa_highest_slotid
+    enc.encode_bool(false);            // csa_cachethis
+    enc.encode_uint32(0);              // csa_referring_call_lists<>
+}
+
+bool cb_notify_lock(const Nfs4BackChannel& bc,
+                    uint32_t xid,
+                    uint32_t cb_seqid,
+                    const FileHandle& fh,
+                    uint64_t owner_clientid,
+                    const std::vector<uint8_t>& owner) {
+    if (!bc.valid()) return false;
+
+    XdrEncoder enc;
+    encode_cb_compound41(enc, bc, xid, cb_seqid, 2);  // CB_SEQUENCE + CB_NOTIFY_LOCK
+
+    // RFC 8881 §20.11 - CB_NOTIFY_LOCK4args: cnla_fh, cnla_lock_owner
+    enc.encode_uint32(OP_CB_NOTIFY_LOCK);
+    enc.encode_opaque(fh.data(), fh.size());
+    enc.encode_uint64(owner_clientid);
+    enc.encode_opaque(owner.data(), owner.size());
+
+    return bc.send(enc.data().data(), enc.size());
+}
+
+bool cb_recall41(const Nfs4BackChannel& bc,
+                 uint32_t xid,
+                 uint32_t cb_seqid,
+                 const Nfs4StateId& stateid,
+                 bool truncate,
+                 const FileHandle& fh) {
+    if (!bc.valid()) return false;
+
+    XdrEncoder enc;
+    encode_cb_compound41(enc, bc, xid, cb_seqid, 2);  // CB_SEQUENCE + CB_RECALL
+
+    // RFC 8881 §20.2 - CB_RECALL4args: stateid, truncate, fh
+    enc.encode_uint32(OP_CB_RECALL);
+    enc.encode_uint32(stateid.seqid);
+    enc.encode_opaque_fixed(stateid.other, 12);
+    enc.encode_bool(truncate);
+    enc.encode_opaque(fh.data(), fh.size());
+
+    return bc.send(enc.data().data(), enc.size());
+}
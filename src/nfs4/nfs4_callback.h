@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <string>
 #include "nfs4/nfs4_types.h"
+#include "rpc/rpc_types.h"
 #include "vfs/vfs.h"
 
 // RFC 7530 §7.10 - Callback info stored per client
@@ -14,6 +15,16 @@ struct Nfs4CallbackInfo {
     bool valid = false;
 };
 
+// RFC 8881 §2.10.3.1 - NFSv4.1 callback path: the session's backchannel
+// connection, with CB_SEQUENCE leading every CB_COMPOUND (single slot).
+struct Nfs4BackChannel {
+    SessionId41 sessionid{};
+    uint32_t cb_program = 0;
+    uint32_t slot_seqid = 0;   // last csa_sequenceid the client took on slot 0
+    RpcBackChannel send;
+    bool valid() const { return static_cast<bool>(send); }
+};
+
 // Parse universal address (RFC 5665) into host and port.
 // "192.168.1.1.8.1" -> host="192.168.1.1", port=2049
 bool parse_universal_addr(const std::string& r_addr,
@@ -32,3 +43,24 @@ bool cb_recall(const Nfs4CallbackInfo& cb,
                bool truncate,
                const FileHandle& fh,
                int timeout_ms = 10000);
+
+// RFC 8881 §20.11 - Send CB_NOTIFY_LOCK (after CB_SEQUENCE with cb_seqid)
+// over a session backchannel. Returns once sent: the reply comes back on
+// the fore channel connection (Nfs4StateManager::backchannel_reply()). The
+// notification is only a hint that the client should retry its LOCK now.
+bool cb_notify_lock(const Nfs4BackChannel& bc,
+                    uint32_t xid,
+                    uint32_t cb_seqid,
+                    const FileHandle& fh,
+                    uint64_t owner_clientid,
+                    const std::vector<uint8_t>& owner);
+
+// RFC 8881 §20.2 - Send CB_RECALL (after CB_SEQUENCE with cb_seqid) over a
+// session backchannel. Returns once sent, like cb_notify_lock; the client
+// then returns the delegation with DELEGRETURN.
+bool cb_recall41(const Nfs4BackChannel& bc,
+                 uint32_t xid,
+                 uint32_t cb_seqid,
+                 const Nfs4StateId& stateid,
+                 bool truncate,
+                 const FileHandle& fh);
@@ -2,9 +2,15 @@
 #include "nfs4/nfs4_attrs.h"
 #include "nfs4/nfs4_callback.h"
 #include "nfs4/nfs4_types.h"
+#include "rpc/rpc_overload.h"
+#include "log/logger.h"
+#include "stats/probes.h"
+#include "stats/request_tracer.h"
+#include "stats/slow_op_log.h"
+#include <algorithm>
 #include <chrono>
 #include <cstring>
-#include <iostream>
+#include <iterator>
 
 // RFC 7530 §14.1 - UTF-8 string validation
 static bool is_valid_utf8(const std::string& s) {
@@ -99,6 +105,40 @@ RpcProgramHandlers Nfs4Server::get_handlers() {
     return h;
 }
 
+void Nfs4Server::register_metrics(MetricsRegistry& metrics) {
+    for (const auto& [opcode, handler] : op_handlers_) {
+        if (opcode >= kOpCountSlots) continue;
+        uint32_t op = opcode;
+        metrics.counter("nfsd_nfs4_ops_total", "NFSv4 COMPOUND operations processed",
+                        {{"op", std::to_string(op)}},
+                        [this, op] { return op_counts_[op].load(std::memory_order_relaxed); });
+    }
+    metrics.counter("nfsd_io_bytes_total", "File data bytes read and written",
+                    {{"direction", "read"}, {"version", "4"}},
+                    [this] { return bytes_read_.load(std::memory_order_relaxed); });
+    metrics.counter("nfsd_io_bytes_total", "File data bytes read and written",
+                    {{"direction", "write"}, {"version", "4"}},
+                    [this] { return bytes_written_.load(std::memory_order_relaxed); });
+    state_.register_metrics(metrics);
+}
+
+void Nfs4Server::save_state(XdrEncoder& enc) {
+    enc.encode_uint64(write_verifier_);
+    state_.save_state(enc);
+}
+
+bool Nfs4Server::restore_state(XdrDecoder& dec) {
+    uint64_t write_verifier;
+    try {
+        write_verifier = dec.decode_uint64();
+    } catch (const std::exception&) {
+        return false;
+    }
+    if (!state_.restore_state(dec)) return false;
+    write_verifier_ = write_verifier;
+    return true;
+}
+
 // RFC 7530 §16.1 Procedure 0: NULL
 void Nfs4Server::proc_null(const RpcCallHeader&, XdrDecoder&, XdrEncoder&) {
     // No-op
@@ -106,7 +146,7 @@ void Nfs4Server::proc_null(const RpcCallHeader&, XdrDecoder&, XdrEncoder&) {
 
 // RFC 7530 §16.2 Procedure 1: COMPOUND
 void Nfs4Server::proc_compound(const RpcCallHeader& call, XdrDecoder& args, XdrEncoder& reply) {
-    std::string tag = args.decode_string();
+    std::pmr::string tag = args.decode_string(call.arena);
     uint32_t minorversion = args.decode_uint32();
     uint32_t num_ops = args.decode_uint32();
 
@@ -117,25 +157,24 @@ void Nfs4Server::proc_compound(const RpcCallHeader& call, XdrDecoder& args, XdrE
         return;
     }
 
-    CompoundState cs;
+    CompoundState cs(call.arena);
     cs.minorversion = minorversion;
+    cs.back_channel = call.back_channel;
 
     // Extract AUTH_SYS credentials if present
     if (call.credential.flavor == RpcAuthFlavor::AUTH_SYS) {
-        auto auth = RpcServer::parse_auth_sys(call.credential);
+        auto auth = RpcServer::parse_auth_sys(call.credential, call.arena);
         cs.uid = auth.uid;
         cs.gid = auth.gid;
-        cs.gids = auth.gids;
+        cs.gids = std::move(auth.gids);
     }
     Nfs4Stat last_status = Nfs4Stat::NFS4_OK;
 
-    // Buffer individual op results, then assemble the final reply
-    struct OpResult {
-        uint32_t opcode;
-        Nfs4Stat status;
-        std::vector<uint8_t> data;
-    };
-    std::vector<OpResult> results;
+    // The ops' results (resop4) as encoded, behind the reply's status and
+    // count once those are known; op_enc takes each op's result body
+    XdrEncoder results(call.arena);
+    uint32_t num_results = 0;
+    XdrEncoder op_enc(call.arena);
 
     // RFC 8881 - ops banned in v4.1 (v4.0-only bootstrap ops)
     static const uint32_t kBannedV41[] = {
@@ -157,14 +196,57 @@ void Nfs4Server::proc_compound(const RpcCallHeader& call, XdrDecoder& args, XdrE
         for (size_t j = 0; j < n; j++) if (arr[j] == v) return true;
         return false;
     };
+    // Under overload (RpcCallHeader::overload) an expensive op answers
+    // NFS4ERR_DELAY (RFC 8881 §15.1.1.3) before it runs, provided only
+    // cheap ops ran before it: a compound that has already changed state
+    // (opened, locked, created) is finished, and session setup, CLOSE,
+    // LOCKU and DELEGRETURN are never shed. Nor is a v4.0 OPEN: the
+    // client advances the open-owner's seqid on NFS4ERR_DELAY too (RFC
+    // 7530 §9.1.7), so an OPEN that never ran would fail its next one
+    // with NFS4ERR_BAD_SEQID.
+    static const uint32_t kCheapOps[] = {
+        3,   // OP_ACCESS
+        9,   // OP_GETATTR
+        10,  // OP_GETFH
+        15,  // OP_LOOKUP
+        16,  // OP_LOOKUPP
+        17,  // OP_NVERIFY
+        22,  // OP_PUTFH
+        23,  // OP_PUTPUBFH
+        24,  // OP_PUTROOTFH
+        31,  // OP_RESTOREFH
+        32,  // OP_SAVEFH
+        37,  // OP_VERIFY
+        53,  // OP_SEQUENCE
+    };
+    static const uint32_t kSheddableOps[] = {
+        5,   // OP_COMMIT
+        6,   // OP_CREATE
+        11,  // OP_LINK
+        18,  // OP_OPEN
+        25,  // OP_READ
+        26,  // OP_READDIR
+        28,  // OP_REMOVE
+        29,  // OP_RENAME
+        34,  // OP_SETATTR
+        38,  // OP_WRITE
+    };
+    bool may_shed = call.overload != nullptr;
+    RequestTrace* trace = current_request_trace();
+    const bool timed = latency_stats_ || trace;
+    // One timestamp per op: each op's end is the next one's start, so an
+    // op's time includes decoding its arguments
+    uint64_t op_mark = 0;
 
     for (uint32_t i = 0; i < num_ops; i++) {
         uint32_t opcode = args.decode_uint32();
-        XdrEncoder op_enc;
+        op_enc.clear();
 
         auto it = op_handlers_.find(opcode);
         Nfs4Stat status;
         bool do_call = true;
+        if (opcode < kOpCountSlots)
+            op_counts_[opcode].fetch_add(1, std::memory_order_relaxed);
 
         if (it == op_handlers_.end()) {
             status = Nfs4Stat::NFS4ERR_OP_ILLEGAL;
@@ -189,20 +271,49 @@ void Nfs4Server::proc_compound(const RpcCallHeader& call, XdrDecoder& args, XdrE
             }
         }
 
+        if (do_call && may_shed) {
+            if (in_set(kSheddableOps, std::size(kSheddableOps), opcode) &&
+                !(cs.minorversion == 0 && opcode == static_cast<uint32_t>(Nfs4Op::OP_OPEN))) {
+                status = Nfs4Stat::NFS4ERR_DELAY;
+                do_call = false;
+                call.overload->shed(NFS_V4);
+            } else if (!in_set(kCheapOps, std::size(kCheapOps), opcode)) {
+                may_shed = false;
+            }
+        }
+
+        uint64_t op_ns = 0;
+        uint64_t op_start = 0;
         if (do_call) {
+            if (timed && !op_mark) op_mark = LatencyStats::now_ns();
+            op_start = op_mark;
+            NFSD_PROBE3(nfs4__op__start, call.xid, opcode, i);
             try {
                 status = (this->*(it->second))(cs, args, op_enc);
             } catch (const std::exception& e) {
-                std::cerr << "[SERVERFAULT] op=" << opcode << " exception: " << e.what() << std::endl;
+                NFSD_LOG_ERROR(LogSys::NFS4, "op failed, answering NFS4ERR_SERVERFAULT",
+                               {{"xid", call.xid}, {"op", opcode}, {"error", e.what()}});
                 status = Nfs4Stat::NFS4ERR_SERVERFAULT;
             }
+            NFSD_PROBE4(nfs4__op__done, call.xid, opcode, i, static_cast<uint32_t>(status));
+            if (timed) {
+                op_mark = LatencyStats::now_ns();
+                op_ns = op_mark - op_start;
+            }
+            if (latency_stats_)
+                latency_stats_->record({NFS_PROGRAM, NFS_V4, NFSPROC4_COMPOUND, opcode},
+                                       LatencyPhase::HANDLER, op_ns);
         }
+        if (trace) trace->ops.push_back({opcode, static_cast<uint32_t>(status), op_ns});
+        if (trace && trace->spans && do_call)
+            trace->spans->push({op_start, op_ns, nullptr, call.xid, opcode,
+                                static_cast<uint32_t>(status), i, SpanKind::OP});
 
-        OpResult r;
-        r.opcode = opcode;
-        r.status = status;
-        r.data = std::vector<uint8_t>(op_enc.data().begin(), op_enc.data().end());
-        results.push_back(std::move(r));
+        results.encode_uint32(opcode);
+        results.encode_uint32(static_cast<uint32_t>(status));
+        if (op_enc.size())
+            results.encode_opaque_fixed(op_enc.data().data(), op_enc.size());
+        num_results++;
 
         last_status = status;
         if (status != Nfs4Stat::NFS4_OK)
@@ -212,14 +323,9 @@ void Nfs4Server::proc_compound(const RpcCallHeader& call, XdrDecoder& args, XdrE
     // Encode COMPOUND reply
     reply.encode_uint32(static_cast<uint32_t>(last_status));
     reply.encode_string(tag);
-    reply.encode_uint32(static_cast<uint32_t>(results.size()));
-
-    for (const auto& r : results) {
-        reply.encode_uint32(r.opcode);
-        reply.encode_uint32(static_cast<uint32_t>(r.status));
-        if (!r.data.empty())
-            reply.encode_opaque_fixed(r.data.data(), r.data.size());
-    }
+    reply.encode_uint32(num_results);
+    if (results.size())
+        reply.encode_opaque_fixed(results.data().data(), results.size());
 }
 
 // --- Helper methods ---
@@ -252,11 +358,13 @@ Nfs4Stat Nfs4Server::op_putrootfh(CompoundState& cs, XdrDecoder&, XdrEncoder&) {
 
 // RFC 7530 §16.19 - PUTFH
 Nfs4Stat Nfs4Server::op_putfh(CompoundState& cs, XdrDecoder& args, XdrEncoder&) {
-    auto opaque = args.decode_opaque();
-    FileHandle fh;
-    fh.len = std::min(opaque.size(), sizeof(fh.data));
-    std::memcpy(fh.data, opaque.data(), fh.len);
-    cs.current_fh = fh;
+    uint32_t len = args.decode_uint32();
+    const uint8_t* data = args.current();
+    args.skip(len);
+    // Longer than any handle this server issues
+    if (len == 0 || len > FileHandle::kMaxSize)
+        return Nfs4Stat::NFS4ERR_BADHANDLE;
+    cs.current_fh = FileHandle(data, len);
     cs.current_fh_set = true;
     return Nfs4Stat::NFS4_OK;
 }
@@ -264,7 +372,7 @@ Nfs4Stat Nfs4Server::op_putfh(CompoundState& cs, XdrDecoder& args, XdrEncoder&)
 // RFC 7530 §16.10 - GETFH
 Nfs4Stat Nfs4Server::op_getfh(CompoundState& cs, XdrDecoder&, XdrEncoder& enc) {
     if (!cs.current_fh_set) return Nfs4Stat::NFS4ERR_NOFILEHANDLE;
-    enc.encode_opaque(cs.current_fh.data, cs.current_fh.len);
+    enc.encode_opaque(cs.current_fh.data(), cs.current_fh.size());
     return Nfs4Stat::NFS4_OK;
 }
 
@@ -290,7 +398,7 @@ Nfs4Stat Nfs4Server::op_restorefh(CompoundState& cs, XdrDecoder&, XdrEncoder&) {
 Nfs4Stat Nfs4Server::op_getattr(CompoundState& cs, XdrDecoder& args, XdrEncoder& enc) {
     if (!cs.current_fh_set) return Nfs4Stat::NFS4ERR_NOFILEHANDLE;
 
-    auto requested = decode_bitmap(args);
+    auto requested = decode_bitmap(args, cs.arena);
 
     Fattr3 attr;
     NfsStat3 s = vfs_.getattr(cs.current_fh, attr);
@@ -350,7 +458,7 @@ Nfs4Stat Nfs4Server::op_readdir(CompoundState& cs, XdrDecoder& args, XdrEncoder&
     uint64_t client_verf = args.decode_uint64();
     uint32_t dircount = args.decode_uint32();
     args.decode_uint32(); // maxcount
-    auto attr_request = decode_bitmap(args);
+    auto attr_request = decode_bitmap(args, cs.arena);
 
     // Generate cookieverf from directory mtime
     Fattr3 dir_attr;
@@ -386,7 +494,7 @@ Nfs4Stat Nfs4Server::op_readdir(CompoundState& cs, XdrDecoder& args, XdrEncoder&
             encode_fattr4(enc, attr_request, entry_attr, entry_fh);
         } else {
             // Encode empty attrs on lookup failure
-            std::vector<uint32_t> empty_bm;
+            Bitmap4 empty_bm;
             encode_bitmap(enc, empty_bm);
             enc.encode_uint32(0); // empty attr data
         }
@@ -479,8 +587,8 @@ Nfs4Stat Nfs4Server::op_setclientid_confirm(CompoundState&, XdrDecoder& args, Xd
     if (cb.valid) {
         bool ok = cb_null_probe(cb, next_cb_xid_++);
         if (!ok) {
-            std::cerr << "CB_NULL probe failed for client " << clientid
-                      << " at " << cb.r_addr << " — delegations disabled\n";
+            NFSD_LOG_WARN(LogSys::NFS4, "CB_NULL probe failed, delegations disabled",
+                          {{"clientid", clientid}, {"r_addr", cb.r_addr}});
             state_.invalidate_client_callback(clientid);
         }
     }
@@ -503,6 +611,10 @@ Nfs4Stat Nfs4Server::op_open(CompoundState& cs, XdrDecoder& args, XdrEncoder& en
     uint32_t effective_seqid = (cs.minorversion == 1) ? 0 : seqid;
     uint32_t share_access = args.decode_uint32();
     uint32_t share_deny = args.decode_uint32();
+    // RFC 8881 §18.16.3 - v4.1 clients may ask for no delegation
+    bool want_deleg = (share_access & OPEN4_SHARE_ACCESS_WANT_DELEG_MASK) !=
+                      OPEN4_SHARE_ACCESS_WANT_NO_DELEG;
+    share_access &= ~OPEN4_SHARE_ACCESS_WANT_DELEG_MASK;
 
     // open_owner4: clientid + owner
     uint64_t clientid = args.decode_uint64();
@@ -582,7 +694,7 @@ Nfs4Stat Nfs4Server::op_open(CompoundState& cs, XdrDecoder& args, XdrEncoder& en
         enc.encode_uint32(rflags);
 
         // attrset bitmap
-        std::vector<uint32_t> attrset;
+        Bitmap4 attrset;
         encode_bitmap(enc, attrset);
 
         // Re-grant delegation if client had one before
@@ -692,7 +804,7 @@ Nfs4Stat Nfs4Server::op_open(CompoundState& cs, XdrDecoder& args, XdrEncoder& en
                                    share_access, share_deny,
                                    stateid, needs_confirm,
                                    deleg_type, deleg_stateid,
-                                   recall_cb, recall_deleg_sid, recall_fh);
+                                   recall_cb, recall_deleg_sid, recall_fh, want_deleg);
 
     if (s == Nfs4Stat::NFS4ERR_DELAY) {
         // Delegation conflict — send CB_RECALL and tell client to retry
@@ -733,7 +845,7 @@ Nfs4Stat Nfs4Server::op_open(CompoundState& cs, XdrDecoder& args, XdrEncoder& en
     enc.encode_uint32(rflags);
 
     // attrset bitmap (for CREATE: what attrs were set)
-    std::vector<uint32_t> attrset;
+    Bitmap4 attrset;
     encode_bitmap(enc, attrset);
 
     // delegation
@@ -801,6 +913,7 @@ Nfs4Stat Nfs4Server::op_lock(CompoundState& cs, XdrDecoder& args, XdrEncoder& en
     uint64_t length = args.decode_uint64();
 
     // Normalize wait variants
+    bool blocking = (locktype == READW_LT || locktype == WRITEW_LT);
     if (locktype == READW_LT) locktype = READ_LT;
     if (locktype == WRITEW_LT) locktype = WRITE_LT;
 
@@ -837,6 +950,11 @@ Nfs4Stat Nfs4Server::op_lock(CompoundState& cs, XdrDecoder& args, XdrEncoder& en
                             lo, eff_lock_seqid, cs.current_fh,
                             locktype, offset, length,
                             out_stateid, denied);
+
+        // RFC 8881 §20.11 - denied blocking lock: notify when it frees up
+        if (s == Nfs4Stat::NFS4ERR_DENIED && blocking && cs.session_set)
+            state_.add_lock_waiter41(cs.session_id, lo, cs.current_fh,
+                                     locktype, offset, length);
     } else {
         Nfs4StateId lock_stateid;
         decode_stateid(args, lock_stateid);
@@ -846,6 +964,10 @@ Nfs4Stat Nfs4Server::op_lock(CompoundState& cs, XdrDecoder& args, XdrEncoder& en
         s = state_.lock_existing(lock_stateid, eff_lock_seqid,
                                  locktype, offset, length,
                                  out_stateid, denied);
+
+        if (s == Nfs4Stat::NFS4ERR_DENIED && blocking && cs.session_set)
+            state_.add_lock_waiter41(cs.session_id, lock_stateid,
+                                     locktype, offset, length);
     }
 
     if (s == Nfs4Stat::NFS4_OK) {
@@ -968,6 +1090,7 @@ Nfs4Stat Nfs4Server::op_read(CompoundState& cs, XdrDecoder& args, XdrEncoder& en
     bool eof = false;
     NfsStat3 s = vfs_.read(cs.current_fh, offset, count, data, eof);
     if (s != NfsStat3::NFS3_OK) return nfs3stat_to_nfs4stat(s);
+    bytes_read_.fetch_add(data.size(), std::memory_order_relaxed);
 
     enc.encode_bool(eof);
     enc.encode_opaque(data.data(), data.size());
@@ -992,6 +1115,7 @@ Nfs4Stat Nfs4Server::op_write(CompoundState& cs, XdrDecoder& args, XdrEncoder& e
     NfsStat3 s = vfs_.write(cs.current_fh, offset, data.data(),
                              static_cast<uint32_t>(data.size()), written);
     if (s != NfsStat3::NFS3_OK) return nfs3stat_to_nfs4stat(s);
+    bytes_written_.fetch_add(written, std::memory_order_relaxed);
 
     enc.encode_uint32(written);
     enc.encode_uint32(stable); // echo back committed level
@@ -1050,7 +1174,7 @@ Nfs4Stat Nfs4Server::op_setattr(CompoundState& cs, XdrDecoder& args, XdrEncoder&
     if (s != NfsStat3::NFS3_OK) return nfs3stat_to_nfs4stat(s);
 
     // attrsset bitmap (what was actually set)
-    std::vector<uint32_t> attrsset;
+    Bitmap4 attrsset(cs.arena);
     if (sa.mode != UINT32_MAX) bitmap_set(attrsset, FATTR4_MODE);
     if (sa.size != UINT64_MAX) bitmap_set(attrsset, FATTR4_SIZE);
     if (sa.has_acl) bitmap_set(attrsset, FATTR4_ACL);
@@ -1118,7 +1242,7 @@ Nfs4Stat Nfs4Server::op_create(CompoundState& cs, XdrDecoder& args, XdrEncoder&
     enc.encode_uint64(change_after);
 
     // attrset bitmap
-    std::vector<uint32_t> attrset;
+    Bitmap4 attrset;
     encode_bitmap(enc, attrset);
 
     return Nfs4Stat::NFS4_OK;
@@ -1202,8 +1326,8 @@ Nfs4Stat Nfs4Server::verify_common(CompoundState& cs, XdrDecoder& args, bool neg
     if (!cs.current_fh_set) return Nfs4Stat::NFS4ERR_NOFILEHANDLE;
 
     // Decode the client-supplied fattr4 (bitmap + opaque attr data)
-    auto client_bm = decode_bitmap(args);
-    auto client_attr_data = args.decode_opaque();
+    auto client_bm = decode_bitmap(args, cs.arena);
+    auto client_attr_data = args.decode_opaque(cs.arena);
 
     // Get actual file attributes
     Fattr3 attr;
@@ -1211,15 +1335,15 @@ Nfs4Stat Nfs4Server::verify_common(CompoundState& cs, XdrDecoder& args, bool neg
     if (s != NfsStat3::NFS3_OK) return nfs3stat_to_nfs4stat(s);
 
     // Encode server's fattr4 using the same bitmap the client requested
-    XdrEncoder server_enc;
+    XdrEncoder server_enc(cs.arena);
     encode_fattr4(server_enc, client_bm, attr, cs.current_fh);
 
     // The encode_fattr4 output includes the result bitmap + opaque attr data.
     // We need to extract just the opaque attr data for comparison.
     // Re-decode the server-encoded fattr4 to get the attr data portion.
     XdrDecoder server_dec(server_enc.data().data(), server_enc.size());
-    auto server_bm = decode_bitmap(server_dec);
-    auto server_attr_data = server_dec.decode_opaque();
+    auto server_bm = decode_bitmap(server_dec, cs.arena);
+    auto server_attr_data = server_dec.decode_opaque(cs.arena);
 
     bool match = (client_attr_data == server_attr_data);
 
@@ -1303,11 +1427,10 @@ Nfs4Stat Nfs4Server::op_exchange_id(CompoundState&, XdrDecoder& args, XdrEncoder
 }
 
 // RFC 8881 §18.36 - CREATE_SESSION
-Nfs4Stat Nfs4Server::op_create_session(CompoundState&, XdrDecoder& args, XdrEncoder& enc) {
+Nfs4Stat Nfs4Server::op_create_session(CompoundState& cs, XdrDecoder& args, XdrEncoder& enc) {
     uint64_t clientid   = args.decode_uint64();
     uint32_t sequence   = args.decode_uint32();
     uint32_t flags      = args.decode_uint32();
-    (void)flags;
 
     // fore_chan_attrs: 6 fixed uint32s + ca_rdma_ird count (RFC 8881 §2.10.6)
     uint32_t fore[6];
@@ -1321,8 +1444,7 @@ Nfs4Stat Nfs4Server::op_create_session(CompoundState&, XdrDecoder& args, XdrEnco
     uint32_t back_rdma_count = args.decode_uint32();
     for (uint32_t i = 0; i < back_rdma_count; i++) args.decode_uint32();
 
-    // cb_program
-    args.decode_uint32();
+    uint32_t cb_program = args.decode_uint32();
 
     // csa_sec_parms: array of cb_secflavor (AUTH_NONE=0 has no body)
     uint32_t sec_count = args.decode_uint32();
@@ -1331,8 +1453,18 @@ Nfs4Stat Nfs4Server::op_create_session(CompoundState&, XdrDecoder& args, XdrEnco
         (void)flavor;  // AUTH_NONE has no body; ignore others for simplicity
     }
 
+    // RFC 8881 §18.36.3 - CONN_BACK_CHAN: callbacks share this connection
+    const RpcBackChannel* back_conn = nullptr;
+    if ((flags & CREATE_SESSION4_FLAG_CONN_BACK_CHAN) && cs.back_channel && *cs.back_channel)
+        back_conn = cs.back_channel;
+
+    // RFC 8881 §18.36.3 - grant up to NFS4_MAX_SESSION_SLOTS of the
+    // requested ca_maxrequests and tell the client what it got
+    fore[5] = std::clamp(fore[5], 1u, NFS4_MAX_SESSION_SLOTS);
+
     SessionId41 sessionid{};
-    Nfs4Stat s = state_.create_session41(clientid, sequence, sessionid);
+    Nfs4Stat s = state_.create_session41(clientid, sequence, sessionid, back_conn, cb_program,
+                                         fore[5]);
     if (s != Nfs4Stat::NFS4_OK) return s;
 
     // csr_sessionid
@@ -1340,8 +1472,8 @@ Nfs4Stat Nfs4Server::op_create_session(CompoundState&, XdrDecoder& args, XdrEnco
     // csr_sequence
     enc.encode_uint32(sequence);
     // csr_flags
-    enc.encode_uint32(0);
-    // csr_fore_chan_attrs (echo client's values)
+    enc.encode_uint32(back_conn ? CREATE_SESSION4_FLAG_CONN_BACK_CHAN : 0);
+    // csr_fore_chan_attrs (client's values, ca_maxrequests as granted)
     for (auto v : fore) enc.encode_uint32(v);
     enc.encode_uint32(0);  // ca_rdma_ird empty array
     // csr_back_chan_attrs
@@ -1361,7 +1493,9 @@ Nfs4Stat Nfs4Server::op_sequence(CompoundState& cs, XdrDecoder& args, XdrEncoder
     args.decode_uint32();  // sa_cachethis (bool)
     (void)highest_slotid;
 
-    Nfs4Stat s = state_.validate_sequence41(sid, seqid, slotid);
+    uint32_t session_highest = 0;
+    Nfs4Stat s = state_.validate_sequence41(sid, seqid, slotid, &session_highest,
+                                               cs.back_channel);
     if (s != Nfs4Stat::NFS4_OK) return s;
 
     cs.session_set = true;
@@ -1374,9 +1508,9 @@ Nfs4Stat Nfs4Server::op_sequence(CompoundState& cs, XdrDecoder& args, XdrEncoder
     // sr_slotid
     enc.encode_uint32(slotid);
     // sr_highest_slotid
-    enc.encode_uint32(0);
+    enc.encode_uint32(session_highest);
     // sr_target_highest_slotid
-    enc.encode_uint32(0);
+    enc.encode_uint32(session_highest);
     // sr_status_flags
     enc.encode_uint32(0);
 
@@ -1399,17 +1533,27 @@ Nfs4Stat Nfs4Server::op_destroy_session(CompoundState&, XdrDecoder& args, XdrEnc
 }
 
 // RFC 8881 §18.34 - BIND_CONN_TO_SESSION
-// For TCP, the connection is trivially bound; this is mainly used for RDMA.
-Nfs4Stat Nfs4Server::op_bind_conn_to_session(CompoundState&, XdrDecoder& args, XdrEncoder& enc) {
+// The fore channel needs no binding over TCP; a backchannel request makes
+// this connection the session's callback path.
+Nfs4Stat Nfs4Server::op_bind_conn_to_session(CompoundState& cs, XdrDecoder& args, XdrEncoder& enc) {
     SessionId41 sid{};
     args.decode_opaque_fixed(sid.data(), 16);
     uint32_t bctsa_dir = args.decode_uint32();
     args.decode_uint32();  // bctsa_use_conn_in_rdma_mode (bool)
 
+    uint32_t dir = CDFS4_FORE;
+    bool want_back = (bctsa_dir == CDFC4_BACK || bctsa_dir == CDFC4_FORE_OR_BOTH ||
+                      bctsa_dir == CDFC4_BACK_OR_BOTH);
+    if (want_back && cs.back_channel && *cs.back_channel) {
+        Nfs4Stat s = state_.bind_back_channel41(sid, *cs.back_channel);
+        if (s != Nfs4Stat::NFS4_OK) return s;
+        dir = (bctsa_dir == CDFC4_BACK) ? CDFS4_BACK : CDFS4_BOTH;
+    }
+
     // bctsr_sessionid
     enc.encode_opaque_fixed(sid.data(), 16);
     // bctsr_dir
-    enc.encode_uint32(bctsa_dir);
+    enc.encode_uint32(dir);
     // bctsr_use_conn_in_rdma_mode
     enc.encode_uint32(0);
 
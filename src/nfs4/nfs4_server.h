@@ -4,6 +4,8 @@
 #include "vfs/vfs.h"
 #include "nfs4/nfs4_types.h"
 #include "nfs4/nfs4_state.h"
+#include "stats/latency_stats.h"
+#include <array>
 #include <atomic>
 #include <map>
 #include <string>
@@ -12,6 +14,9 @@
 
 // Per-COMPOUND request state
 struct CompoundState {
+    CompoundState() = default;
+    explicit CompoundState(std::pmr::memory_resource* mr) : gids(mr), arena(mr) {}
+
     FileHandle current_fh;
     bool current_fh_set = false;
     FileHandle saved_fh;
@@ -19,11 +24,15 @@ struct CompoundState {
     // AUTH_SYS credentials from RPC call header
     uint32_t uid = 0;
     uint32_t gid = 0;
-    std::vector<uint32_t> gids;
+    std::pmr::vector<uint32_t> gids;
     // RFC 8881 - NFSv4.1 session context
     uint32_t    minorversion{0};
     bool        session_set{false};
     SessionId41 session_id{};
+    // Connection the COMPOUND arrived on, for binding a session backchannel
+    const RpcBackChannel* back_channel = nullptr;
+    // The call's arena (RpcCallHeader::arena), for the ops' temporaries
+    std::pmr::memory_resource* arena = std::pmr::get_default_resource();
 };
 
 class Nfs4Server {
@@ -32,9 +41,23 @@ public:
 
     RpcProgramHandlers get_handlers();
 
-    // Access to shared lock table and its mutex (for NLM cross-protocol locking)
+    // Shared lock table (for NLM cross-protocol locking; internally synchronized)
     ByteRangeLockTable& lock_table() { return state_.lock_table(); }
-    std::mutex& lock_mutex() { return state_.lock_mutex(); }
+
+    // A REPLY to a backchannel call (RpcServer::set_backchannel_reply_handler())
+    void backchannel_reply(const uint8_t* data, size_t len) { state_.backchannel_reply(data, len); }
+
+    // Record per-COMPOUND-op handler latency into stats (optional, not owned)
+    void set_latency_stats(LatencyStats* stats) { latency_stats_ = stats; }
+
+    // Export per-op counts, READ/WRITE bytes and state manager gauges
+    void register_metrics(MetricsRegistry& metrics);
+
+    // Binary upgrade: the write verifier and all client state (see
+    // Nfs4StateManager::save_state())
+    void save_state(XdrEncoder& enc);
+    // Adopt a save_state() image; false if malformed. Call before serving.
+    bool restore_state(XdrDecoder& dec);
 
 private:
     // RFC 7530 §16.1 - Procedure 0: NULL
@@ -106,4 +129,11 @@ private:
     std::map<uint32_t, OpHandler> op_handlers_;
     uint64_t write_verifier_ = 0;
     std::atomic<uint32_t> next_cb_xid_{1};
+    LatencyStats* latency_stats_ = nullptr;
+
+    // Ops processed, indexed by opcode (0..75, as in /proc/net/rpc/nfsd)
+    static constexpr uint32_t kOpCountSlots = 76;
+    std::array<std::atomic<uint64_t>, kOpCountSlots> op_counts_{};
+    std::atomic<uint64_t> bytes_read_{0};
+    std::atomic<uint64_t> bytes_written_{0};
 };
@@ -1,4 +1,6 @@
 #include "nfs4/nfs4_state.h"
+#include "stats/probes.h"
+#include "xdr/xdr_codec.h"
 #include <algorithm>
 #include <cstring>
 #include <iomanip>
@@ -11,12 +13,20 @@
 Nfs4StateManager::Nfs4StateManager()
     : grace_start_(std::chrono::steady_clock::now()) {
     reaper_thread_ = std::thread(&Nfs4StateManager::reaper_loop, this);
+    notify_thread_ = std::thread(&Nfs4StateManager::notify_loop, this);
 }
 
 Nfs4StateManager::~Nfs4StateManager() {
     reaper_running_ = false;
     if (reaper_thread_.joinable())
         reaper_thread_.join();
+    {
+        std::lock_guard<std::mutex> nlk(notify_mu_);
+        notify_running_ = false;
+    }
+    notify_cv_.notify_all();
+    if (notify_thread_.joinable())
+        notify_thread_.join();
 }
 
 // RFC 7530 §9.6 - Lease expiry reaper thread
@@ -31,7 +41,7 @@ void Nfs4StateManager::reaper_loop() {
 }
 
 void Nfs4StateManager::expire_clients() {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
     auto now = std::chrono::steady_clock::now();
     auto lease = std::chrono::seconds(NFS4_LEASE_TIME);
 
@@ -61,6 +71,9 @@ void Nfs4StateManager::expire_clients() {
                 [cid](const Nfs4LockState& ls) { return ls.clientid == cid; }),
             lock_states_.end());
 
+        // Drop CB_NOTIFY_LOCK waiters (including owners that never got a lock)
+        lock_table_.cancel_waiters_matching("v4:" + std::to_string(cid) + ":");
+
         // Remove all open state for this client
         open_states_.erase(
             std::remove_if(open_states_.begin(), open_states_.end(),
@@ -111,7 +124,7 @@ std::pair<uint64_t, std::array<uint8_t, 8>>
 Nfs4StateManager::set_clientid(const uint8_t verifier[8],
                                 const std::vector<uint8_t>& client_id,
                                 const Nfs4CallbackInfo& cb) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     // Check if this client_id already exists
     auto it = client_id_to_clientid_.find(client_id);
@@ -162,7 +175,7 @@ Nfs4StateManager::set_clientid(const uint8_t verifier[8],
 // RFC 7530 §16.34 - SETCLIENTID_CONFIRM
 Nfs4Stat Nfs4StateManager::confirm_clientid(uint64_t clientid,
                                               const uint8_t confirm[8]) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     auto it = clients_.find(clientid);
     if (it == clients_.end())
@@ -188,8 +201,9 @@ Nfs4Stat Nfs4StateManager::open_file(uint64_t clientid,
                                       Nfs4StateId& out_deleg_stateid,
                                       Nfs4CallbackInfo& out_recall_cb,
                                       Nfs4StateId& out_recall_deleg_sid,
-                                      FileHandle& out_recall_fh) {
-    std::lock_guard<std::mutex> lk(mu_);
+                                      FileHandle& out_recall_fh,
+                                      bool want_deleg) {
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     out_deleg_type = OPEN_DELEGATE_NONE;
 
@@ -207,9 +221,19 @@ Nfs4Stat Nfs4StateManager::open_file(uint64_t clientid,
 
         if (!ds.recalled) {
             ds.recalled = true;
+            NFSD_PROBE4(deleg__recall, t_probe_xid, ds.fh.data(), ds.fh.size(), ds.clientid);
             auto dit = clients_.find(ds.clientid);
-            if (dit != clients_.end())
+            if (dit != clients_.end() && dit->second.cb_info.valid) {
                 out_recall_cb = dit->second.cb_info;
+            } else if (dit != clients_.end() && dit->second.cb_session_set) {
+                // RFC 8881 §20.2 - v4.1 holder: CB_RECALL over its backchannel
+                PendingCallback cb;
+                cb.sessionid = dit->second.cb_session;
+                cb.fh = ds.fh;
+                cb.recall = true;
+                cb.deleg_stateid = ds.stateid;
+                queue_callback(std::move(cb));
+            }
             out_recall_deleg_sid = ds.stateid;
             out_recall_fh = ds.fh;
         }
@@ -218,7 +242,9 @@ Nfs4Stat Nfs4StateManager::open_file(uint64_t clientid,
 
     // Check if there's an existing open for same owner+fh
     for (auto& os : open_states_) {
-        if (os.clientid == clientid && os.owner == owner && os.fh == fh) {
+        // The handle first: its hash rules out almost every other open
+        // without following the owner's bytes to the heap
+        if (os.fh == fh && os.clientid == clientid && os.owner == owner) {
             // RFC 7530 §8.1.5 - Sequence ID validation (seqid=0 skips for NFSv4.1)
             if (seqid != 0 && seqid != os.open_seqid + 1)
                 return Nfs4Stat::NFS4ERR_BAD_SEQID;
@@ -250,7 +276,8 @@ Nfs4Stat Nfs4StateManager::open_file(uint64_t clientid,
     open_states_.push_back(std::move(os));
 
     // RFC 7530 §10.4 - Try to grant delegation
-    // Only if no other client has the file open and client has valid callback
+    // Only if no other client has the file open and the client can be
+    // called back (SETCLIENTID callback or a v4.1 session backchannel)
     bool other_client_open = false;
     for (const auto& oos : open_states_) {
         if (oos.fh == fh && oos.clientid != clientid) {
@@ -258,7 +285,8 @@ Nfs4Stat Nfs4StateManager::open_file(uint64_t clientid,
             break;
         }
     }
-    if (!other_client_open && cit->second.cb_info.valid) {
+    if (want_deleg && !other_client_open &&
+        (cit->second.cb_info.valid || cit->second.cb_session_set)) {
         // Check if client already has delegation on this file
         for (const auto& ds : deleg_states_) {
             if (ds.fh == fh && ds.clientid == clientid) {
@@ -278,6 +306,7 @@ Nfs4Stat Nfs4StateManager::open_file(uint64_t clientid,
                             ? OPEN_DELEGATE_WRITE : OPEN_DELEGATE_READ;
             out_deleg_type = ds.deleg_type;
             out_deleg_stateid = ds.stateid;
+            NFSD_PROBE5(deleg__grant, t_probe_xid, ds.fh.data(), ds.fh.size(), clientid, ds.deleg_type);
             deleg_states_.push_back(std::move(ds));
         }
     }
@@ -291,7 +320,7 @@ deleg_done:
 Nfs4Stat Nfs4StateManager::confirm_open(const Nfs4StateId& stateid,
                                           uint32_t seqid,
                                           Nfs4StateId& out_stateid) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     auto* os = find_open_state(stateid);
     if (!os) return Nfs4Stat::NFS4ERR_BAD_STATEID;
@@ -317,7 +346,7 @@ Nfs4Stat Nfs4StateManager::confirm_open(const Nfs4StateId& stateid,
 Nfs4Stat Nfs4StateManager::close_file(const Nfs4StateId& stateid,
                                         uint32_t seqid,
                                         Nfs4StateId& out_stateid) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     auto it = std::find_if(open_states_.begin(), open_states_.end(),
         [&](const Nfs4OpenState& os) {
@@ -372,7 +401,7 @@ Nfs4Stat Nfs4StateManager::open_downgrade(const Nfs4StateId& stateid,
                                             uint32_t seqid,
                                             uint32_t access, uint32_t deny,
                                             Nfs4StateId& out_stateid) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     auto* os = find_open_state(stateid);
     if (!os) return Nfs4Stat::NFS4ERR_BAD_STATEID;
@@ -399,7 +428,7 @@ Nfs4Stat Nfs4StateManager::open_downgrade(const Nfs4StateId& stateid,
 
 // RFC 7530 §16.27 - RENEW
 Nfs4Stat Nfs4StateManager::renew(uint64_t clientid) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     auto it = clients_.find(clientid);
     if (it == clients_.end())
@@ -415,7 +444,7 @@ Nfs4Stat Nfs4StateManager::validate_stateid(const Nfs4StateId& stateid,
     if (is_special_stateid(stateid))
         return Nfs4Stat::NFS4_OK;
 
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     auto* os = find_open_state(stateid);
     if (os) {
@@ -454,7 +483,7 @@ Nfs4LockState* Nfs4StateManager::find_lock_state(const Nfs4StateId& sid) {
 Nfs4LockState* Nfs4StateManager::find_lock_state_by_owner(
         const Nfs4LockOwner& owner, const FileHandle& fh) {
     for (auto& ls : lock_states_) {
-        if (ls.lock_owner == owner && ls.fh == fh)
+        if (ls.fh == fh && ls.lock_owner == owner)
             return &ls;
     }
     return nullptr;
@@ -469,8 +498,45 @@ LockOwnerKey Nfs4StateManager::make_lock_key(const Nfs4LockOwner& owner) {
     return oss.str();
 }
 
-// Helper: check conflict via shared lock table, fill Nfs4LockDenied on conflict.
+void Nfs4StateManager::register_metrics(MetricsRegistry& metrics) {
+    auto count_of = [this](auto member) {
+        return [this, member] {
+            std::lock_guard<ProfiledMutex> lk(mu_);
+            return static_cast<double>((this->*member).size());
+        };
+    };
+    metrics.gauge("nfsd_nfs4_clients", "NFSv4 client records (confirmed or not)", {},
+                  count_of(&Nfs4StateManager::clients_));
+    metrics.gauge("nfsd_nfs4_sessions", "NFSv4.1 sessions", {},
+                  count_of(&Nfs4StateManager::sessions_));
+    metrics.gauge("nfsd_nfs4_open_states", "NFSv4 open stateids", {},
+                  count_of(&Nfs4StateManager::open_states_));
+    metrics.gauge("nfsd_nfs4_lock_states", "NFSv4 lock stateids", {},
+                  count_of(&Nfs4StateManager::lock_states_));
+    metrics.gauge("nfsd_nfs4_delegations", "NFSv4 delegations outstanding", {},
+                  count_of(&Nfs4StateManager::deleg_states_));
+    mu_.register_metrics(metrics);
+}
+
+// Helper: fill Nfs4LockDenied from a lock table conflict.
 // If lock_states is provided, maps the conflicting owner key back to Nfs4LockOwner.
+static void fill_lock_denied(const LockConflict& conflict, Nfs4LockDenied& denied,
+                             const std::vector<Nfs4LockState>* lock_states) {
+    denied.offset = conflict.offset;
+    denied.length = conflict.length;
+    denied.locktype = conflict.exclusive ? WRITE_LT : READ_LT;
+    // Map string key back to Nfs4LockOwner if possible
+    if (lock_states) {
+        for (const auto& ls : *lock_states) {
+            if (Nfs4StateManager::make_lock_key(ls.lock_owner) == conflict.owner) {
+                denied.owner = ls.lock_owner;
+                break;
+            }
+        }
+    }
+}
+
+// Helper: check conflict via shared lock table, fill Nfs4LockDenied on conflict.
 static bool check_lock_conflict_v4(ByteRangeLockTable& table,
                                     const FileHandle& fh,
                                     const LockOwnerKey& requester_key,
@@ -481,18 +547,7 @@ static bool check_lock_conflict_v4(ByteRangeLockTable& table,
     LockConflict conflict;
     bool exclusive = (locktype == WRITE_LT || locktype == WRITEW_LT);
     if (table.test(fh, requester_key, exclusive, offset, length, conflict)) {
-        denied.offset = conflict.offset;
-        denied.length = conflict.length;
-        denied.locktype = conflict.exclusive ? WRITE_LT : READ_LT;
-        // Map string key back to Nfs4LockOwner if possible
-        if (lock_states) {
-            for (const auto& ls : *lock_states) {
-                if (Nfs4StateManager::make_lock_key(ls.lock_owner) == conflict.owner) {
-                    denied.owner = ls.lock_owner;
-                    break;
-                }
-            }
-        }
+        fill_lock_denied(conflict, denied, lock_states);
         return true;
     }
     return false;
@@ -509,7 +564,7 @@ Nfs4Stat Nfs4StateManager::lock_new(uint64_t clientid,
                                       uint64_t offset, uint64_t length,
                                       Nfs4StateId& out_stateid,
                                       Nfs4LockDenied& denied) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     // Find and validate open state
     auto* os = find_open_state(open_stateid);
@@ -523,15 +578,16 @@ Nfs4Stat Nfs4StateManager::lock_new(uint64_t clientid,
     if (open_seqid != 0) os->open_seqid = open_seqid;
     os->stateid.seqid++;
 
-    // Check for conflicts via shared lock table
+    // Test-and-acquire in the shared lock table as one step, so an NLM
+    // client cannot slip in between; a retry after CB_NOTIFY_LOCK ends the wait
     LockOwnerKey lock_key = make_lock_key(lock_owner);
-    if (check_lock_conflict_v4(lock_table_, fh, lock_key, locktype, offset, length, denied, &lock_states_))
-        return Nfs4Stat::NFS4ERR_DENIED;
-
-    // Acquire in shared lock table
     bool exclusive = (locktype == WRITE_LT || locktype == WRITEW_LT);
     LockConflict conflict;
-    lock_table_.acquire(fh, lock_key, exclusive, offset, length, conflict);
+    if (!lock_table_.acquire(fh, lock_key, exclusive, offset, length, conflict)) {
+        fill_lock_denied(conflict, denied, &lock_states_);
+        return Nfs4Stat::NFS4ERR_DENIED;
+    }
+    lock_table_.cancel_waiter(fh, lock_key, exclusive, offset, length);
 
     // Find or create lock state for this owner+fh
     auto* ls = find_lock_state_by_owner(lock_owner, fh);
@@ -572,7 +628,7 @@ Nfs4Stat Nfs4StateManager::lock_existing(const Nfs4StateId& lock_stateid,
                                            uint64_t offset, uint64_t length,
                                            Nfs4StateId& out_stateid,
                                            Nfs4LockDenied& denied) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     auto* ls = find_lock_state(lock_stateid);
     if (!ls) return Nfs4Stat::NFS4ERR_BAD_STATEID;
@@ -580,15 +636,16 @@ Nfs4Stat Nfs4StateManager::lock_existing(const Nfs4StateId& lock_stateid,
     if (lock_seqid != 0 && lock_seqid != ls->lock_seqid + 1)
         return Nfs4Stat::NFS4ERR_BAD_SEQID;
 
-    // Check for conflicts via shared lock table
+    // Test-and-acquire in the shared lock table as one step; a retry after
+    // CB_NOTIFY_LOCK ends the wait
     LockOwnerKey lock_key = make_lock_key(ls->lock_owner);
-    if (check_lock_conflict_v4(lock_table_, ls->fh, lock_key, locktype, offset, length, denied, &lock_states_))
-        return Nfs4Stat::NFS4ERR_DENIED;
-
-    // Acquire in shared lock table
     bool exclusive = (locktype == WRITE_LT || locktype == WRITEW_LT);
     LockConflict conflict;
-    lock_table_.acquire(ls->fh, lock_key, exclusive, offset, length, conflict);
+    if (!lock_table_.acquire(ls->fh, lock_key, exclusive, offset, length, conflict)) {
+        fill_lock_denied(conflict, denied, &lock_states_);
+        return Nfs4Stat::NFS4ERR_DENIED;
+    }
+    lock_table_.cancel_waiter(ls->fh, lock_key, exclusive, offset, length);
 
     ls->ranges.push_back({offset, length, locktype});
     if (lock_seqid != 0) ls->lock_seqid = lock_seqid;
@@ -609,7 +666,7 @@ Nfs4Stat Nfs4StateManager::lock_test(const FileHandle& fh,
                                        uint64_t offset, uint64_t length,
                                        const Nfs4LockOwner& lock_owner,
                                        Nfs4LockDenied& denied) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     LockOwnerKey lock_key = make_lock_key(lock_owner);
     if (check_lock_conflict_v4(lock_table_, fh, lock_key, locktype, offset, length, denied, &lock_states_))
@@ -623,7 +680,7 @@ Nfs4Stat Nfs4StateManager::lock_unlock(const Nfs4StateId& lock_stateid,
                                          uint32_t seqid,
                                          uint64_t offset, uint64_t length,
                                          Nfs4StateId& out_stateid) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     auto* ls = find_lock_state(lock_stateid);
     if (!ls) return Nfs4Stat::NFS4ERR_BAD_STATEID;
@@ -647,9 +704,172 @@ Nfs4Stat Nfs4StateManager::lock_unlock(const Nfs4StateId& lock_stateid,
     return Nfs4Stat::NFS4_OK;
 }
 
+// RFC 8881 §20.11 - Blocking lock waiters (CB_NOTIFY_LOCK)
+void Nfs4StateManager::add_lock_waiter41(const SessionId41& sid,
+                                         const Nfs4LockOwner& lock_owner,
+                                         const FileHandle& fh,
+                                         uint32_t locktype,
+                                         uint64_t offset, uint64_t length) {
+    std::lock_guard<ProfiledMutex> lk(mu_);
+    enqueue_lock_waiter(sid, lock_owner, fh, locktype, offset, length);
+}
+
+void Nfs4StateManager::add_lock_waiter41(const SessionId41& sid,
+                                         const Nfs4StateId& lock_stateid,
+                                         uint32_t locktype,
+                                         uint64_t offset, uint64_t length) {
+    std::lock_guard<ProfiledMutex> lk(mu_);
+    auto* ls = find_lock_state(lock_stateid);
+    if (!ls) return;
+    enqueue_lock_waiter(sid, ls->lock_owner, ls->fh, locktype, offset, length);
+}
+
+void Nfs4StateManager::enqueue_lock_waiter(const SessionId41& sid,
+                                           const Nfs4LockOwner& lock_owner,
+                                           const FileHandle& fh,
+                                           uint32_t locktype,
+                                           uint64_t offset, uint64_t length) {
+    // Only worth queueing if the client can actually be called back
+    auto it = sessions_.find(sid);
+    if (it == sessions_.end() || !it->second.back_channel.valid())
+        return;
+
+    PendingCallback n;
+    n.sessionid = sid;
+    n.fh = fh;
+    n.lock_owner = lock_owner;
+
+    LockWaiter w;
+    w.owner = make_lock_key(lock_owner);
+    w.fh = fh;
+    w.exclusive = (locktype == WRITE_LT || locktype == WRITEW_LT);
+    w.offset = offset;
+    w.length = length;
+    w.acquire = false;  // the client retries LOCK itself
+    w.on_ready = [this, n](const LockWaiter&) { queue_callback(n); };
+    lock_table_.enqueue_waiter(std::move(w));
+}
+
+void Nfs4StateManager::queue_callback(PendingCallback cb) {
+    {
+        std::lock_guard<std::mutex> nlk(notify_mu_);
+        notify_queue_.push_back(std::move(cb));
+    }
+    notify_cv_.notify_one();
+}
+
+// How long a session's slot 0 stays busy with a call the client has not
+// answered. After that the next call goes out with the same sequenceid: a
+// client that did take the lost one answers it as a retry, and either way
+// the slot is back in step.
+static constexpr auto kSlotReplyTimeout = std::chrono::seconds(5);
+
+void Nfs4StateManager::notify_loop() {
+    for (;;) {
+        PendingCallback n;
+        uint32_t xid;
+        {
+            std::unique_lock<std::mutex> nlk(notify_mu_);
+            // The oldest callback whose session's slot is free
+            auto next = notify_queue_.end();
+            for (;;) {
+                if (!notify_running_) return;
+                const auto now = std::chrono::steady_clock::now();
+                for (auto it = slot_calls_.begin(); it != slot_calls_.end();)
+                    it = now - it->second.sent >= kSlotReplyTimeout ? slot_calls_.erase(it)
+                                                                    : std::next(it);
+                next = std::find_if(notify_queue_.begin(), notify_queue_.end(),
+                                    [this](const PendingCallback& q) {
+                                        return !slot_calls_.count(q.sessionid);
+                                    });
+                if (next != notify_queue_.end()) break;
+                if (slot_calls_.empty())
+                    notify_cv_.wait(nlk);
+                else
+                    notify_cv_.wait_for(nlk, std::chrono::milliseconds(100));
+            }
+            n = std::move(*next);
+            notify_queue_.erase(next);
+            xid = notify_xid_++;
+        }
+
+        // The slot's next sequenceid, read under mu_ and sent without it;
+        // the session takes it only once the client's reply says it did
+        Nfs4BackChannel bc;
+        {
+            std::lock_guard<ProfiledMutex> lk(mu_);
+            auto it = sessions_.find(n.sessionid);
+            if (it == sessions_.end() || !it->second.back_channel.valid())
+                continue;
+            bc = it->second.back_channel;
+            bc.slot_seqid++;
+        }
+        // Busy before the send: the reply can beat send() returning
+        {
+            std::lock_guard<std::mutex> nlk(notify_mu_);
+            slot_calls_[n.sessionid] = {xid, bc.slot_seqid, std::chrono::steady_clock::now()};
+        }
+        bool sent;
+        if (n.recall)
+            sent = cb_recall41(bc, xid, bc.slot_seqid, n.deleg_stateid, false, n.fh);
+        else
+            sent = cb_notify_lock(bc, xid, bc.slot_seqid, n.fh,
+                                  n.lock_owner.clientid, n.lock_owner.owner);
+        if (!sent) {
+            std::lock_guard<std::mutex> nlk(notify_mu_);
+            auto it = slot_calls_.find(n.sessionid);
+            if (it != slot_calls_.end() && it->second.xid == xid) slot_calls_.erase(it);
+        }
+    }
+}
+
+void Nfs4StateManager::backchannel_reply(const uint8_t* data, size_t len) {
+    XdrDecoder dec(data, len);
+    SessionId41 sid{};
+    SlotCall call;
+    try {
+        const uint32_t xid = dec.decode_uint32();
+        std::lock_guard<std::mutex> nlk(notify_mu_);
+        auto it = std::find_if(slot_calls_.begin(), slot_calls_.end(),
+                               [xid](const auto& sc) { return sc.second.xid == xid; });
+        if (it == slot_calls_.end()) return;
+        sid = it->first;
+        call = it->second;
+        slot_calls_.erase(it);
+    } catch (const std::exception&) {
+        return;
+    }
+    notify_cv_.notify_one();
+
+    // The client took the sequenceid if its CB_SEQUENCE succeeded, or if
+    // it had already taken it (a retry of a call whose reply was lost)
+    bool taken = false;
+    try {
+        dec.decode_uint32();                              // REPLY
+        if (dec.decode_uint32() == 0) {                   // MSG_ACCEPTED
+            dec.decode_uint32(); dec.decode_opaque();     // verf
+            if (dec.decode_uint32() == 0) {               // SUCCESS
+                dec.decode_uint32();                      // CB_COMPOUND status
+                dec.decode_string();                      // tag
+                if (dec.decode_uint32() > 0 && dec.decode_uint32() == OP_CB_SEQUENCE) {
+                    const auto status = static_cast<Nfs4Stat>(dec.decode_uint32());
+                    taken = status == Nfs4Stat::NFS4_OK ||
+                            status == Nfs4Stat::NFS4ERR_RETRY_UNCACHED_REP;
+                }
+            }
+        }
+    } catch (const std::exception&) {
+    }
+    if (!taken) return;
+    std::lock_guard<ProfiledMutex> lk(mu_);
+    auto it = sessions_.find(sid);
+    if (it != sessions_.end() && it->second.back_channel.slot_seqid + 1 == call.seqid)
+        it->second.back_channel.slot_seqid = call.seqid;
+}
+
 // RFC 7530 §16.26 - RELEASE_LOCKOWNER
 Nfs4Stat Nfs4StateManager::release_lock_owner(const Nfs4LockOwner& lock_owner) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     // Release from shared lock table
     LockOwnerKey lock_key = make_lock_key(lock_owner);
@@ -674,7 +894,7 @@ Nfs4DelegState* Nfs4StateManager::find_deleg_state(const Nfs4StateId& sid) {
 }
 
 Nfs4Stat Nfs4StateManager::delegreturn(const Nfs4StateId& stateid) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     auto it = std::find_if(deleg_states_.begin(), deleg_states_.end(),
         [&](const Nfs4DelegState& ds) {
@@ -688,7 +908,7 @@ Nfs4Stat Nfs4StateManager::delegreturn(const Nfs4StateId& stateid) {
 }
 
 Nfs4Stat Nfs4StateManager::delegpurge(uint64_t clientid) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     deleg_states_.erase(
         std::remove_if(deleg_states_.begin(), deleg_states_.end(),
@@ -699,14 +919,14 @@ Nfs4Stat Nfs4StateManager::delegpurge(uint64_t clientid) {
 }
 
 Nfs4CallbackInfo Nfs4StateManager::get_client_callback(uint64_t clientid) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
     auto it = clients_.find(clientid);
     if (it == clients_.end()) return {};
     return it->second.cb_info;
 }
 
 void Nfs4StateManager::invalidate_client_callback(uint64_t clientid) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
     auto it = clients_.find(clientid);
     if (it != clients_.end())
         it->second.cb_info.valid = false;
@@ -714,7 +934,7 @@ void Nfs4StateManager::invalidate_client_callback(uint64_t clientid) {
 
 // RFC 8881 §18.51 - Auto-confirm open for NFSv4.1 (no seqid validation)
 void Nfs4StateManager::auto_confirm_open(const Nfs4StateId& stateid) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
     auto* os = find_open_state(stateid);
     if (os) os->confirmed = true;
 }
@@ -722,7 +942,7 @@ void Nfs4StateManager::auto_confirm_open(const Nfs4StateId& stateid) {
 // RFC 8881 §18.35 - EXCHANGE_ID
 std::pair<uint64_t, uint32_t>
 Nfs4StateManager::exchange_id41(const uint8_t verifier[8], const std::string& ownerid) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     std::vector<uint8_t> client_id(ownerid.begin(), ownerid.end());
 
@@ -752,8 +972,11 @@ Nfs4StateManager::exchange_id41(const uint8_t verifier[8], const std::string& ow
 
 // RFC 8881 §18.36 - CREATE_SESSION
 Nfs4Stat Nfs4StateManager::create_session41(uint64_t clientid, uint32_t sequence,
-                                              SessionId41& out_sessionid) {
-    std::lock_guard<std::mutex> lk(mu_);
+                                              SessionId41& out_sessionid,
+                                              const RpcBackChannel* back_channel,
+                                              uint32_t cb_program,
+                                              uint32_t slots) {
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     auto it = clients_.find(clientid);
     if (it == clients_.end())
@@ -771,39 +994,79 @@ Nfs4Stat Nfs4StateManager::create_session41(uint64_t clientid, uint32_t sequence
     Nfs4Session sess;
     sess.sessionid = sid;
     sess.clientid = clientid;
-    sess.slot_seqid = 0;
+    sess.slot_seqids.assign(std::clamp(slots, 1u, NFS4_MAX_SESSION_SLOTS), 0);
     sess.create_sequence = sequence;
+    sess.back_channel.sessionid = sid;
+    sess.back_channel.cb_program = cb_program;
+    if (back_channel)
+        sess.back_channel.send = *back_channel;
 
-    sessions_[sid] = sess;
+    sessions_[sid] = std::move(sess);
     out_sessionid = sid;
 
+    if (back_channel && *back_channel) {
+        it->second.cb_session = sid;
+        it->second.cb_session_set = true;
+    }
+
     it->second.last_renewed = std::chrono::steady_clock::now();
     return Nfs4Stat::NFS4_OK;
 }
 
+// RFC 8881 §18.34 - BIND_CONN_TO_SESSION: move the callback path
+Nfs4Stat Nfs4StateManager::bind_back_channel41(const SessionId41& sid,
+                                                const RpcBackChannel& back_channel) {
+    std::lock_guard<ProfiledMutex> lk(mu_);
+
+    auto it = sessions_.find(sid);
+    if (it == sessions_.end())
+        return Nfs4Stat::NFS4ERR_BADSESSION;
+
+    auto& bc = it->second.back_channel;
+    bc.sessionid = sid;
+    bc.send = back_channel;
+
+    auto cit = clients_.find(it->second.clientid);
+    if (cit != clients_.end() && back_channel) {
+        cit->second.cb_session = sid;
+        cit->second.cb_session_set = true;
+    }
+    return Nfs4Stat::NFS4_OK;
+}
+
 // RFC 8881 §18.46 - SEQUENCE validation
 Nfs4Stat Nfs4StateManager::validate_sequence41(const SessionId41& sid, uint32_t seqid,
-                                                uint32_t slotid) {
-    std::lock_guard<std::mutex> lk(mu_);
+                                                uint32_t slotid,
+                                                uint32_t* highest_slotid,
+                                                const RpcBackChannel* conn) {
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     auto it = sessions_.find(sid);
     if (it == sessions_.end())
         return Nfs4Stat::NFS4ERR_BADSESSION;
 
-    if (slotid != 0)
+    auto& sess = it->second;
+    if (sess.rebind_back_channel && conn && *conn) {
+        sess.back_channel.send = *conn;
+        sess.rebind_back_channel = false;
+    }
+    if (slotid >= sess.slot_seqids.size())
         return Nfs4Stat::NFS4ERR_BADSLOT;
+    if (highest_slotid)
+        *highest_slotid = static_cast<uint32_t>(sess.slot_seqids.size() - 1);
 
-    auto& sess = it->second;
-    if (seqid == sess.slot_seqid + 1) {
+    // RFC 8881 §2.10.6.1 - each slot carries its own sequence
+    uint32_t& slot_seqid = sess.slot_seqids[slotid];
+    if (seqid == slot_seqid + 1) {
         // Normal advance
-        sess.slot_seqid = seqid;
+        slot_seqid = seqid;
         // Renew client lease
         auto cit = clients_.find(sess.clientid);
         if (cit != clients_.end())
             cit->second.last_renewed = std::chrono::steady_clock::now();
         return Nfs4Stat::NFS4_OK;
-    } else if (seqid == sess.slot_seqid) {
-        // Replay — accept without updating slot_seqid
+    } else if (seqid == slot_seqid) {
+        // Replay — accept without updating the slot
         return Nfs4Stat::NFS4_OK;
     }
     return Nfs4Stat::NFS4ERR_SEQ_MISORDERED;
@@ -811,19 +1074,22 @@ Nfs4Stat Nfs4StateManager::validate_sequence41(const SessionId41& sid, uint32_t
 
 // RFC 8881 §18.37 - DESTROY_SESSION
 Nfs4Stat Nfs4StateManager::destroy_session41(const SessionId41& sid) {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
 
     auto it = sessions_.find(sid);
     if (it == sessions_.end())
         return Nfs4Stat::NFS4ERR_BADSESSION;
 
+    auto cit = clients_.find(it->second.clientid);
+    if (cit != clients_.end() && cit->second.cb_session_set && cit->second.cb_session == sid)
+        cit->second.cb_session_set = false;
     sessions_.erase(it);
     return Nfs4Stat::NFS4_OK;
 }
 
 // RFC 7530 §9.14 - Grace period
 bool Nfs4StateManager::in_grace_period() {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
     if (in_grace_period_) {
         auto elapsed = std::chrono::steady_clock::now() - grace_start_;
         if (elapsed > std::chrono::seconds(NFS4_LEASE_TIME))
@@ -833,6 +1099,263 @@ bool Nfs4StateManager::in_grace_period() {
 }
 
 void Nfs4StateManager::end_grace_period() {
-    std::lock_guard<std::mutex> lk(mu_);
+    std::lock_guard<ProfiledMutex> lk(mu_);
     in_grace_period_ = false;
 }
+
+// --- Binary upgrade ---
+
+static const uint32_t kStateImageVersion = 1;
+
+static void encode_fh(XdrEncoder& enc, const FileHandle& fh) {
+    enc.encode_opaque(fh.data(), fh.size());
+}
+
+static FileHandle decode_fh(XdrDecoder& dec) {
+    std::vector<uint8_t> b = dec.decode_opaque();
+    if (b.size() > FileHandle::kMaxSize) throw std::runtime_error("file handle too long");
+    return FileHandle(b.data(), b.size());
+}
+
+static void encode_stateid(XdrEncoder& enc, const Nfs4StateId& sid) {
+    enc.encode_uint32(sid.seqid);
+    enc.encode_opaque_fixed(sid.other, 12);
+}
+
+static Nfs4StateId decode_stateid(XdrDecoder& dec) {
+    Nfs4StateId sid;
+    sid.seqid = dec.decode_uint32();
+    dec.decode_opaque_fixed(sid.other, 12);
+    return sid;
+}
+
+// Steady clocks do not compare across processes; ages do
+static void encode_age(XdrEncoder& enc, std::chrono::steady_clock::time_point t,
+                       std::chrono::steady_clock::time_point now) {
+    auto age = std::chrono::duration_cast<std::chrono::nanoseconds>(now - t).count();
+    enc.encode_uint64(age > 0 ? static_cast<uint64_t>(age) : 0);
+}
+
+static std::chrono::steady_clock::time_point decode_age(
+    XdrDecoder& dec, std::chrono::steady_clock::time_point now) {
+    return now - std::chrono::nanoseconds(dec.decode_uint64());
+}
+
+void Nfs4StateManager::save_state(XdrEncoder& enc) {
+    std::lock_guard<ProfiledMutex> lk(mu_);
+    const auto now = std::chrono::steady_clock::now();
+    enc.encode_uint32(kStateImageVersion);
+    enc.encode_uint64(next_clientid_);
+    enc.encode_uint64(next_state_counter_);
+    enc.encode_bool(in_grace_period_);
+    encode_age(enc, grace_start_, now);
+
+    enc.encode_uint32(static_cast<uint32_t>(clients_.size()));
+    for (const auto& [cid, c] : clients_) {
+        enc.encode_uint64(cid);
+        enc.encode_opaque_fixed(c.verifier, 8);
+        enc.encode_opaque_fixed(c.confirm_verifier, 8);
+        enc.encode_opaque(c.client_id.data(), c.client_id.size());
+        enc.encode_bool(c.confirmed);
+        encode_age(enc, c.last_renewed, now);
+        enc.encode_uint32(c.cb_info.cb_program);
+        enc.encode_string(c.cb_info.r_netid);
+        enc.encode_string(c.cb_info.r_addr);
+        enc.encode_uint32(c.cb_info.callback_ident);
+        enc.encode_bool(c.cb_info.valid);
+        enc.encode_uint32(c.exchange_seqid);
+        enc.encode_opaque_fixed(c.cb_session.data(), 16);
+        enc.encode_bool(c.cb_session_set);
+    }
+
+    enc.encode_uint32(static_cast<uint32_t>(sessions_.size()));
+    for (const auto& [sid, sess] : sessions_) {
+        enc.encode_opaque_fixed(sid.data(), 16);
+        enc.encode_uint64(sess.clientid);
+        enc.encode_uint32(static_cast<uint32_t>(sess.slot_seqids.size()));
+        for (uint32_t seq : sess.slot_seqids) enc.encode_uint32(seq);
+        enc.encode_uint32(sess.create_sequence);
+        enc.encode_uint32(sess.back_channel.cb_program);
+        enc.encode_uint32(sess.back_channel.slot_seqid);
+        enc.encode_bool(sess.back_channel.valid() || sess.rebind_back_channel);
+    }
+
+    enc.encode_uint32(static_cast<uint32_t>(open_states_.size()));
+    for (const auto& os : open_states_) {
+        encode_stateid(enc, os.stateid);
+        enc.encode_uint64(os.clientid);
+        encode_fh(enc, os.fh);
+        enc.encode_uint32(os.access);
+        enc.encode_uint32(os.deny);
+        enc.encode_opaque(os.owner.data(), os.owner.size());
+        enc.encode_uint32(os.open_seqid);
+        enc.encode_bool(os.confirmed);
+    }
+
+    enc.encode_uint32(static_cast<uint32_t>(lock_states_.size()));
+    for (const auto& ls : lock_states_) {
+        encode_stateid(enc, ls.stateid);
+        enc.encode_uint64(ls.lock_owner.clientid);
+        enc.encode_opaque(ls.lock_owner.owner.data(), ls.lock_owner.owner.size());
+        encode_fh(enc, ls.fh);
+        enc.encode_uint64(ls.clientid);
+        enc.encode_opaque_fixed(ls.open_stateid_other, 12);
+        enc.encode_uint32(ls.lock_seqid);
+        enc.encode_uint32(static_cast<uint32_t>(ls.ranges.size()));
+        for (const auto& r : ls.ranges) {
+            enc.encode_uint64(r.offset);
+            enc.encode_uint64(r.length);
+            enc.encode_uint32(r.locktype);
+        }
+    }
+
+    enc.encode_uint32(static_cast<uint32_t>(deleg_states_.size()));
+    for (const auto& ds : deleg_states_) {
+        encode_stateid(enc, ds.stateid);
+        enc.encode_uint64(ds.clientid);
+        encode_fh(enc, ds.fh);
+        enc.encode_uint32(ds.deleg_type);
+        enc.encode_bool(ds.recalled);
+    }
+
+    std::vector<LockEntry> locks = lock_table_.entries();
+    enc.encode_uint32(static_cast<uint32_t>(locks.size()));
+    for (const auto& e : locks) {
+        enc.encode_string(e.owner);
+        encode_fh(enc, e.fh);
+        enc.encode_uint32(static_cast<uint32_t>(e.ranges.size()));
+        for (const auto& r : e.ranges) {
+            enc.encode_uint64(r.offset);
+            enc.encode_uint64(r.length);
+            enc.encode_bool(r.exclusive);
+        }
+    }
+}
+
+bool Nfs4StateManager::restore_state(XdrDecoder& dec) {
+    const auto now = std::chrono::steady_clock::now();
+    std::map<uint64_t, Nfs4Client> clients;
+    std::map<SessionId41, Nfs4Session> sessions;
+    std::vector<Nfs4OpenState> opens;
+    std::vector<Nfs4LockState> lock_states;
+    std::vector<Nfs4DelegState> delegs;
+    std::vector<LockEntry> locks;
+    uint64_t next_clientid, next_state_counter;
+    bool in_grace;
+    std::chrono::steady_clock::time_point grace_start;
+    try {
+        if (dec.decode_uint32() != kStateImageVersion) return false;
+        next_clientid = dec.decode_uint64();
+        next_state_counter = dec.decode_uint64();
+        in_grace = dec.decode_bool();
+        grace_start = decode_age(dec, now);
+
+        for (uint32_t n = dec.decode_uint32(); n > 0; n--) {
+            Nfs4Client c;
+            c.clientid = dec.decode_uint64();
+            dec.decode_opaque_fixed(c.verifier, 8);
+            dec.decode_opaque_fixed(c.confirm_verifier, 8);
+            c.client_id = dec.decode_opaque();
+            c.confirmed = dec.decode_bool();
+            c.last_renewed = decode_age(dec, now);
+            c.cb_info.cb_program = dec.decode_uint32();
+            c.cb_info.r_netid = dec.decode_string();
+            c.cb_info.r_addr = dec.decode_string();
+            c.cb_info.callback_ident = dec.decode_uint32();
+            c.cb_info.valid = dec.decode_bool();
+            c.exchange_seqid = dec.decode_uint32();
+            dec.decode_opaque_fixed(c.cb_session.data(), 16);
+            c.cb_session_set = dec.decode_bool();
+            clients[c.clientid] = std::move(c);
+        }
+
+        for (uint32_t n = dec.decode_uint32(); n > 0; n--) {
+            Nfs4Session sess;
+            dec.decode_opaque_fixed(sess.sessionid.data(), 16);
+            sess.clientid = dec.decode_uint64();
+            uint32_t slots = dec.decode_uint32();
+            if (slots == 0 || slots > NFS4_MAX_SESSION_SLOTS) return false;
+            sess.slot_seqids.resize(slots);
+            for (auto& seq : sess.slot_seqids) seq = dec.decode_uint32();
+            sess.create_sequence = dec.decode_uint32();
+            sess.back_channel.sessionid = sess.sessionid;
+            sess.back_channel.cb_program = dec.decode_uint32();
+            sess.back_channel.slot_seqid = dec.decode_uint32();
+            sess.rebind_back_channel = dec.decode_bool();
+            sessions[sess.sessionid] = std::move(sess);
+        }
+
+        for (uint32_t n = dec.decode_uint32(); n > 0; n--) {
+            Nfs4OpenState os;
+            os.stateid = decode_stateid(dec);
+            os.clientid = dec.decode_uint64();
+            os.fh = decode_fh(dec);
+            os.access = dec.decode_uint32();
+            os.deny = dec.decode_uint32();
+            os.owner = dec.decode_opaque();
+            os.open_seqid = dec.decode_uint32();
+            os.confirmed = dec.decode_bool();
+            opens.push_back(std::move(os));
+        }
+
+        for (uint32_t n = dec.decode_uint32(); n > 0; n--) {
+            Nfs4LockState ls;
+            ls.stateid = decode_stateid(dec);
+            ls.lock_owner.clientid = dec.decode_uint64();
+            ls.lock_owner.owner = dec.decode_opaque();
+            ls.fh = decode_fh(dec);
+            ls.clientid = dec.decode_uint64();
+            dec.decode_opaque_fixed(ls.open_stateid_other, 12);
+            ls.lock_seqid = dec.decode_uint32();
+            for (uint32_t r = dec.decode_uint32(); r > 0; r--) {
+                Nfs4LockRange range;
+                range.offset = dec.decode_uint64();
+                range.length = dec.decode_uint64();
+                range.locktype = dec.decode_uint32();
+                ls.ranges.push_back(range);
+            }
+            lock_states.push_back(std::move(ls));
+        }
+
+        for (uint32_t n = dec.decode_uint32(); n > 0; n--) {
+            Nfs4DelegState ds;
+            ds.stateid = decode_stateid(dec);
+            ds.clientid = dec.decode_uint64();
+            ds.fh = decode_fh(dec);
+            ds.deleg_type = dec.decode_uint32();
+            ds.recalled = dec.decode_bool();
+            delegs.push_back(std::move(ds));
+        }
+
+        for (uint32_t n = dec.decode_uint32(); n > 0; n--) {
+            LockEntry e;
+            e.owner = dec.decode_string();
+            e.fh = decode_fh(dec);
+            for (uint32_t r = dec.decode_uint32(); r > 0; r--) {
+                LockRange range;
+                range.offset = dec.decode_uint64();
+                range.length = dec.decode_uint64();
+                range.exclusive = dec.decode_bool();
+                e.ranges.push_back(range);
+            }
+            locks.push_back(std::move(e));
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+
+    std::lock_guard<ProfiledMutex> lk(mu_);
+    next_clientid_ = next_clientid;
+    next_state_counter_ = next_state_counter;
+    in_grace_period_ = in_grace;
+    grace_start_ = grace_start;
+    clients_ = std::move(clients);
+    client_id_to_clientid_.clear();
+    for (const auto& [cid, c] : clients_) client_id_to_clientid_[c.client_id] = cid;
+    sessions_ = std::move(sessions);
+    open_states_ = std::move(opens);
+    lock_states_ = std::move(lock_states);
+    deleg_states_ = std::move(delegs);
+    lock_table_.restore(locks);
+    return true;
+}
@@ -5,13 +5,20 @@
 #include "vfs/vfs.h"
 #include <array>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <atomic>
+#include <deque>
 #include <map>
 #include <mutex>
 #include <thread>
 #include <vector>
 #include "locking/lock_table.h"
+#include "stats/metrics.h"
+#include "stats/profiled_mutex.h"
+
+class XdrEncoder;
+class XdrDecoder;
 
 // RFC 7530 §3.2 - NFSv4 client and open state management
 
@@ -24,14 +31,21 @@ struct Nfs4Client {
     std::chrono::steady_clock::time_point last_renewed;
     Nfs4CallbackInfo cb_info;          // callback channel from SETCLIENTID
     uint32_t exchange_seqid{1};        // RFC 8881 - eir_sequenceid returned by EXCHANGE_ID
+    SessionId41 cb_session{};          // RFC 8881 - session whose backchannel carries CB_RECALL
+    bool cb_session_set = false;
 };
 
-// RFC 8881 §2.10 - NFSv4.1 session state (single-slot, slotid=0)
+// RFC 8881 §2.10 - NFSv4.1 session state
 struct Nfs4Session {
     SessionId41 sessionid{};
     uint64_t    clientid{};
-    uint32_t    slot_seqid{0};      // last accepted sa_sequenceid for slot 0
+    std::vector<uint32_t> slot_seqids = std::vector<uint32_t>(1, 0);  // last sa_sequenceid per slot
     uint32_t    create_sequence{};  // csa_sequence used to create this session
+    Nfs4BackChannel back_channel;   // set by CONN_BACK_CHAN / BIND_CONN_TO_SESSION
+    // Handed over by another process, which had a backchannel: the
+    // connection of the next SEQUENCE becomes it (the client's connections
+    // were handed over too)
+    bool rebind_back_channel = false;
 };
 
 // RFC 7530 §16.10 - Lock owner identity
@@ -105,7 +119,8 @@ public:
     Nfs4Stat confirm_clientid(uint64_t clientid,
                                const uint8_t confirm[8]);
 
-    // RFC 7530 §16.16 - OPEN
+    // RFC 7530 §16.16 - OPEN; want_deleg false is RFC 8881's
+    // OPEN4_SHARE_ACCESS_WANT_NO_DELEG
     Nfs4Stat open_file(uint64_t clientid,
                        const std::vector<uint8_t>& owner,
                        uint32_t seqid,
@@ -117,7 +132,8 @@ public:
                        Nfs4StateId& out_deleg_stateid,
                        Nfs4CallbackInfo& out_recall_cb,
                        Nfs4StateId& out_recall_deleg_sid,
-                       FileHandle& out_recall_fh);
+                       FileHandle& out_recall_fh,
+                       bool want_deleg = true);
 
     // RFC 7530 §16.18 - OPEN_CONFIRM
     Nfs4Stat confirm_open(const Nfs4StateId& stateid, uint32_t seqid,
@@ -132,12 +148,25 @@ public:
         exchange_id41(const uint8_t verifier[8], const std::string& ownerid);
 
     // RFC 8881 §18.36 - CREATE_SESSION
+    // If back_channel is given, the creating connection becomes the
+    // session's callback path for cb_program. The session gets `slots`
+    // fore channel slots (1..NFS4_MAX_SESSION_SLOTS).
     Nfs4Stat create_session41(uint64_t clientid, uint32_t sequence,
-                               SessionId41& out_sessionid);
-
-    // RFC 8881 §18.46 - SEQUENCE validation
+                               SessionId41& out_sessionid,
+                               const RpcBackChannel* back_channel = nullptr,
+                               uint32_t cb_program = 0,
+                               uint32_t slots = 1);
+
+    // RFC 8881 §18.34 - BIND_CONN_TO_SESSION (backchannel direction)
+    Nfs4Stat bind_back_channel41(const SessionId41& sid,
+                                  const RpcBackChannel& back_channel);
+
+    // RFC 8881 §18.46 - SEQUENCE validation; highest_slotid gets the
+    // session's highest usable slot. conn: the call's connection, which
+    // becomes the backchannel of a session that lost it in a handover.
     Nfs4Stat validate_sequence41(const SessionId41& sid, uint32_t seqid,
-                                  uint32_t slotid);
+                                  uint32_t slotid, uint32_t* highest_slotid = nullptr,
+                                  const RpcBackChannel* conn = nullptr);
 
     // RFC 8881 §18.37 - DESTROY_SESSION
     Nfs4Stat destroy_session41(const SessionId41& sid);
@@ -193,6 +222,24 @@ public:
                          uint64_t offset, uint64_t length,
                          Nfs4StateId& out_stateid);
 
+    // RFC 8881 §20.11 - Record a v4.1 blocking LOCK (READW_LT/WRITEW_LT)
+    // that was denied, so the client gets CB_NOTIFY_LOCK over the session
+    // backchannel once the range is released (LOCKU, CLOSE, lease expiry).
+    void add_lock_waiter41(const SessionId41& sid,
+                           const Nfs4LockOwner& lock_owner,
+                           const FileHandle& fh,
+                           uint32_t locktype,
+                           uint64_t offset, uint64_t length);
+    void add_lock_waiter41(const SessionId41& sid,
+                           const Nfs4StateId& lock_stateid,
+                           uint32_t locktype,
+                           uint64_t offset, uint64_t length);
+
+    // RFC 8881 §2.10.6.1 - A REPLY to one of our backchannel calls, read
+    // on the client's connection. Frees the session's slot 0 for the next
+    // call, and moves its sequenceid on if the client's CB_SEQUENCE did.
+    void backchannel_reply(const uint8_t* data, size_t len);
+
     // RFC 7530 §16.26 - RELEASE_LOCKOWNER
     Nfs4Stat release_lock_owner(const Nfs4LockOwner& lock_owner);
 
@@ -212,15 +259,25 @@ public:
     bool in_grace_period();
     void end_grace_period();
 
-    // Shared lock table (used by both NFSv4 and NLM)
+    // Shared lock table (used by both NFSv4 and NLM). Internally
+    // synchronized; NLM never takes mu_.
     ByteRangeLockTable& lock_table() { return lock_table_; }
 
-    // Expose lock mutex for cross-protocol synchronization (NLM)
-    std::mutex& lock_mutex() { return mu_; }
-
     // Build a lock owner key for the shared table
     static LockOwnerKey make_lock_key(const Nfs4LockOwner& owner);
 
+    // Binary upgrade: every client, session, open, lock and delegation,
+    // the shared lock table (NLM's locks included) and the lease and grace
+    // clocks, as ages. Queued lock requests and pending callbacks are not
+    // carried over; clients retry them.
+    void save_state(XdrEncoder& enc);
+    // Replace all state with a save_state() image. Returns false, keeping
+    // the current state, if the image is malformed.
+    bool restore_state(XdrDecoder& dec);
+
+    // Export client/session/state counts as gauges
+    void register_metrics(MetricsRegistry& metrics);
+
 private:
     // Lookup open state by stateid.other bytes
     Nfs4OpenState* find_open_state(const Nfs4StateId& sid);
@@ -236,7 +293,24 @@ private:
     void expire_clients();
     void reaper_loop();
 
-    std::mutex mu_;
+    // RFC 8881 §20.11 / §20.2 - Backchannel callbacks (CB_NOTIFY_LOCK and
+    // CB_RECALL). They are queued with mu_ held; notify_loop() sends them
+    // without it.
+    struct PendingCallback {
+        SessionId41 sessionid{};
+        FileHandle fh;
+        Nfs4LockOwner lock_owner;  // CB_NOTIFY_LOCK
+        bool recall = false;       // CB_RECALL of deleg_stateid instead
+        Nfs4StateId deleg_stateid;
+    };
+    void queue_callback(PendingCallback cb);
+    void enqueue_lock_waiter(const SessionId41& sid,
+                             const Nfs4LockOwner& lock_owner,
+                             const FileHandle& fh, uint32_t locktype,
+                             uint64_t offset, uint64_t length);
+    void notify_loop();
+
+    ProfiledMutex mu_{"nfs4_state"};
     uint64_t next_clientid_ = 1;
     uint64_t next_state_counter_ = 1;
     std::map<uint64_t, Nfs4Client> clients_;                       // clientid -> client
@@ -256,4 +330,19 @@ private:
 
     std::atomic<bool> reaper_running_{true};
     std::thread reaper_thread_;
+
+    std::mutex notify_mu_;  // ordered after mu_
+    std::condition_variable notify_cv_;
+    std::deque<PendingCallback> notify_queue_;
+    bool notify_running_ = true;
+    uint32_t notify_xid_ = 1;  // notify_loop() only
+    // A session's slot 0 call awaiting its reply; the session's next call
+    // waits for it, or for the timeout. Guarded by notify_mu_.
+    struct SlotCall {
+        uint32_t xid = 0;
+        uint32_t seqid = 0;
+        std::chrono::steady_clock::time_point sent;
+    };
+    std::map<SessionId41, SlotCall> slot_calls_;
+    std::thread notify_thread_;
 };
@@ -121,6 +121,7 @@ enum class Nfs4Stat : uint32_t {
     NFS4ERR_DEADSESSION               = 10056,
     NFS4ERR_SEQ_FALSE_RETRY           = 10060,
     NFS4ERR_SEQ_MISORDERED            = 10063,
+    NFS4ERR_RETRY_UNCACHED_REP        = 10068,
 };
 
 // RFC 7530 §5.8.1.2 - nfs_ftype4
@@ -202,6 +203,10 @@ constexpr uint32_t OPEN4_SHARE_ACCESS_WRITE = 2;
 constexpr uint32_t OPEN4_SHARE_ACCESS_BOTH  = 3;
 constexpr uint32_t OPEN4_SHARE_DENY_NONE    = 0;
 
+// RFC 8881 §18.16.3 - NFSv4.1 delegation wants carried in share_access
+constexpr uint32_t OPEN4_SHARE_ACCESS_WANT_DELEG_MASK = 0xFF00;
+constexpr uint32_t OPEN4_SHARE_ACCESS_WANT_NO_DELEG   = 0x0400;
+
 // RFC 7530 §16.16 - open type
 constexpr uint32_t OPEN4_NOCREATE = 0;
 constexpr uint32_t OPEN4_CREATE   = 1;
@@ -248,6 +253,10 @@ constexpr uint32_t CB_NULL = 0;
 constexpr uint32_t CB_COMPOUND = 1;
 constexpr uint32_t OP_CB_RECALL = 4;
 
+// RFC 8881 §20 - NFSv4.1 callback operations
+constexpr uint32_t OP_CB_SEQUENCE    = 11;
+constexpr uint32_t OP_CB_NOTIFY_LOCK = 13;
+
 // RFC 7530 §16.16 - write delegation space limit
 constexpr uint32_t NFS_LIMIT_SIZE = 1;
 
@@ -290,9 +299,25 @@ constexpr uint32_t NFS4_LEASE_TIME = 90;
 // RFC 8881 - NFSv4.1 session ID (16-byte opaque)
 using SessionId41 = std::array<uint8_t, 16>;
 
+// RFC 8881 §2.10.6.1 - Most fore channel slots granted to one session;
+// a larger ca_maxrequests in CREATE_SESSION is clamped to this
+constexpr uint32_t NFS4_MAX_SESSION_SLOTS = 64;
+
 // RFC 8881 §18.35 - EXCHANGE_ID flag
 constexpr uint32_t EXCHGID4_FLAG_USE_NON_PNFS = 0x00020000;
 
+// RFC 8881 §18.36 - CREATE_SESSION flag: use this connection for callbacks
+constexpr uint32_t CREATE_SESSION4_FLAG_CONN_BACK_CHAN = 0x00000002;
+
+// RFC 8881 §18.34 - BIND_CONN_TO_SESSION channel directions
+constexpr uint32_t CDFC4_FORE         = 0x1;
+constexpr uint32_t CDFC4_BACK         = 0x2;
+constexpr uint32_t CDFC4_FORE_OR_BOTH = 0x3;
+constexpr uint32_t CDFC4_BACK_OR_BOTH = 0x7;
+constexpr uint32_t CDFS4_FORE = 0x1;
+constexpr uint32_t CDFS4_BACK = 0x2;
+constexpr uint32_t CDFS4_BOTH = 0x3;
+
 // RFC 7530 §3.2 - stateid4
 struct Nfs4StateId {
     uint32_t seqid = 0;
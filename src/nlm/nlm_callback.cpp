@@ -0,0 +1,178 @@
+#include "nlm/nlm_callback.h"
+#include "xdr/xdr_codec.h"
+
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstring>
+
+// Open TCP connection to the client's NLM service with timeout
+static int connect_client(const std::string& host, uint16_t port, int timeout_sec) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    struct timeval tv;
+    tv.tv_sec = timeout_sec;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+        close(fd);
+        return -1;
+    }
+
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send data with TCP record marking (last-fragment bit set)
+static bool send_record(int fd, const uint8_t* data, size_t len) {
+    uint32_t hdr = htonl(static_cast<uint32_t>(len) | 0x80000000);
+    if (send(fd, &hdr, 4, MSG_NOSIGNAL) != 4) return false;
+    ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+    return sent == static_cast<ssize_t>(len);
+}
+
+// Receive one complete RPC record (reassemble fragments)
+static bool recv_record(int fd, std::vector<uint8_t>& out) {
+    out.clear();
+    for (;;) {
+        uint8_t hdr_buf[4];
+        size_t got = 0;
+        while (got < 4) {
+            ssize_t n = recv(fd, hdr_buf + got, 4 - got, 0);
+            if (n <= 0) return false;
+            got += n;
+        }
+        uint32_t hdr = ntohl(*reinterpret_cast<uint32_t*>(hdr_buf));
+        bool last = (hdr & 0x80000000) != 0;
+        uint32_t frag_len = hdr & 0x7FFFFFFF;
+        if (frag_len > 1024 * 1024) return false;
+
+        size_t old_size = out.size();
+        out.resize(old_size + frag_len);
+        size_t read_so_far = 0;
+        while (read_so_far < frag_len) {
+            ssize_t n = recv(fd, out.data() + old_size + read_so_far,
+                             frag_len - read_so_far, 0);
+            if (n <= 0) return false;
+            read_so_far += n;
+        }
+        if (last) break;
+    }
+    return true;
+}
+
+// Encode RPC CALL header with AUTH_NONE
+static void encode_rpc_call(XdrEncoder& enc, uint32_t xid,
+                            uint32_t program, uint32_t version,
+                            uint32_t procedure) {
+    enc.encode_uint32(xid);
+    enc.encode_uint32(0);  // CALL
+    enc.encode_uint32(2);  // rpcvers
+    enc.encode_uint32(program);
+    enc.encode_uint32(version);
+    enc.encode_uint32(procedure);
+    // AUTH_NONE credentials
+    enc.encode_uint32(0);
+    enc.encode_uint32(0);
+    // AUTH_NONE verifier
+    enc.encode_uint32(0);
+    enc.encode_uint32(0);
+}
+
+// nlm4_testargs: cookie, exclusive, alock
+static void encode_granted_args(XdrEncoder& enc,
+                                const std::vector<uint8_t>& cookie,
+                                bool exclusive, const NlmLock& lock) {
+    enc.encode_opaque(cookie.data(), cookie.size());
+    enc.encode_bool(exclusive);
+    // nlm4_lock — caller_name is the granting server's name
+    char hostname[HOST_NAME_MAX + 1] = {};
+    gethostname(hostname, sizeof(hostname) - 1);
+    enc.encode_string(hostname);
+    enc.encode_opaque(lock.fh.data(), lock.fh.size());
+    enc.encode_opaque(lock.oh.data(), lock.oh.size());
+    enc.encode_uint32(lock.svid);
+    enc.encode_uint64(lock.offset);
+    enc.encode_uint64(lock.length);
+}
+
+NlmCallbackResult nlm_granted(const std::string& host, uint16_t port,
+                              uint32_t xid,
+                              const std::vector<uint8_t>& cookie,
+                              bool exclusive, const NlmLock& lock,
+                              int timeout_sec) {
+    int fd = connect_client(host, port, timeout_sec);
+    if (fd < 0) return NlmCallbackResult::UNREACHABLE;
+
+    XdrEncoder enc;
+    encode_rpc_call(enc, xid, NLM_PROGRAM, NLM_V4, NLMPROC4_GRANTED);
+    encode_granted_args(enc, cookie, exclusive, lock);
+
+    bool ok = send_record(fd, enc.data().data(), enc.size());
+    if (!ok) { close(fd); return NlmCallbackResult::UNREACHABLE; }
+
+    std::vector<uint8_t> reply;
+    ok = recv_record(fd, reply);
+    close(fd);
+
+    if (!ok || reply.size() < 24) return NlmCallbackResult::UNREACHABLE;
+
+    try {
+        // RPC reply: xid, REPLY(1), reply_stat(0=ACCEPTED), verifier, accept_stat
+        XdrDecoder dec(reply.data(), reply.size());
+        uint32_t reply_xid = dec.decode_uint32();
+        uint32_t msg_type = dec.decode_uint32();
+        if (reply_xid != xid || msg_type != 1) return NlmCallbackResult::UNREACHABLE;
+        uint32_t reply_stat = dec.decode_uint32();
+        if (reply_stat != 0) return NlmCallbackResult::UNREACHABLE;
+
+        // Skip verifier
+        dec.decode_uint32();
+        dec.decode_opaque();
+        uint32_t accept_stat = dec.decode_uint32();
+        if (accept_stat == 3)  // PROC_UNAVAIL
+            return NlmCallbackResult::PROC_UNAVAIL;
+        if (accept_stat != 0) return NlmCallbackResult::UNREACHABLE;
+
+        // nlm4_res: cookie, stat
+        dec.decode_opaque();
+        uint32_t stat = dec.decode_uint32();
+        return stat == static_cast<uint32_t>(NlmStat::LCK_GRANTED)
+                   ? NlmCallbackResult::GRANTED
+                   : NlmCallbackResult::DENIED;
+    } catch (...) {
+        return NlmCallbackResult::UNREACHABLE;
+    }
+}
+
+bool nlm_granted_msg(const std::string& host, uint16_t port,
+                     uint32_t xid,
+                     const std::vector<uint8_t>& cookie,
+                     bool exclusive, const NlmLock& lock,
+                     int timeout_sec) {
+    int fd = connect_client(host, port, timeout_sec);
+    if (fd < 0) return false;
+
+    XdrEncoder enc;
+    encode_rpc_call(enc, xid, NLM_PROGRAM, NLM_V4, NLMPROC4_GRANTED_MSG);
+    encode_granted_args(enc, cookie, exclusive, lock);
+
+    bool ok = send_record(fd, enc.data().data(), enc.size());
+    close(fd);
+    return ok;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "nlm/nlm_types.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// NLM v4 server -> client callbacks for blocked lock requests.
+// The client runs its own NLM service; the server calls it once a queued
+// LCK_BLOCKED request has been granted.
+
+enum class NlmCallbackResult {
+    GRANTED,        // client accepted the lock
+    DENIED,         // client no longer wants it (reply stat != LCK_GRANTED)
+    PROC_UNAVAIL,   // client does not implement NLMPROC4_GRANTED
+    UNREACHABLE,    // connect/send/receive failed or malformed reply
+};
+
+// Send NLMPROC4_GRANTED (nlm4_testargs) and wait for the nlm4_res reply.
+NlmCallbackResult nlm_granted(const std::string& host, uint16_t port,
+                              uint32_t xid,
+                              const std::vector<uint8_t>& cookie,
+                              bool exclusive, const NlmLock& lock,
+                              int timeout_sec = 5);
+
+// Send NLMPROC4_GRANTED_MSG. One-way: the client answers later with an
+// NLMPROC4_GRANTED_RES call carrying the same cookie.
+bool nlm_granted_msg(const std::string& host, uint16_t port,
+                     uint32_t xid,
+                     const std::vector<uint8_t>& cookie,
+                     bool exclusive, const NlmLock& lock,
+                     int timeout_sec = 5);
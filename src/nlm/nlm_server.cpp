@@ -1,8 +1,65 @@
 #include "nlm/nlm_server.h"
+#include "nlm/nlm_callback.h"
+#include "rpc/portmapper.h"
+#include "log/logger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <sstream>
 
-NlmServer::NlmServer(ByteRangeLockTable& lock_table, std::mutex& lock_mu)
-    : lock_table_(lock_table), lock_mu_(lock_mu) {}
+// Delivery attempts for one NLMPROC4_GRANTED callback before the lock is
+// released again.
+static constexpr int kGrantAttempts = 3;
+// Callback delivery threads: as many unreachable hosts as this can be
+// retried at once before the other hosts' callbacks wait
+static constexpr int kGrantThreads = 4;
+
+NlmServer::NlmServer(ByteRangeLockTable& lock_table)
+    : lock_table_(lock_table) {
+    port_resolver_ = [](const std::string& host) {
+        return pmap_getport(host, NLM_PROGRAM, NLM_V4);
+    };
+    for (int i = 0; i < kGrantThreads; i++)
+        grant_threads_.emplace_back(&NlmServer::grant_loop, this);
+}
+
+NlmServer::~NlmServer() {
+    {
+        std::lock_guard<std::mutex> lk(grant_mu_);
+        grant_running_ = false;
+    }
+    grant_cv_.notify_all();
+    for (auto& t : grant_threads_) t.join();
+}
+
+void NlmServer::set_port_resolver(PortResolver resolver) {
+    std::lock_guard<std::mutex> lk(grant_mu_);
+    port_resolver_ = std::move(resolver);
+}
+
+void NlmServer::register_metrics(MetricsRegistry& metrics) {
+    static const char* const kOutcomes[LOCK_OUTCOMES] = {
+        "granted", "denied", "blocked", "deadlock"};
+    for (int o = 0; o < LOCK_OUTCOMES; o++) {
+        metrics.counter("nfsd_nlm_lock_requests_total", "NLM LOCK requests by reply",
+                        {{"result", kOutcomes[o]}},
+                        [this, o] { return lock_outcomes_[o].load(std::memory_order_relaxed); });
+    }
+    metrics.counter("nfsd_nlm_grant_callbacks_total",
+                    "Blocked NLM locks granted: client notified, or lock released unclaimed",
+                    {{"result", "delivered"}},
+                    [this] { return grants_delivered_.load(std::memory_order_relaxed); });
+    metrics.counter("nfsd_nlm_grant_callbacks_total",
+                    "Blocked NLM locks granted: client notified, or lock released unclaimed",
+                    {{"result", "abandoned"}},
+                    [this] { return grants_abandoned_.load(std::memory_order_relaxed); });
+    metrics.gauge("nfsd_nlm_pending_grants", "Granted NLM locks awaiting client acknowledgement",
+                  {}, [this] {
+                      std::lock_guard<std::mutex> glk(grant_mu_);
+                      return static_cast<double>(grant_queue_.size() + delivering_.size() +
+                                                 awaiting_res_.size());
+                  });
+}
 
 RpcProgramHandlers NlmServer::get_handlers() {
     RpcProgramHandlers h;
@@ -11,6 +68,7 @@ RpcProgramHandlers NlmServer::get_handlers() {
     h.procedures[NLMPROC4_LOCK] = [this](auto& c, auto& a, auto& r) { proc_lock(c, a, r); };
     h.procedures[NLMPROC4_CANCEL] = [this](auto& c, auto& a, auto& r) { proc_cancel(c, a, r); };
     h.procedures[NLMPROC4_UNLOCK] = [this](auto& c, auto& a, auto& r) { proc_unlock(c, a, r); };
+    h.procedures[NLMPROC4_GRANTED_RES] = [this](auto& c, auto& a, auto& r) { proc_granted_res(c, a, r); };
     h.procedures[NLMPROC4_FREE_ALL] = [this](auto& c, auto& a, auto& r) { proc_free_all(c, a, r); };
     return h;
 }
@@ -36,10 +94,7 @@ NlmLock NlmServer::decode_nlm4_lock(XdrDecoder& dec) {
     lock.caller_name = dec.decode_string();
     // fh is variable-length opaque (fh3)
     auto fh_data = dec.decode_opaque();
-    if (fh_data.size() <= sizeof(lock.fh.data)) {
-        std::memcpy(lock.fh.data, fh_data.data(), fh_data.size());
-        lock.fh.len = fh_data.size();
-    }
+    lock.fh = FileHandle(fh_data.data(), fh_data.size());
     lock.oh = dec.decode_opaque();
     lock.svid = dec.decode_uint32();
     lock.offset = dec.decode_uint64();
@@ -60,8 +115,6 @@ void NlmServer::proc_test(const RpcCallHeader&, XdrDecoder& args, XdrEncoder& re
     // Encode cookie in reply
     reply.encode_opaque(cookie.data(), cookie.size());
 
-    std::lock_guard<std::mutex> lk(lock_mu_);
-
     LockOwnerKey key = make_nlm_key(lock);
     LockConflict conflict;
     if (lock_table_.test(lock.fh, key, exclusive,
@@ -81,7 +134,7 @@ void NlmServer::proc_test(const RpcCallHeader&, XdrDecoder& args, XdrEncoder& re
 }
 
 // NLMPROC4_LOCK — acquire a lock
-void NlmServer::proc_lock(const RpcCallHeader&, XdrDecoder& args, XdrEncoder& reply) {
+void NlmServer::proc_lock(const RpcCallHeader& call, XdrDecoder& args, XdrEncoder& reply) {
     auto cookie = decode_cookie(args);
     bool block = args.decode_bool();
     bool exclusive = args.decode_bool();
@@ -91,33 +144,81 @@ void NlmServer::proc_lock(const RpcCallHeader&, XdrDecoder& args, XdrEncoder& re
 
     reply.encode_opaque(cookie.data(), cookie.size());
 
-    std::lock_guard<std::mutex> lk(lock_mu_);
-
     LockOwnerKey key = make_nlm_key(lock);
     LockConflict conflict;
-    if (lock_table_.acquire(lock.fh, key, exclusive,
-                            lock.offset, nlm_length(lock.length), conflict)) {
+    uint64_t length = nlm_length(lock.length);
+    if (lock_table_.acquire(lock.fh, key, exclusive, lock.offset, length, conflict)) {
+        lock_outcomes_[LOCK_GRANTED].fetch_add(1, std::memory_order_relaxed);
         reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_GRANTED));
-    } else {
-        // Sync-only mode: if block=true, return LCK_BLOCKED (client will retry)
-        // If block=false, return LCK_DENIED
-        if (block)
-            reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_BLOCKED));
-        else
-            reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_DENIED));
+        return;
+    }
+
+    if (!block) {
+        lock_outcomes_[LOCK_DENIED].fetch_add(1, std::memory_order_relaxed);
+        reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_DENIED));
+        return;
     }
+
+    // Blocking request: queue it and call the client back with
+    // NLMPROC4_GRANTED once the conflicting lock is released; refused if
+    // waiting would close a cycle of owners waiting on each other.
+    PendingGrant g;
+    g.host = call.client_addr.empty() ? lock.caller_name : call.client_addr;
+    g.exclusive = exclusive;
+    g.lock = lock;
+    g.key = key;
+    if (queue_blocked(std::move(g), true) == 0) {
+        lock_outcomes_[LOCK_DEADLCK].fetch_add(1, std::memory_order_relaxed);
+        reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_DEADLCK));
+        return;
+    }
+
+    lock_outcomes_[LOCK_BLOCKED].fetch_add(1, std::memory_order_relaxed);
+    reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_BLOCKED));
 }
 
 // NLMPROC4_CANCEL — cancel a blocked lock request
 void NlmServer::proc_cancel(const RpcCallHeader&, XdrDecoder& args, XdrEncoder& reply) {
     auto cookie = decode_cookie(args);
     /*bool block =*/ args.decode_bool();
-    /*bool exclusive =*/ args.decode_bool();
+    bool exclusive = args.decode_bool();
     NlmLock lock = decode_nlm4_lock(args);
 
     reply.encode_opaque(cookie.data(), cookie.size());
-    // Sync-only mode: nothing to cancel (we don't queue blocked requests)
-    reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_GRANTED));
+
+    LockOwnerKey key = make_nlm_key(lock);
+    uint64_t length = nlm_length(lock.length);
+    if (lock_table_.cancel_waiter(lock.fh, key, exclusive, lock.offset, length)) {
+        {
+            std::lock_guard<std::mutex> glk(grant_mu_);
+            forget_blocked_locked(key, lock, exclusive);
+        }
+        reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_GRANTED));
+        return;
+    }
+
+    // Already granted but the callback has not gone out yet: the client
+    // gave up waiting, so take the lock back instead of delivering it.
+    bool revoked = false;
+    {
+        std::lock_guard<std::mutex> glk(grant_mu_);
+        for (auto it = grant_queue_.begin(); it != grant_queue_.end(); ++it) {
+            if (it->key == key && it->lock.fh == lock.fh &&
+                it->exclusive == exclusive && it->lock.offset == lock.offset &&
+                it->lock.length == lock.length) {
+                grant_queue_.erase(it);
+                revoked = true;
+                break;
+            }
+        }
+    }
+    if (revoked) {
+        lock_table_.release(lock.fh, key, lock.offset, length);
+        reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_GRANTED));
+        return;
+    }
+
+    reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_DENIED));
 }
 
 // NLMPROC4_UNLOCK — release a lock
@@ -127,8 +228,6 @@ void NlmServer::proc_unlock(const RpcCallHeader&, XdrDecoder& args, XdrEncoder&
 
     reply.encode_opaque(cookie.data(), cookie.size());
 
-    std::lock_guard<std::mutex> lk(lock_mu_);
-
     LockOwnerKey key = make_nlm_key(lock);
     lock_table_.release(lock.fh, key, lock.offset, nlm_length(lock.length));
     reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_GRANTED));
@@ -138,10 +237,263 @@ void NlmServer::proc_unlock(const RpcCallHeader&, XdrDecoder& args, XdrEncoder&
 void NlmServer::proc_free_all(const RpcCallHeader&, XdrDecoder& args, XdrEncoder&) {
     std::string name = args.decode_string();
     /*uint32_t state =*/ args.decode_uint32();
+    free_client(name);
+}
 
-    std::lock_guard<std::mutex> lk(lock_mu_);
-
-    // Release all locks with the "nlm:{name}:" prefix
+void NlmServer::free_client(const std::string& name) {
+    // Release all locks (and queued requests) with the "nlm:{name}:" prefix.
+    // Waiters go first: releasing the locks would otherwise grant them to
+    // the instance that is gone.
     std::string prefix = "nlm:" + name + ":";
+    {
+        std::lock_guard<std::mutex> glk(grant_mu_);
+        auto drop = [&](const PendingGrant& g) {
+            return g.key.compare(0, prefix.size(), prefix) == 0;
+        };
+        for (auto it = grant_queue_.begin(); it != grant_queue_.end();)
+            it = drop(*it) ? grant_queue_.erase(it) : std::next(it);
+        for (auto it = awaiting_res_.begin(); it != awaiting_res_.end();)
+            it = drop(it->second) ? awaiting_res_.erase(it) : std::next(it);
+        for (auto it = blocked_.begin(); it != blocked_.end();)
+            it = drop(it->second) ? blocked_.erase(it) : std::next(it);
+    }
+    lock_table_.cancel_waiters_matching(prefix);
     lock_table_.release_all_matching(prefix);
 }
+
+// NLMPROC4_GRANTED_RES — client's answer to an NLMPROC4_GRANTED_MSG callback
+void NlmServer::proc_granted_res(const RpcCallHeader&, XdrDecoder& args, XdrEncoder&) {
+    auto cookie = decode_cookie(args);
+    uint32_t stat = args.decode_uint32();
+
+    PendingGrant g;
+    {
+        std::lock_guard<std::mutex> glk(grant_mu_);
+        auto it = awaiting_res_.find(cookie);
+        if (it == awaiting_res_.end()) return;
+        g = std::move(it->second);
+        awaiting_res_.erase(it);
+    }
+    if (stat != static_cast<uint32_t>(NlmStat::LCK_GRANTED))
+        abandon_grant(g);
+}
+
+// --- Blocked requests ---
+
+static bool same_request(const LockOwnerKey& key_a, const NlmLock& a, bool exclusive_a,
+                         const LockOwnerKey& key_b, const NlmLock& b, bool exclusive_b) {
+    return key_a == key_b && a.fh == b.fh && exclusive_a == exclusive_b &&
+           a.offset == b.offset && a.length == b.length;
+}
+
+uint64_t NlmServer::queue_blocked(PendingGrant g, bool refuse_deadlock) {
+    LockWaiter w;
+    w.owner = g.key;
+    w.fh = g.lock.fh;
+    w.exclusive = g.exclusive;
+    w.offset = g.lock.offset;
+    w.length = nlm_length(g.lock.length);
+
+    // Recorded for save_state() until granted. A retransmission is queued
+    // already: the table keeps the first waiter, and so does blocked_.
+    uint64_t seq = 0;
+    {
+        std::lock_guard<std::mutex> glk(grant_mu_);
+        bool queued = false;
+        for (const auto& [n, b] : blocked_)
+            queued = queued || same_request(b.key, b.lock, b.exclusive, g.key, g.lock, g.exclusive);
+        if (!queued) {
+            seq = next_blocked_++;
+            blocked_[seq] = g;
+        }
+    }
+    w.on_ready = [this, g, seq](const LockWaiter& granted) mutable {
+        // Server cookie: the epoch and the waiter id, matched again in
+        // GRANTED_RES
+        g.cookie.resize(sizeof(cookie_epoch_) + sizeof(granted.id));
+        std::memcpy(g.cookie.data(), &cookie_epoch_, sizeof(cookie_epoch_));
+        std::memcpy(g.cookie.data() + sizeof(cookie_epoch_), &granted.id, sizeof(granted.id));
+        {
+            std::lock_guard<std::mutex> glk(grant_mu_);
+            blocked_.erase(seq);
+            grant_queue_.push_back(std::move(g));
+        }
+        grant_cv_.notify_one();
+    };
+    uint64_t id = lock_table_.enqueue_waiter(std::move(w), refuse_deadlock);
+    if (id == 0 && seq) {
+        std::lock_guard<std::mutex> glk(grant_mu_);
+        blocked_.erase(seq);
+    }
+    return id;
+}
+
+void NlmServer::forget_blocked_locked(const LockOwnerKey& key, const NlmLock& lock,
+                                      bool exclusive) {
+    for (auto it = blocked_.begin(); it != blocked_.end();)
+        it = same_request(it->second.key, it->second.lock, it->second.exclusive, key, lock,
+                          exclusive)
+                 ? blocked_.erase(it)
+                 : std::next(it);
+}
+
+// --- Binary upgrade ---
+
+void NlmServer::encode_grant(XdrEncoder& enc, const PendingGrant& g) {
+    enc.encode_string(g.host);
+    enc.encode_bool(g.exclusive);
+    enc.encode_string(g.lock.caller_name);
+    enc.encode_opaque(g.lock.fh.data(), g.lock.fh.size());
+    enc.encode_opaque(g.lock.oh.data(), g.lock.oh.size());
+    enc.encode_uint32(g.lock.svid);
+    enc.encode_uint64(g.lock.offset);
+    enc.encode_uint64(g.lock.length);
+    enc.encode_opaque(g.cookie.data(), g.cookie.size());
+}
+
+NlmServer::PendingGrant NlmServer::decode_grant(XdrDecoder& dec) {
+    PendingGrant g;
+    g.host = dec.decode_string();
+    g.exclusive = dec.decode_bool();
+    g.lock = decode_nlm4_lock(dec);
+    g.key = make_nlm_key(g.lock);
+    g.cookie = dec.decode_opaque();
+    return g;
+}
+
+// Image: cookie epoch, then three lists of requests: blocked (arrival
+// order), granted with the callback still to send, and granted with a
+// GRANTED_MSG awaiting its GRANTED_RES
+void NlmServer::save_state(XdrEncoder& enc) {
+    std::lock_guard<std::mutex> glk(grant_mu_);
+    enc.encode_uint32(cookie_epoch_);
+    enc.encode_uint32(static_cast<uint32_t>(blocked_.size()));
+    for (const auto& [seq, g] : blocked_) encode_grant(enc, g);
+
+    std::vector<const PendingGrant*> granted;
+    for (const auto& [host, g] : delivering_)
+        if (!awaiting_res_.count(g.cookie)) granted.push_back(&g);
+    for (const auto& g : grant_queue_) granted.push_back(&g);
+    enc.encode_uint32(static_cast<uint32_t>(granted.size()));
+    for (const PendingGrant* g : granted) encode_grant(enc, *g);
+
+    enc.encode_uint32(static_cast<uint32_t>(awaiting_res_.size()));
+    for (const auto& [cookie, g] : awaiting_res_) encode_grant(enc, g);
+}
+
+bool NlmServer::restore_state(XdrDecoder& dec) {
+    uint32_t epoch;
+    std::vector<PendingGrant> lists[3];
+    try {
+        epoch = dec.decode_uint32();
+        for (auto& list : lists)
+            for (uint32_t n = dec.decode_uint32(); n > 0; n--) list.push_back(decode_grant(dec));
+    } catch (const std::exception&) {
+        return false;
+    }
+    auto& [blocked, granted, awaiting] = lists;
+    cookie_epoch_ = epoch + 1;
+
+    // Granted first, so the blocked requests queue behind them. Their locks
+    // came with the lock table, unless one was released while the images
+    // were taken: then the request waits again.
+    for (auto& g : granted) {
+        LockConflict conflict;
+        if (lock_table_.acquire(g.lock.fh, g.key, g.exclusive, g.lock.offset,
+                                nlm_length(g.lock.length), conflict)) {
+            std::lock_guard<std::mutex> glk(grant_mu_);
+            grant_queue_.push_back(std::move(g));
+        } else {
+            queue_blocked(std::move(g), false);
+        }
+    }
+    grant_cv_.notify_one();
+    for (auto& g : blocked) queue_blocked(std::move(g), false);
+    {
+        std::lock_guard<std::mutex> glk(grant_mu_);
+        for (auto& g : awaiting) awaiting_res_[g.cookie] = std::move(g);
+    }
+    NFSD_LOG_INFO(LogSys::NLM, "blocked lock requests carried over",
+                  {{"blocked", blocked.size()}, {"granted", granted.size()},
+                   {"awaiting_res", awaiting.size()}});
+    return true;
+}
+
+// --- GRANTED callback delivery ---
+
+void NlmServer::grant_loop() {
+    for (;;) {
+        PendingGrant g;
+        {
+            std::unique_lock<std::mutex> glk(grant_mu_);
+            // The oldest callback whose host has none in flight
+            auto next = grant_queue_.end();
+            grant_cv_.wait(glk, [&] {
+                next = std::find_if(grant_queue_.begin(), grant_queue_.end(),
+                                    [this](const PendingGrant& q) {
+                                        return !delivering_.count(q.host);
+                                    });
+                return !grant_running_ || next != grant_queue_.end();
+            });
+            if (!grant_running_) return;
+            g = std::move(*next);
+            grant_queue_.erase(next);
+            delivering_[g.host] = g;
+        }
+        deliver_grant(g);
+        {
+            std::lock_guard<std::mutex> glk(grant_mu_);
+            delivering_.erase(g.host);
+        }
+        // The host's next callback, if any, can go now
+        grant_cv_.notify_all();
+    }
+}
+
+void NlmServer::deliver_grant(const PendingGrant& g) {
+    PortResolver resolve;
+    {
+        std::lock_guard<std::mutex> glk(grant_mu_);
+        resolve = port_resolver_;
+    }
+
+    for (int attempt = 0; attempt < kGrantAttempts; attempt++) {
+        if (attempt > 0)
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        uint16_t port = resolve ? resolve(g.host) : 0;
+        if (port == 0) continue;
+
+        auto result = nlm_granted(g.host, port, next_cb_xid_++,
+                                  g.cookie, g.exclusive, g.lock);
+        if (result == NlmCallbackResult::GRANTED) {
+            grants_delivered_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (result == NlmCallbackResult::DENIED) break;
+        if (result == NlmCallbackResult::PROC_UNAVAIL) {
+            // Client only speaks the async protocol. Register the cookie
+            // first: GRANTED_RES may arrive before the send returns.
+            {
+                std::lock_guard<std::mutex> glk(grant_mu_);
+                awaiting_res_[g.cookie] = g;
+            }
+            if (nlm_granted_msg(g.host, port, next_cb_xid_++,
+                                g.cookie, g.exclusive, g.lock)) {
+                grants_delivered_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            std::lock_guard<std::mutex> glk(grant_mu_);
+            awaiting_res_.erase(g.cookie);
+        }
+    }
+
+    NFSD_LOG_WARN(LogSys::NLM, "GRANTED callback not accepted, releasing lock",
+                  {{"host", g.host}});
+    abandon_grant(g);
+}
+
+void NlmServer::abandon_grant(const PendingGrant& g) {
+    grants_abandoned_.fetch_add(1, std::memory_order_relaxed);
+    lock_table_.release(g.lock.fh, g.key, g.lock.offset, nlm_length(g.lock.length));
+}
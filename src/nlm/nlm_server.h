@@ -3,23 +3,54 @@
 #include "rpc/rpc_server.h"
 #include "locking/lock_table.h"
 #include "nlm/nlm_types.h"
+#include "stats/metrics.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
 #include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 class NlmServer {
 public:
-    NlmServer(ByteRangeLockTable& lock_table, std::mutex& lock_mu);
+    explicit NlmServer(ByteRangeLockTable& lock_table);
+    ~NlmServer();
 
     // Returns RPC handlers to register with RpcServer.
     RpcProgramHandlers get_handlers();
 
+    // Resolves a client's NLM port for GRANTED callbacks.
+    // Default: portmapper GETPORT on the client host.
+    using PortResolver = std::function<uint16_t(const std::string& host)>;
+    void set_port_resolver(PortResolver resolver);
+
+    // A client rebooted (FREE_ALL, or NSM's SM_NOTIFY): drop its queued
+    // requests and pending callbacks, then release its locks
+    void free_client(const std::string& name);
+
+    // Export LOCK outcome and GRANTED callback counters
+    void register_metrics(MetricsRegistry& metrics);
+
+    // Binary upgrade: blocked requests in arrival order, and granted ones
+    // whose client has not accepted the GRANTED callback yet. Their locks
+    // go with the shared lock table (Nfs4Server::save_state()).
+    void save_state(XdrEncoder& enc);
+    // Adopt a save_state() image: queue the blocked requests again and
+    // resend the pending callbacks; false if malformed. Call after the
+    // lock table is restored, before serving.
+    bool restore_state(XdrDecoder& dec);
+
 private:
     void proc_null(const RpcCallHeader& call, XdrDecoder& args, XdrEncoder& reply);
     void proc_test(const RpcCallHeader& call, XdrDecoder& args, XdrEncoder& reply);
     void proc_lock(const RpcCallHeader& call, XdrDecoder& args, XdrEncoder& reply);
     void proc_cancel(const RpcCallHeader& call, XdrDecoder& args, XdrEncoder& reply);
     void proc_unlock(const RpcCallHeader& call, XdrDecoder& args, XdrEncoder& reply);
+    void proc_granted_res(const RpcCallHeader& call, XdrDecoder& args, XdrEncoder& reply);
     void proc_free_all(const RpcCallHeader& call, XdrDecoder& args, XdrEncoder& reply);
 
     // XDR decode helpers
@@ -32,6 +63,58 @@ private:
     // Convert NLM length (0 = EOF) to lock table length (UINT64_MAX = EOF)
     static uint64_t nlm_length(uint64_t len);
 
-    ByteRangeLockTable& lock_table_;
-    std::mutex& lock_mu_;  // shared with Nfs4StateManager
+    // A blocked request that the lock table has granted; the client must
+    // be told via NLMPROC4_GRANTED before it stops waiting.
+    struct PendingGrant {
+        std::string host;              // callback address
+        bool exclusive = false;
+        NlmLock lock;
+        LockOwnerKey key;
+        std::vector<uint8_t> cookie;   // server cookie, echoed in GRANTED_RES
+    };
+
+    // Queue g's request in the lock table; once granted, the callback is
+    // queued for delivery. Returns the waiter id, or 0 if refused as a
+    // deadlock (only with refuse_deadlock).
+    uint64_t queue_blocked(PendingGrant g, bool refuse_deadlock);
+    // Drop blocked_ entries for a request no longer queued; grant_mu_ held
+    void forget_blocked_locked(const LockOwnerKey& key, const NlmLock& lock, bool exclusive);
+
+    static void encode_grant(XdrEncoder& enc, const PendingGrant& g);
+    PendingGrant decode_grant(XdrDecoder& dec);
+
+    // Callback delivery runs on a few threads of its own so LOCK/UNLOCK
+    // never wait on a client's network round trip. Each host's callbacks
+    // go one at a time, in order; an unreachable host holds up only its
+    // own.
+    void grant_loop();
+    void deliver_grant(const PendingGrant& g);
+    // Release a granted lock the client did not accept (re-wakes waiters).
+    void abandon_grant(const PendingGrant& g);
+
+    ByteRangeLockTable& lock_table_;  // internally synchronized, shared with NFSv4
+
+    PortResolver port_resolver_;
+    std::atomic<uint32_t> next_cb_xid_{1};
+
+    std::mutex grant_mu_;  // ordered after the lock table's stripe locks
+    std::condition_variable grant_cv_;
+    std::deque<PendingGrant> grant_queue_;
+    // Taken off grant_queue_, being sent; by host, one at a time each
+    std::map<std::string, PendingGrant> delivering_;
+    std::map<std::vector<uint8_t>, PendingGrant> awaiting_res_;  // GRANTED_MSG sent
+    // Requests queued in the lock table, by arrival (no cookie yet)
+    std::map<uint64_t, PendingGrant> blocked_;
+    uint64_t next_blocked_ = 1;
+    // Leads every server cookie, so the cookies of callbacks carried over
+    // by an upgrade never match new ones; one more than the old process's
+    uint32_t cookie_epoch_ = 0;
+    bool grant_running_ = true;
+    std::vector<std::thread> grant_threads_;
+
+    // LOCK replies by outcome
+    enum LockOutcome { LOCK_GRANTED, LOCK_DENIED, LOCK_BLOCKED, LOCK_DEADLCK, LOCK_OUTCOMES };
+    std::atomic<uint64_t> lock_outcomes_[LOCK_OUTCOMES] = {};
+    std::atomic<uint64_t> grants_delivered_{0};
+    std::atomic<uint64_t> grants_abandoned_{0};
 };
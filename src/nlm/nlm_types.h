@@ -17,7 +17,11 @@ constexpr uint32_t NLMPROC4_TEST         = 1;
 constexpr uint32_t NLMPROC4_LOCK         = 2;
 constexpr uint32_t NLMPROC4_CANCEL       = 3;
 constexpr uint32_t NLMPROC4_UNLOCK       = 4;
-// Async MSG variants (7-12) not implemented — sync-only mode
+constexpr uint32_t NLMPROC4_GRANTED      = 5;   // server -> client callback
+// Async MSG variants (7-14) are not accepted from clients; GRANTED_MSG is
+// only sent as a fallback callback and answered with GRANTED_RES.
+constexpr uint32_t NLMPROC4_GRANTED_MSG  = 10;
+constexpr uint32_t NLMPROC4_GRANTED_RES  = 15;
 constexpr uint32_t NLMPROC4_FREE_ALL     = 23;
 
 // NLM status codes
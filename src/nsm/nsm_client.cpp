@@ -1,16 +1,16 @@
 #include "nsm/nsm_client.h"
 #include "rpc/portmapper.h"
 #include "xdr/xdr_codec.h"
+#include "log/logger.h"
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <cstring>
-#include <iostream>
 #include <vector>
 
-NsmClient::NsmClient(ByteRangeLockTable& lock_table, std::mutex& lock_mu)
-    : lock_table_(lock_table), lock_mu_(lock_mu) {}
+NsmClient::NsmClient(ByteRangeLockTable& lock_table)
+    : lock_table_(lock_table) {}
 
 // Connect to local statd on its discovered port
 static int connect_statd(uint16_t port, int timeout_sec) {
@@ -103,13 +103,15 @@ bool NsmClient::monitor(const std::string& client_name,
     // Look up statd port via portmapper
     uint16_t port = pmap_getport(SM_PROGRAM, SM_VERSION);
     if (port == 0) {
-        std::cerr << "  NSM: rpc.statd not registered with portmapper\n";
+        NFSD_LOG_WARN(LogSys::NSM, "rpc.statd not registered with portmapper",
+                      {{"client", client_name}});
         return false;
     }
 
     int fd = connect_statd(port, 2);
     if (fd < 0) {
-        std::cerr << "  NSM: cannot connect to rpc.statd on port " << port << "\n";
+        NFSD_LOG_WARN(LogSys::NSM, "cannot connect to rpc.statd",
+                      {{"client", client_name}, {"port", port}});
         return false;
     }
 
@@ -200,11 +202,20 @@ bool NsmClient::unmonitor_all(const std::string& my_name) {
     return ok;
 }
 
+void NsmClient::set_reboot_handler(RebootHandler handler) {
+    on_reboot_ = std::move(handler);
+}
+
 void NsmClient::handle_notify(const std::string& client_name) {
-    std::lock_guard<std::mutex> lk(lock_mu_);
-    // Release all NLM locks for this client
-    std::string prefix = "nlm:" + client_name + ":";
-    lock_table_.release_all_matching(prefix);
+    if (on_reboot_) {
+        on_reboot_(client_name);
+    } else {
+        // Cancel this client's waiters before its locks are released, so
+        // they are not granted to the instance that rebooted
+        std::string prefix = "nlm:" + client_name + ":";
+        lock_table_.cancel_waiters_matching(prefix);
+        lock_table_.release_all_matching(prefix);
+    }
 
     std::lock_guard<std::mutex> lk2(nsm_mu_);
     monitored_.erase(client_name);
@@ -2,6 +2,7 @@
 
 #include "locking/lock_table.h"
 #include <cstdint>
+#include <functional>
 #include <mutex>
 #include <set>
 #include <string>
@@ -18,7 +19,7 @@ constexpr uint32_t SM_UNMON_ALL = 4;
 
 class NsmClient {
 public:
-    NsmClient(ByteRangeLockTable& lock_table, std::mutex& lock_mu);
+    explicit NsmClient(ByteRangeLockTable& lock_table);
 
     // Monitor a client — call SM_MON on local rpc.statd.
     // Returns true if monitoring started, false if statd unreachable.
@@ -33,7 +34,14 @@ public:
     // Stop monitoring all clients.
     bool unmonitor_all(const std::string& my_name);
 
-    // Handle SM_NOTIFY callback — release all locks for the rebooted client.
+    // What a reboot frees beyond the lock table's locks — the NLM server's
+    // queued requests and pending callbacks (NlmServer::free_client()).
+    // Without one, handle_notify() only touches the lock table.
+    using RebootHandler = std::function<void(const std::string& client_name)>;
+    void set_reboot_handler(RebootHandler handler);
+
+    // Handle SM_NOTIFY callback — free everything the rebooted client held
+    // or waited for.
     void handle_notify(const std::string& client_name);
 
     // Check if a client is being monitored.
@@ -41,7 +49,7 @@ public:
 
 private:
     ByteRangeLockTable& lock_table_;
-    std::mutex& lock_mu_;
+    RebootHandler on_reboot_;
     std::mutex nsm_mu_;
     std::set<std::string> monitored_;
 };
@@ -3,20 +3,22 @@
 #include "nfs4/nfs4_types.h"
 #include "nlm/nlm_types.h"
 #include "xdr/xdr_codec.h"
+#include "log/logger.h"
 
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <chrono>
 #include <cstring>
 #include <iostream>
 #include <thread>
 #include <vector>
 
-// Connect to local portmapper (127.0.0.1:111) with timeout
-static int connect_portmapper(int timeout_sec) {
+// Connect to a portmapper (default 127.0.0.1:111) with timeout
+static int connect_portmapper(int timeout_sec, const char* host = "127.0.0.1") {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) return -1;
 
@@ -29,7 +31,10 @@ static int connect_portmapper(int timeout_sec) {
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_port = htons(111);
-    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        close(fd);
+        return -1;
+    }
 
     if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
         close(fd);
@@ -161,13 +166,14 @@ void pmap_register_all(uint16_t port) {
             registered = true;
             break;
         }
-        std::cerr << "  Portmapper not ready, retrying in 1s...\n";
+        NFSD_LOG_INFO(LogSys::PORTMAP, "portmapper not ready, retrying",
+                      {{"attempt", attempt + 1}, {"delay_s", 1}});
         std::this_thread::sleep_for(std::chrono::seconds(1));
     }
 
     if (!registered) {
-        std::cerr << "  Warning: could not register with portmapper"
-                  << " (rpcbind may not be running)\n";
+        NFSD_LOG_WARN(LogSys::PORTMAP, "could not register with portmapper (is rpcbind running?)",
+                      {{"port", port}});
         return;
     }
 
@@ -193,11 +199,15 @@ void pmap_unregister_all() {
 }
 
 uint16_t pmap_getport(uint32_t program, uint32_t version) {
-    int fd = connect_portmapper(2);
+    return pmap_getport("127.0.0.1", program, version);
+}
+
+uint16_t pmap_getport(const std::string& host, uint32_t program, uint32_t version) {
+    int fd = connect_portmapper(2, host.c_str());
     if (fd < 0) return 0;
 
     XdrEncoder enc;
-    static uint32_t xid = 100;
+    static std::atomic<uint32_t> xid{100};
     encode_rpc_call(enc, xid++, PMAP_PROGRAM, PMAP_VERSION, PMAPPROC_GETPORT);
 
     // mapping: {program, version, protocol, port(ignored)}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <string>
 
 // RFC 1833 - Portmapper v2 (program 100000) client
 // Registers/unregisters RPC programs with the local rpcbind daemon on port 111.
@@ -28,3 +29,7 @@ void pmap_unregister_all();
 // Look up the port for an RPC program/version via portmapper.
 // Returns 0 if not found or portmapper unreachable.
 uint16_t pmap_getport(uint32_t program, uint32_t version);
+
+// Same, against the portmapper on a remote host (dotted IPv4 address).
+// Used to find a client's NLM service for GRANTED callbacks.
+uint16_t pmap_getport(const std::string& host, uint32_t program, uint32_t version);
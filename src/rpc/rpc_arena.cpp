@@ -0,0 +1,60 @@
+#include "rpc/rpc_arena.h"
+
+#include <algorithm>
+
+RequestArena::RequestArena(size_t first_block, size_t max_retained,
+                           std::pmr::memory_resource* upstream)
+    : upstream_(upstream),
+      first_block_(std::max<size_t>(first_block, 64)),
+      max_retained_(std::max(max_retained, first_block_)) {
+    blocks_.reserve(8);
+    add_block(first_block_);
+}
+
+RequestArena::~RequestArena() {
+    free_blocks();
+}
+
+void RequestArena::add_block(size_t size) {
+    blocks_.push_back(
+        {static_cast<uint8_t*>(upstream_->allocate(size, alignof(std::max_align_t))), size});
+    capacity_ += size;
+    grows_++;
+}
+
+void* RequestArena::do_allocate(size_t bytes, size_t alignment) {
+    for (;;) {
+        Block& b = blocks_[cur_];
+        const uintptr_t base = reinterpret_cast<uintptr_t>(b.mem);
+        const size_t start = ((base + pos_ + alignment - 1) & ~(uintptr_t(alignment) - 1)) - base;
+        if (start + bytes <= b.size) {
+            pos_ = start + bytes;
+            return b.mem + start;
+        }
+        // Used up: on to a block kept from an earlier call, or a new one
+        // big enough for this and, doubling, for what follows
+        used_ += b.size;
+        cur_++;
+        pos_ = 0;
+        if (cur_ == blocks_.size())
+            add_block(std::max(b.size * 2, bytes + alignment));
+    }
+}
+
+void RequestArena::free_blocks() {
+    for (const Block& b : blocks_) upstream_->deallocate(b.mem, b.size, alignof(std::max_align_t));
+    blocks_.clear();
+}
+
+void RequestArena::reset() {
+    if (blocks_.size() > 1 || capacity_ > max_retained_) {
+        // One block for what the call needed, so the next like it fits
+        const size_t want = std::min(std::max(used(), first_block_), max_retained_);
+        free_blocks();
+        capacity_ = 0;
+        add_block(want);
+    }
+    cur_ = 0;
+    pos_ = 0;
+    used_ = 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+// Memory for one call's temporaries: the decoded credential, a COMPOUND's
+// tag and per-op results, bitmaps, the reply as it is built. Allocation
+// bumps a pointer; deallocation does nothing; reset(), once the reply is
+// sent, rewinds to the start for the next call. Nothing is freed between
+// calls, so once the arena has grown to fit a connection's calls they make
+// no heap allocations at all.
+//
+// A call that outgrows the arena gets another block from the heap; the
+// next reset() replaces the blocks with one that fits them all, up to
+// max_retained, so a burst of large READs does not pin megabytes on every
+// idle connection. Blocks come from upstream: the heap, or the buffer pool
+// of the connection's NUMA node (rpc/rpc_numa.h). Like the connection that
+// owns it, an arena serves one thread.
+
+class RequestArena : public std::pmr::memory_resource {
+public:
+    explicit RequestArena(size_t first_block = 16384, size_t max_retained = 262144,
+                          std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+    explicit RequestArena(std::pmr::memory_resource* upstream)
+        : RequestArena(16384, 262144, upstream) {}
+    ~RequestArena() override;
+
+    RequestArena(const RequestArena&) = delete;
+    RequestArena& operator=(const RequestArena&) = delete;
+
+    // Forget everything allocated; every pointer handed out is dead
+    void reset();
+
+    // Bytes held from the heap, and handed out since the last reset()
+    size_t capacity() const { return capacity_; }
+    size_t used() const { return used_ + pos_; }
+    // Blocks taken from the heap since construction
+    uint64_t grows() const { return grows_; }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void*, size_t, size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    void add_block(size_t size);
+    void free_blocks();
+
+    struct Block {
+        uint8_t* mem;
+        size_t size;
+    };
+    std::pmr::memory_resource* const upstream_;
+    const size_t first_block_;
+    const size_t max_retained_;
+    std::vector<Block> blocks_;
+    size_t cur_ = 0;   // block being carved
+    size_t pos_ = 0;   // offset into it
+    size_t used_ = 0;  // bytes of the blocks before it, padding included
+    size_t capacity_ = 0;
+    uint64_t grows_ = 0;
+};
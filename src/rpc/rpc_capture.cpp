@@ -0,0 +1,143 @@
+#include "rpc/rpc_capture.h"
+#include "stats/latency_stats.h"
+#include "stats/metrics.h"
+
+#include <chrono>
+#include <cstring>
+
+static const char kMagic[8] = {'N', 'F', 'S', 'D', 'C', 'A', 'P', '1'};
+static const uint32_t kVersion = 1;
+
+static void put_le(uint8_t* p, uint64_t v, size_t n) {
+    for (size_t i = 0; i < n; i++) p[i] = static_cast<uint8_t>(v >> (8 * i));
+}
+
+static uint64_t get_le(const uint8_t* p, size_t n) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; i++) v |= static_cast<uint64_t>(p[i]) << (8 * i);
+    return v;
+}
+
+RpcCapture::RpcCapture(const std::string& path, bool replies, size_t buffer_bytes,
+                       uint64_t max_file_bytes)
+    : replies_(replies), buffer_bytes_(buffer_bytes), max_file_bytes_(max_file_bytes),
+      start_ns_(LatencyStats::now_ns()), file_(path, std::ios::binary | std::ios::trunc) {
+    if (file_.is_open()) {
+        uint8_t hdr[kCaptureHeaderSize] = {};
+        std::memcpy(hdr, kMagic, sizeof(kMagic));
+        put_le(hdr + 8, kVersion, 4);
+        put_le(hdr + 12, replies ? kCaptureFlagReplies : 0, 4);
+        put_le(hdr + 16,
+               static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::system_clock::now().time_since_epoch()).count()),
+               8);
+        file_.write(reinterpret_cast<const char*>(hdr), sizeof(hdr));
+        file_.flush();
+    }
+    writer_ = std::thread(&RpcCapture::writer_loop, this);
+}
+
+RpcCapture::~RpcCapture() {
+    {
+        std::lock_guard<std::mutex> lk(stop_mu_);
+        stop_ = true;
+    }
+    stop_cv_.notify_all();
+    writer_.join();
+    flush();
+}
+
+void RpcCapture::record(CaptureKind kind, uint32_t conn, const uint8_t* data, size_t len) {
+    if (!file_.is_open()) return;
+    const size_t size = kCaptureRecordHeaderSize + len;
+    std::lock_guard<std::mutex> lk(mu_);
+    if (buffer_.size() + size > buffer_bytes_ ||
+        (max_file_bytes_ && reserved_ + size > max_file_bytes_)) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    size_t off = buffer_.size();
+    const size_t cap = buffer_.capacity();
+    buffer_.resize(off + size);
+    if (buffer_.capacity() != cap)
+        memory_bytes_.fetch_add(buffer_.capacity() - cap, std::memory_order_relaxed);
+    uint8_t* p = buffer_.data() + off;
+    p[0] = static_cast<uint8_t>(kind);
+    p[1] = p[2] = p[3] = 0;
+    put_le(p + 4, conn, 4);
+    put_le(p + 8, LatencyStats::now_ns() - start_ns_, 8);
+    put_le(p + 16, len, 4);
+    std::memcpy(p + kCaptureRecordHeaderSize, data, len);
+    reserved_ += size;
+    captured_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RpcCapture::flush() {
+    std::lock_guard<std::mutex> wlk(write_mu_);
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        buffer_.swap(spare_);
+    }
+    if (spare_.empty()) return;
+    file_.write(reinterpret_cast<const char*>(spare_.data()),
+                static_cast<std::streamsize>(spare_.size()));
+    file_.flush();
+    spare_.clear();
+}
+
+uint64_t RpcCapture::trim() {
+    flush();
+    std::lock_guard<std::mutex> wlk(write_mu_);
+    uint64_t freed = spare_.capacity();
+    std::vector<uint8_t>().swap(spare_);
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (buffer_.empty()) {
+            freed += buffer_.capacity();
+            std::vector<uint8_t>().swap(buffer_);
+        }
+    }
+    memory_bytes_.fetch_sub(freed, std::memory_order_relaxed);
+    return freed;
+}
+
+void RpcCapture::writer_loop() {
+    std::unique_lock<std::mutex> lk(stop_mu_);
+    while (!stop_) {
+        stop_cv_.wait_for(lk, std::chrono::milliseconds(100), [this] { return stop_; });
+        lk.unlock();
+        flush();
+        lk.lock();
+    }
+}
+
+void RpcCapture::register_metrics(MetricsRegistry& metrics) {
+    metrics.counter("nfsd_capture_records_total", "RPC records written to the capture file",
+                    {}, [this] { return captured(); });
+    metrics.counter("nfsd_capture_records_dropped_total",
+                    "RPC records not captured because the buffer or file was full", {},
+                    [this] { return dropped(); });
+}
+
+RpcCaptureReader::RpcCaptureReader(const std::string& path)
+    : file_(path, std::ios::binary) {
+    uint8_t hdr[kCaptureHeaderSize];
+    if (!file_.read(reinterpret_cast<char*>(hdr), sizeof(hdr))) return;
+    if (std::memcmp(hdr, kMagic, sizeof(kMagic)) != 0 || get_le(hdr + 8, 4) != kVersion) return;
+    flags_ = static_cast<uint32_t>(get_le(hdr + 12, 4));
+    start_wall_ns_ = get_le(hdr + 16, 8);
+    ok_ = true;
+}
+
+bool RpcCaptureReader::next(CaptureRecord& rec) {
+    if (!ok_) return false;
+    uint8_t hdr[kCaptureRecordHeaderSize];
+    if (!file_.read(reinterpret_cast<char*>(hdr), sizeof(hdr))) return false;
+    rec.kind = static_cast<CaptureKind>(hdr[0]);
+    rec.conn = static_cast<uint32_t>(get_le(hdr + 4, 4));
+    rec.ts_ns = get_le(hdr + 8, 8);
+    rec.data.resize(get_le(hdr + 16, 4));
+    return rec.data.empty() ||
+           static_cast<bool>(file_.read(reinterpret_cast<char*>(rec.data.data()),
+                                        static_cast<std::streamsize>(rec.data.size())));
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class MetricsRegistry;
+
+// RPC traffic capture for replay (bench/nfsreplay).
+//
+// RpcServer hands every record it receives, and optionally every reply it
+// sends, to record(). Records are copied into one bounded buffer and a
+// writer thread appends them to a binary trace file. A record that does not
+// fit in the buffer, or would take the file past its size limit, is dropped
+// and counted: capture never blocks a request.
+//
+// One buffer under a mutex rather than per-thread rings (RequestTracer,
+// Logger): the timestamp is taken under the lock, so the file is in
+// timestamp order, which replay relies on.
+//
+// File layout, little-endian:
+//
+//   header  "NFSDCAP1", u32 version (1), u32 flags (bit 0: replies),
+//           u64 wall-clock ns at start, u64 reserved
+//   record  u8 kind (CaptureKind), u8[3] zero, u32 connection id,
+//           u64 ns since start, u32 length, then the RPC message without
+//           its record mark
+
+enum class CaptureKind : uint8_t {
+    RECEIVED = 1,  // a record from the client (normally a call)
+    SENT = 2,      // a reply to the client
+};
+
+struct CaptureRecord {
+    CaptureKind kind = CaptureKind::RECEIVED;
+    uint32_t conn = 0;
+    uint64_t ts_ns = 0;
+    std::vector<uint8_t> data;
+};
+
+constexpr size_t kCaptureHeaderSize = 32;
+constexpr size_t kCaptureRecordHeaderSize = 20;
+constexpr uint32_t kCaptureFlagReplies = 1;
+
+class RpcCapture {
+public:
+    // buffer_bytes bounds what waits for the writer; max_file_bytes the
+    // file (0: unbounded)
+    RpcCapture(const std::string& path, bool replies, size_t buffer_bytes = 64 << 20,
+               uint64_t max_file_bytes = 0);
+    ~RpcCapture();
+
+    RpcCapture(const RpcCapture&) = delete;
+    RpcCapture& operator=(const RpcCapture&) = delete;
+
+    bool open() const { return file_.is_open(); }
+    bool replies() const { return replies_; }
+
+    void record(CaptureKind kind, uint32_t conn, const uint8_t* data, size_t len);
+
+    // Write everything buffered so far
+    void flush();
+
+    // Heap held by the buffers
+    uint64_t memory_bytes() const { return memory_bytes_.load(std::memory_order_relaxed); }
+    // Write everything buffered and release the buffers' memory; returns
+    // the bytes released. The next records grow them again.
+    uint64_t trim();
+
+    uint64_t captured() const { return captured_.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // nfsd_capture_records_total / nfsd_capture_records_dropped_total
+    void register_metrics(MetricsRegistry& metrics);
+
+private:
+    void writer_loop();
+
+    const bool replies_;
+    const size_t buffer_bytes_;
+    const uint64_t max_file_bytes_;
+    const uint64_t start_ns_;  // LatencyStats::now_ns() clock
+
+    std::mutex mu_;  // guards buffer_ and reserved_
+    std::vector<uint8_t> buffer_;
+    uint64_t reserved_ = kCaptureHeaderSize;  // file bytes written or buffered
+
+    std::mutex write_mu_;  // guards file_ and spare_
+    std::ofstream file_;
+    std::vector<uint8_t> spare_;
+
+    std::mutex stop_mu_;
+    std::condition_variable stop_cv_;
+    bool stop_ = false;
+    std::thread writer_;
+
+    std::atomic<uint64_t> memory_bytes_{0};  // capacity of buffer_ plus spare_
+    std::atomic<uint64_t> captured_{0};
+    std::atomic<uint64_t> dropped_{0};
+};
+
+// Sequential reader of a capture file
+class RpcCaptureReader {
+public:
+    explicit RpcCaptureReader(const std::string& path);
+
+    // False if the file is missing or not a capture
+    bool open() const { return ok_; }
+    bool replies() const { return flags_ & kCaptureFlagReplies; }
+    uint64_t start_wall_ns() const { return start_wall_ns_; }
+
+    // The next record; false at the end (a truncated last record included)
+    bool next(CaptureRecord& rec);
+
+private:
+    std::ifstream file_;
+    bool ok_ = false;
+    uint32_t flags_ = 0;
+    uint64_t start_wall_ns_ = 0;
+};
@@ -0,0 +1,312 @@
+#include "rpc/rpc_handoff.h"
+#include "log/logger.h"
+#include "stats/latency_stats.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+enum HandoffFrame : uint32_t { FRAME_READY = 1, FRAME_STATE, FRAME_CONNS, FRAME_DONE, FRAME_ACK };
+
+// Descriptors per frame; the kernel takes at most 253 (SCM_MAX_FD)
+static const size_t kFdsPerFrame = 200;
+// The new process has this long to start and then to restore the state
+static const int kStepTimeoutMs = 30000;
+// Calls in progress have this long to finish before their connections
+// are left behind
+static const uint64_t kDrainTimeoutNs = 5000000000ull;
+
+RpcHandoff::~RpcHandoff() {
+    if (fd_ >= 0) close(fd_);
+}
+
+void RpcHandoff::add_state(std::string name, SaveFn save, RestoreFn restore) {
+    states_.push_back({std::move(name), std::move(save), std::move(restore)});
+}
+
+static bool send_all(int fd, const uint8_t* p, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Wait until fd is readable or deadline_ns (LatencyStats::now_ns()) passes
+static bool wait_readable(int fd, uint64_t deadline_ns) {
+    for (;;) {
+        uint64_t now = LatencyStats::now_ns();
+        if (now >= deadline_ns) return false;
+        pollfd pfd{fd, POLLIN, 0};
+        int n = poll(&pfd, 1, static_cast<int>((deadline_ns - now) / 1000000 + 1));
+        if (n > 0) return true;
+        if (n < 0 && errno != EINTR) return false;
+    }
+}
+
+static bool recv_all(int fd, uint8_t* p, size_t len, uint64_t deadline_ns) {
+    while (len > 0) {
+        if (!wait_readable(fd, deadline_ns)) return false;
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static bool send_frame(int fd, uint32_t type, const uint8_t* payload, size_t len,
+                       const std::vector<int>& fds = {}) {
+    uint32_t hdr[2] = {htonl(type), htonl(static_cast<uint32_t>(len))};
+    iovec iov{hdr, sizeof(hdr)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    // uint64_t elements keep the control buffer aligned for cmsghdr
+    std::vector<uint64_t> control;
+    if (!fds.empty()) {
+        const size_t space = CMSG_SPACE(fds.size() * sizeof(int));
+        control.resize((space + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+        msg.msg_control = control.data();
+        msg.msg_controllen = space;
+        cmsghdr* c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        std::memcpy(CMSG_DATA(c), fds.data(), fds.size() * sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n != static_cast<ssize_t>(sizeof(hdr))) return false;
+    return send_all(fd, payload, len);
+}
+
+// The descriptors arrive with the frame's first byte
+static bool recv_frame(int fd, uint32_t& type, std::vector<uint8_t>& payload,
+                       std::vector<int>& fds, uint64_t deadline_ns) {
+    uint32_t hdr[2];
+    iovec iov{hdr, sizeof(hdr)};
+    std::vector<uint64_t> control(CMSG_SPACE(kFdsPerFrame * sizeof(int)) / sizeof(uint64_t) + 1);
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size() * sizeof(uint64_t);
+    if (!wait_readable(fd, deadline_ns)) return false;
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return false;
+    for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const uint8_t* data = CMSG_DATA(c);
+        for (size_t i = 0; i < count; i++) {
+            int received;
+            std::memcpy(&received, data + i * sizeof(int), sizeof(int));
+            fds.push_back(received);
+        }
+    }
+    if (n < static_cast<ssize_t>(sizeof(hdr)) &&
+        !recv_all(fd, reinterpret_cast<uint8_t*>(hdr) + n, sizeof(hdr) - n, deadline_ns))
+        return false;
+    type = ntohl(hdr[0]);
+    payload.resize(ntohl(hdr[1]));
+    return recv_all(fd, payload.data(), payload.size(), deadline_ns);
+}
+
+static uint64_t deadline_in(int ms) {
+    return LatencyStats::now_ns() + static_cast<uint64_t>(ms) * 1000000;
+}
+
+bool RpcHandoff::upgrade(RpcServer& rpc, const std::vector<std::string>& argv,
+                         const std::function<void()>& quiesce,
+                         const std::function<void()>& resume, std::string& err) {
+    int sv[2];
+    if (argv.empty() || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        err = std::string("socketpair: ") + std::strerror(errno);
+        return false;
+    }
+    // Built before fork(): the child may only make async-signal-safe calls
+    std::vector<std::string> args;
+    for (size_t i = 0; i < argv.size(); i++) {
+        if (argv[i] == "--upgrade-fd") {
+            i++;
+            continue;
+        }
+        args.push_back(argv[i]);
+    }
+    args.push_back("--upgrade-fd");
+    args.push_back("3");
+    std::vector<char*> cargs;
+    for (auto& a : args) cargs.push_back(&a[0]);
+    cargs.push_back(nullptr);
+    rlimit rl{};
+    getrlimit(RLIMIT_NOFILE, &rl);
+    const int max_fd = rl.rlim_cur == RLIM_INFINITY ? 65536 : static_cast<int>(rl.rlim_cur);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        err = std::string("fork: ") + std::strerror(errno);
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    if (pid == 0) {
+        // The new process gets stdio and the socket as fd 3, nothing else:
+        // a stray copy of a client connection would keep it open
+        dup2(sv[1], 3);
+#ifdef SYS_close_range
+        if (syscall(SYS_close_range, 4, ~0u, 0) != 0)
+#endif
+            for (int fd = 4; fd < max_fd; fd++) close(fd);
+        execvp(cargs[0], cargs.data());
+        _exit(127);
+    }
+    close(sv[1]);
+
+    bool ok = hand_over(sv[0], rpc, quiesce, resume, err);
+    close(sv[0]);
+    if (!ok) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+    return ok;
+}
+
+bool RpcHandoff::hand_over(int fd, RpcServer& rpc, const std::function<void()>& quiesce,
+                           const std::function<void()>& resume, std::string& err) {
+    uint32_t type = 0;
+    std::vector<uint8_t> payload;
+    std::vector<int> fds;
+    if (!recv_frame(fd, type, payload, fds, deadline_in(kStepTimeoutMs)) || type != FRAME_READY) {
+        err = "new process did not start";
+        return false;
+    }
+
+    if (quiesce) quiesce();
+    int listen_fd = -1;
+    std::vector<RpcServer::HandedOffConnection> conns;
+    if (!rpc.hand_off(listen_fd, kDrainTimeoutNs, conns)) {
+        err = "calls still in progress after the drain timeout";
+        if (resume) resume();
+        return false;
+    }
+
+    // Saved only now: no call is changing the state any more
+    XdrEncoder images;
+    images.encode_uint32(static_cast<uint32_t>(states_.size()));
+    for (const auto& st : states_) {
+        XdrEncoder image;
+        st.save(image);
+        images.encode_string(st.name);
+        images.encode_opaque(image.data().data(), image.size());
+    }
+    bool sent = send_frame(fd, FRAME_STATE, images.data().data(), images.size(), {listen_fd});
+    for (size_t i = 0; sent && i < conns.size(); i += kFdsPerFrame) {
+        const size_t end = std::min(conns.size(), i + kFdsPerFrame);
+        XdrEncoder peers;
+        std::vector<int> batch;
+        peers.encode_uint32(static_cast<uint32_t>(end - i));
+        for (size_t j = i; j < end; j++) {
+            peers.encode_string(conns[j].peer_addr);
+            batch.push_back(conns[j].fd);
+        }
+        sent = send_frame(fd, FRAME_CONNS, peers.data().data(), peers.size(), batch);
+    }
+    sent = sent && send_frame(fd, FRAME_DONE, nullptr, 0);
+
+    fds.clear();
+    if (sent && recv_frame(fd, type, payload, fds, deadline_in(kStepTimeoutMs)) &&
+        type == FRAME_ACK) {
+        // The new process has its own copies
+        close(listen_fd);
+        for (const auto& c : conns) close(c.fd);
+        NFSD_LOG_INFO(LogSys::RPC, "upgrade handed over",
+                      {{"connections", conns.size()}, {"states", states_.size()}});
+        return true;
+    }
+
+    // Nothing was lost: the state is still here and the connections unread
+    err = "new process failed after the hand-off";
+    rpc.start_from(listen_fd);
+    rpc.adopt(std::move(conns));
+    if (resume) resume();
+    return false;
+}
+
+bool RpcHandoff::receive(int fd, std::string& err) {
+    fd_ = fd;
+    fcntl(fd_, F_SETFD, FD_CLOEXEC);
+    if (!send_frame(fd_, FRAME_READY, nullptr, 0)) {
+        err = "upgrade socket closed";
+        return false;
+    }
+    for (;;) {
+        uint32_t type = 0;
+        std::vector<uint8_t> payload;
+        std::vector<int> fds;
+        if (!recv_frame(fd_, type, payload, fds, deadline_in(kStepTimeoutMs))) {
+            err = "hand-off interrupted";
+            return false;
+        }
+        try {
+            XdrDecoder dec(payload.data(), payload.size());
+            if (type == FRAME_STATE) {
+                if (fds.size() != 1) throw std::runtime_error("no listening socket");
+                listen_fd_ = fds[0];
+                for (uint32_t n = dec.decode_uint32(); n > 0; n--) {
+                    std::string name = dec.decode_string();
+                    std::vector<uint8_t> image = dec.decode_opaque();
+                    for (const auto& st : states_) {
+                        if (st.name != name) continue;
+                        XdrDecoder idec(image.data(), image.size());
+                        if (!st.restore(idec)) {
+                            err = "cannot restore " + name;
+                            return false;
+                        }
+                    }
+                }
+            } else if (type == FRAME_CONNS) {
+                uint32_t n = dec.decode_uint32();
+                if (n != fds.size()) throw std::runtime_error("connection count mismatch");
+                for (int cfd : fds) conns_.push_back({cfd, dec.decode_string()});
+            } else if (type == FRAME_DONE) {
+                break;
+            }
+        } catch (const std::exception& e) {
+            err = e.what();
+            return false;
+        }
+    }
+    if (listen_fd_ < 0) {
+        err = "no listening socket";
+        return false;
+    }
+    connections_ = conns_.size();
+    return true;
+}
+
+void RpcHandoff::serve(RpcServer& rpc) {
+    rpc.start_from(listen_fd_);
+    rpc.adopt(std::move(conns_));
+    send_frame(fd_, FRAME_ACK, nullptr, 0);
+    close(fd_);
+    fd_ = -1;
+}
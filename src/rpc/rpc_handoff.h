@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "rpc/rpc_server.h"
+#include "xdr/xdr_codec.h"
+
+// Binary upgrade without dropping connections. The running server starts
+// the new binary with one end of a Unix socket pair (--upgrade-fd) and
+// hands it the listening socket, its clients' connections and its state,
+// so clients see a pause rather than a reconnect and state recovery.
+//
+// The processes talk in frames: a type and a length (network byte order),
+// the payload, and any descriptors, passed with SCM_RIGHTS (unix(7)):
+//
+//   new -> old  READY  configured, serving nothing yet
+//   old -> new  STATE  named state images; descriptor: listening socket
+//   old -> new  CONNS  peer addresses; descriptors: up to 200 connections
+//   old -> new  DONE
+//   new -> old  ACK    serving
+//
+// Only once the new process is READY does the old one stop accepting and
+// take its connections off their threads between calls
+// (RpcServer::hand_off()). If a call is still being served at the drain
+// timeout, or no ACK follows, it serves them again itself.
+
+class RpcHandoff {
+public:
+    RpcHandoff() = default;
+    ~RpcHandoff();
+
+    RpcHandoff(const RpcHandoff&) = delete;
+    RpcHandoff& operator=(const RpcHandoff&) = delete;
+
+    // Carry a component's state across: save runs in the old process once
+    // no call is being served, restore in the new one before it serves.
+    // Images are matched by name; one the other binary lacks is skipped.
+    using SaveFn = std::function<void(XdrEncoder&)>;
+    using RestoreFn = std::function<bool(XdrDecoder&)>;
+    void add_state(std::string name, SaveFn save, RestoreFn restore);
+
+    // Old process: start argv (the new binary and its arguments; the
+    // socket is added as --upgrade-fd 3) and hand_over() to it
+    bool upgrade(RpcServer& rpc, const std::vector<std::string>& argv,
+                 const std::function<void()>& quiesce, const std::function<void()>& resume,
+                 std::string& err);
+    // Old process: hand rpc over on fd once READY. quiesce runs first, to
+    // let go of what the new process will take (the metrics endpoint);
+    // resume undoes it if the new process fails. Returns true once the new
+    // process serves: the caller then exits, leaving the portmapper
+    // registration to it.
+    bool hand_over(int fd, RpcServer& rpc, const std::function<void()>& quiesce,
+                   const std::function<void()>& resume, std::string& err);
+
+    // New process: say READY on fd (from --upgrade-fd), then take in the
+    // sockets and restore the state images
+    bool receive(int fd, std::string& err);
+    // New process: serve the sockets received and say ACK
+    void serve(RpcServer& rpc);
+
+    // Connections received, for the startup report
+    size_t connections() const { return connections_; }
+
+private:
+    struct State {
+        std::string name;
+        SaveFn save;
+        RestoreFn restore;
+    };
+    std::vector<State> states_;
+
+    int fd_ = -1;
+    int listen_fd_ = -1;
+    std::vector<RpcServer::HandedOffConnection> conns_;
+    size_t connections_ = 0;
+};
@@ -0,0 +1,311 @@
+#include "rpc/rpc_numa.h"
+#include "stats/metrics.h"
+
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+// --- Topology ---
+
+bool NumaTopology::parse_cpulist(const std::string& text, std::vector<int>& cpus) {
+    cpus.clear();
+    size_t pos = 0;
+    while (pos < text.size() && text[pos] != '\n') {
+        char* end = nullptr;
+        long first = std::strtol(text.c_str() + pos, &end, 10);
+        if (end == text.c_str() + pos || first < 0) return false;
+        long last = first;
+        pos = end - text.c_str();
+        if (pos < text.size() && text[pos] == '-') {
+            last = std::strtol(text.c_str() + pos + 1, &end, 10);
+            if (end == text.c_str() + pos + 1 || last < first) return false;
+            pos = end - text.c_str();
+        }
+        for (long cpu = first; cpu <= last; cpu++) cpus.push_back(static_cast<int>(cpu));
+        if (pos < text.size() && text[pos] == ',') pos++;
+        else if (pos < text.size() && text[pos] != '\n') return false;
+    }
+    return true;
+}
+
+// CPUs this process may run on (cgroup cpusets, taskset); empty if unknown
+static std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+    return cpus;
+}
+
+void NumaTopology::add(Node node) {
+    for (int cpu : node.cpus) {
+        if (static_cast<size_t>(cpu) >= cpu_node_.size()) cpu_node_.resize(cpu + 1, -1);
+        cpu_node_[cpu] = static_cast<int>(nodes_.size());
+    }
+    nodes_.push_back(std::move(node));
+}
+
+NumaTopology NumaTopology::single(std::vector<int> cpus) {
+    NumaTopology topo;
+    topo.add({0, std::move(cpus)});
+    return topo;
+}
+
+NumaTopology NumaTopology::discover(const std::string& root) {
+    std::vector<int> allowed = allowed_cpus();
+    std::vector<Node> found;
+    if (DIR* dir = opendir(root.c_str())) {
+        while (dirent* e = readdir(dir)) {
+            char* end = nullptr;
+            if (std::strncmp(e->d_name, "node", 4) != 0) continue;
+            long id = std::strtol(e->d_name + 4, &end, 10);
+            if (end == e->d_name + 4 || *end != '\0') continue;
+            std::ifstream in(root + "/" + e->d_name + "/cpulist");
+            std::string text;
+            Node node;
+            node.id = static_cast<int>(id);
+            if (!std::getline(in, text) || !parse_cpulist(text, node.cpus)) continue;
+            if (!allowed.empty()) {
+                node.cpus.erase(std::remove_if(node.cpus.begin(), node.cpus.end(),
+                                               [&allowed](int cpu) {
+                                                   return !std::binary_search(
+                                                       allowed.begin(), allowed.end(), cpu);
+                                               }),
+                                node.cpus.end());
+            }
+            found.push_back(std::move(node));
+        }
+        closedir(dir);
+    }
+    if (found.empty()) return single(std::move(allowed));
+
+    std::sort(found.begin(), found.end(),
+              [](const Node& a, const Node& b) { return a.id < b.id; });
+    NumaTopology topo;
+    for (auto& node : found) topo.add(std::move(node));
+    return topo;
+}
+
+int NumaTopology::node_of_cpu(int cpu) const {
+    if (cpu < 0 || static_cast<size_t>(cpu) >= cpu_node_.size()) return -1;
+    return cpu_node_[cpu];
+}
+
+// --- Buffer pool ---
+
+NodeBufferPool::NodeBufferPool(int node_id, bool bind) : node_id_(node_id), bind_(bind) {}
+
+NodeBufferPool::~NodeBufferPool() {
+    for (uint8_t* region : regions_) munmap(region, kRegionBytes);
+}
+
+const char* NodeBufferPool::backing_name(Backing b) {
+    static const char* const kNames[BACKINGS] = {"hugetlb", "thp", "pages"};
+    return kNames[b];
+}
+
+uint64_t NodeBufferPool::mapped_bytes() const {
+    uint64_t total = 0;
+    for (const auto& m : mapped_) total += m.load(std::memory_order_relaxed);
+    return total;
+}
+
+size_t NodeBufferPool::class_of(size_t bytes) {
+    size_t cls = 0;
+    while (chunk_bytes(cls) < bytes) cls++;
+    return cls;
+}
+
+uint8_t* NodeBufferPool::map_region() {
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    Backing backing = HUGETLB;
+    void* p = mmap(nullptr, kRegionBytes, prot, flags | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (p == MAP_FAILED) {
+        // Twice the size, to cut an aligned region out of: THP only backs
+        // 2 MiB-aligned ranges
+        uint8_t* raw = static_cast<uint8_t*>(mmap(nullptr, 2 * kRegionBytes, prot, flags, -1, 0));
+        if (raw == MAP_FAILED) throw std::bad_alloc();
+        const uintptr_t base = reinterpret_cast<uintptr_t>(raw);
+        uint8_t* aligned = raw + ((kRegionBytes - base % kRegionBytes) % kRegionBytes);
+        if (aligned > raw) munmap(raw, aligned - raw);
+        munmap(aligned + kRegionBytes, raw + 2 * kRegionBytes - (aligned + kRegionBytes));
+        p = aligned;
+        backing = madvise(p, kRegionBytes, MADV_HUGEPAGE) == 0 ? THP : PAGES;
+    }
+    if (bind_) {
+        // Before the first touch: mbind() places pages as they fault in
+        unsigned long mask[16] = {};
+        const size_t bits = sizeof(mask) * 8;
+        if (static_cast<size_t>(node_id_) < bits) {
+            mask[node_id_ / (sizeof(long) * 8)] = 1ul << (node_id_ % (sizeof(long) * 8));
+            if (syscall(SYS_mbind, p, kRegionBytes, MPOL_PREFERRED, mask, bits, 0) != 0)
+                bind_failures_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    mapped_[backing].fetch_add(kRegionBytes, std::memory_order_relaxed);
+    regions_.push_back(static_cast<uint8_t*>(p));
+    return static_cast<uint8_t*>(p);
+}
+
+uint8_t* NodeBufferPool::carve(size_t cls) {
+    const size_t size = chunk_bytes(cls);
+    if (left_ < size) {
+        // The rest of the region is a multiple of 4 KiB: keep it as chunks
+        for (size_t c = kClasses; c-- > 0;) {
+            while (left_ >= chunk_bytes(c)) {
+                auto* chunk = reinterpret_cast<FreeChunk*>(cur_);
+                chunk->next = free_[c];
+                free_[c] = chunk;
+                cur_ += chunk_bytes(c);
+                left_ -= chunk_bytes(c);
+            }
+        }
+        cur_ = map_region();
+        left_ = kRegionBytes;
+    }
+    uint8_t* p = cur_;
+    cur_ += size;
+    left_ -= size;
+    return p;
+}
+
+void* NodeBufferPool::do_allocate(size_t bytes, size_t alignment) {
+    if (bytes > kRegionBytes || alignment > kMinChunk)
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    const size_t cls = class_of(bytes);
+    void* p;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (FreeChunk* chunk = free_[cls]) {
+            free_[cls] = chunk->next;
+            p = chunk;
+        } else {
+            p = carve(cls);
+        }
+    }
+    in_use_.fetch_add(chunk_bytes(cls), std::memory_order_relaxed);
+    return p;
+}
+
+void NodeBufferPool::do_deallocate(void* p, size_t bytes, size_t alignment) {
+    if (bytes > kRegionBytes || alignment > kMinChunk) {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        return;
+    }
+    const size_t cls = class_of(bytes);
+    in_use_.fetch_sub(chunk_bytes(cls), std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lk(mu_);
+    auto* chunk = static_cast<FreeChunk*>(p);
+    chunk->next = free_[cls];
+    free_[cls] = chunk;
+}
+
+// --- Placement ---
+
+NumaPlacement::NumaPlacement(NumaTopology topology)
+    : topology_(std::move(topology)), shards_(new Shard[topology_.nodes()]) {
+    // With one node there is nowhere else for pages to go
+    const bool bind = topology_.nodes() > 1;
+    for (size_t i = 0; i < topology_.nodes(); i++)
+        pools_.push_back(std::make_unique<NodeBufferPool>(topology_.node(i).id, bind));
+}
+
+size_t NumaPlacement::place(int fd) {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    int node = -1;
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0)
+        node = topology_.node_of_cpu(cpu);
+    if (node >= 0) {
+        shards_[node].by_cpu.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        // Not known yet (no packet processed, a Unix socket): the node with
+        // fewest connections among those with CPUs
+        size_t best = 0;
+        uint64_t fewest = UINT64_MAX;
+        for (size_t i = 0; i < topology_.nodes(); i++) {
+            if (topology_.node(i).cpus.empty()) continue;
+            uint64_t n = connections(i);
+            if (n < fewest) {
+                fewest = n;
+                best = i;
+            }
+        }
+        node = static_cast<int>(best);
+        shards_[node].by_load.fetch_add(1, std::memory_order_relaxed);
+    }
+    shards_[node].connections.fetch_add(1, std::memory_order_relaxed);
+    return static_cast<size_t>(node);
+}
+
+void NumaPlacement::release(size_t node) {
+    shards_[node].connections.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool NumaPlacement::pin(size_t node) {
+    const auto& cpus = topology_.node(node).cpus;
+    if (topology_.nodes() < 2 || cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+uint64_t NumaPlacement::idle_bytes() const {
+    uint64_t idle = 0;
+    for (const auto& pool : pools_) {
+        uint64_t mapped = pool->mapped_bytes(), used = pool->in_use_bytes();
+        idle += mapped > used ? mapped - used : 0;
+    }
+    return idle;
+}
+
+void NumaPlacement::register_metrics(MetricsRegistry& metrics) {
+    for (size_t i = 0; i < topology_.nodes(); i++) {
+        const std::string node = std::to_string(topology_.node(i).id);
+        metrics.gauge("nfsd_numa_connections", "Open connections served on each NUMA node",
+                      {{"node", node}}, [this, i] { return static_cast<double>(connections(i)); });
+        metrics.counter("nfsd_numa_placements_total",
+                        "Connections placed on a NUMA node, by the CPU their packets "
+                        "arrived on (SO_INCOMING_CPU) or by load",
+                        {{"node", node}, {"by", "cpu"}}, [this, i] { return placed_by_cpu(i); });
+        metrics.counter("nfsd_numa_placements_total",
+                        "Connections placed on a NUMA node, by the CPU their packets "
+                        "arrived on (SO_INCOMING_CPU) or by load",
+                        {{"node", node}, {"by", "load"}}, [this, i] { return placed_by_load(i); });
+        const NodeBufferPool* pool = pools_[i].get();
+        for (int b = 0; b < NodeBufferPool::BACKINGS; b++) {
+            auto backing = static_cast<NodeBufferPool::Backing>(b);
+            metrics.gauge("nfsd_numa_pool_bytes",
+                          "Bytes mapped for a NUMA node's connection buffers, by page backing",
+                          {{"node", node}, {"backing", NodeBufferPool::backing_name(backing)}},
+                          [pool, backing] {
+                              return static_cast<double>(pool->mapped_bytes(backing));
+                          });
+        }
+        metrics.gauge("nfsd_numa_pool_in_use_bytes",
+                      "Bytes of a NUMA node's buffer pool held by connections", {{"node", node}},
+                      [pool] { return static_cast<double>(pool->in_use_bytes()); });
+    }
+}
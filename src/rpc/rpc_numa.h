@@ -0,0 +1,168 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class MetricsRegistry;
+
+// NUMA placement of connections. On a machine with several memory nodes a
+// call's buffers are otherwise allocated wherever the heap finds room,
+// filled by a NIC queue serviced on one node and decoded by a thread that
+// the scheduler may run on the other, so most of its bytes cross the
+// interconnect at least once.
+//
+// RpcServer::set_numa() keeps each connection on one node: the node of the
+// CPU that processed its packets (SO_INCOMING_CPU, socket(7); with RSS or
+// RFS that is the node of its NIC queue), else the node serving the fewest
+// connections. Its thread is restricted to that node's CPUs, and its
+// record buffer and request arena come from the node's buffer pool.
+
+// CPUs of each memory node, from sysfs (node<N>/cpulist), restricted to
+// the CPUs this process may run on. Without sysfs the machine is one node
+// with every CPU.
+class NumaTopology {
+public:
+    struct Node {
+        int id = 0;             // the kernel's node number
+        std::vector<int> cpus;  // may be empty: a memory-only node
+    };
+
+    static NumaTopology discover(const std::string& root = "/sys/devices/system/node");
+    // One node with cpus, for tests and the benchmark
+    static NumaTopology single(std::vector<int> cpus);
+
+    // cpulist format (cpuset(7) "List format"): "0-3,8,10-11"
+    static bool parse_cpulist(const std::string& text, std::vector<int>& cpus);
+
+    size_t nodes() const { return nodes_.size(); }
+    const Node& node(size_t index) const { return nodes_[index]; }
+    // Index of the node cpu belongs to; -1 if unknown
+    int node_of_cpu(int cpu) const;
+
+private:
+    void add(Node node);
+
+    std::vector<Node> nodes_;
+    std::vector<int> cpu_node_;  // by CPU number: node index, or -1
+};
+
+// Buffers of one node, carved from 2 MiB regions that are backed by
+// hugepages where the kernel has them: a hugetlbfs page (MAP_HUGETLB, from
+// vm.nr_hugepages), else transparent hugepages (MADV_HUGEPAGE), else
+// ordinary pages. A connection's record and arena blocks then take a
+// handful of TLB entries instead of hundreds. With bind, regions prefer
+// the node's memory (mbind(2) MPOL_PREFERRED); without, pages land where
+// they are first touched.
+//
+// Requests are rounded up to a power of two from 4 KiB to 2 MiB, and freed
+// chunks kept on a list per size for the next request of that size.
+// Regions are never unmapped: the pool holds what its busiest moment
+// needed, as the connections' arenas do. Larger requests, or ones aligned
+// beyond 4 KiB, go to the heap. Thread-safe; connections only allocate
+// when their buffers grow.
+class NodeBufferPool : public std::pmr::memory_resource {
+public:
+    NodeBufferPool(int node_id, bool bind);
+    ~NodeBufferPool() override;
+
+    NodeBufferPool(const NodeBufferPool&) = delete;
+    NodeBufferPool& operator=(const NodeBufferPool&) = delete;
+
+    enum Backing { HUGETLB, THP, PAGES, BACKINGS };
+    static const char* backing_name(Backing b);
+
+    static constexpr size_t kRegionBytes = 2 << 20;
+    static constexpr size_t kMinChunk = 4096;
+
+    // Bytes of regions mapped with each backing
+    uint64_t mapped_bytes(Backing b) const { return mapped_[b].load(std::memory_order_relaxed); }
+    uint64_t mapped_bytes() const;
+    // Bytes handed out and not yet returned (rounded up to their chunks)
+    uint64_t in_use_bytes() const { return in_use_.load(std::memory_order_relaxed); }
+    // Regions whose mbind() failed (kernel without NUMA, seccomp)
+    uint64_t bind_failures() const { return bind_failures_.load(std::memory_order_relaxed); }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    static constexpr size_t kClasses = 10;  // 4 KiB .. 2 MiB
+    static size_t class_of(size_t bytes);
+    static size_t chunk_bytes(size_t cls) { return kMinChunk << cls; }
+
+    // Next chunk of class cls from the current region; mu_ held
+    uint8_t* carve(size_t cls);
+    uint8_t* map_region();
+
+    struct FreeChunk {
+        FreeChunk* next;
+    };
+
+    const int node_id_;
+    const bool bind_;
+    std::mutex mu_;
+    FreeChunk* free_[kClasses] = {};
+    std::vector<uint8_t*> regions_;
+    uint8_t* cur_ = nullptr;  // unused rest of the newest region
+    size_t left_ = 0;
+    std::atomic<uint64_t> mapped_[BACKINGS] = {};
+    std::atomic<uint64_t> in_use_{0};
+    std::atomic<uint64_t> bind_failures_{0};
+};
+
+class NumaPlacement {
+public:
+    explicit NumaPlacement(NumaTopology topology);
+
+    NumaPlacement(const NumaPlacement&) = delete;
+    NumaPlacement& operator=(const NumaPlacement&) = delete;
+
+    const NumaTopology& topology() const { return topology_; }
+
+    // Node index for a new connection on fd, counted until release()
+    size_t place(int fd);
+    void release(size_t node);
+    // Restrict the calling thread to node's CPUs. Does nothing, returning
+    // false, on a single node or a node without CPUs.
+    bool pin(size_t node);
+
+    NodeBufferPool& pool(size_t node) { return *pools_[node]; }
+    const NodeBufferPool& pool(size_t node) const { return *pools_[node]; }
+
+    uint64_t connections(size_t node) const {
+        return shards_[node].connections.load(std::memory_order_relaxed);
+    }
+    // Connections placed by the CPU their packets arrived on, and by load
+    uint64_t placed_by_cpu(size_t node) const {
+        return shards_[node].by_cpu.load(std::memory_order_relaxed);
+    }
+    uint64_t placed_by_load(size_t node) const {
+        return shards_[node].by_load.load(std::memory_order_relaxed);
+    }
+    // Bytes the pools hold that no connection is using
+    uint64_t idle_bytes() const;
+
+    // nfsd_numa_connections, nfsd_numa_placements_total by node and how,
+    // nfsd_numa_pool_bytes by node and backing, nfsd_numa_pool_in_use_bytes
+    void register_metrics(MetricsRegistry& metrics);
+
+private:
+    struct Shard {
+        std::atomic<uint64_t> connections{0};
+        std::atomic<uint64_t> by_cpu{0};
+        std::atomic<uint64_t> by_load{0};
+    };
+
+    const NumaTopology topology_;
+    std::vector<std::unique_ptr<NodeBufferPool>> pools_;
+    std::unique_ptr<Shard[]> shards_;
+};
@@ -0,0 +1,57 @@
+#include "rpc/rpc_overload.h"
+#include "stats/metrics.h"
+
+OverloadControl::OverloadControl(uint64_t target_ns, uint64_t interval_ns)
+    : target_ns_(target_ns), interval_ns_(interval_ns ? interval_ns : 1) {}
+
+static void fetch_min(std::atomic<uint64_t>& a, uint64_t v) {
+    uint64_t cur = a.load(std::memory_order_relaxed);
+    while (v < cur && !a.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {
+    }
+}
+
+// RFC 8289 §3 - the minimum sojourn over an interval separates a standing
+// queue from a burst that drains by itself
+bool OverloadControl::sample(uint64_t sojourn_ns, uint64_t now_ns) {
+    uint64_t start = window_start_.load(std::memory_order_relaxed);
+    if (start == 0 && window_start_.compare_exchange_strong(start, now_ns))
+        start = now_ns;
+    if (now_ns - start >= interval_ns_ &&
+        window_start_.compare_exchange_strong(start, now_ns, std::memory_order_relaxed)) {
+        // This call closes the window and opens the next one. No calls at
+        // all for a while is no evidence either way: the next one's sojourn
+        // says whether they were stuck behind something or the queue emptied.
+        const uint64_t m = window_min_.exchange(sojourn_ns, std::memory_order_relaxed);
+        if (m != UINT64_MAX) {
+            last_min_.store(m, std::memory_order_relaxed);
+            if (m > target_ns_) {
+                if (!overloaded_.exchange(true, std::memory_order_relaxed))
+                    episodes_.fetch_add(1, std::memory_order_relaxed);
+            } else if (m <= target_ns_ / 2) {
+                // Shedding holds the queue near target; only a queue that
+                // drains well below it ends the episode
+                overloaded_.store(false, std::memory_order_relaxed);
+            }
+        }
+    } else {
+        fetch_min(window_min_, sojourn_ns);
+    }
+    return sojourn_ns > target_ns_ && overloaded_.load(std::memory_order_relaxed);
+}
+
+void OverloadControl::register_metrics(MetricsRegistry& metrics) {
+    metrics.gauge("nfsd_overload_active",
+                  "1 while calls have queued longer than the overload target for an interval",
+                  {}, [this] { return overloaded() ? 1.0 : 0.0; });
+    metrics.gauge("nfsd_overload_min_sojourn_seconds",
+                  "Shortest time a call waited before dispatch in the last interval", {},
+                  [this] { return min_sojourn_ns() / 1e9; });
+    metrics.counter("nfsd_overload_episodes_total", "Times the server became overloaded", {},
+                    [this] { return episodes(); });
+    metrics.counter("nfsd_overload_shed_total",
+                    "Calls answered NFS3ERR_JUKEBOX or NFS4ERR_DELAY under overload",
+                    {{"version", "3"}}, [this] { return shed_count(3); });
+    metrics.counter("nfsd_overload_shed_total",
+                    "Calls answered NFS3ERR_JUKEBOX or NFS4ERR_DELAY under overload",
+                    {{"version", "4"}}, [this] { return shed_count(4); });
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+class MetricsRegistry;
+
+// Overload control for NFS calls, after CoDel (RFC 8289): when the time
+// calls wait before dispatch stays above a target, answer expensive calls
+// at once with "try again later" instead of queueing them until the client
+// times out and retransmits, which only adds to the queue.
+//
+// The queue is each connection's socket receive buffer: a connection's
+// thread serves one call at a time, and the calls a client has pipelined
+// behind it wait in the kernel. A call's sojourn is the time from its
+// first bytes reaching the socket (the SO_TIMESTAMPNS receive stamp) to its
+// dispatch. As in CoDel, the controller watches the smallest sojourn of
+// each interval: a standing queue keeps even the luckiest call waiting, a
+// burst does not. When an interval's minimum is above target the server is
+// overloaded, and calls that waited longer than target may be shed, until
+// an interval's minimum falls to half the target.
+//
+// Shedding is the handlers' decision (RpcCallHeader::overload): NFSv3
+// answers expensive procedures with NFS3ERR_JUKEBOX (RFC 1813 §2.6) and
+// NFSv4 expensive operations with NFS4ERR_DELAY (RFC 8881 §15.1.1.3); both
+// tell the client to retry later with a new xid. Cheap calls (GETATTR,
+// LOOKUP, ACCESS, ...), session and state management, lock and open
+// releases, and MOUNT and NLM are always served.
+
+class OverloadControl {
+public:
+    // target_ns: acceptable standing queue; interval_ns: how long the
+    // minimum must stay above target, about a round trip plus a service time
+    explicit OverloadControl(uint64_t target_ns = 10000000, uint64_t interval_ns = 100000000);
+
+    OverloadControl(const OverloadControl&) = delete;
+    OverloadControl& operator=(const OverloadControl&) = delete;
+
+    // Account one call that waited sojourn_ns; true if it may be shed.
+    // now_ns: LatencyStats::now_ns()
+    bool sample(uint64_t sojourn_ns, uint64_t now_ns);
+
+    // A handler answered a call of NFS version 3 or 4 with JUKEBOX/DELAY
+    void shed(uint32_t version) {
+        shed_[version >= 4 ? 1 : 0].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t target_ns() const { return target_ns_; }
+    uint64_t interval_ns() const { return interval_ns_; }
+    bool overloaded() const { return overloaded_.load(std::memory_order_relaxed); }
+    // Smallest sojourn of the last complete interval
+    uint64_t min_sojourn_ns() const { return last_min_.load(std::memory_order_relaxed); }
+    uint64_t shed_count(uint32_t version) const {
+        return shed_[version >= 4 ? 1 : 0].load(std::memory_order_relaxed);
+    }
+    // Times the controller went from normal to overloaded
+    uint64_t episodes() const { return episodes_.load(std::memory_order_relaxed); }
+
+    // nfsd_overload_active, nfsd_overload_min_sojourn_seconds,
+    // nfsd_overload_episodes_total and nfsd_overload_shed_total by version
+    void register_metrics(MetricsRegistry& metrics);
+
+private:
+    const uint64_t target_ns_;
+    const uint64_t interval_ns_;
+
+    std::atomic<uint64_t> window_start_{0};
+    std::atomic<uint64_t> window_min_{UINT64_MAX};
+    std::atomic<uint64_t> last_min_{0};
+    std::atomic<bool> overloaded_{false};
+    std::atomic<uint64_t> episodes_{0};
+    std::atomic<uint64_t> shed_[2] = {};
+};
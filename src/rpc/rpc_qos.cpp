@@ -0,0 +1,351 @@
+#include "rpc/rpc_qos.h"
+#include "stats/metrics.h"
+#include "xdr/xdr_codec.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+static const char* const kScopeNames[kQosScopes] = {"client", "uid", "export"};
+
+const char* qos_scope_name(QosScope scope) {
+    size_t i = static_cast<size_t>(scope);
+    return i < kQosScopes ? kScopeNames[i] : "unknown";
+}
+
+// Idle buckets are dropped once a policy has this many
+static const size_t kPruneBuckets = 4096;
+
+// RFC 1813 §3.3.6, §3.3.7 - NFSv3 READ and WRITE procedure numbers
+static const uint32_t kNfs3Read = 6;
+static const uint32_t kNfs3Write = 7;
+// RFC 7530 §1.2 - NFSv4 is version 4 of the NFS program
+static const uint32_t kNfsV4 = 4;
+
+static std::vector<std::string> split(const std::string& s, char sep) {
+    std::vector<std::string> out;
+    size_t pos = 0;
+    for (;;) {
+        size_t next = s.find(sep, pos);
+        out.push_back(s.substr(pos, next == std::string::npos ? std::string::npos : next - pos));
+        if (next == std::string::npos) return out;
+        pos = next + 1;
+    }
+}
+
+bool QosPolicy::matches(const std::string& key) const {
+    if (match.empty()) return true;
+    if (match.back() == '*')
+        return key.compare(0, match.size() - 1, match, 0, match.size() - 1) == 0;
+    return key == match;
+}
+
+bool QosPolicy::parse(const std::string& spec, QosPolicy& out, std::string& err) {
+    out = QosPolicy();
+    out.spec = spec;
+    bool have_scope = false;
+    for (const auto& item : split(spec, ',')) {
+        if (item == "shared") {
+            out.shared = true;
+            continue;
+        }
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) {
+            err = "expected key=value: " + item;
+            return false;
+        }
+        std::string key = item.substr(0, eq);
+        std::string value = item.substr(eq + 1);
+        bool ok = true;
+        char* end = nullptr;
+        if (key == "scope") {
+            size_t i = 0;
+            while (i < kQosScopes && value != kScopeNames[i]) i++;
+            ok = i < kQosScopes;
+            out.scope = static_cast<QosScope>(i);
+            have_scope = ok;
+        } else if (key == "match") {
+            out.match = value;
+            ok = !value.empty();
+        } else if (key == "iops") {
+            out.ops_per_sec = std::strtod(value.c_str(), &end);
+            ok = end != value.c_str() && *end == '\0' && out.ops_per_sec > 0;
+        } else if (key == "bw") {
+            double v = std::strtod(value.c_str(), &end);
+            double scale = 1;
+            if (*end == 'K') scale = 1024.0, end++;
+            else if (*end == 'M') scale = 1024.0 * 1024, end++;
+            else if (*end == 'G') scale = 1024.0 * 1024 * 1024, end++;
+            ok = end != value.c_str() && *end == '\0' && v > 0;
+            out.bytes_per_sec = static_cast<uint64_t>(v * scale);
+        } else if (key == "burst") {
+            double v = std::strtod(value.c_str(), &end);
+            std::string unit(end);
+            double scale = 0;
+            if (unit == "us") scale = 1e3;
+            else if (unit == "ms") scale = 1e6;
+            else if (unit == "s") scale = 1e9;
+            ok = end != value.c_str() && scale > 0 && v >= 0;
+            out.burst_ns = static_cast<uint64_t>(v * scale);
+        } else {
+            err = "unknown key: " + key;
+            return false;
+        }
+        if (!ok) {
+            err = "bad " + key + ": " + value;
+            return false;
+        }
+    }
+    if (!have_scope) {
+        err = "scope is required";
+        return false;
+    }
+    if (out.ops_per_sec <= 0 && out.bytes_per_sec == 0) {
+        err = "iops or bw is required";
+        return false;
+    }
+    return true;
+}
+
+// Each limit is kept as a theoretical arrival time (GCRA): when the work
+// reserved so far will have drained at the limit's rate. A call may start
+// while that time is at most burst_ns ahead of now.
+struct RpcQos::Bucket {
+    uint64_t ops_tat_ns = 0;
+    uint64_t bytes_tat_ns = 0;
+    uint64_t throttled = 0;
+    uint64_t delay_ns = 0;
+};
+
+struct RpcQos::Policy {
+    QosPolicy policy;
+    std::unordered_map<std::string, Bucket> buckets;  // key "" if shared
+    uint64_t bytes = 0;                               // bucket_bytes() of them all
+
+    // Heap use of one bucket: hash node, key and a bucket-array slot
+    static uint64_t bucket_bytes(const std::string& key) {
+        static const size_t sso = std::string().capacity();
+        return sizeof(std::pair<const std::string, Bucket>) + 2 * sizeof(void*) +
+               (key.capacity() > sso ? key.capacity() + 1 : 0);
+    }
+
+    static bool idle(const Bucket& b, uint64_t now_ns) {
+        return std::max(b.ops_tat_ns, b.bytes_tat_ns) <= now_ns;
+    }
+
+    // Drop idle buckets until about want bytes are freed; bytes freed
+    uint64_t drop_idle(uint64_t want, uint64_t now_ns) {
+        uint64_t freed = 0;
+        for (auto it = buckets.begin(); it != buckets.end() && freed < want;) {
+            if (idle(it->second, now_ns)) {
+                freed += bucket_bytes(it->first);
+                it = buckets.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        bytes -= std::min(freed, bytes);
+        return freed;
+    }
+};
+
+// Wait before the reservation may start, then add cost to the backlog
+static uint64_t reserve_one(uint64_t& tat_ns, uint64_t cost_ns, uint64_t burst_ns,
+                            uint64_t now_ns) {
+    uint64_t start = std::max(tat_ns, now_ns);
+    tat_ns = start + cost_ns;
+    return start > now_ns + burst_ns ? start - now_ns - burst_ns : 0;
+}
+
+RpcQos::RpcQos() = default;
+RpcQos::~RpcQos() = default;
+
+void RpcQos::set_policies(std::vector<QosPolicy> policies) {
+    std::vector<std::shared_ptr<Policy>> next;
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto& p : policies) {
+        auto kept = std::find_if(policies_.begin(), policies_.end(), [&](const auto& old) {
+            return old && old->policy.spec == p.spec;
+        });
+        if (kept != policies_.end() && !p.spec.empty()) {
+            next.push_back(std::move(*kept));
+        } else {
+            next.push_back(std::make_shared<Policy>());
+            next.back()->policy = std::move(p);
+        }
+    }
+    policies_ = std::move(next);
+    uint64_t bytes = 0;
+    for (const auto& p : policies_) bytes += p->bytes;
+    bytes_.store(bytes, std::memory_order_relaxed);
+    active_.store(!policies_.empty(), std::memory_order_relaxed);
+}
+
+size_t RpcQos::policy_count() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return policies_.size();
+}
+
+size_t RpcQos::bucket_count() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    size_t n = 0;
+    for (const auto& p : policies_) n += p->buckets.size();
+    return n;
+}
+
+uint64_t RpcQos::reserve(const QosRequest& req, uint64_t ops, uint64_t now_ns, bool count) {
+    uint64_t worst = 0;
+    QosScope worst_scope = QosScope::CLIENT;
+    std::string uid_key;
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto& p : policies_) {
+        const QosPolicy& pol = p->policy;
+        const std::string* key = nullptr;
+        switch (pol.scope) {
+            case QosScope::CLIENT: key = req.client; break;
+            case QosScope::EXPORT: key = req.export_name; break;
+            case QosScope::UID:
+                if (!req.uid) break;
+                if (uid_key.empty()) uid_key = std::to_string(*req.uid);
+                key = &uid_key;
+                break;
+            case QosScope::COUNT: break;
+        }
+        if (!key || !pol.matches(*key)) continue;
+
+        const std::string& bucket_key = pol.shared ? std::string() : *key;
+        auto found = p->buckets.find(bucket_key);
+        if (found == p->buckets.end()) {
+            // A bucket with nothing reserved past now is as good as a new one
+            if (p->buckets.size() >= kPruneBuckets)
+                bytes_.fetch_sub(p->drop_idle(UINT64_MAX, now_ns), std::memory_order_relaxed);
+            found = p->buckets.emplace(bucket_key, Bucket()).first;
+            const uint64_t added = Policy::bucket_bytes(found->first);
+            p->bytes += added;
+            bytes_.fetch_add(added, std::memory_order_relaxed);
+        }
+        Bucket& b = found->second;
+        uint64_t wait = 0;
+        if (pol.ops_per_sec > 0 && ops)
+            wait = reserve_one(b.ops_tat_ns, static_cast<uint64_t>(ops * 1e9 / pol.ops_per_sec),
+                               pol.burst_ns, now_ns);
+        if (pol.bytes_per_sec)
+            wait = std::max(wait, reserve_one(b.bytes_tat_ns,
+                                              static_cast<uint64_t>(req.bytes * 1e9 /
+                                                                    pol.bytes_per_sec),
+                                              pol.burst_ns, now_ns));
+        if (count && wait) {
+            b.throttled++;
+            b.delay_ns += wait;
+        }
+        if (wait > worst) {
+            worst = wait;
+            worst_scope = pol.scope;
+        }
+    }
+    if (count && worst) {
+        ScopeStats& s = stats_[static_cast<size_t>(worst_scope)];
+        s.throttled.fetch_add(1, std::memory_order_relaxed);
+        s.delay_ns.fetch_add(worst, std::memory_order_relaxed);
+    }
+    return worst;
+}
+
+uint64_t RpcQos::admit(const QosRequest& req, uint64_t now_ns) {
+    return reserve(req, 1, now_ns, true);
+}
+
+void RpcQos::charge(const QosRequest& req, uint64_t now_ns) {
+    if (req.bytes) reserve(req, 0, now_ns, false);
+}
+
+uint64_t RpcQos::reclaim(uint64_t bytes, uint64_t now_ns) {
+    std::lock_guard<std::mutex> lk(mu_);
+    uint64_t freed = 0;
+    for (auto& p : policies_) {
+        if (freed >= bytes) break;
+        freed += p->drop_idle(bytes - freed, now_ns);
+    }
+    bytes_.fetch_sub(freed, std::memory_order_relaxed);
+    return freed;
+}
+
+void RpcQos::wait(uint64_t ns, const std::atomic<bool>& running) {
+    waiting_.fetch_add(1, std::memory_order_relaxed);
+    auto until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(ns);
+    while (running.load(std::memory_order_relaxed)) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= until) break;
+        std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+            until - now, std::chrono::milliseconds(100)));
+    }
+    waiting_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+uint64_t RpcQos::call_bytes(const RpcCallHeader& call, const uint8_t* args, size_t args_len,
+                            size_t record_len) {
+    if (call.program != NFS_PROGRAM) return 0;
+    if (call.version == kNfsV4) return record_len;
+    if (call.version != NFS_V3 || (call.procedure != kNfs3Read && call.procedure != kNfs3Write))
+        return 0;
+    // READ3args / WRITE3args both open with (nfs_fh3 file, offset3 offset, count3 count)
+    try {
+        XdrDecoder dec(args, args_len);
+        dec.decode_opaque();
+        dec.decode_uint64();
+        return dec.decode_uint32();
+    } catch (...) {
+        return 0;  // the handler reports the bad arguments
+    }
+}
+
+std::string RpcQos::report(size_t n) const {
+    std::ostringstream os;
+    std::lock_guard<std::mutex> lk(mu_);
+    os << "qos: " << policies_.size() << (policies_.size() == 1 ? " policy, " : " policies, ")
+       << waiting_.load() << " calls waiting\n";
+    for (const auto& p : policies_) {
+        os << "policy " << p->policy.spec << ": " << p->buckets.size() << " bucket"
+           << (p->buckets.size() == 1 ? "" : "s") << '\n';
+        std::vector<const std::pair<const std::string, Bucket>*> rows;
+        for (const auto& b : p->buckets)
+            if (b.second.throttled) rows.push_back(&b);
+        std::sort(rows.begin(), rows.end(),
+                  [](const auto* a, const auto* b) { return a->second.delay_ns > b->second.delay_ns; });
+        if (rows.size() > n) rows.resize(n);
+        if (rows.empty()) continue;
+        char line[160];
+        std::snprintf(line, sizeof(line), "  %12s %12s  %s\n", "throttled", "delay_ms", "key");
+        os << line;
+        for (const auto* r : rows) {
+            std::snprintf(line, sizeof(line), "  %12llu %12.1f  ",
+                          static_cast<unsigned long long>(r->second.throttled),
+                          r->second.delay_ns / 1e6);
+            os << line << (r->first.empty() ? "(shared)" : r->first) << '\n';
+        }
+    }
+    return os.str();
+}
+
+void RpcQos::register_metrics(MetricsRegistry& metrics) {
+    for (size_t i = 0; i < kQosScopes; i++) {
+        QosScope scope = static_cast<QosScope>(i);
+        MetricLabels labels = {{"scope", kScopeNames[i]}};
+        metrics.counter("nfsd_qos_throttled_total",
+                        "NFS calls held back by a QoS policy, by the scope of the longest wait",
+                        labels, [this, scope] { return throttled(scope); });
+        metrics.counter_seconds("nfsd_qos_delay_seconds_total",
+                                "Time NFS calls were held back by QoS policies", labels,
+                                [this, scope] { return delay_ns(scope); });
+    }
+    metrics.gauge("nfsd_qos_waiting", "NFS calls currently held back by QoS", {},
+                  [this] { return static_cast<double>(waiting()); });
+    metrics.gauge("nfsd_qos_policies", "QoS policies in force", {},
+                  [this] { return static_cast<double>(policy_count()); });
+    metrics.gauge("nfsd_qos_buckets", "QoS token buckets tracked", {},
+                  [this] { return static_cast<double>(bucket_count()); });
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "rpc/rpc_types.h"
+
+class MetricsRegistry;
+
+// Quality of service for NFS calls: token buckets limiting ops/s and
+// bytes/s per client address, per AUTH_SYS uid or per export, so one
+// tenant's batch job cannot take every other tenant's latency with it.
+//
+// A call over its limit is not rejected: admit() reserves its ops and bytes
+// in every bucket it is charged to and returns how long the caller must
+// wait for them, and RpcServer holds the call that long before dispatch.
+// Reservations are taken in arrival order, so throttled calls form a FIFO
+// queue per bucket. A bucket may go into debt by one call (a 1 MiB READ
+// against a 512 KiB/s bucket is let through when the bucket is idle); the
+// calls after it wait the debt off.
+//
+// Only NFS program calls other than NULL are throttled: MOUNT, NLM and
+// the NULL ping stay prompt whatever the load.
+
+enum class QosScope : uint8_t { CLIENT, UID, EXPORT, COUNT };
+constexpr size_t kQosScopes = static_cast<size_t>(QosScope::COUNT);
+const char* qos_scope_name(QosScope scope);
+
+// One policy; a call is charged to every policy matching it, so the
+// tightest one sets its pace.
+//
+// Spec syntax (parse()): comma-separated key=value pairs
+//   scope=client|uid|export  what the buckets are keyed by (required)
+//   match=10.0.0.*           only keys equal to this, or starting with it
+//                            when it ends in '*'; default every key
+//   shared                   one bucket for every matching key rather
+//                            than one bucket per key
+//   iops=500                 calls per second
+//   bw=50M                   READ/WRITE bytes per second (K, M and G)
+//   burst=200ms              credit an idle bucket builds up (default 100ms)
+// At least one of iops and bw is required.
+struct QosPolicy {
+    QosScope scope = QosScope::CLIENT;
+    std::string match;
+    bool shared = false;
+    double ops_per_sec = 0;
+    uint64_t bytes_per_sec = 0;
+    uint64_t burst_ns = 100000000;
+    std::string spec;  // as parsed, for reports
+
+    bool matches(const std::string& key) const;
+
+    static bool parse(const std::string& spec, QosPolicy& out, std::string& err);
+};
+
+// What a call is charged to
+struct QosRequest {
+    const std::string* client = nullptr;       // peer address
+    const uint32_t* uid = nullptr;             // AUTH_SYS uid, if any
+    const std::string* export_name = nullptr;
+    uint64_t bytes = 0;
+};
+
+class RpcQos {
+public:
+    RpcQos();
+    ~RpcQos();
+
+    RpcQos(const RpcQos&) = delete;
+    RpcQos& operator=(const RpcQos&) = delete;
+
+    // Replace every policy; safe while calls are being admitted. A policy
+    // with the same spec as one it replaces keeps its buckets, so reloading
+    // an unchanged policy file neither forgives nor adds debt.
+    void set_policies(std::vector<QosPolicy> policies);
+    size_t policy_count() const;
+    bool active() const { return active_.load(std::memory_order_relaxed); }
+
+    // Reserve one op and req.bytes in every matching bucket; returns how
+    // long the call must wait before dispatch (0: go now).
+    // now_ns: LatencyStats::now_ns()
+    uint64_t admit(const QosRequest& req, uint64_t now_ns);
+
+    // Charge bytes only known after the call (an NFSv4 COMPOUND's reply)
+    // without holding it; the calls after it pay
+    void charge(const QosRequest& req, uint64_t now_ns);
+
+    // Sleep ns, waking early once running is false (server shutdown)
+    void wait(uint64_t ns, const std::atomic<bool>& running);
+
+    // Bytes to charge up front for a call: the count of an NFSv3 READ or
+    // WRITE (RFC 1813 §3.3.6, §3.3.7), the whole record (and so any WRITE
+    // payload) of an NFSv4 COMPOUND, 0 for anything else. args: the call's
+    // arguments, record_len: the whole record.
+    static uint64_t call_bytes(const RpcCallHeader& call, const uint8_t* args, size_t args_len,
+                               size_t record_len);
+
+    uint64_t throttled(QosScope scope) const {
+        return stats_[static_cast<size_t>(scope)].throttled.load(std::memory_order_relaxed);
+    }
+    uint64_t delay_ns(QosScope scope) const {
+        return stats_[static_cast<size_t>(scope)].delay_ns.load(std::memory_order_relaxed);
+    }
+    int64_t waiting() const { return waiting_.load(std::memory_order_relaxed); }
+    size_t bucket_count() const;
+
+    // Estimated heap held by the buckets
+    uint64_t memory_bytes() const { return bytes_.load(std::memory_order_relaxed); }
+    // Drop idle buckets (nothing reserved past now_ns, so no different from
+    // new ones) until about bytes are freed; returns the bytes freed
+    uint64_t reclaim(uint64_t bytes, uint64_t now_ns);
+
+    // Plain-text table of the policies and their most delayed buckets
+    std::string report(size_t n) const;
+
+    // nfsd_qos_{throttled,delay_seconds}_total by scope, nfsd_qos_waiting,
+    // nfsd_qos_policies, nfsd_qos_buckets
+    void register_metrics(MetricsRegistry& metrics);
+
+private:
+    struct Bucket;
+    struct Policy;
+
+    // Reserve in every matching bucket; longest wait over them
+    uint64_t reserve(const QosRequest& req, uint64_t ops, uint64_t now_ns, bool count);
+
+    struct ScopeStats {
+        std::atomic<uint64_t> throttled{0};
+        std::atomic<uint64_t> delay_ns{0};
+    };
+
+    mutable std::mutex mu_;  // guards policies_ and their buckets
+    std::vector<std::shared_ptr<Policy>> policies_;
+    std::atomic<bool> active_{false};
+    std::atomic<int64_t> waiting_{0};
+    std::atomic<uint64_t> bytes_{0};  // written under mu_
+    ScopeStats stats_[kQosScopes];
+};
@@ -1,15 +1,23 @@
 #include "rpc/rpc_server.h"
+#include "log/logger.h"
+#include "stats/probes.h"
 
+#include <csignal>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include <cstring>
-#include <iostream>
+#include <ctime>
 
 // --- ClientConnection I/O ---
 
-bool ClientConnection::read_exact(void* buf, size_t len) {
+bool ClientConnection::read_exact(void* buf, size_t len, bool between_calls) {
     uint8_t* p = static_cast<uint8_t*>(buf);
     size_t remaining = len;
     while (remaining > 0) {
@@ -19,13 +27,66 @@ bool ClientConnection::read_exact(void* buf, size_t len) {
         } else {
             n = recv(fd, p, remaining, 0);
         }
+        if (n < 0 && errno == EINTR && !tls.is_active()) {
+            if (between_calls && remaining == len) {
+                interrupted = true;
+                return false;
+            }
+            continue;
+        }
         if (n <= 0) return false;
         p += n;
         remaining -= n;
+        rx_offset += n;
     }
     return true;
 }
 
+// socket(7) SO_TIMESTAMPNS - the first recvmsg() of a record carries the
+// CLOCK_REALTIME stamp of the segment its bytes came in; how long ago that
+// was, taken off the steady clock, is when the call reached the socket.
+// TCP merges segments queued behind a busy reader, and the merged one
+// keeps the newest stamp, so a deep queue would look young: the FIONREAD
+// taken at each call says which bytes were already waiting then.
+bool ClientConnection::read_exact_stamped(void* buf, size_t len, uint64_t& arrived_ns) {
+    if (!rx_timestamps || tls.is_active() || len == 0) {
+        bool ok = read_exact(buf, len, true);
+        arrived_ns = LatencyStats::now_ns();
+        return ok;
+    }
+    iovec iov{buf, len};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(timespec))];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    const uint64_t start = rx_offset;
+    ssize_t n = recvmsg(fd, &msg, 0);
+    if (n < 0 && errno == EINTR) interrupted = true;
+    if (n <= 0) return false;
+    rx_offset += n;
+    const uint64_t now = LatencyStats::now_ns();
+    arrived_ns = now;
+    for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPNS) continue;
+        timespec stamp, real;
+        std::memcpy(&stamp, CMSG_DATA(c), sizeof(stamp));
+        clock_gettime(CLOCK_REALTIME, &real);
+        const int64_t waited = (static_cast<int64_t>(real.tv_sec) - stamp.tv_sec) * 1000000000 +
+                               (real.tv_nsec - stamp.tv_nsec);
+        if (waited > 0 && static_cast<uint64_t>(waited) < now) arrived_ns = now - waited;
+    }
+    while (!rx_seen.empty() && rx_seen.front().first <= start) rx_seen.pop_front();
+    if (!rx_seen.empty()) arrived_ns = std::min(arrived_ns, rx_seen.front().second);
+    int waiting = 0;
+    if (ioctl(fd, FIONREAD, &waiting) == 0 && waiting > 0 &&
+        (rx_seen.empty() || rx_seen.back().first < rx_offset + waiting))
+        rx_seen.push_back({rx_offset + waiting, now});
+    size_t got = static_cast<size_t>(n);
+    return got == len || read_exact(static_cast<uint8_t*>(buf) + got, len - got);
+}
+
 ssize_t ClientConnection::read_some(void* buf, size_t len) {
     if (tls.is_active())
         return tls.read(buf, len);
@@ -41,6 +102,7 @@ bool ClientConnection::write_all(const void* buf, size_t len) {
             n = tls.write(p, remaining);
         } else {
             n = send(fd, p, remaining, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
         }
         if (n <= 0) return false;
         p += n;
@@ -49,6 +111,32 @@ bool ClientConnection::write_all(const void* buf, size_t len) {
     return true;
 }
 
+// RFC 5531 §11 - Send with TCP record marking (last-fragment bit set)
+bool ClientConnection::send_record(const uint8_t* data, size_t len) {
+    std::lock_guard<std::mutex> lk(write_mu);
+    if (fd < 0) return false;
+    uint32_t hdr = htonl(static_cast<uint32_t>(len) | 0x80000000);
+    if (!write_all(&hdr, 4)) return false;
+    return write_all(data, len);
+}
+
+// A connection's record buffer larger than this is freed after the call
+static const size_t kKeepRecordBytes = 65536;
+
+// xid of a received record before it is decoded (0 if too short)
+[[maybe_unused]] static uint32_t peek_xid(const std::pmr::vector<uint8_t>& record) {
+    uint32_t xid = 0;
+    if (record.size() >= 4) std::memcpy(&xid, record.data(), 4);
+    return ntohl(xid);
+}
+
+// msg_type of a record at least 8 bytes long
+static uint32_t peek_msg_type(const uint8_t* data) {
+    uint32_t type;
+    std::memcpy(&type, data + 4, 4);
+    return ntohl(type);
+}
+
 // --- RpcServer ---
 
 RpcServer::RpcServer() = default;
@@ -59,7 +147,38 @@ RpcServer::~RpcServer() {
 
 void RpcServer::register_program(uint32_t program, uint32_t version,
                                   RpcProgramHandlers handlers) {
-    programs_[{program, version}] = std::move(handlers);
+    RegisteredProgram& prog = programs_[{program, version}];
+    prog.num_calls = handlers.procedures.empty() ? 0 : handlers.procedures.rbegin()->first + 1;
+    prog.calls.reset(new std::atomic<uint64_t>[prog.num_calls]());
+    prog.handlers = std::move(handlers);
+}
+
+void RpcServer::register_metrics(MetricsRegistry& metrics) {
+    for (const auto& [key, prog] : programs_) {
+        for (const auto& [proc, handler] : prog.handlers.procedures) {
+            const std::atomic<uint64_t>* count = &prog.calls[proc];
+            metrics.counter("nfsd_rpc_calls_total", "RPC calls dispatched to a procedure",
+                            {{"program", std::to_string(key.first)},
+                             {"version", std::to_string(key.second)},
+                             {"procedure", std::to_string(proc)}},
+                            [count] { return count->load(std::memory_order_relaxed); });
+        }
+    }
+
+    static const char* const kReasons[ERR_REASONS] = {
+        "badfmt", "rpcvers", "prog_unavail", "proc_unavail", "system_err"};
+    for (int r = 0; r < ERR_REASONS; r++) {
+        metrics.counter("nfsd_rpc_errors_total", "RPC calls not answered with a procedure result",
+                        {{"reason", kReasons[r]}},
+                        [this, r] { return errors_[r].load(std::memory_order_relaxed); });
+    }
+    metrics.counter("nfsd_connections_accepted_total", "TCP connections accepted", {},
+                    [this] { return connections_accepted_.load(std::memory_order_relaxed); });
+    metrics.gauge("nfsd_connections_active", "Open client connections (one thread each)", {},
+                  [this] { return static_cast<double>(connections_active_.load()); });
+    threads_mu_.register_metrics(metrics);
+    if (latency_stats_)
+        metrics.add_latency_stats(latency_stats_);
 }
 
 void RpcServer::set_tls_context(std::unique_ptr<RpcTlsContext> ctx) {
@@ -86,13 +205,122 @@ void RpcServer::start(uint16_t port) {
     if (listen(listen_fd_, 16) < 0)
         throw std::runtime_error("listen() failed: " + std::string(strerror(errno)));
 
+    start_from(listen_fd_);
+}
+
+void RpcServer::start_from(int listen_fd) {
+    listen_fd_ = listen_fd;
+    // Inherited by accepted connections, so even the segments that arrive
+    // before a connection's thread runs are stamped
+    int opt = 1;
+    if (overload_) setsockopt(listen_fd_, SOL_SOCKET, SO_TIMESTAMPNS, &opt, sizeof(opt));
+    {
+        std::lock_guard<std::mutex> lk(handed_off_mu_);
+        handing_off_ = false;
+        handed_over_ = false;
+    }
     running_ = true;
     {
-        std::lock_guard<std::mutex> lk(threads_mu_);
+        std::lock_guard<ProfiledMutex> lk(threads_mu_);
         threads_.emplace_back(&RpcServer::accept_loop, this, listen_fd_);
     }
 
-    std::cout << "RPC server listening on port " << port << std::endl;
+    NFSD_LOG_INFO(LogSys::RPC, "listening", {{"port", this->port()}});
+}
+
+void RpcServer::adopt(std::vector<HandedOffConnection> conns) {
+    int opt = 1;
+    for (auto& c : conns) {
+        if (overload_) setsockopt(c.fd, SOL_SOCKET, SO_TIMESTAMPNS, &opt, sizeof(opt));
+        spawn_client(c.fd, std::move(c.peer_addr));
+    }
+}
+
+// Interrupts the blocking recv() or accept() of the thread it is sent to
+static void handoff_wakeup(int) {}
+
+bool RpcServer::hand_off(int& listen_fd, uint64_t timeout_ns,
+                         std::vector<HandedOffConnection>& conns) {
+    // No SA_RESTART: the interrupted call returns EINTR
+    struct sigaction sa{};
+    sa.sa_handler = handoff_wakeup;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGURG, &sa, nullptr);
+
+    handing_off_ = true;
+    // A signal can land just before a thread blocks, so keep sending until
+    // every thread has let go
+    const uint64_t deadline = LatencyStats::now_ns() + timeout_ns;
+    while (accepting_) {
+        pthread_kill(accept_thread_, SIGURG);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    while (client_threads_ > 0 && LatencyStats::now_ns() < deadline) {
+        {
+            std::lock_guard<ProfiledMutex> lk(threads_mu_);
+            for (const auto& [id, conn] : live_)
+                if (conn->idle) pthread_kill(conn->thread, SIGURG);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    std::unique_lock<std::mutex> lk(handed_off_mu_);
+    if (client_threads_ > 0) {
+        // A call still in a handler could change the state after the caller
+        // saves it, and answer a client whose new server never hears of it.
+        // Call the hand-off off: threads not yet let go keep serving
+        // (release_connection()), the rest are served again.
+        const int busy = client_threads_.load();
+        handing_off_ = false;
+        std::vector<HandedOffConnection> released = std::move(handed_off_);
+        handed_off_.clear();
+        lk.unlock();
+        NFSD_LOG_WARN(LogSys::RPC, "hand-off called off: calls in progress",
+                      {{"busy", busy}, {"released", released.size()}});
+        start_from(listen_fd_);
+        adopt(std::move(released));
+        listen_fd = -1;
+        return false;
+    }
+    // No thread is left to release a connection; should one still turn up,
+    // release_connection() closes it rather than queue it for no one
+    handed_over_ = true;
+    listen_fd = listen_fd_;
+    listen_fd_ = -1;
+    conns = std::move(handed_off_);
+    handed_off_.clear();
+    NFSD_LOG_INFO(LogSys::RPC, "connections handed off", {{"connections", conns.size()}});
+    return true;
+}
+
+bool RpcServer::release_connection(ClientConnection& conn) {
+    std::lock_guard<std::mutex> lk(conn.write_mu);
+    std::lock_guard<std::mutex> hk(handed_off_mu_);
+    // hand_off() called it off since this thread looked
+    if (!handing_off_) return false;
+    if (conn.tls.is_active() || handed_over_) {
+        close(conn.fd);
+    } else {
+        handed_off_.push_back({conn.fd, conn.peer_addr});
+    }
+    conn.fd = -1;
+    return true;
+}
+
+void RpcServer::spawn_client(int client_fd, std::string peer_addr) {
+    // Counted before the thread runs, so hand_off() waits for it
+    client_threads_.fetch_add(1);
+    std::lock_guard<ProfiledMutex> lk(threads_mu_);
+    threads_.emplace_back(&RpcServer::handle_client, this, client_fd, std::move(peer_addr));
+}
+
+uint16_t RpcServer::port() const {
+    if (listen_fd_ < 0) return 0;
+    sockaddr_in addr{};
+    socklen_t len = sizeof(addr);
+    if (getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len) < 0)
+        return 0;
+    return ntohs(addr.sin_port);
 }
 
 void RpcServer::stop() {
@@ -104,7 +332,7 @@ void RpcServer::stop() {
     }
     std::vector<std::thread> to_join;
     {
-        std::lock_guard<std::mutex> lk(threads_mu_);
+        std::lock_guard<ProfiledMutex> lk(threads_mu_);
         to_join = std::move(threads_);
     }
     for (auto& t : to_join) {
@@ -114,7 +342,9 @@ void RpcServer::stop() {
 }
 
 void RpcServer::accept_loop(int listen_fd) {
-    while (running_) {
+    accept_thread_ = pthread_self();
+    accepting_ = true;
+    while (running_ && !handing_off_) {
         sockaddr_in client_addr{};
         socklen_t client_len = sizeof(client_addr);
         int client_fd = accept(listen_fd,
@@ -128,26 +358,115 @@ void RpcServer::accept_loop(int listen_fd) {
         int opt = 1;
         setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
 
-        {
-            std::lock_guard<std::mutex> lk(threads_mu_);
-            threads_.emplace_back(&RpcServer::handle_client, this, client_fd);
-        }
+        char peer[INET_ADDRSTRLEN] = {};
+        inet_ntop(AF_INET, &client_addr.sin_addr, peer, sizeof(peer));
+
+        spawn_client(client_fd, peer);
     }
+    accepting_ = false;
 }
 
 // RFC 5531 §11 - Record Marking Standard (TCP)
 // Each record is a sequence of fragments; last fragment has bit 31 set in length header.
-void RpcServer::handle_client(int client_fd) {
-    ClientConnection conn;
+void RpcServer::handle_client(int client_fd, std::string peer_addr) {
+    const uint64_t conn_id = connections_accepted_.fetch_add(1, std::memory_order_relaxed) + 1;
+    connections_active_.fetch_add(1, std::memory_order_relaxed);
+    struct ActiveGuard {
+        std::atomic<int64_t>& n;
+        ~ActiveGuard() { n.fetch_sub(1, std::memory_order_relaxed); }
+    } active_guard{connections_active_};
+
+    // On a NUMA machine the connection stays on one node: this thread runs
+    // on its CPUs and its buffers come from its memory
+    std::pmr::memory_resource* buffers = std::pmr::get_default_resource();
+    size_t node = 0;
+    if (numa_) {
+        node = numa_->place(client_fd);
+        numa_->pin(node);
+        buffers = &numa_->pool(node);
+    }
+    struct NodeGuard {
+        NumaPlacement* numa;
+        size_t node;
+        ~NodeGuard() {
+            if (numa) numa->release(node);
+        }
+    } node_guard{numa_, node};
+
+    // Shared so backchannel senders can outlive a closed connection safely
+    auto conn_ptr = std::make_shared<ClientConnection>(buffers);
+    ClientConnection& conn = *conn_ptr;
     conn.fd = client_fd;
+    conn.id = static_cast<uint32_t>(conn_id);
+    conn.peer_addr = std::move(peer_addr);
+    conn.rx_timestamps = overload_ != nullptr;
+    conn.thread = pthread_self();
 
+    {
+        std::lock_guard<ProfiledMutex> lk(threads_mu_);
+        live_[conn.id] = conn_ptr;
+    }
+    struct LiveGuard {
+        RpcServer& srv;
+        uint32_t id;
+        ~LiveGuard() {
+            {
+                std::lock_guard<ProfiledMutex> lk(srv.threads_mu_);
+                srv.live_.erase(id);
+            }
+            srv.client_threads_.fetch_sub(1);
+        }
+    } live_guard{*this, conn.id};
+
+    // Backchannel calls are plain-TCP only: the TLS session is not safe to
+    // write from a second thread while this one is reading.
+    std::weak_ptr<ClientConnection> weak_conn = conn_ptr;
+    conn.back_channel = [weak_conn](const uint8_t* data, size_t len) {
+        auto c = weak_conn.lock();
+        if (!c || c->tls.is_active()) return false;
+        return c->send_record(data, len);
+    };
+
+    auto close_conn = [&] {
+        std::lock_guard<std::mutex> lk(conn.write_mu);
+        close(client_fd);
+        conn.fd = -1;
+    };
+
+    struct ArenaGuard {
+        std::atomic<uint64_t>& total;
+        size_t held;
+        ~ArenaGuard() { total.fetch_sub(held, std::memory_order_relaxed); }
+    } arena_guard{arena_bytes_, conn.arena.capacity()};
+    arena_bytes_.fetch_add(arena_guard.held, std::memory_order_relaxed);
+
+    // Kept from call to call like the arena, unless a large WRITE grew it
+    std::pmr::vector<uint8_t> record(buffers);
     while (running_) {
-        std::vector<uint8_t> record;
+        if (record.capacity() > kKeepRecordBytes) std::pmr::vector<uint8_t>(buffers).swap(record);
+        record.clear();
         bool complete = false;
+        uint64_t arrived_ns = 0;
 
         while (!complete) {
             uint8_t hdr[4];
-            if (!conn.read_exact(hdr, 4)) { close(client_fd); return; }
+            bool ok;
+            if (record.empty()) {
+                // Between calls: where a connection can move to another
+                // process (hand_off())
+                conn.idle = true;
+                if (handing_off_ && release_connection(conn)) return;
+                ok = overload_ ? conn.read_exact_stamped(hdr, 4, arrived_ns)
+                               : conn.read_exact(hdr, 4, true);
+                conn.idle.store(false, std::memory_order_relaxed);
+                if (!ok && conn.interrupted) {
+                    conn.interrupted = false;
+                    continue;
+                }
+            } else {
+                ok = conn.read_exact(hdr, 4);
+            }
+            if (!ok) { close_conn(); return; }
 
             uint32_t raw = (static_cast<uint32_t>(hdr[0]) << 24) |
                            (static_cast<uint32_t>(hdr[1]) << 16) |
@@ -156,29 +475,38 @@ void RpcServer::handle_client(int client_fd) {
             bool last_fragment = (raw & 0x80000000) != 0;
             uint32_t frag_len = raw & 0x7FFFFFFF;
 
-            if (frag_len > 1024 * 1024) { close(client_fd); return; }
+            if (frag_len > 1024 * 1024) { close_conn(); return; }
 
             size_t old_size = record.size();
             record.resize(old_size + frag_len);
             if (!conn.read_exact(record.data() + old_size, frag_len)) {
-                close(client_fd);
+                close_conn();
                 return;
             }
 
             complete = last_fragment;
 
             // Guard against unbounded accumulation
-            if (record.size() > 16 * 1024 * 1024) { close(client_fd); return; }
+            if (record.size() > 16 * 1024 * 1024) { close_conn(); return; }
         }
 
-        process_rpc_message(record.data(), record.size(), conn);
+        const bool timed = latency_stats_ || client_stats_ || slow_op_log_ || request_tracer_;
+        uint64_t received_ns = timed ? LatencyStats::now_ns() : 0;
+        NFSD_PROBE2(rpc__receive, peek_xid(record), record.size());
+        if (capture_) capture_->record(CaptureKind::RECEIVED, conn.id, record.data(), record.size());
+        process_rpc_message(record.data(), record.size(), conn, received_ns, arrived_ns);
+        conn.arena.reset();
+        if (conn.arena.capacity() != arena_guard.held) {
+            arena_bytes_.fetch_add(conn.arena.capacity() - arena_guard.held,
+                                   std::memory_order_relaxed);
+            arena_guard.held = conn.arena.capacity();
+        }
     }
-    close(client_fd);
+    close_conn();
 }
 
 // RFC 5531 §7.1 - Decode call_body (xid, msg_type, rpcvers, prog, vers, proc, cred, verf)
-RpcCallHeader RpcServer::decode_call_header(XdrDecoder& dec) {
-    RpcCallHeader call;
+void RpcServer::decode_call_header(XdrDecoder& dec, RpcCallHeader& call) {
     call.xid = dec.decode_uint32();
     uint32_t msg_type = dec.decode_uint32();
     if (msg_type != static_cast<uint32_t>(RpcMsgType::CALL))
@@ -191,26 +519,26 @@ RpcCallHeader RpcServer::decode_call_header(XdrDecoder& dec) {
 
     // Credential
     call.credential.flavor = static_cast<RpcAuthFlavor>(dec.decode_uint32());
-    call.credential.body = dec.decode_opaque();
+    call.credential.body = dec.decode_opaque(call.arena);
 
     // Verifier
     call.verifier.flavor = static_cast<RpcAuthFlavor>(dec.decode_uint32());
-    call.verifier.body = dec.decode_opaque();
-
-    return call;
+    call.verifier.body = dec.decode_opaque(call.arena);
 }
 
 // RFC 5531 §8.2.2 - AUTH_SYS (stamp, machinename, uid, gid, gids)
-RpcAuthSys RpcServer::parse_auth_sys(const RpcOpaqueAuth& auth) {
-    RpcAuthSys sys;
+RpcAuthSys RpcServer::parse_auth_sys(const RpcOpaqueAuth& auth, std::pmr::memory_resource* mr) {
+    RpcAuthSys sys(mr);
     if (auth.body.empty()) return sys;
 
     XdrDecoder dec(auth.body.data(), auth.body.size());
     sys.stamp = dec.decode_uint32();
-    sys.machinename = dec.decode_string();
+    sys.machinename = dec.decode_string(mr);
     sys.uid = dec.decode_uint32();
     sys.gid = dec.decode_uint32();
     uint32_t ngids = dec.decode_uint32();
+    // At most 16 (RFC 5531 §8.2.2); each takes 4 bytes of the body
+    sys.gids.reserve(std::min<size_t>(ngids, dec.remaining() / 4));
     for (uint32_t i = 0; i < ngids; ++i)
         sys.gids.push_back(dec.decode_uint32());
     return sys;
@@ -233,34 +561,52 @@ bool RpcServer::try_tls_upgrade(ClientConnection& conn, const RpcCallHeader& cal
     // Upgrade to TLS
     SSL* ssl = tls_ctx_->create_ssl(conn.fd);
     if (!ssl) {
-        std::cerr << "  TLS: failed to create SSL session\n";
+        NFSD_LOG_ERROR(LogSys::TLS, "cannot create TLS session", {{"client", conn.peer_addr}});
         return true;  // handled (but failed)
     }
 
     conn.tls = RpcTlsSession(ssl);
     if (!conn.tls.handshake()) {
-        std::cerr << "  TLS: handshake failed, closing connection\n";
+        NFSD_LOG_WARN(LogSys::TLS, "handshake failed, closing connection",
+                      {{"client", conn.peer_addr}});
         conn.tls = RpcTlsSession();  // clear failed session
         return true;  // handled (but failed)
     }
 
-    std::cerr << "  TLS: connection upgraded successfully\n";
+    NFSD_LOG_INFO(LogSys::TLS, "connection upgraded", {{"client", conn.peer_addr}});
     return true;
 }
 
 // RFC 5531 §7 - RPC message dispatch (program/version/procedure lookup)
 void RpcServer::process_rpc_message(const uint8_t* data, size_t len,
-                                     ClientConnection& conn) {
+                                     ClientConnection& conn, uint64_t received_ns,
+                                     uint64_t arrived_ns) {
+    const bool timed = latency_stats_ || client_stats_ || slow_op_log_ || request_tracer_;
+    // One timestamp per phase boundary: receiving the record's last byte
+    // starts decode (handle_client stamps it just before calling here)
+    if (timed && received_ns == 0) received_ns = LatencyStats::now_ns();
+    // RFC 8881 §2.9.3.1 - a REPLY on a client's connection answers one of
+    // our backchannel calls (CB_RECALL, CB_NOTIFY_LOCK)
+    if (len >= 8 && peek_msg_type(data) == static_cast<uint32_t>(RpcMsgType::REPLY)) {
+        if (back_channel_reply_) back_channel_reply_(data, len);
+        return;
+    }
     XdrDecoder dec(data, len);
-    RpcCallHeader call;
+    RpcCallHeader call(&conn.arena);
     try {
-        call = decode_call_header(dec);
+        decode_call_header(dec, call);
     } catch (...) {
+        errors_[ERR_BADFMT].fetch_add(1, std::memory_order_relaxed);
         return; // malformed, drop silently
     }
+    call.client_addr = conn.peer_addr;
+    call.back_channel = &conn.back_channel;
+    NFSD_PROBE4(rpc__decoded, call.xid, call.program, call.version, call.procedure);
 
     if (call.rpc_version != 2) {
-        std::cerr << "RPC version mismatch: " << call.rpc_version << std::endl;
+        errors_[ERR_RPCVERS].fetch_add(1, std::memory_order_relaxed);
+        NFSD_LOG_WARN(LogSys::RPC, "RPC version mismatch",
+                      {{"client", conn.peer_addr}, {"xid", call.xid}, {"rpcvers", call.rpc_version}});
         send_denied_reply(conn, call.xid, RpcRejectStatus::RPC_MISMATCH, 2, 2);
         return;
     }
@@ -271,30 +617,148 @@ void RpcServer::process_rpc_message(const uint8_t* data, size_t len,
 
     auto it = programs_.find({call.program, call.version});
     if (it == programs_.end()) {
-        std::cerr << "RPC: program/version not found" << std::endl;
+        errors_[ERR_PROG_UNAVAIL].fetch_add(1, std::memory_order_relaxed);
+        NFSD_LOG_WARN(LogSys::RPC, "program/version not registered",
+                      {{"client", conn.peer_addr}, {"prog", call.program}, {"vers", call.version}});
         XdrEncoder body;
         send_accepted_reply(conn, call.xid, RpcAcceptStatus::PROG_UNAVAIL, body);
         return;
     }
 
-    auto proc_it = it->second.procedures.find(call.procedure);
-    if (proc_it == it->second.procedures.end()) {
+    RegisteredProgram& prog = it->second;
+    auto proc_it = prog.handlers.procedures.find(call.procedure);
+    if (proc_it == prog.handlers.procedures.end()) {
+        errors_[ERR_PROC_UNAVAIL].fetch_add(1, std::memory_order_relaxed);
         XdrEncoder body;
         send_accepted_reply(conn, call.xid, RpcAcceptStatus::PROC_UNAVAIL, body);
         return;
     }
 
-    XdrEncoder reply_body;
+    prog.calls[call.procedure].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t decoded_ns = timed ? LatencyStats::now_ns() : 0;
+    // Overload control: sojourn from reaching the socket to here
+    if (overload_ && call.program == NFS_PROGRAM && call.procedure != 0) {
+        const uint64_t now = decoded_ns ? decoded_ns : LatencyStats::now_ns();
+        if (overload_->sample(arrived_ns && now > arrived_ns ? now - arrived_ns : 0, now))
+            call.overload = overload_;
+    }
+    // QoS: hold the call until its buckets allow it; counted as queueing
+    QosRequest qos_req;
+    uint64_t throttle_ns = 0;
+    if (qos_ && qos_->active() && call.program == NFS_PROGRAM && call.procedure != 0) {
+        client_stats_key(conn, call.credential);
+        qos_req.client = &conn.peer_addr;
+        qos_req.uid = conn.stats_auth_sys ? &conn.stats_uid : nullptr;
+        qos_req.export_name = export_key_.name.empty() ? nullptr : &export_key_.name;
+        qos_req.bytes = RpcQos::call_bytes(call, data + (len - dec.remaining()),
+                                           dec.remaining(), len);
+        throttle_ns = qos_->admit(qos_req, decoded_ns ? decoded_ns : LatencyStats::now_ns());
+        if (throttle_ns) qos_->wait(throttle_ns, running_);
+    }
+    uint64_t dispatch_ns = timed && throttle_ns ? LatencyStats::now_ns() : decoded_ns;
+    XdrEncoder reply_body(call.arena);
+    RequestTrace trace;
+    if (request_tracer_) {
+        static const std::string kNoClient;
+        const std::string& client = request_tracer_->filters_clients()
+                                        ? client_stats_key(conn, call.credential).name
+                                        : kNoClient;
+        if (request_tracer_->sample(client)) trace.spans = request_tracer_->thread_ring();
+        trace.xid = call.xid;
+    }
+    RequestTraceScope trace_scope(slow_op_log_ || trace.spans ? &trace : nullptr);
+    ProbeXidScope probe_xid(call.xid);
+    NFSD_PROBE4(rpc__dispatch__start, call.xid, call.program, call.version, call.procedure);
     try {
         proc_it->second(call, dec, reply_body);
+        NFSD_PROBE5(rpc__dispatch__done, call.xid, call.program, call.version, call.procedure, 1);
     } catch (const std::exception& e) {
-        std::cerr << "RPC procedure error: " << e.what() << std::endl;
+        NFSD_PROBE5(rpc__dispatch__done, call.xid, call.program, call.version, call.procedure, 0);
+        errors_[ERR_SYSTEM].fetch_add(1, std::memory_order_relaxed);
+        NFSD_LOG_ERROR(LogSys::RPC, "procedure failed",
+                       {{"client", conn.peer_addr}, {"xid", call.xid}, {"prog", call.program},
+                        {"vers", call.version}, {"proc", call.procedure}, {"error", e.what()}});
         XdrEncoder err_body;
         send_accepted_reply(conn, call.xid, RpcAcceptStatus::SYSTEM_ERR, err_body);
         return;
     }
+    uint64_t handled_ns = timed ? LatencyStats::now_ns() : 0;
 
     send_accepted_reply(conn, call.xid, RpcAcceptStatus::SUCCESS, reply_body);
+    // An NFSv4 READ's bytes are only known from its reply
+    if (qos_req.client && call.version != NFS_V3) {
+        qos_req.bytes = reply_body.size();
+        qos_->charge(qos_req, handled_ns ? handled_ns : LatencyStats::now_ns());
+    }
+
+    if (!timed) return;
+    uint64_t sent_ns = LatencyStats::now_ns();
+    const uint64_t phases[kLatencyPhases] = {
+        dispatch_ns - decoded_ns, decoded_ns - received_ns, handled_ns - dispatch_ns,
+        sent_ns - handled_ns};
+    if (latency_stats_)
+        latency_stats_->record_call({call.program, call.version, call.procedure}, phases);
+    if (trace.spans) {
+        const uint32_t reply_bytes = static_cast<uint32_t>(reply_body.size());
+        trace.spans->push({received_ns, sent_ns - received_ns, nullptr, call.xid,
+                           call.program, call.version, call.procedure, SpanKind::CALL});
+        trace.spans->push({received_ns, phases[1], nullptr, call.xid, 0, 0, 0, SpanKind::DECODE});
+        if (dispatch_ns != decoded_ns)
+            trace.spans->push({decoded_ns, dispatch_ns - decoded_ns, nullptr, call.xid, 0, 0, 0,
+                               SpanKind::THROTTLE});
+        trace.spans->push({dispatch_ns, phases[2], nullptr, call.xid, 0, 0, 0,
+                           SpanKind::HANDLER});
+        trace.spans->push({handled_ns, phases[3], nullptr, call.xid, reply_bytes, 0, 0,
+                           SpanKind::SEND});
+    }
+    if (slow_op_log_ && sent_ns - received_ns >= slow_op_log_->threshold_ns()) {
+        SlowOpRecord rec;
+        rec.wall_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+        rec.xid = call.xid;
+        rec.client = client_stats_key(conn, call.credential).name;
+        rec.program = call.program;
+        rec.version = call.version;
+        rec.procedure = call.procedure;
+        rec.bytes_in = len;
+        rec.bytes_out = reply_body.size();
+        std::copy(std::begin(phases), std::end(phases), rec.phases);
+        rec.trace = std::move(trace);
+        slow_op_log_->submit(std::move(rec));
+    }
+    if (client_stats_) {
+        TalkerSample sample;
+        sample.bytes_in = len;
+        sample.bytes_out = reply_body.size();
+        sample.busy_ns = sent_ns - received_ns;
+        client_stats_->record(client_stats_key(conn, call.credential), export_key_, sample);
+    }
+}
+
+// Peer address plus AUTH_SYS machinename/uid; the parsed key is cached on
+// the connection since clients rarely switch credentials mid-stream
+const TalkerKey& RpcServer::client_stats_key(ClientConnection& conn,
+                                             const RpcOpaqueAuth& cred) {
+    if (!conn.stats_client.name.empty() && conn.stats_cred.flavor == cred.flavor &&
+        conn.stats_cred.body == cred.body)
+        return conn.stats_client;
+
+    bool auth_sys = cred.flavor == RpcAuthFlavor::AUTH_SYS;
+    RpcAuthSys sys;
+    if (auth_sys) {
+        try {
+            sys = parse_auth_sys(cred);
+        } catch (...) {
+            auth_sys = false;
+        }
+    }
+    conn.stats_cred = cred;
+    conn.stats_auth_sys = auth_sys;
+    conn.stats_uid = sys.uid;
+    conn.stats_client =
+        TalkerKey(ClientStats::client_key(conn.peer_addr, auth_sys, sys.machinename, sys.uid));
+    return conn.stats_client;
 }
 
 // RFC 9289 §4.1 - STARTTLS accepted reply
@@ -321,7 +785,8 @@ void RpcServer::send_starttls_reply(ClientConnection& conn, uint32_t xid) {
 void RpcServer::send_accepted_reply(ClientConnection& conn, uint32_t xid,
                                      RpcAcceptStatus status,
                                      const XdrEncoder& body) {
-    XdrEncoder reply;
+    XdrEncoder reply(&conn.arena);
+    reply.reserve(24 + body.size());
     reply.encode_uint32(xid);
     reply.encode_uint32(static_cast<uint32_t>(RpcMsgType::REPLY));
     reply.encode_uint32(static_cast<uint32_t>(RpcReplyStatus::MSG_ACCEPTED));
@@ -339,8 +804,9 @@ void RpcServer::send_accepted_reply(ClientConnection& conn, uint32_t xid,
     }
 
     if (!send_record(conn, reply.data().data(), reply.size())) {
-        std::cerr << "send_record failed for xid " << xid << std::endl;
+        NFSD_LOG_WARN(LogSys::RPC, "reply send failed", {{"client", conn.peer_addr}, {"xid", xid}});
     }
+    NFSD_PROBE3(rpc__reply, xid, reply.size(), static_cast<uint32_t>(status));
 }
 
 // RFC 5531 §7.2 - rejected_reply (MSG_DENIED + reject_stat)
@@ -358,13 +824,11 @@ void RpcServer::send_denied_reply(ClientConnection& conn, uint32_t xid,
     }
 
     if (!send_record(conn, reply.data().data(), reply.size())) {
-        std::cerr << "send_record failed for xid " << xid << std::endl;
+        NFSD_LOG_WARN(LogSys::RPC, "reply send failed", {{"client", conn.peer_addr}, {"xid", xid}});
     }
 }
 
-// RFC 5531 §11 - Send with TCP record marking (last-fragment bit set)
 bool RpcServer::send_record(ClientConnection& conn, const uint8_t* data, size_t len) {
-    uint32_t hdr = htonl(static_cast<uint32_t>(len) | 0x80000000);
-    if (!conn.write_all(&hdr, 4)) return false;
-    return conn.write_all(data, len);
+    if (capture_ && capture_->replies()) capture_->record(CaptureKind::SENT, conn.id, data, len);
+    return conn.send_record(data, len);
 }
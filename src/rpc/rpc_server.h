@@ -1,15 +1,29 @@
 #pragma once
 
 #include <cstdint>
+#include <deque>
 #include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <atomic>
+#include <pthread.h>
 #include <thread>
 #include <vector>
+#include "rpc/rpc_arena.h"
+#include "rpc/rpc_capture.h"
+#include "rpc/rpc_numa.h"
+#include "rpc/rpc_overload.h"
+#include "rpc/rpc_qos.h"
 #include "rpc/rpc_types.h"
 #include "rpc/rpc_tls.h"
+#include "stats/client_stats.h"
+#include "stats/latency_stats.h"
+#include "stats/slow_op_log.h"
+#include "stats/metrics.h"
+#include "stats/profiled_mutex.h"
+#include "stats/request_tracer.h"
 #include "xdr/xdr_codec.h"
 
 // RFC 5531 - ONC RPC v2
@@ -26,15 +40,57 @@ struct RpcProgramHandlers {
 
 // Per-client connection state (raw TCP or TLS-upgraded)
 struct ClientConnection {
+    // buffers: where the request arena gets its blocks
+    explicit ClientConnection(
+        std::pmr::memory_resource* buffers = std::pmr::get_default_resource())
+        : arena(buffers) {}
+
     int fd = -1;
+    uint32_t id = 0;        // order of acceptance, from 1; names the connection in captures
+    std::string peer_addr;  // dotted-quad IPv4 address of the client
+    RpcBackChannel back_channel;  // handed to handlers via RpcCallHeader
     RpcTlsSession tls;
+    // Temporaries of the call being served (RpcCallHeader::arena), reset
+    // after each reply
+    RequestArena arena;
+    // ClientStats key for the last credential seen on this connection
+    // (rebuilt only when the credential changes)
+    RpcOpaqueAuth stats_cred;
+    TalkerKey stats_client;
+    bool stats_auth_sys = false;  // and its AUTH_SYS uid, for QoS
+    uint32_t stats_uid = 0;
+    // Overload control: SO_TIMESTAMPNS is on; bytes read so far; and
+    // {stream offset, time} pairs: everything before the offset was
+    // already waiting in the socket at that time
+    bool rx_timestamps = false;
+    uint64_t rx_offset = 0;
+    std::deque<std::pair<uint64_t, uint64_t>> rx_seen;
+    // Binary upgrade: the connection's thread, which RpcServer::hand_off()
+    // interrupts while it waits for a call (idle) so it lets go of the
+    // connection; interrupted: a read gave up for that, having read nothing
+    pthread_t thread{};
+    std::atomic<bool> idle{false};
+    bool interrupted = false;
 
-    // Read exactly len bytes. Returns true on success.
-    bool read_exact(void* buf, size_t len);
+    // Read exactly len bytes. Returns true on success. between_calls: a
+    // signal before anything is read ends the read (interrupted); else
+    // reads resume after signals.
+    bool read_exact(void* buf, size_t len, bool between_calls = false);
+    // read_exact() of a call's first bytes (between_calls), also setting
+    // arrived_ns (LatencyStats::now_ns() clock) to when the first of the
+    // bytes reached the socket. With rx_timestamps on a plain TCP
+    // connection that is the earlier of the kernel's receive stamp and
+    // when the bytes were first seen waiting, else now.
+    bool read_exact_stamped(void* buf, size_t len, uint64_t& arrived_ns);
     // Read up to len bytes. Returns bytes read, 0 on close, -1 on error.
     ssize_t read_some(void* buf, size_t len);
     // Write all bytes. Returns true on success.
     bool write_all(const void* buf, size_t len);
+    // Write one record-marked message. Serialized so backchannel calls
+    // never interleave with replies.
+    bool send_record(const uint8_t* data, size_t len);
+
+    std::mutex write_mu;
 };
 
 class RpcServer {
@@ -49,24 +105,117 @@ public:
     // Set TLS context (optional — if not set, AUTH_TLS probes are ignored).
     void set_tls_context(std::unique_ptr<RpcTlsContext> ctx);
 
+    // Record per-procedure latency into stats (optional, not owned).
+    // Call before start().
+    void set_latency_stats(LatencyStats* stats) { latency_stats_ = stats; }
+
+    // Account ops, bytes and busy time per client and against export_name
+    // (optional, not owned). Call before start().
+    void set_client_stats(ClientStats* stats, std::string export_name) {
+        client_stats_ = stats;
+        export_key_ = TalkerKey(std::move(export_name));
+    }
+
+    // Log calls slower than log->threshold_ns() (optional, not owned).
+    // Call before start().
+    void set_slow_op_log(SlowOpLog* log) { slow_op_log_ = log; }
+
+    // Record timelines of the calls tracer samples (optional, not owned).
+    // Call before start().
+    void set_request_tracer(RequestTracer* tracer) { request_tracer_ = tracer; }
+
+    // Hand the REPLY records that arrive on client connections — answers
+    // to backchannel calls (RFC 8881 §2.9.3.1) — to handler (optional).
+    // Call before start().
+    using BackChannelReplyHandler = std::function<void(const uint8_t* data, size_t len)>;
+    void set_backchannel_reply_handler(BackChannelReplyHandler handler) {
+        back_channel_reply_ = std::move(handler);
+    }
+
+    // Copy every record received, and every reply if capture->replies(),
+    // into capture (optional, not owned). Call before start().
+    void set_capture(RpcCapture* capture) { capture_ = capture; }
+
+    // Hold NFS calls back to the rates qos's policies allow (optional,
+    // not owned; the policies may change while running). Buckets of
+    // scope export are keyed by the set_client_stats() export name.
+    // Call before start().
+    void set_qos(RpcQos* qos) { qos_ = qos; }
+
+    // Let NFS handlers shed expensive calls while control finds the server
+    // overloaded (optional, not owned). Turns on SO_TIMESTAMPNS for every
+    // connection accepted to measure how long calls queued in the socket.
+    // Call before start().
+    void set_overload_control(OverloadControl* control) { overload_ = control; }
+
+    // Keep each connection on one NUMA node (optional, not owned): its
+    // thread pinned to the node's CPUs, its record buffer and request
+    // arena from the node's pool. Call before start().
+    void set_numa(NumaPlacement* numa) { numa_ = numa; }
+
+    // Export call, error and connection counters. Call after every
+    // register_program() and before start().
+    void register_metrics(MetricsRegistry& metrics);
+
     // Start listening on the given port (TCP).
     void start(uint16_t port);
     void stop();
 
-    // Parse AUTH_SYS credentials from opaque auth body.
-    static RpcAuthSys parse_auth_sys(const RpcOpaqueAuth& auth);
+    // Binary upgrade. A plain TCP connection between calls holds nothing
+    // in this process (records are read straight into the call being
+    // served), so another process can carry on reading it.
+    struct HandedOffConnection {
+        int fd = -1;
+        std::string peer_addr;
+    };
+    // Old process: stop accepting, and take every connection off its
+    // thread once its call in progress is answered, waiting up to
+    // timeout_ns. Returns true with the listening socket (still listening,
+    // no longer accepted on) and the plain TCP connections in conns, which
+    // the caller now owns; no call is being served any more. TLS
+    // connections cannot move their session and are closed. If a call is
+    // still in progress at the timeout, hands nothing off: serves on as
+    // before and returns false.
+    bool hand_off(int& listen_fd, uint64_t timeout_ns, std::vector<HandedOffConnection>& conns);
+    // New process, or the old one taking back what hand_off() gave: accept
+    // on an already listening socket, and serve handed-off connections
+    void start_from(int listen_fd);
+    void adopt(std::vector<HandedOffConnection> conns);
+
+    // Bound TCP port (useful after start(0) picks an ephemeral port).
+    uint16_t port() const;
+
+    // Parse AUTH_SYS credentials from opaque auth body, allocating the
+    // machine name and gids from mr (RpcCallHeader::arena in handlers).
+    static RpcAuthSys parse_auth_sys(const RpcOpaqueAuth& auth,
+                                     std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+    // Bytes the connections' request arenas hold between calls
+    uint64_t arena_bytes() const { return arena_bytes_.load(std::memory_order_relaxed); }
 
 private:
     void accept_loop(int listen_fd);
-    void handle_client(int client_fd);
+    void handle_client(int client_fd, std::string peer_addr);
+    // Start handle_client() on a thread
+    void spawn_client(int client_fd, std::string peer_addr);
+    // Between calls while handing off: queue conn for hand_off(), or close
+    // it if hand_off() has returned. False if the hand-off was called off
+    // and the thread should serve on.
+    bool release_connection(ClientConnection& conn);
 
     // Returns true if the message was handled (STARTTLS upgrade).
     // Returns false if normal dispatch should continue.
     bool try_tls_upgrade(ClientConnection& conn, const RpcCallHeader& call);
 
-    void process_rpc_message(const uint8_t* data, size_t len, ClientConnection& conn);
+    // received_ns: LatencyStats::now_ns() when the record was fully read;
+    // arrived_ns: when its first bytes reached the socket (0: unknown)
+    void process_rpc_message(const uint8_t* data, size_t len, ClientConnection& conn,
+                             uint64_t received_ns = 0, uint64_t arrived_ns = 0);
 
-    RpcCallHeader decode_call_header(XdrDecoder& dec);
+    const TalkerKey& client_stats_key(ClientConnection& conn, const RpcOpaqueAuth& cred);
+
+    // Into call, whose credential and verifier allocate from its arena
+    void decode_call_header(XdrDecoder& dec, RpcCallHeader& call);
     void send_accepted_reply(ClientConnection& conn, uint32_t xid,
                              RpcAcceptStatus status, const XdrEncoder& body);
     void send_starttls_reply(ClientConnection& conn, uint32_t xid);
@@ -75,12 +224,51 @@ private:
                            uint32_t low_ver, uint32_t high_ver);
     bool send_record(ClientConnection& conn, const uint8_t* data, size_t len);
 
+    struct RegisteredProgram {
+        RpcProgramHandlers handlers;
+        // Calls per procedure number (sized to the highest registered procedure)
+        std::unique_ptr<std::atomic<uint64_t>[]> calls;
+        size_t num_calls = 0;
+    };
+
+    // Why a call was answered with something other than a procedure result
+    enum ErrorReason { ERR_BADFMT, ERR_RPCVERS, ERR_PROG_UNAVAIL, ERR_PROC_UNAVAIL,
+                       ERR_SYSTEM, ERR_REASONS };
+
     // Key: {program, version}
-    std::map<std::pair<uint32_t, uint32_t>, RpcProgramHandlers> programs_;
+    std::map<std::pair<uint32_t, uint32_t>, RegisteredProgram> programs_;
+
+    std::atomic<uint64_t> errors_[ERR_REASONS] = {};
+    std::atomic<uint64_t> connections_accepted_{0};
+    std::atomic<int64_t> connections_active_{0};
+    std::atomic<uint64_t> arena_bytes_{0};
 
     std::unique_ptr<RpcTlsContext> tls_ctx_;
+    LatencyStats* latency_stats_ = nullptr;
+    ClientStats* client_stats_ = nullptr;
+    SlowOpLog* slow_op_log_ = nullptr;
+    RequestTracer* request_tracer_ = nullptr;
+    RpcCapture* capture_ = nullptr;
+    BackChannelReplyHandler back_channel_reply_;
+    RpcQos* qos_ = nullptr;
+    OverloadControl* overload_ = nullptr;
+    NumaPlacement* numa_ = nullptr;
+    TalkerKey export_key_;
     std::atomic<bool> running_{false};
-    std::mutex threads_mu_;
+    ProfiledMutex threads_mu_{"rpc_threads"};
     std::vector<std::thread> threads_;
     int listen_fd_ = -1;
+
+    // Binary upgrade
+    std::atomic<bool> handing_off_{false};
+    std::atomic<bool> accepting_{false};
+    pthread_t accept_thread_{};
+    std::atomic<int> client_threads_{0};
+    // Connections being served, by id, to interrupt; guarded by threads_mu_
+    std::map<uint32_t, std::shared_ptr<ClientConnection>> live_;
+    // handed_over_: hand_off() has returned the connections. Both guarded
+    // by handed_off_mu_, as are changes to handing_off_.
+    std::mutex handed_off_mu_;
+    std::vector<HandedOffConnection> handed_off_;
+    bool handed_over_ = false;
 };
@@ -1,6 +1,7 @@
 #include "rpc/rpc_tls.h"
+#include "log/logger.h"
 #include <openssl/err.h>
-#include <iostream>
+#include <string>
 
 // RFC 9289 §5.1 — ALPN protocol identifier for ONC RPC
 static int alpn_select_cb(SSL*, const unsigned char** out, unsigned char* outlen,
@@ -20,12 +21,24 @@ static int alpn_select_cb(SSL*, const unsigned char** out, unsigned char* outlen
     return SSL_TLSEXT_ERR_ALERT_FATAL;
 }
 
+// Drain this thread's OpenSSL error queue into one string
+static std::string ssl_errors() {
+    std::string out;
+    char buf[256];
+    while (unsigned long e = ERR_get_error()) {
+        ERR_error_string_n(e, buf, sizeof(buf));
+        if (!out.empty()) out += "; ";
+        out += buf;
+    }
+    return out;
+}
+
 RpcTlsContext::RpcTlsContext(const std::string& cert_path,
                              const std::string& key_path) {
     const SSL_METHOD* method = TLS_server_method();
     ctx_ = SSL_CTX_new(method);
     if (!ctx_) {
-        std::cerr << "  TLS: failed to create SSL_CTX\n";
+        NFSD_LOG_ERROR(LogSys::TLS, "cannot create SSL_CTX", {{"ssl_error", ssl_errors()}});
         return;
     }
 
@@ -37,8 +50,8 @@ RpcTlsContext::RpcTlsContext(const std::string& cert_path,
 
     // Load server certificate
     if (SSL_CTX_use_certificate_chain_file(ctx_, cert_path.c_str()) != 1) {
-        std::cerr << "  TLS: failed to load certificate from " << cert_path << "\n";
-        ERR_print_errors_fp(stderr);
+        NFSD_LOG_ERROR(LogSys::TLS, "cannot load certificate",
+                       {{"path", cert_path}, {"ssl_error", ssl_errors()}});
         SSL_CTX_free(ctx_);
         ctx_ = nullptr;
         return;
@@ -46,15 +59,16 @@ RpcTlsContext::RpcTlsContext(const std::string& cert_path,
 
     // Load private key (must be unencrypted)
     if (SSL_CTX_use_PrivateKey_file(ctx_, key_path.c_str(), SSL_FILETYPE_PEM) != 1) {
-        std::cerr << "  TLS: failed to load private key from " << key_path << "\n";
-        ERR_print_errors_fp(stderr);
+        NFSD_LOG_ERROR(LogSys::TLS, "cannot load private key",
+                       {{"path", key_path}, {"ssl_error", ssl_errors()}});
         SSL_CTX_free(ctx_);
         ctx_ = nullptr;
         return;
     }
 
     if (SSL_CTX_check_private_key(ctx_) != 1) {
-        std::cerr << "  TLS: certificate and private key do not match\n";
+        NFSD_LOG_ERROR(LogSys::TLS, "certificate and private key do not match",
+                       {{"cert", cert_path}, {"key", key_path}});
         SSL_CTX_free(ctx_);
         ctx_ = nullptr;
         return;
@@ -108,8 +122,8 @@ bool RpcTlsSession::handshake() {
     int ret = SSL_accept(ssl_);
     if (ret != 1) {
         int err = SSL_get_error(ssl_, ret);
-        std::cerr << "  TLS: handshake failed (SSL error " << err << ")\n";
-        ERR_print_errors_fp(stderr);
+        NFSD_LOG_WARN(LogSys::TLS, "handshake failed",
+                      {{"ssl_status", err}, {"ssl_error", ssl_errors()}});
         return false;
     }
     return true;
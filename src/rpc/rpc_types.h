@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
+#include <memory_resource>
 #include <string>
 #include <vector>
 
@@ -43,21 +45,39 @@ enum class RpcRejectStatus : uint32_t {
 
 // RFC 5531 §7.1 - opaque_auth
 struct RpcOpaqueAuth {
+    RpcOpaqueAuth() = default;
+    explicit RpcOpaqueAuth(std::pmr::memory_resource* mr) : body(mr) {}
+
     RpcAuthFlavor flavor = RpcAuthFlavor::AUTH_NONE;
-    std::vector<uint8_t> body;
+    std::pmr::vector<uint8_t> body;
 };
 
 // RFC 5531 §8.2.2 - authsys_parms
 struct RpcAuthSys {
+    RpcAuthSys() = default;
+    explicit RpcAuthSys(std::pmr::memory_resource* mr) : machinename(mr), gids(mr) {}
+
     uint32_t stamp = 0;
-    std::string machinename;
+    std::pmr::string machinename;
     uint32_t uid = 0;
     uint32_t gid = 0;
-    std::vector<uint32_t> gids;
+    std::pmr::vector<uint32_t> gids;
 };
 
 // RFC 5531 §7.1 - call_body
+// RFC 8881 §2.10.3.1 - Sends one complete RPC CALL message (no record mark)
+// back to the client over the connection a request arrived on. Returns false
+// once that connection has closed. Empty for in-process callers.
+using RpcBackChannel = std::function<bool(const uint8_t* data, size_t len)>;
+
+class OverloadControl;
+
 struct RpcCallHeader {
+    RpcCallHeader() = default;
+    // Credential and verifier bodies allocated from arena
+    explicit RpcCallHeader(std::pmr::memory_resource* mr)
+        : credential(mr), verifier(mr), arena(mr) {}
+
     uint32_t xid = 0;
     uint32_t rpc_version = 2;
     uint32_t program = 0;
@@ -65,6 +85,20 @@ struct RpcCallHeader {
     uint32_t procedure = 0;
     RpcOpaqueAuth credential;
     RpcOpaqueAuth verifier;
+    // Transport context (not part of call_body): peer IPv4 address of the
+    // connection the call arrived on, empty for in-process callers.
+    std::string client_addr;
+    // Server-to-client CALLs on that same connection (NFSv4.1 backchannel).
+    // Valid only during the handler call; copy the function to keep it.
+    const RpcBackChannel* back_channel = nullptr;
+    // Set when the server is overloaded and this call queued past the
+    // target: the handler may answer it NFS3ERR_JUKEBOX / NFS4ERR_DELAY if
+    // it is expensive, and then counts it with overload->shed()
+    OverloadControl* overload = nullptr;
+    // The call's RequestArena (rpc/rpc_arena.h), reset once the reply is
+    // sent: where handlers allocate what they decode and build. The heap
+    // for in-process callers.
+    std::pmr::memory_resource* arena = std::pmr::get_default_resource();
 };
 
 // RFC 1813 §3 - NFS program number and version
@@ -0,0 +1,314 @@
+#include "stats/client_stats.h"
+#include "stats/metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+
+const char* talker_rank_name(TalkerRank rank) {
+    switch (rank) {
+    case TalkerRank::OPS: return "ops";
+    case TalkerRank::BYTES: return "bytes";
+    case TalkerRank::BUSY: return "busy";
+    }
+    return "unknown";
+}
+
+// FNV-1a over the key bytes, then a splitmix64 finalizer so both 32-bit
+// halves are well mixed (the sketch derives its row hashes from them)
+uint64_t TopTalkers::hash(const std::string& key) {
+    uint64_t h = 1469598103934665603ull;
+    for (unsigned char c : key) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return h;
+}
+
+// --- CountMinSketch ---
+
+CountMinSketch::CountMinSketch(size_t width) {
+    size_t w = 1;
+    while (w < width) w <<= 1;
+    mask_ = w - 1;
+    cells_.reset(new TalkerSample[kDepth * w]);
+    for (size_t i = 0; i < kDepth * w; i++) cells_[i].ops = 0;
+}
+
+// Row hashes h1 + row * h2 (Kirsch-Mitzenmacher): one 64-bit hash per key
+size_t CountMinSketch::cell(size_t row, uint64_t hash) const {
+    uint64_t h1 = hash & 0xffffffffu;
+    uint64_t h2 = (hash >> 32) | 1;
+    return row * (mask_ + 1) + ((h1 + row * h2) & mask_);
+}
+
+static void take_min(TalkerSample& est, const TalkerSample& c) {
+    est.ops = std::min(est.ops, c.ops);
+    est.bytes_in = std::min(est.bytes_in, c.bytes_in);
+    est.bytes_out = std::min(est.bytes_out, c.bytes_out);
+    est.busy_ns = std::min(est.busy_ns, c.busy_ns);
+}
+
+static const TalkerSample kNoEstimate = {UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX};
+
+TalkerSample CountMinSketch::add(uint64_t hash, const TalkerSample& s) {
+    TalkerSample est = kNoEstimate;
+    for (size_t row = 0; row < kDepth; row++) {
+        TalkerSample& c = cells_[cell(row, hash)];
+        c.ops += s.ops;
+        c.bytes_in += s.bytes_in;
+        c.bytes_out += s.bytes_out;
+        c.busy_ns += s.busy_ns;
+        take_min(est, c);
+    }
+    return est;
+}
+
+TalkerSample CountMinSketch::estimate(uint64_t hash) const {
+    TalkerSample est = kNoEstimate;
+    for (size_t row = 0; row < kDepth; row++) take_min(est, cells_[cell(row, hash)]);
+    return est;
+}
+
+// --- TopTalkers ---
+
+TopTalkers::TopTalkers(size_t capacity, size_t width, const char* lock_name)
+    : capacity_(capacity ? capacity : 1) {
+    for (size_t i = 0; i < kShards; i++)
+        shards_.push_back(std::make_unique<Shard>(lock_name, width));
+}
+
+namespace {
+std::atomic<size_t> g_next_talker_shard{0};
+}  // namespace
+
+// Threads take shards round robin on first use, the same index in every
+// TopTalkers; connection threads live as long as their connection
+TopTalkers::Shard& TopTalkers::local_shard() {
+    static thread_local const size_t t_shard =
+        g_next_talker_shard.fetch_add(1, std::memory_order_relaxed);
+    return *shards_[t_shard % kShards];
+}
+
+void TopTalkers::add(uint64_t hash, const std::string& key, const TalkerSample& s) {
+    Shard& sh = local_shard();
+    std::lock_guard<ProfiledMutex> lk(sh.mu);
+    TalkerSample est = sh.sketch.add(hash, s);
+    sh.total_ops += s.ops;
+    for (size_t r = 0; r < kTalkerRanks; r++) {
+        auto rank = static_cast<TalkerRank>(r);
+        offer(sh, rank, hash, key, rank_value(rank, est));
+    }
+}
+
+uint64_t TopTalkers::rank_value(TalkerRank rank, const TalkerSample& est) {
+    switch (rank) {
+    case TalkerRank::OPS: return est.ops;
+    case TalkerRank::BYTES: return est.bytes_in + est.bytes_out;
+    case TalkerRank::BUSY: return est.busy_ns;
+    }
+    return 0;
+}
+
+// Space-Saving over sketch estimates: a new key displaces the smallest
+// tracked key once its estimate is larger. Stored estimates are updated
+// only when their key is seen, so an idle key may be evicted early; a
+// heavy hitter re-enters with its full sketch estimate the next time it
+// calls. Works on one shard's candidates and estimates; called with its mu
+// held.
+void TopTalkers::offer(Shard& sh, TalkerRank rank, uint64_t hash, const std::string& key,
+                       uint64_t est) {
+    Candidates& c = sh.ranks[static_cast<size_t>(rank)];
+    if (est <= c.floor) return;
+
+    auto it = c.slots.find(hash);
+    if (it != c.slots.end()) {
+        it->second.second = est;
+        return;
+    }
+    if (c.slots.size() >= capacity_) {
+        auto victim = c.slots.begin();
+        for (auto s = c.slots.begin(); s != c.slots.end(); ++s)
+            if (s->second.second < victim->second.second) victim = s;
+        if (est <= victim->second.second) {
+            c.floor = victim->second.second;
+            return;
+        }
+        c.slots.erase(victim);
+    }
+    c.slots.emplace(hash, std::make_pair(key, est));
+    if (c.slots.size() >= capacity_) {
+        c.floor = est;
+        for (const auto& s : c.slots) c.floor = std::min(c.floor, s.second.second);
+    }
+}
+
+static TalkerEntry make_entry(const std::string& key, const TalkerSample& est) {
+    TalkerEntry e;
+    e.key = key;
+    e.ops = est.ops;
+    e.bytes_in = est.bytes_in;
+    e.bytes_out = est.bytes_out;
+    e.busy_ns = est.busy_ns;
+    return e;
+}
+
+static void add_sample(TalkerSample& sum, const TalkerSample& s) {
+    sum.ops += s.ops;
+    sum.bytes_in += s.bytes_in;
+    sum.bytes_out += s.bytes_out;
+    sum.busy_ns += s.busy_ns;
+}
+
+TalkerEntry TopTalkers::estimate(const std::string& key) const {
+    uint64_t h = hash(key);
+    TalkerSample est{0, 0, 0, 0};
+    for (const auto& sh : shards_) {
+        std::lock_guard<ProfiledMutex> lk(sh->mu);
+        add_sample(est, sh->sketch.estimate(h));
+    }
+    return make_entry(key, est);
+}
+
+std::vector<TalkerEntry> TopTalkers::top(TalkerRank rank, size_t n) const {
+    // Every shard's candidates, then each one's estimate summed over shards
+    std::unordered_map<uint64_t, std::pair<std::string, TalkerSample>> keys;
+    for (const auto& sh : shards_) {
+        std::lock_guard<ProfiledMutex> lk(sh->mu);
+        for (const auto& [hash, slot] : sh->ranks[static_cast<size_t>(rank)].slots)
+            keys.emplace(hash, std::make_pair(slot.first, TalkerSample{0, 0, 0, 0}));
+    }
+    for (const auto& sh : shards_) {
+        std::lock_guard<ProfiledMutex> lk(sh->mu);
+        for (auto& [hash, key] : keys) add_sample(key.second, sh->sketch.estimate(hash));
+    }
+
+    std::vector<std::pair<uint64_t, TalkerEntry>> ranked;
+    for (const auto& [hash, key] : keys)
+        ranked.emplace_back(rank_value(rank, key.second), make_entry(key.first, key.second));
+    std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+        return a.first != b.first ? a.first > b.first : a.second.key < b.second.key;
+    });
+
+    std::vector<TalkerEntry> out;
+    for (size_t i = 0; i < ranked.size() && i < n; i++)
+        out.push_back(std::move(ranked[i].second));
+    return out;
+}
+
+uint64_t TopTalkers::total_ops() const {
+    uint64_t total = 0;
+    for (const auto& sh : shards_) {
+        std::lock_guard<ProfiledMutex> lk(sh->mu);
+        total += sh->total_ops;
+    }
+    return total;
+}
+
+// Each shard overcounts by at most e/width of its own total, so the sum by
+// at most e/width of the dimension's
+uint64_t TopTalkers::ops_error_bound() const {
+    return static_cast<uint64_t>(
+        std::ceil(std::exp(1.0) * total_ops() / shards_.front()->sketch.width()));
+}
+
+void TopTalkers::register_metrics(MetricsRegistry& metrics) {
+    const MetricLabels labels = {{"lock", shards_.front()->mu.name()}};
+    auto sum = [this](uint64_t (ProfiledMutex::*field)() const) {
+        return [this, field] {
+            uint64_t total = 0;
+            for (const auto& sh : shards_) total += (sh->mu.*field)();
+            return total;
+        };
+    };
+    metrics.counter("nfsd_lock_acquisitions_total",
+                    "Acquisitions of a profiled server lock", labels,
+                    sum(&ProfiledMutex::acquisitions));
+    metrics.counter("nfsd_lock_contended_total",
+                    "Acquisitions that found the lock held and had to wait", labels,
+                    sum(&ProfiledMutex::contended));
+    metrics.counter_seconds("nfsd_lock_wait_seconds_total",
+                            "Time spent waiting to acquire a profiled lock", labels,
+                            sum(&ProfiledMutex::wait_ns));
+    metrics.counter_seconds("nfsd_lock_hold_seconds_total",
+                            "Time a profiled lock was held", labels,
+                            sum(&ProfiledMutex::hold_ns));
+    metrics.gauge("nfsd_lock_wait_max_seconds",
+                  "Longest single wait for a profiled lock", labels, [this] {
+                      uint64_t worst = 0;
+                      for (const auto& sh : shards_)
+                          worst = std::max(worst, sh->mu.max_wait_ns());
+                      return worst / 1e9;
+                  });
+}
+
+// --- ClientStats ---
+
+ClientStats::ClientStats(size_t capacity, size_t width)
+    : clients_(capacity, width, "top_clients"), exports_(capacity, width, "top_exports") {}
+
+void ClientStats::register_metrics(MetricsRegistry& metrics) {
+    clients_.register_metrics(metrics);
+    exports_.register_metrics(metrics);
+}
+
+void ClientStats::record(const std::string& client, const std::string& export_name,
+                         const TalkerSample& s) {
+    clients_.add(client, s);
+    if (!export_name.empty()) exports_.add(export_name, s);
+}
+
+void ClientStats::record(const TalkerKey& client, const TalkerKey& export_key,
+                         const TalkerSample& s) {
+    clients_.add(client.hash, client.name, s);
+    if (!export_key.name.empty()) exports_.add(export_key.hash, export_key.name, s);
+}
+
+std::string ClientStats::client_key(const std::string& peer_addr, bool auth_sys,
+                                    std::string_view machinename, uint32_t uid) {
+    std::string key = peer_addr.empty() ? "local" : peer_addr;
+    if (auth_sys) {
+        key += ' ';
+        key += machinename;
+        key += " uid=" + std::to_string(uid);
+    }
+    return key;
+}
+
+static void report_dimension(std::ostringstream& os, const char* name,
+                             const TopTalkers& t, size_t n) {
+    os << name << ": " << t.total_ops() << " ops, estimates overcount by at most "
+       << t.ops_error_bound() << " ops\n";
+    for (size_t r = 0; r < kTalkerRanks; r++) {
+        auto rank = static_cast<TalkerRank>(r);
+        auto entries = t.top(rank, n);
+        if (entries.empty()) continue;
+        os << "top " << name << " by " << talker_rank_name(rank) << '\n';
+        char line[160];
+        std::snprintf(line, sizeof(line), "  %4s %12s %14s %14s %10s  %s\n",
+                      "rank", "ops", "bytes_in", "bytes_out", "busy_ms", "key");
+        os << line;
+        for (size_t i = 0; i < entries.size(); i++) {
+            const TalkerEntry& e = entries[i];
+            std::snprintf(line, sizeof(line), "  %4zu %12llu %14llu %14llu %10.1f  ",
+                          i + 1, static_cast<unsigned long long>(e.ops),
+                          static_cast<unsigned long long>(e.bytes_in),
+                          static_cast<unsigned long long>(e.bytes_out), e.busy_ns / 1e6);
+            os << line << e.key << '\n';
+        }
+    }
+}
+
+std::string ClientStats::report(size_t n) const {
+    std::ostringstream os;
+    report_dimension(os, "clients", clients_, n);
+    report_dimension(os, "exports", exports_, n);
+    return os.str();
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include "stats/profiled_mutex.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Per-client and per-export I/O accounting in fixed memory.
+//
+// Each dimension (clients, exports) keeps count-min sketches of ops, bytes
+// in, bytes out and busy time, plus a small candidate set per ranking that
+// tracks the keys with the largest estimates (heavy hitters). Memory is
+// fixed by the sketch width, candidate capacity and shard count no matter
+// how many distinct clients show up; estimates only ever overcount, by at
+// most e/width of the dimension's total with high probability.
+//
+// Each dimension is split into shards, one per recording thread (threads
+// outnumbering shards share). A call takes one short critical section in
+// its thread's shard, so connection threads do not serialize even on the
+// export dimension's single key; a sketch cell holds all four counters, so
+// an add touches one cache line per row. Reports merge the shards: a key's
+// estimate is the sum of its shards' estimates, which still never
+// undercounts and still overcounts by at most e/width of the total.
+
+// What one call cost
+struct TalkerSample {
+    uint64_t ops = 1;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t busy_ns = 0;
+};
+
+// Rankings reported for each dimension
+enum class TalkerRank : uint8_t { OPS = 0, BYTES = 1, BUSY = 2 };
+constexpr size_t kTalkerRanks = 3;
+
+const char* talker_rank_name(TalkerRank rank);
+
+class MetricsRegistry;
+
+struct TalkerEntry {
+    std::string key;
+    uint64_t ops = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t busy_ns = 0;
+};
+
+// Count-min sketch over all four TalkerSample counters (not thread-safe;
+// each TopTalkers shard serializes access to its own). Each counter's estimate is its own
+// minimum across rows.
+class CountMinSketch {
+public:
+    static constexpr size_t kDepth = 4;
+
+    explicit CountMinSketch(size_t width);
+
+    // Add s under hash; returns the key's new estimates
+    TalkerSample add(uint64_t hash, const TalkerSample& s);
+    TalkerSample estimate(uint64_t hash) const;
+    size_t width() const { return mask_ + 1; }
+
+private:
+    size_t cell(size_t row, uint64_t hash) const;
+
+    size_t mask_;
+    std::unique_ptr<TalkerSample[]> cells_;
+};
+
+// One accounting dimension (e.g. clients)
+class TopTalkers {
+public:
+    static constexpr size_t kShards = 8;
+
+    // capacity: keys tracked per ranking and shard. width: sketch columns
+    // (rounded up to a power of two). lock_name: the shards' lock site in
+    // lock profiling (ProfiledMutex).
+    explicit TopTalkers(size_t capacity = 32, size_t width = 1024,
+                        const char* lock_name = "top_talkers");
+
+    void add(const std::string& key, const TalkerSample& s) { add(hash(key), key, s); }
+    // hash must be hash(key); lets callers that keep keys skip rehashing
+    void add(uint64_t hash, const std::string& key, const TalkerSample& s);
+    static uint64_t hash(const std::string& key);
+
+    // Up to n keys with the largest estimates for rank, largest first,
+    // among the keys any shard tracks
+    std::vector<TalkerEntry> top(TalkerRank rank, size_t n) const;
+    // Estimates for any key (tracked or not)
+    TalkerEntry estimate(const std::string& key) const;
+
+    uint64_t total_ops() const;
+    // Upper bound on how far one estimate may overcount ops (e/width * total)
+    uint64_t ops_error_bound() const;
+
+    // Export the shards' locks as one nfsd_lock_* site
+    void register_metrics(MetricsRegistry& metrics);
+
+private:
+    struct Candidates {
+        // Key hash -> (key, estimate when last seen)
+        std::unordered_map<uint64_t, std::pair<std::string, uint64_t>> slots;
+        // Smallest tracked estimate once full; a key at or below it can't
+        // displace anything and is not looked up
+        uint64_t floor = 0;
+    };
+
+    struct alignas(64) Shard {
+        Shard(const char* lock_name, size_t width) : mu(lock_name), sketch(width) {}
+
+        mutable ProfiledMutex mu;  // guards everything below
+        CountMinSketch sketch;
+        uint64_t total_ops = 0;
+        Candidates ranks[kTalkerRanks];
+    };
+
+    static uint64_t rank_value(TalkerRank rank, const TalkerSample& est);
+    void offer(Shard& sh, TalkerRank rank, uint64_t hash, const std::string& key, uint64_t est);
+    // The calling thread's shard
+    Shard& local_shard();
+
+    size_t capacity_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+// A key with its hash computed once, for keys reused across many calls
+struct TalkerKey {
+    TalkerKey() = default;
+    explicit TalkerKey(std::string k) : name(std::move(k)), hash(TopTalkers::hash(name)) {}
+
+    std::string name;
+    uint64_t hash = 0;
+};
+
+class ClientStats {
+public:
+    explicit ClientStats(size_t capacity = 32, size_t width = 1024);
+
+    // client: peer address plus AUTH_SYS identity (see client_key())
+    void record(const std::string& client, const std::string& export_name,
+                const TalkerSample& s);
+    // Same, for keys the caller keeps around (empty export name: not counted)
+    void record(const TalkerKey& client, const TalkerKey& export_key, const TalkerSample& s);
+
+    const TopTalkers& clients() const { return clients_; }
+    const TopTalkers& exports() const { return exports_; }
+
+    // Plain-text top-n tables for each dimension and ranking
+    std::string report(size_t n) const;
+
+    // Export each dimension's lock profile
+    void register_metrics(MetricsRegistry& metrics);
+
+    // "addr" for AUTH_NONE, "addr machinename uid=N" for AUTH_SYS
+    static std::string client_key(const std::string& peer_addr, bool auth_sys,
+                                  std::string_view machinename, uint32_t uid);
+
+private:
+    TopTalkers clients_;
+    TopTalkers exports_;
+};
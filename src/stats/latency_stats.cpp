@@ -0,0 +1,249 @@
+#include "stats/latency_stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+const char* latency_phase_name(LatencyPhase phase) {
+    switch (phase) {
+        case LatencyPhase::QUEUE:   return "queue";
+        case LatencyPhase::DECODE:  return "decode";
+        case LatencyPhase::HANDLER: return "handler";
+        case LatencyPhase::SEND:    return "send";
+    }
+    return "unknown";
+}
+
+// --- LatencySnapshot ---
+
+size_t LatencySnapshot::bucket_index(uint64_t ns) {
+    constexpr uint64_t kSub = 1u << kSubBucketBits;
+    if (ns < kSub) return static_cast<size_t>(ns);
+    unsigned mag = 63 - static_cast<unsigned>(__builtin_clzll(ns));
+    if (mag > kMaxMagnitude) return kBuckets - 1;
+    uint64_t sub = (ns >> (mag - kSubBucketBits)) & (kSub - 1);
+    return (static_cast<size_t>(mag - kSubBucketBits + 1) << kSubBucketBits) + sub;
+}
+
+uint64_t LatencySnapshot::bucket_lower(size_t idx) {
+    constexpr uint64_t kSub = 1u << kSubBucketBits;
+    if (idx < kSub) return idx;
+    unsigned mag = static_cast<unsigned>(idx >> kSubBucketBits) + kSubBucketBits - 1;
+    uint64_t sub = idx & (kSub - 1);
+    return (kSub + sub) << (mag - kSubBucketBits);
+}
+
+uint64_t LatencySnapshot::bucket_upper(size_t idx) {
+    if (idx + 1 >= kBuckets) return UINT64_MAX;
+    return bucket_lower(idx + 1) - 1;
+}
+
+uint64_t LatencySnapshot::percentile(double q) const {
+    if (count == 0) return 0;
+    q = std::min(std::max(q, 0.0), 1.0);
+    uint64_t rank = static_cast<uint64_t>(q * count + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; i++) {
+        seen += buckets[i];
+        if (seen >= rank) return std::min(bucket_upper(i), max_ns);
+    }
+    return max_ns;
+}
+
+void LatencySnapshot::merge(const LatencySnapshot& o) {
+    count += o.count;
+    sum_ns += o.sum_ns;
+    max_ns = std::max(max_ns, o.max_ns);
+    for (size_t i = 0; i < kBuckets; i++)
+        buckets[i] += o.buckets[i];
+}
+
+// --- LatencyHistogram ---
+
+// Only the owning thread writes, so a relaxed load+store is enough and
+// avoids a locked read-modify-write on the hot path.
+void LatencyHistogram::record(uint64_t ns) {
+    auto& c = counts_[LatencySnapshot::bucket_index(ns)];
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum_.store(sum_.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    if (ns > max_.load(std::memory_order_relaxed))
+        max_.store(ns, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::add_to(LatencySnapshot& out) const {
+    for (size_t i = 0; i < LatencySnapshot::kBuckets; i++) {
+        uint64_t n = counts_[i].load(std::memory_order_relaxed);
+        out.buckets[i] += n;
+        out.count += n;
+    }
+    out.sum_ns += sum_.load(std::memory_order_relaxed);
+    out.max_ns = std::max(out.max_ns, max_.load(std::memory_order_relaxed));
+}
+
+double LatencyEntry::total_mean_ns() const {
+    double total = 0;
+    for (const auto& p : phases) total += p.mean_ns();
+    return total;
+}
+
+// --- Per-thread shards ---
+
+// Key packing: program(32) | version(8) | procedure(8) | has_op(1) | op(15)
+static uint64_t pack_key(const LatencyKey& k) {
+    uint64_t packed = (static_cast<uint64_t>(k.program) << 32) |
+                      (static_cast<uint64_t>(k.version & 0xff) << 24) |
+                      (static_cast<uint64_t>(k.procedure & 0xff) << 16);
+    if (k.op != LatencyKey::kNoOp)
+        packed |= 0x8000 | (k.op & 0x7fff);
+    return packed;
+}
+
+static LatencyKey unpack_key(uint64_t packed) {
+    LatencyKey k;
+    k.program = static_cast<uint32_t>(packed >> 32);
+    k.version = static_cast<uint32_t>((packed >> 24) & 0xff);
+    k.procedure = static_cast<uint32_t>((packed >> 16) & 0xff);
+    if (packed & 0x8000)
+        k.op = static_cast<uint32_t>(packed & 0x7fff);
+    return k;
+}
+
+using PhaseHistograms = std::array<LatencyHistogram, kLatencyPhases>;
+
+// Open-addressing table owned by one thread at a time. A slot is published
+// by storing the key, then the histogram pointer with release ordering;
+// readers that see the pointer also see the key.
+struct alignas(64) LatencyShard {
+    static constexpr size_t kSlots = 256;
+
+    struct Slot {
+        std::atomic<uint64_t> key{0};
+        std::atomic<PhaseHistograms*> hist{nullptr};
+    };
+
+    std::array<Slot, kSlots> slots;
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> in_use{true};
+
+    ~LatencyShard() {
+        for (auto& s : slots) delete s.hist.load(std::memory_order_relaxed);
+    }
+
+    PhaseHistograms* find_or_insert(uint64_t key) {
+        size_t idx = (key * 0x9E3779B97F4A7C15ULL) >> 56;
+        for (size_t probe = 0; probe < kSlots; probe++) {
+            Slot& s = slots[(idx + probe) & (kSlots - 1)];
+            PhaseHistograms* h = s.hist.load(std::memory_order_relaxed);
+            if (!h) {
+                h = new PhaseHistograms();
+                s.key.store(key, std::memory_order_relaxed);
+                s.hist.store(h, std::memory_order_release);
+                return h;
+            }
+            if (s.key.load(std::memory_order_relaxed) == key) return h;
+        }
+        dropped.store(dropped.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+        return nullptr;
+    }
+};
+
+namespace {
+
+std::atomic<uint64_t> g_next_stats_id{1};
+
+// This thread's shard for each LatencyStats it has recorded into. On thread
+// exit the shards are handed back so a later thread can reuse them; their
+// counts stay in the totals.
+struct LocalShards {
+    struct Ref {
+        uint64_t owner;
+        std::shared_ptr<LatencyShard> shard;
+    };
+    std::vector<Ref> refs;
+
+    ~LocalShards() {
+        for (auto& r : refs) r.shard->in_use.store(false, std::memory_order_release);
+    }
+};
+
+thread_local LocalShards t_shards;
+
+}  // namespace
+
+LatencyStats::LatencyStats() : id_(g_next_stats_id.fetch_add(1)) {}
+
+LatencyStats::~LatencyStats() = default;
+
+uint64_t LatencyStats::now_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+LatencyShard& LatencyStats::local_shard() {
+    auto& refs = t_shards.refs;
+    for (auto& r : refs)
+        if (r.owner == id_) return *r.shard;
+
+    std::shared_ptr<LatencyShard> shard;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (auto& s : shards_) {
+            bool expected = false;
+            if (s->in_use.compare_exchange_strong(expected, true,
+                                                  std::memory_order_acquire)) {
+                shard = s;
+                break;
+            }
+        }
+        if (!shard) {
+            shard = std::make_shared<LatencyShard>();
+            shards_.push_back(shard);
+        }
+    }
+    refs.push_back({id_, shard});
+    return *shard;
+}
+
+void LatencyStats::record(const LatencyKey& key, LatencyPhase phase, uint64_t ns) {
+    PhaseHistograms* h = local_shard().find_or_insert(pack_key(key));
+    if (h) (*h)[static_cast<size_t>(phase)].record(ns);
+}
+
+void LatencyStats::record_call(const LatencyKey& key,
+                               const uint64_t (&phase_ns)[kLatencyPhases]) {
+    PhaseHistograms* h = local_shard().find_or_insert(pack_key(key));
+    if (!h) return;
+    for (size_t i = 0; i < kLatencyPhases; i++)
+        (*h)[i].record(phase_ns[i]);
+}
+
+std::vector<LatencyEntry> LatencyStats::snapshot() const {
+    std::map<uint64_t, LatencyEntry> merged;
+    std::lock_guard<std::mutex> lk(mu_);
+    for (const auto& shard : shards_) {
+        for (const auto& slot : shard->slots) {
+            const PhaseHistograms* h = slot.hist.load(std::memory_order_acquire);
+            if (!h) continue;
+            uint64_t key = slot.key.load(std::memory_order_relaxed);
+            auto [it, inserted] = merged.try_emplace(key);
+            if (inserted) it->second.key = unpack_key(key);
+            for (size_t i = 0; i < kLatencyPhases; i++)
+                (*h)[i].add_to(it->second.phases[i]);
+        }
+    }
+
+    std::vector<LatencyEntry> out;
+    out.reserve(merged.size());
+    for (auto& [key, entry] : merged) out.push_back(std::move(entry));
+    return out;
+}
+
+uint64_t LatencyStats::dropped() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    uint64_t total = 0;
+    for (const auto& shard : shards_)
+        total += shard->dropped.load(std::memory_order_relaxed);
+    return total;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Per-procedure latency histograms.
+//
+// Recording is lock-free: every thread writes to its own shard of
+// histograms (single writer, relaxed atomics, no read-modify-write), and
+// readers merge all shards on demand. Buckets are HDR-style log-linear:
+// 8 linear sub-buckets per power of two, so any recorded value is reported
+// within 12.5% of its true value, from 1 ns up to ~18 minutes.
+
+// Where the time of one RPC call went
+enum class LatencyPhase : uint8_t {
+    QUEUE = 0,    // held back by a QoS policy between decode and dispatch
+    DECODE = 1,   // RPC header decode + program/procedure lookup
+    HANDLER = 2,  // procedure handler (argument decode, VFS, reply encode)
+    SEND = 3,     // reply framing and socket write
+};
+constexpr size_t kLatencyPhases = 4;
+
+const char* latency_phase_name(LatencyPhase phase);
+
+// (program, version, procedure), optionally narrowed to one NFSv4 COMPOUND op
+struct LatencyKey {
+    static constexpr uint32_t kNoOp = UINT32_MAX;
+
+    uint32_t program = 0;
+    uint32_t version = 0;
+    uint32_t procedure = 0;
+    uint32_t op = kNoOp;
+
+    bool operator==(const LatencyKey& o) const {
+        return program == o.program && version == o.version &&
+               procedure == o.procedure && op == o.op;
+    }
+};
+
+// Merged, read-only view of one histogram
+struct LatencySnapshot {
+    static constexpr unsigned kSubBucketBits = 3;
+    static constexpr unsigned kMaxMagnitude = 40;  // 2^40 ns ~ 18 min
+    static constexpr size_t kBuckets =
+        (kMaxMagnitude - kSubBucketBits + 2) << kSubBucketBits;
+
+    uint64_t count = 0;
+    uint64_t sum_ns = 0;
+    uint64_t max_ns = 0;
+    std::array<uint64_t, kBuckets> buckets{};
+
+    static size_t bucket_index(uint64_t ns);
+    // Smallest and largest value that land in bucket idx
+    static uint64_t bucket_lower(size_t idx);
+    static uint64_t bucket_upper(size_t idx);
+
+    // Value at quantile q (0..1), as the upper bound of its bucket
+    uint64_t percentile(double q) const;
+    double mean_ns() const { return count ? static_cast<double>(sum_ns) / count : 0; }
+    void merge(const LatencySnapshot& o);
+};
+
+// Single-writer histogram: only the owning thread calls record(). Cache
+// line aligned so two threads' histograms never share a line.
+class alignas(64) LatencyHistogram {
+public:
+    void record(uint64_t ns);
+    void add_to(LatencySnapshot& out) const;
+
+private:
+    std::array<std::atomic<uint64_t>, LatencySnapshot::kBuckets> counts_{};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
+
+struct LatencyEntry {
+    LatencyKey key;
+    std::array<LatencySnapshot, kLatencyPhases> phases;
+
+    // Sum over all phases of the mean latency
+    double total_mean_ns() const;
+};
+
+struct LatencyShard;
+
+class LatencyStats {
+public:
+    LatencyStats();
+    ~LatencyStats();
+
+    LatencyStats(const LatencyStats&) = delete;
+    LatencyStats& operator=(const LatencyStats&) = delete;
+
+    // Monotonic timestamp used for all phase measurements
+    static uint64_t now_ns();
+
+    void record(const LatencyKey& key, LatencyPhase phase, uint64_t ns);
+    // Record every phase of one call with a single histogram lookup
+    void record_call(const LatencyKey& key, const uint64_t (&phase_ns)[kLatencyPhases]);
+
+    // Merge all threads' histograms; entries sorted by key
+    std::vector<LatencyEntry> snapshot() const;
+
+    // Keys dropped because a thread's shard was full
+    uint64_t dropped() const;
+
+private:
+    LatencyShard& local_shard();
+
+    const uint64_t id_;
+    mutable std::mutex mu_;  // guards shards_ (not the histograms)
+    std::vector<std::shared_ptr<LatencyShard>> shards_;
+};
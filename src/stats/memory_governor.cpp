@@ -0,0 +1,240 @@
+#include "stats/memory_governor.h"
+#include "stats/metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+// Under pressure, ask for this fraction of current usage back per pass
+static const double kPressureStep = 0.10;
+
+MemoryGovernor::MemoryGovernor(uint64_t budget_bytes) : budget_(budget_bytes) {}
+
+MemoryGovernor::~MemoryGovernor() {
+    stop();
+}
+
+void MemoryGovernor::add(const std::string& name, uint32_t weight, UsageFn usage,
+                         ReclaimFn reclaim) {
+    auto s = std::make_unique<Subsystem>();
+    s->name = name;
+    s->weight = std::max<uint32_t>(weight, 1);
+    s->usage = std::move(usage);
+    s->reclaim = std::move(reclaim);
+    subsystems_.push_back(std::move(s));
+}
+
+void MemoryGovernor::set_pressure(const std::string& psi_path, double threshold_pct) {
+    psi_path_ = psi_path;
+    psi_threshold_ = threshold_pct;
+}
+
+static std::string read_file(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) return std::string();
+    std::ostringstream os;
+    os << in.rdbuf();
+    return os.str();
+}
+
+// cgroup v2: /proc/self/cgroup has one line "0::<path>"
+std::string MemoryGovernor::default_psi_path() {
+    std::istringstream lines(read_file("/proc/self/cgroup"));
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.compare(0, 3, "0::") != 0) continue;
+        std::string dir = "/sys/fs/cgroup" + line.substr(3);
+        if (dir.back() != '/') dir += '/';
+        if (!read_file(dir + "memory.pressure").empty()) return dir + "memory.pressure";
+    }
+    if (!read_file("/proc/pressure/memory").empty()) return "/proc/pressure/memory";
+    return std::string();
+}
+
+// "some avg10=1.23 avg60=0.50 avg300=0.10 total=123456"
+double MemoryGovernor::parse_psi_some_avg10(const std::string& text) {
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.compare(0, 5, "some ") != 0) continue;
+        size_t pos = line.find("avg10=");
+        if (pos == std::string::npos) return -1;
+        const char* start = line.c_str() + pos + 6;
+        char* end = nullptr;
+        double v = std::strtod(start, &end);
+        return end == start ? -1 : v;
+    }
+    return -1;
+}
+
+double MemoryGovernor::read_pressure() const {
+    if (psi_path_.empty() || psi_threshold_ <= 0) return -1;
+    return parse_psi_some_avg10(read_file(psi_path_));
+}
+
+const MemoryGovernor::Subsystem* MemoryGovernor::find(const std::string& name) const {
+    for (const auto& s : subsystems_)
+        if (s->name == name) return s.get();
+    return nullptr;
+}
+
+uint64_t MemoryGovernor::usage(const std::string& name) const {
+    const Subsystem* s = find(name);
+    return s ? s->bytes.load(std::memory_order_relaxed) : 0;
+}
+
+uint64_t MemoryGovernor::share(const std::string& name) const {
+    const Subsystem* s = find(name);
+    return s ? s->share.load(std::memory_order_relaxed) : 0;
+}
+
+uint64_t MemoryGovernor::reclaimed(const std::string& name) const {
+    const Subsystem* s = find(name);
+    return s ? s->reclaimed.load(std::memory_order_relaxed) : 0;
+}
+
+void MemoryGovernor::rebalance() {
+    std::lock_guard<std::mutex> lk(rebalance_mu_);
+    const size_t n = subsystems_.size();
+    std::vector<uint64_t> used(n);
+    uint64_t total = 0, pinned = 0, reclaimable = 0;
+    uint64_t weights = 0;
+    for (size_t i = 0; i < n; i++) {
+        Subsystem& s = *subsystems_[i];
+        used[i] = s.usage ? s.usage() : 0;
+        s.bytes.store(used[i], std::memory_order_relaxed);
+        total += used[i];
+        if (s.reclaim) {
+            reclaimable += used[i];
+            weights += s.weight;
+        } else {
+            pinned += used[i];
+        }
+    }
+    total_.store(total, std::memory_order_relaxed);
+
+    // Weighted shares of what the pinned subsystems leave of the budget
+    const uint64_t avail = budget_ > pinned ? budget_ - pinned : 0;
+    std::vector<uint64_t> shares(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        Subsystem& s = *subsystems_[i];
+        if (s.reclaim && weights)
+            shares[i] = static_cast<uint64_t>(static_cast<double>(avail) * s.weight / weights);
+        s.share.store(s.reclaim ? shares[i] : used[i], std::memory_order_relaxed);
+    }
+
+    const double psi = read_pressure();
+    pressure_.store(std::max(psi, 0.0), std::memory_order_relaxed);
+    uint64_t target = UINT64_MAX;
+    Reason reason = BUDGET;
+    if (budget_ && total > budget_) target = budget_;
+    if (psi >= psi_threshold_ && psi_threshold_ > 0) {
+        uint64_t t = static_cast<uint64_t>(static_cast<double>(total) * (1 - kPressureStep));
+        if (t < target) {
+            target = t;
+            reason = PRESSURE;
+        }
+    }
+    if (target >= total || reclaimable == 0) return;
+    const uint64_t excess = std::min(total - target, reclaimable);
+    reclaims_[reason].fetch_add(1, std::memory_order_relaxed);
+
+    std::vector<uint64_t> freed(n, 0);
+    uint64_t freed_total = 0;
+    auto take = [&](size_t i, uint64_t bytes) {
+        if (!bytes || used[i] <= freed[i]) return;
+        bytes = std::min(bytes, used[i] - freed[i]);
+        uint64_t got = subsystems_[i]->reclaim(bytes);
+        freed[i] += got;
+        freed_total += got;
+    };
+
+    // First from the subsystems over their share, by how far over
+    uint64_t over_total = 0;
+    for (size_t i = 0; i < n; i++)
+        if (subsystems_[i]->reclaim && used[i] > shares[i]) over_total += used[i] - shares[i];
+    if (over_total) {
+        for (size_t i = 0; i < n; i++) {
+            if (!subsystems_[i]->reclaim || used[i] <= shares[i]) continue;
+            const uint64_t over = used[i] - shares[i];
+            take(i, std::min(over, static_cast<uint64_t>(static_cast<double>(excess) *
+                                                         over / over_total)));
+        }
+    }
+    // Then from everyone, by what each still holds
+    if (freed_total < excess) {
+        const uint64_t rest = excess - freed_total;
+        uint64_t held = 0;
+        for (size_t i = 0; i < n; i++)
+            if (subsystems_[i]->reclaim) held += used[i] - std::min(freed[i], used[i]);
+        for (size_t i = 0; held && i < n; i++) {
+            if (!subsystems_[i]->reclaim) continue;
+            const uint64_t h = used[i] - std::min(freed[i], used[i]);
+            take(i, static_cast<uint64_t>(static_cast<double>(rest) * h / held + 0.5));
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (!freed[i]) continue;
+        subsystems_[i]->reclaimed.fetch_add(freed[i], std::memory_order_relaxed);
+        subsystems_[i]->bytes.store(used[i] - std::min(freed[i], used[i]),
+                                    std::memory_order_relaxed);
+    }
+    total_.store(total - std::min(freed_total, total), std::memory_order_relaxed);
+}
+
+void MemoryGovernor::start(uint32_t interval_ms) {
+    if (thread_.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lk(stop_mu_);
+        stop_ = false;
+    }
+    thread_ = std::thread(&MemoryGovernor::run, this, std::max<uint32_t>(interval_ms, 1));
+}
+
+void MemoryGovernor::stop() {
+    {
+        std::lock_guard<std::mutex> lk(stop_mu_);
+        stop_ = true;
+    }
+    stop_cv_.notify_all();
+    if (thread_.joinable()) thread_.join();
+}
+
+void MemoryGovernor::run(uint32_t interval_ms) {
+    std::unique_lock<std::mutex> lk(stop_mu_);
+    while (!stop_) {
+        lk.unlock();
+        rebalance();
+        lk.lock();
+        stop_cv_.wait_for(lk, std::chrono::milliseconds(interval_ms), [this] { return stop_; });
+    }
+}
+
+void MemoryGovernor::register_metrics(MetricsRegistry& metrics) {
+    for (const auto& s : subsystems_) {
+        const Subsystem* sp = s.get();
+        MetricLabels labels = {{"subsystem", s->name}};
+        metrics.gauge("nfsd_memory_bytes", "Memory held by a subsystem at the last sample",
+                      labels, [sp] { return static_cast<double>(sp->bytes.load()); });
+        metrics.gauge("nfsd_memory_share_bytes",
+                      "A subsystem's weighted share of the memory budget "
+                      "(its usage if it cannot reclaim)",
+                      labels, [sp] { return static_cast<double>(sp->share.load()); });
+        metrics.counter("nfsd_memory_reclaimed_bytes_total",
+                        "Memory a subsystem gave back to the governor", labels,
+                        [sp] { return sp->reclaimed.load(); });
+    }
+    metrics.gauge("nfsd_memory_budget_bytes", "Memory budget of the registered subsystems "
+                  "(0: none)", {}, [this] { return static_cast<double>(budget_); });
+    metrics.gauge("nfsd_memory_total_bytes", "Memory held by the registered subsystems", {},
+                  [this] { return static_cast<double>(total()); });
+    metrics.gauge("nfsd_memory_pressure_percent", "Memory PSI some avg10 at the last sample",
+                  {}, [this] { return pressure(); });
+    metrics.counter("nfsd_memory_reclaims_total", "Governor passes that asked for memory back",
+                    {{"reason", "budget"}}, [this] { return reclaims_[BUDGET].load(); });
+    metrics.counter("nfsd_memory_reclaims_total", "Governor passes that asked for memory back",
+                    {{"reason", "pressure"}}, [this] { return reclaims_[PRESSURE].load(); });
+}
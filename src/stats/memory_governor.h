@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class MetricsRegistry;
+
+// Global memory budget for the server's caches.
+//
+// Each subsystem that holds memory in proportion to its working set
+// registers itself with a usage hook (bytes held now) and, if it can give
+// memory back, a reclaim hook. A background thread samples usage every
+// interval and, when the total is over budget, asks the subsystems to
+// reclaim:
+//
+//   - first from those over their share: the budget left after the
+//     pinned (non-reclaimable) subsystems, split by weight, in proportion
+//     to how far each is over;
+//   - then, if that was not enough, from all of them in proportion to
+//     their usage.
+//
+// Under memory pressure (PSI "some avg10" from the cgroup's
+// memory.pressure, or /proc/pressure/memory, at or above a threshold) the
+// target drops to 90% of current usage each pass, budget or not, so the
+// caches give way before the kernel's reclaim or the OOM killer has to.
+//
+// Hooks run on the governor thread. Usage hooks should be cheap (a counter
+// kept up to date, not a walk); reclaim hooks free about the bytes asked
+// for and return what they freed.
+
+class MemoryGovernor {
+public:
+    // budget_bytes: 0 for accounting and pressure response only
+    explicit MemoryGovernor(uint64_t budget_bytes = 0);
+    ~MemoryGovernor();
+
+    MemoryGovernor(const MemoryGovernor&) = delete;
+    MemoryGovernor& operator=(const MemoryGovernor&) = delete;
+
+    using UsageFn = std::function<uint64_t()>;
+    using ReclaimFn = std::function<uint64_t(uint64_t bytes)>;
+
+    // Register a subsystem. weight sets its share of the budget among the
+    // reclaimable ones; without reclaim it is pinned and only counted.
+    // Call before start().
+    void add(const std::string& name, uint32_t weight, UsageFn usage,
+             ReclaimFn reclaim = nullptr);
+
+    // PSI file to watch and the avg10 percentage that counts as pressure
+    // (0: ignore pressure). Call before start().
+    void set_pressure(const std::string& psi_path, double threshold_pct);
+    // The cgroup v2 memory.pressure of this process if there is one, else
+    // /proc/pressure/memory; empty if neither is readable
+    static std::string default_psi_path();
+
+    void start(uint32_t interval_ms = 1000);
+    void stop();
+
+    // One pass: sample usage and reclaim if over budget or under
+    // pressure. What the governor thread runs every interval.
+    void rebalance();
+
+    uint64_t budget() const { return budget_; }
+    uint64_t total() const { return total_.load(std::memory_order_relaxed); }
+    // Last sampled usage, share of the budget and bytes reclaimed so far
+    // of the subsystem registered as name; 0 if unknown
+    uint64_t usage(const std::string& name) const;
+    uint64_t share(const std::string& name) const;
+    uint64_t reclaimed(const std::string& name) const;
+    // Last PSI avg10 read, in percent
+    double pressure() const { return pressure_.load(std::memory_order_relaxed); }
+
+    // nfsd_memory_{bytes,share_bytes,reclaimed_bytes_total} by subsystem,
+    // nfsd_memory_{budget,total}_bytes, nfsd_memory_pressure_percent and
+    // nfsd_memory_reclaims_total by reason. Call after every add().
+    void register_metrics(MetricsRegistry& metrics);
+
+    // PSI "some avg10" from the text of a pressure file; -1 if absent
+    static double parse_psi_some_avg10(const std::string& text);
+
+private:
+    struct Subsystem {
+        std::string name;
+        uint32_t weight = 1;
+        UsageFn usage;
+        ReclaimFn reclaim;
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> share{0};
+        std::atomic<uint64_t> reclaimed{0};
+    };
+    enum Reason { BUDGET, PRESSURE, REASONS };
+
+    const Subsystem* find(const std::string& name) const;
+    double read_pressure() const;
+    void run(uint32_t interval_ms);
+
+    const uint64_t budget_;
+    std::vector<std::unique_ptr<Subsystem>> subsystems_;
+    std::string psi_path_;
+    double psi_threshold_ = 0;
+
+    std::mutex rebalance_mu_;  // one pass at a time
+    std::atomic<uint64_t> total_{0};
+    std::atomic<double> pressure_{0};
+    std::atomic<uint64_t> reclaims_[REASONS] = {};
+
+    std::mutex stop_mu_;
+    std::condition_variable stop_cv_;
+    bool stop_ = false;
+    std::thread thread_;
+};
@@ -0,0 +1,279 @@
+#include "stats/metrics.h"
+#include "rpc/rpc_types.h"
+
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+
+MetricsRegistry::Family& MetricsRegistry::family(const std::string& name,
+                                                 const std::string& help,
+                                                 bool is_counter) {
+    auto& fam = families_[name];
+    if (fam.help.empty()) fam.help = help;
+    fam.is_counter = is_counter;
+    return fam;
+}
+
+void MetricsRegistry::counter(const std::string& name, const std::string& help,
+                              const MetricLabels& labels, std::function<uint64_t()> read) {
+    std::lock_guard<std::mutex> lk(mu_);
+    family(name, help, true).series[labels] = [read = std::move(read)] {
+        return static_cast<double>(read());
+    };
+}
+
+void MetricsRegistry::counter_seconds(const std::string& name, const std::string& help,
+                                      const MetricLabels& labels,
+                                      std::function<uint64_t()> read_ns) {
+    std::lock_guard<std::mutex> lk(mu_);
+    family(name, help, true).series[labels] = [read_ns = std::move(read_ns)] {
+        return static_cast<double>(read_ns()) / 1e9;
+    };
+}
+
+void MetricsRegistry::gauge(const std::string& name, const std::string& help,
+                            const MetricLabels& labels, std::function<double()> read) {
+    std::lock_guard<std::mutex> lk(mu_);
+    family(name, help, false).series[labels] = std::move(read);
+}
+
+void MetricsRegistry::add_latency_stats(const LatencyStats* stats) {
+    std::lock_guard<std::mutex> lk(mu_);
+    latency_.push_back(stats);
+}
+
+void MetricsRegistry::add_client_stats(const ClientStats* stats, size_t top_n) {
+    std::lock_guard<std::mutex> lk(mu_);
+    client_stats_.emplace_back(stats, top_n);
+}
+
+double MetricsRegistry::value(const std::string& name, const MetricLabels& labels) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto fit = families_.find(name);
+    if (fit == families_.end()) return 0;
+    auto sit = fit->second.series.find(labels);
+    if (sit == fit->second.series.end()) return 0;
+    return sit->second();
+}
+
+// --- Prometheus text format ---
+
+static std::string escape_label(const std::string& v) {
+    std::string out;
+    out.reserve(v.size());
+    for (char c : v) {
+        if (c == '\\') out += "\\\\";
+        else if (c == '"') out += "\\\"";
+        else if (c == '\n') out += "\\n";
+        else out += c;
+    }
+    return out;
+}
+
+static void write_labels(std::ostringstream& os, const MetricLabels& labels) {
+    if (labels.empty()) return;
+    os << '{';
+    for (size_t i = 0; i < labels.size(); i++) {
+        if (i) os << ',';
+        os << labels[i].first << "=\"" << escape_label(labels[i].second) << '"';
+    }
+    os << '}';
+}
+
+static void write_value(std::ostringstream& os, double v) {
+    char buf[32];
+    if (std::floor(v) == v && std::fabs(v) < 9007199254740992.0)
+        std::snprintf(buf, sizeof(buf), "%.0f", v);
+    else
+        std::snprintf(buf, sizeof(buf), "%.9g", v);
+    os << buf;
+}
+
+// Histogram bucket bounds for exported latencies, in seconds
+static const double kLatencyBounds[] = {
+    0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+    0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0,
+};
+
+// Internal buckets are log-linear, so a bucket that straddles a bound is
+// counted at the next bound (at most 12.5% late).
+static void write_latency_histogram(std::ostringstream& os, const LatencyEntry& e) {
+    MetricLabels base = {
+        {"program", std::to_string(e.key.program)},
+        {"version", std::to_string(e.key.version)},
+        {"procedure", std::to_string(e.key.procedure)},
+    };
+    if (e.key.op != LatencyKey::kNoOp)
+        base.emplace_back("op", std::to_string(e.key.op));
+
+    for (size_t p = 0; p < kLatencyPhases; p++) {
+        const LatencySnapshot& s = e.phases[p];
+        if (s.count == 0) continue;
+        MetricLabels labels = base;
+        labels.emplace_back("phase", latency_phase_name(static_cast<LatencyPhase>(p)));
+
+        size_t idx = 0;
+        uint64_t cumulative = 0;
+        for (double bound : kLatencyBounds) {
+            uint64_t bound_ns = static_cast<uint64_t>(bound * 1e9);
+            while (idx < LatencySnapshot::kBuckets &&
+                   LatencySnapshot::bucket_upper(idx) <= bound_ns)
+                cumulative += s.buckets[idx++];
+            MetricLabels le = labels;
+            char buf[32];
+            std::snprintf(buf, sizeof(buf), "%g", bound);
+            le.emplace_back("le", buf);
+            os << "nfsd_rpc_latency_seconds_bucket";
+            write_labels(os, le);
+            os << ' ' << cumulative << '\n';
+        }
+        MetricLabels inf = labels;
+        inf.emplace_back("le", "+Inf");
+        os << "nfsd_rpc_latency_seconds_bucket";
+        write_labels(os, inf);
+        os << ' ' << s.count << '\n';
+
+        os << "nfsd_rpc_latency_seconds_sum";
+        write_labels(os, labels);
+        os << ' ';
+        write_value(os, s.sum_ns / 1e9);
+        os << '\n';
+        os << "nfsd_rpc_latency_seconds_count";
+        write_labels(os, labels);
+        os << ' ' << s.count << '\n';
+    }
+}
+
+// Union of the top_n keys of every ranking; series come and go as keys
+// enter and leave the tracked set
+static void write_top_talkers(std::ostringstream& os, const char* dim, const char* label,
+                              const TopTalkers& t, size_t top_n) {
+    std::map<std::string, TalkerEntry> keys;
+    for (size_t r = 0; r < kTalkerRanks; r++)
+        for (auto& e : t.top(static_cast<TalkerRank>(r), top_n))
+            keys.emplace(e.key, e);
+
+    std::string prefix = std::string("nfsd_top_") + dim;
+    os << "# HELP " << prefix << "_ops_total Estimated calls from the busiest " << dim << "s\n";
+    os << "# TYPE " << prefix << "_ops_total counter\n";
+    for (const auto& [key, e] : keys) {
+        os << prefix << "_ops_total";
+        write_labels(os, {{label, key}});
+        os << ' ' << e.ops << '\n';
+    }
+    os << "# HELP " << prefix << "_bytes_total Estimated RPC message bytes of the busiest "
+       << dim << "s\n";
+    os << "# TYPE " << prefix << "_bytes_total counter\n";
+    for (const auto& [key, e] : keys) {
+        os << prefix << "_bytes_total";
+        write_labels(os, {{label, key}, {"direction", "in"}});
+        os << ' ' << e.bytes_in << '\n';
+        os << prefix << "_bytes_total";
+        write_labels(os, {{label, key}, {"direction", "out"}});
+        os << ' ' << e.bytes_out << '\n';
+    }
+    os << "# HELP " << prefix << "_busy_seconds_total Estimated server time spent on the busiest "
+       << dim << "s\n";
+    os << "# TYPE " << prefix << "_busy_seconds_total counter\n";
+    for (const auto& [key, e] : keys) {
+        os << prefix << "_busy_seconds_total";
+        write_labels(os, {{label, key}});
+        os << ' ';
+        write_value(os, e.busy_ns / 1e9);
+        os << '\n';
+    }
+}
+
+std::string MetricsRegistry::render_prometheus() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    std::ostringstream os;
+    for (const auto& [name, fam] : families_) {
+        os << "# HELP " << name << ' ' << fam.help << '\n';
+        os << "# TYPE " << name << ' ' << (fam.is_counter ? "counter" : "gauge") << '\n';
+        for (const auto& [labels, read] : fam.series) {
+            os << name;
+            write_labels(os, labels);
+            os << ' ';
+            write_value(os, read());
+            os << '\n';
+        }
+    }
+
+    if (!latency_.empty()) {
+        os << "# HELP nfsd_rpc_latency_seconds Server-side RPC latency by phase\n";
+        os << "# TYPE nfsd_rpc_latency_seconds histogram\n";
+        for (const LatencyStats* stats : latency_)
+            for (const auto& e : stats->snapshot())
+                write_latency_histogram(os, e);
+    }
+
+    for (const auto& [stats, top_n] : client_stats_) {
+        write_top_talkers(os, "client", "client", stats->clients(), top_n);
+        write_top_talkers(os, "export", "export", stats->exports(), top_n);
+    }
+    return os.str();
+}
+
+std::string MetricsRegistry::render_top_report() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    std::string out;
+    for (const auto& [stats, top_n] : client_stats_) out += stats->report(top_n);
+    return out;
+}
+
+// --- /proc/net/rpc/nfsd ---
+
+static uint64_t proc_count(const MetricsRegistry& r, uint32_t vers, uint32_t proc) {
+    return static_cast<uint64_t>(r.value("nfsd_rpc_calls_total",
+        {{"program", std::to_string(NFS_PROGRAM)},
+         {"version", std::to_string(vers)},
+         {"procedure", std::to_string(proc)}}));
+}
+
+static uint64_t metric(const MetricsRegistry& r, const std::string& name,
+                       const MetricLabels& labels = {}) {
+    return static_cast<uint64_t>(r.value(name, labels));
+}
+
+std::string render_proc_nfsd(const MetricsRegistry& r) {
+    // NFSv3 has 22 procedures, NFSv2 18; proc4ops covers ops 0..75
+    // (through RFC 7862), matching current kernels.
+    constexpr uint32_t kProc2 = 18, kProc3 = 22, kProc4Ops = 76;
+
+    uint64_t calls = 0;
+    for (uint32_t v : {3u, 4u})
+        for (uint32_t p = 0; p < (v == 3 ? kProc3 : 2); p++)
+            calls += proc_count(r, v, p);
+    uint64_t badfmt = metric(r, "nfsd_rpc_errors_total", {{"reason", "badfmt"}});
+
+    std::ostringstream os;
+    // No duplicate request cache: every call is "nocache"
+    os << "rc 0 0 " << calls << '\n';
+    os << "fh " << metric(r, "nfsd_fh_cache_lookups_total", {{"result", "miss"}})
+       << " 0 0 0 0\n";
+    os << "io "
+       << metric(r, "nfsd_io_bytes_total", {{"direction", "read"}, {"version", "3"}}) +
+              metric(r, "nfsd_io_bytes_total", {{"direction", "read"}, {"version", "4"}})
+       << ' '
+       << metric(r, "nfsd_io_bytes_total", {{"direction", "write"}, {"version", "3"}}) +
+              metric(r, "nfsd_io_bytes_total", {{"direction", "write"}, {"version", "4"}})
+       << '\n';
+    os << "th " << metric(r, "nfsd_connections_active")
+       << " 0 0.000 0.000 0.000 0.000 0.000 0.000 0.000 0.000 0.000 0.000\n";
+    os << "net " << calls << " 0 " << calls << ' '
+       << metric(r, "nfsd_connections_accepted_total") << '\n';
+    os << "rpc " << calls + badfmt << ' ' << badfmt << ' ' << badfmt << " 0 0\n";
+
+    os << "proc2 " << kProc2;
+    for (uint32_t p = 0; p < kProc2; p++) os << " 0";
+    os << '\n';
+    os << "proc3 " << kProc3;
+    for (uint32_t p = 0; p < kProc3; p++) os << ' ' << proc_count(r, 3, p);
+    os << '\n';
+    os << "proc4 2 " << proc_count(r, 4, 0) << ' ' << proc_count(r, 4, 1) << '\n';
+    os << "proc4ops " << kProc4Ops;
+    for (uint32_t op = 0; op < kProc4Ops; op++)
+        os << ' ' << metric(r, "nfsd_nfs4_ops_total", {{"op", std::to_string(op)}});
+    os << '\n';
+    return os.str();
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "stats/client_stats.h"
+#include "stats/latency_stats.h"
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Metrics registry exported in Prometheus text format (version 0.0.4).
+//
+// Components keep their own counters (plain atomics on the hot path) and
+// register read callbacks here; nothing is sampled until a scrape renders
+// the registry. Callbacks run with the registry mutex held and may be called
+// from the metrics server thread, so they must be thread-safe and must not
+// call back into the registry. Register during startup, before start(), and
+// keep every registered component alive for the registry's lifetime.
+
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+class MetricsRegistry {
+public:
+    // Monotonic count (exposed as TYPE counter)
+    void counter(const std::string& name, const std::string& help,
+                 const MetricLabels& labels, std::function<uint64_t()> read);
+    // Monotonic time kept in nanoseconds, exposed in seconds (TYPE counter)
+    void counter_seconds(const std::string& name, const std::string& help,
+                         const MetricLabels& labels, std::function<uint64_t()> read_ns);
+    // Point-in-time value (exposed as TYPE gauge)
+    void gauge(const std::string& name, const std::string& help,
+               const MetricLabels& labels, std::function<double()> read);
+
+    // Export stats as nfsd_rpc_latency_seconds histograms (not owned)
+    void add_latency_stats(const LatencyStats* stats);
+
+    // Export the top_n keys of each ClientStats ranking as
+    // nfsd_top_{client,export}_* series (not owned)
+    void add_client_stats(const ClientStats* stats, size_t top_n);
+
+    std::string render_prometheus() const;
+    // ClientStats::report() of every added ClientStats
+    std::string render_top_report() const;
+
+    // Current value of one series; 0 if it is not registered
+    double value(const std::string& name, const MetricLabels& labels = {}) const;
+
+private:
+    struct Family {
+        std::string help;
+        bool is_counter = false;
+        std::map<MetricLabels, std::function<double()>> series;
+    };
+
+    Family& family(const std::string& name, const std::string& help, bool is_counter);
+
+    mutable std::mutex mu_;
+    std::map<std::string, Family> families_;
+    std::vector<const LatencyStats*> latency_;
+    std::vector<std::pair<const ClientStats*, size_t>> client_stats_;
+};
+
+// nfsd statistics in the /proc/net/rpc/nfsd layout read by nfsstat(8):
+// rc, fh, io, th, net, rpc, proc2, proc3, proc4 and proc4ops lines.
+// Built from the series RpcServer, NfsServer, Nfs4Server and LocalFs register.
+std::string render_proc_nfsd(const MetricsRegistry& registry);
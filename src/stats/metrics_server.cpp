@@ -0,0 +1,182 @@
+#include "stats/metrics_server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+
+MetricsServer::MetricsServer(const MetricsRegistry& registry) : registry_(registry) {}
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+bool MetricsServer::listen_unix(const std::string& path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(fd, 16) < 0) {
+        close(fd);
+        return false;
+    }
+    unix_path_ = path;
+    listen_fds_.push_back(fd);
+    return true;
+}
+
+bool MetricsServer::listen_tcp(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(fd, 16) < 0) {
+        close(fd);
+        return false;
+    }
+    tcp_fd_ = fd;
+    listen_fds_.push_back(fd);
+    return true;
+}
+
+uint16_t MetricsServer::tcp_port() const {
+    if (tcp_fd_ < 0) return 0;
+    sockaddr_in addr{};
+    socklen_t len = sizeof(addr);
+    if (getsockname(tcp_fd_, reinterpret_cast<sockaddr*>(&addr), &len) < 0) return 0;
+    return ntohs(addr.sin_port);
+}
+
+void MetricsServer::start() {
+    if (listen_fds_.empty() || running_) return;
+    running_ = true;
+    thread_ = std::thread(&MetricsServer::serve_loop, this);
+}
+
+void MetricsServer::stop() {
+    running_ = false;
+    if (thread_.joinable()) thread_.join();
+    for (int fd : listen_fds_) close(fd);
+    listen_fds_.clear();
+    tcp_fd_ = -1;
+    if (!unix_path_.empty()) {
+        unlink(unix_path_.c_str());
+        unix_path_.clear();
+    }
+}
+
+void MetricsServer::serve_loop() {
+    std::vector<pollfd> pfds;
+    for (int fd : listen_fds_) pfds.push_back({fd, POLLIN, 0});
+
+    while (running_) {
+        // Short timeout so stop() is noticed without closing fds under poll
+        int n = poll(pfds.data(), pfds.size(), 200);
+        if (n <= 0) continue;
+        for (auto& p : pfds) {
+            if (!(p.revents & POLLIN)) continue;
+            int client = accept(p.fd, nullptr, nullptr);
+            if (client < 0) continue;
+            serve_client(client);
+            close(client);
+        }
+    }
+}
+
+static void send_all(int fd, const std::string& data) {
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t n = send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+        if (n <= 0) return;
+        off += static_cast<size_t>(n);
+    }
+}
+
+void MetricsServer::serve_client(int fd) {
+    // Read the request head (bounded; a slow client gets at most 1s)
+    std::string req;
+    char buf[1024];
+    while (req.find("\r\n\r\n") == std::string::npos &&
+           req.find("\n\n") == std::string::npos && req.size() < 8192) {
+        pollfd p{fd, POLLIN, 0};
+        if (poll(&p, 1, 1000) <= 0) return;
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) break;
+        req.append(buf, static_cast<size_t>(n));
+    }
+
+    // Request line: METHOD SP PATH SP VERSION
+    std::string method, path;
+    size_t sp1 = req.find(' ');
+    size_t sp2 = sp1 == std::string::npos ? sp1 : req.find_first_of(" \r\n", sp1 + 1);
+    if (sp1 != std::string::npos && sp2 != std::string::npos) {
+        method = req.substr(0, sp1);
+        path = req.substr(sp1 + 1, sp2 - sp1 - 1);
+    }
+
+    std::string status = "200 OK";
+    std::string type = "text/plain; version=0.0.4; charset=utf-8";
+    std::string body;
+    if (method != "GET") {
+        status = "405 Method Not Allowed";
+        body = "only GET is supported\n";
+    } else if (path == "/metrics") {
+        body = registry_.render_prometheus();
+    } else if (path == "/nfsd") {
+        body = render_proc_nfsd(registry_);
+    } else if (path == "/top") {
+        body = registry_.render_top_report();
+    } else {
+        status = "404 Not Found";
+        body = "try /metrics, /nfsd or /top\n";
+    }
+
+    send_all(fd, "HTTP/1.0 " + status + "\r\nContent-Type: " + type +
+                 "\r\nContent-Length: " + std::to_string(body.size()) +
+                 "\r\nConnection: close\r\n\r\n" + body);
+}
+
+bool metrics_fetch_unix(const std::string& socket_path, const std::string& path,
+                        std::string& body) {
+    sockaddr_un addr{};
+    if (socket_path.size() >= sizeof(addr.sun_path)) return false;
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return false;
+    }
+    send_all(fd, "GET " + path + " HTTP/1.0\r\n\r\n");
+
+    std::string resp;
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+        resp.append(buf, static_cast<size_t>(n));
+    close(fd);
+
+    size_t head_end = resp.find("\r\n\r\n");
+    if (resp.compare(0, 12, "HTTP/1.0 200") != 0 || head_end == std::string::npos)
+        return false;
+    body = resp.substr(head_end + 4);
+    return true;
+}
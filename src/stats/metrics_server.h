@@ -0,0 +1,46 @@
+#pragma once
+
+#include "stats/metrics.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Minimal HTTP/1.0 endpoint for scraping a MetricsRegistry.
+//   GET /metrics  — Prometheus text format
+//   GET /nfsd     — /proc/net/rpc/nfsd layout (what `nfsd --stats` prints)
+//   GET /top      — top clients and exports by ops, bytes and busy time
+// Listens on a Unix socket and/or a loopback TCP port. Requests are served
+// one at a time on a single thread; scrapes are infrequent.
+class MetricsServer {
+public:
+    explicit MetricsServer(const MetricsRegistry& registry);
+    ~MetricsServer();
+
+    // Listen on a Unix socket at path (an existing socket file is replaced).
+    bool listen_unix(const std::string& path);
+    // Listen on 127.0.0.1:port (0 picks an ephemeral port).
+    bool listen_tcp(uint16_t port);
+    // Bound TCP port after listen_tcp()
+    uint16_t tcp_port() const;
+
+    void start();
+    void stop();
+
+private:
+    void serve_loop();
+    void serve_client(int fd);
+
+    const MetricsRegistry& registry_;
+    std::vector<int> listen_fds_;
+    std::string unix_path_;
+    int tcp_fd_ = -1;
+    std::atomic<bool> running_{false};
+    std::thread thread_;
+};
+
+// Fetch path (e.g. "/nfsd") from a MetricsServer's Unix socket.
+// Returns false if the server is unreachable or the request fails.
+bool metrics_fetch_unix(const std::string& socket_path, const std::string& path,
+                        std::string& body);
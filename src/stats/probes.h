@@ -0,0 +1,73 @@
+#pragma once
+
+// USDT (user statically-defined tracing) probes, provider "nfsd".
+//
+// With <sys/sdt.h> (systemtap-sdt-dev) each probe is a single nop plus an
+// ELF note describing where its arguments live; nothing is evaluated
+// beyond what is already in registers, and tools such as bpftrace can
+// attach to a running server:
+//
+//   bpftrace -e 'usdt:./nfsd:nfsd:rpc__dispatch__start { @s[tid] = nsecs; }
+//                usdt:./nfsd:nfsd:rpc__dispatch__done /@s[tid]/ {
+//                  @us[arg3] = hist((nsecs - @s[tid]) / 1000); delete(@s[tid]); }'
+//
+// Without the header, or when built with NFSD_NO_USDT, the probes compile
+// to nothing. Arguments are integers and pointers only: handles are passed
+// as (data pointer, length), to be read with buf(argN, argM).
+//
+// Probes and arguments:
+//   rpc__receive          (xid, record_len)
+//   rpc__decoded          (xid, program, version, procedure)
+//   rpc__dispatch__start  (xid, program, version, procedure)
+//   rpc__dispatch__done   (xid, program, version, procedure, handler_ok)
+//   rpc__reply            (xid, reply_len, accept_stat)
+//   nfs4__op__start       (xid, opcode, index)
+//   nfs4__op__done        (xid, opcode, index, nfsstat4)
+//   vfs__start            (xid, vfs_op, fh_data, fh_len)
+//   vfs__done             (xid, vfs_op, fh_data, fh_len, nfsstat3)
+//   lock__acquire         (xid, fh_data, fh_len, offset, length, exclusive)
+//   lock__deny            (xid, fh_data, fh_len, offset, length, exclusive)
+//   deleg__grant          (xid, fh_data, fh_len, clientid, deleg_type)
+//   deleg__recall         (xid, fh_data, fh_len, clientid)
+//
+// xid is that of the call being handled on the probing thread (0 outside a
+// call); vfs_op is a NUL-terminated operation name (read with str()).
+
+#include <cstdint>
+
+#if !defined(NFSD_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define NFSD_HAVE_USDT 1
+#endif
+#endif
+
+#ifdef NFSD_HAVE_USDT
+#define NFSD_PROBE2(name, a1, a2) DTRACE_PROBE2(nfsd, name, a1, a2)
+#define NFSD_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(nfsd, name, a1, a2, a3)
+#define NFSD_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(nfsd, name, a1, a2, a3, a4)
+#define NFSD_PROBE5(name, a1, a2, a3, a4, a5) DTRACE_PROBE5(nfsd, name, a1, a2, a3, a4, a5)
+#define NFSD_PROBE6(name, a1, a2, a3, a4, a5, a6) \
+    DTRACE_PROBE6(nfsd, name, a1, a2, a3, a4, a5, a6)
+#else
+#define NFSD_PROBE2(name, a1, a2) do {} while (0)
+#define NFSD_PROBE3(name, a1, a2, a3) do {} while (0)
+#define NFSD_PROBE4(name, a1, a2, a3, a4) do {} while (0)
+#define NFSD_PROBE5(name, a1, a2, a3, a4, a5) do {} while (0)
+#define NFSD_PROBE6(name, a1, a2, a3, a4, a5, a6) do {} while (0)
+#endif
+
+// xid of the call being handled on this thread, for probes below the RPC
+// layer (VFS, lock table, NFSv4 state). Set by RpcServer around dispatch.
+inline thread_local uint32_t t_probe_xid = 0;
+
+class ProbeXidScope {
+public:
+    explicit ProbeXidScope(uint32_t xid) : prev_(t_probe_xid) { t_probe_xid = xid; }
+    ~ProbeXidScope() { t_probe_xid = prev_; }
+    ProbeXidScope(const ProbeXidScope&) = delete;
+    ProbeXidScope& operator=(const ProbeXidScope&) = delete;
+
+private:
+    uint32_t prev_;
+};
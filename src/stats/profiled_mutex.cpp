@@ -0,0 +1,59 @@
+#include "stats/profiled_mutex.h"
+#include "stats/latency_stats.h"
+#include "stats/metrics.h"
+
+// Add to a counter only the lock holder writes
+static void bump(std::atomic<uint64_t>& c, uint64_t d) {
+    c.store(c.load(std::memory_order_relaxed) + d, std::memory_order_relaxed);
+}
+
+void ProfiledMutex::lock_profiled() {
+    uint64_t acquired_ns;
+    if (mu_.try_lock()) {
+        acquired_ns = LatencyStats::now_ns();
+    } else {
+        uint64_t start_ns = LatencyStats::now_ns();
+        mu_.lock();
+        acquired_ns = LatencyStats::now_ns();
+        uint64_t waited = acquired_ns - start_ns;
+        bump(contended_, 1);
+        bump(wait_ns_, waited);
+        if (waited > max_wait_ns_.load(std::memory_order_relaxed))
+            max_wait_ns_.store(waited, std::memory_order_relaxed);
+    }
+    bump(acquisitions_, 1);
+    held_since_ns_ = acquired_ns;
+}
+
+bool ProfiledMutex::try_lock() {
+    if (!mu_.try_lock()) return false;
+    if (enabled()) {
+        bump(acquisitions_, 1);
+        held_since_ns_ = LatencyStats::now_ns();
+    }
+    return true;
+}
+
+void ProfiledMutex::record_hold() {
+    bump(hold_ns_, LatencyStats::now_ns() - held_since_ns_);
+    held_since_ns_ = 0;
+}
+
+void ProfiledMutex::register_metrics(MetricsRegistry& metrics) {
+    const MetricLabels labels = {{"lock", name_}};
+    metrics.counter("nfsd_lock_acquisitions_total",
+                    "Acquisitions of a profiled server lock", labels,
+                    [this] { return acquisitions(); });
+    metrics.counter("nfsd_lock_contended_total",
+                    "Acquisitions that found the lock held and had to wait", labels,
+                    [this] { return contended(); });
+    metrics.counter_seconds("nfsd_lock_wait_seconds_total",
+                            "Time spent waiting to acquire a profiled lock", labels,
+                            [this] { return wait_ns(); });
+    metrics.counter_seconds("nfsd_lock_hold_seconds_total",
+                            "Time a profiled lock was held", labels,
+                            [this] { return hold_ns(); });
+    metrics.gauge("nfsd_lock_wait_max_seconds",
+                  "Longest single wait for a profiled lock", labels,
+                  [this] { return max_wait_ns() / 1e9; });
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+class MetricsRegistry;
+
+// Mutex that records, per named lock site, how often it is taken, how
+// often a taker had to wait, and the total wait and hold time. A drop-in
+// for std::mutex with std::lock_guard / std::unique_lock (not usable with
+// std::condition_variable).
+//
+// Profiling is process-wide and off by default; while off, lock() and
+// unlock() cost one relaxed load and one predictable branch over the
+// plain mutex. While on, an uncontended acquisition adds two clock reads
+// (hold time); only a failed try_lock pays for timing the wait. Counters
+// are written only by the current holder, so they need no atomic RMW.
+class ProfiledMutex {
+public:
+    // name labels the site in metrics ("localfs", "nfs4_state", ...)
+    explicit ProfiledMutex(const char* name) : name_(name) {}
+    ProfiledMutex(const ProfiledMutex&) = delete;
+    ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+
+    void lock() {
+        if (!enabled()) {
+            mu_.lock();
+            return;
+        }
+        lock_profiled();
+    }
+
+    bool try_lock();
+
+    void unlock() {
+        if (held_since_ns_) record_hold();
+        mu_.unlock();
+    }
+
+    static void set_enabled(bool on) { enabled_.store(on, std::memory_order_relaxed); }
+    static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    const char* name() const { return name_; }
+    uint64_t acquisitions() const { return acquisitions_.load(std::memory_order_relaxed); }
+    uint64_t contended() const { return contended_.load(std::memory_order_relaxed); }
+    uint64_t wait_ns() const { return wait_ns_.load(std::memory_order_relaxed); }
+    uint64_t hold_ns() const { return hold_ns_.load(std::memory_order_relaxed); }
+    uint64_t max_wait_ns() const { return max_wait_ns_.load(std::memory_order_relaxed); }
+
+    // Export as nfsd_lock_* series labelled lock=name()
+    void register_metrics(MetricsRegistry& metrics);
+
+private:
+    void lock_profiled();
+    void record_hold();
+
+    static inline std::atomic<bool> enabled_{false};
+
+    std::mutex mu_;
+    const char* name_;
+    uint64_t held_since_ns_ = 0;  // holder only; 0 when not profiled
+
+    std::atomic<uint64_t> acquisitions_{0};
+    std::atomic<uint64_t> contended_{0};
+    std::atomic<uint64_t> wait_ns_{0};
+    std::atomic<uint64_t> hold_ns_{0};
+    std::atomic<uint64_t> max_wait_ns_{0};
+};
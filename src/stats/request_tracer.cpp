@@ -0,0 +1,200 @@
+#include "stats/request_tracer.h"
+
+#include <chrono>
+#include <cstdio>
+
+static std::atomic<uint64_t> g_next_tracer_instance{1};
+
+namespace {
+// The ring this thread pushes to; handed back when the thread exits
+struct ThreadRing {
+    uint64_t instance = 0;
+    std::shared_ptr<SpanRing> ring;
+    ~ThreadRing();
+};
+}  // namespace
+
+static thread_local ThreadRing t_ring;
+static thread_local uint32_t t_calls_since_sample = 0;
+
+RequestTracer::RequestTracer(const std::string& path, uint32_t sample_every,
+                             std::string client_filter)
+    : sample_every_(sample_every), client_filter_(std::move(client_filter)),
+      instance_(g_next_tracer_instance.fetch_add(1, std::memory_order_relaxed)),
+      file_(path, std::ios::trunc) {
+    // JSON array form of the trace-event format; viewers accept it without
+    // the closing bracket, so a killed server still leaves a usable trace
+    if (file_.is_open()) file_ << "[\n";
+    writer_ = std::thread(&RequestTracer::writer_loop, this);
+}
+
+RequestTracer::~RequestTracer() {
+    {
+        std::lock_guard<std::mutex> lk(stop_mu_);
+        stop_ = true;
+    }
+    stop_cv_.notify_all();
+    writer_.join();
+
+    std::lock_guard<std::mutex> lk(write_mu_);
+    drain_locked();
+    if (file_.is_open()) file_ << "\n]\n";
+}
+
+bool RequestTracer::sample(const std::string& client) {
+    if (!client_filter_.empty() && client.find(client_filter_) != std::string::npos)
+        return true;
+    if (sample_every_ == 0) return false;
+    // Per-thread countdown: no shared counter on the request path
+    if (++t_calls_since_sample < sample_every_) return false;
+    t_calls_since_sample = 0;
+    return true;
+}
+
+SpanRing* RequestTracer::thread_ring() {
+    if (t_ring.instance == instance_) return t_ring.ring.get();
+    if (t_ring.ring) t_ring.ring->release();
+
+    std::lock_guard<std::mutex> lk(rings_mu_);
+    std::shared_ptr<SpanRing> ring;
+    for (auto& r : rings_) {
+        if (r->released_.load(std::memory_order_acquire)) {
+            r->released_.store(false, std::memory_order_relaxed);
+            ring = r;
+            break;
+        }
+    }
+    if (!ring) {
+        ring = std::make_shared<SpanRing>(static_cast<uint32_t>(rings_.size() + 1));
+        rings_.push_back(ring);
+    }
+    t_ring.instance = instance_;
+    t_ring.ring = ring;
+    return ring.get();
+}
+
+ThreadRing::~ThreadRing() {
+    if (ring) ring->release();
+}
+
+uint64_t RequestTracer::dropped() const {
+    std::lock_guard<std::mutex> lk(rings_mu_);
+    uint64_t n = 0;
+    for (const auto& r : rings_) n += r->dropped();
+    return n;
+}
+
+void RequestTracer::flush() {
+    std::lock_guard<std::mutex> lk(write_mu_);
+    drain_locked();
+    if (file_.is_open()) file_.flush();
+}
+
+void RequestTracer::writer_loop() {
+    std::unique_lock<std::mutex> lk(stop_mu_);
+    while (!stop_) {
+        stop_cv_.wait_for(lk, std::chrono::milliseconds(200), [this] { return stop_; });
+        lk.unlock();
+        flush();
+        lk.lock();
+    }
+}
+
+void RequestTracer::drain_locked() {
+    std::vector<std::shared_ptr<SpanRing>> rings;
+    {
+        std::lock_guard<std::mutex> lk(rings_mu_);
+        rings = rings_;
+    }
+
+    std::string out;
+    for (; named_rings_ < rings.size(); named_rings_++) {
+        // Metadata event naming the ring's track in the viewer
+        char meta[128];
+        std::snprintf(meta, sizeof(meta),
+                      "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                      "\"args\":{\"name\":\"rpc worker %u\"}}",
+                      rings[named_rings_]->id(), rings[named_rings_]->id());
+        if (!first_) out += ",\n";
+        first_ = false;
+        out += meta;
+    }
+
+    uint64_t n = 0;
+    for (const auto& ring : rings) {
+        batch_.clear();
+        ring->drain(batch_);
+        for (const auto& s : batch_) write_span(out, s, ring->id());
+        n += batch_.size();
+    }
+    if (file_.is_open() && !out.empty()) file_ << out;
+    written_.fetch_add(n, std::memory_order_relaxed);
+}
+
+static const char* program_name(uint32_t program) {
+    switch (program) {
+        case 100003: return "NFS";
+        case 100005: return "MOUNT";
+        case 100021: return "NLM";
+        default:     return nullptr;
+    }
+}
+
+void RequestTracer::write_span(std::string& out, const TraceSpan& s, uint32_t tid) {
+    char name[48];
+    const char* cat = "rpc";
+    switch (s.kind) {
+        case SpanKind::CALL:
+            if (const char* prog = program_name(s.a))
+                std::snprintf(name, sizeof(name), "%sv%u proc %u", prog, s.b, s.c);
+            else
+                std::snprintf(name, sizeof(name), "prog %u v%u proc %u", s.a, s.b, s.c);
+            break;
+        case SpanKind::DECODE:  std::snprintf(name, sizeof(name), "decode"); break;
+        case SpanKind::HANDLER: std::snprintf(name, sizeof(name), "handler"); break;
+        case SpanKind::SEND:    std::snprintf(name, sizeof(name), "send"); break;
+        case SpanKind::THROTTLE: std::snprintf(name, sizeof(name), "qos throttle"); break;
+        case SpanKind::OP:
+            std::snprintf(name, sizeof(name), "op %u", s.a);
+            cat = "nfs4";
+            break;
+        case SpanKind::VFS:
+            std::snprintf(name, sizeof(name), "%s", s.name ? s.name : "vfs");
+            cat = "vfs";
+            break;
+    }
+
+    char args[96];
+    switch (s.kind) {
+        case SpanKind::CALL:
+            std::snprintf(args, sizeof(args), ",\"prog\":%u,\"vers\":%u,\"proc\":%u", s.a, s.b,
+                          s.c);
+            break;
+        case SpanKind::OP:
+            std::snprintf(args, sizeof(args), ",\"opcode\":%u,\"status\":%u,\"index\":%u", s.a,
+                          s.b, s.c);
+            break;
+        case SpanKind::VFS:
+            std::snprintf(args, sizeof(args), ",\"status\":%u", s.b);
+            break;
+        case SpanKind::SEND:
+            std::snprintf(args, sizeof(args), ",\"bytes\":%u", s.a);
+            break;
+        default:
+            args[0] = '\0';
+            break;
+    }
+
+    // ts and dur are in microseconds
+    char ev[320];
+    std::snprintf(ev, sizeof(ev),
+                  "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03u,"
+                  "\"dur\":%llu.%03u,\"pid\":1,\"tid\":%u,\"args\":{\"xid\":\"0x%08x\"%s}}",
+                  name, cat, static_cast<unsigned long long>(s.start_ns / 1000),
+                  static_cast<unsigned>(s.start_ns % 1000),
+                  static_cast<unsigned long long>(s.dur_ns / 1000),
+                  static_cast<unsigned>(s.dur_ns % 1000), tid, s.xid, args);
+    if (!first_) out += ",\n";
+    first_ = false;
+    out += ev;
+}
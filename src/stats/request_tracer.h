@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Sampled request timelines in Chrome trace-event JSON (chrome://tracing,
+// ui.perfetto.dev).
+//
+// RpcServer picks 1 in N calls, or every call from clients matching a
+// filter, and gives the call's RequestTrace (stats/slow_op_log.h) the
+// calling thread's span ring. The RPC layer, the NFSv4 COMPOUND loop and
+// TracedVfs then push one span per phase, op and VFS call. Rings are
+// single-producer/single-consumer: the request thread never blocks or
+// formats; a writer thread drains all rings and appends complete ("X")
+// events to the file.
+
+enum class SpanKind : uint8_t {
+    CALL,    // whole call, receive to reply sent: a = program, b = version, c = procedure
+    DECODE,  // RPC header decode and dispatch lookup
+    HANDLER, // procedure handler, including argument decode and reply encode
+    OP,      // one NFSv4 COMPOUND op: a = opcode, b = nfsstat4, c = index
+    VFS,     // one Vfs call (name): b = nfsstat3
+    SEND,    // reply record send: a = reply bytes
+    THROTTLE, // held back by a QoS policy before the handler
+};
+
+struct TraceSpan {
+    uint64_t start_ns = 0;  // LatencyStats::now_ns() clock
+    uint64_t dur_ns = 0;
+    const char* name = nullptr;  // static string, VFS spans only
+    uint32_t xid = 0;
+    uint32_t a = 0, b = 0, c = 0;
+    SpanKind kind = SpanKind::CALL;
+};
+
+// Bounded single-producer/single-consumer span queue; full means the span
+// is dropped and counted
+class SpanRing {
+public:
+    static constexpr size_t kCapacity = 1024;  // power of two
+
+    explicit SpanRing(uint32_t id) : id_(id), spans_(new TraceSpan[kCapacity]) {}
+
+    // Producer (the owning request thread)
+    void push(const TraceSpan& span) {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) >= kCapacity) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        spans_[head & (kCapacity - 1)] = span;
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    // Consumer (the writer); appends everything queued to out
+    size_t drain(std::vector<TraceSpan>& out) {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        uint64_t head = head_.load(std::memory_order_acquire);
+        for (uint64_t i = tail; i != head; i++) out.push_back(spans_[i & (kCapacity - 1)]);
+        tail_.store(head, std::memory_order_release);
+        return head - tail;
+    }
+
+    uint32_t id() const { return id_; }
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // The owning thread is done with the ring; the tracer may hand it,
+    // with anything still queued, to another thread
+    void release() { released_.store(true, std::memory_order_release); }
+
+private:
+    friend class RequestTracer;
+
+    const uint32_t id_;  // Chrome "tid" of everything in this ring
+    std::unique_ptr<TraceSpan[]> spans_;
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) std::atomic<uint64_t> tail_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<bool> released_{false};
+};
+
+class RequestTracer {
+public:
+    // sample_every: trace 1 in N calls per thread (0: none unless the
+    // client matches). client_filter: also trace every call whose client
+    // key (ClientStats::client_key) contains it; empty matches nothing.
+    RequestTracer(const std::string& path, uint32_t sample_every,
+                  std::string client_filter = "");
+    ~RequestTracer();
+
+    RequestTracer(const RequestTracer&) = delete;
+    RequestTracer& operator=(const RequestTracer&) = delete;
+
+    bool open() const { return file_.is_open(); }
+    bool filters_clients() const { return !client_filter_.empty(); }
+
+    // Whether to trace the next call on this thread from client
+    bool sample(const std::string& client);
+
+    // This thread's ring, claimed on first use
+    SpanRing* thread_ring();
+
+    // Write every span queued so far
+    void flush();
+
+    uint64_t written() const { return written_.load(std::memory_order_relaxed); }
+    uint64_t dropped() const;
+
+private:
+    void writer_loop();
+    // Drain all rings to the file; called with write_mu_ held
+    void drain_locked();
+    void write_span(std::string& out, const TraceSpan& s, uint32_t tid);
+
+    const uint32_t sample_every_;
+    const std::string client_filter_;
+    const uint64_t instance_;  // tells this tracer's thread rings from a previous one's
+
+    mutable std::mutex rings_mu_;  // guards rings_
+    std::vector<std::shared_ptr<SpanRing>> rings_;
+
+    std::mutex write_mu_;  // guards everything down to batch_
+    std::ofstream file_;
+    bool first_ = true;
+    size_t named_rings_ = 0;  // rings whose thread_name event is written
+    std::vector<TraceSpan> batch_;
+
+    std::mutex stop_mu_;
+    std::condition_variable stop_cv_;
+    bool stop_ = false;
+    std::thread writer_;
+
+    std::atomic<uint64_t> written_{0};
+};
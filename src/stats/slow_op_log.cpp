@@ -0,0 +1,148 @@
+#include "stats/slow_op_log.h"
+
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+
+static thread_local RequestTrace* t_current_trace = nullptr;
+
+RequestTrace* current_request_trace() {
+    return t_current_trace;
+}
+
+RequestTraceScope::RequestTraceScope(RequestTrace* trace) : prev_(t_current_trace) {
+    t_current_trace = trace;
+}
+
+RequestTraceScope::~RequestTraceScope() {
+    t_current_trace = prev_;
+}
+
+// --- SlowOpLog ---
+
+SlowOpLog::SlowOpLog(uint64_t threshold_ns, const std::string& path)
+    : threshold_ns_(threshold_ns), path_(path) {
+    if (!path_.empty()) file_.open(path_, std::ios::app);
+    writer_ = std::thread(&SlowOpLog::writer_loop, this);
+}
+
+SlowOpLog::~SlowOpLog() {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    writer_.join();
+}
+
+void SlowOpLog::submit(SlowOpRecord&& rec) {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (queue_.size() >= kMaxQueued) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        queue_.push_back(std::move(rec));
+    }
+    cv_.notify_one();
+}
+
+void SlowOpLog::flush() {
+    std::unique_lock<std::mutex> lk(mu_);
+    drained_cv_.wait(lk, [this] { return (queue_.empty() && !writing_) || stop_; });
+}
+
+void SlowOpLog::writer_loop() {
+    std::unique_lock<std::mutex> lk(mu_);
+    for (;;) {
+        cv_.wait(lk, [this] { return stop_ || !queue_.empty(); });
+        if (queue_.empty() && stop_) break;
+
+        std::deque<SlowOpRecord> batch;
+        batch.swap(queue_);
+        writing_ = true;
+        lk.unlock();
+
+        std::string out;
+        for (const auto& rec : batch) {
+            std::string path;
+            if (path_resolver_ && rec.trace.has_fh) path = path_resolver_(rec.trace.fh);
+            out += format(rec, path);
+            out += '\n';
+        }
+        if (path_.empty()) {
+            std::cerr << out << std::flush;
+        } else if (file_.is_open()) {
+            file_ << out;
+            file_.flush();
+        }
+        logged_.fetch_add(batch.size(), std::memory_order_relaxed);
+
+        lk.lock();
+        writing_ = false;
+        drained_cv_.notify_all();
+    }
+    writing_ = false;
+    drained_cv_.notify_all();
+}
+
+static std::string fmt_us(uint64_t ns) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.1f", ns / 1000.0);
+    return buf;
+}
+
+static std::string hex_handle(const FileHandle& fh) {
+    static const char kHex[] = "0123456789abcdef";
+    std::string out;
+    for (size_t i = 0; i < fh.size(); i++) {
+        out += kHex[fh.data()[i] >> 4];
+        out += kHex[fh.data()[i] & 15];
+    }
+    return out;
+}
+
+std::string SlowOpLog::format(const SlowOpRecord& rec, const std::string& path) {
+    std::ostringstream os;
+
+    time_t secs = static_cast<time_t>(rec.wall_ns / 1000000000ull);
+    struct tm tm {};
+    gmtime_r(&secs, &tm);
+    char stamp[64];
+    std::snprintf(stamp, sizeof(stamp), "%04d-%02d-%02dT%02d:%02d:%02d.%06uZ",
+                  tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min,
+                  tm.tm_sec, static_cast<unsigned>(rec.wall_ns % 1000000000ull / 1000));
+
+    uint64_t total = 0;
+    for (uint64_t p : rec.phases) total += p;
+    const uint64_t handler = rec.phases[static_cast<size_t>(LatencyPhase::HANDLER)];
+    const RequestTrace& t = rec.trace;
+
+    char xid[16];
+    std::snprintf(xid, sizeof(xid), "0x%08x", rec.xid);
+    os << stamp << " slow-op xid=" << xid << " client=\"" << rec.client << '"'
+       << " prog=" << rec.program << " vers=" << rec.version << " proc=" << rec.procedure
+       << " total_us=" << fmt_us(total)
+       << " queue_us=" << fmt_us(rec.phases[static_cast<size_t>(LatencyPhase::QUEUE)])
+       << " decode_us=" << fmt_us(rec.phases[static_cast<size_t>(LatencyPhase::DECODE)])
+       << " handler_us=" << fmt_us(handler)
+       << " vfs_us=" << fmt_us(t.vfs_ns) << " vfs_calls=" << t.vfs_calls
+       << " proc_us=" << fmt_us(handler > t.vfs_ns ? handler - t.vfs_ns : 0)
+       << " send_us=" << fmt_us(rec.phases[static_cast<size_t>(LatencyPhase::SEND)])
+       << " bytes_in=" << rec.bytes_in << " bytes_out=" << rec.bytes_out
+       << " io_bytes=" << t.io_bytes;
+    if (t.has_fh) {
+        os << " fh=" << hex_handle(t.fh);
+        if (!path.empty()) os << " path=\"" << path << '"';
+    }
+    if (!t.ops.empty()) {
+        // op:status:microseconds for each COMPOUND op, in order
+        os << " ops=";
+        for (size_t i = 0; i < t.ops.size(); i++) {
+            if (i) os << ',';
+            os << t.ops[i].opcode << ':' << t.ops[i].status << ':' << fmt_us(t.ops[i].ns);
+        }
+    }
+    return os.str();
+}
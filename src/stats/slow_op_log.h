@@ -0,0 +1,132 @@
+#pragma once
+
+#include "stats/latency_stats.h"
+#include "vfs/vfs.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Slow-operation log.
+//
+// While a call is being handled, RpcServer installs a RequestTrace as the
+// thread's current trace; the VFS layer (TracedVfs) and the NFSv4 COMPOUND
+// loop charge their time to it. Calls slower than the threshold are queued
+// as SlowOpRecords and written by a background thread, one line each, so
+// the request thread never formats or writes.
+
+class SpanRing;
+
+// Timing context of the call being handled on this thread
+struct RequestTrace {
+    // One NFSv4 COMPOUND op (RFC 8881 §18 op number, nfsstat4 result)
+    struct Op {
+        uint32_t opcode = 0;
+        uint32_t status = 0;
+        uint64_t ns = 0;
+    };
+
+    uint64_t vfs_ns = 0;      // time inside Vfs calls
+    uint32_t vfs_calls = 0;
+    uint64_t io_bytes = 0;    // file data read or written
+    FileHandle fh;            // first handle passed to the VFS
+    bool has_fh = false;
+    std::vector<Op> ops;
+    // Set when the call is sampled for the request timeline
+    // (stats/request_tracer.h): layers push their spans here
+    SpanRing* spans = nullptr;
+    uint32_t xid = 0;
+
+    void add_vfs(uint64_t ns, const FileHandle* handle) {
+        vfs_ns += ns;
+        vfs_calls++;
+        if (handle && !has_fh) {
+            fh = *handle;
+            has_fh = true;
+        }
+    }
+};
+
+// Trace of the call running on this thread; nullptr outside a traced call
+RequestTrace* current_request_trace();
+
+// Installs trace as the thread's current trace for its lifetime
+class RequestTraceScope {
+public:
+    explicit RequestTraceScope(RequestTrace* trace);
+    ~RequestTraceScope();
+    RequestTraceScope(const RequestTraceScope&) = delete;
+    RequestTraceScope& operator=(const RequestTraceScope&) = delete;
+
+private:
+    RequestTrace* prev_;
+};
+
+struct SlowOpRecord {
+    uint64_t wall_ns = 0;     // CLOCK_REALTIME when the reply was sent
+    uint32_t xid = 0;
+    std::string client;
+    uint32_t program = 0;
+    uint32_t version = 0;
+    uint32_t procedure = 0;
+    uint64_t bytes_in = 0;    // RPC message bytes
+    uint64_t bytes_out = 0;
+    uint64_t phases[kLatencyPhases] = {};
+    RequestTrace trace;
+};
+
+class SlowOpLog {
+public:
+    // Lines go to path (appended), or to stderr when path is empty
+    SlowOpLog(uint64_t threshold_ns, const std::string& path = "");
+    ~SlowOpLog();
+
+    // Calls at or above this end-to-end time are logged
+    uint64_t threshold_ns() const { return threshold_ns_; }
+    bool open() const { return path_.empty() || file_.is_open(); }
+
+    // Render the first handle as a path in the log line (runs on the
+    // writer thread; empty result falls back to the hex handle)
+    void set_path_resolver(std::function<std::string(const FileHandle&)> fn) {
+        path_resolver_ = std::move(fn);
+    }
+
+    // Queue one record; dropped (and counted) if the writer is backlogged
+    void submit(SlowOpRecord&& rec);
+
+    // Write everything queued so far
+    void flush();
+
+    uint64_t logged() const { return logged_.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // One log line, without the trailing newline
+    static std::string format(const SlowOpRecord& rec, const std::string& path);
+
+private:
+    static constexpr size_t kMaxQueued = 4096;
+
+    void writer_loop();
+
+    uint64_t threshold_ns_;
+    std::string path_;
+    std::ofstream file_;
+    std::function<std::string(const FileHandle&)> path_resolver_;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::condition_variable drained_cv_;
+    std::deque<SlowOpRecord> queue_;
+    bool writing_ = false;
+    bool stop_ = false;
+    std::thread writer_;
+
+    std::atomic<uint64_t> logged_{0};
+    std::atomic<uint64_t> dropped_{0};
+};
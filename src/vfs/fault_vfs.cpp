@@ -0,0 +1,436 @@
+#include "vfs/fault_vfs.h"
+#include "stats/latency_stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <thread>
+
+static const char* const kOpNames[kVfsOps] = {
+    "getattr", "setattr", "lookup", "access", "read", "write", "create", "mkdir",
+    "remove", "rmdir", "rename", "readdir", "readlink", "symlink", "link", "fsstat",
+    "fsinfo", "pathconf", "commit", "mknod", "get_root_fh"};
+
+const char* vfs_op_name(VfsOp op) {
+    size_t i = static_cast<size_t>(op);
+    return i < kVfsOps ? kOpNames[i] : "unknown";
+}
+
+static const struct {
+    const char* name;
+    NfsStat3 status;
+} kErrors[] = {
+    {"PERM", NfsStat3::NFS3ERR_PERM},       {"NOENT", NfsStat3::NFS3ERR_NOENT},
+    {"IO", NfsStat3::NFS3ERR_IO},           {"ACCES", NfsStat3::NFS3ERR_ACCES},
+    {"NOSPC", NfsStat3::NFS3ERR_NOSPC},     {"ROFS", NfsStat3::NFS3ERR_ROFS},
+    {"DQUOT", NfsStat3::NFS3ERR_DQUOT},     {"STALE", NfsStat3::NFS3ERR_STALE},
+    {"NOTSUPP", NfsStat3::NFS3ERR_NOTSUPP}, {"SERVERFAULT", NfsStat3::NFS3ERR_SERVERFAULT},
+};
+
+// "250us", "5ms", "1.5s", "100ns"
+static bool parse_duration(const std::string& s, uint64_t& ns) {
+    char* end = nullptr;
+    double v = std::strtod(s.c_str(), &end);
+    if (end == s.c_str() || v < 0) return false;
+    std::string unit(end);
+    double scale = 0;
+    if (unit == "ns") scale = 1;
+    else if (unit == "us") scale = 1e3;
+    else if (unit == "ms") scale = 1e6;
+    else if (unit == "s") scale = 1e9;
+    else return false;
+    ns = static_cast<uint64_t>(v * scale);
+    return true;
+}
+
+static bool parse_prob(const std::string& s, double& p) {
+    char* end = nullptr;
+    p = std::strtod(s.c_str(), &end);
+    return end != s.c_str() && *end == '\0' && p >= 0 && p <= 1;
+}
+
+static std::vector<std::string> split(const std::string& s, char sep) {
+    std::vector<std::string> out;
+    size_t pos = 0;
+    for (;;) {
+        size_t next = s.find(sep, pos);
+        out.push_back(s.substr(pos, next == std::string::npos ? std::string::npos : next - pos));
+        if (next == std::string::npos) return out;
+        pos = next + 1;
+    }
+}
+
+static bool parse_latency(const std::string& s, FaultLatency& out) {
+    auto parts = split(s, ':');
+    using Kind = FaultLatency::Kind;
+    if (parts.size() == 1) {
+        out.kind = Kind::FIXED;
+        return parse_duration(parts[0], out.a_ns);
+    }
+    if (parts[0] == "uniform" && parts.size() == 3) {
+        out.kind = Kind::UNIFORM;
+        return parse_duration(parts[1], out.a_ns) && parse_duration(parts[2], out.b_ns) &&
+               out.a_ns <= out.b_ns;
+    }
+    if (parts[0] == "exp" && parts.size() == 2) {
+        out.kind = Kind::EXP;
+        return parse_duration(parts[1], out.a_ns);
+    }
+    if (parts[0] == "lognormal" && parts.size() == 3) {
+        out.kind = Kind::LOGNORMAL;
+        char* end = nullptr;
+        out.sigma = std::strtod(parts[2].c_str(), &end);
+        return parse_duration(parts[1], out.a_ns) && end != parts[2].c_str() && *end == '\0' &&
+               out.sigma >= 0;
+    }
+    return false;
+}
+
+bool FaultRule::parse(const std::string& spec, FaultRule& out, std::string& err) {
+    out = FaultRule();
+    for (const auto& item : split(spec, ',')) {
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) {
+            err = "expected key=value: " + item;
+            return false;
+        }
+        std::string key = item.substr(0, eq);
+        std::string value = item.substr(eq + 1);
+        bool ok = true;
+        if (key == "op") {
+            out.ops = 0;
+            for (const auto& name : split(value, '+')) {
+                size_t i = 0;
+                while (i < kVfsOps && name != kOpNames[i]) i++;
+                if (i == kVfsOps) {
+                    err = "unknown op: " + name;
+                    return false;
+                }
+                out.ops |= 1u << i;
+            }
+        } else if (key == "prefix") {
+            out.prefix = value;
+            while (out.prefix.size() > 1 && out.prefix.back() == '/') out.prefix.pop_back();
+            ok = !out.prefix.empty() && out.prefix[0] == '/';
+        } else if (key == "fh") {
+            ok = value.size() % 2 == 0 && value.size() / 2 <= FileHandle::kMaxSize &&
+                 !value.empty();
+            uint8_t bytes[FileHandle::kMaxSize];
+            for (size_t i = 0; ok && i < value.size(); i += 2) {
+                char* end = nullptr;
+                std::string byte = value.substr(i, 2);
+                bytes[i / 2] = static_cast<uint8_t>(std::strtoul(byte.c_str(), &end, 16));
+                ok = *end == '\0';
+            }
+            out.fh = ok ? FileHandle(bytes, value.size() / 2) : FileHandle();
+        } else if (key == "latency") {
+            ok = parse_latency(value, out.latency);
+        } else if (key == "stall") {
+            auto parts = split(value, ':');
+            ok = parts.size() == 2 && parse_prob(parts[0], out.stall_prob) &&
+                 parse_duration(parts[1], out.stall_ns);
+        } else if (key == "error") {
+            auto parts = split(value, ':');
+            ok = parts.size() <= 2 && parse_prob(parts[0], out.error_prob);
+            if (ok && parts.size() == 2) {
+                ok = false;
+                for (const auto& e : kErrors) {
+                    if (parts[1] == e.name) {
+                        out.error = e.status;
+                        ok = true;
+                    }
+                }
+                char* end = nullptr;
+                unsigned long n = std::strtoul(parts[1].c_str(), &end, 10);
+                if (!ok && end != parts[1].c_str() && *end == '\0' && n != 0) {
+                    out.error = static_cast<NfsStat3>(n);
+                    ok = true;
+                }
+            }
+        } else if (key == "bw") {
+            char* end = nullptr;
+            double v = std::strtod(value.c_str(), &end);
+            double scale = 1;
+            if (*end == 'K') scale = 1024.0, end++;
+            else if (*end == 'M') scale = 1024.0 * 1024, end++;
+            else if (*end == 'G') scale = 1024.0 * 1024 * 1024, end++;
+            ok = end != value.c_str() && *end == '\0' && v > 0;
+            out.bytes_per_sec = static_cast<uint64_t>(v * scale);
+        } else {
+            err = "unknown key: " + key;
+            return false;
+        }
+        if (!ok) {
+            err = "bad " + key + ": " + value;
+            return false;
+        }
+    }
+    return true;
+}
+
+// A rule and its bandwidth clock: the time at which everything sent
+// through the rule so far will have drained at bytes_per_sec
+struct FaultVfs::Rule {
+    FaultRule rule;
+    std::mutex mu;
+    uint64_t busy_until_ns = 0;
+};
+
+FaultVfs::FaultVfs(Vfs& inner, uint64_t seed) : inner_(inner), seed_(seed ? seed : 1) {}
+
+FaultVfs::~FaultVfs() = default;
+
+void FaultVfs::add_rule(const FaultRule& rule) {
+    auto r = std::make_unique<Rule>();
+    r->rule = rule;
+    rules_.push_back(std::move(r));
+}
+
+// Per-thread generator, seeded from the configured seed and the thread
+static uint64_t next_random(uint64_t seed) {
+    thread_local uint64_t state = 0;
+    if (!state) {
+        state = seed ^ (std::hash<std::thread::id>()(std::this_thread::get_id()) *
+                        0x9e3779b97f4a7c15ull);
+        if (!state) state = 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// In [0, 1)
+static double uniform(uint64_t seed) {
+    return (next_random(seed) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t sample(const FaultLatency& l, uint64_t seed) {
+    using Kind = FaultLatency::Kind;
+    switch (l.kind) {
+        case Kind::NONE:
+            return 0;
+        case Kind::FIXED:
+            return l.a_ns;
+        case Kind::UNIFORM:
+            return l.a_ns + static_cast<uint64_t>(uniform(seed) * (l.b_ns - l.a_ns));
+        case Kind::EXP:
+            return static_cast<uint64_t>(-std::log(1 - uniform(seed)) * l.a_ns);
+        case Kind::LOGNORMAL: {
+            // Box-Muller for a standard normal
+            double u1 = 1 - uniform(seed);
+            double z = std::sqrt(-2 * std::log(u1)) * std::cos(2 * M_PI * uniform(seed));
+            return static_cast<uint64_t>(l.a_ns * std::exp(l.sigma * z));
+        }
+    }
+    return 0;
+}
+
+// path is prefix, or below it
+static bool under(const std::string& path, const std::string& prefix) {
+    if (path.compare(0, prefix.size(), prefix) != 0) return false;
+    return path.size() == prefix.size() || prefix == "/" || path[prefix.size()] == '/';
+}
+
+bool FaultVfs::inject(VfsOp op, const FileHandle* fh, uint64_t bytes, NfsStat3& st) {
+    if (rules_.empty()) return true;
+    std::string path;
+    bool resolved = false;
+    Rule* match = nullptr;
+    for (auto& r : rules_) {
+        const FaultRule& rule = r->rule;
+        if (!(rule.ops & (1u << static_cast<size_t>(op)))) continue;
+        if (!rule.fh.empty() && !(fh && *fh == rule.fh)) continue;
+        if (!rule.prefix.empty()) {
+            if (!fh || !path_resolver_) continue;
+            if (!resolved) {
+                // LocalFs paths may hold "//" below a root handle
+                path = path_resolver_(*fh);
+                path.erase(std::unique(path.begin(), path.end(),
+                                       [](char a, char b) { return a == '/' && b == '/'; }),
+                           path.end());
+                resolved = true;
+            }
+            if (path.empty() || !under(path, rule.prefix)) continue;
+        }
+        match = r.get();
+        break;
+    }
+    if (!match) return true;
+    const FaultRule& rule = match->rule;
+
+    uint64_t delay = sample(rule.latency, seed_);
+    if (rule.stall_prob > 0 && uniform(seed_) < rule.stall_prob) delay += rule.stall_ns;
+    if (rule.bytes_per_sec && bytes) {
+        uint64_t now = LatencyStats::now_ns();
+        uint64_t cost = static_cast<uint64_t>(bytes * 1e9 / rule.bytes_per_sec);
+        uint64_t done;
+        {
+            std::lock_guard<std::mutex> lk(match->mu);
+            match->busy_until_ns = std::max(match->busy_until_ns, now) + cost;
+            done = match->busy_until_ns;
+        }
+        delay += done - now;
+    }
+    OpStats& s = stats_[static_cast<size_t>(op)];
+    if (delay) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(delay));
+        s.delayed.fetch_add(1, std::memory_order_relaxed);
+        s.delay_ns.fetch_add(delay, std::memory_order_relaxed);
+    }
+    if (rule.error_prob > 0 && uniform(seed_) < rule.error_prob) {
+        s.errors.fetch_add(1, std::memory_order_relaxed);
+        st = rule.error;
+        return false;
+    }
+    return true;
+}
+
+template <typename F>
+NfsStat3 FaultVfs::faulty(VfsOp op, const FileHandle* fh, uint64_t bytes, F&& fn) {
+    NfsStat3 st = NfsStat3::NFS3_OK;
+    if (!inject(op, fh, bytes, st)) return st;
+    return fn();
+}
+
+void FaultVfs::register_metrics(MetricsRegistry& metrics) {
+    for (size_t i = 0; i < kVfsOps; i++) {
+        VfsOp op = static_cast<VfsOp>(i);
+        MetricLabels labels = {{"op", kOpNames[i]}};
+        metrics.counter("nfsd_vfs_fault_delayed_total", "VFS calls delayed by fault injection",
+                        labels, [this, op] { return delayed(op); });
+        metrics.counter_seconds("nfsd_vfs_fault_delay_seconds_total",
+                                "Delay added to VFS calls by fault injection", labels,
+                                [this, op] { return delay_ns(op); });
+        metrics.counter("nfsd_vfs_fault_errors_total", "VFS calls failed by fault injection",
+                        labels, [this, op] { return errors(op); });
+    }
+}
+
+NfsStat3 FaultVfs::getattr(const FileHandle& fh, Fattr3& attr) {
+    return faulty(VfsOp::GETATTR, &fh, 0, [&] { return inner_.getattr(fh, attr); });
+}
+
+NfsStat3 FaultVfs::setattr(const FileHandle& fh, uint32_t mode, uint32_t uid, uint32_t gid,
+                           uint64_t size, NfsTimeSet atime, NfsTimeSet mtime) {
+    return faulty(VfsOp::SETATTR, &fh, 0, [&] {
+        return inner_.setattr(fh, mode, uid, gid, size, atime, mtime);
+    });
+}
+
+NfsStat3 FaultVfs::lookup(const FileHandle& dir_fh, const std::string& name,
+                          FileHandle& out_fh, Fattr3& out_attr) {
+    return faulty(VfsOp::LOOKUP, &dir_fh, 0, [&] {
+        return inner_.lookup(dir_fh, name, out_fh, out_attr);
+    });
+}
+
+NfsStat3 FaultVfs::access(const FileHandle& fh, uint32_t requested, uint32_t& granted) {
+    return faulty(VfsOp::ACCESS, &fh, 0, [&] { return inner_.access(fh, requested, granted); });
+}
+
+NfsStat3 FaultVfs::read(const FileHandle& fh, uint64_t offset, uint32_t count,
+                        std::vector<uint8_t>& data, bool& eof) {
+    return faulty(VfsOp::READ, &fh, count, [&] {
+        return inner_.read(fh, offset, count, data, eof);
+    });
+}
+
+NfsStat3 FaultVfs::write(const FileHandle& fh, uint64_t offset, const uint8_t* data,
+                         uint32_t count, uint32_t& written) {
+    return faulty(VfsOp::WRITE, &fh, count, [&] {
+        return inner_.write(fh, offset, data, count, written);
+    });
+}
+
+NfsStat3 FaultVfs::create(const FileHandle& dir_fh, const std::string& name, uint32_t mode,
+                          FileHandle& out_fh, Fattr3& out_attr) {
+    return faulty(VfsOp::CREATE, &dir_fh, 0, [&] {
+        return inner_.create(dir_fh, name, mode, out_fh, out_attr);
+    });
+}
+
+NfsStat3 FaultVfs::mkdir(const FileHandle& dir_fh, const std::string& name, uint32_t mode,
+                         FileHandle& out_fh, Fattr3& out_attr) {
+    return faulty(VfsOp::MKDIR, &dir_fh, 0, [&] {
+        return inner_.mkdir(dir_fh, name, mode, out_fh, out_attr);
+    });
+}
+
+NfsStat3 FaultVfs::remove(const FileHandle& dir_fh, const std::string& name) {
+    return faulty(VfsOp::REMOVE, &dir_fh, 0, [&] { return inner_.remove(dir_fh, name); });
+}
+
+NfsStat3 FaultVfs::rmdir(const FileHandle& dir_fh, const std::string& name) {
+    return faulty(VfsOp::RMDIR, &dir_fh, 0, [&] { return inner_.rmdir(dir_fh, name); });
+}
+
+NfsStat3 FaultVfs::rename(const FileHandle& from_dir, const std::string& from_name,
+                          const FileHandle& to_dir, const std::string& to_name) {
+    return faulty(VfsOp::RENAME, &from_dir, 0, [&] {
+        return inner_.rename(from_dir, from_name, to_dir, to_name);
+    });
+}
+
+NfsStat3 FaultVfs::readdir(const FileHandle& dir_fh, uint64_t cookie, uint32_t count,
+                           std::vector<DirEntry>& entries, bool& eof) {
+    return faulty(VfsOp::READDIR, &dir_fh, 0, [&] {
+        return inner_.readdir(dir_fh, cookie, count, entries, eof);
+    });
+}
+
+NfsStat3 FaultVfs::readlink(const FileHandle& fh, std::string& target) {
+    return faulty(VfsOp::READLINK, &fh, 0, [&] { return inner_.readlink(fh, target); });
+}
+
+NfsStat3 FaultVfs::symlink(const FileHandle& dir_fh, const std::string& name,
+                           const std::string& target, FileHandle& out_fh,
+                           Fattr3& out_attr) {
+    return faulty(VfsOp::SYMLINK, &dir_fh, 0, [&] {
+        return inner_.symlink(dir_fh, name, target, out_fh, out_attr);
+    });
+}
+
+NfsStat3 FaultVfs::link(const FileHandle& fh, const FileHandle& dir_fh,
+                        const std::string& name) {
+    return faulty(VfsOp::LINK, &fh, 0, [&] { return inner_.link(fh, dir_fh, name); });
+}
+
+NfsStat3 FaultVfs::fsstat(const FileHandle& fh, uint64_t& total_bytes,
+                          uint64_t& free_bytes, uint64_t& avail_bytes,
+                          uint64_t& total_files, uint64_t& free_files,
+                          uint64_t& avail_files) {
+    return faulty(VfsOp::FSSTAT, &fh, 0, [&] {
+        return inner_.fsstat(fh, total_bytes, free_bytes, avail_bytes,
+                             total_files, free_files, avail_files);
+    });
+}
+
+NfsStat3 FaultVfs::fsinfo(const FileHandle& fh, uint32_t& rtmax, uint32_t& rtpref,
+                          uint32_t& wtmax, uint32_t& wtpref, uint32_t& dtpref,
+                          uint64_t& maxfilesize) {
+    return faulty(VfsOp::FSINFO, &fh, 0, [&] {
+        return inner_.fsinfo(fh, rtmax, rtpref, wtmax, wtpref, dtpref, maxfilesize);
+    });
+}
+
+NfsStat3 FaultVfs::pathconf(const FileHandle& fh, uint32_t& linkmax, uint32_t& name_max) {
+    return faulty(VfsOp::PATHCONF, &fh, 0, [&] { return inner_.pathconf(fh, linkmax, name_max); });
+}
+
+NfsStat3 FaultVfs::commit(const FileHandle& fh, uint64_t offset, uint32_t count) {
+    return faulty(VfsOp::COMMIT, &fh, 0, [&] { return inner_.commit(fh, offset, count); });
+}
+
+NfsStat3 FaultVfs::mknod(const FileHandle& dir_fh, const std::string& name, Ftype3 type,
+                         uint32_t mode, uint32_t rdev_major, uint32_t rdev_minor,
+                         FileHandle& out_fh, Fattr3& out_attr) {
+    return faulty(VfsOp::MKNOD, &dir_fh, 0, [&] {
+        return inner_.mknod(dir_fh, name, type, mode, rdev_major, rdev_minor, out_fh, out_attr);
+    });
+}
+
+NfsStat3 FaultVfs::get_root_fh(const std::string& path, FileHandle& fh) {
+    return faulty(VfsOp::GET_ROOT_FH, nullptr, 0, [&] { return inner_.get_root_fh(path, fh); });
+}
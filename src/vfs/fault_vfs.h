@@ -0,0 +1,155 @@
+#pragma once
+
+#include "vfs/vfs.h"
+#include "stats/metrics.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Vfs decorator that makes any backend behave like degraded storage: added
+// latency drawn from a distribution, rare long stalls, injected errors and
+// a bandwidth cap, chosen per operation and per handle or path prefix. For
+// tail-latency tests and benchmarks; the delays block the calling server
+// thread, as a slow disk would.
+
+enum class VfsOp : uint8_t {
+    GETATTR, SETATTR, LOOKUP, ACCESS, READ, WRITE, CREATE, MKDIR, REMOVE, RMDIR,
+    RENAME, READDIR, READLINK, SYMLINK, LINK, FSSTAT, FSINFO, PATHCONF, COMMIT,
+    MKNOD, GET_ROOT_FH, COUNT
+};
+constexpr size_t kVfsOps = static_cast<size_t>(VfsOp::COUNT);
+const char* vfs_op_name(VfsOp op);
+
+// Latency added to every matching call
+struct FaultLatency {
+    enum class Kind : uint8_t {
+        NONE,
+        FIXED,      // a
+        UNIFORM,    // between a and b
+        EXP,        // exponential with mean a
+        LOGNORMAL,  // median a, log-space standard deviation sigma
+    } kind = Kind::NONE;
+    uint64_t a_ns = 0;
+    uint64_t b_ns = 0;
+    double sigma = 0;
+};
+
+// One rule; the first rule matching a call applies to it.
+//
+// Spec syntax (parse()): comma-separated key=value pairs
+//   op=read+write        operations (vfs_op_name); default all
+//   prefix=/db           handles whose path is /db or below it
+//   fh=<hex>             only this handle
+//   latency=5ms | uniform:1ms:10ms | exp:2ms | lognormal:2ms:0.8
+//   stall=0.001:500ms    probability and length of an extra stall
+//   error=0.01:IO        probability and nfsstat3 (name without NFS3ERR_,
+//                        or number; default IO) of failing the call
+//   bw=50M               bytes/s shared by the rule's READs and WRITEs
+// Durations take ns, us, ms or s; bw takes K, M and G.
+struct FaultRule {
+    uint32_t ops = ~0u;  // bit per VfsOp
+    std::string prefix;
+    FileHandle fh;       // len 0: any handle
+    FaultLatency latency;
+    double stall_prob = 0;
+    uint64_t stall_ns = 0;
+    double error_prob = 0;
+    NfsStat3 error = NfsStat3::NFS3ERR_IO;
+    uint64_t bytes_per_sec = 0;
+
+    static bool parse(const std::string& spec, FaultRule& out, std::string& err);
+};
+
+class FaultVfs : public Vfs {
+public:
+    explicit FaultVfs(Vfs& inner, uint64_t seed = 1);
+    ~FaultVfs() override;
+
+    // Call before the server starts
+    void add_rule(const FaultRule& rule);
+    bool empty() const { return rules_.empty(); }
+
+    // Path of a handle for prefix rules (e.g. LocalFs::path_of, relative
+    // to the export); without one, prefix rules never match
+    void set_path_resolver(std::function<std::string(const FileHandle&)> fn) {
+        path_resolver_ = std::move(fn);
+    }
+
+    uint64_t delayed(VfsOp op) const { return stats_[static_cast<size_t>(op)].delayed.load(); }
+    uint64_t delay_ns(VfsOp op) const { return stats_[static_cast<size_t>(op)].delay_ns.load(); }
+    uint64_t errors(VfsOp op) const { return stats_[static_cast<size_t>(op)].errors.load(); }
+
+    // nfsd_vfs_fault_{delayed,errors}_total and
+    // nfsd_vfs_fault_delay_seconds_total by op
+    void register_metrics(MetricsRegistry& metrics);
+
+    NfsStat3 getattr(const FileHandle& fh, Fattr3& attr) override;
+    NfsStat3 setattr(const FileHandle& fh, uint32_t mode, uint32_t uid,
+                      uint32_t gid, uint64_t size,
+                      NfsTimeSet atime, NfsTimeSet mtime) override;
+    NfsStat3 lookup(const FileHandle& dir_fh, const std::string& name,
+                     FileHandle& out_fh, Fattr3& out_attr) override;
+    NfsStat3 access(const FileHandle& fh, uint32_t requested,
+                     uint32_t& granted) override;
+    NfsStat3 read(const FileHandle& fh, uint64_t offset, uint32_t count,
+                   std::vector<uint8_t>& data, bool& eof) override;
+    NfsStat3 write(const FileHandle& fh, uint64_t offset,
+                    const uint8_t* data, uint32_t count,
+                    uint32_t& written) override;
+    NfsStat3 create(const FileHandle& dir_fh, const std::string& name,
+                     uint32_t mode, FileHandle& out_fh, Fattr3& out_attr) override;
+    NfsStat3 mkdir(const FileHandle& dir_fh, const std::string& name,
+                    uint32_t mode, FileHandle& out_fh, Fattr3& out_attr) override;
+    NfsStat3 remove(const FileHandle& dir_fh, const std::string& name) override;
+    NfsStat3 rmdir(const FileHandle& dir_fh, const std::string& name) override;
+    NfsStat3 rename(const FileHandle& from_dir, const std::string& from_name,
+                     const FileHandle& to_dir, const std::string& to_name) override;
+    NfsStat3 readdir(const FileHandle& dir_fh, uint64_t cookie,
+                      uint32_t count, std::vector<DirEntry>& entries,
+                      bool& eof) override;
+    NfsStat3 readlink(const FileHandle& fh, std::string& target) override;
+    NfsStat3 symlink(const FileHandle& dir_fh, const std::string& name,
+                      const std::string& target, FileHandle& out_fh,
+                      Fattr3& out_attr) override;
+    NfsStat3 link(const FileHandle& fh, const FileHandle& dir_fh,
+                   const std::string& name) override;
+    NfsStat3 fsstat(const FileHandle& fh, uint64_t& total_bytes,
+                     uint64_t& free_bytes, uint64_t& avail_bytes,
+                     uint64_t& total_files, uint64_t& free_files,
+                     uint64_t& avail_files) override;
+    NfsStat3 fsinfo(const FileHandle& fh, uint32_t& rtmax, uint32_t& rtpref,
+                     uint32_t& wtmax, uint32_t& wtpref, uint32_t& dtpref,
+                     uint64_t& maxfilesize) override;
+    NfsStat3 pathconf(const FileHandle& fh, uint32_t& linkmax,
+                       uint32_t& name_max) override;
+    NfsStat3 commit(const FileHandle& fh, uint64_t offset,
+                     uint32_t count) override;
+    NfsStat3 mknod(const FileHandle& dir_fh, const std::string& name,
+                    Ftype3 type, uint32_t mode,
+                    uint32_t rdev_major, uint32_t rdev_minor,
+                    FileHandle& out_fh, Fattr3& out_attr) override;
+    NfsStat3 get_root_fh(const std::string& path, FileHandle& fh) override;
+
+private:
+    struct Rule;
+    struct OpStats {
+        std::atomic<uint64_t> delayed{0};
+        std::atomic<uint64_t> delay_ns{0};
+        std::atomic<uint64_t> errors{0};
+    };
+
+    // Delay the call as its rule says; false with st set if it is to fail
+    bool inject(VfsOp op, const FileHandle* fh, uint64_t bytes, NfsStat3& st);
+    template <typename F>
+    NfsStat3 faulty(VfsOp op, const FileHandle* fh, uint64_t bytes, F&& fn);
+
+    Vfs& inner_;
+    const uint64_t seed_;
+    std::vector<std::unique_ptr<Rule>> rules_;
+    std::function<std::string(const FileHandle&)> path_resolver_;
+    OpStats stats_[kVfsOps];
+};
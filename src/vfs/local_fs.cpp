@@ -5,6 +5,9 @@
 #include <cstring>
 #include <dirent.h>
 #include <fcntl.h>
+#include <algorithm>
+#include <memory>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/sysmacros.h>
@@ -13,29 +16,440 @@
 LocalFs::LocalFs(const std::string& export_root)
     : export_root_(export_root) {}
 
+LocalFs::~LocalFs() {
+    warm_stop_ = true;
+    wait_warm();
+    if (warm_map_) munmap(warm_map_, warm_map_len_);
+}
+
 FileHandle LocalFs::make_handle(ino_t inode, dev_t dev) {
-    FileHandle fh;
     // Encode inode and device into handle.
     // Use first 8 bytes for inode, next 8 for device.
-    fh.len = 16;
-    std::memcpy(fh.data, &inode, sizeof(inode));
-    std::memcpy(fh.data + 8, &dev, sizeof(dev));
-    return fh;
+    uint8_t data[16];
+    std::memcpy(data, &inode, sizeof(inode));
+    std::memcpy(data + 8, &dev, sizeof(dev));
+    return FileHandle(data, sizeof(data));
+}
+
+// An std::unordered_map node: a link ahead of the value, and about one
+// bucket pointer per entry
+static const size_t kCacheNodeBytes =
+    sizeof(std::pair<const FileHandle, std::pair<std::string, uint64_t>>) + 2 * sizeof(void*);
+
+// Heap use of one handle_to_path_ entry: the node, plus the path if it is
+// too long for the small-string buffer
+static size_t cache_entry_bytes(const std::string& path) {
+    static const size_t sso = std::string().capacity();
+    return kCacheNodeBytes + (path.capacity() > sso ? path.capacity() + 1 : 0);
+}
+
+// A directory read with getdents64(2) rather than readdir(3), so that
+// Syscall::READDIR counts the kernel's buffer refills (one per buffer of
+// entries) instead of entries.
+namespace {
+class DirEntries {
+public:
+    explicit DirEntries(const std::string& path)
+        : fd_(::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) {}
+    ~DirEntries() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+    DirEntries(const DirEntries&) = delete;
+    DirEntries& operator=(const DirEntries&) = delete;
+
+    bool ok() const { return fd_ >= 0; }
+
+    // Next entry, nullptr at the end or on a read error. Calls on_refill()
+    // before each getdents64 call.
+    template <typename F>
+    const struct dirent64* next(F&& on_refill) {
+        if (pos_ >= len_) {
+            if (done_) return nullptr;
+            if (!buf_) buf_.reset(new char[kBufBytes]);
+            on_refill();
+            ssize_t n = ::getdents64(fd_, buf_.get(), kBufBytes);
+            pos_ = 0;
+            len_ = n > 0 ? static_cast<size_t>(n) : 0;
+            if (n <= 0) {
+                done_ = true;
+                return nullptr;
+            }
+        }
+        auto* ent = reinterpret_cast<const struct dirent64*>(buf_.get() + pos_);
+        pos_ += ent->d_reclen;
+        return ent;
+    }
+
+private:
+    static constexpr size_t kBufBytes = 32768;  // what glibc's readdir uses
+
+    int fd_;
+    std::unique_ptr<char[]> buf_;
+    size_t pos_ = 0;
+    size_t len_ = 0;
+    bool done_ = false;
+};
+}  // namespace
+
+void LocalFs::set_path_locked(const FileHandle& fh, const std::string& path) {
+    auto res = handle_to_path_.emplace(fh, CacheEntry());
+    if (!res.second) cache_bytes_ -= cache_entry_bytes(res.first->second.path);
+    res.first->second.path = path;
+    cache_bytes_ += cache_entry_bytes(res.first->second.path);
+}
+
+void LocalFs::forget_locked(const FileHandle& fh) {
+    auto it = handle_to_path_.find(fh);
+    if (it == handle_to_path_.end()) return;
+    cache_bytes_ -= cache_entry_bytes(it->second.path);
+    handle_to_path_.erase(it);
 }
 
 void LocalFs::cache_path(const FileHandle& fh, const std::string& path) {
-    std::lock_guard<std::mutex> lock(mu_);
-    handle_to_path_[fh] = path;
+    std::lock_guard<ProfiledMutex> lock(mu_);
+    set_path_locked(fh, path);
+}
+
+std::string LocalFs::path_of(const FileHandle& fh) {
+    std::lock_guard<ProfiledMutex> lock(mu_);
+    auto it = handle_to_path_.find(fh);
+    return it != handle_to_path_.end() ? it->second.path : std::string();
 }
 
 std::string LocalFs::resolve_path(const FileHandle& fh) {
-    std::lock_guard<std::mutex> lock(mu_);
+    std::unique_lock<ProfiledMutex> lock(mu_);
     auto it = handle_to_path_.find(fh);
-    if (it != handle_to_path_.end())
-        return it->second;
+    if (it != handle_to_path_.end()) {
+        it->second.hits++;
+        cache_hits_.fetch_add(1, std::memory_order_relaxed);
+        return it->second.path;
+    }
+    // A handle from before the restart, ahead of the warm-up threads
+    auto w = warm_index_.find(fh);
+    if (w != warm_index_.end()) {
+        const WarmRecord& r = warm_records_[w->second];
+        std::string path = export_root_ + std::string(r.path, r.path_len);
+        uint64_t hits = r.hits / 2 + 1;
+        warm_index_.erase(w);
+        lock.unlock();
+        if (warm_adopt(fh, path, hits)) {
+            cache_hits_.fetch_add(1, std::memory_order_relaxed);
+            return path;
+        }
+    }
+    cache_misses_.fetch_add(1, std::memory_order_relaxed);
     return "";
 }
 
+const char* LocalFs::syscall_name(Syscall s) {
+    static const char* const names[kSyscalls] = {
+        "stat", "open", "close", "read", "write", "fsync", "opendir", "readdir", "mkdir",
+        "rmdir", "unlink", "rename", "link", "symlink", "readlink", "mknod", "setattr",
+        "statfs"};
+    size_t i = static_cast<size_t>(s);
+    return i < kSyscalls ? names[i] : "unknown";
+}
+
+LocalFs::CacheFootprint LocalFs::cache_footprint() {
+    std::lock_guard<ProfiledMutex> lock(mu_);
+    CacheFootprint fp;
+    fp.entries = handle_to_path_.size();
+    for (const auto& kv : handle_to_path_) fp.bytes += cache_entry_bytes(kv.second.path);
+    return fp;
+}
+
+uint64_t LocalFs::trim_cache(uint64_t bytes) {
+    std::lock_guard<ProfiledMutex> lock(mu_);
+    std::vector<std::pair<uint64_t, const FileHandle*>> by_hits;
+    by_hits.reserve(handle_to_path_.size());
+    for (auto& kv : handle_to_path_) {
+        // The export root, as export_root_ or with a trailing slash
+        if (kv.second.path.size() > export_root_.size() + 1)
+            by_hits.emplace_back(kv.second.hits, &kv.first);
+        kv.second.hits /= 2;
+    }
+    std::sort(by_hits.begin(), by_hits.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    uint64_t freed = 0;
+    uint64_t evicted = 0;
+    for (const auto& [hits, fh] : by_hits) {
+        if (freed >= bytes) break;
+        freed += cache_entry_bytes(handle_to_path_.find(*fh)->second.path);
+        forget_locked(*fh);
+        evicted++;
+    }
+    cache_evictions_.fetch_add(evicted, std::memory_order_relaxed);
+    return freed;
+}
+
+// Snapshot file: a header, then one record per entry, hottest first, in
+// host byte order (a snapshot is only read back by the same host):
+//   char magic[8] "NFSDWARM", uint32 version, uint32 count
+//   uint8 fh_len, fh_len bytes, uint64 hits, uint16 path_len, path_len bytes
+// Paths are relative to the export root.
+static const char kWarmMagic[8] = {'N', 'F', 'S', 'D', 'W', 'A', 'R', 'M'};
+static const uint32_t kWarmVersion = 1;
+static const size_t kWarmHeaderBytes = 16;
+
+template <typename T>
+static void put(std::string& out, T v) {
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+std::string LocalFs::encode_snapshot(size_t max_entries) {
+    struct Saved {
+        FileHandle fh;
+        std::string rel;
+        uint64_t hits;
+    };
+    std::vector<Saved> saved;
+    {
+        std::lock_guard<ProfiledMutex> lock(mu_);
+        saved.reserve(handle_to_path_.size() + warm_index_.size());
+        for (const auto& kv : handle_to_path_) {
+            const std::string& p = kv.second.path;
+            if (p.compare(0, export_root_.size(), export_root_) != 0) continue;
+            saved.push_back({kv.first, p.substr(export_root_.size()), kv.second.hits});
+        }
+        // Entries of the last snapshot nobody has asked for yet are still
+        // worth keeping if shutdown comes before the warm-up finishes
+        for (const auto& kv : warm_index_) {
+            const WarmRecord& r = warm_records_[kv.second];
+            saved.push_back({kv.first, std::string(r.path, r.path_len), r.hits});
+        }
+    }
+    auto hotter = [](const Saved& a, const Saved& b) { return a.hits > b.hits; };
+    if (saved.size() > max_entries) {
+        std::partial_sort(saved.begin(), saved.begin() + max_entries, saved.end(), hotter);
+        saved.resize(max_entries);
+    } else {
+        std::sort(saved.begin(), saved.end(), hotter);
+    }
+
+    std::string out(kWarmMagic, sizeof(kWarmMagic));
+    put(out, kWarmVersion);
+    uint32_t count = 0;
+    put(out, count);
+    for (const auto& e : saved) {
+        if (e.rel.size() > UINT16_MAX) continue;
+        put(out, static_cast<uint8_t>(e.fh.size()));
+        out.append(reinterpret_cast<const char*>(e.fh.data()), e.fh.size());
+        put(out, e.hits);
+        put(out, static_cast<uint16_t>(e.rel.size()));
+        out += e.rel;
+        count++;
+    }
+    std::memcpy(&out[12], &count, sizeof(count));
+    return out;
+}
+
+bool LocalFs::save_snapshot(const std::string& path, size_t max_entries, std::string& err) {
+    const std::string out = encode_snapshot(max_entries);
+    // Written aside and renamed, so a crash mid-write leaves the last
+    // snapshot rather than a torn one
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        err = tmp + ": " + std::strerror(errno);
+        return false;
+    }
+    size_t off = 0;
+    while (off < out.size()) {
+        ssize_t n = ::write(fd, out.data() + off, out.size() - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += static_cast<size_t>(n);
+    }
+    bool ok = off == out.size() && fsync(fd) == 0;
+    if (!ok) err = tmp + ": " + std::strerror(errno);
+    ::close(fd);
+    if (ok && ::rename(tmp.c_str(), path.c_str()) != 0) {
+        err = path + ": " + std::strerror(errno);
+        ok = false;
+    }
+    if (!ok) unlink(tmp.c_str());
+    return ok;
+}
+
+bool LocalFs::load_snapshot(const std::string& path, unsigned threads, std::string& err) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        err = path + ": " + std::strerror(errno);
+        return false;
+    }
+    bool ok = load_snapshot_fd(fd, threads, err);
+    ::close(fd);
+    if (!ok) err = path + ": " + err;
+    return ok;
+}
+
+bool LocalFs::load_snapshot_fd(int fd, unsigned threads, std::string& err) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < kWarmHeaderBytes) {
+        err = "not a snapshot";
+        return false;
+    }
+    size_t len = static_cast<size_t>(st.st_size);
+    void* map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        err = std::strerror(errno);
+        return false;
+    }
+    // Read ahead: the records are walked front to back
+    madvise(map, len, MADV_WILLNEED);
+
+    const char* p = static_cast<const char*>(map);
+    const char* end = p + len;
+    uint32_t version, count;
+    std::memcpy(&version, p + 8, sizeof(version));
+    std::memcpy(&count, p + 12, sizeof(count));
+    if (std::memcmp(p, kWarmMagic, sizeof(kWarmMagic)) != 0 || version != kWarmVersion) {
+        munmap(map, len);
+        err = "not a snapshot";
+        return false;
+    }
+    p += kWarmHeaderBytes;
+
+    std::vector<WarmRecord> records;
+    records.reserve(std::min<size_t>(count, len / 16));
+    for (uint32_t i = 0; i < count; i++) {
+        WarmRecord r;
+        uint8_t fh_len;
+        uint16_t path_len;
+        if (end - p < 1) break;
+        fh_len = static_cast<uint8_t>(*p++);
+        if (fh_len > FileHandle::kMaxSize || static_cast<size_t>(end - p) < fh_len + 10u) break;
+        r.fh = FileHandle(p, fh_len);
+        p += fh_len;
+        std::memcpy(&r.hits, p, sizeof(r.hits));
+        std::memcpy(&path_len, p + 8, sizeof(path_len));
+        p += 10;
+        if (static_cast<size_t>(end - p) < path_len) break;
+        r.path = p;
+        r.path_len = path_len;
+        p += path_len;
+        records.push_back(r);
+    }
+    if (records.size() != count) {
+        munmap(map, len);
+        err = "truncated snapshot";
+        return false;
+    }
+
+    {
+        std::lock_guard<ProfiledMutex> lock(mu_);
+        warm_map_ = map;
+        warm_map_len_ = len;
+        warm_records_ = std::move(records);
+        warm_entries_ = warm_records_.size();
+        for (size_t i = 0; i < warm_records_.size(); i++)
+            warm_index_.emplace(warm_records_[i].fh, i);
+    }
+    warm_running_ = threads;
+    for (unsigned i = 0; i < threads; i++) warm_threads_.emplace_back([this] { warm_worker(); });
+    return true;
+}
+
+bool LocalFs::warm_adopt(const FileHandle& fh, const std::string& path, uint64_t hits) {
+    struct stat st;
+    count_syscall(Syscall::STAT);
+    if (lstat(path.c_str(), &st) != 0 || !(make_handle(st.st_ino, st.st_dev) == fh)) {
+        // Removed, or the name now belongs to another file: the handle
+        // stays STALE, as it would have without the snapshot
+        warm_stale_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    {
+        std::lock_guard<ProfiledMutex> lock(mu_);
+        // A lookup since startup knows better
+        if (handle_to_path_.find(fh) == handle_to_path_.end()) {
+            set_path_locked(fh, path);
+            handle_to_path_[fh].hits = hits;
+        }
+    }
+    warm_loaded_.fetch_add(1, std::memory_order_relaxed);
+    if (!S_ISDIR(st.st_mode)) return true;
+
+    // Pull the directory's blocks and dentries into the kernel's caches
+    // ahead of the clients' READDIRs and LOOKUPs
+    count_syscall(Syscall::OPENDIR);
+    DirEntries dir(path);
+    if (dir.ok()) {
+        while (dir.next([this] { count_syscall(Syscall::READDIR); }) != nullptr) {
+        }
+        warm_prefetched_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+void LocalFs::warm_worker() {
+    for (size_t i; !warm_stop_ && (i = warm_next_.fetch_add(1)) < warm_records_.size();) {
+        const WarmRecord& r = warm_records_[i];
+        {
+            std::lock_guard<ProfiledMutex> lock(mu_);
+            auto it = warm_index_.find(r.fh);
+            // Already claimed by a client's call
+            if (it == warm_index_.end() || it->second != i) continue;
+            warm_index_.erase(it);
+        }
+        // Counts decay by half each restart, so last week's hot set does
+        // not outrank today's
+        warm_adopt(r.fh, export_root_ + std::string(r.path, r.path_len), r.hits / 2);
+    }
+    if (warm_running_.fetch_sub(1) != 1) return;
+    // Last one out: nothing points into the mapping any more
+    std::lock_guard<ProfiledMutex> lock(mu_);
+    warm_index_.clear();
+    warm_records_.clear();
+    warm_records_.shrink_to_fit();
+    munmap(warm_map_, warm_map_len_);
+    warm_map_ = nullptr;
+}
+
+void LocalFs::wait_warm() {
+    for (auto& t : warm_threads_) t.join();
+    warm_threads_.clear();
+}
+
+size_t LocalFs::warm_pending() {
+    std::lock_guard<ProfiledMutex> lock(mu_);
+    return warm_index_.size();
+}
+
+void LocalFs::register_metrics(MetricsRegistry& metrics) {
+    metrics.counter("nfsd_fh_cache_lookups_total", "File handle to path cache lookups",
+                    {{"result", "hit"}},
+                    [this] { return cache_hits_.load(std::memory_order_relaxed); });
+    metrics.counter("nfsd_fh_cache_lookups_total", "File handle to path cache lookups",
+                    {{"result", "miss"}},
+                    [this] { return cache_misses_.load(std::memory_order_relaxed); });
+    metrics.counter("nfsd_fh_cache_evictions_total",
+                    "File handle to path entries dropped to give memory back", {},
+                    [this] { return cache_evictions(); });
+    metrics.gauge("nfsd_fh_cache_entries", "Cached file handle to path entries", {},
+                  [this] {
+                      std::lock_guard<ProfiledMutex> lock(mu_);
+                      return static_cast<double>(handle_to_path_.size());
+                  });
+    for (size_t i = 0; i < kSyscalls; i++) {
+        Syscall s = static_cast<Syscall>(i);
+        metrics.counter("nfsd_vfs_syscalls_total",
+                        "System calls made on the export (readdir: getdents64 buffer refills)",
+                        {{"call", syscall_name(s)}}, [this, s] { return syscalls(s); });
+    }
+    metrics.counter("nfsd_warm_entries_total", "Warm restart snapshot entries checked",
+                    {{"result", "loaded"}}, [this] { return warm_loaded(); });
+    metrics.counter("nfsd_warm_entries_total", "Warm restart snapshot entries checked",
+                    {{"result", "stale"}}, [this] { return warm_stale(); });
+    metrics.counter("nfsd_warm_prefetched_dirs_total",
+                    "Directories read ahead from the warm restart snapshot", {},
+                    [this] { return warm_prefetched(); });
+    metrics.gauge("nfsd_warm_pending", "Warm restart snapshot entries not checked yet", {},
+                  [this] { return static_cast<double>(warm_pending()); });
+    mu_.register_metrics(metrics);
+}
+
 NfsStat3 LocalFs::errno_to_nfsstat() {
     switch (errno) {
         case EPERM:       return NfsStat3::NFS3ERR_PERM;
@@ -101,6 +515,7 @@ Fattr3 LocalFs::stat_to_fattr(const struct stat& st) {
 NfsStat3 LocalFs::get_root_fh(const std::string& path, FileHandle& fh) {
     std::string full = export_root_ + path;
     struct stat st;
+    count_syscall(Syscall::STAT);
     if (lstat(full.c_str(), &st) != 0)
         return errno_to_nfsstat();
     fh = make_handle(st.st_ino, st.st_dev);
@@ -112,6 +527,7 @@ NfsStat3 LocalFs::getattr(const FileHandle& fh, Fattr3& attr) {
     std::string path = resolve_path(fh);
     if (path.empty()) return NfsStat3::NFS3ERR_STALE;
     struct stat st;
+    count_syscall(Syscall::STAT);
     if (lstat(path.c_str(), &st) != 0) return errno_to_nfsstat();
     attr = stat_to_fattr(st);
     return NfsStat3::NFS3_OK;
@@ -123,15 +539,20 @@ NfsStat3 LocalFs::setattr(const FileHandle& fh, uint32_t mode, uint32_t uid,
     std::string path = resolve_path(fh);
     if (path.empty()) return NfsStat3::NFS3ERR_STALE;
 
-    if (mode != UINT32_MAX)
+    if (mode != UINT32_MAX) {
+        count_syscall(Syscall::SETATTR);
         if (chmod(path.c_str(), mode) != 0) return errno_to_nfsstat();
+    }
     if (uid != UINT32_MAX || gid != UINT32_MAX) {
         uid_t u = (uid != UINT32_MAX) ? uid : static_cast<uid_t>(-1);
         gid_t g = (gid != UINT32_MAX) ? gid : static_cast<gid_t>(-1);
+        count_syscall(Syscall::SETATTR);
         if (lchown(path.c_str(), u, g) != 0) return errno_to_nfsstat();
     }
-    if (size != UINT64_MAX)
+    if (size != UINT64_MAX) {
+        count_syscall(Syscall::SETATTR);
         if (truncate(path.c_str(), size) != 0) return errno_to_nfsstat();
+    }
 
     if (atime.how != NfsTimeSet::How::DONT_CHANGE ||
         mtime.how != NfsTimeSet::How::DONT_CHANGE) {
@@ -156,6 +577,7 @@ NfsStat3 LocalFs::setattr(const FileHandle& fh, uint32_t mode, uint32_t uid,
             times[1].tv_sec = mtime.time.seconds;
             times[1].tv_nsec = mtime.time.nseconds;
         }
+        count_syscall(Syscall::SETATTR);
         if (utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0)
             return errno_to_nfsstat();
     }
@@ -170,6 +592,7 @@ NfsStat3 LocalFs::lookup(const FileHandle& dir_fh, const std::string& name,
 
     std::string full = dir_path + "/" + name;
     struct stat st;
+    count_syscall(Syscall::STAT);
     if (lstat(full.c_str(), &st) != 0)
         return errno_to_nfsstat();
 
@@ -188,6 +611,7 @@ NfsStat3 LocalFs::access(const FileHandle& fh, uint32_t requested,
     if (path.empty()) return NfsStat3::NFS3ERR_STALE;
 
     struct stat st;
+    count_syscall(Syscall::STAT);
     if (lstat(path.c_str(), &st) != 0) return errno_to_nfsstat();
 
     // Check permission bits. Running as root so check all bits.
@@ -216,11 +640,14 @@ NfsStat3 LocalFs::read(const FileHandle& fh, uint64_t offset, uint32_t count,
     std::string path = resolve_path(fh);
     if (path.empty()) return NfsStat3::NFS3ERR_STALE;
 
+    count_syscall(Syscall::OPEN);
     int fd = open(path.c_str(), O_RDONLY);
     if (fd < 0) return errno_to_nfsstat();
 
     data.resize(count);
+    count_syscall(Syscall::READ);
     ssize_t n = pread(fd, data.data(), count, offset);
+    count_syscall(Syscall::CLOSE);
     close(fd);
 
     if (n < 0) return errno_to_nfsstat();
@@ -235,10 +662,13 @@ NfsStat3 LocalFs::write(const FileHandle& fh, uint64_t offset,
     std::string path = resolve_path(fh);
     if (path.empty()) return NfsStat3::NFS3ERR_STALE;
 
+    count_syscall(Syscall::OPEN);
     int fd = open(path.c_str(), O_WRONLY);
     if (fd < 0) return errno_to_nfsstat();
 
+    count_syscall(Syscall::WRITE);
     ssize_t n = pwrite(fd, wdata, count, offset);
+    count_syscall(Syscall::CLOSE);
     close(fd);
 
     if (n < 0) return errno_to_nfsstat();
@@ -252,11 +682,14 @@ NfsStat3 LocalFs::create(const FileHandle& dir_fh, const std::string& name,
     if (dir_path.empty()) return NfsStat3::NFS3ERR_STALE;
 
     std::string full = dir_path + "/" + name;
+    count_syscall(Syscall::OPEN);
     int fd = open(full.c_str(), O_CREAT | O_WRONLY | O_TRUNC, mode);
     if (fd < 0) return errno_to_nfsstat();
 
     struct stat st;
+    count_syscall(Syscall::STAT);
     fstat(fd, &st);
+    count_syscall(Syscall::CLOSE);
     close(fd);
 
     out_fh = make_handle(st.st_ino, st.st_dev);
@@ -271,10 +704,12 @@ NfsStat3 LocalFs::mkdir(const FileHandle& dir_fh, const std::string& name,
     if (dir_path.empty()) return NfsStat3::NFS3ERR_STALE;
 
     std::string full = dir_path + "/" + name;
+    count_syscall(Syscall::MKDIR);
     if (::mkdir(full.c_str(), mode) != 0)
         return errno_to_nfsstat();
 
     struct stat st;
+    count_syscall(Syscall::STAT);
     if (lstat(full.c_str(), &st) != 0) return errno_to_nfsstat();
 
     out_fh = make_handle(st.st_ino, st.st_dev);
@@ -292,9 +727,11 @@ NfsStat3 LocalFs::remove(const FileHandle& dir_fh, const std::string& name) {
     // Get handle before removing so we can evict from cache
     struct stat st;
     FileHandle victim_fh;
+    count_syscall(Syscall::STAT);
     bool have_victim = (lstat(full.c_str(), &st) == 0);
     if (have_victim) victim_fh = make_handle(st.st_ino, st.st_dev);
 
+    count_syscall(Syscall::UNLINK);
     if (unlink(full.c_str()) != 0) return errno_to_nfsstat();
 
     // Only evict the handle from cache when this was the last hard link
@@ -302,8 +739,8 @@ NfsStat3 LocalFs::remove(const FileHandle& dir_fh, const std::string& name) {
     // If nlink > 1, the inode survives under another name; keep the cached
     // path so existing file handles remain valid (RFC 1813 §2.5).
     if (have_victim && st.st_nlink == 1) {
-        std::lock_guard<std::mutex> lock(mu_);
-        handle_to_path_.erase(victim_fh);
+        std::lock_guard<ProfiledMutex> lock(mu_);
+        forget_locked(victim_fh);
     }
     return NfsStat3::NFS3_OK;
 }
@@ -317,14 +754,16 @@ NfsStat3 LocalFs::rmdir(const FileHandle& dir_fh, const std::string& name) {
     // Get handle before removing so we can evict from cache
     struct stat st;
     FileHandle victim_fh;
+    count_syscall(Syscall::STAT);
     bool have_victim = (lstat(full.c_str(), &st) == 0);
     if (have_victim) victim_fh = make_handle(st.st_ino, st.st_dev);
 
+    count_syscall(Syscall::RMDIR);
     if (::rmdir(full.c_str()) != 0) return errno_to_nfsstat();
 
     if (have_victim) {
-        std::lock_guard<std::mutex> lock(mu_);
-        handle_to_path_.erase(victim_fh);
+        std::lock_guard<ProfiledMutex> lock(mu_);
+        forget_locked(victim_fh);
     }
     return NfsStat3::NFS3_OK;
 }
@@ -340,15 +779,17 @@ NfsStat3 LocalFs::rename(const FileHandle& from_dir, const std::string& from_nam
 
     // Capture inode before rename (inode survives rename)
     struct stat st;
+    count_syscall(Syscall::STAT);
     bool have_stat = (lstat(from.c_str(), &st) == 0);
     FileHandle moved_fh;
     if (have_stat) moved_fh = make_handle(st.st_ino, st.st_dev);
 
+    count_syscall(Syscall::RENAME);
     if (::rename(from.c_str(), to.c_str()) != 0) return errno_to_nfsstat();
 
     if (have_stat) {
-        std::lock_guard<std::mutex> lock(mu_);
-        handle_to_path_[moved_fh] = to;
+        std::lock_guard<ProfiledMutex> lock(mu_);
+        set_path_locked(moved_fh, to);
     }
     return NfsStat3::NFS3_OK;
 }
@@ -359,14 +800,16 @@ NfsStat3 LocalFs::readdir(const FileHandle& dir_fh, uint64_t cookie,
     std::string dir_path = resolve_path(dir_fh);
     if (dir_path.empty()) return NfsStat3::NFS3ERR_STALE;
 
-    DIR* dir = opendir(dir_path.c_str());
-    if (!dir) return errno_to_nfsstat();
+    count_syscall(Syscall::OPENDIR);
+    DirEntries dir(dir_path);
+    if (!dir.ok()) return errno_to_nfsstat();
 
+    auto refill = [this] { count_syscall(Syscall::READDIR); };
     uint64_t idx = 0;
-    struct dirent* ent;
+    const struct dirent64* ent;
     entries.clear();
 
-    while ((ent = ::readdir(dir)) != nullptr) {
+    while ((ent = dir.next(refill)) != nullptr) {
         idx++;
         if (idx <= cookie) continue;
         if (entries.size() >= count) break;
@@ -384,14 +827,14 @@ NfsStat3 LocalFs::readdir(const FileHandle& dir_fh, uint64_t cookie,
             continue;
         std::string full = dir_path + "/" + dname;
         struct stat st;
+        count_syscall(Syscall::STAT);
         if (lstat(full.c_str(), &st) == 0) {
             auto fh = make_handle(st.st_ino, st.st_dev);
             cache_path(fh, full);
         }
     }
 
-    eof = (::readdir(dir) == nullptr);
-    closedir(dir);
+    eof = dir.next(refill) == nullptr;
     return NfsStat3::NFS3_OK;
 }
 
@@ -400,6 +843,7 @@ NfsStat3 LocalFs::readlink(const FileHandle& fh, std::string& target) {
     if (path.empty()) return NfsStat3::NFS3ERR_STALE;
 
     char buf[4096];
+    count_syscall(Syscall::READLINK);
     ssize_t n = ::readlink(path.c_str(), buf, sizeof(buf) - 1);
     if (n < 0) return errno_to_nfsstat();
     buf[n] = '\0';
@@ -414,10 +858,12 @@ NfsStat3 LocalFs::symlink(const FileHandle& dir_fh, const std::string& name,
     if (dir_path.empty()) return NfsStat3::NFS3ERR_STALE;
 
     std::string full = dir_path + "/" + name;
+    count_syscall(Syscall::SYMLINK);
     if (::symlink(target.c_str(), full.c_str()) != 0)
         return errno_to_nfsstat();
 
     struct stat st;
+    count_syscall(Syscall::STAT);
     if (lstat(full.c_str(), &st) != 0) return errno_to_nfsstat();
     out_fh = make_handle(st.st_ino, st.st_dev);
     cache_path(out_fh, full);
@@ -432,6 +878,7 @@ NfsStat3 LocalFs::link(const FileHandle& fh, const FileHandle& dir_fh,
     if (src_path.empty() || dir_path.empty()) return NfsStat3::NFS3ERR_STALE;
 
     std::string full = dir_path + "/" + name;
+    count_syscall(Syscall::LINK);
     if (::link(src_path.c_str(), full.c_str()) != 0) return errno_to_nfsstat();
     return NfsStat3::NFS3_OK;
 }
@@ -444,6 +891,7 @@ NfsStat3 LocalFs::fsstat(const FileHandle& fh, uint64_t& total_bytes,
     if (path.empty()) return NfsStat3::NFS3ERR_STALE;
 
     struct statvfs sv;
+    count_syscall(Syscall::STATFS);
     if (statvfs(path.c_str(), &sv) != 0) return errno_to_nfsstat();
 
     total_bytes = sv.f_blocks * sv.f_frsize;
@@ -478,9 +926,12 @@ NfsStat3 LocalFs::commit(const FileHandle& fh, uint64_t /*offset*/, uint32_t /*c
     std::string path = resolve_path(fh);
     if (path.empty()) return NfsStat3::NFS3ERR_STALE;
 
+    count_syscall(Syscall::OPEN);
     int fd = open(path.c_str(), O_RDONLY);
     if (fd < 0) return errno_to_nfsstat();
+    count_syscall(Syscall::FSYNC);
     fsync(fd);
+    count_syscall(Syscall::CLOSE);
     close(fd);
     return NfsStat3::NFS3_OK;
 }
@@ -515,10 +966,12 @@ NfsStat3 LocalFs::mknod(const FileHandle& dir_fh, const std::string& name,
             return NfsStat3::NFS3ERR_INVAL;
     }
 
+    count_syscall(Syscall::MKNOD);
     if (::mknod(full.c_str(), dev_mode, dev) != 0)
         return errno_to_nfsstat();
 
     struct stat st;
+    count_syscall(Syscall::STAT);
     if (lstat(full.c_str(), &st) != 0) return errno_to_nfsstat();
 
     out_fh = make_handle(st.st_ino, st.st_dev);
@@ -1,15 +1,21 @@
 #pragma once
 
 #include "vfs/vfs.h"
-#include <map>
+#include "stats/metrics.h"
+#include "stats/profiled_mutex.h"
+#include <atomic>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 // Local filesystem passthrough VFS implementation.
 // File handles encode the inode + device to uniquely identify files.
 class LocalFs : public Vfs {
 public:
     explicit LocalFs(const std::string& export_root);
+    ~LocalFs() override;
 
     NfsStat3 getattr(const FileHandle& fh, Fattr3& attr) override;
     NfsStat3 setattr(const FileHandle& fh, uint32_t mode, uint32_t uid,
@@ -58,15 +64,126 @@ public:
                     FileHandle& out_fh, Fattr3& out_attr) override;
     NfsStat3 get_root_fh(const std::string& path, FileHandle& fh) override;
 
+    // Cached path of a handle, empty if unknown. For diagnostics: does not
+    // count as a cache lookup.
+    std::string path_of(const FileHandle& fh);
+
+    // System calls made on the export, by kind. READDIR counts getdents64
+    // calls, each of which refills a buffer of many entries.
+    enum class Syscall : uint8_t {
+        STAT, OPEN, CLOSE, READ, WRITE, FSYNC, OPENDIR, READDIR, MKDIR, RMDIR, UNLINK,
+        RENAME, LINK, SYMLINK, READLINK, MKNOD, SETATTR, STATFS, COUNT
+    };
+    static constexpr size_t kSyscalls = static_cast<size_t>(Syscall::COUNT);
+    static const char* syscall_name(Syscall s);
+    uint64_t syscalls(Syscall s) const {
+        return syscalls_[static_cast<size_t>(s)].load(std::memory_order_relaxed);
+    }
+
+    // handle_to_path_ entries and an estimate of their heap use (nodes plus
+    // paths too long for the small-string buffer). Walks the cache.
+    struct CacheFootprint {
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+    CacheFootprint cache_footprint();
+    // The same byte estimate, kept up to date as entries change
+    uint64_t cache_bytes() const { return cache_bytes_.load(std::memory_order_relaxed); }
+    // Drop the least resolved entries until about bytes are freed, and
+    // halve the survivors' counts so old hits fade; returns the bytes
+    // freed. The export root stays. A client holding a dropped handle gets
+    // NFS3ERR_STALE and looks the name up again, as after a restart.
+    uint64_t trim_cache(uint64_t bytes);
+    uint64_t cache_evictions() const { return cache_evictions_.load(std::memory_order_relaxed); }
+
+    // Warm restart. Handles are inode + device, so they outlive the server,
+    // but handle_to_path_ does not: after a restart every handle a client
+    // holds is STALE until the client looks it up again, and the kernel's
+    // dentry, inode and directory caches are cold.
+    //
+    // save_snapshot() writes the hottest max_entries entries (most resolved
+    // first) to path, through a temporary file renamed into place. Each
+    // record is the handle, its resolve count and its path below the export.
+    bool save_snapshot(const std::string& path, size_t max_entries, std::string& err);
+    // The file's contents
+    std::string encode_snapshot(size_t max_entries);
+    // Map a snapshot and adopt its entries: threads background threads lstat
+    // each path, hottest first, keep the entries whose inode and device still
+    // match the handle, and read the directories through to warm the kernel's
+    // caches. A handle resolved before its turn is checked on the spot, so
+    // old handles work at once; with no threads that is all that happens.
+    // Call before serving, at most once.
+    bool load_snapshot(const std::string& path, unsigned threads, std::string& err);
+    // The same from an open file (a memfd, in a binary upgrade); the
+    // caller keeps fd
+    bool load_snapshot_fd(int fd, unsigned threads, std::string& err);
+    // Block until the background threads are done
+    void wait_warm();
+    // Entries in the loaded snapshot, and those not checked yet
+    size_t warm_entries() const { return warm_entries_; }
+    size_t warm_pending();
+    uint64_t warm_loaded() const { return warm_loaded_.load(std::memory_order_relaxed); }
+    uint64_t warm_stale() const { return warm_stale_.load(std::memory_order_relaxed); }
+    uint64_t warm_prefetched() const { return warm_prefetched_.load(std::memory_order_relaxed); }
+
+    // Export handle-cache hit/miss counters and size, syscall counters and
+    // warm restart progress
+    void register_metrics(MetricsRegistry& metrics);
+
 private:
     // Map inode -> path for handle resolution.
     FileHandle make_handle(ino_t inode, dev_t dev);
     std::string resolve_path(const FileHandle& fh);
     void cache_path(const FileHandle& fh, const std::string& path);
+    // Add, replace or drop an entry, keeping cache_bytes_; mu_ held
+    void set_path_locked(const FileHandle& fh, const std::string& path);
+    void forget_locked(const FileHandle& fh);
+    // Adopt a snapshot entry if the path still names the handle's file;
+    // true if it does
+    bool warm_adopt(const FileHandle& fh, const std::string& path, uint64_t hits);
+    void warm_worker();
     Fattr3 stat_to_fattr(const struct stat& st);
     NfsStat3 errno_to_nfsstat();
+    void count_syscall(Syscall s) {
+        syscalls_[static_cast<size_t>(s)].fetch_add(1, std::memory_order_relaxed);
+    }
 
     std::string export_root_;
-    std::mutex mu_;
-    std::map<FileHandle, std::string> handle_to_path_;
+    ProfiledMutex mu_{"localfs"};
+    // hits: resolve_path() calls, which rank entries for the snapshot
+    struct CacheEntry {
+        std::string path;
+        uint64_t hits = 0;
+    };
+    std::unordered_map<FileHandle, CacheEntry> handle_to_path_;
+    std::atomic<uint64_t> cache_bytes_{0};  // written under mu_
+
+    // The loaded snapshot. warm_records_ point into the mapping, which is
+    // unmapped when the last background thread finishes; warm_index_ holds
+    // the records nobody has claimed yet, and is cleared first.
+    struct WarmRecord {
+        FileHandle fh;
+        const char* path;
+        size_t path_len;
+        uint64_t hits;
+    };
+    void* warm_map_ = nullptr;
+    size_t warm_map_len_ = 0;
+    std::vector<WarmRecord> warm_records_;
+    std::unordered_map<FileHandle, size_t> warm_index_;  // guarded by mu_
+    size_t warm_entries_ = 0;
+    std::atomic<size_t> warm_next_{0};
+    std::atomic<unsigned> warm_running_{0};
+    std::atomic<bool> warm_stop_{false};
+    std::vector<std::thread> warm_threads_;
+    std::atomic<uint64_t> warm_loaded_{0};
+    std::atomic<uint64_t> warm_stale_{0};
+    std::atomic<uint64_t> warm_prefetched_{0};
+
+    // A miss means the handle is unknown: the caller answers NFS3ERR_STALE
+    std::atomic<uint64_t> cache_hits_{0};
+    std::atomic<uint64_t> cache_misses_{0};
+    std::atomic<uint64_t> cache_evictions_{0};
+
+    std::atomic<uint64_t> syscalls_[kSyscalls] = {};
 };
@@ -0,0 +1,158 @@
+#include "vfs/traced_vfs.h"
+#include "stats/probes.h"
+#include "stats/request_tracer.h"
+#include "stats/slow_op_log.h"
+
+// Run fn between the vfs__start/vfs__done probes, charging its time (and
+// fh, if it is the first handle seen) to the current trace, and adding a
+// span if the call is sampled
+template <typename F>
+static NfsStat3 traced(const char* op, const FileHandle* fh, F&& fn) {
+    NFSD_PROBE4(vfs__start, t_probe_xid, op, fh ? fh->data : nullptr, fh ? fh->len : 0);
+    RequestTrace* t = current_request_trace();
+    uint64_t start = t ? LatencyStats::now_ns() : 0;
+    NfsStat3 st = fn();
+    if (t) {
+        uint64_t ns = LatencyStats::now_ns() - start;
+        t->add_vfs(ns, fh);
+        if (t->spans)
+            t->spans->push({start, ns, op, t->xid, 0, static_cast<uint32_t>(st), 0,
+                            SpanKind::VFS});
+    }
+    NFSD_PROBE5(vfs__done, t_probe_xid, op, fh ? fh->data : nullptr, fh ? fh->len : 0,
+                static_cast<uint32_t>(st));
+    return st;
+}
+
+NfsStat3 TracedVfs::getattr(const FileHandle& fh, Fattr3& attr) {
+    return traced("getattr", &fh, [&] { return inner_.getattr(fh, attr); });
+}
+
+NfsStat3 TracedVfs::setattr(const FileHandle& fh, uint32_t mode, uint32_t uid, uint32_t gid,
+                            uint64_t size, NfsTimeSet atime, NfsTimeSet mtime) {
+    return traced("setattr", &fh, [&] {
+        return inner_.setattr(fh, mode, uid, gid, size, atime, mtime);
+    });
+}
+
+NfsStat3 TracedVfs::lookup(const FileHandle& dir_fh, const std::string& name,
+                           FileHandle& out_fh, Fattr3& out_attr) {
+    return traced("lookup", &dir_fh, [&] {
+        return inner_.lookup(dir_fh, name, out_fh, out_attr);
+    });
+}
+
+NfsStat3 TracedVfs::access(const FileHandle& fh, uint32_t requested, uint32_t& granted) {
+    return traced("access", &fh, [&] { return inner_.access(fh, requested, granted); });
+}
+
+NfsStat3 TracedVfs::read(const FileHandle& fh, uint64_t offset, uint32_t count,
+                         std::vector<uint8_t>& data, bool& eof) {
+    NfsStat3 st = traced("read", &fh, [&] {
+        return inner_.read(fh, offset, count, data, eof);
+    });
+    RequestTrace* t = current_request_trace();
+    if (t && st == NfsStat3::NFS3_OK) t->io_bytes += data.size();
+    return st;
+}
+
+NfsStat3 TracedVfs::write(const FileHandle& fh, uint64_t offset, const uint8_t* data,
+                          uint32_t count, uint32_t& written) {
+    NfsStat3 st = traced("write", &fh, [&] {
+        return inner_.write(fh, offset, data, count, written);
+    });
+    RequestTrace* t = current_request_trace();
+    if (t && st == NfsStat3::NFS3_OK) t->io_bytes += written;
+    return st;
+}
+
+NfsStat3 TracedVfs::create(const FileHandle& dir_fh, const std::string& name, uint32_t mode,
+                           FileHandle& out_fh, Fattr3& out_attr) {
+    return traced("create", &dir_fh, [&] {
+        return inner_.create(dir_fh, name, mode, out_fh, out_attr);
+    });
+}
+
+NfsStat3 TracedVfs::mkdir(const FileHandle& dir_fh, const std::string& name, uint32_t mode,
+                          FileHandle& out_fh, Fattr3& out_attr) {
+    return traced("mkdir", &dir_fh, [&] {
+        return inner_.mkdir(dir_fh, name, mode, out_fh, out_attr);
+    });
+}
+
+NfsStat3 TracedVfs::remove(const FileHandle& dir_fh, const std::string& name) {
+    return traced("remove", &dir_fh, [&] { return inner_.remove(dir_fh, name); });
+}
+
+NfsStat3 TracedVfs::rmdir(const FileHandle& dir_fh, const std::string& name) {
+    return traced("rmdir", &dir_fh, [&] { return inner_.rmdir(dir_fh, name); });
+}
+
+NfsStat3 TracedVfs::rename(const FileHandle& from_dir, const std::string& from_name,
+                           const FileHandle& to_dir, const std::string& to_name) {
+    return traced("rename", &from_dir, [&] {
+        return inner_.rename(from_dir, from_name, to_dir, to_name);
+    });
+}
+
+NfsStat3 TracedVfs::readdir(const FileHandle& dir_fh, uint64_t cookie, uint32_t count,
+                            std::vector<DirEntry>& entries, bool& eof) {
+    return traced("readdir", &dir_fh, [&] {
+        return inner_.readdir(dir_fh, cookie, count, entries, eof);
+    });
+}
+
+NfsStat3 TracedVfs::readlink(const FileHandle& fh, std::string& target) {
+    return traced("readlink", &fh, [&] { return inner_.readlink(fh, target); });
+}
+
+NfsStat3 TracedVfs::symlink(const FileHandle& dir_fh, const std::string& name,
+                            const std::string& target, FileHandle& out_fh,
+                            Fattr3& out_attr) {
+    return traced("symlink", &dir_fh, [&] {
+        return inner_.symlink(dir_fh, name, target, out_fh, out_attr);
+    });
+}
+
+NfsStat3 TracedVfs::link(const FileHandle& fh, const FileHandle& dir_fh,
+                         const std::string& name) {
+    return traced("link", &fh, [&] { return inner_.link(fh, dir_fh, name); });
+}
+
+NfsStat3 TracedVfs::fsstat(const FileHandle& fh, uint64_t& total_bytes,
+                           uint64_t& free_bytes, uint64_t& avail_bytes,
+                           uint64_t& total_files, uint64_t& free_files,
+                           uint64_t& avail_files) {
+    return traced("fsstat", &fh, [&] {
+        return inner_.fsstat(fh, total_bytes, free_bytes, avail_bytes,
+                             total_files, free_files, avail_files);
+    });
+}
+
+NfsStat3 TracedVfs::fsinfo(const FileHandle& fh, uint32_t& rtmax, uint32_t& rtpref,
+                           uint32_t& wtmax, uint32_t& wtpref, uint32_t& dtpref,
+                           uint64_t& maxfilesize) {
+    return traced("fsinfo", &fh, [&] {
+        return inner_.fsinfo(fh, rtmax, rtpref, wtmax, wtpref, dtpref, maxfilesize);
+    });
+}
+
+NfsStat3 TracedVfs::pathconf(const FileHandle& fh, uint32_t& linkmax, uint32_t& name_max) {
+    return traced("pathconf", &fh, [&] { return inner_.pathconf(fh, linkmax, name_max); });
+}
+
+NfsStat3 TracedVfs::commit(const FileHandle& fh, uint64_t offset, uint32_t count) {
+    return traced("commit", &fh, [&] { return inner_.commit(fh, offset, count); });
+}
+
+NfsStat3 TracedVfs::mknod(const FileHandle& dir_fh, const std::string& name, Ftype3 type,
+                          uint32_t mode, uint32_t rdev_major, uint32_t rdev_minor,
+                          FileHandle& out_fh, Fattr3& out_attr) {
+    return traced("mknod", &dir_fh, [&] {
+        return inner_.mknod(dir_fh, name, type, mode, rdev_major, rdev_minor, out_fh, out_attr);
+    });
+}
+
+NfsStat3 TracedVfs::get_root_fh(const std::string& path, FileHandle& fh) {
+    return traced("get_root_fh", nullptr, [&] { return inner_.get_root_fh(path, fh); });
+}
@@ -1,11 +1,30 @@
 #include "vfs/vfs.h"
 #include <cstring>
 
-bool FileHandle::operator==(const FileHandle& o) const {
-    return len == o.len && std::memcmp(data, o.data, len) == 0;
+// Mixes 8-byte words with the multiply-xorshift finalizer of SplitMix64:
+// the three words of a handle's block hash in a few cycles, where FNV-1a
+// took a multiply per byte
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return h;
 }
 
-bool FileHandle::operator<(const FileHandle& o) const {
-    if (len != o.len) return len < o.len;
-    return std::memcmp(data, o.data, len) < 0;
+FileHandle::FileHandle(const void* data, size_t len) {
+    // Empty (or too long) stays the default handle, hash 0
+    if (len == 0 || len > kMaxSize) return;
+    std::memcpy(bytes_, data, len);
+    bytes_[kMaxSize] = static_cast<uint8_t>(len);
+    // The length is in the last word, so equal bytes of different lengths
+    // hash apart
+    uint64_t h = 0;
+    for (size_t i = 0; i < sizeof(bytes_); i += sizeof(uint64_t)) {
+        uint64_t w;
+        std::memcpy(&w, bytes_ + i, sizeof(w));
+        h = mix(h ^ w ^ (i + 1) * 0x9e3779b97f4a7c15ull);
+    }
+    hash_ = h;
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
+#include <functional>
 #include <string>
 #include <vector>
 #include <map>
@@ -10,13 +12,48 @@
 // RFC 1813 §2.3.3 - nfs_fh3: opaque file handle (max 64 bytes)
 constexpr size_t NFS3_FHSIZE = 64;
 
-struct FileHandle {
-    uint8_t data[NFS3_FHSIZE] = {};
-    size_t len = 0;
+// A file handle as the server keeps it: the bytes, their length and a hash
+// of both in half a cache line. Opens, locks, delegations, lock waiters
+// and every cached handle hold one, and the tables find them by hash.
+// Wire handles are converted when decoded and encoded.
+//
+// The server issues 16-byte handles (LocalFs::make_handle()). A client's
+// handle longer than kMaxSize cannot be one of them and becomes the empty
+// handle, which resolves to nothing.
+class FileHandle {
+public:
+    static constexpr size_t kMaxSize = 23;
+
+    FileHandle() = default;
+    FileHandle(const void* data, size_t len);
+
+    const uint8_t* data() const { return bytes_; }
+    size_t size() const { return bytes_[kMaxSize]; }
+    bool empty() const { return size() == 0; }
+    uint64_t hash() const { return hash_; }
+
+    // Unused bytes are zero, so whole blocks compare
+    bool operator==(const FileHandle& o) const {
+        return hash_ == o.hash_ && std::memcmp(bytes_, o.bytes_, sizeof(bytes_)) == 0;
+    }
+    bool operator!=(const FileHandle& o) const { return !(*this == o); }
+    bool operator<(const FileHandle& o) const {
+        return std::memcmp(bytes_, o.bytes_, sizeof(bytes_)) < 0;
+    }
+
+private:
+    uint8_t bytes_[kMaxSize + 1] = {};  // data, zero padding, length last
+    uint64_t hash_ = 0;
+};
+
+static_assert(sizeof(FileHandle) == 32, "FileHandle should stay half a cache line");
 
-    bool operator==(const FileHandle& o) const;
-    bool operator<(const FileHandle& o) const;
+namespace std {
+template <>
+struct hash<FileHandle> {
+    size_t operator()(const FileHandle& fh) const noexcept { return fh.hash(); }
 };
+}  // namespace std
 
 // RFC 1813 §2.6 - nfsstat3: NFS status codes
 enum class NfsStat3 : uint32_t {
@@ -46,6 +83,8 @@ enum class NfsStat3 : uint32_t {
     NFS3ERR_NOTSUPP     = 10004,
     NFS3ERR_TOOSMALL    = 10005,
     NFS3ERR_SERVERFAULT = 10006,
+    NFS3ERR_BADTYPE     = 10007,
+    NFS3ERR_JUKEBOX     = 10008,
 };
 
 // RFC 1813 §2.2 - ftype3: file types
@@ -60,7 +60,7 @@ void XdrEncoder::encode_opaque(const void* data, size_t len) {
 }
 
 // RFC 4506 §4.11 - String
-void XdrEncoder::encode_string(const std::string& s) {
+void XdrEncoder::encode_string(std::string_view s) {
     encode_opaque(s.data(), s.size());
 }
 
@@ -144,3 +144,21 @@ std::string XdrDecoder::decode_string() {
     skip_pad();
     return result;
 }
+
+std::pmr::vector<uint8_t> XdrDecoder::decode_opaque(std::pmr::memory_resource* mr) {
+    uint32_t len = decode_uint32();
+    check(len);
+    std::pmr::vector<uint8_t> result(data_ + pos_, data_ + pos_ + len, mr);
+    pos_ += len;
+    skip_pad();
+    return result;
+}
+
+std::pmr::string XdrDecoder::decode_string(std::pmr::memory_resource* mr) {
+    uint32_t len = decode_uint32();
+    check(len);
+    std::pmr::string result(reinterpret_cast<const char*>(data_ + pos_), len, mr);
+    pos_ += len;
+    skip_pad();
+    return result;
+}
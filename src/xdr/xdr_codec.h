@@ -2,17 +2,23 @@
 
 #include <cstdint>
 #include <cstring>
+#include <memory_resource>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <stdexcept>
 #include <arpa/inet.h>
 
 // RFC 4506 - XDR: External Data Representation Standard
 // All XDR data is aligned to 4-byte boundaries, big-endian.
+//
+// Both take a std::pmr::memory_resource for what they allocate: a call's
+// RequestArena (rpc/rpc_arena.h) in the request path, else the heap.
 
 class XdrEncoder {
 public:
     XdrEncoder() = default;
+    explicit XdrEncoder(std::pmr::memory_resource* mr) : buf_(mr) {}
 
     void encode_uint32(uint32_t v);       // RFC 4506 §4.2 - Unsigned Integer
     void encode_int32(int32_t v);         // RFC 4506 §4.1 - Integer
@@ -21,15 +27,19 @@ public:
     void encode_bool(bool v);             // RFC 4506 §4.4 - Boolean
     void encode_opaque_fixed(const void* data, size_t len); // RFC 4506 §4.9 - Fixed-Length Opaque
     void encode_opaque(const void* data, size_t len);       // RFC 4506 §4.10 - Variable-Length Opaque
-    void encode_string(const std::string& s);               // RFC 4506 §4.11 - String
+    void encode_string(std::string_view s);                 // RFC 4506 §4.11 - String
 
-    const std::vector<uint8_t>& data() const { return buf_; }
+    const std::pmr::vector<uint8_t>& data() const { return buf_; }
     size_t size() const { return buf_.size(); }
+    // Start over, keeping the buffer
+    void clear() { buf_.clear(); }
+    void reserve(size_t n) { buf_.reserve(n); }
+    std::pmr::memory_resource* resource() const { return buf_.get_allocator().resource(); }
 
 private:
     void append(const void* data, size_t len);
     void pad_to_4();
-    std::vector<uint8_t> buf_;
+    std::pmr::vector<uint8_t> buf_;
 };
 
 class XdrDecoder {
@@ -44,6 +54,9 @@ public:
     void decode_opaque_fixed(void* out, size_t len);    // RFC 4506 §4.9 - Fixed-Length Opaque
     std::vector<uint8_t> decode_opaque();               // RFC 4506 §4.10 - Variable-Length Opaque
     std::string decode_string();                        // RFC 4506 §4.11 - String
+    // The same, allocated from mr
+    std::pmr::vector<uint8_t> decode_opaque(std::pmr::memory_resource* mr);
+    std::pmr::string decode_string(std::pmr::memory_resource* mr);
 
     size_t remaining() const { return len_ - pos_; }
     const uint8_t* current() const { return data_ + pos_; }
@@ -1,12 +1,11 @@
 #include <gtest/gtest.h>
+#include <atomic>
 #include <cstring>
+#include <thread>
 #include "locking/lock_table.h"
 
 static FileHandle make_fh(uint64_t id) {
-    FileHandle fh{};
-    std::memcpy(fh.data, &id, sizeof(id));
-    fh.len = sizeof(id);
-    return fh;
+    return FileHandle(&id, sizeof(id));
 }
 
 TEST(LockTable, RangesOverlap) {
@@ -189,3 +188,280 @@ TEST(LockTable, ReleaseAllForFile) {
     // fh2 lock still there
     EXPECT_FALSE(table.acquire(fh2, "owner2", true, 0, 100, conflict));
 }
+
+static LockWaiter make_waiter(const FileHandle& fh, const std::string& owner,
+                              bool exclusive, uint64_t offset, uint64_t length,
+                              std::vector<std::string>* woken) {
+    LockWaiter w;
+    w.owner = owner;
+    w.fh = fh;
+    w.exclusive = exclusive;
+    w.offset = offset;
+    w.length = length;
+    w.on_ready = [woken](const LockWaiter& ready) { woken->push_back(ready.owner); };
+    return w;
+}
+
+TEST(LockTable, WaiterGrantedOnRelease) {
+    ByteRangeLockTable table;
+    FileHandle fh = make_fh(1);
+    LockConflict conflict;
+    std::vector<std::string> woken;
+
+    table.acquire(fh, "owner1", true, 0, 100, conflict);
+    table.enqueue_waiter(make_waiter(fh, "owner2", true, 0, 100, &woken));
+    EXPECT_EQ(table.waiter_count(fh), 1u);
+    EXPECT_TRUE(woken.empty());
+
+    table.release(fh, "owner1", 0, 100);
+    ASSERT_EQ(woken.size(), 1u);
+    EXPECT_EQ(woken[0], "owner2");
+    EXPECT_EQ(table.waiter_count(fh), 0u);
+
+    // The table acquired on the waiter's behalf
+    EXPECT_TRUE(table.test(fh, "owner1", true, 0, 100, conflict));
+    EXPECT_EQ(conflict.owner, "owner2");
+}
+
+TEST(LockTable, WaitersServedFifo) {
+    ByteRangeLockTable table;
+    FileHandle fh = make_fh(1);
+    LockConflict conflict;
+    std::vector<std::string> woken;
+
+    table.acquire(fh, "holder", true, 0, 100, conflict);
+    table.enqueue_waiter(make_waiter(fh, "first", true, 0, 100, &woken));
+    // Needs only part of the range, but must not jump ahead of "first"
+    table.enqueue_waiter(make_waiter(fh, "second", true, 50, 10, &woken));
+
+    table.release(fh, "holder", 0, 100);
+    ASSERT_EQ(woken.size(), 1u);
+    EXPECT_EQ(woken[0], "first");
+    EXPECT_EQ(table.waiter_count(fh), 1u);
+
+    table.release(fh, "first", 0, 100);
+    ASSERT_EQ(woken.size(), 2u);
+    EXPECT_EQ(woken[1], "second");
+}
+
+TEST(LockTable, QueuedWriterNotOvertakenByLaterReaders) {
+    ByteRangeLockTable table;
+    FileHandle fh = make_fh(1);
+    LockConflict conflict;
+    std::vector<std::string> woken;
+
+    table.acquire(fh, "reader1", false, 0, 100, conflict);
+    table.enqueue_waiter(make_waiter(fh, "writer", true, 0, 100, &woken));
+
+    // Compatible with the held read lock, but queued behind the writer
+    EXPECT_FALSE(table.acquire(fh, "reader2", false, 50, 10, conflict));
+    EXPECT_EQ(conflict.owner, "writer");
+    // Not overlapping the writer's range: no reason to wait
+    EXPECT_TRUE(table.acquire(fh, "reader3", false, 200, 10, conflict));
+
+    table.release(fh, "reader1", 0, 100);
+    ASSERT_EQ(woken.size(), 1u);
+    EXPECT_EQ(woken[0], "writer");
+    EXPECT_FALSE(table.acquire(fh, "reader2", false, 50, 10, conflict));
+    EXPECT_EQ(conflict.owner, "writer");
+    table.release(fh, "writer", 0, 100);
+    EXPECT_TRUE(table.acquire(fh, "reader2", false, 50, 10, conflict));
+}
+
+TEST(LockTable, SharedWaitersWokenTogether) {
+    ByteRangeLockTable table;
+    FileHandle fh = make_fh(1);
+    LockConflict conflict;
+    std::vector<std::string> woken;
+
+    table.acquire(fh, "writer", true, 0, UINT64_MAX, conflict);
+    table.enqueue_waiter(make_waiter(fh, "reader1", false, 0, 100, &woken));
+    table.enqueue_waiter(make_waiter(fh, "reader2", false, 0, 100, &woken));
+
+    table.release_all("writer");
+    EXPECT_EQ(woken.size(), 2u);
+}
+
+TEST(LockTable, DuplicateWaiterNotQueuedTwice) {
+    ByteRangeLockTable table;
+    FileHandle fh = make_fh(1);
+    LockConflict conflict;
+    std::vector<std::string> woken;
+
+    table.acquire(fh, "owner1", true, 0, 100, conflict);
+    uint64_t id1 = table.enqueue_waiter(make_waiter(fh, "owner2", true, 0, 100, &woken));
+    uint64_t id2 = table.enqueue_waiter(make_waiter(fh, "owner2", true, 0, 100, &woken));
+    EXPECT_EQ(id1, id2);
+    EXPECT_EQ(table.waiter_count(fh), 1u);
+}
+
+TEST(LockTable, CancelWaiter) {
+    ByteRangeLockTable table;
+    FileHandle fh = make_fh(1);
+    LockConflict conflict;
+    std::vector<std::string> woken;
+
+    table.acquire(fh, "owner1", true, 0, 100, conflict);
+    table.enqueue_waiter(make_waiter(fh, "owner2", true, 0, 100, &woken));
+
+    EXPECT_TRUE(table.cancel_waiter(fh, "owner2", true, 0, 100));
+    EXPECT_FALSE(table.cancel_waiter(fh, "owner2", true, 0, 100));
+    EXPECT_EQ(table.waiter_count(fh), 0u);
+
+    table.release(fh, "owner1", 0, 100);
+    EXPECT_TRUE(woken.empty());
+}
+
+TEST(LockTable, ReleaseAllDropsOwnersWaiters) {
+    ByteRangeLockTable table;
+    FileHandle fh1 = make_fh(1);
+    FileHandle fh2 = make_fh(2);
+    LockConflict conflict;
+    std::vector<std::string> woken;
+
+    table.acquire(fh1, "nlm:a:1", true, 0, 100, conflict);
+    table.acquire(fh2, "nlm:b:1", true, 0, 100, conflict);
+    table.enqueue_waiter(make_waiter(fh2, "nlm:a:1", true, 0, 100, &woken));
+
+    table.release_all_matching("nlm:a:");
+    EXPECT_EQ(table.waiter_count(fh2), 0u);
+    table.release(fh2, "nlm:b:1", 0, 100);
+    EXPECT_TRUE(woken.empty());
+}
+
+TEST(LockTable, DeadlockDetection) {
+    ByteRangeLockTable table;
+    FileHandle fh1 = make_fh(1);
+    FileHandle fh2 = make_fh(2);
+    LockConflict conflict;
+    std::vector<std::string> woken;
+
+    table.acquire(fh1, "A", true, 0, 100, conflict);
+    table.acquire(fh2, "B", true, 0, 100, conflict);
+
+    // A waits for B
+    EXPECT_FALSE(table.would_deadlock(fh2, "A", true, 0, 100));
+    table.enqueue_waiter(make_waiter(fh2, "A", true, 0, 100, &woken));
+
+    // B waiting for A would close the cycle
+    EXPECT_TRUE(table.would_deadlock(fh1, "B", true, 0, 100));
+    // A third owner waiting on A is fine
+    EXPECT_FALSE(table.would_deadlock(fh1, "C", true, 0, 100));
+}
+
+TEST(LockTable, DeadlockThroughAQueuedWaiter) {
+    ByteRangeLockTable table;
+    FileHandle fh1 = make_fh(1);
+    FileHandle fh2 = make_fh(2);
+    LockConflict conflict;
+    std::vector<std::string> woken;
+
+    table.acquire(fh1, "A", true, 0, 100, conflict);
+    table.acquire(fh2, "C", true, 0, 100, conflict);
+    // B waits for C; A's range is free but overlaps B's, so A waits behind B
+    table.enqueue_waiter(make_waiter(fh2, "B", true, 50, 100, &woken));
+    EXPECT_FALSE(table.would_deadlock(fh2, "A", true, 120, 10));
+    table.enqueue_waiter(make_waiter(fh2, "A", true, 120, 10, &woken));
+
+    // C waiting for A: C -> A -> B -> C
+    EXPECT_TRUE(table.would_deadlock(fh1, "C", true, 0, 100));
+}
+
+TEST(LockTable, NotifyWaitersAreNotBlockedOwners) {
+    ByteRangeLockTable table;
+    FileHandle fh1 = make_fh(1);
+    FileHandle fh2 = make_fh(2);
+    LockConflict conflict;
+    std::vector<std::string> woken;
+
+    table.acquire(fh1, "A", true, 0, 100, conflict);
+    table.acquire(fh2, "B", true, 0, 100, conflict);
+    // A's client only wants CB_NOTIFY_LOCK for B's file: it polls, and
+    // is not stuck in the server
+    LockWaiter notify = make_waiter(fh2, "A", true, 0, 100, &woken);
+    notify.acquire = false;
+    table.enqueue_waiter(std::move(notify));
+
+    EXPECT_FALSE(table.would_deadlock(fh1, "B", true, 0, 100));
+}
+
+TEST(LockTable, QueuedBehindANotifyWaiterWaitsForWhatItWaitsFor) {
+    ByteRangeLockTable table;
+    FileHandle fh1 = make_fh(1);
+    FileHandle fh2 = make_fh(2);
+    LockConflict conflict;
+    std::vector<std::string> woken;
+
+    table.acquire(fh1, "H", true, 0, 50, conflict);
+    table.acquire(fh2, "B", true, 0, 100, conflict);
+    LockWaiter notify = make_waiter(fh1, "N", true, 0, 100, &woken);
+    notify.acquire = false;
+    table.enqueue_waiter(std::move(notify));
+    // B's range is free of H's lock, but B queues behind N, which waits for H
+    table.enqueue_waiter(make_waiter(fh1, "B", true, 60, 10, &woken));
+
+    // H waiting for B: H -> B -> (N) -> H
+    EXPECT_TRUE(table.would_deadlock(fh2, "H", true, 0, 100));
+}
+
+TEST(LockTable, DeadlockCheckAndEnqueueAreAtomic) {
+    // A holds fh1 and B fh2; each blocks on the other's file at the same
+    // time. Exactly one of them must be refused, or neither ever wakes.
+    for (int round = 0; round < 200; round++) {
+        ByteRangeLockTable table;
+        FileHandle fh1 = make_fh(1);
+        FileHandle fh2 = make_fh(2);
+        LockConflict conflict;
+        table.acquire(fh1, "A", true, 0, 100, conflict);
+        table.acquire(fh2, "B", true, 0, 100, conflict);
+
+        std::vector<std::string> woken_a, woken_b;
+        std::atomic<bool> go{false};
+        uint64_t id_a = 0, id_b = 0;
+        std::thread ta([&] {
+            while (!go) std::this_thread::yield();
+            id_a = table.enqueue_waiter(make_waiter(fh2, "A", true, 0, 100, &woken_a), true);
+        });
+        std::thread tb([&] {
+            while (!go) std::this_thread::yield();
+            id_b = table.enqueue_waiter(make_waiter(fh1, "B", true, 0, 100, &woken_b), true);
+        });
+        go = true;
+        ta.join();
+        tb.join();
+        ASSERT_EQ((id_a == 0) + (id_b == 0), 1) << "round " << round;
+        EXPECT_EQ(table.waiter_count(fh1) + table.waiter_count(fh2), 1u);
+    }
+}
+
+TEST(LockTable, ConcurrentExclusiveLockIsMutuallyExclusive) {
+    // Many owners race for the same range while others hammer unrelated
+    // files; the table must never grant the shared range twice.
+    ByteRangeLockTable table;
+    FileHandle hot = make_fh(1);
+    std::atomic<int> holders{0};
+    std::atomic<bool> overlap{false};
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&, t] {
+            std::string owner = "owner" + std::to_string(t);
+            FileHandle own = make_fh(100 + t);
+            LockConflict conflict;
+            for (int i = 0; i < 2000; i++) {
+                table.acquire(own, owner, true, 0, 10, conflict);
+                if (table.acquire(hot, owner, true, 0, 10, conflict)) {
+                    if (holders.fetch_add(1) != 0) overlap = true;
+                    holders.fetch_sub(1);
+                    table.release(hot, owner, 0, 10);
+                }
+                table.release(own, owner, 0, 10);
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+
+    EXPECT_FALSE(overlap.load());
+    LockConflict conflict;
+    EXPECT_FALSE(table.test(hot, "probe", true, 0, 10, conflict));
+}
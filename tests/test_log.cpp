@@ -0,0 +1,126 @@
+#include <gtest/gtest.h>
+#include "log/logger.h"
+#include "stats/metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Captures everything the writer emits; levels and rate limit reset per test
+class LogTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        Logger& log = Logger::instance();
+        log.flush();
+        log.set_sink([this](const std::string& lines) {
+            std::lock_guard<std::mutex> lk(mu_);
+            out_ += lines;
+        });
+        ASSERT_TRUE(log.configure("info"));
+        log.set_rate_limit(0);
+    }
+
+    void TearDown() override {
+        Logger::instance().flush();
+        Logger::instance().set_sink([](const std::string&) {});
+        Logger::instance().set_rate_limit(10);
+    }
+
+    std::string output() {
+        Logger::instance().flush();
+        std::lock_guard<std::mutex> lk(mu_);
+        return out_;
+    }
+
+    size_t lines() {
+        std::string out = output();
+        return static_cast<size_t>(std::count(out.begin(), out.end(), '\n'));
+    }
+
+    std::mutex mu_;
+    std::string out_;
+};
+
+TEST_F(LogTest, WritesLogfmtWithQuotedFields) {
+    std::string owned = "plain";
+    NFSD_LOG_WARN(LogSys::RPC, "program/version not registered",
+                  {{"prog", 100099u}, {"delta", -3}, {"client", "a b\"c"}, {"tag", owned}});
+    std::string out = output();
+    EXPECT_EQ(out.compare(0, 3, "ts="), 0) << out;
+    EXPECT_NE(out.find(" level=warn sys=rpc msg=\"program/version not registered\" prog=100099"
+                       " delta=-3 client=\"a b\\\"c\" tag=plain\n"),
+              std::string::npos)
+        << out;
+}
+
+TEST_F(LogTest, LevelsArePerSubsystem) {
+    ASSERT_TRUE(Logger::instance().configure("warn,nfs4=debug"));
+    NFSD_LOG_INFO(LogSys::RPC, "hidden", {{"n", 1}});
+    NFSD_LOG_DEBUG(LogSys::NFS4, "shown", {{"n", 2}});
+    NFSD_LOG_ERROR(LogSys::TLS, "shown too");
+    std::string out = output();
+    EXPECT_EQ(out.find("hidden"), std::string::npos);
+    EXPECT_NE(out.find("level=debug sys=nfs4 msg=\"shown\" n=2"), std::string::npos) << out;
+    EXPECT_NE(out.find("level=error sys=tls msg=\"shown too\"\n"), std::string::npos) << out;
+
+    // A bad spec changes nothing
+    EXPECT_FALSE(Logger::instance().configure("info,bogus=debug"));
+    EXPECT_FALSE(Logger::instance().configure("loud"));
+    EXPECT_FALSE(Logger::instance().enabled(LogSys::RPC, LogLevel::INFO));
+    EXPECT_TRUE(Logger::instance().enabled(LogSys::NFS4, LogLevel::DEBUG));
+}
+
+TEST_F(LogTest, RateLimitIsPerSiteAndReportsSuppressed) {
+    Logger::instance().set_rate_limit(3);
+    uint64_t suppressed_before = Logger::instance().suppressed();
+
+    // Start just after a second boundary so the burst fits in one window
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    std::this_thread::sleep_for(std::chrono::seconds(1) -
+                                (now % std::chrono::seconds(1)) + std::chrono::milliseconds(5));
+    auto burst = [] {
+        for (int i = 0; i < 10; i++) NFSD_LOG_WARN(LogSys::RPC, "burst", {{"i", i}});
+    };
+    burst();
+    NFSD_LOG_WARN(LogSys::RPC, "other site");
+    EXPECT_EQ(lines(), 4u);
+    EXPECT_EQ(Logger::instance().suppressed() - suppressed_before, 7u);
+
+    // The next admitted message carries the count it stands for
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    burst();
+    EXPECT_NE(output().find("msg=\"burst\" i=0 suppressed=7\n"), std::string::npos) << output();
+}
+
+TEST_F(LogTest, ConcurrentThreadsEachLineIntact) {
+    const int kThreads = 4, kPerThread = 50;
+    uint64_t dropped_before = Logger::instance().dropped();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([t] {
+            for (int i = 0; i < kPerThread; i++)
+                NFSD_LOG_INFO(LogSys::VFS, "io", {{"thread", t}, {"i", i}});
+        });
+    }
+    for (auto& th : threads) th.join();
+
+    // Rings of exited threads are still drained
+    std::string out = output();
+    uint64_t dropped = Logger::instance().dropped() - dropped_before;
+    EXPECT_EQ(lines() + dropped, static_cast<size_t>(kThreads * kPerThread));
+    EXPECT_NE(out.find("sys=vfs msg=\"io\" thread=3 i=49\n"), std::string::npos);
+}
+
+TEST_F(LogTest, FullRingDropsInsteadOfBlocking) {
+    uint64_t dropped_before = Logger::instance().dropped();
+    for (int i = 0; i < 2000; i++) NFSD_LOG_INFO(LogSys::NLM, "flood", {{"i", i}});
+    uint64_t dropped = Logger::instance().dropped() - dropped_before;
+    EXPECT_EQ(lines() + dropped, 2000u);
+
+    MetricsRegistry reg;
+    Logger::instance().register_metrics(reg);
+    EXPECT_GE(reg.value("nfsd_log_messages_dropped_total"), static_cast<double>(dropped));
+}
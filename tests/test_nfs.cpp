@@ -3,22 +3,47 @@
 #include "vfs/local_fs.h"
 #include "nfs/nfs_types.h"
 #include "nfs/nfs_server.h"
+#include "rpc/rpc_overload.h"
 
 #include <cstdlib>
+#include <unordered_map>
 #include <unistd.h>
 
 TEST(NfsTypes, FileHandleComparison) {
-    FileHandle a, b;
-    a.len = 4;
-    a.data[0] = 1; a.data[1] = 2; a.data[2] = 3; a.data[3] = 4;
+    const uint8_t da[4] = {1, 2, 3, 4};
+    const uint8_t db[4] = {1, 2, 3, 5};
+    FileHandle a(da, sizeof(da)), b;
     b = a;
     EXPECT_TRUE(a == b);
 
-    b.data[3] = 5;
+    b = FileHandle(db, sizeof(db));
     EXPECT_FALSE(a == b);
     EXPECT_TRUE(a < b);
 }
 
+TEST(NfsTypes, FileHandleHashAndLimits) {
+    const uint8_t bytes[FileHandle::kMaxSize + 1] = {7, 0, 0, 0};
+    FileHandle four(bytes, 4), five(bytes, 5);
+    EXPECT_EQ(four.size(), 4u);
+    EXPECT_EQ(four.hash(), FileHandle(bytes, 4).hash());
+    // Trailing zeros are still part of the handle
+    EXPECT_FALSE(four == five);
+    EXPECT_NE(four.hash(), five.hash());
+
+    // Longer than any handle the server issues: the empty handle
+    FileHandle longest(bytes, FileHandle::kMaxSize);
+    EXPECT_EQ(longest.size(), FileHandle::kMaxSize);
+    FileHandle too_long(bytes, FileHandle::kMaxSize + 1);
+    EXPECT_TRUE(too_long.empty());
+    EXPECT_TRUE(too_long == FileHandle());
+
+    std::unordered_map<FileHandle, int> m;
+    m[four] = 4;
+    m[five] = 5;
+    EXPECT_EQ(m.at(FileHandle(bytes, 4)), 4);
+    EXPECT_EQ(m.size(), 2u);
+}
+
 TEST(NfsTypes, ProcedureConstants) {
     EXPECT_EQ(NFSPROC3_NULL, 0u);
     EXPECT_EQ(NFSPROC3_GETATTR, 1u);
@@ -81,7 +106,7 @@ protected:
 
     // Encode a file handle as variable-length opaque (for procedure args)
     void encode_fh(XdrEncoder& enc, const FileHandle& fh) {
-        enc.encode_opaque(fh.data, fh.len);
+        enc.encode_opaque(fh.data(), fh.size());
     }
 
     RpcCallHeader make_call() {
@@ -236,3 +261,53 @@ TEST_F(NfsProcTest, DecodeSattr3Helper) {
     EXPECT_EQ(sa.mtime.time.seconds, 1234u);
     EXPECT_EQ(sa.mtime.time.nseconds, 5678u);
 }
+
+TEST_F(NfsProcTest, ShedsExpensiveCallsUnderOverload) {
+    OverloadControl overload;
+    auto handlers = nfs_->get_handlers();
+    auto call = make_call();
+    call.overload = &overload;
+
+    // READ: JUKEBOX and an absent post_op_attr, without touching the file
+    XdrEncoder args;
+    encode_fh(args, root_fh_);
+    args.encode_uint64(0);
+    args.encode_uint32(4096);
+    XdrDecoder dec(args.data().data(), args.size());
+    XdrEncoder reply;
+    handlers.procedures[NFSPROC3_READ](call, dec, reply);
+    XdrDecoder rdec(reply.data().data(), reply.size());
+    EXPECT_EQ(rdec.decode_uint32(), static_cast<uint32_t>(NfsStat3::NFS3ERR_JUKEBOX));
+    EXPECT_FALSE(rdec.decode_bool());
+    EXPECT_EQ(rdec.remaining(), 0u);
+
+    // RENAME: both directories' wcc_data absent
+    XdrEncoder rargs;
+    encode_fh(rargs, root_fh_);
+    rargs.encode_string("a");
+    encode_fh(rargs, root_fh_);
+    rargs.encode_string("b");
+    XdrDecoder rename_dec(rargs.data().data(), rargs.size());
+    XdrEncoder rename_reply;
+    handlers.procedures[NFSPROC3_RENAME](call, rename_dec, rename_reply);
+    EXPECT_EQ(rename_reply.size(), 5 * 4u);
+
+    // GETATTR is cheap and always served
+    XdrEncoder gargs;
+    encode_fh(gargs, root_fh_);
+    XdrDecoder gdec(gargs.data().data(), gargs.size());
+    XdrEncoder greply;
+    handlers.procedures[NFSPROC3_GETATTR](call, gdec, greply);
+    XdrDecoder grdec(greply.data().data(), greply.size());
+    EXPECT_EQ(grdec.decode_uint32(), static_cast<uint32_t>(NfsStat3::NFS3_OK));
+    EXPECT_EQ(overload.shed_count(3), 2u);
+
+    // Without the mark the same RENAME runs
+    call.overload = nullptr;
+    XdrDecoder rename_dec2(rargs.data().data(), rargs.size());
+    XdrEncoder rename_reply2;
+    handlers.procedures[NFSPROC3_RENAME](call, rename_dec2, rename_reply2);
+    XdrDecoder rrdec(rename_reply2.data().data(), rename_reply2.size());
+    EXPECT_EQ(rrdec.decode_uint32(), static_cast<uint32_t>(NfsStat3::NFS3ERR_NOENT));
+    EXPECT_EQ(overload.shed_count(3), 2u);
+}
@@ -4,8 +4,45 @@
 #include "nfs4/nfs4_callback.h"
 #include "nfs4/nfs4_state.h"
 #include "nfs4/nfs4_server.h"
+#include "rpc/rpc_arena.h"
+#include "rpc/rpc_overload.h"
+#include "vfs/local_fs.h"
 #include "xdr/xdr_codec.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Heap allocations by this thread, for the request-arena test
+static thread_local uint64_t t_allocs = 0;
+
+void* operator new(std::size_t n) {
+    t_allocs++;
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new(std::size_t n, std::align_val_t al) {
+    t_allocs++;
+    const size_t a = static_cast<size_t>(al);
+    if (void* p = std::aligned_alloc(a, (n + a - 1) / a * a)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+// A 16-byte handle like the ones LocalFs issues, told apart by its first byte
+static FileHandle test_fh(uint8_t tag) {
+    uint8_t data[16] = {tag};
+    return FileHandle(data, sizeof(data));
+}
+
 // Helper: call open_file with delegation out-params (ignoring them)
 // Also ends grace period so tests that don't care about it work normally.
 static Nfs4Stat open_file_simple(Nfs4StateManager& mgr, uint64_t clientid,
@@ -29,7 +66,7 @@ static Nfs4Stat open_file_simple(Nfs4StateManager& mgr, uint64_t clientid,
 // --- Attribute codec tests ---
 
 TEST(Nfs4Attrs, BitmapRoundTrip) {
-    std::vector<uint32_t> bm = {0xDEADBEEF, 0x12345678};
+    Bitmap4 bm = {0xDEADBEEF, 0x12345678};
     XdrEncoder enc;
     encode_bitmap(enc, bm);
 
@@ -41,7 +78,7 @@ TEST(Nfs4Attrs, BitmapRoundTrip) {
 }
 
 TEST(Nfs4Attrs, BitmapTrailingZerosTrimmed) {
-    std::vector<uint32_t> bm = {0x01, 0x00, 0x00};
+    Bitmap4 bm = {0x01, 0x00, 0x00};
     XdrEncoder enc;
     encode_bitmap(enc, bm);
 
@@ -53,7 +90,7 @@ TEST(Nfs4Attrs, BitmapTrailingZerosTrimmed) {
 }
 
 TEST(Nfs4Attrs, BitmapIsset) {
-    std::vector<uint32_t> bm = {0, 0};
+    Bitmap4 bm = {0, 0};
     bitmap_set(bm, FATTR4_TYPE);       // bit 1 in word 0
     bitmap_set(bm, FATTR4_SIZE);       // bit 4 in word 0
     bitmap_set(bm, FATTR4_MODE);       // bit 33 -> bit 1 in word 1
@@ -90,11 +127,10 @@ TEST(Nfs4Attrs, EncodeFattr4TypeAndSize) {
     attr.fileid = 42;
     attr.fsid = 1;
 
-    FileHandle fh;
-    fh.len = 16;
+    FileHandle fh = test_fh(0);
 
     // Request only TYPE and SIZE
-    std::vector<uint32_t> requested(1, 0);
+    Bitmap4 requested(1, 0);
     bitmap_set(requested, FATTR4_TYPE);
     bitmap_set(requested, FATTR4_SIZE);
 
@@ -168,9 +204,7 @@ TEST(Nfs4State, OpenConfirmClose) {
     mgr.confirm_clientid(clientid, confirm.data());
 
     // Open
-    FileHandle fh;
-    fh.len = 16;
-    fh.data[0] = 42;
+    FileHandle fh = test_fh(42);
     std::vector<uint8_t> owner = {1, 2, 3};
     Nfs4StateId stateid;
     bool needs_confirm = false;
@@ -238,9 +272,7 @@ TEST(Nfs4State, BadSeqid) {
     mgr.confirm_clientid(clientid, confirm.data());
 
     // Open
-    FileHandle fh;
-    fh.len = 16;
-    fh.data[0] = 42;
+    FileHandle fh = test_fh(42);
     std::vector<uint8_t> owner = {1, 2, 3};
     Nfs4StateId stateid;
     bool needs_confirm = false;
@@ -281,8 +313,7 @@ struct LockTestFixture {
         clientid = cid_out;
         mgr.confirm_clientid(clientid, confirm.data());
 
-        fh.len = 16;
-        fh.data[0] = 42;
+        fh = test_fh(42);
         std::vector<uint8_t> owner = {1, 2, 3};
         bool needs_confirm = false;
 
@@ -457,6 +488,40 @@ TEST(Nfs4Lock, ReleaseLockOwner) {
                               lock_sid2, denied), Nfs4Stat::NFS4_OK);
 }
 
+TEST(Nfs4Lock, StateSurvivesSaveAndRestore) {
+    LockTestFixture f;
+    Nfs4LockOwner owner1{f.clientid, {10}};
+    Nfs4LockOwner owner2{f.clientid, {20}};
+    Nfs4StateId lock_sid, out_sid;
+    Nfs4LockDenied denied;
+    EXPECT_EQ(f.mgr.lock_new(f.clientid, f.open_stateid, f.next_open_seqid++,
+                              owner1, 0, f.fh, WRITE_LT, 0, 100,
+                              lock_sid, denied), Nfs4Stat::NFS4_OK);
+
+    XdrEncoder enc;
+    f.mgr.save_state(enc);
+
+    // A new process: same clients, opens and locks, out of grace
+    Nfs4StateManager mgr;
+    XdrDecoder dec(enc.data().data(), enc.size());
+    ASSERT_TRUE(mgr.restore_state(dec));
+    EXPECT_FALSE(mgr.in_grace_period());
+    EXPECT_EQ(mgr.renew(f.clientid), Nfs4Stat::NFS4_OK);
+    EXPECT_EQ(mgr.validate_stateid(f.open_stateid, OPEN4_SHARE_ACCESS_READ), Nfs4Stat::NFS4_OK);
+    EXPECT_EQ(mgr.lock_test(f.fh, WRITE_LT, 50, 10, owner2, denied), Nfs4Stat::NFS4ERR_DENIED);
+    EXPECT_EQ(denied.owner.owner, owner1.owner);
+
+    // The lock owner's seqid carried over too
+    EXPECT_EQ(mgr.lock_unlock(lock_sid, 1, 0, 100, out_sid), Nfs4Stat::NFS4_OK);
+    EXPECT_EQ(mgr.lock_test(f.fh, WRITE_LT, 50, 10, owner2, denied), Nfs4Stat::NFS4_OK);
+
+    // A truncated image is refused and changes nothing
+    Nfs4StateManager fresh;
+    XdrDecoder short_dec(enc.data().data(), enc.size() / 2);
+    EXPECT_FALSE(fresh.restore_state(short_dec));
+    EXPECT_EQ(fresh.renew(f.clientid), Nfs4Stat::NFS4ERR_STALE_CLIENTID);
+}
+
 TEST(Nfs4Lock, CloseWithLocksHeld) {
     LockTestFixture f;
     Nfs4LockOwner owner1{f.clientid, {10}};
@@ -576,7 +641,7 @@ TEST(Nfs4Deleg, GrantReadDelegation) {
     mgr.end_grace_period();
     uint64_t clientid = setup_client_with_cb(mgr);
 
-    FileHandle fh; fh.len = 16; fh.data[0] = 1;
+    FileHandle fh = test_fh(1);
     std::vector<uint8_t> owner = {1};
     Nfs4StateId open_sid, deleg_sid;
     bool needs_confirm;
@@ -600,7 +665,7 @@ TEST(Nfs4Deleg, GrantWriteDelegation) {
     mgr.end_grace_period();
     uint64_t clientid = setup_client_with_cb(mgr);
 
-    FileHandle fh; fh.len = 16; fh.data[0] = 1;
+    FileHandle fh = test_fh(1);
     std::vector<uint8_t> owner = {1};
     Nfs4StateId open_sid, deleg_sid;
     bool needs_confirm;
@@ -623,7 +688,7 @@ TEST(Nfs4Deleg, NoGrantWithoutCallback) {
     mgr.end_grace_period();
     uint64_t clientid = setup_client_no_cb(mgr, {1});
 
-    FileHandle fh; fh.len = 16; fh.data[0] = 1;
+    FileHandle fh = test_fh(1);
     std::vector<uint8_t> owner = {1};
     Nfs4StateId open_sid, deleg_sid;
     bool needs_confirm;
@@ -646,7 +711,7 @@ TEST(Nfs4Deleg, NoGrantOtherClientOpen) {
     uint64_t client1 = setup_client_with_cb(mgr);
     uint64_t client2 = setup_client_no_cb(mgr, {2});
 
-    FileHandle fh; fh.len = 16; fh.data[0] = 1;
+    FileHandle fh = test_fh(1);
     Nfs4StateId open_sid, deleg_sid;
     bool needs_confirm;
     uint32_t deleg_type;
@@ -677,7 +742,7 @@ TEST(Nfs4Deleg, DelegReturn) {
     mgr.end_grace_period();
     uint64_t clientid = setup_client_with_cb(mgr);
 
-    FileHandle fh; fh.len = 16; fh.data[0] = 1;
+    FileHandle fh = test_fh(1);
     std::vector<uint8_t> owner = {1};
     Nfs4StateId open_sid, deleg_sid;
     bool needs_confirm;
@@ -706,7 +771,7 @@ TEST(Nfs4Deleg, DelegPurge) {
     mgr.end_grace_period();
     uint64_t clientid = setup_client_with_cb(mgr);
 
-    FileHandle fh; fh.len = 16; fh.data[0] = 1;
+    FileHandle fh = test_fh(1);
     std::vector<uint8_t> owner = {1};
     Nfs4StateId open_sid, deleg_sid;
     bool needs_confirm;
@@ -734,7 +799,7 @@ TEST(Nfs4Deleg, ConflictTriggerDelay) {
     uint64_t client1 = setup_client_with_cb(mgr);
     uint64_t client2 = setup_client_no_cb(mgr, {2});
 
-    FileHandle fh; fh.len = 16; fh.data[0] = 1;
+    FileHandle fh = test_fh(1);
     Nfs4StateId open_sid, deleg_sid;
     bool needs_confirm;
     uint32_t deleg_type;
@@ -779,7 +844,7 @@ TEST(Nfs4Deleg, ValidateDelegStateid) {
     mgr.end_grace_period();
     uint64_t clientid = setup_client_with_cb(mgr);
 
-    FileHandle fh; fh.len = 16; fh.data[0] = 1;
+    FileHandle fh = test_fh(1);
     std::vector<uint8_t> owner = {1};
     Nfs4StateId open_sid, deleg_sid;
     bool needs_confirm;
@@ -813,7 +878,7 @@ TEST(Nfs4Deleg, InvalidateClientCallback) {
     mgr.invalidate_client_callback(clientid);
 
     // Now open should NOT grant delegation
-    FileHandle fh; fh.len = 16; fh.data[0] = 1;
+    FileHandle fh = test_fh(1);
     std::vector<uint8_t> owner = {1};
     Nfs4StateId open_sid, deleg_sid;
     bool needs_confirm;
@@ -852,6 +917,290 @@ TEST(Nfs4Compound, MinorVersionMismatch) {
     EXPECT_EQ(mv, 1u);
 }
 
+// READDIR4args: cookie, cookieverf, dircount, maxcount, attr_request
+static void encode_readdir4(XdrEncoder& req) {
+    req.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_READDIR));
+    req.encode_uint64(0);
+    req.encode_uint64(0);
+    req.encode_uint32(4096);
+    req.encode_uint32(8192);
+    req.encode_uint32(0);  // empty bitmap
+}
+
+TEST(Nfs4Compound, ShedsExpensiveOpsUnderOverload) {
+    char tmpl[] = "/tmp/nfs4_overload_XXXXXX";
+    char* dir = mkdtemp(tmpl);
+    ASSERT_NE(dir, nullptr);
+    std::string tmpdir = dir;
+    ASSERT_EQ(mkdir((tmpdir + "/d").c_str(), 0755), 0);
+    {
+        LocalFs fs(tmpdir);
+        Nfs4Server srv(fs, tmpdir);
+        auto h = srv.get_handlers();
+        OverloadControl overload;
+        RpcCallHeader call;
+        call.program = NFS_PROGRAM;
+        call.version = NFS_V4;
+        call.procedure = NFSPROC4_COMPOUND;
+        call.overload = &overload;
+
+        auto run = [&](const XdrEncoder& req, std::vector<std::pair<uint32_t, uint32_t>>& ops) {
+            XdrDecoder dec(req.data().data(), req.size());
+            XdrEncoder reply;
+            h.procedures.at(NFSPROC4_COMPOUND)(call, dec, reply);
+            XdrDecoder rdec(reply.data().data(), reply.size());
+            uint32_t status = rdec.decode_uint32();
+            rdec.decode_string();
+            uint32_t n = rdec.decode_uint32();
+            ops.clear();
+            for (uint32_t i = 0; i < n; i++) {
+                uint32_t op = rdec.decode_uint32();
+                uint32_t st = rdec.decode_uint32();
+                ops.push_back({op, st});
+                if (op == static_cast<uint32_t>(Nfs4Op::OP_SECINFO) && st == 0) {
+                    rdec.decode_uint32();
+                    rdec.decode_uint32();
+                }
+                if (st != 0 || op == static_cast<uint32_t>(Nfs4Op::OP_READDIR)) break;
+            }
+            return status;
+        };
+        std::vector<std::pair<uint32_t, uint32_t>> ops;
+        const uint32_t kDelay = static_cast<uint32_t>(Nfs4Stat::NFS4ERR_DELAY);
+
+        // PUTROOTFH is cheap and runs; READDIR answers DELAY before running
+        XdrEncoder req;
+        req.encode_string("");
+        req.encode_uint32(0);
+        req.encode_uint32(2);
+        req.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_PUTROOTFH));
+        encode_readdir4(req);
+        EXPECT_EQ(run(req, ops), kDelay);
+        ASSERT_EQ(ops.size(), 2u);
+        EXPECT_EQ(ops[0].second, 0u);
+        EXPECT_EQ(ops[1].first, static_cast<uint32_t>(Nfs4Op::OP_READDIR));
+        EXPECT_EQ(ops[1].second, kDelay);
+        EXPECT_EQ(overload.shed_count(4), 1u);
+
+        // After an op that is neither cheap nor sheddable the compound is
+        // in progress and finishes
+        XdrEncoder req2;
+        req2.encode_string("");
+        req2.encode_uint32(0);
+        req2.encode_uint32(4);
+        req2.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_PUTROOTFH));
+        req2.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_SECINFO));
+        req2.encode_string("d");
+        req2.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_PUTROOTFH));
+        encode_readdir4(req2);
+        EXPECT_EQ(run(req2, ops), 0u);
+        ASSERT_EQ(ops.size(), 4u);
+        EXPECT_EQ(ops[3].first, static_cast<uint32_t>(Nfs4Op::OP_READDIR));
+        EXPECT_EQ(ops[3].second, 0u);
+        EXPECT_EQ(overload.shed_count(4), 1u);
+    }
+    std::string cmd = "rm -rf " + tmpdir;
+    system(cmd.c_str());
+}
+
+// RFC 7530 §9.1.7: a v4.0 client advances the open-owner's seqid even on
+// NFS4ERR_DELAY, so under overload an OPEN must run rather than be shed
+TEST(Nfs4Compound, V40OpenNotShedUnderOverload) {
+    char tmpl[] = "/tmp/nfs4_overload_XXXXXX";
+    char* dir = mkdtemp(tmpl);
+    ASSERT_NE(dir, nullptr);
+    std::string tmpdir = dir;
+    std::ofstream(tmpdir + "/f") << "data";
+    {
+        LocalFs fs(tmpdir);
+        Nfs4Server srv(fs, tmpdir);
+        auto h = srv.get_handlers();
+        RpcCallHeader call;
+        call.program = NFS_PROGRAM;
+        call.version = NFS_V4;
+        call.procedure = NFSPROC4_COMPOUND;
+
+        // Status of the compound, with rdec left at the last op's result
+        XdrEncoder reply;
+        auto run = [&](const XdrEncoder& req, XdrDecoder& rdec, uint32_t ops) {
+            XdrDecoder dec(req.data().data(), req.size());
+            reply.clear();
+            h.procedures.at(NFSPROC4_COMPOUND)(call, dec, reply);
+            rdec = XdrDecoder(reply.data().data(), reply.size());
+            uint32_t status = rdec.decode_uint32();
+            rdec.decode_string();
+            EXPECT_EQ(rdec.decode_uint32(), ops);
+            for (uint32_t i = 0; i + 1 < ops; i++) {
+                rdec.decode_uint32();
+                EXPECT_EQ(rdec.decode_uint32(), 0u);
+            }
+            rdec.decode_uint32();
+            rdec.decode_uint32();
+            return status;
+        };
+        auto compound = [](XdrEncoder& req, uint32_t ops) {
+            req.encode_string("");
+            req.encode_uint32(0);  // minorversion 0
+            req.encode_uint32(ops);
+        };
+        XdrDecoder rdec(nullptr, 0);
+
+        XdrEncoder setclientid;
+        compound(setclientid, 1);
+        setclientid.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_SETCLIENTID));
+        const uint8_t verifier[8] = {1};
+        setclientid.encode_opaque_fixed(verifier, 8);
+        setclientid.encode_string("client");
+        setclientid.encode_uint32(0);
+        setclientid.encode_string("");
+        setclientid.encode_string("");
+        setclientid.encode_uint32(0);
+        ASSERT_EQ(run(setclientid, rdec, 1), 0u);
+        uint64_t clientid = rdec.decode_uint64();
+        uint8_t confirm[8];
+        rdec.decode_opaque_fixed(confirm, 8);
+
+        XdrEncoder confirm_req;
+        compound(confirm_req, 1);
+        confirm_req.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_SETCLIENTID_CONFIRM));
+        confirm_req.encode_uint64(clientid);
+        confirm_req.encode_opaque_fixed(confirm, 8);
+        ASSERT_EQ(run(confirm_req, rdec, 1), 0u);
+
+        // Overloaded from here: PUTROOTFH and LOOKUP are cheap, so the
+        // OPEN would be next to shed. A reclaim, as the server is in grace.
+        OverloadControl overload;
+        call.overload = &overload;
+        XdrEncoder open;
+        compound(open, 3);
+        open.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_PUTROOTFH));
+        open.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_LOOKUP));
+        open.encode_string("f");
+        open.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_OPEN));
+        open.encode_uint32(1);  // seqid
+        open.encode_uint32(OPEN4_SHARE_ACCESS_READ);
+        open.encode_uint32(OPEN4_SHARE_DENY_NONE);
+        open.encode_uint64(clientid);
+        open.encode_string("owner");
+        open.encode_uint32(OPEN4_NOCREATE);
+        open.encode_uint32(CLAIM_PREVIOUS);
+        open.encode_uint32(OPEN_DELEGATE_NONE);
+        ASSERT_EQ(run(open, rdec, 3), 0u);
+        EXPECT_EQ(overload.shed_count(4), 0u);
+        uint32_t sid_seqid = rdec.decode_uint32();
+        uint8_t other[12];
+        rdec.decode_opaque_fixed(other, 12);
+
+        // The owner's seqid moved on with the client's: 2 is next
+        XdrEncoder open_confirm;
+        compound(open_confirm, 1);
+        open_confirm.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_OPEN_CONFIRM));
+        open_confirm.encode_uint32(sid_seqid);
+        open_confirm.encode_opaque_fixed(other, 12);
+        open_confirm.encode_uint32(2);
+        EXPECT_EQ(run(open_confirm, rdec, 1), 0u);
+
+        // A v4.0 READDIR is still shed
+        XdrEncoder req;
+        compound(req, 2);
+        req.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_PUTROOTFH));
+        encode_readdir4(req);
+        XdrDecoder dec(req.data().data(), req.size());
+        XdrEncoder delayed;
+        h.procedures.at(NFSPROC4_COMPOUND)(call, dec, delayed);
+        XdrDecoder ddec(delayed.data().data(), delayed.size());
+        EXPECT_EQ(ddec.decode_uint32(), static_cast<uint32_t>(Nfs4Stat::NFS4ERR_DELAY));
+        EXPECT_EQ(overload.shed_count(4), 1u);
+    }
+    std::string cmd = "rm -rf " + tmpdir;
+    system(cmd.c_str());
+}
+
+// Attributes without a trip to the file system, which allocates the
+// handle's path
+class FixedAttrFs : public LocalFs {
+public:
+    using LocalFs::LocalFs;
+    NfsStat3 getattr(const FileHandle&, Fattr3& attr) override {
+        attr = Fattr3{};
+        attr.type = Ftype3::NF3DIR;
+        attr.mode = 0755;
+        attr.nlink = 2;
+        attr.fileid = 2;
+        attr.mtime = {1700000000, 5};
+        return NfsStat3::NFS3_OK;
+    }
+};
+
+TEST(Nfs4Compound, SteadyStateCompoundDoesNotAllocate) {
+    char tmpl[] = "/tmp/nfs4_arena_XXXXXX";
+    char* dir = mkdtemp(tmpl);
+    ASSERT_NE(dir, nullptr);
+    std::string tmpdir = dir;
+    {
+        FixedAttrFs fs(tmpdir);
+        Nfs4Server srv(fs, tmpdir);
+        auto h = srv.get_handlers();
+        FileHandle root;
+        ASSERT_EQ(fs.get_root_fh("/", root), NfsStat3::NFS3_OK);
+
+        // AUTH_SYS with a long machine name and a few groups
+        XdrEncoder cred;
+        cred.encode_uint32(1);
+        cred.encode_string("client-with-a-long-name.example.com");
+        cred.encode_uint32(0);
+        cred.encode_uint32(0);
+        cred.encode_uint32(4);
+        for (uint32_t g = 0; g < 4; g++) cred.encode_uint32(100 + g);
+
+        // PUTFH, GETATTR of what a client asks after a lookup, GETFH
+        XdrEncoder req;
+        req.encode_string("a-tag-too-long-for-a-short-string");
+        req.encode_uint32(0);
+        req.encode_uint32(3);
+        req.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_PUTFH));
+        req.encode_opaque(root.data(), root.size());
+        req.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_GETATTR));
+        Bitmap4 bm;
+        for (uint32_t bit : {FATTR4_TYPE, FATTR4_CHANGE, FATTR4_SIZE, FATTR4_FSID, FATTR4_FILEID,
+                             FATTR4_MODE, FATTR4_NUMLINKS, FATTR4_OWNER, FATTR4_OWNER_GROUP,
+                             FATTR4_SPACE_USED, FATTR4_TIME_MODIFY})
+            bitmap_set(bm, bit);
+        encode_bitmap(req, bm);
+        req.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_GETFH));
+
+        RequestArena arena;
+        auto run = [&] {
+            uint32_t status;
+            {
+                RpcCallHeader call(&arena);
+                call.program = NFS_PROGRAM;
+                call.version = NFS_V4;
+                call.procedure = NFSPROC4_COMPOUND;
+                call.credential.flavor = RpcAuthFlavor::AUTH_SYS;
+                call.credential.body.assign(cred.data().begin(), cred.data().end());
+                XdrDecoder dec(req.data().data(), req.size());
+                XdrEncoder reply(&arena);
+                h.procedures.at(NFSPROC4_COMPOUND)(call, dec, reply);
+                XdrDecoder rdec(reply.data().data(), reply.size());
+                status = rdec.decode_uint32();
+            }
+            arena.reset();
+            return status;
+        };
+        EXPECT_EQ(run(), 0u);
+        EXPECT_EQ(run(), 0u);
+
+        const uint64_t before = t_allocs;
+        uint32_t failed = 0;
+        for (int i = 0; i < 50; i++) failed += run() != 0;
+        EXPECT_EQ(t_allocs - before, 0u);
+        EXPECT_EQ(failed, 0u);
+    }
+    std::string cmd = "rm -rf " + tmpdir;
+    system(cmd.c_str());
+}
+
 // --- Grace period tests ---
 
 TEST(Nfs4Grace, GracePeriodActive) {
@@ -880,7 +1229,7 @@ TEST(Nfs4Grace, ClaimNullDuringGrace) {
     auto [clientid, confirm] = mgr.set_clientid(verifier, cid);
     mgr.confirm_clientid(clientid, confirm.data());
 
-    FileHandle fh; fh.len = 16; fh.data[0] = 1;
+    FileHandle fh = test_fh(1);
     std::vector<uint8_t> owner = {1};
     Nfs4StateId stateid;
     bool needs_confirm;
@@ -914,7 +1263,7 @@ TEST(Nfs4Grace, ClaimPreviousDuringGrace) {
 
     // open_file works at state manager level even during grace
     // (the grace check is at the server level per claim type)
-    FileHandle fh; fh.len = 16; fh.data[0] = 1;
+    FileHandle fh = test_fh(1);
     std::vector<uint8_t> owner = {1};
     Nfs4StateId stateid;
     bool needs_confirm;
@@ -1045,10 +1394,9 @@ TEST(Nfs4Acl, EncodeFattr4Acl) {
     attr.fileid = 1;
     attr.fsid = 1;
 
-    FileHandle fh{};
-    fh.len = 16;
+    FileHandle fh = test_fh(0);
 
-    std::vector<uint32_t> requested;
+    Bitmap4 requested;
     bitmap_set(requested, FATTR4_ACL);
 
     XdrEncoder enc;
@@ -1081,10 +1429,9 @@ TEST(Nfs4Acl, AclsupportAttribute) {
     attr.fileid = 1;
     attr.fsid = 1;
 
-    FileHandle fh{};
-    fh.len = 16;
+    FileHandle fh = test_fh(0);
 
-    std::vector<uint32_t> requested;
+    Bitmap4 requested;
     bitmap_set(requested, FATTR4_ACLSUPPORT);
 
     XdrEncoder enc;
@@ -1105,7 +1452,7 @@ TEST(Nfs4Acl, DecodeSetAttrWithAcl) {
     XdrEncoder acl_enc;
     encode_acl4(acl_enc, acl);
 
-    std::vector<uint32_t> bm;
+    Bitmap4 bm;
     bitmap_set(bm, FATTR4_ACL);
 
     XdrEncoder payload;
@@ -1177,6 +1524,37 @@ TEST(Nfs4Session, ValidateSequenceBadSlot) {
     EXPECT_EQ(mgr.validate_sequence41(sid, 1, 1), Nfs4Stat::NFS4ERR_BADSLOT);
 }
 
+TEST(Nfs4Session, MultiSlotSequence) {
+    Nfs4StateManager mgr;
+    uint8_t verifier[8] = {};
+    auto [clientid, seqid] = mgr.exchange_id41(verifier, "test-client-ms");
+    SessionId41 sid{};
+    ASSERT_EQ(mgr.create_session41(clientid, seqid, sid, nullptr, 0, 4), Nfs4Stat::NFS4_OK);
+
+    uint32_t highest = 0;
+    EXPECT_EQ(mgr.validate_sequence41(sid, 1, 3, &highest), Nfs4Stat::NFS4_OK);
+    EXPECT_EQ(highest, 3u);
+    EXPECT_EQ(mgr.validate_sequence41(sid, 1, 4), Nfs4Stat::NFS4ERR_BADSLOT);
+
+    // Each slot keeps its own sequence
+    EXPECT_EQ(mgr.validate_sequence41(sid, 1, 0), Nfs4Stat::NFS4_OK);
+    EXPECT_EQ(mgr.validate_sequence41(sid, 2, 1), Nfs4Stat::NFS4ERR_SEQ_MISORDERED);
+    EXPECT_EQ(mgr.validate_sequence41(sid, 2, 3), Nfs4Stat::NFS4_OK);
+}
+
+TEST(Nfs4Session, SlotCountClamped) {
+    Nfs4StateManager mgr;
+    uint8_t verifier[8] = {};
+    auto [clientid, seqid] = mgr.exchange_id41(verifier, "test-client-sc");
+    SessionId41 sid{};
+    ASSERT_EQ(mgr.create_session41(clientid, seqid, sid, nullptr, 0, 100000),
+              Nfs4Stat::NFS4_OK);
+
+    uint32_t highest = 0;
+    EXPECT_EQ(mgr.validate_sequence41(sid, 1, 0, &highest), Nfs4Stat::NFS4_OK);
+    EXPECT_EQ(highest, NFS4_MAX_SESSION_SLOTS - 1);
+}
+
 TEST(Nfs4Session, DestroySession) {
     Nfs4StateManager mgr;
     uint8_t verifier[8] = {};
@@ -1188,3 +1566,303 @@ TEST(Nfs4Session, DestroySession) {
     // After destroy, validate must return BADSESSION
     EXPECT_EQ(mgr.validate_sequence41(sid, 1, 0), Nfs4Stat::NFS4ERR_BADSESSION);
 }
+
+// --- CB_NOTIFY_LOCK (RFC 8881 §20.11) ---
+
+struct NotifyLockFixture {
+    std::mutex mu;
+    std::condition_variable cv;
+    std::vector<std::vector<uint8_t>> cb_records;  // CALLs sent on the backchannel
+    int failed_sends = 0;                           // sends to fail, after recording
+    RpcBackChannel back_channel;
+
+    // Declared after the capture state so its notifier thread stops first
+    Nfs4StateManager mgr;
+    uint64_t clientid = 0;
+    SessionId41 sid{};
+    FileHandle fh;
+    Nfs4StateId open_stateid;
+
+    NotifyLockFixture() {
+        back_channel = [this](const uint8_t* data, size_t len) {
+            std::lock_guard<std::mutex> lk(mu);
+            cb_records.emplace_back(data, data + len);
+            cv.notify_all();
+            if (failed_sends == 0) return true;
+            failed_sends--;
+            return false;
+        };
+
+        uint8_t verifier[8] = {};
+        auto [cid, seqid] = mgr.exchange_id41(verifier, "notify-lock-client");
+        clientid = cid;
+        mgr.create_session41(clientid, seqid, sid, &back_channel, NFS4_CALLBACK);
+
+        fh = test_fh(77);
+        bool needs_confirm = false;
+        open_file_simple(mgr, clientid, {1}, 0, fh, OPEN4_SHARE_ACCESS_BOTH,
+                         OPEN4_SHARE_DENY_NONE, open_stateid, needs_confirm);
+        mgr.auto_confirm_open(open_stateid);
+    }
+
+    bool wait_for_records(size_t n) {
+        std::unique_lock<std::mutex> lk(mu);
+        return cv.wait_for(lk, std::chrono::seconds(2),
+                           [&] { return cb_records.size() >= n; });
+    }
+
+    // xid and csa_sequenceid of backchannel call i
+    std::pair<uint32_t, uint32_t> call_seq(size_t i) {
+        std::lock_guard<std::mutex> lk(mu);
+        XdrDecoder dec(cb_records.at(i).data(), cb_records[i].size());
+        uint32_t xid = dec.decode_uint32();
+        for (int k = 0; k < 5; k++) dec.decode_uint32();  // CALL .. procedure
+        dec.decode_uint32(); dec.decode_opaque();         // cred
+        dec.decode_uint32(); dec.decode_opaque();         // verf
+        dec.decode_string();                              // tag
+        for (int k = 0; k < 4; k++) dec.decode_uint32();  // minorversion .. OP_CB_SEQUENCE
+        SessionId41 sid{};
+        dec.decode_opaque_fixed(sid.data(), 16);
+        return {xid, dec.decode_uint32()};
+    }
+
+    // The client's answer to call xid, as read on the fore channel
+    void reply(uint32_t xid, Nfs4Stat cb_sequence_status) {
+        XdrEncoder enc;
+        enc.encode_uint32(xid);
+        enc.encode_uint32(1);                  // REPLY
+        enc.encode_uint32(0);                  // MSG_ACCEPTED
+        enc.encode_uint32(0);                  // verf flavor
+        enc.encode_opaque(nullptr, 0);
+        enc.encode_uint32(0);                  // SUCCESS
+        enc.encode_uint32(static_cast<uint32_t>(cb_sequence_status));
+        enc.encode_string("");
+        enc.encode_uint32(1);                  // resops
+        enc.encode_uint32(OP_CB_SEQUENCE);
+        enc.encode_uint32(static_cast<uint32_t>(cb_sequence_status));
+        mgr.backchannel_reply(enc.data().data(), enc.size());
+    }
+
+    // Two of the client's lock owners wait for a third's range; then it
+    // unlocks, and each waiter is notified
+    void notify_two_waiters() {
+        Nfs4LockOwner holder{clientid, {10}};
+        Nfs4StateId holder_sid, out;
+        Nfs4LockDenied denied;
+        mgr.lock_new(clientid, open_stateid, 0, holder, 0, fh, WRITE_LT, 0, 100, holder_sid,
+                     denied);
+        mgr.add_lock_waiter41(sid, Nfs4LockOwner{clientid, {20}}, fh, WRITE_LT, 0, 10);
+        mgr.add_lock_waiter41(sid, Nfs4LockOwner{clientid, {30}}, fh, WRITE_LT, 50, 10);
+        mgr.lock_unlock(holder_sid, 0, 0, 100, out);
+    }
+};
+
+TEST(Nfs4NotifyLock, NotifiedOnLocku) {
+    NotifyLockFixture f;
+    Nfs4LockOwner holder{f.clientid, {10}};
+    Nfs4LockOwner waiter{f.clientid, {20}};
+    Nfs4StateId holder_sid, waiter_sid;
+    Nfs4LockDenied denied;
+
+    ASSERT_EQ(f.mgr.lock_new(f.clientid, f.open_stateid, 0, holder, 0, f.fh,
+                             WRITE_LT, 0, 100, holder_sid, denied), Nfs4Stat::NFS4_OK);
+    ASSERT_EQ(f.mgr.lock_new(f.clientid, f.open_stateid, 0, waiter, 0, f.fh,
+                             WRITE_LT, 0, 100, waiter_sid, denied), Nfs4Stat::NFS4ERR_DENIED);
+    f.mgr.add_lock_waiter41(f.sid, waiter, f.fh, WRITE_LT, 0, 100);
+    EXPECT_EQ(f.mgr.lock_table().waiter_count(f.fh), 1u);
+
+    Nfs4StateId out;
+    ASSERT_EQ(f.mgr.lock_unlock(holder_sid, 0, 0, 100, out), Nfs4Stat::NFS4_OK);
+    ASSERT_TRUE(f.wait_for_records(1));
+
+    std::lock_guard<std::mutex> lk(f.mu);
+    const auto& rec = f.cb_records[0];
+    XdrDecoder dec(rec.data(), rec.size());
+    dec.decode_uint32();                           // xid
+    EXPECT_EQ(dec.decode_uint32(), 0u);            // CALL
+    dec.decode_uint32();                           // rpcvers
+    EXPECT_EQ(dec.decode_uint32(), NFS4_CALLBACK);
+    dec.decode_uint32();                           // version
+    EXPECT_EQ(dec.decode_uint32(), CB_COMPOUND);
+    dec.decode_uint32(); dec.decode_opaque();      // cred
+    dec.decode_uint32(); dec.decode_opaque();      // verf
+    dec.decode_string();                           // tag
+    EXPECT_EQ(dec.decode_uint32(), 1u);            // minorversion
+    dec.decode_uint32();                           // callback_ident
+    EXPECT_EQ(dec.decode_uint32(), 2u);            // num_ops
+
+    EXPECT_EQ(dec.decode_uint32(), OP_CB_SEQUENCE);
+    SessionId41 sid{};
+    dec.decode_opaque_fixed(sid.data(), 16);
+    EXPECT_EQ(sid, f.sid);
+    EXPECT_EQ(dec.decode_uint32(), 1u);            // csa_sequenceid
+    dec.decode_uint32(); dec.decode_uint32();      // slotid, highest_slotid
+    dec.decode_bool();                             // cachethis
+    EXPECT_EQ(dec.decode_uint32(), 0u);            // referring_call_lists
+
+    EXPECT_EQ(dec.decode_uint32(), OP_CB_NOTIFY_LOCK);
+    auto fh = dec.decode_opaque();
+    EXPECT_EQ(fh.size(), f.fh.size());
+    EXPECT_EQ(dec.decode_uint64(), f.clientid);
+    EXPECT_EQ(dec.decode_opaque(), waiter.owner);
+}
+
+TEST(Nfs4NotifyLock, SlotWaitsForTheReply) {
+    NotifyLockFixture f;
+    f.notify_two_waiters();
+    ASSERT_TRUE(f.wait_for_records(1));
+    auto [xid, seqid] = f.call_seq(0);
+    EXPECT_EQ(seqid, 1u);
+
+    // Slot 0 is busy until the client answers
+    EXPECT_FALSE(f.wait_for_records(2));
+    f.reply(xid, Nfs4Stat::NFS4_OK);
+    ASSERT_TRUE(f.wait_for_records(2));
+    EXPECT_EQ(f.call_seq(1).second, 2u);
+}
+
+TEST(Nfs4NotifyLock, FailedOrRefusedCallDoesNotAdvanceTheSlot) {
+    NotifyLockFixture f;
+    f.failed_sends = 1;
+    f.notify_two_waiters();
+    // The first send fails: the second call reuses its sequenceid
+    ASSERT_TRUE(f.wait_for_records(2));
+    EXPECT_EQ(f.call_seq(0).second, 1u);
+    auto [xid, seqid] = f.call_seq(1);
+    EXPECT_EQ(seqid, 1u);
+
+    // A CB_SEQUENCE the client refuses does not move the slot either
+    f.reply(xid, Nfs4Stat::NFS4ERR_SEQ_MISORDERED);
+    Nfs4StateId deleg_sid, open_sid, recall_sid;
+    bool needs_confirm = false;
+    uint32_t deleg_type = OPEN_DELEGATE_NONE;
+    Nfs4CallbackInfo recall_cb;
+    FileHandle recall_fh, fh = test_fh(80);
+    ASSERT_EQ(f.mgr.open_file(f.clientid, {1}, 0, fh, OPEN4_SHARE_ACCESS_BOTH,
+                              OPEN4_SHARE_DENY_NONE, open_sid, needs_confirm,
+                              deleg_type, deleg_sid, recall_cb, recall_sid, recall_fh),
+              Nfs4Stat::NFS4_OK);
+    ASSERT_EQ(deleg_type, OPEN_DELEGATE_WRITE);
+    uint8_t verifier[8] = {7};
+    auto [other, other_seq] = f.mgr.exchange_id41(verifier, "slot-other-client");
+    (void)other_seq;
+    Nfs4StateId other_sid;
+    EXPECT_EQ(open_file_simple(f.mgr, other, {2}, 0, fh, OPEN4_SHARE_ACCESS_READ,
+                               OPEN4_SHARE_DENY_NONE, other_sid, needs_confirm),
+              Nfs4Stat::NFS4ERR_DELAY);
+    ASSERT_TRUE(f.wait_for_records(3));
+    EXPECT_EQ(f.call_seq(2).second, 1u);
+}
+
+TEST(Nfs4NotifyLock, RetryClearsWaiter) {
+    NotifyLockFixture f;
+    Nfs4LockOwner holder{f.clientid, {10}};
+    Nfs4LockOwner waiter{f.clientid, {20}};
+    Nfs4StateId holder_sid, waiter_sid;
+    Nfs4LockDenied denied;
+
+    f.mgr.lock_new(f.clientid, f.open_stateid, 0, holder, 0, f.fh,
+                   READ_LT, 0, 10, holder_sid, denied);
+    f.mgr.add_lock_waiter41(f.sid, waiter, f.fh, WRITE_LT, 100, 10);
+
+    // The range never conflicted; the client's own retry succeeds and
+    // must drop the queued notification.
+    ASSERT_EQ(f.mgr.lock_new(f.clientid, f.open_stateid, 0, waiter, 0, f.fh,
+                             WRITE_LT, 100, 10, waiter_sid, denied), Nfs4Stat::NFS4_OK);
+    EXPECT_EQ(f.mgr.lock_table().waiter_count(f.fh), 0u);
+}
+
+TEST(Nfs4NotifyLock, NoWaiterWithoutBackchannel) {
+    Nfs4StateManager mgr;
+    uint8_t verifier[8] = {};
+    auto [clientid, seqid] = mgr.exchange_id41(verifier, "no-backchannel");
+    SessionId41 sid{};
+    ASSERT_EQ(mgr.create_session41(clientid, seqid, sid), Nfs4Stat::NFS4_OK);
+
+    FileHandle fh = test_fh(0);
+    Nfs4LockOwner owner{clientid, {1}};
+    mgr.add_lock_waiter41(sid, owner, fh, WRITE_LT, 0, 10);
+    EXPECT_EQ(mgr.lock_table().waiter_count(fh), 0u);
+}
+
+// --- CB_RECALL over a session backchannel (RFC 8881 §20.2) ---
+
+TEST(Nfs4Deleg41, RecallOverBackchannel) {
+    NotifyLockFixture f;
+    FileHandle fh = test_fh(79);
+
+    // A session with a backchannel is enough to be granted a delegation
+    Nfs4StateId open_sid, deleg_sid, recall_sid;
+    bool needs_confirm = false;
+    uint32_t deleg_type = OPEN_DELEGATE_NONE;
+    Nfs4CallbackInfo recall_cb;
+    FileHandle recall_fh;
+    ASSERT_EQ(f.mgr.open_file(f.clientid, {1}, 0, fh, OPEN4_SHARE_ACCESS_BOTH,
+                              OPEN4_SHARE_DENY_NONE, open_sid, needs_confirm,
+                              deleg_type, deleg_sid, recall_cb, recall_sid, recall_fh),
+              Nfs4Stat::NFS4_OK);
+    ASSERT_EQ(deleg_type, OPEN_DELEGATE_WRITE);
+
+    // A second client's OPEN conflicts; the recall goes out on the backchannel
+    uint8_t verifier[8] = {9};
+    auto [other, other_seq] = f.mgr.exchange_id41(verifier, "recall-other-client");
+    (void)other_seq;
+    Nfs4StateId other_sid;
+    EXPECT_EQ(open_file_simple(f.mgr, other, {2}, 0, fh, OPEN4_SHARE_ACCESS_READ,
+                               OPEN4_SHARE_DENY_NONE, other_sid, needs_confirm),
+              Nfs4Stat::NFS4ERR_DELAY);
+    ASSERT_TRUE(f.wait_for_records(1));
+
+    {
+        std::lock_guard<std::mutex> lk(f.mu);
+        const auto& rec = f.cb_records[0];
+        XdrDecoder dec(rec.data(), rec.size());
+        for (int i = 0; i < 6; i++) dec.decode_uint32();  // xid .. procedure
+        dec.decode_uint32(); dec.decode_opaque();          // cred
+        dec.decode_uint32(); dec.decode_opaque();          // verf
+        dec.decode_string();                               // tag
+        EXPECT_EQ(dec.decode_uint32(), 1u);                // minorversion
+        dec.decode_uint32();                               // callback_ident
+        EXPECT_EQ(dec.decode_uint32(), 2u);                // num_ops
+
+        EXPECT_EQ(dec.decode_uint32(), OP_CB_SEQUENCE);
+        SessionId41 sid{};
+        dec.decode_opaque_fixed(sid.data(), 16);
+        EXPECT_EQ(sid, f.sid);
+        EXPECT_EQ(dec.decode_uint32(), 1u);                // csa_sequenceid
+        dec.decode_uint32(); dec.decode_uint32();
+        dec.decode_bool();
+        dec.decode_uint32();
+
+        EXPECT_EQ(dec.decode_uint32(), OP_CB_RECALL);
+        Nfs4StateId recalled;
+        recalled.seqid = dec.decode_uint32();
+        dec.decode_opaque_fixed(recalled.other, 12);
+        EXPECT_EQ(recalled, deleg_sid);
+        EXPECT_FALSE(dec.decode_bool());                   // truncate
+        EXPECT_EQ(dec.decode_opaque().size(), fh.size());
+    }
+
+    // Once the holder returns it, the other client's OPEN goes through
+    ASSERT_EQ(f.mgr.delegreturn(deleg_sid), Nfs4Stat::NFS4_OK);
+    EXPECT_EQ(open_file_simple(f.mgr, other, {2}, 0, fh, OPEN4_SHARE_ACCESS_READ,
+                               OPEN4_SHARE_DENY_NONE, other_sid, needs_confirm),
+              Nfs4Stat::NFS4_OK);
+}
+
+TEST(Nfs4Deleg41, NoGrantAfterDestroySession) {
+    NotifyLockFixture f;
+    ASSERT_EQ(f.mgr.destroy_session41(f.sid), Nfs4Stat::NFS4_OK);
+
+    FileHandle fh = test_fh(78);
+    Nfs4StateId open_sid, deleg_sid, recall_sid;
+    bool needs_confirm = false;
+    uint32_t deleg_type = OPEN_DELEGATE_NONE;
+    Nfs4CallbackInfo recall_cb;
+    FileHandle recall_fh;
+    ASSERT_EQ(f.mgr.open_file(f.clientid, {3}, 0, fh, OPEN4_SHARE_ACCESS_READ,
+                              OPEN4_SHARE_DENY_NONE, open_sid, needs_confirm,
+                              deleg_type, deleg_sid, recall_cb, recall_sid, recall_fh),
+              Nfs4Stat::NFS4_OK);
+    EXPECT_EQ(deleg_type, OPEN_DELEGATE_NONE);
+}
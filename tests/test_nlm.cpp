@@ -2,6 +2,12 @@
 #include "nlm/nlm_types.h"
 #include "nlm/nlm_server.h"
 #include "nsm/nsm_client.h"
+#include "rpc/rpc_server.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 
 TEST(NlmTypes, ProgramAndVersion) {
     EXPECT_EQ(NLM_PROGRAM, 100021u);
@@ -44,3 +50,303 @@ TEST(NsmTypes, ProcedureNumbers) {
     EXPECT_EQ(SM_UNMON, 3u);
     EXPECT_EQ(SM_UNMON_ALL, 4u);
 }
+
+// --- Blocking locks ---
+
+static void encode_nlm4_lock(XdrEncoder& enc, const std::string& caller,
+                             uint32_t svid, uint8_t fh_id,
+                             uint64_t offset, uint64_t length) {
+    enc.encode_string(caller);
+    uint8_t fh[8] = {fh_id};
+    enc.encode_opaque(fh, sizeof(fh));
+    uint8_t oh[4] = {1, 2, 3, 4};
+    enc.encode_opaque(oh, sizeof(oh));
+    enc.encode_uint32(svid);
+    enc.encode_uint64(offset);
+    enc.encode_uint64(length);
+}
+
+static NlmStat call_nlm(RpcProgramHandlers& h, uint32_t proc, const XdrEncoder& args) {
+    RpcCallHeader call;
+    call.program = NLM_PROGRAM;
+    call.version = NLM_V4;
+    call.procedure = proc;
+    XdrDecoder dec(args.data().data(), args.size());
+    XdrEncoder reply;
+    h.procedures.at(proc)(call, dec, reply);
+    XdrDecoder res(reply.data().data(), reply.size());
+    res.decode_opaque();  // cookie
+    return static_cast<NlmStat>(res.decode_uint32());
+}
+
+static NlmStat nlm_lock(RpcProgramHandlers& h, const std::string& caller, uint32_t svid,
+                        uint8_t fh_id, bool block, uint64_t offset, uint64_t length) {
+    XdrEncoder enc;
+    enc.encode_opaque("c", 1);
+    enc.encode_bool(block);
+    enc.encode_bool(true);  // exclusive
+    encode_nlm4_lock(enc, caller, svid, fh_id, offset, length);
+    enc.encode_bool(false);  // reclaim
+    enc.encode_uint32(0);    // state
+    return call_nlm(h, NLMPROC4_LOCK, enc);
+}
+
+static NlmStat nlm_unlock(RpcProgramHandlers& h, const std::string& caller, uint32_t svid,
+                          uint8_t fh_id, uint64_t offset, uint64_t length) {
+    XdrEncoder enc;
+    enc.encode_opaque("c", 1);
+    encode_nlm4_lock(enc, caller, svid, fh_id, offset, length);
+    return call_nlm(h, NLMPROC4_UNLOCK, enc);
+}
+
+static NlmStat nlm_cancel(RpcProgramHandlers& h, const std::string& caller, uint32_t svid,
+                          uint8_t fh_id, uint64_t offset, uint64_t length) {
+    XdrEncoder enc;
+    enc.encode_opaque("c", 1);
+    enc.encode_bool(true);  // block
+    enc.encode_bool(true);  // exclusive
+    encode_nlm4_lock(enc, caller, svid, fh_id, offset, length);
+    return call_nlm(h, NLMPROC4_CANCEL, enc);
+}
+
+TEST(NlmBlocking, GrantedCallbackAfterUnlock) {
+    // Stand-in for the client's NLM service, receiving NLMPROC4_GRANTED
+    std::mutex mu;
+    std::condition_variable cv;
+    std::vector<uint32_t> granted_svids;
+
+    RpcServer client_nlm;
+    RpcProgramHandlers cb;
+    cb.procedures[NLMPROC4_GRANTED] = [&](const RpcCallHeader&, XdrDecoder& args, XdrEncoder& reply) {
+        auto cookie = args.decode_opaque();
+        args.decode_bool();    // exclusive
+        args.decode_string();  // caller_name
+        args.decode_opaque();  // fh
+        args.decode_opaque();  // oh
+        uint32_t svid = args.decode_uint32();
+        reply.encode_opaque(cookie.data(), cookie.size());
+        reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_GRANTED));
+        std::lock_guard<std::mutex> lk(mu);
+        granted_svids.push_back(svid);
+        cv.notify_all();
+    };
+    client_nlm.register_program(NLM_PROGRAM, NLM_V4, cb);
+    client_nlm.start(0);
+    uint16_t cb_port = client_nlm.port();
+
+    ByteRangeLockTable table;
+    NlmServer srv(table);
+    srv.set_port_resolver([cb_port](const std::string&) { return cb_port; });
+    auto h = srv.get_handlers();
+
+    EXPECT_EQ(nlm_lock(h, "127.0.0.1", 1, 7, false, 0, 100), NlmStat::LCK_GRANTED);
+    EXPECT_EQ(nlm_lock(h, "127.0.0.1", 2, 7, false, 0, 100), NlmStat::LCK_DENIED);
+    EXPECT_EQ(nlm_lock(h, "127.0.0.1", 2, 7, true, 0, 100), NlmStat::LCK_BLOCKED);
+
+    EXPECT_EQ(nlm_unlock(h, "127.0.0.1", 1, 7, 0, 100), NlmStat::LCK_GRANTED);
+
+    {
+        std::unique_lock<std::mutex> lk(mu);
+        ASSERT_TRUE(cv.wait_for(lk, std::chrono::seconds(5),
+                                [&] { return !granted_svids.empty(); }));
+        EXPECT_EQ(granted_svids[0], 2u);
+    }
+
+    // svid 2 now holds the lock
+    EXPECT_EQ(nlm_lock(h, "127.0.0.1", 1, 7, false, 0, 100), NlmStat::LCK_DENIED);
+    client_nlm.stop();
+}
+
+TEST(NlmBlocking, UnreachableHostDoesNotDelayOtherGrants) {
+    std::mutex mu;
+    std::condition_variable cv;
+    std::vector<uint32_t> granted_svids;
+
+    RpcServer client_nlm;
+    RpcProgramHandlers cb;
+    cb.procedures[NLMPROC4_GRANTED] = [&](const RpcCallHeader&, XdrDecoder& args, XdrEncoder& reply) {
+        auto cookie = args.decode_opaque();
+        args.decode_bool();    // exclusive
+        args.decode_string();  // caller_name
+        args.decode_opaque();  // fh
+        args.decode_opaque();  // oh
+        uint32_t svid = args.decode_uint32();
+        reply.encode_opaque(cookie.data(), cookie.size());
+        reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_GRANTED));
+        std::lock_guard<std::mutex> lk(mu);
+        granted_svids.push_back(svid);
+        cv.notify_all();
+    };
+    client_nlm.register_program(NLM_PROGRAM, NLM_V4, cb);
+    client_nlm.start(0);
+    uint16_t cb_port = client_nlm.port();
+
+    // Looking up "deadhost" hangs, as GETPORT to a firewalled host does
+    bool released = false;
+    ByteRangeLockTable table;
+    NlmServer srv(table);
+    srv.set_port_resolver([&](const std::string& host) {
+        if (host != "deadhost") return cb_port;
+        std::unique_lock<std::mutex> lk(mu);
+        cv.wait_for(lk, std::chrono::seconds(10), [&] { return released; });
+        return uint16_t(0);
+    });
+    auto h = srv.get_handlers();
+
+    // deadhost's lock is granted first, 127.0.0.1's right after
+    EXPECT_EQ(nlm_lock(h, "holder", 1, 4, false, 0, 20), NlmStat::LCK_GRANTED);
+    EXPECT_EQ(nlm_lock(h, "deadhost", 1, 4, true, 0, 10), NlmStat::LCK_BLOCKED);
+    EXPECT_EQ(nlm_lock(h, "127.0.0.1", 2, 4, true, 10, 10), NlmStat::LCK_BLOCKED);
+    EXPECT_EQ(nlm_unlock(h, "holder", 1, 4, 0, 20), NlmStat::LCK_GRANTED);
+    {
+        std::unique_lock<std::mutex> lk(mu);
+        ASSERT_TRUE(cv.wait_for(lk, std::chrono::seconds(5),
+                                [&] { return !granted_svids.empty(); }));
+        EXPECT_EQ(granted_svids[0], 2u);
+        released = true;
+        cv.notify_all();
+    }
+    client_nlm.stop();
+}
+
+TEST(NlmBlocking, CancelQueuedRequest) {
+    ByteRangeLockTable table;
+    NlmServer srv(table);
+    srv.set_port_resolver([](const std::string&) { return uint16_t(0); });
+    auto h = srv.get_handlers();
+
+    EXPECT_EQ(nlm_lock(h, "hostA", 1, 3, false, 0, 0), NlmStat::LCK_GRANTED);
+    EXPECT_EQ(nlm_lock(h, "hostB", 1, 3, true, 0, 0), NlmStat::LCK_BLOCKED);
+
+    EXPECT_EQ(nlm_cancel(h, "hostB", 1, 3, 0, 0), NlmStat::LCK_GRANTED);
+    // Nothing left to cancel
+    EXPECT_EQ(nlm_cancel(h, "hostB", 1, 3, 0, 0), NlmStat::LCK_DENIED);
+
+    uint8_t data[8] = {3};
+    FileHandle fh(data, sizeof(data));
+    EXPECT_EQ(table.waiter_count(fh), 0u);
+
+    // Unlock does not hand the range to the cancelled request
+    nlm_unlock(h, "hostA", 1, 3, 0, 0);
+    LockConflict conflict;
+    EXPECT_FALSE(table.test(fh, "other", true, 0, UINT64_MAX, conflict));
+}
+
+TEST(NlmBlocking, DeadlockRejected) {
+    ByteRangeLockTable table;
+    NlmServer srv(table);
+    srv.set_port_resolver([](const std::string&) { return uint16_t(0); });
+    auto h = srv.get_handlers();
+
+    EXPECT_EQ(nlm_lock(h, "hostA", 1, 1, false, 0, 10), NlmStat::LCK_GRANTED);
+    EXPECT_EQ(nlm_lock(h, "hostB", 1, 2, false, 0, 10), NlmStat::LCK_GRANTED);
+    // A waits for B's file
+    EXPECT_EQ(nlm_lock(h, "hostA", 1, 2, true, 0, 10), NlmStat::LCK_BLOCKED);
+    // B waiting for A's file would deadlock
+    EXPECT_EQ(nlm_lock(h, "hostB", 1, 1, true, 0, 10), NlmStat::LCK_DEADLCK);
+}
+
+TEST(NlmBlocking, RebootNotifyDropsTheClientsQueuedRequests) {
+    ByteRangeLockTable table;
+    NlmServer srv(table);
+    srv.set_port_resolver([](const std::string&) { return uint16_t(0); });
+    NsmClient nsm(table);
+    nsm.set_reboot_handler([&srv](const std::string& name) { srv.free_client(name); });
+    auto h = srv.get_handlers();
+
+    // hostB holds the range, and another of its processes waits for it
+    EXPECT_EQ(nlm_lock(h, "hostB", 1, 5, false, 0, 10), NlmStat::LCK_GRANTED);
+    EXPECT_EQ(nlm_lock(h, "hostB", 2, 5, true, 0, 10), NlmStat::LCK_BLOCKED);
+    uint8_t data[8] = {5};
+    FileHandle fh(data, sizeof(data));
+    EXPECT_EQ(table.waiter_count(fh), 1u);
+
+    // After the reboot the range goes to nobody from the old instance
+    nsm.handle_notify("hostB");
+    EXPECT_EQ(table.waiter_count(fh), 0u);
+    EXPECT_EQ(nlm_lock(h, "hostC", 1, 5, false, 0, 10), NlmStat::LCK_GRANTED);
+}
+
+TEST(NlmBlocking, UpgradeCarriesBlockedAndGrantedRequests) {
+    std::mutex mu;
+    std::condition_variable cv;
+    std::vector<uint32_t> granted_svids;
+
+    RpcServer client_nlm;
+    RpcProgramHandlers cb;
+    cb.procedures[NLMPROC4_GRANTED] = [&](const RpcCallHeader&, XdrDecoder& args, XdrEncoder& reply) {
+        auto cookie = args.decode_opaque();
+        args.decode_bool();    // exclusive
+        args.decode_string();  // caller_name
+        args.decode_opaque();  // fh
+        args.decode_opaque();  // oh
+        uint32_t svid = args.decode_uint32();
+        reply.encode_opaque(cookie.data(), cookie.size());
+        reply.encode_uint32(static_cast<uint32_t>(NlmStat::LCK_GRANTED));
+        std::lock_guard<std::mutex> lk(mu);
+        granted_svids.push_back(svid);
+        cv.notify_all();
+    };
+    client_nlm.register_program(NLM_PROGRAM, NLM_V4, cb);
+    client_nlm.start(0);
+    uint16_t cb_port = client_nlm.port();
+
+    // The old process cannot reach the client until told to
+    bool resolving = false;
+    bool reachable = false;
+    ByteRangeLockTable old_table;
+    auto old_srv = std::make_unique<NlmServer>(old_table);
+    old_srv->set_port_resolver([&](const std::string&) {
+        std::unique_lock<std::mutex> lk(mu);
+        resolving = true;
+        cv.notify_all();
+        cv.wait_for(lk, std::chrono::seconds(10), [&] { return reachable; });
+        return cb_port;
+    });
+    auto old_h = old_srv->get_handlers();
+
+    // svid 1 holds the lock, 2 and 3 wait; 2 is granted when 1 unlocks, but
+    // its callback is still being sent at the upgrade
+    EXPECT_EQ(nlm_lock(old_h, "127.0.0.1", 1, 9, false, 0, 100), NlmStat::LCK_GRANTED);
+    EXPECT_EQ(nlm_lock(old_h, "127.0.0.1", 2, 9, true, 0, 100), NlmStat::LCK_BLOCKED);
+    EXPECT_EQ(nlm_lock(old_h, "127.0.0.1", 3, 9, true, 0, 100), NlmStat::LCK_BLOCKED);
+    EXPECT_EQ(nlm_unlock(old_h, "127.0.0.1", 1, 9, 0, 100), NlmStat::LCK_GRANTED);
+    {
+        std::unique_lock<std::mutex> lk(mu);
+        ASSERT_TRUE(cv.wait_for(lk, std::chrono::seconds(5), [&] { return resolving; }));
+    }
+
+    // Hand over as a binary upgrade does: the lock table, then NLM's image
+    XdrEncoder image;
+    old_srv->save_state(image);
+    ByteRangeLockTable table;
+    table.restore(old_table.entries());
+    NlmServer srv(table);
+    srv.set_port_resolver([cb_port](const std::string&) { return cb_port; });
+    XdrDecoder dec(image.data().data(), image.size());
+    ASSERT_TRUE(srv.restore_state(dec));
+    uint8_t data[8] = {9};
+    FileHandle fh(data, sizeof(data));
+    EXPECT_EQ(table.waiter_count(fh), 1u);
+
+    // The new process sends svid 2's callback, and grants svid 3 next
+    auto h = srv.get_handlers();
+    {
+        std::unique_lock<std::mutex> lk(mu);
+        ASSERT_TRUE(cv.wait_for(lk, std::chrono::seconds(5),
+                                [&] { return !granted_svids.empty(); }));
+        EXPECT_EQ(granted_svids[0], 2u);
+    }
+    EXPECT_EQ(nlm_lock(h, "127.0.0.1", 1, 9, false, 0, 100), NlmStat::LCK_DENIED);
+    EXPECT_EQ(nlm_unlock(h, "127.0.0.1", 2, 9, 0, 100), NlmStat::LCK_GRANTED);
+    {
+        std::unique_lock<std::mutex> lk(mu);
+        ASSERT_TRUE(cv.wait_for(lk, std::chrono::seconds(5),
+                                [&] { return granted_svids.size() >= 2; }));
+        EXPECT_EQ(granted_svids[1], 3u);
+        reachable = true;
+        cv.notify_all();
+    }
+    old_srv.reset();
+    client_nlm.stop();
+}
@@ -1,15 +1,44 @@
 #include <gtest/gtest.h>
+#include "rpc/rpc_handoff.h"
+#include "rpc/rpc_numa.h"
+#include "rpc/rpc_overload.h"
+#include "rpc/rpc_qos.h"
 #include "rpc/rpc_server.h"
 #include "rpc/rpc_types.h"
 #include "rpc/rpc_tls.h"
 #include "rpc/portmapper.h"
 
+#include <sched.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <new>
 #include <thread>
 #include <chrono>
 
+// Heap allocations by this thread, for the request-arena tests
+static thread_local uint64_t t_allocs = 0;
+
+void* operator new(std::size_t n) {
+    t_allocs++;
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new(std::size_t n, std::align_val_t al) {
+    t_allocs++;
+    const size_t a = static_cast<size_t>(al);
+    if (void* p = std::aligned_alloc(a, (n + a - 1) / a * a)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
 TEST(RpcTypes, AuthSysParse) {
     // Encode a fake AUTH_SYS body.
     XdrEncoder enc;
@@ -23,7 +52,7 @@ TEST(RpcTypes, AuthSysParse) {
 
     RpcOpaqueAuth auth;
     auth.flavor = RpcAuthFlavor::AUTH_SYS;
-    auth.body = std::vector<uint8_t>(enc.data().begin(), enc.data().end());
+    auth.body.assign(enc.data().begin(), enc.data().end());
 
     auto sys = RpcServer::parse_auth_sys(auth);
     EXPECT_EQ(sys.stamp, 12345u);
@@ -219,8 +248,765 @@ TEST(RpcServer, SendTcpErrorHandling) {
     // If we get here without crash/hang, the test passes
 }
 
+TEST(RpcCapture, CapturesCallsAndReplies) {
+    char tmpl[] = "/tmp/nfs_capture_XXXXXX";
+    int tmp_fd = mkstemp(tmpl);
+    ASSERT_GE(tmp_fd, 0);
+    close(tmp_fd);
+
+    {
+        RpcCapture capture(tmpl, true);
+        ASSERT_TRUE(capture.open());
+        RpcServer server;
+        RpcProgramHandlers handlers;
+        handlers.procedures[0] = [](const RpcCallHeader&, XdrDecoder&, XdrEncoder&) {};
+        server.register_program(100003, 3, std::move(handlers));
+        server.set_capture(&capture);
+        server.start(0);
+
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        ASSERT_GE(fd, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(server.port());
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+        for (uint32_t xid : {0x51u, 0x52u}) {
+            auto framed = frame_record(make_rpc_call(xid, 2, 100003, 3, 0));
+            send(fd, framed.data(), framed.size(), 0);
+            EXPECT_FALSE(read_reply(fd).empty());
+        }
+        close(fd);
+        server.stop();
+        EXPECT_EQ(capture.captured(), 4u);
+        EXPECT_EQ(capture.dropped(), 0u);
+    }
+
+    RpcCaptureReader reader(tmpl);
+    ASSERT_TRUE(reader.open());
+    EXPECT_TRUE(reader.replies());
+    std::vector<CaptureRecord> records;
+    CaptureRecord rec;
+    while (reader.next(rec)) records.push_back(rec);
+    ASSERT_EQ(records.size(), 4u);
+    const CaptureKind kinds[] = {CaptureKind::RECEIVED, CaptureKind::SENT,
+                                 CaptureKind::RECEIVED, CaptureKind::SENT};
+    for (size_t i = 0; i < records.size(); i++) {
+        EXPECT_EQ(records[i].kind, kinds[i]);
+        EXPECT_EQ(records[i].conn, records[0].conn);
+        if (i) EXPECT_GE(records[i].ts_ns, records[i - 1].ts_ns);
+        XdrDecoder dec(records[i].data.data(), records[i].data.size());
+        EXPECT_EQ(dec.decode_uint32(), i < 2 ? 0x51u : 0x52u);
+    }
+    EXPECT_EQ(records[0].data, make_rpc_call(0x51, 2, 100003, 3, 0));
+    unlink(tmpl);
+}
+
+TEST(RpcCapture, DropsWhatDoesNotFit) {
+    char tmpl[] = "/tmp/nfs_capture_XXXXXX";
+    int tmp_fd = mkstemp(tmpl);
+    ASSERT_GE(tmp_fd, 0);
+    close(tmp_fd);
+
+    std::vector<uint8_t> msg(100, 7);
+    {
+        // Room for one record in the buffer and two in the file
+        RpcCapture capture(tmpl, false, kCaptureRecordHeaderSize + msg.size(),
+                           kCaptureHeaderSize + 2 * (kCaptureRecordHeaderSize + msg.size()));
+        capture.record(CaptureKind::RECEIVED, 1, msg.data(), msg.size());
+        capture.record(CaptureKind::RECEIVED, 1, msg.data(), msg.size());
+        capture.flush();
+        capture.record(CaptureKind::RECEIVED, 2, msg.data(), msg.size());
+        capture.flush();
+        capture.record(CaptureKind::RECEIVED, 3, msg.data(), msg.size());
+        EXPECT_EQ(capture.captured(), 2u);
+        EXPECT_EQ(capture.dropped(), 2u);
+        const uint64_t held = capture.memory_bytes();
+        EXPECT_GE(held, kCaptureRecordHeaderSize + msg.size());
+        EXPECT_EQ(capture.trim(), held);
+        EXPECT_EQ(capture.memory_bytes(), 0u);
+    }
+
+    RpcCaptureReader reader(tmpl);
+    ASSERT_TRUE(reader.open());
+    EXPECT_FALSE(reader.replies());
+    CaptureRecord rec;
+    ASSERT_TRUE(reader.next(rec));
+    EXPECT_EQ(rec.conn, 1u);
+    EXPECT_EQ(rec.data, msg);
+    ASSERT_TRUE(reader.next(rec));
+    EXPECT_EQ(rec.conn, 2u);
+    EXPECT_FALSE(reader.next(rec));
+    unlink(tmpl);
+}
+
+TEST(RpcQos, ParsesPolicies) {
+    QosPolicy p;
+    std::string err;
+    ASSERT_TRUE(QosPolicy::parse("scope=client,match=10.0.0.*,shared,iops=500,bw=2M,burst=1s",
+                                 p, err)) << err;
+    EXPECT_EQ(p.scope, QosScope::CLIENT);
+    EXPECT_TRUE(p.shared);
+    EXPECT_DOUBLE_EQ(p.ops_per_sec, 500);
+    EXPECT_EQ(p.bytes_per_sec, 2u << 20);
+    EXPECT_EQ(p.burst_ns, 1000000000u);
+    EXPECT_TRUE(p.matches("10.0.0.7"));
+    EXPECT_FALSE(p.matches("10.0.1.7"));
+
+    ASSERT_TRUE(QosPolicy::parse("scope=uid,match=1000,bw=10K", p, err)) << err;
+    EXPECT_TRUE(p.matches("1000"));
+    EXPECT_FALSE(p.matches("10000"));
+
+    EXPECT_FALSE(QosPolicy::parse("iops=5", p, err));             // no scope
+    EXPECT_FALSE(QosPolicy::parse("scope=export", p, err));       // no limit
+    EXPECT_FALSE(QosPolicy::parse("scope=host,iops=5", p, err));
+    EXPECT_FALSE(QosPolicy::parse("scope=uid,iops=-1", p, err));
+    EXPECT_FALSE(QosPolicy::parse("scope=uid,iops=5,burst=2", p, err));
+}
+
+TEST(RpcQos, QueuesCallsOverTheLimit) {
+    QosPolicy p;
+    std::string err;
+    // 100 ops/s: 10ms per call, the first two free
+    ASSERT_TRUE(QosPolicy::parse("scope=client,iops=100,burst=10ms", p, err)) << err;
+    RpcQos qos;
+    EXPECT_FALSE(qos.active());
+    qos.set_policies({p});
+    EXPECT_TRUE(qos.active());
+
+    const std::string a = "10.0.0.1", b = "10.0.0.2";
+    QosRequest ra, rb;
+    ra.client = &a;
+    rb.client = &b;
+    const uint64_t t0 = 1000000000;
+    EXPECT_EQ(qos.admit(ra, t0), 0u);
+    EXPECT_EQ(qos.admit(ra, t0), 0u);
+    // Each later call waits for those ahead of it
+    EXPECT_EQ(qos.admit(ra, t0), 10000000u);
+    EXPECT_EQ(qos.admit(ra, t0), 20000000u);
+    // Another client has a bucket of its own
+    EXPECT_EQ(qos.admit(rb, t0), 0u);
+    // The backlog drains at the limit
+    EXPECT_EQ(qos.admit(ra, t0 + 40000000), 0u);
+
+    EXPECT_EQ(qos.throttled(QosScope::CLIENT), 2u);
+    EXPECT_EQ(qos.delay_ns(QosScope::CLIENT), 30000000u);
+    EXPECT_EQ(qos.bucket_count(), 2u);
+    EXPECT_NE(qos.report(10).find("10.0.0.1"), std::string::npos);
+}
+
+TEST(RpcQos, ChargesBytesAndAppliesTheTightestPolicy) {
+    QosPolicy per_uid, one_uid;
+    std::string err;
+    ASSERT_TRUE(QosPolicy::parse("scope=uid,bw=1M,burst=0s", per_uid, err)) << err;
+    ASSERT_TRUE(QosPolicy::parse("scope=uid,match=1000,bw=512K,burst=0s", one_uid, err)) << err;
+    RpcQos qos;
+    qos.set_policies({per_uid, one_uid});
+
+    const std::string client = "10.0.0.1";
+    const uint32_t u1000 = 1000, u2000 = 2000;
+    QosRequest r;
+    r.client = &client;
+    r.bytes = 512 * 1024;
+    const uint64_t t0 = 1000000000;
+
+    // The first call goes into debt; the next pays it off
+    r.uid = &u2000;
+    EXPECT_EQ(qos.admit(r, t0), 0u);
+    EXPECT_EQ(qos.admit(r, t0), 500000000u);
+    r.uid = &u1000;
+    EXPECT_EQ(qos.admit(r, t0), 0u);
+    EXPECT_EQ(qos.admit(r, t0), 1000000000u);
+    // Without AUTH_SYS no uid policy applies
+    r.uid = nullptr;
+    EXPECT_EQ(qos.admit(r, t0), 0u);
+    EXPECT_EQ(qos.admit(r, t0), 0u);
+
+    // Bytes charged after a call hold back the next one only
+    qos.set_policies({});
+    EXPECT_FALSE(qos.active());
+    QosPolicy per_client;
+    ASSERT_TRUE(QosPolicy::parse("scope=client,bw=1M,burst=0s", per_client, err)) << err;
+    qos.set_policies({per_client});
+    r.bytes = 0;
+    EXPECT_EQ(qos.admit(r, t0), 0u);
+    r.bytes = 1 << 20;
+    qos.charge(r, t0);
+    r.bytes = 0;
+    EXPECT_EQ(qos.admit(r, t0), 1000000000u);
+}
+
+TEST(RpcQos, ReloadKeepsUnchangedPolicies) {
+    QosPolicy p, q;
+    std::string err;
+    ASSERT_TRUE(QosPolicy::parse("scope=export,iops=1,burst=0s", p, err)) << err;
+    ASSERT_TRUE(QosPolicy::parse("scope=client,iops=1000", q, err)) << err;
+    RpcQos qos;
+    qos.set_policies({p});
+    const std::string exp = "/srv";
+    QosRequest r;
+    r.export_name = &exp;
+    EXPECT_EQ(qos.admit(r, 0), 0u);
+    // Same policy, same backlog
+    qos.set_policies({q, p});
+    EXPECT_EQ(qos.policy_count(), 2u);
+    EXPECT_EQ(qos.admit(r, 0), 1000000000u);
+    // A changed policy starts afresh
+    ASSERT_TRUE(QosPolicy::parse("scope=export,iops=2,burst=0s", p, err)) << err;
+    qos.set_policies({p});
+    EXPECT_EQ(qos.admit(r, 0), 0u);
+}
+
+TEST(RpcQos, ReclaimsIdleBuckets) {
+    QosPolicy p;
+    std::string err;
+    ASSERT_TRUE(QosPolicy::parse("scope=client,iops=1,burst=0s", p, err)) << err;
+    RpcQos qos;
+    qos.set_policies({p});
+    const std::string a = "10.0.0.1", b = "10.0.0.2";
+    QosRequest r;
+    r.client = &a;
+    qos.admit(r, 0);
+    r.client = &b;
+    qos.admit(r, 5000000000);
+    const uint64_t two = qos.memory_bytes();
+    EXPECT_GT(two, 0u);
+    // At 3s only a's bucket has drained
+    EXPECT_EQ(qos.reclaim(UINT64_MAX, 3000000000), two / 2);
+    EXPECT_EQ(qos.bucket_count(), 1u);
+    EXPECT_EQ(qos.memory_bytes(), two / 2);
+    qos.set_policies({});
+    EXPECT_EQ(qos.memory_bytes(), 0u);
+}
+
+TEST(RpcQos, CallBytesFromReadAndWriteCounts) {
+    RpcCallHeader call;
+    call.program = NFS_PROGRAM;
+    call.version = NFS_V3;
+    call.procedure = 6;  // READ
+    XdrEncoder args;
+    const uint8_t fh[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    args.encode_opaque(fh, sizeof(fh));
+    args.encode_uint64(4096);
+    args.encode_uint32(65536);
+    EXPECT_EQ(RpcQos::call_bytes(call, args.data().data(), args.size(), 200), 65536u);
+    call.procedure = 1;  // GETATTR
+    EXPECT_EQ(RpcQos::call_bytes(call, args.data().data(), args.size(), 200), 0u);
+    call.procedure = 6;
+    EXPECT_EQ(RpcQos::call_bytes(call, args.data().data(), 4, 200), 0u);  // truncated
+    call.version = 4;
+    EXPECT_EQ(RpcQos::call_bytes(call, args.data().data(), args.size(), 200), 200u);
+    call.program = MOUNT_PROGRAM;
+    EXPECT_EQ(RpcQos::call_bytes(call, args.data().data(), args.size(), 200), 0u);
+}
+
+TEST(RpcQos, ServerHoldsThrottledCalls) {
+    QosPolicy p;
+    std::string err;
+    ASSERT_TRUE(QosPolicy::parse("scope=client,iops=20,burst=0s", p, err)) << err;
+    RpcQos qos;
+    qos.set_policies({p});
+
+    RpcServer server;
+    RpcProgramHandlers handlers;
+    handlers.procedures[0] = [](const RpcCallHeader&, XdrDecoder&, XdrEncoder&) {};
+    handlers.procedures[1] = [](const RpcCallHeader&, XdrDecoder&, XdrEncoder&) {};
+    server.register_program(NFS_PROGRAM, NFS_V3, std::move(handlers));
+    server.set_qos(&qos);
+    server.start(0);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_GE(fd, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server.port());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+
+    auto call = [&](uint32_t xid, uint32_t proc) {
+        auto framed = frame_record(make_rpc_call(xid, 2, NFS_PROGRAM, NFS_V3, proc));
+        send(fd, framed.data(), framed.size(), 0);
+        return !read_reply(fd).empty();
+    };
+    // NULL is never held
+    auto t0 = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < 5; i++) EXPECT_TRUE(call(0x100 + i, 0));
+    EXPECT_EQ(qos.throttled(QosScope::CLIENT), 0u);
+    // Five GETATTR-like calls at 20/s: four waits of 50ms
+    for (uint32_t i = 0; i < 5; i++) EXPECT_TRUE(call(0x200 + i, 1));
+    auto elapsed = std::chrono::steady_clock::now() - t0;
+    EXPECT_GE(elapsed, std::chrono::milliseconds(150));
+    EXPECT_EQ(qos.throttled(QosScope::CLIENT), 4u);
+    EXPECT_EQ(qos.waiting(), 0);
+
+    close(fd);
+    server.stop();
+}
+
+// --- Overload control ---
+
+TEST(OverloadControl, FollowsTheMinimumSojournOfEachInterval) {
+    const uint64_t ms = 1000000;
+    OverloadControl ctl(10 * ms, 100 * ms);
+    uint64_t t = 1000 * ms;
+
+    // A standing queue: every call of an interval waited 50ms
+    for (int i = 0; i < 10; i++) EXPECT_FALSE(ctl.sample(50 * ms, t + i * 10 * ms));
+    EXPECT_FALSE(ctl.overloaded());
+    t += 100 * ms;
+    EXPECT_TRUE(ctl.sample(50 * ms, t));
+    EXPECT_TRUE(ctl.overloaded());
+    EXPECT_EQ(ctl.min_sojourn_ns(), 50 * ms);
+    EXPECT_EQ(ctl.episodes(), 1u);
+    // Calls that did not queue past the target are never shed
+    EXPECT_FALSE(ctl.sample(5 * ms, t + 10 * ms));
+
+    // That 5ms call shows the queue drained: normal again next interval
+    t += 100 * ms;
+    EXPECT_FALSE(ctl.sample(50 * ms, t));
+    EXPECT_FALSE(ctl.overloaded());
+
+    // A burst (one call got through quickly) is not overload
+    for (int i = 0; i < 10; i++) ctl.sample(i == 5 ? 2 * ms : 80 * ms, t + i * 10 * ms);
+    t += 100 * ms;
+    EXPECT_FALSE(ctl.sample(80 * ms, t));
+    EXPECT_EQ(ctl.min_sojourn_ns(), 2 * ms);
+
+    // Nothing for a long while, then a call stuck the whole time
+    for (int i = 0; i < 10; i++) ctl.sample(80 * ms, t + i * 10 * ms);
+    t += 5000 * ms;
+    EXPECT_TRUE(ctl.sample(4000 * ms, t));
+    EXPECT_EQ(ctl.episodes(), 2u);
+}
+
+TEST(OverloadControl, ServerMarksCallsQueuedInTheSocket) {
+    OverloadControl ctl(5000000, 50000000);  // 5ms target, 50ms interval
+    std::atomic<int> calls{0}, marked{0}, first_marked{-1};
+    RpcServer server;
+    RpcProgramHandlers handlers;
+    handlers.procedures[1] = [&](const RpcCallHeader& c, XdrDecoder&, XdrEncoder&) {
+        int n = calls.fetch_add(1);
+        if (c.overload) {
+            marked.fetch_add(1);
+            int none = -1;
+            first_marked.compare_exchange_strong(none, n);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    };
+    server.register_program(NFS_PROGRAM, NFS_V3, std::move(handlers));
+    server.set_overload_control(&ctl);
+    server.start(0);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_GE(fd, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server.port());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+
+    // Twelve calls pipelined at once; the server serves one per 30ms, so
+    // call k waits about 30k ms in the socket
+    std::vector<uint8_t> burst;
+    for (uint32_t i = 0; i < 12; i++) {
+        auto framed = frame_record(make_rpc_call(0x300 + i, 2, NFS_PROGRAM, NFS_V3, 1));
+        burst.insert(burst.end(), framed.begin(), framed.end());
+    }
+    ASSERT_EQ(send(fd, burst.data(), burst.size(), 0), static_cast<ssize_t>(burst.size()));
+    for (int i = 0; i < 12; i++) EXPECT_FALSE(read_reply(fd).empty());
+
+    // The first interval held the unqueued first call; from the second
+    // the minimum is well over target and the rest are marked
+    EXPECT_GE(first_marked.load(), 2);
+    EXPECT_GE(marked.load(), 5);
+    EXPECT_TRUE(ctl.overloaded());
+    EXPECT_GT(ctl.min_sojourn_ns(), 5000000u);
+
+    close(fd);
+    server.stop();
+}
+
+// A server whose NULL procedure answers with its own tag
+static void register_tagged(RpcServer& server, uint32_t tag) {
+    RpcProgramHandlers handlers;
+    handlers.procedures[0] = [tag](const RpcCallHeader&, XdrDecoder&, XdrEncoder& enc) {
+        enc.encode_uint32(tag);
+    };
+    server.register_program(NFS_PROGRAM, NFS_V3, std::move(handlers));
+}
+
+// The tag of the server that answered a NULL call on fd, or 0
+static uint32_t call_tagged(int fd, uint32_t xid) {
+    auto framed = frame_record(make_rpc_call(xid, 2, NFS_PROGRAM, NFS_V3, 0));
+    if (send(fd, framed.data(), framed.size(), 0) != static_cast<ssize_t>(framed.size()))
+        return 0;
+    auto reply = read_reply(fd);
+    if (reply.size() < 28) return 0;
+    XdrDecoder dec(reply.data() + 24, reply.size() - 24);
+    return dec.decode_uint32();
+}
+
+static int connect_loopback(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+TEST(RpcHandoff, NewServerTakesOverSocketsAndState) {
+    RpcServer old_server, new_server;
+    register_tagged(old_server, 1);
+    register_tagged(new_server, 2);
+    old_server.start(0);
+    const uint16_t port = old_server.port();
+
+    int client = connect_loopback(port);
+    ASSERT_GE(client, 0);
+    EXPECT_EQ(call_tagged(client, 0x400), 1u);
+
+    RpcHandoff sender, receiver;
+    sender.add_state("counter", [](XdrEncoder& enc) { enc.encode_uint64(42); },
+                     [](XdrDecoder&) { return true; });
+    uint64_t restored = 0;
+    receiver.add_state("counter", nullptr, [&restored](XdrDecoder& dec) {
+        restored = dec.decode_uint64();
+        return true;
+    });
+
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    std::string recv_err;
+    bool received = false;
+    std::thread peer([&] {
+        received = receiver.receive(sv[1], recv_err);
+        if (received) receiver.serve(new_server);
+    });
+    std::string err;
+    bool quiesced = false;
+    EXPECT_TRUE(sender.hand_over(sv[0], old_server, [&] { quiesced = true; }, nullptr, err))
+        << err;
+    peer.join();
+    close(sv[0]);
+    ASSERT_TRUE(received) << recv_err;
+    EXPECT_TRUE(quiesced);
+    EXPECT_EQ(restored, 42u);
+    EXPECT_EQ(receiver.connections(), 1u);
+
+    // The open connection and new ones are the new server's now
+    EXPECT_EQ(call_tagged(client, 0x401), 2u);
+    int second = connect_loopback(port);
+    ASSERT_GE(second, 0);
+    EXPECT_EQ(call_tagged(second, 0x402), 2u);
+
+    close(client);
+    close(second);
+    old_server.stop();
+    new_server.stop();
+}
+
+TEST(RpcHandoff, OldServerResumesWhenTheNewOneFails) {
+    RpcServer server;
+    register_tagged(server, 1);
+    server.start(0);
+    int client = connect_loopback(server.port());
+    ASSERT_GE(client, 0);
+    EXPECT_EQ(call_tagged(client, 0x410), 1u);
+
+    // The new process says READY, then dies before taking over
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    uint32_t ready[2] = {htonl(1), 0};
+    ASSERT_EQ(send(sv[1], ready, sizeof(ready), 0), static_cast<ssize_t>(sizeof(ready)));
+    close(sv[1]);
+    RpcHandoff sender;
+    std::string err;
+    bool resumed = false;
+    EXPECT_FALSE(sender.hand_over(sv[0], server, nullptr, [&] { resumed = true; }, err));
+    close(sv[0]);
+    EXPECT_TRUE(resumed);
+
+    EXPECT_EQ(call_tagged(client, 0x411), 1u);
+    int second = connect_loopback(server.port());
+    ASSERT_GE(second, 0);
+    EXPECT_EQ(call_tagged(second, 0x412), 1u);
+
+    close(client);
+    close(second);
+    server.stop();
+}
+
+TEST(RpcHandoff, CallInProgressAtTheTimeoutCallsTheHandOffOff) {
+    RpcServer server;
+    std::atomic<bool> entered{false}, finish{false};
+    RpcProgramHandlers handlers;
+    handlers.procedures[0] = [](const RpcCallHeader&, XdrDecoder&, XdrEncoder& enc) {
+        enc.encode_uint32(1);
+    };
+    handlers.procedures[1] = [&](const RpcCallHeader&, XdrDecoder&, XdrEncoder& enc) {
+        entered = true;
+        while (!finish) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        enc.encode_uint32(3);
+    };
+    server.register_program(NFS_PROGRAM, NFS_V3, std::move(handlers));
+    server.start(0);
+    int idle = connect_loopback(server.port());
+    int busy = connect_loopback(server.port());
+    ASSERT_GE(idle, 0);
+    ASSERT_GE(busy, 0);
+    EXPECT_EQ(call_tagged(idle, 0x420), 1u);
+    auto slow = frame_record(make_rpc_call(0x421, 2, NFS_PROGRAM, NFS_V3, 1));
+    ASSERT_EQ(send(busy, slow.data(), slow.size(), 0), static_cast<ssize_t>(slow.size()));
+    while (!entered) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    // The slow call could change state after it is saved: nothing moves
+    int listen_fd = 0;
+    std::vector<RpcServer::HandedOffConnection> conns;
+    EXPECT_FALSE(server.hand_off(listen_fd, 100000000, conns));
+    EXPECT_EQ(listen_fd, -1);
+    EXPECT_TRUE(conns.empty());
+
+    // Every connection, the busy one too, is served on, and new ones
+    finish = true;
+    auto reply = read_reply(busy);
+    ASSERT_GE(reply.size(), 28u);
+    XdrDecoder dec(reply.data() + 24, reply.size() - 24);
+    EXPECT_EQ(dec.decode_uint32(), 3u);
+    EXPECT_EQ(call_tagged(busy, 0x422), 1u);
+    EXPECT_EQ(call_tagged(idle, 0x423), 1u);
+    int second = connect_loopback(server.port());
+    ASSERT_GE(second, 0);
+    EXPECT_EQ(call_tagged(second, 0x424), 1u);
+
+    close(idle);
+    close(busy);
+    close(second);
+    server.stop();
+}
+
 // --- Portmapper tests ---
 
+TEST(RequestArena, RewindsAndRegrowsToFit) {
+    RequestArena arena(1024, 16384);
+    EXPECT_EQ(arena.capacity(), 1024u);
+    void* first = arena.allocate(100, 8);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(arena.allocate(4, 16)) % 16, 0u);
+    arena.reset();
+    EXPECT_EQ(arena.used(), 0u);
+    EXPECT_EQ(arena.allocate(100, 8), first);
+    EXPECT_EQ(arena.grows(), 1u);
+
+    // Outgrown: another block for now, then one that fits it all
+    EXPECT_NE(arena.allocate(3000, 8), nullptr);
+    EXPECT_EQ(arena.grows(), 2u);
+    arena.reset();
+    EXPECT_GE(arena.capacity(), 3100u);
+    EXPECT_NE(arena.allocate(100, 8), nullptr);
+    EXPECT_NE(arena.allocate(3000, 8), nullptr);
+    EXPECT_EQ(arena.grows(), 3u);
+
+    // Beyond max_retained: back to at most that
+    EXPECT_NE(arena.allocate(100000, 8), nullptr);
+    arena.reset();
+    EXPECT_EQ(arena.capacity(), 16384u);
+}
+
+TEST(RequestArena, SteadyStateCallsDoNotAllocate) {
+    // A handler using the call's arena the way NFS handlers do: the AUTH_SYS
+    // credential parsed, a string decoded, a reply of a few kilobytes. It
+    // notes its thread's allocations so far: from one call to the next, the
+    // connection's thread has read, decoded, dispatched and replied.
+    std::atomic<uint64_t> conn_allocs{0};
+    RpcServer server;
+    RpcProgramHandlers handlers;
+    handlers.procedures[1] = [&conn_allocs](const RpcCallHeader& call, XdrDecoder& args,
+                                            XdrEncoder& reply) {
+        conn_allocs.store(t_allocs);
+        RpcAuthSys sys = RpcServer::parse_auth_sys(call.credential, call.arena);
+        std::pmr::string name = args.decode_string(call.arena);
+        reply.encode_uint32(static_cast<uint32_t>(sys.gids.size()));
+        reply.encode_string(sys.machinename);
+        for (int i = 0; i < 64; i++) reply.encode_string(name);
+    };
+    server.register_program(NFS_PROGRAM, NFS_V3, std::move(handlers));
+    server.start(0);
+    int fd = connect_loopback(server.port());
+    ASSERT_GE(fd, 0);
+
+    XdrEncoder body;
+    body.encode_uint32(1);
+    body.encode_string("client-with-a-long-name.example.com");
+    body.encode_uint32(1000);
+    body.encode_uint32(1000);
+    body.encode_uint32(8);
+    for (uint32_t g = 0; g < 8; g++) body.encode_uint32(100 + g);
+    XdrEncoder enc;
+    enc.encode_uint32(0x500);
+    enc.encode_uint32(static_cast<uint32_t>(RpcMsgType::CALL));
+    enc.encode_uint32(2);
+    enc.encode_uint32(NFS_PROGRAM);
+    enc.encode_uint32(NFS_V3);
+    enc.encode_uint32(1);
+    enc.encode_uint32(static_cast<uint32_t>(RpcAuthFlavor::AUTH_SYS));
+    enc.encode_opaque(body.data().data(), body.size());
+    enc.encode_uint32(0);
+    enc.encode_uint32(0);
+    enc.encode_string("a-name-too-long-for-a-short-string");
+    auto framed = frame_record(std::vector<uint8_t>(enc.data().begin(), enc.data().end()));
+
+    auto call = [&] {
+        uint8_t buf[8192];
+        if (send(fd, framed.data(), framed.size(), 0) != static_cast<ssize_t>(framed.size()))
+            return size_t(0);
+        if (recv(fd, buf, 4, MSG_WAITALL) != 4) return size_t(0);
+        const size_t len = ntohl(*reinterpret_cast<uint32_t*>(buf)) & 0x7FFFFFFF;
+        if (len > sizeof(buf) || recv(fd, buf, len, MSG_WAITALL) != static_cast<ssize_t>(len))
+            return size_t(0);
+        return len;
+    };
+    const size_t reply_len = call();
+    EXPECT_GT(reply_len, 64 * 36u);
+    for (int i = 0; i < 3; i++) EXPECT_EQ(call(), reply_len);
+
+    const uint64_t before = conn_allocs.load();
+    size_t failed = 0;
+    for (int i = 0; i < 100; i++) failed += call() != reply_len;
+    EXPECT_EQ(conn_allocs.load() - before, 0u);
+    EXPECT_EQ(failed, 0u);
+    EXPECT_GT(server.arena_bytes(), 0u);
+
+    close(fd);
+    server.stop();
+}
+
+TEST(NumaTopology, ParsesCpulists) {
+    std::vector<int> cpus;
+    ASSERT_TRUE(NumaTopology::parse_cpulist("0-3,8,10-11\n", cpus));
+    EXPECT_EQ(cpus, (std::vector<int>{0, 1, 2, 3, 8, 10, 11}));
+    ASSERT_TRUE(NumaTopology::parse_cpulist("\n", cpus));  // a memory-only node
+    EXPECT_TRUE(cpus.empty());
+    EXPECT_FALSE(NumaTopology::parse_cpulist("3-1", cpus));
+    EXPECT_FALSE(NumaTopology::parse_cpulist("0;1", cpus));
+}
+
+TEST(NumaTopology, DiscoversNodesFromSysfs) {
+    char root[] = "/tmp/nfs_numa_XXXXXX";
+    ASSERT_NE(mkdtemp(root), nullptr);
+    const std::string dir = root;
+    // Listed out of order, with a memory-only node and entries to skip;
+    // node 0 takes every CPU this process may run on
+    for (const char* name : {"node1", "node0", "nodeX", "power"})
+        mkdir((dir + "/" + name).c_str(), 0755);
+    std::ofstream(dir + "/node1/cpulist") << "\n";
+    std::ofstream(dir + "/node0/cpulist") << "0-1023\n";
+    std::ofstream(dir + "/nodeX/cpulist") << "0\n";
+
+    NumaTopology topo = NumaTopology::discover(dir);
+    ASSERT_EQ(topo.nodes(), 2u);
+    EXPECT_EQ(topo.node(0).id, 0);
+    EXPECT_EQ(topo.node(1).id, 1);
+    EXPECT_FALSE(topo.node(0).cpus.empty());
+    EXPECT_TRUE(topo.node(1).cpus.empty());
+    EXPECT_EQ(topo.node_of_cpu(sched_getcpu()), 0);
+    EXPECT_EQ(topo.node_of_cpu(1 << 20), -1);
+
+    // Connections go to nodes with CPUs; a Unix socket has no incoming CPU
+    NumaPlacement numa(std::move(topo));
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    EXPECT_EQ(numa.place(sv[0]), 0u);
+    EXPECT_EQ(numa.place(sv[1]), 0u);
+    EXPECT_EQ(numa.connections(0), 2u);
+    EXPECT_EQ(numa.placed_by_load(0), 2u);
+    EXPECT_EQ(numa.connections(1), 0u);
+    numa.release(0);
+    EXPECT_EQ(numa.connections(0), 1u);
+    bool pinned = true;
+    std::thread([&] { pinned = numa.pin(1); }).join();
+    EXPECT_FALSE(pinned);  // no CPUs to run on
+    close(sv[0]);
+    close(sv[1]);
+
+    for (const char* name : {"node1", "node0", "nodeX"})
+        unlink((dir + "/" + name + "/cpulist").c_str());
+    for (const char* name : {"node1", "node0", "nodeX", "power"})
+        rmdir((dir + "/" + name).c_str());
+    rmdir(root);
+}
+
+TEST(NodeBufferPool, ReusesChunksBySize) {
+    NodeBufferPool pool(0, false);
+    EXPECT_EQ(pool.mapped_bytes(), 0u);
+    void* a = pool.allocate(100);
+    EXPECT_EQ(pool.in_use_bytes(), 4096u);
+    EXPECT_EQ(pool.mapped_bytes(), NodeBufferPool::kRegionBytes);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(a) % 4096, 0u);
+    pool.deallocate(a, 100);
+    EXPECT_EQ(pool.in_use_bytes(), 0u);
+    EXPECT_EQ(pool.allocate(3000), a);  // same size class
+    void* b = pool.allocate(5000);
+    EXPECT_NE(b, a);
+    EXPECT_EQ(pool.in_use_bytes(), 4096u + 8192u);
+
+    // A 2 MiB chunk needs a region of its own; the rest of the first one
+    // is kept for smaller requests
+    void* big = pool.allocate(NodeBufferPool::kRegionBytes);
+    EXPECT_EQ(pool.mapped_bytes(), 2 * NodeBufferPool::kRegionBytes);
+    uint8_t* rest = static_cast<uint8_t*>(pool.allocate(1 << 20));
+    EXPECT_EQ(pool.mapped_bytes(), 2 * NodeBufferPool::kRegionBytes);
+    EXPECT_GT(rest, static_cast<uint8_t*>(a));
+    EXPECT_LT(rest, static_cast<uint8_t*>(a) + NodeBufferPool::kRegionBytes);
+
+    // Beyond a region: the heap
+    void* huge = pool.allocate(3 << 20);
+    EXPECT_EQ(pool.mapped_bytes(), 2 * NodeBufferPool::kRegionBytes);
+    pool.deallocate(huge, 3 << 20);
+    pool.deallocate(rest, 1 << 20);
+    pool.deallocate(big, NodeBufferPool::kRegionBytes);
+    pool.deallocate(b, 5000);
+    pool.deallocate(a, 3000);
+    EXPECT_EQ(pool.in_use_bytes(), 0u);
+
+    uint64_t by_backing = 0;
+    for (int i = 0; i < NodeBufferPool::BACKINGS; i++)
+        by_backing += pool.mapped_bytes(static_cast<NodeBufferPool::Backing>(i));
+    EXPECT_EQ(by_backing, pool.mapped_bytes());
+}
+
+TEST(NumaPlacement, ConnectionBuffersComeFromTheNodePool) {
+    NumaPlacement numa(NumaTopology::single({0}));
+    RpcServer server;
+    RpcProgramHandlers handlers;
+    handlers.procedures[0] = [](const RpcCallHeader& call, XdrDecoder&, XdrEncoder& reply) {
+        std::pmr::string s("a string long enough to need the arena", call.arena);
+        reply.encode_string(s);
+    };
+    server.register_program(100003, 3, std::move(handlers));
+    server.set_numa(&numa);
+    server.start(0);
+    int fd = connect_loopback(server.port());
+    ASSERT_GE(fd, 0);
+
+    auto framed = frame_record(make_rpc_call(0x600, 2, 100003, 3, 0));
+    ASSERT_EQ(send(fd, framed.data(), framed.size(), 0), static_cast<ssize_t>(framed.size()));
+    ASSERT_FALSE(read_reply(fd).empty());
+    EXPECT_EQ(numa.connections(0), 1u);
+    EXPECT_EQ(numa.placed_by_cpu(0) + numa.placed_by_load(0), 1u);
+    // The arena's first block and the record buffer
+    EXPECT_GE(numa.pool(0).in_use_bytes(), 16384u + 4096u);
+
+    close(fd);
+    server.stop();
+    EXPECT_EQ(numa.connections(0), 0u);
+    EXPECT_EQ(numa.pool(0).in_use_bytes(), 0u);
+    EXPECT_EQ(numa.idle_bytes(), numa.pool(0).mapped_bytes());
+}
+
 TEST(Portmapper, Constants) {
     EXPECT_EQ(PMAP_PROGRAM, 100000u);
     EXPECT_EQ(PMAP_VERSION, 2u);
@@ -0,0 +1,762 @@
+#include <gtest/gtest.h>
+#include "stats/client_stats.h"
+#include "stats/latency_stats.h"
+#include "stats/memory_governor.h"
+#include "stats/metrics.h"
+#include "stats/metrics_server.h"
+#include "stats/profiled_mutex.h"
+#include "stats/request_tracer.h"
+#include "stats/slow_op_log.h"
+#include "rpc/rpc_server.h"
+#include "rpc/rpc_types.h"
+#include "nfs4/nfs4_server.h"
+#include "vfs/local_fs.h"
+#include "vfs/traced_vfs.h"
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <thread>
+#include <vector>
+
+static const LatencyEntry* find_entry(const std::vector<LatencyEntry>& entries,
+                                      const LatencyKey& key) {
+    for (const auto& e : entries)
+        if (e.key == key) return &e;
+    return nullptr;
+}
+
+// --- Histogram buckets ---
+
+TEST(LatencyHistogram, BucketBoundsContainValue) {
+    for (uint64_t v : {0ull, 1ull, 7ull, 8ull, 9ull, 15ull, 16ull, 100ull, 999ull,
+                       123456ull, 1000000007ull, 1ull << 39}) {
+        size_t idx = LatencySnapshot::bucket_index(v);
+        EXPECT_LE(LatencySnapshot::bucket_lower(idx), v) << v;
+        EXPECT_GE(LatencySnapshot::bucket_upper(idx), v) << v;
+    }
+}
+
+TEST(LatencyHistogram, RelativeErrorBounded) {
+    // 8 sub-buckets per power of two: bucket width <= 12.5% of its lower bound
+    for (size_t idx = 8; idx + 1 < LatencySnapshot::kBuckets; idx++) {
+        uint64_t lo = LatencySnapshot::bucket_lower(idx);
+        uint64_t hi = LatencySnapshot::bucket_upper(idx);
+        EXPECT_LE(static_cast<double>(hi - lo + 1), lo * 0.125 + 1) << idx;
+        EXPECT_EQ(LatencySnapshot::bucket_lower(idx + 1), hi + 1) << idx;
+    }
+}
+
+TEST(LatencyHistogram, HugeValuesClampToLastBucket) {
+    EXPECT_EQ(LatencySnapshot::bucket_index(UINT64_MAX), LatencySnapshot::kBuckets - 1);
+}
+
+TEST(LatencyHistogram, Percentiles) {
+    LatencyHistogram h;
+    for (uint64_t v = 1; v <= 10000; v++) h.record(v * 1000);
+    LatencySnapshot s;
+    h.add_to(s);
+
+    EXPECT_EQ(s.count, 10000u);
+    EXPECT_EQ(s.max_ns, 10000000u);
+    EXPECT_NEAR(s.mean_ns(), 5000500.0, 1.0);
+    EXPECT_NEAR(static_cast<double>(s.percentile(0.50)), 5000000.0, 5000000.0 * 0.125);
+    EXPECT_NEAR(static_cast<double>(s.percentile(0.99)), 9900000.0, 9900000.0 * 0.125);
+    EXPECT_EQ(s.percentile(1.0), 10000000u);
+}
+
+// --- LatencyStats ---
+
+TEST(LatencyStats, ThreadsMergedOnSnapshot) {
+    LatencyStats stats;
+    LatencyKey key{100003, 3, 6};
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 1000; i++)
+                stats.record(key, LatencyPhase::HANDLER, 500);
+        });
+    }
+    for (auto& th : threads) th.join();
+
+    // Counts from exited threads are kept
+    auto entries = stats.snapshot();
+    const LatencyEntry* e = find_entry(entries, key);
+    ASSERT_NE(e, nullptr);
+    EXPECT_EQ(e->phases[static_cast<size_t>(LatencyPhase::HANDLER)].count, 4000u);
+    EXPECT_EQ(e->phases[static_cast<size_t>(LatencyPhase::DECODE)].count, 0u);
+    EXPECT_EQ(stats.dropped(), 0u);
+}
+
+TEST(LatencyStats, OpKeysDistinctFromProcedureKeys) {
+    LatencyStats stats;
+    LatencyKey proc{100003, 4, 1};
+    LatencyKey op{100003, 4, 1, 24};
+    stats.record(proc, LatencyPhase::HANDLER, 10);
+    stats.record(op, LatencyPhase::HANDLER, 20);
+    stats.record(op, LatencyPhase::HANDLER, 20);
+
+    auto entries = stats.snapshot();
+    ASSERT_EQ(entries.size(), 2u);
+    ASSERT_NE(find_entry(entries, proc), nullptr);
+    ASSERT_NE(find_entry(entries, op), nullptr);
+    EXPECT_EQ(find_entry(entries, op)->phases[2].count, 2u);
+    EXPECT_EQ(find_entry(entries, op)->key.op, 24u);
+}
+
+TEST(LatencyStats, RecordCallFillsAllPhases) {
+    LatencyStats stats;
+    LatencyKey key{100021, 4, 2};
+    const uint64_t phases[kLatencyPhases] = {1, 2, 3, 4};
+    stats.record_call(key, phases);
+
+    auto entries = stats.snapshot();
+    ASSERT_EQ(entries.size(), 1u);
+    for (size_t i = 0; i < kLatencyPhases; i++) {
+        EXPECT_EQ(entries[0].phases[i].count, 1u);
+        EXPECT_EQ(entries[0].phases[i].sum_ns, i + 1);
+    }
+    EXPECT_DOUBLE_EQ(entries[0].total_mean_ns(), 10.0);
+}
+
+// --- Integration: RpcServer and NFSv4 COMPOUND ---
+
+static std::vector<uint8_t> frame_call(uint32_t xid, uint32_t prog, uint32_t vers,
+                                       uint32_t proc, const XdrEncoder& args) {
+    XdrEncoder enc;
+    enc.encode_uint32(xid);
+    enc.encode_uint32(static_cast<uint32_t>(RpcMsgType::CALL));
+    enc.encode_uint32(2);
+    enc.encode_uint32(prog);
+    enc.encode_uint32(vers);
+    enc.encode_uint32(proc);
+    enc.encode_uint32(0);  // AUTH_NONE credential
+    enc.encode_uint32(0);
+    enc.encode_uint32(0);  // AUTH_NONE verifier
+    enc.encode_uint32(0);
+    std::vector<uint8_t> framed(4);
+    uint32_t hdr = htonl(static_cast<uint32_t>(enc.size() + args.size()) | 0x80000000u);
+    std::memcpy(framed.data(), &hdr, 4);
+    framed.insert(framed.end(), enc.data().begin(), enc.data().end());
+    framed.insert(framed.end(), args.data().begin(), args.data().end());
+    return framed;
+}
+
+static bool call_and_wait_reply(uint16_t port, const std::vector<uint8_t>& framed) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bool ok = connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 &&
+              send(fd, framed.data(), framed.size(), 0) == static_cast<ssize_t>(framed.size());
+    uint8_t hdr[4];
+    ok = ok && recv(fd, hdr, 4, MSG_WAITALL) == 4;
+    close(fd);
+    return ok;
+}
+
+// The server records after sending, so the reply can overtake the sample
+static std::vector<LatencyEntry> wait_for_key(const LatencyStats& stats,
+                                              const LatencyKey& key) {
+    for (int i = 0; i < 200; i++) {
+        auto entries = stats.snapshot();
+        if (find_entry(entries, key)) return entries;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return stats.snapshot();
+}
+
+TEST(LatencyStats, RpcServerRecordsPerProcedure) {
+    LatencyStats stats;
+    RpcServer server;
+    server.set_latency_stats(&stats);
+    RpcProgramHandlers handlers;
+    handlers.procedures[7] = [](const RpcCallHeader&, XdrDecoder&, XdrEncoder& reply) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        reply.encode_uint32(0);
+    };
+    server.register_program(100099, 1, std::move(handlers));
+    server.start(0);
+
+    XdrEncoder args;
+    ASSERT_TRUE(call_and_wait_reply(server.port(), frame_call(1, 100099, 1, 7, args)));
+
+    LatencyKey key{100099, 1, 7};
+    auto entries = wait_for_key(stats, key);
+    server.stop();
+
+    const LatencyEntry* e = find_entry(entries, key);
+    ASSERT_NE(e, nullptr);
+    for (size_t i = 0; i < kLatencyPhases; i++)
+        EXPECT_EQ(e->phases[i].count, 1u) << latency_phase_name(static_cast<LatencyPhase>(i));
+    EXPECT_GE(e->phases[static_cast<size_t>(LatencyPhase::HANDLER)].max_ns, 2000000u);
+}
+
+TEST(LatencyStats, Nfs4CompoundRecordsPerOp) {
+    char tmpl[] = "/tmp/nfs_stats_XXXXXX";
+    char* dir = mkdtemp(tmpl);
+    ASSERT_NE(dir, nullptr);
+    std::string tmpdir = dir;
+    {
+        LocalFs fs(tmpdir);
+        Nfs4Server srv(fs, tmpdir);
+        LatencyStats stats;
+        srv.set_latency_stats(&stats);
+        auto h = srv.get_handlers();
+
+        XdrEncoder args;
+        args.encode_string("");
+        args.encode_uint32(0);  // minorversion
+        args.encode_uint32(2);
+        args.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_PUTROOTFH));
+        args.encode_uint32(static_cast<uint32_t>(Nfs4Op::OP_GETFH));
+
+        RpcCallHeader call;
+        call.program = NFS_PROGRAM;
+        call.version = NFS_V4;
+        call.procedure = NFSPROC4_COMPOUND;
+        XdrDecoder dec(args.data().data(), args.size());
+        XdrEncoder reply;
+        h.procedures.at(NFSPROC4_COMPOUND)(call, dec, reply);
+
+        auto entries = stats.snapshot();
+        ASSERT_EQ(entries.size(), 2u);
+        EXPECT_NE(find_entry(entries, {NFS_PROGRAM, NFS_V4, NFSPROC4_COMPOUND,
+                                       static_cast<uint32_t>(Nfs4Op::OP_PUTROOTFH)}),
+                  nullptr);
+        EXPECT_NE(find_entry(entries, {NFS_PROGRAM, NFS_V4, NFSPROC4_COMPOUND,
+                                       static_cast<uint32_t>(Nfs4Op::OP_GETFH)}),
+                  nullptr);
+    }
+    std::string cmd = "rm -rf " + tmpdir;
+    system(cmd.c_str());
+}
+
+// --- Metrics registry and endpoint ---
+
+TEST(Metrics, RendersFamiliesWithHelpAndType) {
+    MetricsRegistry reg;
+    uint64_t n = 3;
+    reg.counter("t_requests_total", "Requests", {{"kind", "a\"b"}}, [&] { return n; });
+    reg.gauge("t_depth", "Depth", {}, [] { return 1.5; });
+
+    std::string text = reg.render_prometheus();
+    EXPECT_NE(text.find("# HELP t_requests_total Requests\n"), std::string::npos);
+    EXPECT_NE(text.find("# TYPE t_requests_total counter\n"), std::string::npos);
+    EXPECT_NE(text.find("t_requests_total{kind=\"a\\\"b\"} 3\n"), std::string::npos);
+    EXPECT_NE(text.find("# TYPE t_depth gauge\n"), std::string::npos);
+    EXPECT_NE(text.find("t_depth 1.5\n"), std::string::npos);
+
+    // Values are read at scrape time
+    n = 7;
+    EXPECT_DOUBLE_EQ(reg.value("t_requests_total", {{"kind", "a\"b"}}), 7.0);
+    EXPECT_DOUBLE_EQ(reg.value("t_missing"), 0.0);
+}
+
+TEST(Metrics, LatencyHistogramBucketsAreCumulative) {
+    MetricsRegistry reg;
+    LatencyStats stats;
+    reg.add_latency_stats(&stats);
+    stats.record({100003, 3, 1}, LatencyPhase::HANDLER, 5000);      // 5us
+    stats.record({100003, 3, 1}, LatencyPhase::HANDLER, 2000000);   // 2ms
+
+    std::string text = reg.render_prometheus();
+    std::string base = "nfsd_rpc_latency_seconds_bucket{program=\"100003\",version=\"3\","
+                       "procedure=\"1\",phase=\"handler\",";
+    EXPECT_NE(text.find(base + "le=\"1e-05\"} 1\n"), std::string::npos);
+    EXPECT_NE(text.find(base + "le=\"0.0025\"} 2\n"), std::string::npos);
+    EXPECT_NE(text.find(base + "le=\"+Inf\"} 2\n"), std::string::npos);
+    EXPECT_NE(text.find("nfsd_rpc_latency_seconds_count{program=\"100003\",version=\"3\","
+                        "procedure=\"1\",phase=\"handler\"} 2\n"),
+              std::string::npos);
+}
+
+TEST(Metrics, RpcServerCountsCallsAndErrors) {
+    MetricsRegistry reg;
+    RpcServer server;
+    RpcProgramHandlers handlers;
+    handlers.procedures[3] = [](const RpcCallHeader&, XdrDecoder&, XdrEncoder& reply) {
+        reply.encode_uint32(0);
+    };
+    server.register_program(NFS_PROGRAM, NFS_V3, std::move(handlers));
+    server.register_metrics(reg);
+    server.start(0);
+
+    XdrEncoder args;
+    ASSERT_TRUE(call_and_wait_reply(server.port(), frame_call(1, NFS_PROGRAM, NFS_V3, 3, args)));
+    ASSERT_TRUE(call_and_wait_reply(server.port(), frame_call(2, NFS_PROGRAM, NFS_V3, 3, args)));
+    ASSERT_TRUE(call_and_wait_reply(server.port(), frame_call(3, 100099, 1, 0, args)));
+    server.stop();
+
+    EXPECT_DOUBLE_EQ(reg.value("nfsd_rpc_calls_total", {{"program", "100003"},
+                                                        {"version", "3"},
+                                                        {"procedure", "3"}}),
+                     2.0);
+    EXPECT_DOUBLE_EQ(reg.value("nfsd_rpc_errors_total", {{"reason", "prog_unavail"}}), 1.0);
+    EXPECT_DOUBLE_EQ(reg.value("nfsd_connections_accepted_total"), 3.0);
+
+    // nfsstat layout: LOOKUP is the fourth proc3 counter
+    std::string proc = render_proc_nfsd(reg);
+    EXPECT_NE(proc.find("\nproc3 22 0 0 0 2 0"), std::string::npos) << proc;
+    EXPECT_NE(proc.find("\nproc4ops 76 "), std::string::npos);
+}
+
+TEST(Metrics, ServerAnswersOverUnixSocket) {
+    MetricsRegistry reg;
+    reg.gauge("t_up", "Up", {}, [] { return 1.0; });
+
+    char tmpl[] = "/tmp/nfs_metrics_XXXXXX";
+    char* dir = mkdtemp(tmpl);
+    ASSERT_NE(dir, nullptr);
+    std::string sock = std::string(dir) + "/m.sock";
+    {
+        MetricsServer srv(reg);
+        ASSERT_TRUE(srv.listen_unix(sock));
+        srv.start();
+
+        std::string body;
+        ASSERT_TRUE(metrics_fetch_unix(sock, "/metrics", body));
+        EXPECT_NE(body.find("t_up 1\n"), std::string::npos);
+        ASSERT_TRUE(metrics_fetch_unix(sock, "/nfsd", body));
+        EXPECT_EQ(body.compare(0, 3, "rc "), 0);
+        EXPECT_FALSE(metrics_fetch_unix(sock, "/nope", body));
+    }
+    // Socket file removed on stop
+    EXPECT_NE(access(sock.c_str(), F_OK), 0);
+    rmdir(dir);
+}
+
+// --- Per-client accounting ---
+
+TEST(ClientStats, SketchNeverUndercounts) {
+    CountMinSketch cms(256);
+    std::map<uint64_t, uint64_t> truth;
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < 5000; i++) {
+        uint64_t h = (i % 997) * 0x9e3779b97f4a7c15ull;
+        TalkerSample sample;
+        sample.bytes_in = i % 7 + 1;
+        cms.add(h, sample);
+        truth[h] += i % 7 + 1;
+        total += i % 7 + 1;
+    }
+    size_t within = 0;
+    for (const auto& [h, n] : truth) {
+        uint64_t est = cms.estimate(h).bytes_in;
+        EXPECT_GE(est, n);
+        if (est - n <= static_cast<uint64_t>(2.72 * total / cms.width())) within++;
+    }
+    // Bound holds per key with probability 1 - e^-depth (~98%)
+    EXPECT_GE(within, truth.size() * 9 / 10);
+}
+
+TEST(ClientStats, HeavyHittersFoundAmongManyClients) {
+    TopTalkers t(8, 512);
+    // 5000 one-off clients interleaved with three heavy ones
+    for (int i = 0; i < 5000; i++) {
+        t.add("10.1." + std::to_string(i / 256) + "." + std::to_string(i % 256), TalkerSample{});
+        if (i % 4 == 0) t.add("heavy-a", TalkerSample{});
+        if (i % 8 == 0) t.add("heavy-b", TalkerSample{});
+        if (i % 50 == 0) {
+            TalkerSample big;
+            big.bytes_out = 1 << 20;
+            t.add("bulk", big);
+        }
+    }
+
+    auto by_ops = t.top(TalkerRank::OPS, 2);
+    ASSERT_EQ(by_ops.size(), 2u);
+    EXPECT_EQ(by_ops[0].key, "heavy-a");
+    EXPECT_EQ(by_ops[1].key, "heavy-b");
+    EXPECT_GE(by_ops[0].ops, 1250u);
+    EXPECT_LE(by_ops[0].ops, 1250u + t.ops_error_bound());
+
+    auto by_bytes = t.top(TalkerRank::BYTES, 1);
+    ASSERT_EQ(by_bytes.size(), 1u);
+    EXPECT_EQ(by_bytes[0].key, "bulk");
+    EXPECT_GE(by_bytes[0].bytes_out, 100ull << 20);
+
+    // The candidate set never grows past its capacity
+    EXPECT_EQ(t.top(TalkerRank::OPS, 100).size(), 8u);
+    EXPECT_EQ(t.total_ops(), 5000u + 1250u + 625u + 100u);
+}
+
+TEST(ClientStats, ShardsOfManyThreadsMergeInReports) {
+    TopTalkers t(4, 512);
+    // More threads than shards, all on one export and a client each
+    const int kThreads = static_cast<int>(TopTalkers::kShards) + 3;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kThreads; i++) {
+        threads.emplace_back([&t, i] {
+            TalkerSample s;
+            s.bytes_in = 10;
+            for (int k = 0; k < 1000; k++) t.add("/export", s);
+            for (int k = 0; k < 100 * (i + 1); k++)
+                t.add("client" + std::to_string(i), TalkerSample{});
+        });
+    }
+    for (auto& th : threads) th.join();
+
+    // One key counted by every shard is summed across them
+    EXPECT_EQ(t.estimate("/export").ops, kThreads * 1000u);
+    EXPECT_EQ(t.estimate("/export").bytes_in, kThreads * 10000u);
+    auto by_ops = t.top(TalkerRank::OPS, 3);
+    ASSERT_EQ(by_ops.size(), 3u);
+    EXPECT_EQ(by_ops[0].key, "/export");
+    EXPECT_EQ(by_ops[1].key, "client" + std::to_string(kThreads - 1));
+    EXPECT_EQ(by_ops[2].key, "client" + std::to_string(kThreads - 2));
+    uint64_t clients = 0;
+    for (int i = 0; i < kThreads; i++) clients += 100 * (i + 1);
+    EXPECT_EQ(t.total_ops(), kThreads * 1000u + clients);
+}
+
+TEST(ClientStats, ClientKeyIncludesAuthSysIdentity) {
+    EXPECT_EQ(ClientStats::client_key("10.0.0.5", false, "", 0), "10.0.0.5");
+    EXPECT_EQ(ClientStats::client_key("10.0.0.5", true, "build7", 1000),
+              "10.0.0.5 build7 uid=1000");
+    EXPECT_EQ(ClientStats::client_key("", false, "", 0), "local");
+}
+
+TEST(ClientStats, RpcServerAccountsPerClientAndExport) {
+    ClientStats stats;
+    RpcServer server;
+    server.set_client_stats(&stats, "/export");
+    RpcProgramHandlers handlers;
+    handlers.procedures[1] = [](const RpcCallHeader&, XdrDecoder&, XdrEncoder& reply) {
+        reply.encode_uint32(0);
+        reply.encode_uint32(0);
+    };
+    server.register_program(100099, 1, std::move(handlers));
+    server.start(0);
+
+    XdrEncoder args;
+    for (uint32_t xid = 1; xid <= 3; xid++)
+        ASSERT_TRUE(call_and_wait_reply(server.port(), frame_call(xid, 100099, 1, 1, args)));
+
+    // Accounting happens after the reply is sent
+    for (int i = 0; i < 200 && stats.clients().total_ops() < 3; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    server.stop();
+
+    auto top = stats.clients().top(TalkerRank::OPS, 5);
+    ASSERT_EQ(top.size(), 1u);
+    EXPECT_EQ(top[0].key, "127.0.0.1");
+    EXPECT_EQ(top[0].ops, 3u);
+    EXPECT_EQ(top[0].bytes_out, 3u * 8);
+    EXPECT_EQ(stats.exports().estimate("/export").ops, 3u);
+
+    std::string report = stats.report(5);
+    EXPECT_NE(report.find("top clients by ops"), std::string::npos);
+    EXPECT_NE(report.find("127.0.0.1"), std::string::npos);
+    EXPECT_NE(report.find("/export"), std::string::npos);
+}
+
+// --- Slow-op log ---
+
+TEST(SlowOpLog, FormatIncludesPhasesAndOps) {
+    SlowOpRecord rec;
+    rec.wall_ns = 1700000000123456789ull;
+    rec.xid = 0x1234;
+    rec.client = "10.0.0.5 build7 uid=1000";
+    rec.program = 100003;
+    rec.version = 4;
+    rec.procedure = 1;
+    rec.phases[0] = 1000;
+    rec.phases[1] = 2000;
+    rec.phases[2] = 50000;
+    rec.phases[3] = 3000;
+    rec.trace.add_vfs(40000, nullptr);
+    rec.trace.ops.push_back({22, 0, 1000});
+    rec.trace.ops.push_back({25, 0, 45000});
+
+    std::string line = SlowOpLog::format(rec, "");
+    EXPECT_EQ(line.compare(0, 27, "2023-11-14T22:13:20.123456Z"), 0) << line;
+    EXPECT_NE(line.find("xid=0x00001234"), std::string::npos);
+    EXPECT_NE(line.find("client=\"10.0.0.5 build7 uid=1000\""), std::string::npos);
+    EXPECT_NE(line.find("total_us=56.0"), std::string::npos);
+    EXPECT_NE(line.find("vfs_us=40.0 vfs_calls=1 proc_us=10.0"), std::string::npos);
+    EXPECT_NE(line.find("ops=22:0:1.0,25:0:45.0"), std::string::npos);
+    EXPECT_EQ(line.find("fh="), std::string::npos);
+}
+
+TEST(SlowOpLog, RpcServerLogsOnlySlowCallsWithVfsTime) {
+    char tmpl[] = "/tmp/nfs_slowop_XXXXXX";
+    char* dir = mkdtemp(tmpl);
+    ASSERT_NE(dir, nullptr);
+    std::string tmpdir = dir;
+    std::string log_path = tmpdir + "/slow.log";
+    {
+        LocalFs fs(tmpdir);
+        TracedVfs vfs(fs);
+        FileHandle root;
+        ASSERT_EQ(vfs.get_root_fh("/", root), NfsStat3::NFS3_OK);
+
+        SlowOpLog log(2000000, log_path);  // 2 ms
+        ASSERT_TRUE(log.open());
+        log.set_path_resolver([&fs](const FileHandle& fh) { return fs.path_of(fh); });
+
+        RpcServer server;
+        server.set_slow_op_log(&log);
+        RpcProgramHandlers handlers;
+        handlers.procedures[1] = [&](const RpcCallHeader&, XdrDecoder&, XdrEncoder& reply) {
+            Fattr3 attr;
+            vfs.getattr(root, attr);
+            reply.encode_uint32(0);
+        };
+        handlers.procedures[2] = [&](const RpcCallHeader&, XdrDecoder&, XdrEncoder& reply) {
+            Fattr3 attr;
+            vfs.getattr(root, attr);
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            reply.encode_uint32(0);
+        };
+        server.register_program(100099, 1, std::move(handlers));
+        server.start(0);
+
+        XdrEncoder args;
+        ASSERT_TRUE(call_and_wait_reply(server.port(), frame_call(7, 100099, 1, 1, args)));
+        ASSERT_TRUE(call_and_wait_reply(server.port(), frame_call(8, 100099, 1, 2, args)));
+        server.stop();
+        log.flush();
+        EXPECT_EQ(log.logged(), 1u);
+    }
+
+    std::ifstream in(log_path);
+    std::string line;
+    ASSERT_TRUE(std::getline(in, line));
+    EXPECT_NE(line.find("xid=0x00000008"), std::string::npos) << line;
+    EXPECT_NE(line.find("client=\"127.0.0.1\""), std::string::npos) << line;
+    EXPECT_NE(line.find("vfs_calls=1"), std::string::npos) << line;
+    EXPECT_NE(line.find("path=\"" + tmpdir + "/\""), std::string::npos) << line;
+    EXPECT_FALSE(std::getline(in, line));
+
+    std::string cmd = "rm -rf " + tmpdir;
+    system(cmd.c_str());
+}
+
+// --- Lock profiling ---
+
+TEST(ProfiledMutex, DisabledRecordsNothing) {
+    ProfiledMutex::set_enabled(false);
+    ProfiledMutex mu("t_off");
+    for (int i = 0; i < 10; i++) {
+        std::lock_guard<ProfiledMutex> lk(mu);
+    }
+    EXPECT_EQ(mu.acquisitions(), 0u);
+    EXPECT_EQ(mu.hold_ns(), 0u);
+}
+
+TEST(ProfiledMutex, RecordsWaitAndHoldTime) {
+    ProfiledMutex::set_enabled(true);
+    ProfiledMutex mu("t_on");
+
+    std::atomic<bool> held{false};
+    std::thread holder([&] {
+        std::lock_guard<ProfiledMutex> lk(mu);
+        held = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    });
+    while (!held) std::this_thread::yield();
+    {
+        std::lock_guard<ProfiledMutex> lk(mu);  // waits for the holder
+    }
+    holder.join();
+    EXPECT_TRUE(mu.try_lock());
+    mu.unlock();
+    ProfiledMutex::set_enabled(false);
+
+    EXPECT_EQ(mu.acquisitions(), 3u);
+    EXPECT_EQ(mu.contended(), 1u);
+    EXPECT_GE(mu.wait_ns(), 5'000'000u);
+    EXPECT_GE(mu.max_wait_ns(), 5'000'000u);
+    EXPECT_GE(mu.hold_ns(), 20'000'000u);
+
+    MetricsRegistry reg;
+    mu.register_metrics(reg);
+    EXPECT_DOUBLE_EQ(reg.value("nfsd_lock_acquisitions_total", {{"lock", "t_on"}}), 3.0);
+    EXPECT_DOUBLE_EQ(reg.value("nfsd_lock_contended_total", {{"lock", "t_on"}}), 1.0);
+    EXPECT_GE(reg.value("nfsd_lock_hold_seconds_total", {{"lock", "t_on"}}), 0.02);
+    EXPECT_NE(reg.render_prometheus().find("# TYPE nfsd_lock_wait_seconds_total counter\n"),
+              std::string::npos);
+}
+
+// --- Sampled request timelines ---
+
+TEST(RequestTracer, RingDropsWhenFull) {
+    SpanRing ring(1);
+    for (size_t i = 0; i < SpanRing::kCapacity + 5; i++) {
+        TraceSpan s;
+        s.xid = static_cast<uint32_t>(i);
+        ring.push(s);
+    }
+    EXPECT_EQ(ring.dropped(), 5u);
+
+    std::vector<TraceSpan> out;
+    EXPECT_EQ(ring.drain(out), SpanRing::kCapacity);
+    EXPECT_EQ(out.front().xid, 0u);
+    EXPECT_EQ(out.back().xid, SpanRing::kCapacity - 1);
+    EXPECT_EQ(ring.drain(out), 0u);
+}
+
+TEST(RequestTracer, SamplesOneInN) {
+    RequestTracer tracer("/dev/null", 5);
+    int sampled = 0;
+    for (int i = 0; i < 20; i++) sampled += tracer.sample("") ? 1 : 0;
+    EXPECT_EQ(sampled, 4);
+
+    RequestTracer by_client("/dev/null", 0, "10.1.2.3");
+    EXPECT_TRUE(by_client.sample("10.1.2.3 build7 uid=0"));
+    EXPECT_FALSE(by_client.sample("10.1.2.4"));
+}
+
+TEST(RequestTracer, RpcServerWritesChromeTraceEvents) {
+    char tmpl[] = "/tmp/nfs_trace_XXXXXX";
+    char* dir = mkdtemp(tmpl);
+    ASSERT_NE(dir, nullptr);
+    std::string tmpdir = dir;
+    std::string trace_path = tmpdir + "/trace.json";
+    {
+        LocalFs fs(tmpdir);
+        TracedVfs vfs(fs);
+        FileHandle root;
+        ASSERT_EQ(vfs.get_root_fh("/", root), NfsStat3::NFS3_OK);
+
+        // Every call from loopback, none otherwise
+        RequestTracer tracer(trace_path, 0, "127.0.0.1");
+        ASSERT_TRUE(tracer.open());
+
+        RpcServer server;
+        server.set_request_tracer(&tracer);
+        RpcProgramHandlers handlers;
+        handlers.procedures[1] = [&](const RpcCallHeader&, XdrDecoder&, XdrEncoder& reply) {
+            Fattr3 attr;
+            vfs.getattr(root, attr);
+            reply.encode_uint32(0);
+        };
+        server.register_program(100099, 1, std::move(handlers));
+        server.start(0);
+
+        XdrEncoder args;
+        ASSERT_TRUE(call_and_wait_reply(server.port(), frame_call(9, 100099, 1, 1, args)));
+        server.stop();
+        tracer.flush();
+        // call, decode, handler, send, and the getattr
+        EXPECT_EQ(tracer.written(), 5u);
+        EXPECT_EQ(tracer.dropped(), 0u);
+    }
+
+    std::ifstream in(trace_path);
+    std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(json.compare(0, 2, "[\n"), 0);
+    EXPECT_EQ(json.compare(json.size() - 3, 3, "\n]\n"), 0);
+    EXPECT_NE(json.find("\"name\":\"thread_name\",\"ph\":\"M\""), std::string::npos);
+    EXPECT_NE(json.find("{\"name\":\"prog 100099 v1 proc 1\",\"cat\":\"rpc\",\"ph\":\"X\""),
+              std::string::npos) << json;
+    EXPECT_NE(json.find("{\"name\":\"getattr\",\"cat\":\"vfs\",\"ph\":\"X\""),
+              std::string::npos) << json;
+    EXPECT_NE(json.find("\"xid\":\"0x00000009\""), std::string::npos);
+
+    std::string cmd = "rm -rf " + tmpdir;
+    system(cmd.c_str());
+}
+
+// A cache that gives back whatever it is asked for, down to nothing
+struct FakeCache {
+    uint64_t held;
+    uint64_t usage() const { return held; }
+    uint64_t reclaim(uint64_t bytes) {
+        bytes = std::min(bytes, held);
+        held -= bytes;
+        return bytes;
+    }
+};
+
+TEST(MemoryGovernor, ParsesPsi) {
+    EXPECT_DOUBLE_EQ(MemoryGovernor::parse_psi_some_avg10(
+                         "some avg10=12.50 avg60=3.00 avg300=1.00 total=100\n"
+                         "full avg10=2.00 avg60=0.00 avg300=0.00 total=10\n"),
+                     12.5);
+    EXPECT_LT(MemoryGovernor::parse_psi_some_avg10(""), 0);
+    EXPECT_LT(MemoryGovernor::parse_psi_some_avg10("full avg10=2.00\n"), 0);
+}
+
+TEST(MemoryGovernor, ReclaimsOverShareByWeight) {
+    FakeCache a{500}, b{100};
+    uint64_t pinned = 100;
+    MemoryGovernor gov(500);
+    gov.add("pinned", 1, [&] { return pinned; });
+    gov.add("a", 3, [&] { return a.usage(); }, [&](uint64_t n) { return a.reclaim(n); });
+    gov.add("b", 1, [&] { return b.usage(); }, [&](uint64_t n) { return b.reclaim(n); });
+
+    // 400 left after the pinned 100, split 3:1; only a is over its share
+    gov.rebalance();
+    EXPECT_EQ(gov.share("a"), 300u);
+    EXPECT_EQ(gov.share("b"), 100u);
+    EXPECT_EQ(gov.share("pinned"), 100u);
+    EXPECT_EQ(a.held, 300u);
+    EXPECT_EQ(b.held, 100u);
+    EXPECT_EQ(gov.reclaimed("a"), 200u);
+    EXPECT_EQ(gov.reclaimed("b"), 0u);
+    EXPECT_EQ(gov.total(), 500u);
+
+    // Under budget: nothing more
+    gov.rebalance();
+    EXPECT_EQ(gov.reclaimed("a"), 200u);
+
+    // The pinned subsystem grows: everyone shrinks to fit
+    pinned = 300;
+    gov.rebalance();
+    EXPECT_EQ(a.held + b.held, 200u);
+    EXPECT_EQ(gov.usage("pinned"), 300u);
+
+    MetricsRegistry metrics;
+    gov.register_metrics(metrics);
+    EXPECT_EQ(metrics.value("nfsd_memory_bytes", {{"subsystem", "pinned"}}), 300);
+    EXPECT_EQ(metrics.value("nfsd_memory_reclaimed_bytes_total", {{"subsystem", "a"}}),
+              static_cast<double>(gov.reclaimed("a")));
+    EXPECT_EQ(metrics.value("nfsd_memory_reclaims_total", {{"reason", "budget"}}), 2);
+}
+
+TEST(MemoryGovernor, ShrinksProportionallyUnderPressure) {
+    char tmpl[] = "/tmp/nfs_psi_XXXXXX";
+    int fd = mkstemp(tmpl);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    auto write_psi = [&](const char* avg10) {
+        std::ofstream(tmpl) << "some avg10=" << avg10 << " avg60=0.00 avg300=0.00 total=1\n";
+    };
+
+    FakeCache a{300}, b{100};
+    MemoryGovernor gov;  // no budget
+    gov.add("a", 1, [&] { return a.usage(); }, [&](uint64_t n) { return a.reclaim(n); });
+    gov.add("b", 1, [&] { return b.usage(); }, [&](uint64_t n) { return b.reclaim(n); });
+    gov.set_pressure(tmpl, 10);
+
+    write_psi("2.00");
+    gov.rebalance();
+    EXPECT_EQ(a.held + b.held, 400u);
+
+    // 10% of usage back, in proportion to what each holds
+    write_psi("35.00");
+    gov.rebalance();
+    EXPECT_DOUBLE_EQ(gov.pressure(), 35);
+    EXPECT_EQ(a.held + b.held, 360u);
+    EXPECT_NEAR(static_cast<double>(gov.reclaimed("a")), 30, 1);
+    EXPECT_NEAR(static_cast<double>(gov.reclaimed("b")), 10, 1);
+
+    // The governor thread keeps at it while the pressure lasts
+    gov.start(5);
+    for (int i = 0; i < 400 && gov.total() > 100; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    gov.stop();
+    EXPECT_LE(a.held + b.held, 100u);
+    unlink(tmpl);
+}
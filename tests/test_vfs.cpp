@@ -1,4 +1,5 @@
 #include <gtest/gtest.h>
+#include "vfs/fault_vfs.h"
 #include "vfs/local_fs.h"
 #include "nfs/nfs_types.h"
 
@@ -6,6 +7,7 @@
 #include <cstring>
 #include <fstream>
 #include <sys/stat.h>
+#include <chrono>
 #include <unistd.h>
 
 class LocalFsTest : public ::testing::Test {
@@ -37,7 +39,7 @@ protected:
 TEST_F(LocalFsTest, GetRootFh) {
     FileHandle fh;
     EXPECT_EQ(fs_->get_root_fh("/", fh), NfsStat3::NFS3_OK);
-    EXPECT_GT(fh.len, 0u);
+    EXPECT_GT(fh.size(), 0u);
 }
 
 TEST_F(LocalFsTest, GetAttrRootDir) {
@@ -159,3 +161,219 @@ TEST_F(LocalFsTest, Readdir) {
     // Should have at least ".", "..", "file1.txt", "file2.txt"
     EXPECT_GE(entries.size(), 4u);
 }
+
+TEST_F(LocalFsTest, ReaddirCountsBufferRefillsNotEntries) {
+    FileHandle rfh = root_fh();
+    FileHandle fh;
+    Fattr3 attr;
+    for (int i = 0; i < 50; i++)
+        ASSERT_EQ(fs_->create(rfh, "f" + std::to_string(i), 0644, fh, attr), NfsStat3::NFS3_OK);
+
+    uint64_t before = fs_->syscalls(LocalFs::Syscall::READDIR);
+    std::vector<DirEntry> entries;
+    bool eof = false;
+    ASSERT_EQ(fs_->readdir(rfh, 0, 1000, entries, eof), NfsStat3::NFS3_OK);
+    EXPECT_TRUE(eof);
+    EXPECT_GE(entries.size(), 52u);
+    // One getdents64 fills the buffer, a second one reports the end
+    EXPECT_EQ(fs_->syscalls(LocalFs::Syscall::READDIR), before + 2);
+}
+
+TEST_F(LocalFsTest, CountsSyscallsAndCacheFootprint) {
+    FileHandle rfh = root_fh();
+    LocalFs::CacheFootprint before = fs_->cache_footprint();
+    uint64_t stats = fs_->syscalls(LocalFs::Syscall::STAT);
+    uint64_t unlinks = fs_->syscalls(LocalFs::Syscall::UNLINK);
+
+    FileHandle fh;
+    Fattr3 attr;
+    std::string long_name(100, 'x');
+    ASSERT_EQ(fs_->create(rfh, long_name, 0644, fh, attr), NfsStat3::NFS3_OK);
+    EXPECT_EQ(fs_->syscalls(LocalFs::Syscall::OPEN), 1u);
+    EXPECT_EQ(fs_->syscalls(LocalFs::Syscall::CLOSE), 1u);
+    EXPECT_EQ(fs_->lookup(rfh, "nonexistent", fh, attr), NfsStat3::NFS3ERR_NOENT);
+    EXPECT_EQ(fs_->syscalls(LocalFs::Syscall::STAT), stats + 2);  // fstat, lstat
+
+    LocalFs::CacheFootprint after = fs_->cache_footprint();
+    EXPECT_EQ(after.entries, before.entries + 1);
+    EXPECT_GT(after.bytes, before.bytes + long_name.size());
+    EXPECT_EQ(fs_->cache_bytes(), after.bytes);
+
+    ASSERT_EQ(fs_->remove(rfh, long_name), NfsStat3::NFS3_OK);
+    EXPECT_EQ(fs_->syscalls(LocalFs::Syscall::UNLINK), unlinks + 1);
+    EXPECT_EQ(fs_->cache_footprint().entries, before.entries);
+    EXPECT_EQ(fs_->cache_bytes(), before.bytes);
+    EXPECT_STREQ(LocalFs::syscall_name(LocalFs::Syscall::READDIR), "readdir");
+}
+
+TEST_F(LocalFsTest, TrimCacheDropsLeastResolvedHandles) {
+    FileHandle rfh = root_fh();
+    FileHandle hot, cold;
+    Fattr3 attr;
+    ASSERT_EQ(fs_->create(rfh, "hot", 0644, hot, attr), NfsStat3::NFS3_OK);
+    ASSERT_EQ(fs_->create(rfh, "cold", 0644, cold, attr), NfsStat3::NFS3_OK);
+    for (int i = 0; i < 5; i++) ASSERT_EQ(fs_->getattr(hot, attr), NfsStat3::NFS3_OK);
+    for (int i = 0; i < 10; i++) ASSERT_EQ(fs_->getattr(rfh, attr), NfsStat3::NFS3_OK);
+
+    // One entry's worth: the cold file goes, not the hot one or the root
+    uint64_t before = fs_->cache_bytes();
+    uint64_t freed = fs_->trim_cache(1);
+    EXPECT_GT(freed, 0u);
+    EXPECT_EQ(fs_->cache_bytes(), before - freed);
+    EXPECT_EQ(fs_->cache_evictions(), 1u);
+    EXPECT_EQ(fs_->getattr(cold, attr), NfsStat3::NFS3ERR_STALE);
+    EXPECT_EQ(fs_->getattr(hot, attr), NfsStat3::NFS3_OK);
+
+    // Everything but the export root
+    fs_->trim_cache(UINT64_MAX);
+    EXPECT_EQ(fs_->cache_footprint().entries, 1u);
+    EXPECT_EQ(fs_->getattr(rfh, attr), NfsStat3::NFS3_OK);
+    FileHandle again;
+    ASSERT_EQ(fs_->lookup(rfh, "cold", again, attr), NfsStat3::NFS3_OK);
+    EXPECT_EQ(fs_->getattr(cold, attr), NfsStat3::NFS3_OK);
+}
+
+TEST_F(LocalFsTest, WarmRestartSnapshot) {
+    FileHandle rfh = root_fh();
+    FileHandle dfh, ffh, gfh, gone_fh;
+    Fattr3 attr;
+    ASSERT_EQ(fs_->mkdir(rfh, "d", 0755, dfh, attr), NfsStat3::NFS3_OK);
+    ASSERT_EQ(fs_->create(dfh, "f", 0644, ffh, attr), NfsStat3::NFS3_OK);
+    ASSERT_EQ(fs_->create(rfh, "g", 0644, gfh, attr), NfsStat3::NFS3_OK);
+    ASSERT_EQ(fs_->create(rfh, "gone", 0644, gone_fh, attr), NfsStat3::NFS3_OK);
+    for (int i = 0; i < 5; i++) ASSERT_EQ(fs_->getattr(ffh, attr), NfsStat3::NFS3_OK);
+
+    std::string snap = tmpdir_ + "/.warm";
+    std::string hot = tmpdir_ + "/.hot";
+    std::string err;
+    ASSERT_TRUE(fs_->save_snapshot(snap, 100, err)) << err;
+    ASSERT_TRUE(fs_->save_snapshot(hot, 1, err)) << err;
+    fs_.reset();
+
+    // Changed while the server was down: gone removed, g now another file
+    unlink((tmpdir_ + "/gone").c_str());
+    rename((tmpdir_ + "/g").c_str(), (tmpdir_ + "/g2").c_str());
+    std::ofstream(tmpdir_ + "/g") << "new";
+
+    // Without warm-up threads, old handles are checked when first used
+    fs_ = std::make_unique<LocalFs>(tmpdir_);
+    ASSERT_TRUE(fs_->load_snapshot(snap, 0, err)) << err;
+    EXPECT_EQ(fs_->warm_entries(), 5u);
+    EXPECT_EQ(fs_->warm_pending(), 5u);
+    EXPECT_EQ(fs_->getattr(ffh, attr), NfsStat3::NFS3_OK);
+    EXPECT_EQ(fs_->getattr(gone_fh, attr), NfsStat3::NFS3ERR_STALE);
+    EXPECT_EQ(fs_->getattr(gfh, attr), NfsStat3::NFS3ERR_STALE);
+    EXPECT_EQ(fs_->warm_loaded(), 1u);
+    EXPECT_EQ(fs_->warm_stale(), 2u);
+    EXPECT_EQ(fs_->warm_pending(), 2u);
+
+    // In the background, directories read ahead
+    fs_ = std::make_unique<LocalFs>(tmpdir_);
+    ASSERT_TRUE(fs_->load_snapshot(snap, 4, err)) << err;
+    fs_->wait_warm();
+    EXPECT_EQ(fs_->warm_pending(), 0u);
+    EXPECT_EQ(fs_->warm_loaded(), 3u);  // root, d, d/f
+    EXPECT_EQ(fs_->warm_stale(), 2u);
+    EXPECT_EQ(fs_->warm_prefetched(), 2u);
+    EXPECT_GE(fs_->syscalls(LocalFs::Syscall::OPENDIR), 2u);
+    EXPECT_EQ(fs_->getattr(dfh, attr), NfsStat3::NFS3_OK);
+    EXPECT_EQ(fs_->getattr(ffh, attr), NfsStat3::NFS3_OK);
+    EXPECT_EQ(fs_->syscalls(LocalFs::Syscall::STAT), 5u + 2u);
+
+    // A capped snapshot keeps the most resolved entries
+    fs_ = std::make_unique<LocalFs>(tmpdir_);
+    ASSERT_TRUE(fs_->load_snapshot(hot, 0, err)) << err;
+    EXPECT_EQ(fs_->warm_pending(), 1u);
+    EXPECT_EQ(fs_->getattr(ffh, attr), NfsStat3::NFS3_OK);
+    EXPECT_EQ(fs_->getattr(dfh, attr), NfsStat3::NFS3ERR_STALE);
+
+    std::ofstream(tmpdir_ + "/junk") << "not a snapshot at all";
+    EXPECT_FALSE(fs_->load_snapshot(tmpdir_ + "/junk", 0, err));
+    EXPECT_FALSE(fs_->load_snapshot(tmpdir_ + "/missing", 0, err));
+}
+
+TEST(FaultRuleTest, ParsesSpecs) {
+    FaultRule rule;
+    std::string err;
+    ASSERT_TRUE(FaultRule::parse("op=read+write,prefix=/db/,latency=uniform:1ms:3ms,"
+                                 "stall=0.01:500ms,error=0.5:NOSPC,bw=10M", rule, err)) << err;
+    EXPECT_EQ(rule.ops, (1u << static_cast<int>(VfsOp::READ)) |
+                        (1u << static_cast<int>(VfsOp::WRITE)));
+    EXPECT_EQ(rule.prefix, "/db");
+    EXPECT_EQ(rule.latency.kind, FaultLatency::Kind::UNIFORM);
+    EXPECT_EQ(rule.latency.a_ns, 1000000u);
+    EXPECT_EQ(rule.latency.b_ns, 3000000u);
+    EXPECT_EQ(rule.stall_ns, 500000000u);
+    EXPECT_DOUBLE_EQ(rule.error_prob, 0.5);
+    EXPECT_EQ(rule.error, NfsStat3::NFS3ERR_NOSPC);
+    EXPECT_EQ(rule.bytes_per_sec, 10u << 20);
+
+    ASSERT_TRUE(FaultRule::parse("fh=0a0b,latency=lognormal:2ms:0.5,error=1:10008", rule, err));
+    EXPECT_EQ(rule.ops, ~0u);
+    EXPECT_EQ(rule.fh.size(), 2u);
+    EXPECT_EQ(rule.fh.data()[1], 0x0b);
+    EXPECT_EQ(static_cast<uint32_t>(rule.error), 10008u);
+
+    EXPECT_FALSE(FaultRule::parse("op=fsync", rule, err));
+    EXPECT_FALSE(FaultRule::parse("latency=5", rule, err));
+    EXPECT_FALSE(FaultRule::parse("error=2", rule, err));
+    EXPECT_FALSE(FaultRule::parse("prefix=db", rule, err));
+    EXPECT_FALSE(FaultRule::parse("speed=1", rule, err));
+}
+
+TEST_F(LocalFsTest, FaultVfsFailsMatchingCalls) {
+    FaultVfs faults(*fs_);
+    FaultRule rule;
+    std::string err;
+    ASSERT_TRUE(FaultRule::parse("op=read,prefix=/slow,error=1:NOSPC", rule, err));
+    faults.add_rule(rule);
+    faults.set_path_resolver([this](const FileHandle& fh) {
+        return fs_->path_of(fh).substr(tmpdir_.size());
+    });
+
+    FileHandle rfh = root_fh(), dir, slow, fast;
+    Fattr3 attr;
+    ASSERT_EQ(faults.mkdir(rfh, "slow", 0755, dir, attr), NfsStat3::NFS3_OK);
+    ASSERT_EQ(faults.create(dir, "f", 0644, slow, attr), NfsStat3::NFS3_OK);
+    ASSERT_EQ(faults.create(rfh, "slower", 0644, fast, attr), NfsStat3::NFS3_OK);
+
+    std::vector<uint8_t> data;
+    bool eof = false;
+    EXPECT_EQ(faults.read(slow, 0, 16, data, eof), NfsStat3::NFS3ERR_NOSPC);
+    EXPECT_EQ(faults.read(fast, 0, 16, data, eof), NfsStat3::NFS3_OK);
+    EXPECT_EQ(faults.getattr(slow, attr), NfsStat3::NFS3_OK);
+    EXPECT_EQ(faults.errors(VfsOp::READ), 1u);
+    EXPECT_EQ(faults.errors(VfsOp::GETATTR), 0u);
+}
+
+TEST_F(LocalFsTest, FaultVfsDelaysAndCapsBandwidth) {
+    FaultVfs faults(*fs_);
+    FaultRule rule;
+    std::string err;
+    ASSERT_TRUE(FaultRule::parse("op=getattr,latency=20ms", rule, err));
+    faults.add_rule(rule);
+    ASSERT_TRUE(FaultRule::parse("op=write,bw=4M", rule, err));
+    faults.add_rule(rule);
+
+    FileHandle rfh = root_fh(), fh;
+    Fattr3 attr;
+    ASSERT_EQ(faults.create(rfh, "f", 0644, fh, attr), NfsStat3::NFS3_OK);
+    EXPECT_EQ(faults.delayed(VfsOp::CREATE), 0u);
+
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_EQ(faults.getattr(fh, attr), NfsStat3::NFS3_OK);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+    EXPECT_EQ(faults.delayed(VfsOp::GETATTR), 1u);
+    EXPECT_EQ(faults.delay_ns(VfsOp::GETATTR), 20000000u);
+
+    // 1 MiB through a 4 MiB/s cap takes a quarter of a second
+    std::vector<uint8_t> block(256 * 1024, 1);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 4; i++) {
+        uint32_t written = 0;
+        ASSERT_EQ(faults.write(fh, i * block.size(), block.data(), block.size(), written),
+                  NfsStat3::NFS3_OK);
+    }
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(240));
+    EXPECT_EQ(faults.delayed(VfsOp::WRITE), 4u);
+}